@@ -0,0 +1,90 @@
+//
+//  AnalysisBacklog.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "AnalysisBacklog.h"
+
+AnalysisBacklog::AnalysisBacklog(OverlapFramer *framer, float samplingRate, int64_t maxBacklog,
+                                 AnalysisBacklogPolicy policy, int whichConsumer) :
+mFramer(framer),
+mWhichConsumer(whichConsumer),
+mSamplingRate(samplingRate),
+mMaxBacklog(maxBacklog > 0 ? maxBacklog : 1),
+mPolicy(policy)
+{
+    Clear();
+}
+
+bool AnalysisBacklog::NextFrame(FrameView *view, bool allowSkipping)
+{
+    int64_t depth = mFramer->NumFramesAvailable(mWhichConsumer);
+    if (depth <= 0)
+        return false;
+
+    mQueueDepth.store(depth, std::memory_order_relaxed);
+    if (depth > mMaxQueueDepth.load(std::memory_order_relaxed))
+        mMaxQueueDepth.store(depth, std::memory_order_relaxed);
+
+    int64_t numToSkip = 0;
+    if (allowSkipping && depth > mMaxBacklog) {
+        switch (mPolicy.load(std::memory_order_relaxed)) {
+            case AnalysisBacklogCoalesce:
+                numToSkip = depth - 1;
+                break;
+            case AnalysisBacklogDegradeHop:
+                numToSkip = (depth - 1)/mMaxBacklog; // analyze one window in every numToSkip+1
+                if (depth - numToSkip > kMaxDegradedBacklogFactor*mMaxBacklog)
+                    numToSkip = depth - kMaxDegradedBacklogFactor*mMaxBacklog;
+                break;
+            default:
+                numToSkip = depth - mMaxBacklog;
+                break;
+        }
+    }
+    if (numToSkip > 0)
+        mNumFramesSkipped.fetch_add(mFramer->SkipFrames(numToSkip, mWhichConsumer), std::memory_order_relaxed);
+
+    if (!mFramer->PeekFrame(view, mWhichConsumer))
+        return false;
+    mCurrentFrameEnd = view->firstSampleIndex + view->Length();
+    return true;
+}
+
+void AnalysisBacklog::ReleaseFrame()
+{
+    mFramer->ReleaseFrame(mWhichConsumer);
+    mNumFramesAnalyzed.fetch_add(1, std::memory_order_relaxed);
+
+    int64_t lag = mFramer->NumSamplesWritten() - mCurrentFrameEnd;
+    mLagInSamples.store(lag, std::memory_order_relaxed);
+    if (lag > mMaxLagInSamples.load(std::memory_order_relaxed))
+        mMaxLagInSamples.store(lag, std::memory_order_relaxed);
+}
+
+AnalysisLoadStats AnalysisBacklog::Stats()
+{
+    AnalysisLoadStats stats;
+    stats.numFramesAnalyzed = mNumFramesAnalyzed.load(std::memory_order_relaxed);
+    stats.numFramesSkipped = mNumFramesSkipped.load(std::memory_order_relaxed);
+    stats.numDroppedSamples = mFramer->NumDroppedSamples();
+    stats.queueDepth = mQueueDepth.load(std::memory_order_relaxed);
+    stats.maxQueueDepth = mMaxQueueDepth.load(std::memory_order_relaxed);
+    stats.lagInSeconds = (double)mLagInSamples.load(std::memory_order_relaxed)/mSamplingRate;
+    stats.maxLagInSeconds = (double)mMaxLagInSamples.load(std::memory_order_relaxed)/mSamplingRate;
+    return stats;
+}
+
+void AnalysisBacklog::Clear()
+{
+    mCurrentFrameEnd = 0;
+    mNumFramesAnalyzed.store(0);
+    mNumFramesSkipped.store(0);
+    mQueueDepth.store(0);
+    mMaxQueueDepth.store(0);
+    mLagInSamples.store(0);
+    mMaxLagInSamples.store(0);
+}
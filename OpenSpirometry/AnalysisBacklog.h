@@ -0,0 +1,80 @@
+//
+//  AnalysisBacklog.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Consumer side of the OverlapFramer for the one analysis worker (the serial analysis queue in
+//  SpirometerEffortAnalyzer). Windows are handed out strictly in stream order. When analysis
+//  falls behind the audio, the policy decides which windows are skipped so the backlog (and
+//  with it the delay of the flow updates) stays bounded and the audio callback never has to
+//  drop new samples:
+//
+//    AnalysisBacklogDropOldest  more than maxBacklog windows waiting: skip the oldest down to maxBacklog
+//    AnalysisBacklogCoalesce    more than maxBacklog windows waiting: skip all but the newest one
+//    AnalysisBacklogDegradeHop  more than maxBacklog windows waiting: analyze only every k-th window,
+//                               k = 1 + (waiting-1)/maxBacklog, so updates stay evenly spaced in time;
+//                               past kMaxDegradedBacklogFactor*maxBacklog the oldest are dropped as well
+//
+//  Queue depth and lag (how much audio has arrived past the end of the window being analyzed)
+//  are kept as atomics so any thread can read them while the worker runs.
+
+#ifndef OpenSpirometry_AnalysisBacklog_h
+#define OpenSpirometry_AnalysisBacklog_h
+
+#include <stdint.h>
+#include <atomic>
+#include "OverlapFramer.h"
+#include "SpirometerConstants.h" // AnalysisBacklogPolicy
+
+#define kMaxDegradedBacklogFactor 4 // degrade hop never lets the backlog grow past this many times maxBacklog
+
+struct AnalysisLoadStats {
+    int64_t numFramesAnalyzed;
+    int64_t numFramesSkipped;       // by the policy
+    int64_t numDroppedSamples;      // by the framer, only when the ring itself is full
+    int64_t queueDepth;             // windows waiting (including the one being analyzed)
+    int64_t maxQueueDepth;
+    double lagInSeconds;            // audio received after the end of the last analyzed window
+    double maxLagInSeconds;
+};
+
+class AnalysisBacklog {
+
+public:
+    AnalysisBacklog(OverlapFramer *framer, float samplingRate, int64_t maxBacklog,
+                    AnalysisBacklogPolicy policy = AnalysisBacklogDropOldest, int whichConsumer = 0);
+
+    // worker thread: next window to analyze after applying the policy, false if none is ready
+    // (pass false once the audio has stopped, the backlog can only shrink then and nothing is skipped)
+    bool NextFrame(FrameView *view, bool allowSkipping = true);
+    // worker thread: done with the window from NextFrame, updates the lag
+    void ReleaseFrame();
+
+    // any thread
+    AnalysisLoadStats Stats();
+    void SetPolicy(AnalysisBacklogPolicy policy) { mPolicy.store(policy, std::memory_order_relaxed); }
+    AnalysisBacklogPolicy Policy() { return mPolicy.load(std::memory_order_relaxed); }
+    int64_t MaxBacklog() { return mMaxBacklog; }
+
+    // call only when the worker is not running (between efforts), along with OverlapFramer Clear
+    void Clear();
+
+protected:
+    OverlapFramer *mFramer;
+    int mWhichConsumer;
+    float mSamplingRate;
+    int64_t mMaxBacklog;
+    std::atomic<AnalysisBacklogPolicy> mPolicy;
+    int64_t mCurrentFrameEnd;   // stream position just past the window handed out
+
+    std::atomic<int64_t> mNumFramesAnalyzed;
+    std::atomic<int64_t> mNumFramesSkipped;
+    std::atomic<int64_t> mQueueDepth;
+    std::atomic<int64_t> mMaxQueueDepth;
+    std::atomic<int64_t> mLagInSamples;
+    std::atomic<int64_t> mMaxLagInSamples;
+};
+
+#endif
@@ -0,0 +1,195 @@
+//
+//  ArtifactDetector.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "ArtifactDetector.h"
+#include <math.h>
+
+static const float kTinyPower = 1e-20f; // digital silence still has a log
+
+const char *FrameClassName(FrameClass frameClass)
+{
+    switch (frameClass) {
+        case FrameClassWhistle: return "whistle";
+        case FrameClassCough: return "cough";
+        case FrameClassVoice: return "voice";
+        case FrameClassNoise: return "noise";
+        default: return "unknown";
+    }
+}
+
+ArtifactDetector::ArtifactDetector(float samplingRate, float minFrequency, float maxFrequency, double hopInSeconds,
+                                   int64_t windowLength) :
+mSamplingRate(samplingRate),
+mWindowLength(windowLength),
+mFFT(windowLength, FFTWindowHann),
+mWindow((size_t)windowLength)
+{
+    float resolution = samplingRate/(float)windowLength;
+    mNumBins = windowLength/2;
+    mFirstBin = (int64_t)floorf(minFrequency/resolution);
+    mFirstBin = mFirstBin < 1 ? 1 : mFirstBin;
+    mLastBin = (int64_t)ceilf(maxFrequency/resolution);
+    mLastBin = mLastBin > mNumBins - 1 ? mNumBins - 1 : mLastBin;
+    mLastBin = mLastBin < mFirstBin + 2 ? mFirstBin + 2 : mLastBin; // a crest needs a few bins besides the peak
+    mHighBin = (int64_t)ceilf(kArtifactHighBandHz/resolution);
+    mHighBin = mHighBin <= mLastBin ? mLastBin + 1 : mHighBin;
+    mHighBin = mHighBin > mNumBins ? mNumBins : mHighBin;
+    mFloorRise = powf(10.0f, 0.1f*kArtifactFloorRiseDBPerSecond*(float)hopInSeconds);
+    Clear();
+}
+
+void ArtifactDetector::Clear()
+{
+    mFeatures = FrameFeatures();
+    mLastClass = FrameClassNoise;
+    mBandFloor = -1.0f;
+    mHighBandFloor = -1.0f;
+    for (int c = 0; c < kNumFrameClasses; c++)
+        mNumFrames[c] = 0;
+    mRunClass = FrameClassNoise;
+    mRunStart = mRunEnd = 0;
+    mNumArtifacts = 0;
+}
+
+// power of bins first...last-1
+static inline float SumPower(const float *real, const float *imag, int64_t first, int64_t last)
+{
+    float power = 0;
+    for (int64_t k = first; k < last; k++)
+        power += real[k]*real[k] + imag[k]*imag[k];
+    return power;
+}
+
+// and the sum of their logs, for the flatness
+static inline float SumPowerAndLogs(const float *real, const float *imag, int64_t first, int64_t last, float *sumOfLogs)
+{
+    float power = 0, logs = 0;
+    for (int64_t k = first; k < last; k++) {
+        float p = real[k]*real[k] + imag[k]*imag[k] + kTinyPower;
+        power += p;
+        logs += logf(p);
+    }
+    *sumOfLogs = logs;
+    return power;
+}
+
+static inline float Flatness(float sum, float sumOfLogs, int64_t numBins)
+{
+    return numBins > 0 && sum > 0 ? expf(sumOfLogs/numBins)/(sum/numBins) : 1.0f;
+}
+
+void ArtifactDetector::ComputeFeatures(const FrameView &frame)
+{
+    int64_t length = mWindowLength < frame.Length() ? mWindowLength : frame.Length();
+    frame.CopyRangeToBuffer(&mWindow[0], frame.Length() - length, length);
+    for (int64_t i = length; i < mWindowLength; i++)
+        mWindow[i] = 0;
+
+    // zero crossings of the samples on their way to the transform
+    int64_t numCrossings = 0;
+    for (int64_t i = 1; i < length; i++)
+        numCrossings += (mWindow[i-1] < 0) != (mWindow[i] < 0);
+    mFFT.PerformForwardFFT(&mWindow[0]);
+
+    // one pass over the power spectrum below Nyquist, band by band so each loop is branch free
+    const float *real = mFFT.Real(), *imag = mFFT.Imag();
+    float bandLogs, highLogs;
+    float band = SumPowerAndLogs(real, imag, mFirstBin, mLastBin + 1, &bandLogs);
+    float high = SumPowerAndLogs(real, imag, mHighBin, mNumBins, &highLogs);
+    float total = band + high + SumPower(real, imag, 1, mFirstBin) + SumPower(real, imag, mLastBin + 1, mHighBin) + kTinyPower;
+
+    int64_t peakBin = mFirstBin;
+    float peak = 0;
+    for (int64_t k = mFirstBin; k <= mLastBin; k++) {
+        float p = real[k]*real[k] + imag[k]*imag[k];
+        if (p > peak) {
+            peak = p;
+            peakBin = k;
+        }
+    }
+    float peakPower = 0;
+    for (int64_t k = peakBin - 1; k <= peakBin + 1; k++)
+        if (k >= mFirstBin && k <= mLastBin)
+            peakPower += real[k]*real[k] + imag[k]*imag[k] + kTinyPower;
+
+    FrameFeatures &f = mFeatures;
+    f.bandFlatness = Flatness(band, bandLogs, mLastBin - mFirstBin + 1);
+    f.highBandFlatness = Flatness(high, highLogs, mNumBins - mHighBin);
+    f.bandFraction = band/total;
+    f.highBandFraction = high/total;
+    f.crestInDecibels = 10.0f*log10f(peakPower/(fmaxf(band - peakPower, 0.0f) + kTinyPower));
+    f.bandRiseInDecibels = Rise(band, &mBandFloor);
+    f.highBandRiseInDecibels = mHighBin < mNumBins ? Rise(high, &mHighBandFloor) : 0;
+    f.zeroCrossingRate = length > 1 ? numCrossings/(float)(length - 1) : 0;
+    f.hasTone = f.crestInDecibels >= kArtifactMinToneDB;
+}
+
+// dB over the background, which follows the power down at once and up only slowly
+float ArtifactDetector::Rise(float power, float *floor)
+{
+    *floor = *floor < 0 || power < *floor*mFloorRise ? power : *floor*mFloorRise;
+    return 10.0f*log10f((power + kTinyPower)/(*floor + kTinyPower));
+}
+
+FrameClass ArtifactDetector::Classify(const FrameView &frame)
+{
+    ComputeFeatures(frame);
+    const FrameFeatures &f = mFeatures;
+    FrameClass frameClass = FrameClassNoise;
+    if (f.highBandRiseInDecibels >= kArtifactCoughRiseDB && f.highBandFraction >= kArtifactCoughMinHighBandFraction &&
+        f.highBandFlatness >= kArtifactCoughMinFlatness)
+        frameClass = FrameClassCough;
+    else if (f.hasTone)
+        frameClass = FrameClassWhistle;
+    else if (f.bandRiseInDecibels >= kArtifactVoiceRiseDB && f.bandFlatness <= kArtifactVoiceMaxFlatness &&
+             f.zeroCrossingRate <= kArtifactVoiceMaxZeroCrossingRate)
+        frameClass = FrameClassVoice;
+
+    mLastClass = frameClass;
+    mNumFrames[frameClass]++;
+    int64_t length = mWindowLength < frame.Length() ? mWindowLength : frame.Length();
+    UpdateRun(frameClass, (frame.firstSampleIndex + frame.Length() - length/2)/(double)mSamplingRate);
+    return frameClass;
+}
+
+void ArtifactDetector::UpdateRun(FrameClass frameClass, double time)
+{
+    bool isArtifact = frameClass == FrameClassCough || frameClass == FrameClassVoice;
+    if (mRunClass != FrameClassNoise && (time - mRunEnd > kArtifactMaxGapSeconds || (isArtifact && frameClass != mRunClass)))
+        CloseRun();
+    if (!isArtifact)
+        return;
+    if (mRunClass == FrameClassNoise) {
+        mRunClass = frameClass;
+        mRunStart = time;
+    }
+    mRunEnd = time;
+}
+
+void ArtifactDetector::CloseRun()
+{
+    double duration = mRunEnd - mRunStart;
+    bool keep = mRunClass == FrameClassCough ? duration >= kArtifactMinCoughSeconds && duration <= kArtifactMaxCoughSeconds
+                                             : duration >= kArtifactMinVoiceSeconds;
+    if (keep) {
+        if (mNumArtifacts < kMaxNumArtifacts) {
+            ArtifactInterval &artifact = mArtifacts[mNumArtifacts];
+            artifact.kind = mRunClass;
+            artifact.startTime = mRunStart;
+            artifact.endTime = mRunEnd;
+        }
+        mNumArtifacts++;
+    }
+    mRunClass = FrameClassNoise;
+}
+
+void ArtifactDetector::Finish()
+{
+    if (mRunClass != FrameClassNoise)
+        CloseRun();
+}
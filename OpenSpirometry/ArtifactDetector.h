@@ -0,0 +1,124 @@
+//
+//  ArtifactDetector.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Says what each analysis window holds before its peaks are searched for: a clean whistle, a
+//  cough, voice or just noise. The newest ARTIFACT_WINDOW_SIZE samples are transformed (about 23 ms
+//  at 44.1 kHz, like ChannelSelector's score) and one pass over the power spectrum gives the
+//  features: spectral flatness of the whistle band and of the band above kArtifactHighBandHz, the
+//  share of the power in each, and the whistle band's crest (its peak bin and the bins either side
+//  over the rest of the band). The zero crossing rate comes from the samples on the way in.
+//
+//  A frame with a crest of kArtifactMinToneDB has a tone in the whistle band, and only those are
+//  worth a peak search. A cough is a broadband burst: the band above the whistle's harmonics jumps
+//  kArtifactCoughRiseDB over its background (a minimum that rises slowly) and is flat there, with or
+//  without the whistle under it. Voice has no single tone in the band but is structured (harmonics
+//  of the speaking pitch), louder than the background and slow to cross zero. Everything else is
+//  noise. Runs of cough or voice frames (with gaps up to kArtifactMaxGapSeconds) are kept as
+//  artifacts with their start and end, coughs only if they last as long as a cough does.
+
+#ifndef OpenSpirometry_ArtifactDetector_h
+#define OpenSpirometry_ArtifactDetector_h
+
+#include <stdint.h>
+#include <vector>
+#include "SpirometerConstants.h"
+#include "OverlapFramer.h"
+#include "RealFFT.h"
+
+#define kArtifactHighBandHz 4000.0f             // above the whistle's strongest harmonics
+#define kArtifactMinToneDB 6.0f                 // crest of a whistle band that holds a tone
+#define kArtifactCoughRiseDB 12.0f              // high band over its background for a cough
+#define kArtifactCoughMinHighBandFraction 0.1f  // and that much of all the power
+#define kArtifactCoughMinFlatness 0.3f          // and noise like up there
+#define kArtifactVoiceRiseDB 10.0f              // whistle band over its background for voice
+#define kArtifactVoiceMaxFlatness 0.3f          // harmonics, not noise
+#define kArtifactVoiceMaxZeroCrossingRate 0.1f  // per sample
+#define kArtifactFloorRiseDBPerSecond 3.0f      // how fast the backgrounds follow a louder room
+#define kArtifactMaxGapSeconds 0.05             // frames of something else inside one artifact
+#define kArtifactMinCoughSeconds 0.02
+#define kArtifactMaxCoughSeconds 0.6            // longer bursts are breath or handling, not a cough
+#define kArtifactMinVoiceSeconds 0.15
+#define kMaxNumArtifacts 16                     // kept per stream, later ones are only counted
+
+enum FrameClass {
+    FrameClassWhistle,
+    FrameClassCough,
+    FrameClassVoice,
+    FrameClassNoise,
+    kNumFrameClasses
+};
+
+const char *FrameClassName(FrameClass frameClass);
+
+struct FrameFeatures {
+    float bandFlatness;             // geometric over arithmetic mean power, 0 for a tone, about 0.56 for white noise
+    float highBandFlatness;
+    float bandFraction;             // of the power of the whole spectrum
+    float highBandFraction;
+    float crestInDecibels;          // whistle band peak (with its neighbours) over the rest of the band
+    float bandRiseInDecibels;       // over the background
+    float highBandRiseInDecibels;
+    float zeroCrossingRate;         // sign changes per sample
+    bool hasTone;                   // crest of a whistle, whatever else the frame holds
+};
+
+struct ArtifactInterval {
+    FrameClass kind;                // cough or voice
+    double startTime;               // seconds into the stream, centers of the first and last frame's samples
+    double endTime;
+};
+
+class ArtifactDetector {
+
+public:
+    // band is the whistle's, hop is the time between frames
+    ArtifactDetector(float samplingRate, float minFrequency, float maxFrequency, double hopInSeconds,
+                     int64_t windowLength = ARTIFACT_WINDOW_SIZE);
+
+    // the newest samples of the window, frames in stream order
+    FrameClass Classify(const FrameView &frame);
+    // closes an artifact still going when the stream ends
+    void Finish();
+    void Clear();
+
+    const FrameFeatures &Features() { return mFeatures; } // of the newest frame
+    FrameClass LastClass() { return mLastClass; }
+    int64_t NumFrames(FrameClass frameClass) { return mNumFrames[frameClass]; }
+    int64_t NumArtifacts() { return mNumArtifacts < kMaxNumArtifacts ? mNumArtifacts : kMaxNumArtifacts; }
+    int64_t NumDroppedArtifacts() { return mNumArtifacts - NumArtifacts(); }
+    const ArtifactInterval &Artifact(int64_t which) { return mArtifacts[which]; }
+
+protected:
+    void ComputeFeatures(const FrameView &frame);
+    float Rise(float power, float *floor);
+    void UpdateRun(FrameClass frameClass, double time);
+    void CloseRun();
+
+    float mSamplingRate;
+    int64_t mWindowLength;
+    int64_t mFirstBin;              // whistle band
+    int64_t mLastBin;
+    int64_t mHighBin;               // first bin of the high band, mNumBins if there is none
+    int64_t mNumBins;               // below Nyquist
+    float mFloorRise;               // per frame, as a power ratio
+    RealFFT mFFT;
+    std::vector<float> mWindow;
+
+    FrameFeatures mFeatures;
+    FrameClass mLastClass;
+    float mBandFloor;               // backgrounds, negative before the first frame
+    float mHighBandFloor;
+    int64_t mNumFrames[kNumFrameClasses];
+
+    FrameClass mRunClass;           // cough or voice while a run is open, noise when none is
+    double mRunStart;
+    double mRunEnd;
+    ArtifactInterval mArtifacts[kMaxNumArtifacts];
+    int64_t mNumArtifacts;
+};
+
+#endif
@@ -0,0 +1,82 @@
+//
+//  ChannelSelector.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "ChannelSelector.h"
+#include <math.h>
+#include <algorithm>
+
+ChannelSelector::ChannelSelector(float samplingRate, float minFrequency, float maxFrequency, int64_t scoreLength) :
+mScoreLength(scoreLength),
+mFFT(scoreLength, FFTWindowHann),
+mWindow((size_t)scoreLength)
+{
+    float resolution = samplingRate/(float)scoreLength;
+    mFirstBin = (int64_t)floorf(minFrequency/resolution);
+    mFirstBin = mFirstBin < 1 ? 1 : mFirstBin;
+    mLastBin = (int64_t)ceilf(maxFrequency/resolution);
+    mLastBin = mLastBin > scoreLength/2 ? scoreLength/2 : mLastBin;
+    mLastBin = mLastBin < mFirstBin + 2 ? mFirstBin + 2 : mLastBin; // a median needs a few bins
+    mPower.resize((size_t)(mLastBin - mFirstBin + 1));
+    Clear();
+}
+
+void ChannelSelector::Clear()
+{
+    for (int c = 0; c < kMaxNumFramerChannels; c++)
+        mScore[c] = 0;
+    mHasScores = false;
+    mSelected = 0;
+    mNumSwitches = 0;
+}
+
+float ChannelSelector::ScoreChannel(const FrameView &frame)
+{
+    int64_t length = mScoreLength < frame.Length() ? mScoreLength : frame.Length();
+    frame.CopyRangeToBuffer(&mWindow[0], frame.Length() - length, length);
+    for (int64_t i = length; i < mScoreLength; i++)
+        mWindow[i] = 0;
+    mFFT.PerformForwardFFT(&mWindow[0]);
+
+    const float *real = mFFT.Real(), *imag = mFFT.Imag();
+    float peak = 0;
+    for (int64_t k = mFirstBin; k <= mLastBin; k++) {
+        float power = real[k]*real[k] + imag[k]*imag[k];
+        mPower[k - mFirstBin] = power;
+        if (power > peak)
+            peak = power;
+    }
+    std::vector<float>::iterator median = mPower.begin() + mPower.size()/2;
+    std::nth_element(mPower.begin(), median, mPower.end());
+    return 10.0f*log10f((peak + 1e-20f)/(*median + 1e-20f));
+}
+
+int ChannelSelector::Select(const FrameView *frames, int numChannels)
+{
+    if (numChannels > kMaxNumFramerChannels)
+        numChannels = kMaxNumFramerChannels;
+    if (numChannels <= 1)
+        return 0;
+
+    int best = 0;
+    for (int c = 0; c < numChannels; c++) {
+        float score = ScoreChannel(frames[c]);
+        mScore[c] = mHasScores ? mScore[c] + kChannelScoreSmoothing*(score - mScore[c]) : score;
+        if (mScore[c] > mScore[best])
+            best = c;
+    }
+    mHasScores = true;
+
+    if (mSelected >= numChannels)
+        mSelected = 0;
+    if (best != mSelected && mScore[best] >= CHANNEL_MIN_SCORE_DB &&
+        mScore[best] > mScore[mSelected] + CHANNEL_SWITCH_MARGIN_DB) {
+        mSelected = best;
+        mNumSwitches++;
+    }
+    return mSelected;
+}
@@ -0,0 +1,60 @@
+//
+//  ChannelSelector.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Picks which microphone's audio is analyzed when there is more than one (a headset and the
+//  phone, or a device with several mics), so the whistle is followed on the one it is clearest
+//  on without analyzing every channel. Each window, every channel gets a cheap score: the
+//  newest CHANNEL_SCORE_WINDOW_SIZE samples are transformed (about 23 ms at 44.1 kHz) and the
+//  loudest bin in the whistle band is compared with the band's median bin, which is the noise
+//  floor next to the whistle (in dB). Scores are smoothed over windows. The selection moves to
+//  another channel only when its score is CHANNEL_SWITCH_MARGIN_DB above the current one's and
+//  at least CHANNEL_MIN_SCORE_DB, so it does not flip back and forth in silence or between two
+//  equally good mics. Whoever analyzes has to start its running spectrum over on a switch.
+//
+//  Channels are not combined: the mics are not phase aligned, and adding them can cancel the
+//  whistle as easily as reinforce it.
+
+#ifndef OpenSpirometry_ChannelSelector_h
+#define OpenSpirometry_ChannelSelector_h
+
+#include <stdint.h>
+#include <vector>
+#include "SpirometerConstants.h"
+#include "OverlapFramer.h"
+#include "RealFFT.h"
+
+#define kChannelScoreSmoothing 0.3f // weight of the newest window's score
+
+class ChannelSelector {
+
+public:
+    ChannelSelector(float samplingRate, float minFrequency, float maxFrequency, int64_t scoreLength = CHANNEL_SCORE_WINDOW_SIZE);
+
+    // the same window of each channel, returns the channel to analyze
+    int Select(const FrameView *frames, int numChannels);
+    void Clear();
+
+    int SelectedChannel() { return mSelected; }
+    float Score(int whichChannel) { return mScore[whichChannel]; } // smoothed, dB of the band peak over the band median
+    int64_t NumSwitches() { return mNumSwitches; }
+
+protected:
+    float ScoreChannel(const FrameView &frame);
+
+    int64_t mScoreLength;
+    int64_t mFirstBin;
+    int64_t mLastBin;
+    RealFFT mFFT;
+    std::vector<float> mWindow;
+    std::vector<float> mPower;      // band bins of the channel being scored
+    float mScore[kMaxNumFramerChannels];
+    bool mHasScores;
+    int mSelected;
+    int64_t mNumSwitches;
+};
+
+#endif
@@ -0,0 +1,467 @@
+//
+//  EffortFileReader.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "EffortFileReader.h"
+#include "EffortStageDetector.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+template <typename T> static inline T Get(const uint8_t *data) { T value; memcpy(&value, data, sizeof(T)); return value; }
+
+static inline void SetError(std::string *error, const char *message)
+{
+    if (error)
+        *error = message;
+}
+
+// FNV-1a, as EffortRecorder writes it
+static uint32_t Checksum(const uint8_t *data, size_t numBytes)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < numBytes; i++)
+        hash = (hash ^ data[i])*16777619u;
+    return hash;
+}
+
+EffortFileReader::EffortFileReader() :
+mMapping(NULL),
+mMappingBytes(0)
+{
+    Close();
+}
+
+EffortFileReader::~EffortFileReader()
+{
+    Close();
+}
+
+void EffortFileReader::Close()
+{
+    if (mMapping)
+        munmap(mMapping, (size_t)mMappingBytes);
+    mMapping = NULL;
+    mMappingBytes = 0;
+    mFormat = EffortFileFormatUnknown;
+    mEncoding = EncodingFloat32;
+    mSamplingRate = 0;
+    mNumChannels = 0;
+    mNumFrames = 0;
+    mBytesPerSample = 0;
+    mIntegerFullScale = 1.0f;
+    mSamplesAreMappedFloats = false;
+    mChunks.clear();
+    mMarkers.clear();
+    mPosition = 0;
+    mConvertedChunk = -1;
+    mRegions.clear();
+    mRegionsAreBuilt = false;
+}
+
+bool EffortFileReader::Map(const std::string &path, std::string *error)
+{
+    Close();
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+        SetError(error, "cannot open file");
+        return false;
+    }
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size <= 0) {
+        close(descriptor);
+        SetError(error, "empty file");
+        return false;
+    }
+    void *mapping = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor); // the mapping keeps the file
+    if (mapping == MAP_FAILED) {
+        SetError(error, "cannot map file");
+        return false;
+    }
+    mMapping = (uint8_t *)mapping;
+    mMappingBytes = (int64_t)status.st_size;
+    madvise(mMapping, (size_t)mMappingBytes, MADV_SEQUENTIAL); // replays read front to back
+    return true;
+}
+
+bool EffortFileReader::Open(const std::string &path, std::string *error)
+{
+    if (!Map(path, error))
+        return false;
+    bool ok;
+    if (mMappingBytes >= kEffortRecordingHeaderBytes && memcmp(mMapping, "OSER", 4) == 0)
+        ok = ParseRecording(error);
+    else if (mMappingBytes >= 12 && memcmp(mMapping, "RIFF", 4) == 0 && memcmp(&mMapping[8], "WAVE", 4) == 0)
+        ok = ParseWAV(error);
+    else {
+        SetError(error, "not a recording or a RIFF/WAVE file");
+        ok = false;
+    }
+    if (!ok)
+        Close();
+    return ok;
+}
+
+bool EffortFileReader::OpenRawPCM(const std::string &path, double samplingRate, int numChannels, EffortSampleFormat format, std::string *error)
+{
+    if (samplingRate <= 0 || numChannels <= 0) {
+        SetError(error, "bad sampling rate or channels");
+        return false;
+    }
+    if (!Map(path, error))
+        return false;
+    mFormat = EffortFileFormatRawPCM;
+    mSamplingRate = samplingRate;
+    mNumChannels = numChannels;
+    mEncoding = format == EffortSampleFormatFloat32 ? EncodingFloat32 : EncodingInt16;
+    mIntegerFullScale = 32768.0f;
+    SetSingleChunk(mMapping, mMappingBytes, format == EffortSampleFormatFloat32 ? 4 : 2);
+    return true;
+}
+
+void EffortFileReader::SetSingleChunk(const uint8_t *data, int64_t numBytes, int bytesPerSample)
+{
+    mBytesPerSample = bytesPerSample;
+    mNumFrames = numBytes/(bytesPerSample*mNumChannels); // a torn last frame is left out
+    AudioChunk chunk = {0, mNumFrames, data, mNumFrames*bytesPerSample*mNumChannels, 0};
+    mChunks.push_back(chunk);
+    // floats can only be handed out in place if they are aligned (a data chunk at an odd offset is legal)
+    mSamplesAreMappedFloats = mEncoding == EncodingFloat32 && ((uintptr_t)data % sizeof(float)) == 0;
+    if (!mSamplesAreMappedFloats)
+        mConverted.resize((size_t)(kReaderMaxConvertedFrames*mNumChannels));
+}
+
+bool EffortFileReader::ParseWAV(std::string *error)
+{
+    int format = 0, bitsPerSample = 0;
+    const uint8_t *data = NULL;
+    int64_t dataLength = 0;
+    int64_t position = 12;
+    while (position + 8 <= mMappingBytes) {
+        const uint8_t *header = &mMapping[position];
+        int64_t chunkLength = Get<uint32_t>(header + 4);
+        int64_t available = mMappingBytes - position - 8;
+        if (chunkLength > available)
+            chunkLength = available; // truncated recording, take what is there
+        if (memcmp(header, "fmt ", 4) == 0 && chunkLength >= 16) {
+            format = Get<uint16_t>(header + 8);
+            mNumChannels = Get<uint16_t>(header + 10);
+            mSamplingRate = Get<uint32_t>(header + 12);
+            bitsPerSample = Get<uint16_t>(header + 22);
+            if (format == 0xFFFE && chunkLength >= 26)
+                format = Get<uint16_t>(header + 32); // sub format GUID starts with the plain format tag
+        }
+        else if (memcmp(header, "data", 4) == 0) {
+            data = header + 8;
+            dataLength = chunkLength;
+        }
+        position += 8 + chunkLength + (chunkLength & 1);
+    }
+
+    if (!data || mNumChannels <= 0 || mSamplingRate <= 0) {
+        SetError(error, "missing fmt or data chunk");
+        return false;
+    }
+    if (format == 3 && bitsPerSample == 32)
+        mEncoding = EncodingFloat32;
+    else if (format == 1 && bitsPerSample == 16)
+        mEncoding = EncodingInt16;
+    else if (format == 1 && bitsPerSample == 24)
+        mEncoding = EncodingInt24;
+    else if (format == 1 && bitsPerSample == 32)
+        mEncoding = EncodingInt32;
+    else {
+        SetError(error, "unsupported sample format");
+        return false;
+    }
+    mFormat = EffortFileFormatWAV;
+    mIntegerFullScale = (float)(1u << (bitsPerSample - 1));
+    SetSingleChunk(data, dataLength, bitsPerSample/8);
+    return true;
+}
+
+bool EffortFileReader::ParseRecording(std::string *error)
+{
+    const uint8_t *header = mMapping;
+    if (Get<uint32_t>(&header[4]) != kEffortRecordingVersion) {
+        SetError(error, "unknown recording version");
+        return false;
+    }
+    int64_t headerBytes = Get<uint32_t>(&header[8]);
+    EffortSampleFormat sampleFormat = (EffortSampleFormat)Get<uint32_t>(&header[12]);
+    EffortRecordingCodec codec = (EffortRecordingCodec)Get<uint32_t>(&header[16]);
+    mNumChannels = (int)Get<uint32_t>(&header[20]);
+    mSamplingRate = Get<double>(&header[24]);
+    if (mNumChannels <= 0 || mSamplingRate <= 0 || headerBytes < kEffortRecordingHeaderBytes) {
+        SetError(error, "bad recording header");
+        return false;
+    }
+    if (sampleFormat == EffortSampleFormatFloat32) {
+        mEncoding = EncodingFloat32;
+        mBytesPerSample = 4;
+    }
+    else if (codec == EffortRecordingCodecRice) {
+        mEncoding = EncodingRice;
+        mBytesPerSample = 0;
+    }
+    else {
+        mEncoding = EncodingInt16;
+        mBytesPerSample = 2;
+    }
+    mFormat = EffortFileFormatRecording;
+    mIntegerFullScale = 32767.0f; // as Novocaine scales, and EffortRecorder::ReadFile
+
+    // only the chunk headers are touched, payloads stay on disk until they are read
+    int64_t position = headerBytes;
+    while (position + kEffortRecordingChunkHeaderBytes <= mMappingBytes) {
+        const uint8_t *chunk = &mMapping[position];
+        if (memcmp(chunk, "TAIL", 4) == 0)
+            break;
+        int64_t payloadBytes = Get<uint32_t>(&chunk[4]);
+        if (position + kEffortRecordingChunkHeaderBytes + payloadBytes > mMappingBytes)
+            break; // torn write at the end of a recording that never stopped
+        const uint8_t *payload = &chunk[kEffortRecordingChunkHeaderBytes];
+
+        if (memcmp(chunk, "AUDI", 4) == 0) {
+            AudioChunk audio = {Get<int64_t>(&chunk[8]), Get<int64_t>(&chunk[16]), payload, payloadBytes, Get<uint32_t>(&chunk[24])};
+            if (audio.firstFrame != mNumFrames || audio.numFrames <= 0 ||
+                (mBytesPerSample && payloadBytes != audio.numFrames*mNumChannels*mBytesPerSample))
+                break;
+            mChunks.push_back(audio);
+            mNumFrames += audio.numFrames;
+        }
+        else if (memcmp(chunk, "MARK", 4) == 0 && payloadBytes >= kEffortRecordingMarkerBytes) {
+            EffortRecordingMarker marker;
+            marker.frame = Get<int64_t>(&payload[0]);
+            marker.stage = Get<int32_t>(&payload[8]);
+            marker.timeInSeconds = Get<double>(&payload[16]);
+            mMarkers.push_back(marker);
+        }
+        position += kEffortRecordingChunkHeaderBytes + payloadBytes;
+    }
+
+    // every offset in the file is a multiple of four, so float chunks are aligned in the mapping
+    mSamplesAreMappedFloats = mEncoding == EncodingFloat32;
+    if (mEncoding == EncodingInt16)
+        mConverted.resize((size_t)(kReaderMaxConvertedFrames*mNumChannels));
+    return true;
+}
+
+int64_t EffortFileReader::ChunkForFrame(int64_t frame)
+{
+    int64_t low = 0, high = (int64_t)mChunks.size() - 1;
+    while (low < high) {
+        int64_t middle = (low + high + 1)/2;
+        if (mChunks[middle].firstFrame <= frame)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return low;
+}
+
+bool EffortFileReader::ConvertChunk(int64_t chunk)
+{
+    if (chunk == mConvertedChunk)
+        return true;
+    const AudioChunk &audio = mChunks[chunk];
+    if (Checksum(audio.payload, (size_t)audio.payloadBytes) != audio.checksum)
+        return false;
+    int64_t numSamples = audio.numFrames*mNumChannels;
+    mDecoded.resize((size_t)numSamples);
+    mConverted.resize((size_t)numSamples);
+    if (!EffortRecorder::DecodeRice(audio.payload, audio.payloadBytes, audio.numFrames, mNumChannels, &mDecoded[0]))
+        return false;
+    for (int64_t i = 0; i < numSamples; i++)
+        mConverted[i] = (float)mDecoded[i]/mIntegerFullScale;
+    mConvertedChunk = chunk;
+    return true;
+}
+
+void EffortFileReader::Seek(int64_t frame)
+{
+    mPosition = std::max<int64_t>(0, std::min(frame, mNumFrames));
+    if (mPosition >= mNumFrames)
+        return;
+
+    // about a second from here in the background, so a jump to a stage does not wait on the disk
+    const AudioChunk &audio = mChunks[ChunkForFrame(mPosition)];
+    const uint8_t *start = audio.payload;
+    int64_t numBytes = audio.payloadBytes;
+    if (mBytesPerSample) {
+        int64_t bytesPerFrame = mBytesPerSample*mNumChannels;
+        start += (mPosition - audio.firstFrame)*bytesPerFrame;
+        numBytes = std::min((int64_t)mSamplingRate*bytesPerFrame, (int64_t)(audio.payload + audio.payloadBytes - start));
+    }
+    int64_t pageSize = (int64_t)sysconf(_SC_PAGESIZE);
+    int64_t offset = (int64_t)(start - mMapping);
+    int64_t pageStart = offset - offset % pageSize;
+    madvise(mMapping + pageStart, (size_t)(offset - pageStart + numBytes), MADV_WILLNEED);
+}
+
+int64_t EffortFileReader::Read(int64_t maxFrames, EffortSpan *span)
+{
+    if (mPosition >= mNumFrames || maxFrames <= 0)
+        return 0;
+    int64_t chunk = ChunkForFrame(mPosition);
+    const AudioChunk &audio = mChunks[chunk];
+    int64_t offset = mPosition - audio.firstFrame;
+    int64_t numFrames = std::min(maxFrames, audio.numFrames - offset);
+
+    if (mSamplesAreMappedFloats) {
+        span->samples = (const float *)audio.payload + offset*mNumChannels;
+    }
+    else if (mEncoding == EncodingRice) {
+        if (!ConvertChunk(chunk))
+            return 0; // corrupt, the recording ends here
+        span->samples = &mConverted[(size_t)(offset*mNumChannels)];
+    }
+    else {
+        numFrames = std::min<int64_t>(numFrames, kReaderMaxConvertedFrames);
+        int64_t numSamples = numFrames*mNumChannels;
+        const uint8_t *in = audio.payload + offset*mNumChannels*mBytesPerSample;
+        float *out = &mConverted[0];
+        switch (mEncoding) {
+            case EncodingFloat32: // unaligned floats
+                memcpy(out, in, (size_t)numSamples*sizeof(float));
+                break;
+            case EncodingInt16:
+                for (int64_t i = 0; i < numSamples; i++)
+                    out[i] = (float)Get<int16_t>(&in[2*i])/mIntegerFullScale;
+                break;
+            case EncodingInt24:
+                for (int64_t i = 0; i < numSamples; i++) {
+                    const uint8_t *p = &in[3*i];
+                    int32_t value = (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8;
+                    out[i] = (float)((double)value/mIntegerFullScale);
+                }
+                break;
+            case EncodingInt32:
+                for (int64_t i = 0; i < numSamples; i++)
+                    out[i] = (float)((double)Get<int32_t>(&in[4*i])/mIntegerFullScale);
+                break;
+            default:
+                return 0;
+        }
+        span->samples = out;
+    }
+
+    span->firstFrame = mPosition;
+    span->numFrames = numFrames;
+    span->numChannels = mNumChannels;
+    mPosition += numFrames;
+    return numFrames;
+}
+
+int64_t EffortFileReader::Deliver(EffortSpanSink *sink, int64_t firstFrame, int64_t endFrame, int64_t blockFrames, double speed)
+{
+    endFrame = std::min(endFrame, mNumFrames);
+    if (!sink || blockFrames <= 0)
+        return 0;
+    Seek(firstFrame);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int64_t numDelivered = 0;
+    EffortSpan span;
+    while (mPosition < endFrame && Read(std::min(blockFrames, endFrame - mPosition), &span) > 0) {
+        if (speed > 0) {
+            // when the last frame of the span would have come off the microphone
+            double due = (double)(span.firstFrame + span.numFrames - firstFrame)/mSamplingRate/speed;
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(due)));
+        }
+        numDelivered += span.numFrames;
+        if (!sink->AddSpan(span))
+            break;
+    }
+    return numDelivered;
+}
+
+//=============================================================================================================
+// Stage index
+
+const std::vector<EffortStageRegion> &EffortFileReader::StageRegions()
+{
+    if (!mRegionsAreBuilt)
+        BuildStageRegions();
+    return mRegions;
+}
+
+int EffortFileReader::NumEfforts()
+{
+    const std::vector<EffortStageRegion> &regions = StageRegions();
+    return regions.empty() ? 0 : regions.back().effort + 1;
+}
+
+bool EffortFileReader::FindStage(int effort, SpirometryStage stage, EffortStageRegion *region)
+{
+    const std::vector<EffortStageRegion> &regions = StageRegions();
+    bool found = false;
+    for (size_t r = 0; r < regions.size(); r++) {
+        if (regions[r].effort != effort || regions[r].stage != stage)
+            continue;
+        if (!found)
+            *region = regions[r];
+        region->endFrame = regions[r].endFrame;
+        found = true;
+    }
+    return found;
+}
+
+void EffortFileReader::AddStageChange(int64_t frame, SpirometryStage stage)
+{
+    int effort = 0;
+    if (!mRegions.empty()) {
+        EffortStageRegion &last = mRegions.back();
+        if (last.stage == stage)
+            return;
+        last.endFrame = frame;
+        effort = last.effort + (stage == SpirometryStageIsCalibratingSilence ? 1 : 0); // every effort starts by calibrating
+    }
+    EffortStageRegion region = {effort, stage, frame, mNumFrames};
+    mRegions.push_back(region);
+}
+
+void EffortFileReader::BuildStageRegions()
+{
+    mRegions.clear();
+    mRegionsAreBuilt = true;
+    if (!mMarkers.empty()) {
+        for (size_t m = 0; m < mMarkers.size(); m++)
+            AddStageChange(std::min(mMarkers[m].frame, mNumFrames), (SpirometryStage)mMarkers[m].stage);
+        return;
+    }
+
+    // as the analyzer would have seen it: a stage per block from the block maximum, stamped at the
+    // end of the block, and a new effort (calibration first) after each one finishes or times out
+    int64_t position = mPosition;
+    EffortStageDetector detector((float)mSamplingRate);
+    int64_t effortStart = 0, blockEnd = 0;
+    float blockMax = -1e30f;
+    EffortSpan span;
+    Seek(0);
+    while (Read(kReaderStageBlockFrames - (mPosition - blockEnd), &span) > 0) {
+        for (int64_t i = 0; i < span.numFrames; i++)
+            blockMax = std::max(blockMax, span.samples[i*span.numChannels]);
+        if (mPosition - blockEnd < kReaderStageBlockFrames && mPosition < mNumFrames)
+            continue; // block continues in the next chunk
+        blockEnd = mPosition;
+        SpirometryStage stage = detector.AnalyzeStageFromAudioMax(blockMax, blockEnd - effortStart);
+        AddStageChange(blockEnd, stage);
+        if (stage == SpirometryStageIsFinished || stage == SpirometryStageDidTimeOutWaitingForEffort) {
+            detector.Clear();
+            effortStart = blockEnd;
+        }
+        blockMax = -1e30f;
+    }
+    Seek(position);
+}
@@ -0,0 +1,153 @@
+//
+//  EffortFileReader.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Replays recorded efforts from anywhere on disk: EffortRecorder's .effort files, WAV (16, 24
+//  or 32 bit PCM, 32 bit float) and headerless PCM. The file is memory mapped, so opening it reads
+//  nothing but the headers and a replay only pages in what it delivers. Float samples are handed
+//  out as spans straight into the mapping; integer samples are converted into a buffer the reader
+//  owns, kReaderMaxConvertedFrames at a time, and a Rice coded chunk is decoded whole once its
+//  checksum is checked.
+//
+//  A span stays valid until the next Read, Seek or Close, and nothing is shared with another
+//  reader, so a span handed to a sink is never overwritten under it (unlike Novocaine's file
+//  playback, which reused one buffer for every block it dispatched).
+//
+//  The stage index says where each effort's calibration, exhalation and end of test are, so a
+//  replay can seek straight to them. Recordings carry it as stage markers; for other files it is
+//  built once by running EffortStageDetector over the block maxima, one effort after another, so
+//  long sessions with many efforts can be indexed too.
+
+#ifndef OpenSpirometry_EffortFileReader_h
+#define OpenSpirometry_EffortFileReader_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "SpirometerConstants.h"
+#include "EffortRecorder.h"
+
+#define kReaderMaxConvertedFrames 16384     // frames converted per span when the samples are not floats
+#define kReaderStageBlockFrames 1024        // block the stage index is built with, like Novocaine's callbacks
+
+enum EffortFileFormat {
+    EffortFileFormatUnknown,
+    EffortFileFormatRawPCM,
+    EffortFileFormatWAV,
+    EffortFileFormatRecording           // EffortRecorder
+};
+
+// interleaved frames, valid until the next Read, Seek or Close
+struct EffortSpan {
+    const float *samples;
+    int64_t firstFrame;
+    int64_t numFrames;
+    int numChannels;
+};
+
+// one run of a stage, frames [firstFrame, endFrame) of the file
+struct EffortStageRegion {
+    int effort;                         // from 0, in file order
+    SpirometryStage stage;
+    int64_t firstFrame;
+    int64_t endFrame;
+};
+
+// receives the spans of a Deliver, return false to stop early
+class EffortSpanSink {
+
+public:
+    virtual ~EffortSpanSink() {}
+    virtual bool AddSpan(const EffortSpan &span) = 0;
+};
+
+class EffortFileReader {
+
+public:
+    EffortFileReader();
+    ~EffortFileReader();
+
+    // a recording or a WAV file, told apart by content; false (and error) if neither
+    bool Open(const std::string &path, std::string *error = NULL);
+    // headerless interleaved PCM, Float32 or Int16 (scaled by 1/32768 like WAV)
+    bool OpenRawPCM(const std::string &path, double samplingRate, int numChannels, EffortSampleFormat format, std::string *error = NULL);
+    void Close();
+
+    bool IsOpen() { return mFormat != EffortFileFormatUnknown; }
+    EffortFileFormat Format() { return mFormat; }
+    double SamplingRate() { return mSamplingRate; }
+    int NumChannels() { return mNumChannels; }
+    int64_t NumFrames() { return mNumFrames; }
+    double Seconds() { return mSamplingRate > 0 ? (double)mNumFrames/mSamplingRate : 0.0; }
+    bool IsZeroCopy() { return mSamplesAreMappedFloats; } // spans point into the file itself
+    const std::vector<EffortRecordingMarker> &Markers() { return mMarkers; } // recordings only
+
+    // every stage run of every effort in file order; for files without markers it is built on first
+    // use, which reads the file once and invalidates the current span
+    const std::vector<EffortStageRegion> &StageRegions();
+    int NumEfforts();
+    // from the first frame of the stage in that effort to the end of its last run (exhaling and
+    // waiting for the end of the test alternate), false if the effort never reached it
+    bool FindStage(int effort, SpirometryStage stage, EffortStageRegion *region);
+
+    void Seek(int64_t frame);  // also asks the system to page in what follows
+    int64_t Position() { return mPosition; }
+    // next span from the position, at most maxFrames (fewer at a chunk boundary), 0 at the end
+    int64_t Read(int64_t maxFrames, EffortSpan *span);
+
+    // frames [firstFrame, endFrame) in spans of at most blockFrames, each handed to the sink when it
+    // would have arrived at speed times real time (0 or less for as fast as the sink takes them);
+    // returns the frames delivered
+    int64_t Deliver(EffortSpanSink *sink, int64_t firstFrame, int64_t endFrame, int64_t blockFrames, double speed);
+
+protected:
+    enum SampleEncoding { EncodingFloat32, EncodingInt16, EncodingInt24, EncodingInt32, EncodingRice };
+
+    struct AudioChunk {
+        int64_t firstFrame;
+        int64_t numFrames;
+        const uint8_t *payload;
+        int64_t payloadBytes;
+        uint32_t checksum;
+    };
+
+    bool Map(const std::string &path, std::string *error);
+    void SetSingleChunk(const uint8_t *data, int64_t numBytes, int bytesPerSample);
+    bool ParseWAV(std::string *error);
+    bool ParseRecording(std::string *error);
+    int64_t ChunkForFrame(int64_t frame);
+    bool ConvertChunk(int64_t chunk);
+    void BuildStageRegions();
+    void AddStageChange(int64_t frame, SpirometryStage stage);
+
+    // the mapping
+    uint8_t *mMapping;
+    int64_t mMappingBytes;
+
+    EffortFileFormat mFormat;
+    SampleEncoding mEncoding;
+    double mSamplingRate;
+    int mNumChannels;
+    int64_t mNumFrames;
+    int mBytesPerSample;                // 0 for Rice
+    float mIntegerFullScale;            // integer samples are divided by this
+    bool mSamplesAreMappedFloats;
+
+    // audio as chunks of consecutive frames (one for WAV and raw PCM)
+    std::vector<AudioChunk> mChunks;
+    std::vector<EffortRecordingMarker> mMarkers;
+    int64_t mPosition;
+
+    // integer samples converted for the current span, or the decoded Rice chunk
+    int64_t mConvertedChunk;            // Rice chunk in mConverted, -1 for none
+    std::vector<float> mConverted;
+    std::vector<int16_t> mDecoded;
+
+    std::vector<EffortStageRegion> mRegions;
+    bool mRegionsAreBuilt;
+};
+
+#endif
@@ -0,0 +1,565 @@
+//
+//  EffortRecorder.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "EffortRecorder.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#define kRiceParameterBits 5
+#define kRiceEscapeQuotient 24      // quotients this large are written as an escape and the raw value
+#define kRiceRawBits 17             // a zigzagged difference of two 16 bit samples always fits
+
+static inline void PutBytes(std::vector<uint8_t> *out, const void *data, size_t numBytes)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    out->insert(out->end(), bytes, bytes + numBytes);
+}
+
+template <typename T> static inline void Put(std::vector<uint8_t> *out, T value) { PutBytes(out, &value, sizeof(T)); }
+
+template <typename T> static inline T Get(const uint8_t *data) { T value; memcpy(&value, data, sizeof(T)); return value; }
+
+// FNV-1a, enough to notice a torn or corrupt chunk
+static uint32_t Checksum(const uint8_t *data, size_t numBytes)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < numBytes; i++)
+        hash = (hash ^ data[i])*16777619u;
+    return hash;
+}
+
+//=============================================================================================================
+// Rice codec
+
+class BitWriter {
+public:
+    BitWriter(std::vector<uint8_t> *out) : mOut(out), mBits(0), mNumBits(0) {}
+    void Write(uint32_t value, int numBits) {
+        mBits |= (uint64_t)value << mNumBits;
+        mNumBits += numBits;
+        while (mNumBits >= 8) {
+            mOut->push_back((uint8_t)mBits);
+            mBits >>= 8;
+            mNumBits -= 8;
+        }
+    }
+    void WriteOnes(int count) {
+        while (count > 24) { Write(0xFFFFFF, 24); count -= 24; }
+        Write((1u << count) - 1, count);
+    }
+    void Flush() { if (mNumBits > 0) mOut->push_back((uint8_t)mBits); mBits = 0; mNumBits = 0; }
+private:
+    std::vector<uint8_t> *mOut;
+    uint64_t mBits;
+    int mNumBits;
+};
+
+class BitReader {
+public:
+    BitReader(const uint8_t *data, int64_t numBytes) : mData(data), mNumBytes(numBytes), mPosition(0), mBits(0), mNumBits(0) {}
+    bool Read(int numBits, uint32_t *value) {
+        while (mNumBits < numBits) {
+            if (mPosition >= mNumBytes)
+                return false;
+            mBits |= (uint64_t)mData[mPosition++] << mNumBits;
+            mNumBits += 8;
+        }
+        *value = (uint32_t)(mBits & ((1ull << numBits) - 1));
+        mBits >>= numBits;
+        mNumBits -= numBits;
+        return true;
+    }
+    bool ReadOnes(int limit, int *count) { // ones up to a zero, or limit ones
+        *count = 0;
+        uint32_t bit;
+        while (*count < limit) {
+            if (!Read(1, &bit))
+                return false;
+            if (!bit)
+                return true;
+            (*count)++;
+        }
+        return true;
+    }
+private:
+    const uint8_t *mData;
+    int64_t mNumBytes;
+    int64_t mPosition;
+    uint64_t mBits;
+    int mNumBits;
+};
+
+static inline uint32_t ZigZag(int32_t value) { return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31); }
+static inline int32_t UnZigZag(uint32_t value) { return (int32_t)(value >> 1) ^ -(int32_t)(value & 1); }
+
+void EffortRecorder::EncodeRice(const int16_t *interleaved, int64_t numFrames, int numChannels, std::vector<uint8_t> *out)
+{
+    BitWriter bits(out);
+    uint32_t residuals[kRiceBlockLength];
+    for (int c = 0; c < numChannels; c++) {
+        int32_t previous = 0;
+        for (int64_t start = 0; start < numFrames; start += kRiceBlockLength) {
+            int64_t length = std::min<int64_t>(kRiceBlockLength, numFrames - start);
+            uint64_t sum = 0;
+            for (int64_t i = 0; i < length; i++) {
+                int32_t sample = interleaved[(start + i)*numChannels + c];
+                residuals[i] = ZigZag(sample - previous);
+                previous = sample;
+                sum += residuals[i];
+            }
+            // parameter near log2 of the mean residual
+            int k = 0;
+            while (k < kRiceRawBits - 1 && ((uint64_t)length << (k + 1)) <= sum)
+                k++;
+            bits.Write((uint32_t)k, kRiceParameterBits);
+            for (int64_t i = 0; i < length; i++) {
+                uint32_t quotient = residuals[i] >> k;
+                if (quotient < kRiceEscapeQuotient) {
+                    bits.WriteOnes((int)quotient);
+                    bits.Write(0, 1);
+                    if (k > 0)
+                        bits.Write(residuals[i] & ((1u << k) - 1), k);
+                }
+                else {
+                    bits.WriteOnes(kRiceEscapeQuotient);
+                    bits.Write(residuals[i], kRiceRawBits);
+                }
+            }
+        }
+    }
+    bits.Flush();
+}
+
+bool EffortRecorder::DecodeRice(const uint8_t *data, int64_t numBytes, int64_t numFrames, int numChannels, int16_t *interleaved)
+{
+    BitReader bits(data, numBytes);
+    for (int c = 0; c < numChannels; c++) {
+        int32_t previous = 0;
+        for (int64_t start = 0; start < numFrames; start += kRiceBlockLength) {
+            int64_t length = std::min<int64_t>(kRiceBlockLength, numFrames - start);
+            uint32_t k;
+            if (!bits.Read(kRiceParameterBits, &k) || k >= kRiceRawBits)
+                return false;
+            for (int64_t i = 0; i < length; i++) {
+                int quotient;
+                uint32_t residual, low = 0;
+                if (!bits.ReadOnes(kRiceEscapeQuotient, &quotient))
+                    return false;
+                if (quotient < kRiceEscapeQuotient) {
+                    if (k > 0 && !bits.Read((int)k, &low))
+                        return false;
+                    residual = ((uint32_t)quotient << k) | low;
+                }
+                else if (!bits.Read(kRiceRawBits, &residual)) {
+                    return false;
+                }
+                int32_t sample = previous + UnZigZag(residual);
+                if (sample < -32768 || sample > 32767)
+                    return false;
+                interleaved[(start + i)*numChannels + c] = (int16_t)sample;
+                previous = sample;
+            }
+        }
+    }
+    return true;
+}
+
+//=============================================================================================================
+// Recorder
+
+EffortRecorder::EffortRecorder(double ringSeconds) :
+mRingSeconds(ringSeconds > 0 ? ringSeconds : kRecorderRingSeconds),
+mFile(NULL),
+mNumChannels(1),
+mFramesPerChunk(1),
+mFileOffset(0),
+mIsRecording(false),
+mStopRequested(false),
+mHasFailed(false),
+mNumCallbacksInside(0),
+mData(NULL),
+mSizeOfBuffer(0),
+mMask(0),
+mNumMarkersWritten(0)
+{
+    mWriteCount.store(0);
+    mReadCount.store(0);
+    mDroppedFrames.store(0);
+    mNumMarkersClaimed.store(0);
+    mDroppedMarkers.store(0);
+    mNumFramesWritten.store(0);
+    mNumBytesWritten.store(0);
+    for (int m = 0; m < kMaxRecorderMarkers; m++)
+        mMarkers[m].ready.store(false);
+}
+
+EffortRecorder::~EffortRecorder()
+{
+    Stop();
+    free(mData);
+}
+
+bool EffortRecorder::Start(const std::string &path, double samplingRate, int numChannels,
+                           EffortSampleFormat format, EffortRecordingCodec codec)
+{
+    if (IsRecording() || samplingRate <= 0)
+        return false;
+
+    mNumChannels = numChannels > 0 ? numChannels : 1;
+    int64_t wanted = (int64_t)(mRingSeconds*samplingRate)*mNumChannels;
+    int64_t size = 1;
+    while (size < wanted)
+        size <<= 1;
+    if (size != mSizeOfBuffer) {
+        free(mData);
+        mData = (float *)calloc((size_t)size, sizeof(float));
+        mSizeOfBuffer = size;
+        mMask = size - 1;
+    }
+
+    mFile = fopen(path.c_str(), "wb");
+    if (!mFile)
+        return false;
+    setvbuf(mFile, NULL, _IONBF, 0); // chunks go out in one write each, no second copy
+
+    mInfo.sampleFormat = format;
+    mInfo.codec = format == EffortSampleFormatInt16 ? codec : EffortRecordingCodecNone;
+    mInfo.numChannels = (int)mNumChannels;
+    mInfo.samplingRate = samplingRate;
+    mInfo.startTime = (double)time(NULL);
+    mFramesPerChunk = std::max<int64_t>(1, (int64_t)(samplingRate*kRecorderChunkSeconds));
+    mInfo.framesPerChunk = mFramesPerChunk;
+
+    // everything the writer needs, so it only allocates for the index
+    int64_t chunkSamples = mFramesPerChunk*mNumChannels;
+    mChunkFloats.resize((size_t)chunkSamples);
+    mChunkShorts.resize((size_t)chunkSamples);
+    size_t maxCodedBytes = (size_t)(chunkSamples*(kRiceEscapeQuotient + kRiceRawBits)/8 + chunkSamples/kRiceBlockLength + 64);
+    mCodedBytes.clear();
+    mCodedBytes.reserve(maxCodedBytes);
+    mChunkBytes.clear();
+    mChunkBytes.reserve(kEffortRecordingChunkHeaderBytes + std::max(maxCodedBytes, (size_t)chunkSamples*sizeof(float)));
+    mIndex.clear();
+    mIndex.reserve(1024);
+
+    mWriteCount.store(0);
+    mReadCount.store(0);
+    mDroppedFrames.store(0);
+    for (int m = 0; m < kMaxRecorderMarkers; m++)
+        mMarkers[m].ready.store(false);
+    mNumMarkersClaimed.store(0);
+    mDroppedMarkers.store(0);
+    mNumMarkersWritten = 0;
+    mNumFramesWritten.store(0);
+    mNumBytesWritten.store(0);
+    mFileOffset = 0;
+    mStartClock = std::chrono::steady_clock::now();
+
+    std::vector<uint8_t> &header = mChunkBytes;
+    PutBytes(&header, "OSER", 4);
+    Put<uint32_t>(&header, kEffortRecordingVersion);
+    Put<uint32_t>(&header, kEffortRecordingHeaderBytes);
+    Put<uint32_t>(&header, (uint32_t)mInfo.sampleFormat);
+    Put<uint32_t>(&header, (uint32_t)mInfo.codec);
+    Put<uint32_t>(&header, (uint32_t)mInfo.numChannels);
+    Put<double>(&header, mInfo.samplingRate);
+    Put<double>(&header, mInfo.startTime);
+    Put<int64_t>(&header, mInfo.framesPerChunk);
+    header.resize(kEffortRecordingHeaderBytes, 0);
+    if (!WriteBytes(&header[0], header.size())) {
+        fclose(mFile);
+        mFile = NULL;
+        return false;
+    }
+
+    mStopRequested.store(false);
+    mHasFailed.store(false);
+    mIsRecording.store(true, std::memory_order_release);
+    mWriter = std::thread(&EffortRecorder::WriterLoop, this);
+    return true;
+}
+
+void EffortRecorder::Stop()
+{
+    if (!IsRecording())
+        return;
+    // later callbacks are ignored, one already copying in finishes before the last drain (it
+    // would otherwise write into the ring after it, or after the ring is freed)
+    mIsRecording.store(false, std::memory_order_seq_cst);
+    while (mNumCallbacksInside.load(std::memory_order_seq_cst) > 0)
+        std::this_thread::yield();
+    mStopRequested.store(true, std::memory_order_release);
+    mWriter.join();
+
+    // index of the audio chunks, then the trailer pointing at it
+    int64_t indexOffset = mFileOffset;
+    std::vector<uint8_t> index;
+    index.reserve(mIndex.size()*3*sizeof(int64_t));
+    for (size_t i = 0; i < mIndex.size(); i++) {
+        Put<int64_t>(&index, mIndex[i].offset);
+        Put<int64_t>(&index, mIndex[i].firstFrame);
+        Put<int64_t>(&index, mIndex[i].numFrames);
+    }
+    if (WriteChunk("INDX", 0, (int64_t)mIndex.size(), index.empty() ? NULL : &index[0], index.size())) {
+        std::vector<uint8_t> trailer;
+        PutBytes(&trailer, "TAIL", 4);
+        Put<uint32_t>(&trailer, 0);
+        Put<int64_t>(&trailer, indexOffset);
+        if (!WriteBytes(&trailer[0], trailer.size()))
+            mHasFailed.store(true, std::memory_order_release);
+    }
+
+    fclose(mFile);
+    mFile = NULL;
+}
+
+int64_t EffortRecorder::AddNewInterleavedFloatData(const float *data, int64_t numFrames)
+{
+    if (numFrames <= 0)
+        return 0;
+    mNumCallbacksInside.fetch_add(1, std::memory_order_seq_cst);
+    if (!mIsRecording.load(std::memory_order_seq_cst)) {
+        mNumCallbacksInside.fetch_sub(1, std::memory_order_release);
+        return 0;
+    }
+
+    int64_t write = mWriteCount.load(std::memory_order_relaxed);
+    int64_t freeSpace = mSizeOfBuffer - (write - mReadCount.load(std::memory_order_acquire));
+    int64_t numToWrite = std::min(numFrames, freeSpace/mNumChannels);
+    int64_t numSamples = numToWrite*mNumChannels;
+
+    int64_t start = write & mMask;
+    int64_t firstPart = std::min(numSamples, mSizeOfBuffer - start);
+    memcpy(&mData[start], data, (size_t)firstPart*sizeof(float));
+    if (numSamples > firstPart)
+        memcpy(mData, &data[firstPart], (size_t)(numSamples - firstPart)*sizeof(float));
+    mWriteCount.store(write + numSamples, std::memory_order_release);
+
+    if (numToWrite < numFrames)
+        mDroppedFrames.fetch_add(numFrames - numToWrite, std::memory_order_relaxed);
+    mNumCallbacksInside.fetch_sub(1, std::memory_order_release);
+    return numToWrite;
+}
+
+void EffortRecorder::AddMarker(int32_t stage)
+{
+    if (!IsRecording())
+        return;
+    int64_t slot = mNumMarkersClaimed.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= kMaxRecorderMarkers) {
+        mDroppedMarkers.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    MarkerSlot &marker = mMarkers[slot];
+    marker.marker.frame = NumFramesReceived();
+    marker.marker.stage = stage;
+    marker.marker.timeInSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStartClock).count();
+    marker.ready.store(true, std::memory_order_release);
+}
+
+bool EffortRecorder::WriteBytes(const void *data, size_t numBytes)
+{
+    if (fwrite(data, 1, numBytes, mFile) != numBytes)
+        return false;
+    mFileOffset += (int64_t)numBytes;
+    mNumBytesWritten.store(mFileOffset, std::memory_order_relaxed);
+    return true;
+}
+
+void EffortRecorder::WriterLoop()
+{
+    while (!mStopRequested.load(std::memory_order_acquire)) {
+        DrainMarkers();
+        DrainRing(false);
+        std::this_thread::sleep_for(std::chrono::duration<double>(kRecorderPollSeconds));
+    }
+    DrainMarkers();
+    DrainRing(true);
+}
+
+void EffortRecorder::DrainMarkers()
+{
+    int64_t claimed = std::min<int64_t>(mNumMarkersClaimed.load(std::memory_order_relaxed), kMaxRecorderMarkers);
+    while (mNumMarkersWritten < claimed && mMarkers[mNumMarkersWritten].ready.load(std::memory_order_acquire)) {
+        const EffortRecordingMarker &marker = mMarkers[mNumMarkersWritten].marker;
+        uint8_t payload[kEffortRecordingMarkerBytes];
+        int32_t zero = 0;
+        memcpy(&payload[0], &marker.frame, 8);
+        memcpy(&payload[8], &marker.stage, 4);
+        memcpy(&payload[12], &zero, 4);
+        memcpy(&payload[16], &marker.timeInSeconds, 8);
+        WriteChunk("MARK", marker.frame, 0, payload, sizeof(payload));
+        mNumMarkersWritten++;
+    }
+}
+
+void EffortRecorder::DrainRing(bool final)
+{
+    while (true) {
+        int64_t available = (mWriteCount.load(std::memory_order_acquire) - mReadCount.load(std::memory_order_relaxed))/mNumChannels;
+        if (available >= mFramesPerChunk)
+            WriteAudioChunk(mFramesPerChunk);
+        else if (final && available > 0)
+            WriteAudioChunk(available);
+        else
+            break;
+    }
+}
+
+void EffortRecorder::WriteAudioChunk(int64_t numFrames)
+{
+    int64_t numSamples = numFrames*mNumChannels;
+    int64_t read = mReadCount.load(std::memory_order_relaxed);
+    int64_t start = read & mMask;
+    int64_t firstPart = std::min(numSamples, mSizeOfBuffer - start);
+    float *floats = &mChunkFloats[0];
+    memcpy(floats, &mData[start], (size_t)firstPart*sizeof(float));
+    if (numSamples > firstPart)
+        memcpy(&floats[firstPart], mData, (size_t)(numSamples - firstPart)*sizeof(float));
+    mReadCount.store(read + numSamples, std::memory_order_release); // the callback may reuse the space now
+    if (HasFailed()) {
+        mDroppedFrames.fetch_add(numFrames, std::memory_order_relaxed);
+        return;
+    }
+
+    IndexEntry entry = {mFileOffset, mNumFramesWritten.load(std::memory_order_relaxed), numFrames};
+    bool written;
+    if (mInfo.sampleFormat == EffortSampleFormatFloat32) {
+        written = WriteChunk("AUDI", entry.firstFrame, numFrames, floats, (size_t)numSamples*sizeof(float));
+    }
+    else {
+        int16_t *shorts = &mChunkShorts[0];
+        for (int64_t i = 0; i < numSamples; i++) {
+            float scaled = floats[i]*32767.0f;
+            scaled = scaled > 32767.0f ? 32767.0f : (scaled < -32768.0f ? -32768.0f : scaled);
+            shorts[i] = (int16_t)lrintf(scaled);
+        }
+        if (mInfo.codec == EffortRecordingCodecRice) {
+            mCodedBytes.clear();
+            EncodeRice(shorts, numFrames, (int)mNumChannels, &mCodedBytes);
+            written = WriteChunk("AUDI", entry.firstFrame, numFrames, &mCodedBytes[0], mCodedBytes.size());
+        }
+        else {
+            written = WriteChunk("AUDI", entry.firstFrame, numFrames, shorts, (size_t)numSamples*sizeof(int16_t));
+        }
+    }
+    if (!written) { // not in the file, so not in the index either
+        mDroppedFrames.fetch_add(numFrames, std::memory_order_relaxed);
+        return;
+    }
+    mIndex.push_back(entry);
+    mNumFramesWritten.store(entry.firstFrame + numFrames, std::memory_order_relaxed);
+}
+
+bool EffortRecorder::WriteChunk(const char *tag, int64_t firstFrame, int64_t numFrames, const void *payload, size_t payloadBytes)
+{
+    if (HasFailed()) // whatever follows a torn chunk could not be read anyway
+        return false;
+    std::vector<uint8_t> &chunk = mChunkBytes;
+    chunk.clear();
+    PutBytes(&chunk, tag, 4);
+    Put<uint32_t>(&chunk, (uint32_t)payloadBytes);
+    Put<int64_t>(&chunk, firstFrame);
+    Put<int64_t>(&chunk, numFrames);
+    Put<uint32_t>(&chunk, payloadBytes ? Checksum((const uint8_t *)payload, payloadBytes) : 0);
+    Put<uint32_t>(&chunk, 0);
+    if (payloadBytes)
+        PutBytes(&chunk, payload, payloadBytes);
+    if (!WriteBytes(&chunk[0], chunk.size())) {
+        mHasFailed.store(true, std::memory_order_release);
+        return false;
+    }
+    return true;
+}
+
+//=============================================================================================================
+// Reading
+
+bool EffortRecorder::ReadFile(const std::string &path, EffortRecordingInfo *info, std::vector<float> *interleaved,
+                              std::vector<EffortRecordingMarker> *markers)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    std::vector<uint8_t> bytes;
+    uint8_t block[65536];
+    size_t numRead;
+    while ((numRead = fread(block, 1, sizeof(block), file)) > 0)
+        bytes.insert(bytes.end(), block, block + numRead);
+    fclose(file);
+
+    if (bytes.size() < kEffortRecordingHeaderBytes || memcmp(&bytes[0], "OSER", 4) != 0 || Get<uint32_t>(&bytes[4]) != kEffortRecordingVersion)
+        return false;
+    int64_t headerBytes = Get<uint32_t>(&bytes[8]);
+    info->sampleFormat = (EffortSampleFormat)Get<uint32_t>(&bytes[12]);
+    info->codec = (EffortRecordingCodec)Get<uint32_t>(&bytes[16]);
+    info->numChannels = (int)Get<uint32_t>(&bytes[20]);
+    info->samplingRate = Get<double>(&bytes[24]);
+    info->startTime = Get<double>(&bytes[32]);
+    info->framesPerChunk = Get<int64_t>(&bytes[40]);
+    if (info->numChannels <= 0 || headerBytes < kEffortRecordingHeaderBytes)
+        return false;
+
+    // walk the chunks (works with or without the index and trailer), stop at the first bad one
+    interleaved->clear();
+    markers->clear();
+    std::vector<int16_t> shorts;
+    int64_t numFrames = 0, position = headerBytes, size = (int64_t)bytes.size();
+    while (position + kEffortRecordingChunkHeaderBytes <= size) {
+        const uint8_t *chunk = &bytes[(size_t)position];
+        if (memcmp(chunk, "TAIL", 4) == 0)
+            break;
+        int64_t payloadBytes = Get<uint32_t>(&chunk[4]);
+        int64_t firstFrame = Get<int64_t>(&chunk[8]);
+        int64_t chunkFrames = Get<int64_t>(&chunk[16]);
+        const uint8_t *payload = &chunk[kEffortRecordingChunkHeaderBytes];
+        if (position + kEffortRecordingChunkHeaderBytes + payloadBytes > size || (payloadBytes && Checksum(payload, (size_t)payloadBytes) != Get<uint32_t>(&chunk[24])))
+            break; // torn write at the end of a recording that never stopped
+
+        if (memcmp(chunk, "AUDI", 4) == 0) {
+            if (firstFrame != numFrames || chunkFrames < 0)
+                return false;
+            int64_t numSamples = chunkFrames*info->numChannels;
+            size_t offset = interleaved->size();
+            interleaved->resize(offset + (size_t)numSamples);
+            float *out = numSamples ? &(*interleaved)[offset] : NULL;
+            if (info->sampleFormat == EffortSampleFormatFloat32) {
+                if (payloadBytes != numSamples*(int64_t)sizeof(float))
+                    return false;
+                memcpy(out, payload, (size_t)payloadBytes);
+            }
+            else {
+                shorts.resize((size_t)numSamples);
+                if (info->codec == EffortRecordingCodecRice) {
+                    if (!DecodeRice(payload, payloadBytes, chunkFrames, info->numChannels, &shorts[0]))
+                        return false;
+                }
+                else {
+                    if (payloadBytes != numSamples*(int64_t)sizeof(int16_t))
+                        return false;
+                    memcpy(&shorts[0], payload, (size_t)payloadBytes);
+                }
+                for (int64_t i = 0; i < numSamples; i++)
+                    out[i] = (float)shorts[i]/32767.0f;
+            }
+            numFrames += chunkFrames;
+        }
+        else if (memcmp(chunk, "MARK", 4) == 0 && payloadBytes >= kEffortRecordingMarkerBytes) {
+            EffortRecordingMarker marker;
+            marker.frame = Get<int64_t>(&payload[0]);
+            marker.stage = Get<int32_t>(&payload[8]);
+            marker.timeInSeconds = Get<double>(&payload[16]);
+            markers->push_back(marker);
+        }
+        position += kEffortRecordingChunkHeaderBytes + payloadBytes;
+    }
+    return true;
+}
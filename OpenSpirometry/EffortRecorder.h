@@ -0,0 +1,170 @@
+//
+//  EffortRecorder.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Lossless recording of an effort's microphone audio, in place of Novocaine's AAC writer (which
+//  encodes inside the render callback behind a trylock and silently loses the callback's samples
+//  whenever the lock is busy). The audio callback only copies floats into a preallocated lock free
+//  ring: no lock, no allocation, no system call. A writer thread drains the ring into an append
+//  only file in large sequential chunks, converting and compressing there. If the ring ever fills
+//  (the writer stalled for longer than the ring holds) the newest samples are dropped and counted,
+//  never lost silently. A write that fails marks the recording failed: nothing more goes to the
+//  file (it reads back up to the last whole chunk) and the audio from then on counts as dropped.
+//
+//  File layout (little endian):
+//    header    64 bytes: "OSER", version, header size, sample format, codec, channels,
+//              sampling rate, start time (unix seconds), frames per chunk
+//    chunks    tag, payload bytes, first frame, frame count, checksum of the payload, payload
+//              "AUDI" audio, interleaved frames in the sample format (Rice coded if the codec says so)
+//              "MARK" one stage marker: frame, stage, time since the start
+//              "INDX" at the end: offset, first frame and frame count of every audio chunk
+//    trailer   "TAIL", offset of the index chunk
+//  A file without a trailer (the app died while recording) still reads by walking the chunks.
+//
+//  The Rice codec works on 16 bit samples: each channel of a chunk is first differenced and the
+//  zigzagged residuals are Rice coded in blocks of kRiceBlockLength with the best parameter for the
+//  block (like FLAC's fixed order 1 predictor), which takes whistle audio to about two thirds of
+//  its 16 bit size and decodes exactly.
+
+#ifndef OpenSpirometry_EffortRecorder_h
+#define OpenSpirometry_EffortRecorder_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define kRecorderRingSeconds 10.0       // audio the ring holds, so the writer can stall this long without loss
+#define kRecorderChunkSeconds 1.0       // audio per chunk written (one large sequential write each)
+#define kRecorderPollSeconds 0.05       // writer wakes this often to drain the ring
+#define kMaxRecorderMarkers 256         // stage markers per recording
+#define kRiceBlockLength 256
+
+// file layout, shared with EffortFileReader
+#define kEffortRecordingVersion 1
+#define kEffortRecordingHeaderBytes 64
+#define kEffortRecordingChunkHeaderBytes 32
+#define kEffortRecordingTrailerBytes 16
+#define kEffortRecordingMarkerBytes 24
+
+enum EffortSampleFormat {
+    EffortSampleFormatFloat32 = 0,      // the callback's samples bit for bit
+    EffortSampleFormatInt16 = 1         // 16 bit PCM, rounded and clipped by the writer thread
+};
+
+enum EffortRecordingCodec {
+    EffortRecordingCodecNone = 0,
+    EffortRecordingCodecRice = 1        // Int16 only
+};
+
+struct EffortRecordingInfo {
+    EffortSampleFormat sampleFormat;
+    EffortRecordingCodec codec;
+    int numChannels;
+    double samplingRate;
+    double startTime;                   // unix seconds
+    int64_t framesPerChunk;
+};
+
+struct EffortRecordingMarker {
+    int64_t frame;                      // stream position when the stage was entered
+    int32_t stage;                      // SpirometryStage
+    double timeInSeconds;               // since the recording started
+};
+
+class EffortRecorder {
+
+public:
+    EffortRecorder(double ringSeconds = kRecorderRingSeconds);
+    virtual ~EffortRecorder();
+
+    // creates the file and starts the writer thread, false if the file can not be created
+    bool Start(const std::string &path, double samplingRate, int numChannels,
+               EffortSampleFormat format = EffortSampleFormatInt16, EffortRecordingCodec codec = EffortRecordingCodecRice);
+    // waits for a callback still copying in, writes everything still in the ring, the index and
+    // the trailer, then closes the file
+    void Stop();
+    bool IsRecording() { return mIsRecording.load(std::memory_order_acquire); }
+    bool HasFailed() { return mHasFailed.load(std::memory_order_acquire); }
+    int NumChannels() { return (int)mNumChannels; }
+
+    // audio thread only: copies the frames in, returns how many fit (the rest are counted as dropped)
+    int64_t AddNewInterleavedFloatData(const float *data, int64_t numFrames);
+    // any thread: marks the stage at the newest frame received
+    void AddMarker(int32_t stage);
+
+    // any thread
+    int64_t NumFramesReceived() { return mWriteCount.load(std::memory_order_acquire)/mNumChannels; }
+    int64_t NumFramesWritten() { return mNumFramesWritten.load(std::memory_order_relaxed); }
+    int64_t NumDroppedFrames() { return mDroppedFrames.load(std::memory_order_relaxed); } // received but not in the file
+    int64_t NumDroppedMarkers() { return mDroppedMarkers.load(std::memory_order_relaxed); }
+    int64_t NumBytesWritten() { return mNumBytesWritten.load(std::memory_order_relaxed); }
+    int64_t RingCapacityInFrames() { return mSizeOfBuffer/mNumChannels; }
+
+    // reads a whole recording back as interleaved floats (Int16 scaled by 1/32767 like Novocaine)
+    static bool ReadFile(const std::string &path, EffortRecordingInfo *info, std::vector<float> *interleaved,
+                         std::vector<EffortRecordingMarker> *markers);
+
+    // the Rice codec on its own (appends to out), for the reader and the benchmarks
+    static void EncodeRice(const int16_t *interleaved, int64_t numFrames, int numChannels, std::vector<uint8_t> *out);
+    static bool DecodeRice(const uint8_t *data, int64_t numBytes, int64_t numFrames, int numChannels, int16_t *interleaved);
+
+protected:
+    // writer thread: every byte of the file goes through here, one call per chunk
+    virtual bool WriteBytes(const void *data, size_t numBytes);
+
+    void WriterLoop();
+    void DrainRing(bool final);
+    void DrainMarkers();
+    bool WriteChunk(const char *tag, int64_t firstFrame, int64_t numFrames, const void *payload, size_t payloadBytes);
+    void WriteAudioChunk(int64_t numFrames);
+
+    double mRingSeconds;
+    FILE *mFile;
+    EffortRecordingInfo mInfo;
+    int64_t mNumChannels;
+    int64_t mFramesPerChunk;
+    int64_t mFileOffset;
+    std::thread mWriter;
+    std::atomic<bool> mIsRecording;
+    std::atomic<bool> mStopRequested;
+    std::atomic<bool> mHasFailed;
+    std::atomic<int> mNumCallbacksInside;  // callbacks past the recording check, Stop waits for them to leave
+
+    // ring of interleaved floats, one producer (audio thread) and one consumer (writer)
+    float *mData;
+    int64_t mSizeOfBuffer;      // power of two so positions wrap with a mask
+    int64_t mMask;
+    alignas(64) std::atomic<int64_t> mWriteCount;
+    alignas(64) std::atomic<int64_t> mReadCount;
+    alignas(64) std::atomic<int64_t> mDroppedFrames;
+
+    // markers from any thread: a slot is claimed with one fetch_add and published with its ready flag
+    struct MarkerSlot {
+        EffortRecordingMarker marker;
+        std::atomic<bool> ready;
+    };
+    MarkerSlot mMarkers[kMaxRecorderMarkers];
+    std::atomic<int64_t> mNumMarkersClaimed;
+    std::atomic<int64_t> mDroppedMarkers;
+    int64_t mNumMarkersWritten;
+    std::chrono::steady_clock::time_point mStartClock;
+
+    // writer thread scratch, sized once at Start
+    std::vector<float> mChunkFloats;
+    std::vector<int16_t> mChunkShorts;
+    std::vector<uint8_t> mCodedBytes;
+    std::vector<uint8_t> mChunkBytes;     // header and payload, one write per chunk
+    struct IndexEntry { int64_t offset; int64_t firstFrame; int64_t numFrames; };
+    std::vector<IndexEntry> mIndex;
+    std::atomic<int64_t> mNumFramesWritten;
+    std::atomic<int64_t> mNumBytesWritten;
+};
+
+#endif
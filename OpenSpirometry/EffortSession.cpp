@@ -0,0 +1,376 @@
+//
+//  EffortSession.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "EffortSession.h"
+#include <math.h>
+#include <algorithm>
+
+static int64_t DecimationFactorForWhistle(const WhistleModel &whistle, float samplingRate)
+{
+    if (!whistle.useBandLimitedSpectrum)
+        return 1;
+    return ZoomSpectrum::DecimationFactorForBand(BUFFER_SIZE, BUFFER_SIZE-(BUFFER_OVERLAP), samplingRate, whistle.MaxFrequency());
+}
+
+EffortSession::EffortSession(float samplingRate, const WhistleModel &whistle, int64_t blockSize, int numChannels) :
+mSamplingRate(samplingRate),
+mBlockSize(blockSize),
+mWhistle(whistle),
+mFramer(BUFFER_SIZE, BUFFER_SIZE-(BUFFER_OVERLAP), 4*BUFFER_SIZE, 1, numChannels),
+mSpectrum(BUFFER_SIZE, samplingRate, whistle.MinFrequency(), whistle.MaxFrequency(), DecimationFactorForWhistle(whistle, samplingRate)),
+mPeakFinder(mSpectrum.FrequencyResolution(), BUFFER_SIZE/2),
+mTracker(mSpectrum.FrequencyResolution(), BUFFER_SIZE/2, mSpectrum.FirstBin(), mSpectrum.LastBin(),
+         (BUFFER_SIZE-(BUFFER_OVERLAP))/(double)samplingRate, (float)(MAX_FLOW_SLEW_IN_LPS_PER_SECOND/whistle.coefficient)),
+mUseTracker(USE_FUNDAMENTAL_TRACKER),
+mShortWindow(samplingRate, SHORT_WINDOW_SIZE, BUFFER_SIZE-(BUFFER_OVERLAP), whistle.MinFrequency(), whistle.MaxFrequency(),
+             (float)(MAX_FLOW_SLEW_IN_LPS_PER_SECOND/whistle.coefficient)),
+mResolution(samplingRate),
+mUseMultiResolution(USE_MULTIRESOLUTION_ANALYSIS),
+mSelector(samplingRate, whistle.MinFrequency(), whistle.MaxFrequency()),
+mDetector(samplingRate, whistle.MinFrequency(), whistle.MaxFrequency(), (BUFFER_SIZE-(BUFFER_OVERLAP))/(double)samplingRate),
+mUseDetector(USE_ARTIFACT_DETECTOR),
+mStageTracker(samplingRate),
+mEstimateLog(NULL),
+mMagnitude(BUFFER_SIZE/2, 0.0f),
+mPeaks((size_t)SpectrumPeakFinder::MaxNumPeaks(BUFFER_SIZE/2, PEAK_WINDOW_SIZE))
+{
+    mBandMagnitude.reserve((size_t)(mSpectrum.LastBin() - mSpectrum.FirstBin() + 1));
+    mSpectrum.FillBufferOutsideBand(&mMagnitude[0], SPECTRUM_FLOOR_DB);
+    Clear();
+}
+
+void EffortSession::Clear()
+{
+    mFramer.Clear();
+    mSpectrum.Clear();
+    mStageTracker.Clear();
+    mCurve.Clear();
+    mTracker.Clear();
+    mShortWindow.Clear();
+    mResolution.Clear();
+    mSelector.Clear();
+    mDetector.Clear();
+    mStage = SpirometryStageIsCalibratingSilence;
+    mLastFrequency = -1.0f;
+    mLastConfidence = -1.0f;
+    mLastTimeStamp = -1.0;
+    mSamplesRead = 0;
+    mSpectrumEnd = 0;
+    mNumFramesAnalyzed = 0;
+    mNumFramesSkipped = 0;
+    mNumFlowEstimates = 0;
+    mEffortStartTime = -1.0;
+    mLastToneTime = -1.0;
+    mLongWindowFound = false;
+    mInNoiseTail = false;
+}
+
+SpirometryStage EffortSession::AddNewFloatData(const float *data, int64_t numFrames)
+{
+    return AddNewInterleavedFloatData(data, numFrames, 1);
+}
+
+SpirometryStage EffortSession::AddNewInterleavedFloatData(const float *data, int64_t numFrames, int64_t numChannels)
+{
+    int64_t position = 0;
+    while (position < numFrames && mStage < SpirometryStageIsFinished) {
+        int64_t numInBlock = numFrames - position < mBlockSize ? numFrames - position : mBlockSize;
+        AddBlock(&data[position*numChannels], numInBlock, numChannels);
+        position += numInBlock;
+    }
+    return mStage;
+}
+
+void EffortSession::AddBlock(const float *data, int64_t numFrames, int64_t numChannels)
+{
+    mFramer.AddNewInterleavedFloatData(data, numFrames, numChannels);
+    mSamplesRead += numFrames;
+
+    // loudest sample of the channel being analyzed, like vDSP_maxv over the callback's buffer
+    // (the loudest of all of them would hold the effort open on the noisiest mic)
+    int64_t channel = mSelector.SelectedChannel() < numChannels ? mSelector.SelectedChannel() : 0;
+    float maxValue = data[channel];
+    for (int64_t i = 1; i < numFrames; i++)
+        if (data[i*numChannels + channel] > maxValue)
+            maxValue = data[i*numChannels + channel];
+
+    // windows are analyzed as soon as they are full, the stage is checked every block
+    ProcessAvailableFrames();
+    mStageTracker.AddBlock(maxValue, numFrames);
+    mStage = mStageTracker.Stage();
+
+    if (mStage == SpirometryStageIsFinished)
+        FinalizeEffort();
+    else if (mStage == SpirometryStageDidTimeOutWaitingForEffort)
+        mFramer.Clear();
+}
+
+SpirometryStage EffortSession::FinishStream()
+{
+    if (mStage > SpirometryStageIsWaitingForTestToBegin && mStage < SpirometryStageIsFinished) {
+        mStage = SpirometryStageIsFinished;
+        FinalizeEffort();
+    }
+    return mStage;
+}
+
+bool EffortSession::GetResults(FlowVolumeResults *results)
+{
+    if (!mCurve.IsFinalized())
+        return false;
+    *results = mResults;
+    return true;
+}
+
+void EffortSession::FinalizeEffort()
+{
+    ProcessAvailableFrames();
+    FinishAnalysis();
+    mCurve.FinalizeCurves(&mResults);
+}
+
+void EffortSession::FinishAnalysis()
+{
+    if (mUseDetector) {
+        // coughs and voice that were still going or came after the effort started
+        mDetector.Finish();
+        for (int64_t a = 0; a < mDetector.NumArtifacts(); a++) {
+            const ArtifactInterval &artifact = mDetector.Artifact(a);
+            if (mEffortStartTime < 0 || artifact.endTime < mEffortStartTime)
+                continue;
+            if (artifact.kind == FrameClassCough)
+                mCurve.AddArtifact("Cough Detected During Test", "Cough", artifact.startTime, artifact.endTime);
+            else
+                mCurve.AddArtifact("Voice Detected During Test", "Voice", artifact.startTime, artifact.endTime);
+        }
+    }
+}
+
+void EffortSession::ProcessAvailableFrames()
+{
+    FrameView frame;
+    FrameView frames[kMaxNumFramerChannels];
+    int numChannels = mFramer.NumChannels();
+    while (mFramer.PeekFrame(&frame)) {
+        frames[0] = frame; // windows come out on channel 0
+        for (int c = 1; c < numChannels; c++)
+            frames[c] = mFramer.ChannelFrame(frame, c);
+        AnalyzeFrame(SelectChannel(frames, numChannels), NULL);
+        mFramer.ReleaseFrame();
+    }
+}
+
+bool EffortSession::AnalyzeWindow(const FrameView *channelFrames, int numChannels, SpirometryStage stage, LatencyTrace *trace)
+{
+    mStage = stage;
+    int64_t numFlowEstimates = mNumFlowEstimates;
+    AnalyzeFrame(SelectChannel(channelFrames, numChannels), trace);
+    if (trace)
+        LatencyMonitor::MarkStage(trace, LatencyStagePeaksDone);
+    return mNumFlowEstimates > numFlowEstimates;
+}
+
+// the channel the whistle is clearest on, the running spectrum and the phase reference start over when it changes
+FrameView EffortSession::SelectChannel(const FrameView *channelFrames, int numChannels)
+{
+    if (numChannels <= 1)
+        return channelFrames[0];
+    int previous = mSelector.SelectedChannel();
+    int channel = mSelector.Select(channelFrames, numChannels);
+    if (channel != previous) {
+        mSpectrum.Clear();
+        mShortWindow.Clear();
+    }
+    return channelFrames[channel];
+}
+
+// what the window holds, false if the whistle band has had no tone since the time its estimate would be stamped at
+// (a long window still holds the end of a whistle that stopped, up to half a window after it at its center);
+// noise is still searched while the last long window found the whistle, the tail of an effort fades below
+// the newest samples' crest well before it fades out of the long window, only coughs and voice are dropped
+// (the search then keeps a peak only if it stands NOISE_TAIL_MIN_PEAK_OVER_FLOOR_DB over the band's floor)
+bool EffortSession::ClassifyFrame(const FrameView &frame)
+{
+    if (!mUseDetector)
+        return true;
+    FrameClass frameClass = mDetector.Classify(frame);
+    double frameEnd = (frame.firstSampleIndex + frame.Length())/(double)mSamplingRate;
+    if (mEffortStartTime < 0 && mStage >= SpirometryStageIsExhaling)
+        mEffortStartTime = frameEnd;
+    if (mDetector.Features().hasTone)
+        mLastToneTime = frameEnd;
+    mInNoiseTail = mLastToneTime < LongWindowTimeStamp(frame);
+    if (!mInNoiseTail)
+        return true;
+    return mLongWindowFound && frameClass == FrameClassNoise;
+}
+
+void EffortSession::AnalyzeFrame(const FrameView &frame, LatencyTrace *trace)
+{
+    bool hasTone = ClassifyFrame(frame);
+    if (UsesShortWindows()) { // a transform of their own, as cheap as the features, searched either way
+        AnalyzeShortWindow(frame);
+        if (trace)
+            LatencyMonitor::MarkStage(trace, LatencyStageFFTDone); // transform and search are one step
+        return;
+    }
+
+    // only the samples past the running spectrum's end are added, the newest hop unless windows were skipped;
+    // it starts again from the whole window when it is empty or a window or more of the stream is missing
+    int64_t frameEnd = frame.firstSampleIndex + frame.Length();
+    int64_t numNewSamples = frameEnd - mSpectrumEnd;
+    // more windows skipped than the tracker goes between full band checks: its lock can have slid onto the
+    // older audio still in the window (a harmonic, or the flow before the gap), so it acquires again
+    if (mSpectrum.NumFramesSeen() > 0 && numNewSamples > (kTrackerVerifyInterval+1)*mFramer.HopLength())
+        mTracker.Reacquire((numNewSamples - mFramer.HopLength())/(double)mSamplingRate);
+    if (mSpectrum.NumFramesSeen() == 0 || numNewSamples < 0 || numNewSamples >= frame.Length()) {
+        mSpectrum.Clear();
+        numNewSamples = frame.Length();
+    }
+    mSpectrumEnd = frameEnd;
+    int64_t offset = frame.Length() - numNewSamples;
+    if (offset < frame.firstLength) {
+        int64_t numInFirst = frame.firstLength - offset < numNewSamples ? frame.firstLength - offset : numNewSamples;
+        mSpectrum.AddNewFloatData(&frame.first[offset], numInFirst);
+        if (numNewSamples > numInFirst)
+            mSpectrum.AddNewFloatData(frame.second, numNewSamples - numInFirst);
+    }
+    else {
+        mSpectrum.AddNewFloatData(&frame.second[offset - frame.firstLength], numNewSamples);
+    }
+    if (trace)
+        LatencyMonitor::MarkStage(trace, LatencyStageFFTDone);
+    if (mUseTracker) {
+        // only the bins around the predicted fundamental, unless the tracker needs the whole band
+        int64_t firstBin, lastBin;
+        bool tracked = mTracker.SearchBins(&firstBin, &lastBin);
+        mNumFramesAnalyzed++;
+        if (!hasTone) { // the whole band search would come back empty or with noise, and the tracker would follow it
+            mNumFramesSkipped++;
+            mLongWindowFound = false;
+            return;
+        }
+        if (mInNoiseTail) { // the whole band, for its floor
+            firstBin = mSpectrum.FirstBin();
+            lastBin = mSpectrum.LastBin();
+        }
+        mSpectrum.CopydBMagnitudeToBuffer(&mMagnitude[0], firstBin, lastBin);
+
+        FundamentalEstimate estimate;
+        bool found = mTracker.Update(&mMagnitude[0], &estimate);
+        if (!found && tracked) { // lost, look at the whole band of this window
+            mTracker.SearchBins(&firstBin, &lastBin);
+            mSpectrum.CopydBMagnitudeToBuffer(&mMagnitude[0], firstBin, lastBin);
+            found = mTracker.Update(&mMagnitude[0], &estimate);
+        }
+        if (!mUseDetector && estimate.numFullBandPeaks > NUM_PEAKS_IS_COUGH) // identify spectra with many peaks as cough
+            mCurve.AddCustomError("Cough Detected During Test", "Cough");
+        if (found && mInNoiseTail && estimate.magnitude < BandFloor() + NOISE_TAIL_MIN_PEAK_OVER_FLOOR_DB)
+            found = false; // the whistle has faded into the room, its peaks are as high as the noise's own
+        mLongWindowFound = found;
+        if (found)
+            AddFlowEstimate(estimate.frequency, estimate.confidence, LongWindowTimeStamp(frame));
+        return;
+    }
+
+    mNumFramesAnalyzed++;
+    if (!hasTone) {
+        mNumFramesSkipped++;
+        mLongWindowFound = false;
+        return;
+    }
+    mSpectrum.CopydBMagnitudeToBuffer(&mMagnitude[0]);
+
+    // find local maxima and identify most likely harmonics of whistle
+    // bins above the band are at the floor and can never be peaks, so the search stops one window past it
+    float minimumMagnitude = mLastFrequency > 0 ? PEAK_DBMAG_SUSTAINED : PEAK_DBMAG_START;
+    int64_t searchLength = mSpectrum.LastBin() + 1 + (PEAK_WINDOW_SIZE);
+    if (searchLength > (int64_t)mMagnitude.size())
+        searchLength = (int64_t)mMagnitude.size();
+    int64_t numPeaks = mPeakFinder.GetFundamentalPeaks(&mMagnitude[0], searchLength, PEAK_WINDOW_SIZE,
+                                                       minimumMagnitude, MIN_FREQUENCY_OF_WHISTLE_IN_HZ,
+                                                       &mPeaks[0], (int64_t)mPeaks.size(), 3);
+    mLongWindowFound = numPeaks > 0;
+    if (numPeaks == 0)
+        return;
+
+    if (!mUseDetector && numPeaks > NUM_PEAKS_IS_COUGH) // identify spectra with many peaks as cough
+        mCurve.AddCustomError("Cough Detected During Test", "Cough");
+
+    float frequency = mPeaks[0].frequency;
+    float magnitude = mPeaks[0].magnitude;
+    if (mLastFrequency > 0) {
+        // grab the closest of the top three to the last detection, if its magnitude is close to the max
+        float minDistance = 100000.0f;
+        float bestFrequency = -1;
+        float bestMag = mPeaks[0].magnitude;
+        for (int64_t p = 0; p < numPeaks && p < 3; p++) {
+            float tmp = fabsf(mPeaks[p].frequency - mLastFrequency);
+            if (tmp < minDistance && mPeaks[p].magnitude/bestMag > 0.1) {
+                minDistance = tmp;
+                bestFrequency = mPeaks[p].frequency;
+                magnitude = mPeaks[p].magnitude;
+            }
+        }
+        if (bestFrequency > 0)
+            frequency = bestFrequency;
+    }
+    if (mInNoiseTail && magnitude < BandFloor() + NOISE_TAIL_MIN_PEAK_OVER_FLOOR_DB) {
+        mLongWindowFound = false;
+        return;
+    }
+    AddFlowEstimate(frequency, -1.0f, LongWindowTimeStamp(frame));
+}
+
+// median of the whistle band in the newest magnitudes: the room's level, the whistle only covers a few bins
+float EffortSession::BandFloor()
+{
+    mBandMagnitude.assign(mMagnitude.begin() + mSpectrum.FirstBin(), mMagnitude.begin() + mSpectrum.LastBin() + 1);
+    std::nth_element(mBandMagnitude.begin(), mBandMagnitude.begin() + mBandMagnitude.size()/2, mBandMagnitude.end());
+    return mBandMagnitude[mBandMagnitude.size()/2];
+}
+
+// the long window is stamped at its start, or at its center next to short windows (also stamped at theirs)
+double EffortSession::LongWindowTimeStamp(const FrameView &frame)
+{
+    int64_t position = mUseMultiResolution ? frame.firstSampleIndex + frame.Length()/2 : frame.firstSampleIndex;
+    return position/(double)mSamplingRate;
+}
+
+void EffortSession::AnalyzeShortWindow(const FrameView &frame)
+{
+    mNumFramesAnalyzed++;
+    ShortWindowEstimate estimate;
+    float flow = -1.0f;
+    // breath and room noise before the blast can pass for a whistle in so short a window, the stage is louder evidence
+    if (mShortWindow.Analyze(frame, &estimate) && mStage >= SpirometryStageIsExhaling) {
+        flow = mWhistle.FlowFromFrequency(estimate.frequency);
+        int64_t center = frame.firstSampleIndex + frame.Length() - mShortWindow.WindowLength()/2;
+        AddFlowEstimate(estimate.frequency, estimate.confidence, center/(double)mSamplingRate);
+    }
+    // the long window starts from this frame's audio when the tail begins, near the last short estimate
+    mResolution.Update(mStage, frame.firstSampleIndex + frame.Length(), flow);
+    if (!mResolution.UsesShortWindows())
+        mTracker.SetLastFrequency(mLastFrequency);
+}
+
+void EffortSession::AddFlowEstimate(float frequency, float confidence, double timeStamp)
+{
+    // after the switch the long window's first centers are still behind the last short window
+    if (timeStamp <= mLastTimeStamp)
+        return;
+    mLastFrequency = frequency;
+    mLastConfidence = confidence;
+    mLastTimeStamp = timeStamp;
+    mCurve.AddFlowEstimate(mWhistle.FlowFromFrequency(frequency), timeStamp);
+    mNumFlowEstimates++;
+    if (mEstimateLog) {
+        WhistleEstimate estimate = {timeStamp, frequency, confidence};
+        mEstimateLog->push_back(estimate);
+    }
+}
@@ -0,0 +1,154 @@
+//
+//  EffortSession.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  The effort pipeline, without Novocaine or GCD: stage detection, band limited (optionally
+//  decimated) spectrum, fundamental tracking (or peak picking over the whole band every window),
+//  short windows for the blast and peak (multi-resolution), whistle model and flow/volume curves.
+//  Audio is pushed in by the caller as fast as it likes, so recorded efforts can be replayed
+//  faster than real time. SpirometerEffortAnalyzer frames the audio and follows the stages on the
+//  audio thread itself, and hands each window to AnalyzeWindow on its analysis queue. Nothing is
+//  kept in statics, so independent sessions can run on different threads. With more than one channel, each window
+//  is analyzed on the channel ChannelSelector finds the whistle clearest on. Each window is first
+//  classified by ArtifactDetector, peaks are searched for in windows with a tone in the whistle
+//  band and in noise windows while the whistle is still found above the room (the fading end of an effort), and
+//  the coughs and voice it finds during the effort are listed in the errors.
+
+#ifndef OpenSpirometry_EffortSession_h
+#define OpenSpirometry_EffortSession_h
+
+#include <stdint.h>
+#include <vector>
+#include "SpirometerConstants.h"
+#include "OverlapFramer.h"
+#include "ZoomSpectrum.h"
+#include "SpectrumPeakFinder.h"
+#include "FundamentalTracker.h"
+#include "ShortWindowEstimator.h"
+#include "ChannelSelector.h"
+#include "ArtifactDetector.h"
+#include "EffortStageTracker.h"
+#include "FlowVolumeCurve.h"
+#include "WhistleModel.h"
+#include "LatencyMonitor.h"
+
+// one whistle frequency behind a flow estimate, before the whistle model turns it into flow
+struct WhistleEstimate {
+    double timeStamp;           // seconds into the stream
+    float frequency;
+    float confidence;           // -1 from the whole band search
+};
+
+class EffortSession {
+
+public:
+    // blockSize is the callback size the stage detector sees (Novocaine hands out about 1024 frames),
+    // numChannels up to kMaxNumFramerChannels
+    EffortSession(float samplingRate, const WhistleModel &whistle = WhistleModel(), int64_t blockSize = 1024, int numChannels = 1);
+
+    // returns the stage after the data, audio after the effort has finished is ignored
+    SpirometryStage AddNewFloatData(const float *data, int64_t numFrames);
+    SpirometryStage AddNewInterleavedFloatData(const float *data, int64_t numFrames, int64_t numChannels);
+    // end of the recording, finishes the effort if exhaling had started (like requestThatEffortShouldEnd)
+    SpirometryStage FinishStream();
+    bool GetResults(FlowVolumeResults *results); // false if the effort never finished, columns live until Clear
+    void Clear();
+
+    // the analysis on its own, for a caller that frames the audio and follows the stages itself: the
+    // window on each channel and the stage it was heard in, true if it added a flow estimate (the
+    // trace, if any, is marked when the spectrum and the search are done)
+    bool AnalyzeWindow(const FrameView *channelFrames, int numChannels, SpirometryStage stage, LatencyTrace *trace = NULL);
+    // the coughs and voice of the effort go in the curve's errors, for a caller that finalizes the curve itself
+    void FinishAnalysis();
+    // follow the fundamental with FundamentalTracker (default USE_FUNDAMENTAL_TRACKER) or search the whole
+    // band every window, set before the audio
+    void SetFundamentalTracking(bool useTracker) { mUseTracker = useTracker; }
+    // short windows until the tail, then the long window (default USE_MULTIRESOLUTION_ANALYSIS), or the long
+    // window all the way; estimates are then stamped at their window's center, set before the audio
+    void SetMultiResolution(bool useShortWindows) { mUseMultiResolution = useShortWindows; }
+    // every estimate is also appended here (for offline calibration, the vector grows), NULL for none;
+    // not cleared by Clear
+    void SetEstimateLog(std::vector<WhistleEstimate> *log) { mEstimateLog = log; }
+    // classify windows first and skip the peak search without a tone, unless it is noise after a window that
+    // found the whistle (default USE_ARTIFACT_DETECTOR), or search every window and call many fundamentals
+    // a cough, set before the audio
+    void SetArtifactDetection(bool useDetector) { mUseDetector = useDetector; }
+
+    SpirometryStage CurrentStage() { return mStage; }
+    StageEventQueue &StageEvents() { return mStageTracker.Events(); } // stage changes since Clear, for a consumer on another thread
+    float SamplingRate() { return mSamplingRate; }
+    int64_t DecimationFactor() { return mSpectrum.DecimationFactor(); }
+    int64_t FirstBin() { return mSpectrum.FirstBin(); }
+    int64_t LastBin() { return mSpectrum.LastBin(); }
+    int64_t SpectrumDelayInSamples() { return mSpectrum.DelayInSamples(); } // decimating filter delay, 0 for the full band
+    int64_t SamplesRead() { return mSamplesRead; }
+    int64_t NumFramesAnalyzed() { return mNumFramesAnalyzed; }
+    int64_t NumFramesSkipped() { return mNumFramesSkipped; } // of those, no tone to search for
+    int64_t NumFlowEstimates() { return mNumFlowEstimates; }
+    float LastFrequency() { return mLastFrequency; } // whistle frequency behind the newest flow estimate, -1 before the first
+    float LastConfidence() { return mLastConfidence; } // of that frequency, 0 to 1 (-1 from the whole band search)
+    float LastFlow() { return mWhistle.FlowFromFrequency(mLastFrequency); } // that frequency through the whistle model
+    double LastTimeStamp() { return mLastTimeStamp; } // of the newest flow estimate, seconds into the stream
+    bool UsesShortWindows() { return mUseMultiResolution && mResolution.UsesShortWindows(); }
+    int64_t ResolutionSwitchFrame() { return mResolution.SwitchFrame(); } // -1 until the long window takes over
+    FundamentalTracker &Tracker() { return mTracker; }
+    int NumChannels() { return mFramer.NumChannels(); }
+    int SelectedChannel() { return mSelector.SelectedChannel(); } // of the newest window
+    int64_t NumChannelSwitches() { return mSelector.NumSwitches(); }
+    ArtifactDetector &Detector() { return mDetector; }
+    FlowVolumeCurve &Curve() { return mCurve; }
+    const WhistleModel &Whistle() { return mWhistle; }
+
+protected:
+    void AddBlock(const float *data, int64_t numFrames, int64_t numChannels);
+    void ProcessAvailableFrames();
+    FrameView SelectChannel(const FrameView *channelFrames, int numChannels);
+    void AnalyzeFrame(const FrameView &frame, LatencyTrace *trace);
+    void AnalyzeShortWindow(const FrameView &frame);
+    double LongWindowTimeStamp(const FrameView &frame);
+    bool ClassifyFrame(const FrameView &frame);
+    float BandFloor();
+    void AddFlowEstimate(float frequency, float confidence, double timeStamp);
+    void FinalizeEffort();
+
+    float mSamplingRate;
+    int64_t mBlockSize;
+    WhistleModel mWhistle;
+    OverlapFramer mFramer;
+    ZoomSpectrum mSpectrum;         // decimated to the whistle band if the whistle asks for it
+    SpectrumPeakFinder mPeakFinder;
+    FundamentalTracker mTracker;
+    bool mUseTracker;
+    ShortWindowEstimator mShortWindow;
+    ResolutionSwitch mResolution;
+    bool mUseMultiResolution;
+    ChannelSelector mSelector;
+    ArtifactDetector mDetector;
+    bool mUseDetector;
+    EffortStageTracker mStageTracker;
+    FlowVolumeCurve mCurve;
+    FlowVolumeResults mResults;
+    std::vector<WhistleEstimate> *mEstimateLog;
+
+    std::vector<float> mMagnitude;
+    std::vector<float> mBandMagnitude;  // scratch for BandFloor
+    std::vector<SpectrumPeak> mPeaks;   // sized once, top three first after each search
+    SpirometryStage mStage;
+    float mLastFrequency;
+    float mLastConfidence;
+    double mLastTimeStamp;
+    int64_t mSamplesRead;
+    int64_t mSpectrumEnd;           // stream position after the newest sample in mSpectrum
+    int64_t mNumFramesAnalyzed;
+    int64_t mNumFramesSkipped;
+    int64_t mNumFlowEstimates;
+    double mEffortStartTime;        // stream time of the first window analyzed while exhaling, -1 before
+    double mLastToneTime;           // end of the newest window with a tone in the whistle band, -1 before
+    bool mLongWindowFound;          // the newest long window searched found the whistle
+    bool mInNoiseTail;              // the newest window is searched only because the whistle was still found
+};
+
+#endif
@@ -0,0 +1,215 @@
+//
+//  EffortSessionPool.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "EffortSessionPool.h"
+#include <algorithm>
+#include <new>
+#include <stdlib.h>
+
+#define kMaxSpareChunks 8
+
+PooledEffortSession::PooledEffortSession(EffortSessionPool *pool, float samplingRate, const WhistleModel &whistle, int64_t blockSize) :
+mPool(pool),
+mSession(samplingRate, whistle, blockSize),
+mIsScheduled(false),
+mFinishRequested(false),
+mFinished(false),
+mStage(SpirometryStageIsCalibratingSilence),
+mNumChunksAnalyzed(0)
+{
+}
+
+void PooledEffortSession::AddNewFloatData(const float *data, int64_t numFrames)
+{
+    if (numFrames <= 0)
+        return;
+
+    std::vector<float> chunk;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mFinishRequested)
+            return;
+        if (!mSpare.empty()) {
+            chunk.swap(mSpare.back());
+            mSpare.pop_back();
+        }
+    }
+    chunk.assign(data, data + numFrames); // copy outside the lock, the worker may be popping
+
+    bool shouldSchedule = false;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mPending.push_back(std::vector<float>());
+        mPending.back().swap(chunk);
+        if (!mIsScheduled) {
+            mIsScheduled = true;
+            shouldSchedule = true;
+        }
+    }
+    if (shouldSchedule)
+        mPool->Schedule(this);
+}
+
+void PooledEffortSession::FinishStream()
+{
+    bool shouldSchedule = false;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mFinishRequested)
+            return;
+        mFinishRequested = true;
+        if (!mIsScheduled) {
+            mIsScheduled = true;
+            shouldSchedule = true;
+        }
+    }
+    if (shouldSchedule)
+        mPool->Schedule(this);
+}
+
+SpirometryStage PooledEffortSession::WaitUntilIdle()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+    while (mIsScheduled)
+        mIdleCondition.wait(lock);
+    return CurrentStage();
+}
+
+bool PooledEffortSession::GetResults(FlowVolumeResults *results)
+{
+    WaitUntilIdle();
+    return mSession.GetResults(results);
+}
+
+bool PooledEffortSession::RunTurn()
+{
+    for (int turn = 0; turn < kMaxChunksPerTurn; turn++) {
+        std::vector<float> chunk;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            if (mPending.empty())
+                break;
+            chunk.swap(mPending.front());
+            mPending.pop_front();
+        }
+
+        mSession.AddNewFloatData(&chunk[0], (int64_t)chunk.size());
+        mStage.store(mSession.CurrentStage(), std::memory_order_release);
+        mNumChunksAnalyzed.fetch_add(1, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mSpare.size() < kMaxSpareChunks) {
+            mSpare.push_back(std::vector<float>());
+            mSpare.back().swap(chunk);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (!mPending.empty())
+            return true; // stays scheduled, back of the ready list
+        if (!mFinishRequested || mFinished) {
+            // cleared under the same lock the producers check, so no chunk is left unscheduled
+            mIsScheduled = false;
+            mIdleCondition.notify_all();
+            return false;
+        }
+        mFinished = true; // no chunks are taken once the finish is requested
+    }
+
+    mSession.FinishStream();
+    mStage.store(mSession.CurrentStage(), std::memory_order_release);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mIsScheduled = false;
+    mIdleCondition.notify_all();
+    return false;
+}
+
+//=============================================================================================================
+
+EffortSessionPool::EffortSessionPool(int numWorkers) :
+mShuttingDown(false)
+{
+    if (numWorkers <= 0)
+        numWorkers = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 0; i < numWorkers; i++)
+        mWorkers.push_back(std::thread(&EffortSessionPool::WorkerLoop, this));
+}
+
+EffortSessionPool::~EffortSessionPool()
+{
+    std::vector<PooledEffortSession*> sessions;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        sessions = mSessions;
+    }
+    for (size_t i = 0; i < sessions.size(); i++)
+        CloseSession(sessions[i]);
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mShuttingDown = true;
+    }
+    mReadyCondition.notify_all();
+    for (size_t i = 0; i < mWorkers.size(); i++)
+        mWorkers[i].join();
+}
+
+PooledEffortSession *EffortSessionPool::OpenSession(float samplingRate, const WhistleModel &whistle, int64_t blockSize)
+{
+    // the framer's cache line aligned counters need more than plain new guarantees before C++17
+    void *memory = NULL;
+    if (posix_memalign(&memory, alignof(PooledEffortSession), sizeof(PooledEffortSession)) != 0)
+        throw std::bad_alloc();
+    PooledEffortSession *session = new (memory) PooledEffortSession(this, samplingRate, whistle, blockSize);
+    std::lock_guard<std::mutex> lock(mLock);
+    mSessions.push_back(session);
+    return session;
+}
+
+void EffortSessionPool::CloseSession(PooledEffortSession *session)
+{
+    session->WaitUntilIdle();
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        std::vector<PooledEffortSession*>::iterator found = std::find(mSessions.begin(), mSessions.end(), session);
+        if (found == mSessions.end())
+            return;
+        mSessions.erase(found);
+    }
+    session->~PooledEffortSession();
+    free(session);
+}
+
+void EffortSessionPool::Schedule(PooledEffortSession *session)
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mReady.push_back(session);
+    }
+    mReadyCondition.notify_one();
+}
+
+void EffortSessionPool::WorkerLoop()
+{
+    while (true) {
+        PooledEffortSession *session;
+        {
+            std::unique_lock<std::mutex> lock(mLock);
+            while (!mShuttingDown && mReady.empty())
+                mReadyCondition.wait(lock);
+            if (mReady.empty())
+                return;
+            session = mReady.front();
+            mReady.pop_front();
+        }
+        if (session->RunTurn())
+            Schedule(session);
+    }
+}
@@ -0,0 +1,92 @@
+//
+//  EffortSessionPool.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Many EffortSessions analyzed side by side on a fixed set of worker threads, for ingesting
+//  uploaded efforts on a server. Audio chunks can be handed to a session from any thread: they
+//  are copied into the session's queue and the session is put on the pool's ready list. A worker
+//  takes a session off the list, analyzes a few of its chunks and puts it back at the end if it
+//  has more, so one busy stream cannot starve the others. A session is only ever on the list
+//  once, so its chunks are analyzed in order by one worker at a time and EffortSession needs no
+//  locking of its own. Sessions share nothing else, so throughput grows with the workers.
+
+#ifndef OpenSpirometry_EffortSessionPool_h
+#define OpenSpirometry_EffortSessionPool_h
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "EffortSession.h"
+
+#define kMaxChunksPerTurn 4 // chunks a worker analyzes before giving the next session a turn
+
+class EffortSessionPool;
+
+class PooledEffortSession {
+
+public:
+    // any thread: copies the chunk, analysis happens on a worker (ignored after FinishStream)
+    void AddNewFloatData(const float *data, int64_t numFrames);
+    // any thread: end of the recording, the effort is finished after the chunks already added
+    void FinishStream();
+    // blocks until every chunk added so far has been analyzed (and the stream finished, if asked)
+    SpirometryStage WaitUntilIdle();
+    bool GetResults(FlowVolumeResults *results); // after WaitUntilIdle, see EffortSession::GetResults
+
+    SpirometryStage CurrentStage() { return (SpirometryStage)mStage.load(std::memory_order_acquire); }
+    EffortSession &Session() { return mSession; } // only while idle
+    int64_t NumChunksAnalyzed() { return mNumChunksAnalyzed.load(std::memory_order_relaxed); }
+
+protected:
+    friend class EffortSessionPool;
+    PooledEffortSession(EffortSessionPool *pool, float samplingRate, const WhistleModel &whistle, int64_t blockSize);
+
+    bool RunTurn(); // on a worker, true if there is more to do
+
+    EffortSessionPool *mPool;
+    EffortSession mSession;
+
+    std::mutex mLock;                           // guards everything below
+    std::condition_variable mIdleCondition;
+    std::deque<std::vector<float> > mPending;   // chunks not analyzed yet, oldest first
+    std::vector<std::vector<float> > mSpare;    // analyzed chunks, reused for the next copies
+    bool mIsScheduled;                          // on the ready list or being analyzed
+    bool mFinishRequested;
+    bool mFinished;
+
+    std::atomic<int> mStage;
+    std::atomic<int64_t> mNumChunksAnalyzed;
+};
+
+class EffortSessionPool {
+
+public:
+    EffortSessionPool(int numWorkers = 0); // 0 uses every core
+    ~EffortSessionPool();                  // closes any sessions still open
+
+    PooledEffortSession *OpenSession(float samplingRate, const WhistleModel &whistle = WhistleModel(), int64_t blockSize = 1024);
+    void CloseSession(PooledEffortSession *session); // waits for its queued chunks, then deletes it
+
+    int NumWorkers() { return (int)mWorkers.size(); }
+
+protected:
+    friend class PooledEffortSession;
+    void Schedule(PooledEffortSession *session);
+    void WorkerLoop();
+
+    std::vector<std::thread> mWorkers;
+    std::mutex mLock;                               // guards the ready list, sessions and shutdown
+    std::condition_variable mReadyCondition;
+    std::deque<PooledEffortSession*> mReady;
+    std::vector<PooledEffortSession*> mSessions;
+    bool mShuttingDown;
+};
+
+#endif
@@ -0,0 +1,71 @@
+//
+//  EffortStageDetector.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "EffortStageDetector.h"
+
+EffortStageDetector::EffortStageDetector(float samplingRate) :
+mSamplingRate(samplingRate)
+{
+    Clear();
+}
+
+void EffortStageDetector::Clear()
+{
+    mSilenceThreshold = 0;
+    mSilenceThresholdIsSet = false;
+    mTestStarted = false;
+    mLastGoodTime = 0;
+    mTestStartTime = -1;
+    mSilenceEndedStartTime = 0;
+}
+
+SpirometryStage EffortStageDetector::AnalyzeStageFromAudioMax(float maxValue, int64_t samplesRead)
+{
+    double currentTime = (double)samplesRead/mSamplingRate;
+
+    if (samplesRead < mSamplingRate*2) {
+        // still collecting samples for silence, better be quiet here
+        mSilenceThreshold = maxValue > mSilenceThreshold ? maxValue : mSilenceThreshold;
+        return SpirometryStageIsCalibratingSilence;
+    }
+    else if (!mSilenceThresholdIsSet) {
+        // just finished getting all the samples here, lock in silence threshold
+        mSilenceThresholdIsSet = true;
+        mSilenceEndedStartTime = currentTime;
+    }
+
+    if (mTestStarted) {
+        double elapsedTime = currentTime - mLastGoodTime;
+        double totalEffortTime = currentTime - mSilenceEndedStartTime;
+
+        if (totalEffortTime > TEST_MAX_DURATION_SECONDS)
+            return SpirometryStageIsFinished;
+
+        if (maxValue > TEST_END_THRESH*mSilenceThreshold) {
+            // audio still way above threshold
+            mLastGoodTime = currentTime;
+            return SpirometryStageIsExhaling;
+        }
+        if (elapsedTime > WAIT_DURATION_AFTER_TEST) // has low audio for a while now, end effort
+            return SpirometryStageIsFinished;
+        if (elapsedTime < WAIT_DURATION_AFTER_PEAK) // below threshold, but too close to last update to end
+            return SpirometryStageIsExhaling;
+        return SpirometryStageIsWaitingForEndOfTest;
+    }
+    else if (maxValue > TEST_START_THRESH*mSilenceThreshold) {
+        mTestStarted = true;
+        mLastGoodTime = currentTime;
+        mTestStartTime = currentTime;
+        return SpirometryStageIsExhaling;
+    }
+
+    if (currentTime - mSilenceEndedStartTime > TIME_OUT_WAIT_FOR_TEST_START)
+        return SpirometryStageDidTimeOutWaitingForEffort;
+
+    return SpirometryStageIsWaitingForTestToBegin;
+}
@@ -0,0 +1,41 @@
+//
+//  EffortStageDetector.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Portable port of analyzeStagesFromAudioMax: for replaying recorded audio. Time is the
+//  number of samples seen divided by the sampling rate instead of CACurrentMediaTime(),
+//  so a file gives the same stages no matter how fast it is pushed through.
+
+#ifndef OpenSpirometry_EffortStageDetector_h
+#define OpenSpirometry_EffortStageDetector_h
+
+#include <stdint.h>
+#include "SpirometerConstants.h"
+
+class EffortStageDetector {
+
+public:
+    EffortStageDetector(float samplingRate);
+
+    // call once per block of audio with the block maximum, after the block is counted in samplesRead
+    SpirometryStage AnalyzeStageFromAudioMax(float maxValue, int64_t samplesRead);
+    void Clear();
+
+    float SilenceThreshold() { return mSilenceThreshold; }
+    bool SilenceThresholdIsSet() { return mSilenceThresholdIsSet; }
+    double EffortStartTime() { return mTestStartTime; }   // seconds into the stream, -1 until exhaling starts
+
+protected:
+    float mSamplingRate;
+    float mSilenceThreshold;
+    bool mSilenceThresholdIsSet;
+    bool mTestStarted;
+    double mLastGoodTime;
+    double mTestStartTime;
+    double mSilenceEndedStartTime;
+};
+
+#endif
@@ -0,0 +1,102 @@
+//
+//  EffortStageTracker.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "EffortStageTracker.h"
+#include <math.h>
+
+StageEventQueue::StageEventQueue()
+{
+    Clear();
+}
+
+void StageEventQueue::Clear()
+{
+    mPushed.store(0);
+    mPopped.store(0);
+    mDropped.store(0);
+}
+
+bool StageEventQueue::Push(const StageEvent &event)
+{
+    int64_t pushed = mPushed.load(std::memory_order_relaxed);
+    if (pushed - mPopped.load(std::memory_order_acquire) >= kStageEventQueueLength) {
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    mEvents[pushed % kStageEventQueueLength] = event;
+    mPushed.store(pushed + 1, std::memory_order_release);
+    return true;
+}
+
+bool StageEventQueue::PushIfLessThanHalfFull(const StageEvent &event)
+{
+    if (mPushed.load(std::memory_order_relaxed) - mPopped.load(std::memory_order_acquire) >= kStageEventQueueLength/2)
+        return false; // not worth a transition's room
+    return Push(event);
+}
+
+bool StageEventQueue::Pop(StageEvent *event)
+{
+    int64_t popped = mPopped.load(std::memory_order_relaxed);
+    if (popped == mPushed.load(std::memory_order_acquire))
+        return false;
+    *event = mEvents[popped % kStageEventQueueLength];
+    mPopped.store(popped + 1, std::memory_order_release);
+    return true;
+}
+
+//=============================================================================================================
+
+EffortStageTracker::EffortStageTracker(float samplingRate, double levelIntervalInSeconds) :
+mSamplingRate(samplingRate),
+mDetector(samplingRate)
+{
+    SetLevelInterval(levelIntervalInSeconds);
+    Clear();
+}
+
+void EffortStageTracker::SetLevelInterval(double levelIntervalInSeconds)
+{
+    mLevelIntervalInSamples = levelIntervalInSeconds > 0 ? (int64_t)ceil(levelIntervalInSeconds*mSamplingRate) : 0;
+}
+
+void EffortStageTracker::Clear()
+{
+    mDetector.Clear();
+    mSamplesRead = 0;
+    mLastLevelFrame = -1;
+    mStage.store(SpirometryStageIsCalibratingSilence, std::memory_order_release);
+    mEvents.Clear();
+}
+
+int EffortStageTracker::AddBlock(float maxValue, int64_t numFrames)
+{
+    SpirometryStage previous = Stage();
+    if (previous >= SpirometryStageIsFinished || numFrames <= 0)
+        return 0; // done until Clear
+
+    mSamplesRead += numFrames;
+    SpirometryStage stage = mDetector.AnalyzeStageFromAudioMax(maxValue, mSamplesRead);
+    int numQueued = 0;
+    if (stage != previous) {
+        mStage.store(stage, std::memory_order_release);
+        StageEvent event = {StageEventStageChanged, stage, previous, mSamplesRead, maxValue};
+        numQueued += mEvents.Push(event) ? 1 : 0;
+    }
+
+    // level meter, once the silence is known (like didUpdateAudioBufferWithMaximum always was)
+    if (mLevelIntervalInSamples > 0 && mDetector.SilenceThresholdIsSet() && stage < SpirometryStageIsFinished &&
+        (mLastLevelFrame < 0 || mSamplesRead - mLastLevelFrame >= mLevelIntervalInSamples)) {
+        StageEvent event = {StageEventAudioLevel, stage, stage, mSamplesRead, maxValue};
+        if (mEvents.PushIfLessThanHalfFull(event)) {
+            mLastLevelFrame = mSamplesRead;
+            numQueued++;
+        }
+    }
+    return numQueued;
+}
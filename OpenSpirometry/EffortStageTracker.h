@@ -0,0 +1,94 @@
+//
+//  EffortStageTracker.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  The effort's stage machine (silence calibration, start, end soon, finish and time out) run
+//  where the audio arrives, on the audio thread or whatever feeds a replay. It is
+//  EffortStageDetector driven by sample counts, so the same audio gives the same stages at the
+//  same frames no matter how fast it is pushed through or how busy the main queue is, and it
+//  stops at the first Finished or DidTimeOutWaitingForEffort.
+//
+//  Only changes are reported: each transition (and, if asked for, the block maximum every so
+//  many samples for a level meter) goes into a single producer, single consumer queue that the
+//  main queue drains when it is woken, instead of one main queue dispatch per callback. Pushing
+//  never locks or allocates; level updates are only queued while the queue is less than half
+//  full, so transitions always have room.
+
+#ifndef OpenSpirometry_EffortStageTracker_h
+#define OpenSpirometry_EffortStageTracker_h
+
+#include <stdint.h>
+#include <atomic>
+#include "SpirometerConstants.h"
+#include "EffortStageDetector.h"
+
+#define kStageEventQueueLength 256
+
+enum StageEventType {
+    StageEventStageChanged,
+    StageEventAudioLevel
+};
+
+struct StageEvent {
+    StageEventType type;
+    SpirometryStage stage;              // after the change (the current stage for a level update)
+    SpirometryStage previousStage;
+    int64_t frame;                      // samples read when it happened
+    float maxValue;                     // of the block that caused it
+};
+
+class StageEventQueue {
+
+public:
+    StageEventQueue();
+
+    // producer
+    bool Push(const StageEvent &event); // false (and counted) if full
+    bool PushIfLessThanHalfFull(const StageEvent &event);
+    // consumer
+    bool Pop(StageEvent *event);
+
+    int64_t Size() { return mPushed.load(std::memory_order_acquire) - mPopped.load(std::memory_order_acquire); }
+    int64_t NumDropped() { return mDropped.load(std::memory_order_relaxed); }
+    void Clear(); // neither side running
+
+protected:
+    StageEvent mEvents[kStageEventQueueLength];
+    alignas(64) std::atomic<int64_t> mPushed;
+    alignas(64) std::atomic<int64_t> mPopped;
+    std::atomic<int64_t> mDropped;
+};
+
+class EffortStageTracker {
+
+public:
+    // level updates every levelIntervalInSeconds of audio once the silence is calibrated, 0 for none
+    EffortStageTracker(float samplingRate, double levelIntervalInSeconds = 0);
+
+    // producer: one block of audio by its maximum, returns how many events it queued
+    int AddBlock(float maxValue, int64_t numFrames);
+
+    SpirometryStage Stage() { return (SpirometryStage)mStage.load(std::memory_order_acquire); } // any thread
+    bool IsDone() { return Stage() >= SpirometryStageIsFinished; }
+    int64_t SamplesRead() { return mSamplesRead; }  // producer
+    float SilenceThreshold() { return mDetector.SilenceThreshold(); } // producer
+    StageEventQueue &Events() { return mEvents; }
+
+    // neither side running (between efforts)
+    void Clear();
+    void SetLevelInterval(double levelIntervalInSeconds);
+
+protected:
+    float mSamplingRate;
+    EffortStageDetector mDetector;
+    int64_t mSamplesRead;
+    int64_t mLevelIntervalInSamples;
+    int64_t mLastLevelFrame;            // -1 before the first level update
+    std::atomic<int> mStage;
+    StageEventQueue mEvents;
+};
+
+#endif
@@ -0,0 +1,644 @@
+//
+//  EffortStore.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "EffortStore.h"
+#include "FFTLanes.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <math.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void SetError(std::string *error, const char *message)
+{
+    if (error)
+        *error = message;
+}
+
+template <typename T> static inline void Put(uint8_t *data, int64_t *position, T value)
+{
+    memcpy(&data[*position], &value, sizeof(T));
+    *position += sizeof(T);
+}
+
+template <typename T> static inline T Get(const uint8_t *data, int64_t *position)
+{
+    T value;
+    memcpy(&value, &data[*position], sizeof(T));
+    *position += sizeof(T);
+    return value;
+}
+
+// FNV-1a, as EffortRecorder writes it, enough to notice a torn or corrupt record
+static uint32_t Checksum(const uint8_t *data, size_t numBytes)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < numBytes; i++)
+        hash = (hash ^ data[i])*16777619u;
+    return hash;
+}
+
+static inline int64_t RecordBytes(int64_t numSamples)
+{
+    return kEffortStoreRecordHeaderBytes + ((2*numSamples*(int64_t)sizeof(int16_t) + 7) & ~(int64_t)7);
+}
+
+static inline int16_t Quantize(float value)
+{
+    float counts = roundf(value/kEffortStoreQuantum);
+    return (int16_t)(counts > 32767.0f ? 32767.0f : (counts < -32768.0f ? -32768.0f : counts));
+}
+
+uint32_t EffortStoreFlagsFromResults(const FlowVolumeResults &results)
+{
+    uint32_t flags = results.numErrors == 0 ? EffortStoreFlagAcceptable : 0;
+    for (int64_t e = 0; e < results.numErrors; e++) {
+        if (results.errors[e].key == "Cough")
+            flags |= EffortStoreFlagCough;
+        else if (results.errors[e].key == "Voice")
+            flags |= EffortStoreFlagVoice;
+    }
+    return flags;
+}
+
+EffortStore::EffortStore() :
+mDescriptor(-1)
+{
+    Close();
+}
+
+EffortStore::~EffortStore()
+{
+    Close();
+}
+
+void EffortStore::Close()
+{
+    if (mDescriptor >= 0) {
+        Flush();
+        close(mDescriptor);
+    }
+    mDescriptor = -1;
+    mPath.clear();
+    mSampleInterval = 0;
+    mFileBytes = 0;
+    mNumDroppedBytes = 0;
+    mPending.clear();
+    mEfforts.clear();
+    mNumIndexed = -1;
+}
+
+bool EffortStore::Open(const std::string &path, float sampleInterval, std::string *error)
+{
+    Close();
+    mDescriptor = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (mDescriptor < 0) {
+        SetError(error, "cannot open file");
+        return false;
+    }
+    mPath = path;
+    struct stat status;
+    if (fstat(mDescriptor, &status) != 0) {
+        Close();
+        SetError(error, "cannot open file");
+        return false;
+    }
+
+    if (status.st_size == 0) {
+        uint8_t header[kEffortStoreHeaderBytes] = {0};
+        int64_t position = 0;
+        Put<uint32_t>(header, &position, kEffortStoreMagic);
+        Put<uint32_t>(header, &position, kEffortStoreVersion);
+        Put<uint32_t>(header, &position, kEffortStoreHeaderBytes);
+        Put<uint32_t>(header, &position, kEffortStoreRecordHeaderBytes);
+        Put<float>(header, &position, sampleInterval);
+        if (pwrite(mDescriptor, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            Close();
+            SetError(error, "cannot write the header");
+            return false;
+        }
+        mSampleInterval = sampleInterval;
+        mFileBytes = kEffortStoreHeaderBytes;
+        return true;
+    }
+    mFileBytes = (int64_t)status.st_size;
+    if (!ReadIndex(error)) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+// one row per record from the headers alone; a record cut short by a crash ends the store there
+bool EffortStore::ReadIndex(std::string *error)
+{
+    void *mapping = mmap(NULL, (size_t)mFileBytes, PROT_READ, MAP_PRIVATE, mDescriptor, 0);
+    if (mapping == MAP_FAILED) {
+        SetError(error, "cannot map file");
+        return false;
+    }
+    const uint8_t *data = (const uint8_t *)mapping;
+    int64_t position = 0;
+    if (mFileBytes < kEffortStoreHeaderBytes || Get<uint32_t>(data, &position) != kEffortStoreMagic ||
+        Get<uint32_t>(data, &position) != kEffortStoreVersion || Get<uint32_t>(data, &position) != kEffortStoreHeaderBytes ||
+        Get<uint32_t>(data, &position) != kEffortStoreRecordHeaderBytes) {
+        munmap(mapping, (size_t)mFileBytes);
+        SetError(error, "not an effort store");
+        return false;
+    }
+    mSampleInterval = Get<float>(data, &position);
+
+    int64_t offset = kEffortStoreHeaderBytes;
+    while (offset + kEffortStoreRecordHeaderBytes <= mFileBytes) {
+        const uint8_t *record = &data[offset];
+        position = 0;
+        uint32_t tag = Get<uint32_t>(record, &position);
+        int64_t recordBytes = Get<uint32_t>(record, &position);
+        StoredEffort effort;
+        effort.key.patient = Get<int64_t>(record, &position);
+        effort.key.session = Get<int64_t>(record, &position);
+        effort.key.timeInSeconds = Get<double>(record, &position);
+        effort.key.whistle = Get<int32_t>(record, &position);
+        effort.key.flags = Get<uint32_t>(record, &position);
+        effort.peakFlowInLitersPerSecond = Get<float>(record, &position);
+        effort.fevOneInLiters = Get<float>(record, &position);
+        effort.fvcInLiters = Get<float>(record, &position);
+        effort.firstTimeStamp = Get<float>(record, &position);
+        effort.numSamples = Get<int32_t>(record, &position);
+        effort.offset = offset;
+        if (tag != kEffortStoreRecordTag || effort.numSamples < 0 || recordBytes != RecordBytes(effort.numSamples) ||
+            offset + recordBytes > mFileBytes)
+            break;
+        mEfforts.push_back(effort);
+        offset += recordBytes;
+    }
+    munmap(mapping, (size_t)mFileBytes);
+
+    // appends carry on from the last whole record
+    if (offset < mFileBytes) {
+        mNumDroppedBytes = mFileBytes - offset;
+        if (ftruncate(mDescriptor, (off_t)offset) != 0) {
+            SetError(error, "cannot drop the torn last record");
+            return false;
+        }
+        mFileBytes = offset;
+    }
+    return true;
+}
+
+int64_t EffortStore::Append(const EffortKey &key, const FlowVolumeResults &results, std::string *error)
+{
+    if (mDescriptor < 0) {
+        SetError(error, "store is not open");
+        return -1;
+    }
+    int64_t numSamples = results.numSamples;
+    if (numSamples > 1 && fabsf(results.timeStamps[1] - results.timeStamps[0] - mSampleInterval) > 0.01f*mSampleInterval) {
+        SetError(error, "curves are not at the store's interval");
+        return -1;
+    }
+
+    StoredEffort effort;
+    effort.key = key;
+    effort.peakFlowInLitersPerSecond = results.peakFlowInLitersPerSecond;
+    effort.fevOneInLiters = results.fevOneInLiters;
+    effort.fvcInLiters = results.fvcInLiters;
+    effort.firstTimeStamp = numSamples > 0 ? results.timeStamps[0] : 0;
+    effort.numSamples = (int32_t)numSamples;
+    effort.offset = FileBytes();
+
+    int64_t recordBytes = RecordBytes(numSamples);
+    size_t start = mPending.size();
+    mPending.resize(start + (size_t)recordBytes, 0);
+    uint8_t *record = &mPending[start];
+    int16_t *columns = (int16_t *)&record[kEffortStoreRecordHeaderBytes];
+    for (int64_t i = 0; i < numSamples; i++) {
+        columns[i] = Quantize(results.flow[i]);
+        columns[numSamples + i] = Quantize(results.volume[i]);
+    }
+
+    int64_t position = 0;
+    Put<uint32_t>(record, &position, kEffortStoreRecordTag);
+    Put<uint32_t>(record, &position, (uint32_t)recordBytes);
+    Put<int64_t>(record, &position, key.patient);
+    Put<int64_t>(record, &position, key.session);
+    Put<double>(record, &position, key.timeInSeconds);
+    Put<int32_t>(record, &position, key.whistle);
+    Put<uint32_t>(record, &position, key.flags);
+    Put<float>(record, &position, effort.peakFlowInLitersPerSecond);
+    Put<float>(record, &position, effort.fevOneInLiters);
+    Put<float>(record, &position, effort.fvcInLiters);
+    Put<float>(record, &position, effort.firstTimeStamp);
+    Put<int32_t>(record, &position, effort.numSamples);
+    Put<uint32_t>(record, &position, Checksum((const uint8_t *)columns, (size_t)(2*numSamples*sizeof(int16_t))));
+
+    mEfforts.push_back(effort);
+    if (mPending.size() >= kEffortStoreWriteBufferBytes && !Flush()) {
+        SetError(error, "cannot write to the store");
+        return -1;
+    }
+    return (int64_t)mEfforts.size() - 1;
+}
+
+bool EffortStore::Flush()
+{
+    size_t written = 0;
+    while (written < mPending.size()) {
+        ssize_t numWritten = pwrite(mDescriptor, &mPending[written], mPending.size() - written, (off_t)(mFileBytes + written));
+        if (numWritten <= 0)
+            return false;
+        written += (size_t)numWritten;
+    }
+    mFileBytes += (int64_t)mPending.size();
+    mPending.clear();
+    return true;
+}
+
+bool EffortStore::ReadRecord(int64_t effort, CurveScratch *scratch, float *flow, float *volume) const
+{
+    const StoredEffort &stored = mEfforts[effort];
+    int64_t numSamples = stored.numSamples;
+    int64_t recordBytes = RecordBytes(numSamples);
+    scratch->record.resize((size_t)recordBytes);
+    if (pread(mDescriptor, &scratch->record[0], (size_t)recordBytes, (off_t)stored.offset) != (ssize_t)recordBytes)
+        return false;
+    const uint8_t *record = &scratch->record[0];
+    const int16_t *columns = (const int16_t *)&record[kEffortStoreRecordHeaderBytes];
+    int64_t position = kEffortStoreRecordHeaderBytes - sizeof(uint32_t);
+    if (Get<uint32_t>(record, &position) != Checksum((const uint8_t *)columns, (size_t)(2*numSamples*sizeof(int16_t))))
+        return false;
+    for (int64_t i = 0; i < numSamples; i++) {
+        flow[i] = columns[i]*kEffortStoreQuantum;
+        volume[i] = columns[numSamples + i]*kEffortStoreQuantum;
+    }
+    return true;
+}
+
+bool EffortStore::ReadCurves(int64_t effort, std::vector<float> *flow, std::vector<float> *volume)
+{
+    if (!Flush())
+        return false;
+    flow->resize((size_t)mEfforts[effort].numSamples);
+    volume->resize((size_t)mEfforts[effort].numSamples);
+    return flow->empty() || ReadRecord(effort, &mScratch, &(*flow)[0], &(*volume)[0]);
+}
+
+//=============================================================================================================
+// Indexes
+
+int64_t EffortStore::KeyIndex::Find(int64_t key, const int64_t **keyEfforts) const
+{
+    std::vector<int64_t>::const_iterator found = std::lower_bound(keys.begin(), keys.end(), key);
+    if (found == keys.end() || *found != key) {
+        *keyEfforts = NULL;
+        return 0;
+    }
+    size_t k = (size_t)(found - keys.begin());
+    *keyEfforts = &efforts[(size_t)offsets[k]];
+    return offsets[k+1] - offsets[k];
+}
+
+void EffortStore::BuildIndexes()
+{
+    if (mNumIndexed == (int64_t)mEfforts.size())
+        return;
+    BuildIndex(0, &mPatients);
+    BuildIndex(1, &mSessions);
+    BuildIndex(2, &mWhistles);
+    mNumIndexed = (int64_t)mEfforts.size();
+}
+
+void EffortStore::BuildIndex(int which, KeyIndex *index)
+{
+    // the key of each effort next to it, so the sort does not chase rows
+    struct Entry {
+        int64_t key;
+        double time;
+        int64_t effort;
+        bool operator<(const Entry &other) const {
+            return key != other.key ? key < other.key : (time != other.time ? time < other.time : effort < other.effort);
+        }
+    };
+    std::vector<Entry> entries(mEfforts.size());
+    for (size_t e = 0; e < mEfforts.size(); e++) {
+        const EffortKey &key = mEfforts[e].key;
+        entries[e].key = which == 0 ? key.patient : (which == 1 ? key.session : (int64_t)key.whistle);
+        entries[e].time = key.timeInSeconds;
+        entries[e].effort = (int64_t)e;
+    }
+    std::sort(entries.begin(), entries.end());
+
+    index->keys.clear();
+    index->offsets.clear();
+    index->efforts.resize(entries.size());
+    for (size_t e = 0; e < entries.size(); e++) {
+        if (e == 0 || entries[e].key != entries[e-1].key) {
+            index->keys.push_back(entries[e].key);
+            index->offsets.push_back((int64_t)e);
+        }
+        index->efforts[e] = entries[e].effort;
+    }
+    index->offsets.push_back((int64_t)entries.size());
+}
+
+//=============================================================================================================
+// Session and patient queries
+
+void EffortStore::Summarize(const int64_t *efforts, int64_t numEfforts, SessionSummary *summary) const
+{
+    const StoredEffort &first = mEfforts[efforts[0]];
+    summary->session = first.key.session;
+    summary->patient = first.key.patient;
+    summary->timeInSeconds = first.key.timeInSeconds;
+    summary->numEfforts = (int)numEfforts;
+    summary->numAcceptable = 0;
+    summary->bestEffort = -1;
+
+    // largest two of each measure over the acceptable efforts
+    float fevOne[2] = {-INFINITY, -INFINITY}, fvc[2] = {-INFINITY, -INFINITY};
+    float peakFlow = -INFINITY, bestSum = -INFINITY;
+    for (int64_t i = 0; i < numEfforts; i++) {
+        const StoredEffort &effort = mEfforts[efforts[i]];
+        if (!(effort.key.flags & EffortStoreFlagAcceptable))
+            continue;
+        summary->numAcceptable++;
+        if (effort.fevOneInLiters > fevOne[0]) {
+            fevOne[1] = fevOne[0];
+            fevOne[0] = effort.fevOneInLiters;
+        }
+        else if (effort.fevOneInLiters > fevOne[1])
+            fevOne[1] = effort.fevOneInLiters;
+        if (effort.fvcInLiters > fvc[0]) {
+            fvc[1] = fvc[0];
+            fvc[0] = effort.fvcInLiters;
+        }
+        else if (effort.fvcInLiters > fvc[1])
+            fvc[1] = effort.fvcInLiters;
+        peakFlow = std::max(peakFlow, effort.peakFlowInLitersPerSecond);
+        if (effort.fevOneInLiters + effort.fvcInLiters > bestSum) {
+            bestSum = effort.fevOneInLiters + effort.fvcInLiters;
+            summary->bestEffort = efforts[i];
+        }
+    }
+
+    bool hasOne = summary->numAcceptable > 0, hasTwo = summary->numAcceptable > 1;
+    summary->peakFlowInLitersPerSecond = hasOne ? peakFlow : NAN;
+    summary->fevOneInLiters = hasOne ? fevOne[0] : NAN;
+    summary->fvcInLiters = hasOne ? fvc[0] : NAN;
+    summary->fevOneOverFvc = hasOne && fvc[0] > 0 ? fevOne[0]/fvc[0] : NAN;
+    summary->fevOneRepeatabilityInLiters = hasTwo ? fevOne[0] - fevOne[1] : NAN;
+    summary->fvcRepeatabilityInLiters = hasTwo ? fvc[0] - fvc[1] : NAN;
+    float limit = fvc[0] <= kSmallFVCInLiters ? kSmallRepeatabilityInLiters : kRepeatabilityInLiters;
+    summary->isRepeatable = hasTwo && summary->fevOneRepeatabilityInLiters <= limit && summary->fvcRepeatabilityInLiters <= limit;
+}
+
+bool EffortStore::SummarizeSession(int64_t session, SessionSummary *summary)
+{
+    Flush();
+    const int64_t *efforts;
+    int64_t numEfforts = SessionEfforts(session, &efforts);
+    if (numEfforts == 0)
+        return false;
+    Summarize(efforts, numEfforts, summary);
+    return true;
+}
+
+void EffortStore::Trend(int64_t patient, PatientTrend *trend) const
+{
+    const int64_t *efforts;
+    int64_t numEfforts = mPatients.Find(patient, &efforts);
+    trend->patient = patient;
+    trend->numSessions = 0;
+    trend->firstTimeInSeconds = trend->lastTimeInSeconds = NAN;
+    trend->lastFevOneInLiters = trend->lastFvcInLiters = NAN;
+
+    // the patient's sessions summarized, then fit in the order they started at their first effort's
+    // time; the sums are about the first session's time so years of unix seconds do not swamp them
+    std::vector<int64_t> sessions((size_t)numEfforts);
+    for (int64_t i = 0; i < numEfforts; i++)
+        sessions[(size_t)i] = mEfforts[efforts[i]].key.session;
+    std::sort(sessions.begin(), sessions.end());
+    sessions.erase(std::unique(sessions.begin(), sessions.end()), sessions.end());
+    std::vector<SessionSummary> summaries(sessions.size());
+    for (size_t s = 0; s < sessions.size(); s++) {
+        const int64_t *sessionEfforts;
+        int64_t numSessionEfforts = mSessions.Find(sessions[s], &sessionEfforts);
+        Summarize(sessionEfforts, numSessionEfforts, &summaries[s]);
+    }
+    std::sort(summaries.begin(), summaries.end(), [](const SessionSummary &a, const SessionSummary &b) {
+        return a.timeInSeconds < b.timeInSeconds;
+    });
+
+    double sumT = 0, sumTT = 0, sumF = 0, sumTF = 0, sumV = 0, sumTV = 0;
+    for (size_t s = 0; s < summaries.size(); s++) {
+        const SessionSummary &summary = summaries[s];
+        if (summary.numAcceptable == 0)
+            continue;
+        if (trend->numSessions == 0)
+            trend->firstTimeInSeconds = summary.timeInSeconds;
+        trend->lastTimeInSeconds = summary.timeInSeconds;
+        trend->lastFevOneInLiters = summary.fevOneInLiters;
+        trend->lastFvcInLiters = summary.fvcInLiters;
+        trend->numSessions++;
+        double t = (summary.timeInSeconds - trend->firstTimeInSeconds)/kSecondsPerYear;
+        sumT += t;
+        sumTT += t*t;
+        sumF += summary.fevOneInLiters;
+        sumTF += t*summary.fevOneInLiters;
+        sumV += summary.fvcInLiters;
+        sumTV += t*summary.fvcInLiters;
+    }
+    double n = trend->numSessions;
+    double denominator = n*sumTT - sumT*sumT;
+    bool canFit = trend->numSessions > 1 && denominator > 0;
+    trend->fevOneSlopeInLitersPerYear = canFit ? (float)((n*sumTF - sumT*sumF)/denominator) : NAN;
+    trend->fvcSlopeInLitersPerYear = canFit ? (float)((n*sumTV - sumT*sumV)/denominator) : NAN;
+}
+
+bool EffortStore::TrendOfPatient(int64_t patient, PatientTrend *trend)
+{
+    Flush();
+    BuildIndexes();
+    const int64_t *efforts;
+    if (mPatients.Find(patient, &efforts) == 0)
+        return false;
+    Trend(patient, trend);
+    return true;
+}
+
+// items handed out in blocks from a shared counter, work(item, scratch) on each worker
+template <typename Work> void EffortStore::RunOnWorkers(int64_t numItems, int numThreads, Work work)
+{
+    if (numThreads <= 0)
+        numThreads = (int)std::thread::hardware_concurrency();
+    const int64_t kBlock = 256;
+    numThreads = (int)std::max<int64_t>(1, std::min<int64_t>(numThreads, (numItems + kBlock - 1)/kBlock));
+    std::atomic<int64_t> next(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < numThreads; t++) {
+        workers.push_back(std::thread([&next, numItems, kBlock, &work]() {
+            CurveScratch scratch;
+            for (int64_t first = next.fetch_add(kBlock); first < numItems; first = next.fetch_add(kBlock))
+                for (int64_t i = first; i < first + kBlock && i < numItems; i++)
+                    work(i, &scratch);
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
+void EffortStore::SummarizeSessions(std::vector<SessionSummary> *summaries, int numThreads)
+{
+    Flush();
+    BuildIndexes();
+    summaries->resize(mSessions.keys.size());
+    const KeyIndex &sessions = mSessions;
+    SessionSummary *out = summaries->empty() ? NULL : &(*summaries)[0];
+    RunOnWorkers((int64_t)sessions.keys.size(), numThreads, [this, &sessions, out](int64_t s, CurveScratch *) {
+        Summarize(&sessions.efforts[(size_t)sessions.offsets[s]], sessions.offsets[s+1] - sessions.offsets[s], &out[s]);
+    });
+}
+
+void EffortStore::TrendsOfPatients(std::vector<PatientTrend> *trends, int numThreads)
+{
+    Flush();
+    BuildIndexes();
+    trends->resize(mPatients.keys.size());
+    const std::vector<int64_t> &patients = mPatients.keys;
+    PatientTrend *out = trends->empty() ? NULL : &(*trends)[0];
+    RunOnWorkers((int64_t)patients.size(), numThreads, [this, &patients, out](int64_t p, CurveScratch *) {
+        Trend(patients[(size_t)p], &out[p]);
+    });
+}
+
+//=============================================================================================================
+// Curve comparisons
+
+// sum of squared differences, four at a time over the bulk and one at a time over the rest
+template <typename Lanes> static double SumOfSquaredDifferences(const float *a, const float *b, int64_t length)
+{
+    typedef typename Lanes::V V;
+    const int64_t kNumLanes = Lanes::kNumLanes;
+    V sum = Lanes::Splat(0.0f);
+    int64_t i = 0;
+    for (; i + kNumLanes <= length; i += kNumLanes) {
+        V d = Lanes::Load(&a[i]) - Lanes::Load(&b[i]);
+        sum = sum + d*d;
+    }
+    float lanes[4];
+    Lanes::Store(lanes, sum);
+    double total = 0;
+    for (int64_t l = 0; l < kNumLanes; l++)
+        total += lanes[l];
+    for (; i < length; i++)
+        total += (double)(a[i] - b[i])*(a[i] - b[i]);
+    return total;
+}
+
+CurveDistance EffortStore::CompareCurves(const float *flowA, const float *volumeA, int64_t numA, float firstTimeA,
+                                         const float *flowB, const float *volumeB, int64_t numB, float firstTimeB,
+                                         float sampleInterval)
+{
+    // sample i of A is at the time of sample i + shift of B
+    int64_t shift = (int64_t)lroundf((firstTimeA - firstTimeB)/sampleInterval);
+    int64_t firstA = std::max<int64_t>(0, -shift);
+    int64_t length = std::min(numA, numB - shift) - firstA;
+    CurveDistance distance;
+    distance.numSamples = length > 0 ? length : 0;
+    if (length <= 0) {
+        distance.flowInLitersPerSecond = distance.volumeInLiters = NAN;
+        return distance;
+    }
+    distance.flowInLitersPerSecond = (float)sqrt(SumOfSquaredDifferences<VectorLanes>(&flowA[firstA], &flowB[firstA + shift], length)/length);
+    distance.volumeInLiters = (float)sqrt(SumOfSquaredDifferences<VectorLanes>(&volumeA[firstA], &volumeB[firstA + shift], length)/length);
+    return distance;
+}
+
+// the acceptable efforts' curves decoded once, then every pair; returns the number of pairs
+int64_t EffortStore::CompareCurvesOf(const int64_t *efforts, int64_t numEfforts, CurveScratch *scratch,
+                                     std::vector<int64_t> *acceptable, std::vector<CurveDistance> *distances) const
+{
+    acceptable->clear();
+    scratch->starts.clear();
+    int64_t total = 0;
+    for (int64_t i = 0; i < numEfforts; i++) {
+        const StoredEffort &effort = mEfforts[efforts[i]];
+        if (!(effort.key.flags & EffortStoreFlagAcceptable))
+            continue;
+        acceptable->push_back(efforts[i]);
+        scratch->starts.push_back(total);
+        total += effort.numSamples;
+    }
+    scratch->flows.resize((size_t)total + 1);
+    scratch->volumes.resize((size_t)total + 1);
+    int64_t n = (int64_t)acceptable->size();
+    for (int64_t i = 0; i < n; i++) {
+        // a damaged record compares as NAN rather than stopping the session
+        float *flow = &scratch->flows[(size_t)scratch->starts[(size_t)i]];
+        float *volume = &scratch->volumes[(size_t)scratch->starts[(size_t)i]];
+        if (!ReadRecord((*acceptable)[(size_t)i], scratch, flow, volume))
+            std::fill(flow, flow + mEfforts[(*acceptable)[(size_t)i]].numSamples, NAN);
+    }
+
+    distances->resize((size_t)(n*n));
+    for (int64_t i = 0; i < n; i++) {
+        const StoredEffort &a = mEfforts[(*acceptable)[(size_t)i]];
+        (*distances)[(size_t)(i*n + i)].flowInLitersPerSecond = (*distances)[(size_t)(i*n + i)].volumeInLiters = 0;
+        (*distances)[(size_t)(i*n + i)].numSamples = a.numSamples;
+        for (int64_t j = i + 1; j < n; j++) {
+            const StoredEffort &b = mEfforts[(*acceptable)[(size_t)j]];
+            CurveDistance distance = CompareCurves(&scratch->flows[(size_t)scratch->starts[(size_t)i]], &scratch->volumes[(size_t)scratch->starts[(size_t)i]],
+                                                   a.numSamples, a.firstTimeStamp,
+                                                   &scratch->flows[(size_t)scratch->starts[(size_t)j]], &scratch->volumes[(size_t)scratch->starts[(size_t)j]],
+                                                   b.numSamples, b.firstTimeStamp, mSampleInterval);
+            (*distances)[(size_t)(i*n + j)] = (*distances)[(size_t)(j*n + i)] = distance;
+        }
+    }
+    return n*(n - 1)/2;
+}
+
+int64_t EffortStore::CompareSessionCurves(int64_t session, std::vector<int64_t> *efforts, std::vector<CurveDistance> *distances)
+{
+    Flush();
+    const int64_t *sessionEfforts;
+    int64_t numEfforts = SessionEfforts(session, &sessionEfforts);
+    CompareCurvesOf(sessionEfforts, numEfforts, &mScratch, efforts, distances);
+    return (int64_t)efforts->size();
+}
+
+int64_t EffortStore::CompareAllSessionCurves(std::vector<CurveDistance> *closest, int numThreads)
+{
+    Flush();
+    BuildIndexes();
+    closest->resize(mSessions.keys.size());
+    const KeyIndex &sessions = mSessions;
+    CurveDistance *out = closest->empty() ? NULL : &(*closest)[0];
+    std::atomic<int64_t> numPairs(0);
+    RunOnWorkers((int64_t)sessions.keys.size(), numThreads, [this, &sessions, out, &numPairs](int64_t s, CurveScratch *scratch) {
+        // the worker's own vectors, kept across sessions with the scratch
+        thread_local std::vector<int64_t> acceptable;
+        thread_local std::vector<CurveDistance> distances;
+        int64_t pairs = CompareCurvesOf(&sessions.efforts[(size_t)sessions.offsets[s]], sessions.offsets[s+1] - sessions.offsets[s],
+                                        scratch, &acceptable, &distances);
+        int64_t n = (int64_t)acceptable.size();
+        CurveDistance best;
+        best.flowInLitersPerSecond = best.volumeInLiters = NAN;
+        best.numSamples = 0;
+        for (int64_t i = 0; i < n; i++)
+            for (int64_t j = i + 1; j < n; j++)
+                if (!(distances[(size_t)(i*n + j)].flowInLitersPerSecond >= best.flowInLitersPerSecond))
+                    best = distances[(size_t)(i*n + j)];
+        out[s] = best;
+        numPairs.fetch_add(pairs, std::memory_order_relaxed);
+    });
+    return numPairs.load();
+}
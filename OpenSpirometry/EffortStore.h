@@ -0,0 +1,207 @@
+//
+//  EffortStore.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Append only store of finished efforts, so results outlive the delegate call that hands them
+//  over and can be compared across efforts, sessions and years (the reproducibility analytics the
+//  analyzer's TODO asks for). Each effort is one record appended to a single file: its patient,
+//  session, whistle, time, flags and scalar measures, then its flow and volume curves as columns of
+//  16 bit counts of kEffortStoreQuantum (the time column is implied, every curve is sampled at the
+//  store's interval from its first time stamp), about a third of the FlowVolumeResults floats.
+//
+//  Opening a store reads only the record headers into memory, one row per effort, and drops a
+//  record torn by a crash at the end of the file. Patient, session and whistle indexes (the rows
+//  sorted by key and time, kept as offsets into one array per index) are rebuilt on the first query
+//  after an append. Session queries follow ATS/ERS: the largest FEV1 and FVC of the acceptable
+//  efforts, even from different efforts, and their ratio; the best effort by FEV1 plus FVC; and
+//  repeatability as the difference between the largest two of each. A patient's trend is the least
+//  squares slope of the session bests over time. Curves are only read for curve comparisons, which
+//  line the efforts up by time stamp and compare them four samples at a time (FFTLanes). Queries
+//  over every session or patient are split over worker threads.
+//
+//  File layout (little endian):
+//    header    32 bytes: magic, version, header size, record header size, sample interval
+//    records   64 byte header: tag, record bytes, patient, session, time (unix seconds), whistle,
+//              flags, PEF, FEV1, FVC, first time stamp, number of samples, checksum of the columns;
+//              then int16 flow[n], int16 volume[n], zero padded to 8 bytes
+//  Appends go through a write buffer and are written with Flush (or when it fills), queries flush
+//  first. Appending and querying are not safe from different threads at once.
+
+#ifndef OpenSpirometry_EffortStore_h
+#define OpenSpirometry_EffortStore_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "FlowVolumeCurve.h"
+
+#define kEffortStoreMagic 0x53455053        // "SPES" when read as little endian bytes
+#define kEffortStoreVersion 1
+#define kEffortStoreHeaderBytes 32
+#define kEffortStoreRecordHeaderBytes 64
+#define kEffortStoreRecordTag 0x52464645    // "EFFR"
+#define kEffortStoreQuantum 0.001f          // liters (per second) per count of the curve columns
+#define kEffortStoreWriteBufferBytes (1 << 20)
+#define kRepeatabilityInLiters 0.150f       // ATS/ERS: largest two FEV1 (and FVC) at most this far apart
+#define kSmallRepeatabilityInLiters 0.100f  // when the largest FVC is at most kSmallFVCInLiters
+#define kSmallFVCInLiters 1.0f
+#define kSecondsPerYear (365.25*24.0*3600.0)
+
+enum EffortStoreFlags {
+    EffortStoreFlagAcceptable = 1,          // counts for the session's bests and repeatability
+    EffortStoreFlagCough = 2,
+    EffortStoreFlagVoice = 4
+};
+
+// acceptable if no errors were flagged, and the artifacts among them
+uint32_t EffortStoreFlagsFromResults(const FlowVolumeResults &results);
+
+// who and what an effort belongs to, given with it
+struct EffortKey {
+    int64_t patient;
+    int64_t session;                // unique across patients
+    int32_t whistle;
+    double timeInSeconds;           // unix seconds the effort was taken
+    uint32_t flags;                 // EffortStoreFlags
+};
+
+// one row per effort, in memory
+struct StoredEffort {
+    EffortKey key;
+    float peakFlowInLitersPerSecond;
+    float fevOneInLiters;
+    float fvcInLiters;
+    float firstTimeStamp;           // of the curves, seconds from the back extrapolated start
+    int32_t numSamples;
+    int64_t offset;                 // of the record in the file
+};
+
+struct SessionSummary {
+    int64_t session;
+    int64_t patient;
+    double timeInSeconds;           // of its first effort
+    int numEfforts;
+    int numAcceptable;
+    int64_t bestEffort;             // acceptable effort with the largest FEV1 plus FVC, -1 for none
+    float peakFlowInLitersPerSecond;// largest of the acceptable efforts, NAN without any
+    float fevOneInLiters;
+    float fvcInLiters;
+    float fevOneOverFvc;            // of those two
+    float fevOneRepeatabilityInLiters; // largest minus second largest, NAN under two acceptable efforts
+    float fvcRepeatabilityInLiters;
+    bool isRepeatable;              // both within the ATS/ERS limit
+};
+
+struct PatientTrend {
+    int64_t patient;
+    int numSessions;                // with an acceptable effort, the only ones the trend is fit to
+    double firstTimeInSeconds;
+    double lastTimeInSeconds;
+    float lastFevOneInLiters;       // best of the newest session
+    float lastFvcInLiters;
+    float fevOneSlopeInLitersPerYear;   // NAN under two sessions
+    float fvcSlopeInLitersPerYear;
+};
+
+// root mean square differences of two curves over the samples they share, lined up by time stamp
+struct CurveDistance {
+    float flowInLitersPerSecond;
+    float volumeInLiters;
+    int64_t numSamples;
+};
+
+class EffortStore {
+
+public:
+    EffortStore();
+    ~EffortStore();
+
+    // an existing store at its own interval, or a new one at sampleInterval; false (and error) if the
+    // file is not a store or cannot be opened
+    bool Open(const std::string &path, float sampleInterval = 1.0f/100.0f, std::string *error = NULL);
+    void Close();
+    bool IsOpen() { return mDescriptor >= 0; }
+
+    // the results must be sampled at the store's interval; returns the effort's index, -1 (and error) if not
+    int64_t Append(const EffortKey &key, const FlowVolumeResults &results, std::string *error = NULL);
+    bool Flush();
+
+    float SampleInterval() { return mSampleInterval; }
+    int64_t NumEfforts() { return (int64_t)mEfforts.size(); }
+    const StoredEffort &Effort(int64_t effort) { return mEfforts[effort]; }
+    int64_t NumDroppedBytes() { return mNumDroppedBytes; } // of a torn last record when the store was opened
+    int64_t FileBytes() { return mFileBytes + (int64_t)mPending.size(); }
+    // decoded to liters (per second), false if the record is damaged
+    bool ReadCurves(int64_t effort, std::vector<float> *flow, std::vector<float> *volume);
+
+    // the keys in increasing order and each key's efforts in time order, valid until the next append
+    int64_t NumPatients() { BuildIndexes(); return (int64_t)mPatients.keys.size(); }
+    int64_t NumSessions() { BuildIndexes(); return (int64_t)mSessions.keys.size(); }
+    int64_t NumWhistles() { BuildIndexes(); return (int64_t)mWhistles.keys.size(); }
+    int64_t Patient(int64_t which) { BuildIndexes(); return mPatients.keys[which]; }
+    int64_t Session(int64_t which) { BuildIndexes(); return mSessions.keys[which]; }
+    int64_t Whistle(int64_t which) { BuildIndexes(); return mWhistles.keys[which]; }
+    int64_t PatientEfforts(int64_t patient, const int64_t **efforts) { BuildIndexes(); return mPatients.Find(patient, efforts); }
+    int64_t SessionEfforts(int64_t session, const int64_t **efforts) { BuildIndexes(); return mSessions.Find(session, efforts); }
+    int64_t WhistleEfforts(int32_t whistle, const int64_t **efforts) { BuildIndexes(); return mWhistles.Find(whistle, efforts); }
+
+    // false if the session (patient) has no efforts
+    bool SummarizeSession(int64_t session, SessionSummary *summary);
+    bool TrendOfPatient(int64_t patient, PatientTrend *trend);
+    // every session (patient) in key order, split over numThreads (0 uses every core)
+    void SummarizeSessions(std::vector<SessionSummary> *summaries, int numThreads = 0);
+    void TrendsOfPatients(std::vector<PatientTrend> *trends, int numThreads = 0);
+
+    // every pair of the session's acceptable efforts: efforts in time order, distances[i*n + j] (n of them)
+    int64_t CompareSessionCurves(int64_t session, std::vector<int64_t> *efforts, std::vector<CurveDistance> *distances);
+    // the closest pair of acceptable curves in every session, numThreads as above; returns the pairs compared
+    int64_t CompareAllSessionCurves(std::vector<CurveDistance> *closest, int numThreads = 0);
+    static CurveDistance CompareCurves(const float *flowA, const float *volumeA, int64_t numA, float firstTimeA,
+                                       const float *flowB, const float *volumeB, int64_t numB, float firstTimeB,
+                                       float sampleInterval);
+
+protected:
+    // efforts sorted by key then time, the efforts of keys[k] are efforts[offsets[k]...offsets[k+1]-1]
+    struct KeyIndex {
+        std::vector<int64_t> keys;
+        std::vector<int64_t> offsets;
+        std::vector<int64_t> efforts;
+        int64_t Find(int64_t key, const int64_t **keyEfforts) const;
+    };
+
+    // per worker, so curves can be decoded in parallel
+    struct CurveScratch {
+        std::vector<uint8_t> record;
+        std::vector<float> flows;           // the session's curves back to back
+        std::vector<float> volumes;
+        std::vector<int64_t> starts;
+    };
+
+    bool ReadIndex(std::string *error);
+    void BuildIndexes();
+    void BuildIndex(int which, KeyIndex *index);
+    bool ReadRecord(int64_t effort, CurveScratch *scratch, float *flow, float *volume) const;
+    void Summarize(const int64_t *efforts, int64_t numEfforts, SessionSummary *summary) const;
+    void Trend(int64_t patient, PatientTrend *trend) const;
+    int64_t CompareCurvesOf(const int64_t *efforts, int64_t numEfforts, CurveScratch *scratch, std::vector<int64_t> *acceptable,
+                            std::vector<CurveDistance> *distances) const;
+    template <typename Work> void RunOnWorkers(int64_t numItems, int numThreads, Work work);
+
+    int mDescriptor;
+    std::string mPath;
+    float mSampleInterval;
+    int64_t mFileBytes;                 // written to the file so far
+    int64_t mNumDroppedBytes;
+    std::vector<uint8_t> mPending;      // appended, not written yet
+    std::vector<StoredEffort> mEfforts;
+    int64_t mNumIndexed;                // efforts the indexes cover
+    KeyIndex mPatients;
+    KeyIndex mSessions;
+    KeyIndex mWhistles;
+    CurveScratch mScratch;              // for the calls on the caller's thread
+};
+
+#endif
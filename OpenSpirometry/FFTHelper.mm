@@ -1,7 +1,10 @@
 //
-//  FFTHelper.m
+//  FFTHelper.mm
 //  OpenSpirometry
 //
+//  vDSP_fft_zrip only does powers of two, so any other size (BUFFER_SIZE is 44100) runs
+//  through the portable RealFFT instead of silently transforming 2^floor(log2(size)) points.
+//  Both paths give the same dB spectrum.
 //
 //*  Real FFT wrapper for Apple's Accelerate Framework
 //*
@@ -15,6 +18,7 @@
 
 
 #import "FFTHelper.h"
+#include "RealFFT.h"
 
 @interface FFTHelper()
 
@@ -38,6 +42,9 @@
 
 @property (nonatomic) enum WindowType winType;
 
+@property (nonatomic) BOOL usesVDSP;        // power of two sizes stay on Accelerate
+@property (nonatomic) RealFFT* realFFT;     // everything else, tables shared per (size, window)
+
 @end
 
 @implementation FFTHelper
@@ -66,7 +73,11 @@
 
 -(void)copydBMagnitudeToBuffer:(float*)buffer{
     
-    if(self.needsMagnitude){
+    if(self.needsMagnitude && !self.usesVDSP){
+        self.needsMagnitude = NO;
+        self.realFFT->CopydBMagnitudeToBuffer(self.magnitude);
+    }
+    else if(self.needsMagnitude){
         self.needsMagnitude = NO; // not exactly a mutex, but meh...
         // auto calculate the magnitude (TODO: calc phase if needed on demand)
         vDSP_zvmags(&_split_data, 1, self.magnitude, 1, self.fftSizeOver2);
@@ -78,7 +89,7 @@
 
 -(float *)timeSeries{
     if(!_timeSeries){
-        _timeSeries = (float *) malloc(self.fftSize * sizeof(float));
+        _timeSeries = (float *) calloc(self.fftSize, sizeof(float)); // accumulated into
     }
     return _timeSeries;
 }
@@ -117,8 +128,23 @@
     self.fftSizeOver2 = self.fftSize/2;
     self.log2n = log2f(self.fftSize);
     self.log2nOver2 = self.log2n/2;
+    self.usesVDSP = self.fftSize >= 2 && ((size_t)1 << self.log2n) == self.fftSize;
     
     self.needsMagnitude = YES;
+    self.scale = 1.0f/(float)(4.0f*self.fftSize);
+    
+    if(!self.usesVDSP){
+        FFTWindowType realWindow = FFTWindowHann;
+        switch (self.winType) {
+            case WindowTypeHamming:  realWindow = FFTWindowHamming; break;
+            case WindowTypeRect:     realWindow = FFTWindowRect; break;
+            case WindowTypeBlackman: realWindow = FFTWindowBlackman; break;
+            default: break;
+        }
+        self.realFFT = new RealFFT(self.fftSize, realWindow);
+        self.windowSize = self.winType != WindowTypeRect ? self.fftSize : 0;
+        return;
+    }
     
     _split_data.realp = (float *) malloc(self.fftSizeOver2 * sizeof(float));
     _split_data.imagp = (float *) malloc(self.fftSizeOver2 * sizeof(float));
@@ -148,8 +174,6 @@
         self.window = nil;
     }
     
-    self.scale = 1.0f/(float)(4.0f*self.fftSize);
-    
     // allocate the fft object once
     self.fftSetup = vDSP_create_fftsetup(self.log2n, FFT_RADIX2);
     if (self.fftSetup == NULL) {
@@ -167,7 +191,11 @@
     [self safeFree:&(_split_data.realp)];
     [self safeFree:&(_split_data.imagp)];
     
-    vDSP_destroy_fftsetup(_fftSetup);
+    [self safeFree:&_timeSeries];
+    
+    if(_fftSetup)
+        vDSP_destroy_fftsetup(_fftSetup);
+    delete _realFFT;
 }
 
 -(void) safeFree:(float **) var{
@@ -181,11 +209,17 @@
 #pragma mark Perform FFT and IFFT
 -(void)performForwardFFTWithData:(float*)buffer{
     
+    if(!self.usesVDSP){
+        self.realFFT->PerformForwardFFT(buffer);
+        self.needsMagnitude = YES;
+        return;
+    }
+    
     //multiply by window
     if( self.window != NULL )
         vDSP_vmul(buffer, 1, self.window, 1, self.in_real, 1, self.fftSize);
     else
-        memcpy(self.in_real,buffer,self.fftSize);
+        memcpy(self.in_real,buffer,self.fftSize*sizeof(float));
     
     //convert to split complex format with evens in real and odds in imag
     vDSP_ctoz((COMPLEX *) self.in_real, 2, &_split_data, 1, self.fftSizeOver2);
@@ -217,6 +251,34 @@
 -(void)performInverseFFTWithMagnitude:(float *)magnitude
                              andPhase:(float*)phase{
     
+    if(!self.usesVDSP){
+        // same units as the zrip path: magnitude is 2|X_k|, the result is half the windowed frame
+        std::vector<float> real(self.realFFT->NumBins(), 0.0f); // no Nyquist bin in the input
+        std::vector<float> imag(self.realFFT->NumBins(), 0.0f);
+        for (int i = 0; i < self.fftSizeOver2; i++) {
+            real[i] = 0.5f * magnitude[i] * cosf(phase[i]);
+            imag[i] = 0.5f * magnitude[i] * sinf(phase[i]);
+        }
+        self.realFFT->PerformInverseFFT(&real[0], &imag[0], self.out_real);
+        float half = 0.5f;
+        vDSP_vsmul(self.out_real, 1, &half, self.out_real, 1, self.fftSize);
+    }
+    else{
+        [self vDSPInverseFFTWithMagnitude:magnitude andPhase:phase];
+    }
+    
+    // multiply by window w/ overlap-add
+    
+    const float *window = self.usesVDSP ? _window : self.realFFT->Plan().Window();
+    float *p = self.timeSeries; // allocated here if not set
+    for (int i = 0; i < self.fftSize; i++) {
+        *p++ += window ? _out_real[i] * window[i] : _out_real[i];
+    }
+}
+
+-(void)vDSPInverseFFTWithMagnitude:(float *)magnitude
+                          andPhase:(float*)phase{
+    
     float *real_p = _split_data.realp;
     float *imag_p = _split_data.imagp;
     
@@ -229,15 +291,6 @@
     vDSP_ztoc(&_split_data, 1, (COMPLEX*) self.out_real, 2, self.fftSizeOver2);
     
     vDSP_vsmul(self.out_real, 1, &_scale, self.out_real, 1, self.fftSize);
-    
-    // multiply by window w/ overlap-add
-    
-    float *p = _timeSeries; // allocated here if not set
-    for (int i = 0; i < self.fftSize; i++) {
-        *p++ += _out_real[i] * _window[i];
-    }
-    
-    
 }
 
 
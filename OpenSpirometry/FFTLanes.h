@@ -0,0 +1,78 @@
+//
+//  FFTLanes.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Lane types the FFT kernels are written against: one float, or four at a time with SSE on
+//  x86 and NEON on ARM (GCC and clang give both vector types the usual arithmetic operators).
+//  Kernels take the lane type as a template parameter, run the vector version over the bulk of
+//  a loop and the scalar one over the leftovers. The deinterleaving loads are also what
+//  OverlapFramer splits multichannel audio with.
+
+#ifndef OpenSpirometry_FFTLanes_h
+#define OpenSpirometry_FFTLanes_h
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FFT_USE_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FFT_USE_NEON 1
+#endif
+
+struct ScalarLanes {
+    typedef float V;
+    enum { kNumLanes = 1 };
+    static inline V Load(const float *p) { return *p; }
+    static inline void Store(float *p, V v) { *p = v; }
+    static inline V Splat(float x) { return x; }
+    static inline V Reverse(V v) { return v; }
+    static inline void LoadEvenOdd(const float *p, V *even, V *odd) { *even = p[0]; *odd = p[1]; }
+    static inline void LoadQuarters(const float *p, V *a, V *b, V *c, V *d) { *a = p[0]; *b = p[1]; *c = p[2]; *d = p[3]; }
+};
+
+#if FFT_USE_SSE
+struct VectorLanes {
+    typedef __m128 V;
+    enum { kNumLanes = 4 };
+    static inline V Load(const float *p) { return _mm_loadu_ps(p); }
+    static inline void Store(float *p, V v) { _mm_storeu_ps(p, v); }
+    static inline V Splat(float x) { return _mm_set1_ps(x); }
+    static inline V Reverse(V v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 1, 2, 3)); }
+    static inline void LoadEvenOdd(const float *p, V *even, V *odd) {
+        __m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4);
+        *even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        *odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    }
+    // every fourth float starting at p[0], p[1], p[2] and p[3]
+    static inline void LoadQuarters(const float *p, V *a, V *b, V *c, V *d) {
+        __m128 r0 = _mm_loadu_ps(p), r1 = _mm_loadu_ps(p + 4), r2 = _mm_loadu_ps(p + 8), r3 = _mm_loadu_ps(p + 12);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        *a = r0; *b = r1; *c = r2; *d = r3;
+    }
+};
+#elif FFT_USE_NEON
+struct VectorLanes {
+    typedef float32x4_t V;
+    enum { kNumLanes = 4 };
+    static inline V Load(const float *p) { return vld1q_f32(p); }
+    static inline void Store(float *p, V v) { vst1q_f32(p, v); }
+    static inline V Splat(float x) { return vdupq_n_f32(x); }
+    static inline V Reverse(V v) { V r = vrev64q_f32(v); return vcombine_f32(vget_high_f32(r), vget_low_f32(r)); }
+    static inline void LoadEvenOdd(const float *p, V *even, V *odd) {
+        float32x4x2_t pair = vld2q_f32(p);
+        *even = pair.val[0];
+        *odd = pair.val[1];
+    }
+    static inline void LoadQuarters(const float *p, V *a, V *b, V *c, V *d) {
+        float32x4x4_t quad = vld4q_f32(p);
+        *a = quad.val[0]; *b = quad.val[1]; *c = quad.val[2]; *d = quad.val[3];
+    }
+};
+#else
+typedef ScalarLanes VectorLanes;
+#endif
+
+#endif
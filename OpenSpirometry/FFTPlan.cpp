@@ -0,0 +1,307 @@
+//
+//  FFTPlan.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "FFTPlan.h"
+#include "FFTLanes.h"
+#include <math.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+
+// One Stockham stage, written once for scalar and vector lanes and each radix (so the butterfly
+// unrolls and stays in registers). Stages read and write runs of `stride` consecutive values, so
+// every stage after the first few runs four lanes at a time.
+// y[q + s(r p + t)] = W^(p t) sum_j x[q + s(p + j m)] W_r^(j t), for q in [qBegin, qEnd)
+template <class L, int radix>
+static void RunStage(int64_t s, int64_t m, const float *twiddleReal, const float *twiddleImag,
+                     const float *xr, const float *xi, float *yr, float *yi, int64_t qBegin, int64_t qEnd)
+{
+    typedef typename L::V V;
+    const int64_t step = L::kNumLanes;
+    const int64_t jump = s*m; // distance between the inputs of one butterfly
+
+    // W_r^k, for the odd radices
+    V cosTable[radix], sinTable[radix];
+    for (int k=0; k < radix; ++k) {
+        cosTable[k] = L::Splat((float)cos(2.0*M_PI*k/radix));
+        sinTable[k] = L::Splat((float)sin(2.0*M_PI*k/radix));
+    }
+
+    for (int64_t p=0; p < m; ++p) {
+        const float *wr = &twiddleReal[p*(radix-1)];
+        const float *wi = &twiddleImag[p*(radix-1)];
+        V twr[radix], twi[radix];
+        for (int t=1; t < radix; ++t) {
+            twr[t] = L::Splat(wr[t-1]);
+            twi[t] = L::Splat(wi[t-1]);
+        }
+        const int64_t in = s*p;
+        const int64_t out = s*radix*p;
+
+        for (int64_t q=qBegin; q + step <= qEnd; q += step) {
+            V br[radix], bi[radix];
+            if (radix == 2) {
+                V ar0 = L::Load(&xr[in + q]), ai0 = L::Load(&xi[in + q]);
+                V ar1 = L::Load(&xr[in + jump + q]), ai1 = L::Load(&xi[in + jump + q]);
+                br[0] = ar0 + ar1; bi[0] = ai0 + ai1;
+                br[1] = ar0 - ar1; bi[1] = ai0 - ai1;
+            }
+            else if (radix == 4) {
+                V ar0 = L::Load(&xr[in + q]), ai0 = L::Load(&xi[in + q]);
+                V ar1 = L::Load(&xr[in + jump + q]), ai1 = L::Load(&xi[in + jump + q]);
+                V ar2 = L::Load(&xr[in + 2*jump + q]), ai2 = L::Load(&xi[in + 2*jump + q]);
+                V ar3 = L::Load(&xr[in + 3*jump + q]), ai3 = L::Load(&xi[in + 3*jump + q]);
+                V t0r = ar0 + ar2, t0i = ai0 + ai2;
+                V t1r = ar0 - ar2, t1i = ai0 - ai2;
+                V t2r = ar1 + ar3, t2i = ai1 + ai3;
+                V t3r = ar1 - ar3, t3i = ai1 - ai3;
+                br[0] = t0r + t2r; bi[0] = t0i + t2i;
+                br[2] = t0r - t2r; bi[2] = t0i - t2i;
+                br[1] = t1r + t3i; bi[1] = t1i - t3r; // t1 - i t3
+                br[3] = t1r - t3i; bi[3] = t1i + t3r; // t1 + i t3
+            }
+            else {
+                // odd radix, inputs paired as (j, r-j): a_j W^jt + a_(r-j) W^-jt = sum*cos - i diff*sin
+                V ar0 = L::Load(&xr[in + q]), ai0 = L::Load(&xi[in + q]);
+                const int half = radix/2;
+                V sr[half+1], si[half+1], dr[half+1], di[half+1];
+                br[0] = ar0; bi[0] = ai0;
+                for (int j=1; j <= half; ++j) {
+                    V ajr = L::Load(&xr[in + j*jump + q]), aji = L::Load(&xi[in + j*jump + q]);
+                    V akr = L::Load(&xr[in + (radix-j)*jump + q]), aki = L::Load(&xi[in + (radix-j)*jump + q]);
+                    sr[j] = ajr + akr; si[j] = aji + aki;
+                    dr[j] = ajr - akr; di[j] = aji - aki;
+                    br[0] = br[0] + sr[j]; bi[0] = bi[0] + si[j];
+                }
+                for (int t=1; t < radix; ++t) {
+                    V re = ar0, im = ai0;
+                    for (int j=1; j <= half; ++j) {
+                        int k = (j*t) % radix;
+                        re = re + sr[j]*cosTable[k] + di[j]*sinTable[k];
+                        im = im + si[j]*cosTable[k] - dr[j]*sinTable[k];
+                    }
+                    br[t] = re; bi[t] = im;
+                }
+            }
+
+            L::Store(&yr[out + q], br[0]);
+            L::Store(&yi[out + q], bi[0]);
+            for (int t=1; t < radix; ++t) {
+                L::Store(&yr[out + t*s + q], br[t]*twr[t] - bi[t]*twi[t]);
+                L::Store(&yi[out + t*s + q], br[t]*twi[t] + bi[t]*twr[t]);
+            }
+        }
+    }
+}
+
+template <class L>
+static void RunStageForRadix(int radix, int64_t s, int64_t m, const float *twiddleReal, const float *twiddleImag,
+                             const float *xr, const float *xi, float *yr, float *yi, int64_t qBegin, int64_t qEnd)
+{
+    switch (radix) {
+        case 2: RunStage<L, 2>(s, m, twiddleReal, twiddleImag, xr, xi, yr, yi, qBegin, qEnd); break;
+        case 3: RunStage<L, 3>(s, m, twiddleReal, twiddleImag, xr, xi, yr, yi, qBegin, qEnd); break;
+        case 4: RunStage<L, 4>(s, m, twiddleReal, twiddleImag, xr, xi, yr, yi, qBegin, qEnd); break;
+        case 5: RunStage<L, 5>(s, m, twiddleReal, twiddleImag, xr, xi, yr, yi, qBegin, qEnd); break;
+        default: RunStage<L, 7>(s, m, twiddleReal, twiddleImag, xr, xi, yr, yi, qBegin, qEnd); break;
+    }
+}
+
+bool FFTPlan::IsSmooth(int64_t length)
+{
+    if (length < 1)
+        return false;
+    const int64_t primes[4] = {2, 3, 5, 7};
+    for (int i=0; i < 4; ++i)
+        while (length % primes[i] == 0)
+            length /= primes[i];
+    return length == 1;
+}
+
+FFTPlan::FFTPlan(int64_t length) :
+mLength(length < 1 ? 1 : length),
+mScratchLength(mLength),
+mUsesBluestein(false),
+mConvolutionLength(0)
+{
+    if (IsSmooth(mLength)) {
+        // radix 4 first (fewest passes), then what is left
+        int64_t rest = mLength;
+        while (rest % 4 == 0) { mRadices.push_back(4); rest /= 4; }
+        const int others[4] = {2, 3, 5, 7};
+        for (int i=0; i < 4; ++i)
+            while (rest % others[i] == 0) { mRadices.push_back(others[i]); rest /= others[i]; }
+
+        int64_t stride = 1;
+        for (size_t i=0; i < mRadices.size(); ++i) {
+            Stage stage;
+            stage.radix = mRadices[i];
+            stage.stride = stride;
+            int64_t subLength = mLength/stride;
+            stage.numGroups = subLength/stage.radix;
+            stage.twiddleReal.resize((size_t)(stage.numGroups*(stage.radix-1)));
+            stage.twiddleImag.resize((size_t)(stage.numGroups*(stage.radix-1)));
+            for (int64_t p=0; p < stage.numGroups; ++p) {
+                for (int t=1; t < stage.radix; ++t) {
+                    double phase = -2.0*M_PI*(double)(p*t)/(double)subLength;
+                    stage.twiddleReal[(size_t)(p*(stage.radix-1) + t-1)] = (float)cos(phase);
+                    stage.twiddleImag[(size_t)(p*(stage.radix-1) + t-1)] = (float)sin(phase);
+                }
+            }
+            mStages.push_back(stage);
+            stride *= stage.radix;
+        }
+        return;
+    }
+
+    // Bluestein, circular convolution of length M >= 2N-1 done with a power of two plan
+    mUsesBluestein = true;
+    mConvolutionLength = 1;
+    while (mConvolutionLength < 2*mLength - 1)
+        mConvolutionLength *= 2;
+    mConvolutionPlan = Shared(mConvolutionLength);
+    mScratchLength = mConvolutionLength + mConvolutionPlan->ScratchLength();
+
+    mChirpReal.resize((size_t)mLength);
+    mChirpImag.resize((size_t)mLength);
+    for (int64_t n=0; n < mLength; ++n) {
+        int64_t nSquared = (n*n) % (2*mLength); // keeps the phase exact for long transforms
+        double phase = -M_PI*(double)nSquared/(double)mLength;
+        mChirpReal[(size_t)n] = (float)cos(phase);
+        mChirpImag[(size_t)n] = (float)sin(phase);
+    }
+
+    size_t M = (size_t)mConvolutionLength;
+    mKernelReal.assign(M, 0.0f);
+    mKernelImag.assign(M, 0.0f);
+    for (int64_t n=0; n < mLength; ++n) {
+        mKernelReal[(size_t)n] = mChirpReal[(size_t)n];
+        mKernelImag[(size_t)n] = -mChirpImag[(size_t)n];
+        if (n > 0) {
+            mKernelReal[M - (size_t)n] = mChirpReal[(size_t)n];
+            mKernelImag[M - (size_t)n] = -mChirpImag[(size_t)n];
+        }
+    }
+    std::vector<float> scratchReal((size_t)mConvolutionPlan->ScratchLength()), scratchImag(scratchReal.size());
+    mConvolutionPlan->Forward(&mKernelReal[0], &mKernelImag[0], &scratchReal[0], &scratchImag[0]);
+    float scale = 1.0f/(float)mConvolutionLength; // folds the inverse transform's 1/M in
+    for (size_t k=0; k < M; ++k) {
+        mKernelReal[k] *= scale;
+        mKernelImag[k] *= scale;
+    }
+}
+
+FFTPlan::~FFTPlan()
+{
+}
+
+typedef std::map<int64_t, std::shared_ptr<const FFTPlan> > PlanCache;
+
+static std::mutex &PlanCacheLock()
+{
+    static std::mutex lock;
+    return lock;
+}
+
+static PlanCache &SharedPlanCache()
+{
+    static PlanCache cache; // plans live until the process exits
+    return cache;
+}
+
+std::shared_ptr<const FFTPlan> FFTPlan::Shared(int64_t length)
+{
+    {
+        std::lock_guard<std::mutex> lock(PlanCacheLock());
+        PlanCache::iterator found = SharedPlanCache().find(length);
+        if (found != SharedPlanCache().end())
+            return found->second;
+    }
+
+    // built without the lock (a Bluestein plan asks for its power of two plan), first one in wins
+    std::shared_ptr<const FFTPlan> plan(new FFTPlan(length));
+    std::lock_guard<std::mutex> lock(PlanCacheLock());
+    return SharedPlanCache().insert(std::make_pair(length, plan)).first->second;
+}
+
+int64_t FFTPlan::NumSharedPlans()
+{
+    std::lock_guard<std::mutex> lock(PlanCacheLock());
+    return (int64_t)SharedPlanCache().size();
+}
+
+void FFTPlan::Forward(float *real, float *imag, float *scratchReal, float *scratchImag) const
+{
+    if (mUsesBluestein)
+        RunBluestein(real, imag, scratchReal, scratchImag);
+    else
+        RunStages(real, imag, scratchReal, scratchImag);
+}
+
+void FFTPlan::Inverse(float *real, float *imag, float *scratchReal, float *scratchImag) const
+{
+    // swapping real and imaginary parts on the way in and out turns the forward transform into the inverse
+    Forward(imag, real, scratchImag, scratchReal);
+}
+
+void FFTPlan::RunStages(float *real, float *imag, float *scratchReal, float *scratchImag) const
+{
+    const float *xr = real, *xi = imag;
+    float *yr = scratchReal, *yi = scratchImag;
+    for (size_t i=0; i < mStages.size(); ++i) {
+        const Stage &stage = mStages[i];
+        const float *twr = stage.twiddleReal.empty() ? NULL : &stage.twiddleReal[0];
+        const float *twi = stage.twiddleImag.empty() ? NULL : &stage.twiddleImag[0];
+        int64_t vectorEnd = stage.stride - stage.stride % VectorLanes::kNumLanes;
+        if (vectorEnd > 0)
+            RunStageForRadix<VectorLanes>(stage.radix, stage.stride, stage.numGroups, twr, twi, xr, xi, yr, yi, 0, vectorEnd);
+        if (vectorEnd < stage.stride)
+            RunStageForRadix<ScalarLanes>(stage.radix, stage.stride, stage.numGroups, twr, twi, xr, xi, yr, yi, vectorEnd, stage.stride);
+
+        // ping pong between the data and the scratch
+        const float *nextReal = yr, *nextImag = yi;
+        yr = (yr == scratchReal) ? real : scratchReal;
+        yi = (yi == scratchImag) ? imag : scratchImag;
+        xr = nextReal;
+        xi = nextImag;
+    }
+    if (xr != real) {
+        memcpy(real, xr, sizeof(float)*(size_t)mLength);
+        memcpy(imag, xi, sizeof(float)*(size_t)mLength);
+    }
+}
+
+void FFTPlan::RunBluestein(float *real, float *imag, float *scratchReal, float *scratchImag) const
+{
+    const int64_t N = mLength, M = mConvolutionLength;
+    float *ar = scratchReal, *ai = scratchImag;              // M, the sequence being convolved
+    float *subReal = &scratchReal[M], *subImag = &scratchImag[M];
+
+    for (int64_t n=0; n < N; ++n) {
+        float cr = mChirpReal[(size_t)n], ci = mChirpImag[(size_t)n];
+        ar[n] = real[n]*cr - imag[n]*ci;
+        ai[n] = real[n]*ci + imag[n]*cr;
+    }
+    memset(&ar[N], 0, sizeof(float)*(size_t)(M - N));
+    memset(&ai[N], 0, sizeof(float)*(size_t)(M - N));
+
+    mConvolutionPlan->Forward(ar, ai, subReal, subImag);
+    for (int64_t k=0; k < M; ++k) {
+        float kr = mKernelReal[(size_t)k], ki = mKernelImag[(size_t)k];
+        float r = ar[k]*kr - ai[k]*ki;
+        ai[k] = ar[k]*ki + ai[k]*kr;
+        ar[k] = r;
+    }
+    mConvolutionPlan->Inverse(ar, ai, subReal, subImag);
+
+    for (int64_t k=0; k < N; ++k) {
+        float cr = mChirpReal[(size_t)k], ci = mChirpImag[(size_t)k];
+        real[k] = ar[k]*cr - ai[k]*ci;
+        imag[k] = ar[k]*ci + ai[k]*cr;
+    }
+}
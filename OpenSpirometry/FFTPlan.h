@@ -0,0 +1,75 @@
+//
+//  FFTPlan.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Portable complex FFT of any length, for the parts of the analysis that cannot use vDSP
+//  (vDSP_fft_zrip only does powers of two, and BUFFER_SIZE is 44100). Lengths made of 2, 3, 5
+//  and 7 run as a mixed radix Stockham transform (self sorting, no bit reversal), anything else
+//  goes through Bluestein's chirp z transform on a power of two. Data is split complex (separate
+//  real and imaginary arrays, like vDSP's COMPLEX_SPLIT) and the butterflies run four lanes at
+//  a time with SSE on x86 and NEON on ARM.
+//
+//  A plan only holds constants (factors and twiddles) and is never changed once built, so one
+//  plan per length is shared by the whole process through Shared(). Scratch space belongs to
+//  the caller, which keeps the transform itself allocation free and safe on any thread.
+
+#ifndef OpenSpirometry_FFTPlan_h
+#define OpenSpirometry_FFTPlan_h
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+
+class FFTPlan {
+
+public:
+    explicit FFTPlan(int64_t length); // prefer Shared(), this builds a private copy of the tables
+    ~FFTPlan();
+
+    // one plan per length for the whole process, built on first use (thread safe)
+    static std::shared_ptr<const FFTPlan> Shared(int64_t length);
+    static int64_t NumSharedPlans();
+
+    // in place, unscaled, X_k = sum x_n e^(-2 pi i k n/N); scratch arrays hold ScratchLength() floats each
+    void Forward(float *real, float *imag, float *scratchReal, float *scratchImag) const;
+    // unscaled inverse (multiply by 1/N to undo Forward)
+    void Inverse(float *real, float *imag, float *scratchReal, float *scratchImag) const;
+
+    int64_t Length() const { return mLength; }
+    int64_t ScratchLength() const { return mScratchLength; }
+    bool UsesBluestein() const { return mUsesBluestein; }
+    const std::vector<int> &Radices() const { return mRadices; } // empty for Bluestein
+
+    static bool IsSmooth(int64_t length); // only factors of 2, 3, 5 and 7
+
+protected:
+    struct Stage {
+        int radix;
+        int64_t stride;         // s, product of the radices before this stage
+        int64_t numGroups;      // m, (sub transform length)/radix
+        std::vector<float> twiddleReal; // W_(radix*m)^(p*t) for p < m, 1 <= t < radix
+        std::vector<float> twiddleImag;
+    };
+
+    void RunStages(float *real, float *imag, float *scratchReal, float *scratchImag) const;
+    void RunBluestein(float *real, float *imag, float *scratchReal, float *scratchImag) const;
+
+    int64_t mLength;
+    int64_t mScratchLength;
+    bool mUsesBluestein;
+    std::vector<int> mRadices;
+    std::vector<Stage> mStages;
+
+    // Bluestein: x_n w_n convolved with conj(w) by a power of two transform, then times w_k
+    std::shared_ptr<const FFTPlan> mConvolutionPlan;
+    int64_t mConvolutionLength;
+    std::vector<float> mChirpReal;      // w_n = e^(-i pi n^2/N)
+    std::vector<float> mChirpImag;
+    std::vector<float> mKernelReal;     // FFT of conj(w) wrapped around, scaled by 1/M
+    std::vector<float> mKernelImag;
+};
+
+#endif
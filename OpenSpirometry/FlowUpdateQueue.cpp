@@ -0,0 +1,43 @@
+//
+//  FlowUpdateQueue.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "FlowUpdateQueue.h"
+
+FlowUpdateQueue::FlowUpdateQueue()
+{
+    Clear();
+}
+
+void FlowUpdateQueue::Clear()
+{
+    mPushed.store(0);
+    mPopped.store(0);
+    mDropped.store(0);
+}
+
+bool FlowUpdateQueue::Push(const FlowUpdate &update)
+{
+    int64_t pushed = mPushed.load(std::memory_order_relaxed);
+    if (pushed - mPopped.load(std::memory_order_acquire) >= kFlowUpdateQueueLength) {
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    mUpdates[pushed % kFlowUpdateQueueLength] = update;
+    mPushed.store(pushed + 1, std::memory_order_release);
+    return true;
+}
+
+bool FlowUpdateQueue::Pop(FlowUpdate *update)
+{
+    int64_t popped = mPopped.load(std::memory_order_relaxed);
+    if (popped == mPushed.load(std::memory_order_acquire))
+        return false;
+    *update = mUpdates[popped % kFlowUpdateQueueLength];
+    mPopped.store(popped + 1, std::memory_order_release);
+    return true;
+}
@@ -0,0 +1,57 @@
+//
+//  FlowUpdateQueue.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Flow and volume updates on their way from the analysis queue to the delegate on the main
+//  queue. The analysis pushes each update (with the live measures and the latency trace when
+//  someone wants them) into a fixed ring and merges a count into a dispatch source; the main
+//  queue drains the ring when it wakes. Like StageEventQueue it is single producer, single
+//  consumer and never locks or allocates, so the analysis does not copy a block to the heap for
+//  every window the way a dispatch_async per update does. If the main queue falls a whole ring
+//  behind, the newest updates are dropped and counted.
+
+#ifndef OpenSpirometry_FlowUpdateQueue_h
+#define OpenSpirometry_FlowUpdateQueue_h
+
+#include <stdint.h>
+#include <atomic>
+#include "StreamingEffortMetrics.h"
+#include "LatencyMonitor.h"
+
+#define kFlowUpdateQueueLength 256 // over a second of windows
+
+struct FlowUpdate {
+    float flowInLitersPerSecond;
+    float volumeInLiters;
+    float confidence;                   // -1 if the estimate has none
+    bool hasLiveMetrics;
+    LiveEffortMetrics liveMetrics;      // right after this update
+    bool hasTrace;
+    LatencyTrace trace;                 // recorded as delivered once the delegate has it
+};
+
+class FlowUpdateQueue {
+
+public:
+    FlowUpdateQueue();
+
+    // producer
+    bool Push(const FlowUpdate &update); // false (and counted) if full
+    // consumer
+    bool Pop(FlowUpdate *update);
+
+    int64_t Size() { return mPushed.load(std::memory_order_acquire) - mPopped.load(std::memory_order_acquire); }
+    int64_t NumDropped() { return mDropped.load(std::memory_order_relaxed); }
+    void Clear(); // neither side running
+
+protected:
+    FlowUpdate mUpdates[kFlowUpdateQueueLength];
+    alignas(64) std::atomic<int64_t> mPushed;
+    alignas(64) std::atomic<int64_t> mPopped;
+    std::atomic<int64_t> mDropped;
+};
+
+#endif
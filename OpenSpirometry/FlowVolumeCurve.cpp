@@ -0,0 +1,460 @@
+//
+//  FlowVolumeCurve.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "FlowVolumeCurve.h"
+#include "SpirometerConstants.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+// lowpass filter created in python, same taps as finalizeCurvesAndGetResults
+static const float kFlowLowPassTaps[] = {
+    -0.0570114635f, 0.0477192582f, 0.0345309828f, 0.0268428757f, 0.0225935565f, 0.0203979552f, 0.0194419320f,
+    0.0192504413f, 0.0196427420f, 0.0203327997f, 0.0210234412f, 0.0219978553f, 0.0228894845f, 0.0237515661f,
+    0.0246741134f, 0.0254770231f, 0.0263172908f, 0.0270086622f, 0.0277167684f, 0.0282894016f, 0.0287857463f,
+    0.0291875253f, 0.0295200754f, 0.0297003562f, 0.0298753302f, 0.0298742843f, 0.0298753302f, 0.0297003562f,
+    0.0295200754f, 0.0291875253f, 0.0287857463f, 0.0282894016f, 0.0277167684f, 0.0270086622f, 0.0263172908f,
+    0.0254770231f, 0.0246741134f, 0.0237515661f, 0.0228894845f, 0.0219978553f, 0.0210234412f, 0.0203327997f,
+    0.0196427420f, 0.0192504413f, 0.0194419320f, 0.0203979552f, 0.0225935565f, 0.0268428757f, 0.0345309828f,
+    0.0477192582f, -0.0570114635f,
+};
+static const int64_t kNumFlowLowPassTaps = sizeof(kFlowLowPassTaps)/sizeof(float);
+
+FlowVolumeCurve::FlowVolumeCurve(float preferredSamplingInterval, int64_t capacity) :
+mStorage(NULL),
+mCapacity(0),
+mNumGrowths(0),
+mLiveMetrics(preferredSamplingInterval),
+mPreferredSamplingInterval(preferredSamplingInterval)
+{
+    if (capacity <= 0) // whole test plus the analysis window and a little slack
+        capacity = (int64_t)((TEST_MAX_DURATION_SECONDS + 2) / preferredSamplingInterval);
+    Reserve(capacity);
+    mNumGrowths = 0;
+    for (int64_t i = 0; i < kMaxNumEffortErrors; i++) { // kept across Clear, only longer text allocates
+        mErrors[i].key.reserve(kEffortErrorTextCapacity);
+        mErrors[i].message.reserve(kEffortErrorTextCapacity);
+    }
+    mSpline.SetWindowLength(kNumSplineKnots);
+    Clear();
+}
+
+FlowVolumeCurve::~FlowVolumeCurve()
+{
+    delete [] mStorage;
+}
+
+void FlowVolumeCurve::Reserve(int64_t capacity)
+{
+    float *storage = new float[5*capacity];
+    if (mStorage) {
+        memcpy(&storage[0], mTime, mNumSamples*sizeof(float));
+        memcpy(&storage[capacity], mFlow, mNumSamples*sizeof(float));
+        memcpy(&storage[2*capacity], mVolume, mNumSamples*sizeof(float));
+        memcpy(&storage[3*capacity], mFilteredFlow, mNumSamples*sizeof(float));
+        memcpy(&storage[4*capacity], mResultTime, mNumSamples*sizeof(float));
+        delete [] mStorage;
+        mNumGrowths++;
+    }
+    mStorage = storage;
+    mCapacity = capacity;
+    mTime = &mStorage[0];
+    mFlow = &mStorage[capacity];
+    mVolume = &mStorage[2*capacity];
+    mFilteredFlow = &mStorage[3*capacity];
+    mResultTime = &mStorage[4*capacity];
+    mBackExtrapolationSpline.Reserve(capacity); // fits at most the whole curve
+}
+
+void FlowVolumeCurve::Clear()
+{
+    mIsFinalized = false;
+    mNumErrors = 0;
+    mNumArtifacts = 0;
+    mNumSamples = 0;
+    mNumEstimates = 0;
+    mSpline.ClearPoints();
+    mPeakFlow = 0;
+    mInitialTime = 0;
+    mNumFiltered = 0;
+    mFilteredPeak = -1;
+    mExtrapolatedPeak = -1;
+    mNumExtrapolated = 0;
+    mTimeZeroIndex = -1;
+    mLiveMetrics.Clear();
+}
+
+void FlowVolumeCurve::AppendConstantSample(float flow, float volume, float time)
+{
+    if (mNumSamples == mCapacity)
+        Reserve(2*mCapacity); // longer than any valid effort, keep going rather than lose the tail
+
+    mTime[mNumSamples] = time;
+    mFlow[mNumSamples] = flow;
+    mVolume[mNumSamples] = volume;
+    mResultTime[mNumSamples] = mTimeZeroIndex > 0 ? mPreferredSamplingInterval*(mNumSamples-mTimeZeroIndex+1) : time;
+    if (mNumSamples == 0 || flow > mPeakFlow)
+        mPeakFlow = flow;
+    mNumSamples++;
+    mLiveMetrics.AddSample(mTime, mFlow, mVolume, mNumSamples);
+
+    // the sample that now has all of its taps, then the start once the peak has settled
+    if (mNumSamples >= kNumFlowLowPassTaps) {
+        AddFilteredSample(mNumFiltered);
+        mNumFiltered++;
+        if (mFilteredPeak != mExtrapolatedPeak && mNumFiltered - mFilteredPeak > kNumSamplesToSettlePeak)
+            BackExtrapolateFlowBeginning();
+    }
+}
+
+void FlowVolumeCurve::AddFlowEstimate(float flow, double time)
+{
+    // Always assuming that data is arriving more slowly than our preferred sampling rate
+    if (mIsFinalized)
+        Reopen();
+    if (mNumSamples == 0)
+        mInitialTime = (float)time;
+    mSpline.PushPoint((float)(time - mInitialTime), flow); // the window keeps the last kNumSplineKnots estimates
+    mNumEstimates++;
+
+    if (mNumSamples == 0) {
+        AppendConstantSample(flow, 0, 0); // start with zero volume
+    }
+    else if (mNumSamples == 1) { // linearly interpolate from last entry
+        float timeX0 = mTime[0]; // already referenced to zero
+        float timeX1 = (float)(time - mInitialTime);
+        float flowX0 = mFlow[0];
+        float flowX1 = flow;
+
+        float slope = (flowX1-flowX0) / (timeX1 - timeX0);
+
+        float fillTime = timeX0 + mPreferredSamplingInterval;
+        float newVolume = mVolume[0];
+
+        while (fillTime <= timeX1) {
+            float newFlow = flowX0 + slope*(fillTime-timeX0);
+            newVolume += newFlow*mPreferredSamplingInterval;
+            AppendConstantSample(newFlow, newVolume, fillTime);
+            fillTime += mPreferredSamplingInterval;
+        }
+    }
+    else if (mNumEstimates >= 3) {
+        // spline through up to the last 5 estimates, evaluated a block of output times at a time
+        float lastKnotTime = (float)(time - mInitialTime);
+        float fillTime = mTime[mNumSamples-1] + mPreferredSamplingInterval;
+        float newVolume = mVolume[mNumSamples-1];
+        float fillTimes[kNumFillSamplesPerBlock], newFlows[kNumFillSamplesPerBlock];
+
+        while (fillTime <= lastKnotTime) {
+            int64_t numFill = 0;
+            while (numFill < kNumFillSamplesPerBlock && fillTime <= lastKnotTime) {
+                fillTimes[numFill++] = fillTime;
+                fillTime += mPreferredSamplingInterval;
+            }
+            mSpline.Interpolate(fillTimes, newFlows, numFill);
+            for (int64_t i = 0; i < numFill; i++) {
+                float newFlow = newFlows[i];
+                // if the interpolation is off, just add the last flow rate
+                if (newFlow < 0)
+                    newFlow = mFlow[mNumSamples-1];
+                newVolume += newFlow*mPreferredSamplingInterval;
+                AppendConstantSample(newFlow, newVolume, fillTimes[i]);
+            }
+        }
+    }
+}
+
+float FlowVolumeCurve::EstimateOfTotalVolume()
+{
+    return mNumSamples > 0 ? mVolume[mNumSamples-1] : 0;
+}
+
+void FlowVolumeCurve::AddCustomError(const char *errorMessage, const char *customKey)
+{
+    ErrorIndex(errorMessage, customKey);
+}
+
+// the error of the key with the message (added if there is room), -1 if there is none
+int64_t FlowVolumeCurve::ErrorIndex(const char *errorMessage, const char *customKey)
+{
+    for (int64_t i = 0; i < mNumErrors; i++) {
+        if (mErrors[i].key == customKey) {
+            if (mErrors[i].message.compare(0, (size_t)mMessageLength[i], errorMessage) != 0) { // artifact times aside
+                mErrors[i].message = errorMessage;
+                mMessageLength[i] = (int64_t)mErrors[i].message.size();
+            }
+            return i;
+        }
+    }
+    if (mNumErrors < kMaxNumEffortErrors) {
+        mErrors[mNumErrors].key = customKey;
+        mErrors[mNumErrors].message = errorMessage;
+        mMessageLength[mNumErrors] = (int64_t)mErrors[mNumErrors].message.size();
+        return mNumErrors++;
+    }
+    return -1;
+}
+
+void FlowVolumeCurve::AddArtifact(const char *errorMessage, const char *customKey, double startTime, double endTime)
+{
+    int64_t error = ErrorIndex(errorMessage, customKey);
+    if (error < 0 || mNumArtifacts == kMaxNumEffortArtifacts)
+        return;
+    EffortArtifact &artifact = mArtifacts[mNumArtifacts++];
+    artifact.error = error;
+    artifact.startTime = startTime;
+    artifact.endTime = endTime;
+}
+
+float FlowVolumeCurve::FEVOne()
+{
+    // times only ever increase, so the first sample past one second is a binary search away
+    // (once finalized, one second after the back extrapolated start)
+    const float oneSecond = 1.0f;
+    const float *time = mIsFinalized ? mResultTime : mTime;
+    const float *first = std::upper_bound(time, time + mNumSamples, oneSecond);
+    return first < time + mNumSamples ? mVolume[first - time] : 0;
+}
+
+float FlowVolumeCurve::FEVOneOverFVC()
+{
+    float ratio = FEVOne()/FVC();
+    return isnan(ratio) ? 0 : ratio;
+}
+
+// where a stream time falls on the results' time axis (moved with the back extrapolated start)
+float FlowVolumeCurve::ResultTime(double timeStamp)
+{
+    float time = (float)(timeStamp - mInitialTime);
+    if (mTimeZeroIndex > 0)
+        time -= mTime[mTimeZeroIndex] - mResultTime[mTimeZeroIndex];
+    return time;
+}
+
+// each artifact error's message followed by " at 0.52-0.66 s, 1.80-1.95 s", as many as fit the
+// reserved text
+void FlowVolumeCurve::ListArtifactTimes()
+{
+    for (int64_t e = 0; e < mNumErrors; e++) {
+        bool isFirst = true;
+        for (int64_t a = 0; a < mNumArtifacts; a++) {
+            if (mArtifacts[a].error != e)
+                continue;
+            if (isFirst)
+                mErrors[e].message.resize((size_t)mMessageLength[e]);
+            char text[48];
+            int length = snprintf(text, sizeof(text), "%s %.2f-%.2f s", isFirst ? " at" : ",",
+                                  ResultTime(mArtifacts[a].startTime), ResultTime(mArtifacts[a].endTime));
+            isFirst = false;
+            if (length <= 0 || mErrors[e].message.size() + length >= kEffortErrorTextCapacity)
+                break;
+            mErrors[e].message.append(text, (size_t)length);
+        }
+    }
+}
+
+void FlowVolumeCurve::FinalizeCurves(FlowVolumeResults *results)
+{
+    // only the tail is left: the samples whose taps run past the end, and a refit if one is the peak
+    for (int64_t n = mNumFiltered; n < mNumSamples; n++)
+        AddFilteredSample(n);
+    if (mFilteredPeak != mExtrapolatedPeak)
+        BackExtrapolateFlowBeginning();
+    ListArtifactTimes();
+    mIsFinalized = true;
+
+    results->numSamples = mNumSamples;
+    results->timeStamps = mResultTime;
+    results->flow = mFilteredFlow;
+    results->volume = mVolume;
+    results->peakFlowInLitersPerSecond = PeakFlow();
+    results->fevOneInLiters = FEVOne();
+    results->fvcInLiters = FVC();
+    results->fevOneOverFvc = FEVOneOverFVC();
+    results->numErrors = mNumErrors;
+    results->errors = mErrors;
+}
+
+float FlowVolumeCurve::FilteredSample(int64_t n)
+{
+    // same alignment as vDSP_conv with the filter reversed: output[n] = sum_p series[n+p]*taps[P-1-p]
+    // samples past the end of the series count as zero
+    float sum = 0;
+    int64_t numTaps = std::min(mNumSamples - n, kNumFlowLowPassTaps);
+    for (int64_t p = 0; p < numTaps; p++)
+        sum += mFlow[n+p]*kFlowLowPassTaps[kNumFlowLowPassTaps-1-p];
+    return sum;
+}
+
+void FlowVolumeCurve::AddFilteredSample(int64_t n)
+{
+    mFilteredFlow[n] = FilteredSample(n);
+    if (mFilteredPeak < 0 || mFilteredFlow[n] > mFilteredFlow[mFilteredPeak])
+        mFilteredPeak = n;
+}
+
+void FlowVolumeCurve::BackExtrapolateFlowBeginning()
+{
+    float *flow = mFilteredFlow;
+    if (mFilteredPeak < 0)
+        return;
+
+    // undo the last fit, the search below needs the filtered flow as it was
+    for (int64_t i = 0; i < mNumExtrapolated; i++)
+        flow[i] = FilteredSample(i);
+    mNumExtrapolated = 0;
+    mExtrapolatedPeak = mFilteredPeak;
+
+    int64_t maxPosition = mFilteredPeak;
+
+    int64_t idxStartValidFlow = 5;
+    // start at peak flow and find where we are not monotonic
+    if (maxPosition > NUM_SAMPLES_BACK_FROM_PEAKFLOW_TO_INTERPOLATE)
+        idxStartValidFlow = maxPosition - NUM_SAMPLES_BACK_FROM_PEAKFLOW_TO_INTERPOLATE;
+
+    while (idxStartValidFlow > 5) {
+        if (flow[idxStartValidFlow-1] < flow[idxStartValidFlow])
+            idxStartValidFlow--;
+        else
+            break;
+    }
+
+    // need at least two knots between the start of valid flow and the peak
+    if (maxPosition - idxStartValidFlow < 2) {
+        SetTimeZero(-1);
+        return;
+    }
+
+    mBackExtrapolationSpline.SetPoints(&mTime[idxStartValidFlow], &flow[idxStartValidFlow], maxPosition - idxStartValidFlow);
+
+    // now get the interpolated values if they are greater than zero
+    int64_t firstNonZeroElement = -1;
+    float extrapolated[kNumFillSamplesPerBlock];
+    for (int64_t start = 0; start < idxStartValidFlow; start += kNumFillSamplesPerBlock) {
+        int64_t numInBlock = std::min<int64_t>(kNumFillSamplesPerBlock, idxStartValidFlow - start);
+        mBackExtrapolationSpline.Interpolate(&mTime[start], extrapolated, numInBlock);
+        for (int64_t k = 0; k < numInBlock; k++) {
+            int64_t i = start + k;
+            float tmp = extrapolated[k];
+            if (tmp >= 0 && tmp < flow[i]) {
+                flow[i] = tmp;
+                if (firstNonZeroElement < 0)
+                    firstNonZeroElement = i;
+            }
+            else if (tmp < 0)
+                flow[i] = 0.0f;
+        }
+    }
+    mNumExtrapolated = idxStartValidFlow;
+    SetTimeZero(firstNonZeroElement);
+}
+
+// more estimates after finalizing: back to streaming, the tail gets its taps as samples arrive
+void FlowVolumeCurve::Reopen()
+{
+    for (int64_t i = 0; i < mNumExtrapolated; i++)
+        mFilteredFlow[i] = FilteredSample(i);
+    mNumExtrapolated = 0;
+    mExtrapolatedPeak = -1;
+    mFilteredPeak = -1;
+    for (int64_t n = 0; n < mNumFiltered; n++)
+        if (mFilteredPeak < 0 || mFilteredFlow[n] > mFilteredFlow[mFilteredPeak])
+            mFilteredPeak = n;
+    mIsFinalized = false;
+}
+
+void FlowVolumeCurve::SetTimeZero(int64_t timeZeroIndex)
+{
+    if (timeZeroIndex == mTimeZeroIndex)
+        return;
+    mTimeZeroIndex = timeZeroIndex;
+    for (int64_t i = 0; i < mNumSamples; i++)
+        mResultTime[i] = mTimeZeroIndex > 0 ? mPreferredSamplingInterval*(i-mTimeZeroIndex+1) : mTime[i];
+}
+
+//=============================================================================================================
+// Serialization of the columnar results
+
+template <typename T> static inline void WriteValue(uint8_t *buffer, int64_t *position, T value)
+{
+    memcpy(&buffer[*position], &value, sizeof(T));
+    *position += sizeof(T);
+}
+
+template <typename T> static inline T ReadValue(const uint8_t *buffer, int64_t *position)
+{
+    T value;
+    memcpy(&value, &buffer[*position], sizeof(T));
+    *position += sizeof(T);
+    return value;
+}
+
+static const int64_t kFlowVolumeHeaderSize = 2*sizeof(uint32_t) + sizeof(int64_t) + 4*sizeof(float);
+
+int64_t FlowVolumeResults::SerializedSize() const
+{
+    int64_t size = kFlowVolumeHeaderSize + 3*numSamples*sizeof(float) + sizeof(uint32_t);
+    for (int64_t i = 0; i < numErrors; i++)
+        size += 2*sizeof(uint32_t) + errors[i].key.size() + errors[i].message.size();
+    return size;
+}
+
+int64_t FlowVolumeResults::Serialize(uint8_t *buffer) const
+{
+    int64_t position = 0;
+    WriteValue<uint32_t>(buffer, &position, kFlowVolumeResultsMagic);
+    WriteValue<uint32_t>(buffer, &position, kFlowVolumeResultsVersion);
+    WriteValue<int64_t>(buffer, &position, numSamples);
+    WriteValue<float>(buffer, &position, peakFlowInLitersPerSecond);
+    WriteValue<float>(buffer, &position, fevOneInLiters);
+    WriteValue<float>(buffer, &position, fvcInLiters);
+    WriteValue<float>(buffer, &position, fevOneOverFvc);
+
+    const float *columns[3] = {timeStamps, flow, volume};
+    for (int c = 0; c < 3; c++) {
+        if (numSamples > 0)
+            memcpy(&buffer[position], columns[c], numSamples*sizeof(float));
+        position += numSamples*sizeof(float);
+    }
+
+    WriteValue<uint32_t>(buffer, &position, (uint32_t)numErrors);
+    for (int64_t i = 0; i < numErrors; i++) {
+        const std::string *strings[2] = {&errors[i].key, &errors[i].message};
+        for (int s = 0; s < 2; s++) {
+            WriteValue<uint32_t>(buffer, &position, (uint32_t)strings[s]->size());
+            memcpy(&buffer[position], strings[s]->data(), strings[s]->size());
+            position += strings[s]->size();
+        }
+    }
+    return position;
+}
+
+bool ReadSerializedFlowVolumeResults(const uint8_t *buffer, int64_t length, FlowVolumeResults *results)
+{
+    if (length < kFlowVolumeHeaderSize)
+        return false;
+    int64_t position = 0;
+    if (ReadValue<uint32_t>(buffer, &position) != kFlowVolumeResultsMagic ||
+        ReadValue<uint32_t>(buffer, &position) != kFlowVolumeResultsVersion)
+        return false;
+    results->numSamples = ReadValue<int64_t>(buffer, &position);
+    results->peakFlowInLitersPerSecond = ReadValue<float>(buffer, &position);
+    results->fevOneInLiters = ReadValue<float>(buffer, &position);
+    results->fvcInLiters = ReadValue<float>(buffer, &position);
+    results->fevOneOverFvc = ReadValue<float>(buffer, &position);
+    if (results->numSamples < 0 || length - position < 3*results->numSamples*(int64_t)sizeof(float))
+        return false;
+
+    // columns are 4 byte aligned in the blob as long as the blob itself is
+    results->timeStamps = (const float *)&buffer[position];
+    results->flow = results->timeStamps + results->numSamples;
+    results->volume = results->flow + results->numSamples;
+    results->numErrors = 0;
+    results->errors = NULL;
+    return true;
+}
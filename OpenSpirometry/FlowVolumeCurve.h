@@ -0,0 +1,143 @@
+//
+//  FlowVolumeCurve.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Portable core of FlowVolumeDataAnalyzer: resamples flow estimates to a constant rate,
+//  integrates volume and finalizes the curves (low pass, back extrapolation, scalar measures).
+//  The curves live in one preallocated block of floats (time, flow, volume, filtered flow and
+//  result time columns) sized for TEST_MAX_DURATION_SECONDS, so adding estimates and finalizing
+//  do not allocate. Results are handed back as columns that point into that block.
+//
+//  The post processing streams with the samples. Each filtered sample is computed as soon as
+//  the low pass has all of its taps. The back extrapolation of the start is fit once the
+//  filtered peak is kNumSamplesToSettlePeak samples old, and fit again only if a later peak
+//  replaces it. Finalizing filters the last taps worth of samples (zero past the end) and
+//  refits only if one of them became the peak, so it costs the same for any effort length.
+//  The curves are the same as filtering and extrapolating the whole curve at the end.
+
+#ifndef OpenSpirometry_FlowVolumeCurve_h
+#define OpenSpirometry_FlowVolumeCurve_h
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include "SplineInterpolator.h"
+#include "StreamingEffortMetrics.h"
+
+#define kMaxNumEffortErrors 8
+#define kEffortErrorTextCapacity 128 // characters reserved for each key and message, so flagging an error does not allocate
+#define kMaxNumEffortArtifacts 16  // timed artifacts listed in the errors, later ones are left out
+#define kFlowVolumeResultsMagic 0x56465053 // "SPFV" when read as little endian bytes
+#define kFlowVolumeResultsVersion 1
+
+struct EffortError {
+    std::string key;        // same keys as the ErrorsDictionary
+    std::string message;
+};
+
+// columnar results, the arrays are only valid until the curve is cleared or more data is added
+struct FlowVolumeResults {
+    int64_t numSamples;
+    const float *timeStamps;        // TimeStampsForFlowAndVolume
+    const float *flow;              // FlowCurveInLitersPerSecond (filtered and back extrapolated)
+    const float *volume;            // VolumeCurveInLiters
+    float peakFlowInLitersPerSecond;
+    float fevOneInLiters;
+    float fvcInLiters;
+    float fevOneOverFvc;
+    int64_t numErrors;
+    const EffortError *errors;
+
+    // Binary layout, little endian, no padding between fields:
+    //   uint32 magic, uint32 version, int64 numSamples, float peakFlow, fevOne, fvc, fevOneOverFvc,
+    //   float timeStamps[numSamples], flow[numSamples], volume[numSamples],
+    //   uint32 numErrors, then per error: uint32 keyLength, key bytes, uint32 messageLength, message bytes
+    int64_t SerializedSize() const;
+    int64_t Serialize(uint8_t *buffer) const; // buffer must hold SerializedSize() bytes, returns bytes written
+};
+
+// reads the header and columns of a blob written by Serialize (columns point into the blob, errors are skipped)
+bool ReadSerializedFlowVolumeResults(const uint8_t *buffer, int64_t length, FlowVolumeResults *results);
+
+class FlowVolumeCurve {
+
+public:
+    FlowVolumeCurve(float preferredSamplingInterval = 1.0f/100.0f, int64_t capacity = 0); // 0 sizes for TEST_MAX_DURATION_SECONDS
+    ~FlowVolumeCurve();
+
+    void AddFlowEstimate(float flowInLitersPerSecond, double timeStamp);
+    float EstimateOfTotalVolume();
+    void AddCustomError(const char *errorMessage, const char *customKey); // replaces the message if the key exists
+    // the error of customKey, its message followed by when each artifact of that key happened
+    // (startTime and endTime in stream seconds, listed on the results' time axis once finalized)
+    void AddArtifact(const char *errorMessage, const char *customKey, double startTime, double endTime);
+    void FinalizeCurves(FlowVolumeResults *results);
+    void Clear();
+
+    float PeakFlow() { return mNumSamples > 0 ? mPeakFlow : 0; }
+    float FEVOne();
+    float FVC() { return EstimateOfTotalVolume(); }
+    float FEVOneOverFVC();
+    const LiveEffortMetrics &LiveMetrics() { return mLiveMetrics.Metrics(); } // provisional, updated with every sample
+    bool IsFinalized() { return mIsFinalized; }
+    float PreferredSamplingInterval() { return mPreferredSamplingInterval; }
+    int64_t NumSamples() { return mNumSamples; }
+    int64_t Capacity() { return mCapacity; }
+    int64_t NumGrowths() { return mNumGrowths; } // times an effort outgrew the preallocated block
+
+protected:
+    void AppendConstantSample(float flow, float volume, float time);
+    void Reserve(int64_t capacity);
+    float FilteredSample(int64_t n);
+    void AddFilteredSample(int64_t n);
+    void BackExtrapolateFlowBeginning();
+    void SetTimeZero(int64_t timeZeroIndex);
+    void Reopen();
+    int64_t ErrorIndex(const char *errorMessage, const char *customKey);
+    void ListArtifactTimes();
+    float ResultTime(double timeStamp);
+
+    float *mStorage;        // five columns of mCapacity floats
+    float *mTime;
+    float *mFlow;
+    float *mVolume;
+    float *mFilteredFlow;   // low passed, with the start back extrapolated
+    float *mResultTime;     // mTime moved so the back extrapolated start is at the first interval
+    int64_t mCapacity;
+    int64_t mNumSamples;
+    int64_t mNumGrowths;
+    float mPeakFlow;        // running max of the unfiltered flow
+
+    // only the newest estimates are needed for the spline, it keeps them in a sliding window
+    enum { kNumSplineKnots = 5, kNumFillSamplesPerBlock = 32, kNumSamplesToSettlePeak = 25 };
+    int64_t mNumEstimates;
+
+    int64_t mNumFiltered;           // samples filtered with every tap, the rest wait for their look ahead
+    int64_t mFilteredPeak;          // first largest filtered sample (before back extrapolation), -1 for none
+    int64_t mExtrapolatedPeak;      // the peak the back extrapolation was fit to, -1 for none
+    int64_t mNumExtrapolated;       // filtered samples replaced by the back extrapolation
+    int64_t mTimeZeroIndex;         // first back extrapolated sample, mResultTime is moved if > 0
+
+    SplineInterpolator mSpline;                     // resampling, refit as each estimate arrives
+    SplineInterpolator mBackExtrapolationSpline;    // sized for the whole curve
+    StreamingEffortMetrics mLiveMetrics;
+    EffortError mErrors[kMaxNumEffortErrors];
+    int64_t mNumErrors;
+    struct EffortArtifact {
+        int64_t error;                      // the error it is listed in
+        double startTime;
+        double endTime;
+    };
+    EffortArtifact mArtifacts[kMaxNumEffortArtifacts];
+    int64_t mNumArtifacts;
+    int64_t mMessageLength[kMaxNumEffortErrors]; // of each error's message before the artifact times
+
+    float mInitialTime;
+    float mPreferredSamplingInterval;
+    bool mIsFinalized;
+};
+
+#endif
@@ -7,6 +7,11 @@
 //
 
 #import <Foundation/Foundation.h>
+#ifdef __cplusplus
+#include "StreamingEffortMetrics.h"
+#include "FlowVolumeCurve.h"
+#include "EffortStore.h"
+#endif
 
 @interface FlowVolumeDataAnalyzer : NSObject
 
@@ -17,10 +22,24 @@
 @property (nonatomic, readonly) BOOL isFinalized;
 @property (nonatomic, readonly) float preferredSamplingInterval; //TODO: write setter with error checking
 
+#ifdef __cplusplus
+-(id)initWithCurve:(FlowVolumeCurve*)curve; // the results of a curve filled elsewhere (an EffortSession's), which outlives this object
+#endif
 -(void)addFlowEstimateInLitersPerSecond:(float)flow withTimeStamp:(CFAbsoluteTime)time;
 -(float)getEstimateOfTotalVolumeInLiters;
+-(NSDictionary*)liveMetrics; // provisional PEF, FEV1, FVC, time zero and BEV during the effort (see StreamingEffortMetrics.h)
+#ifdef __cplusplus
+-(LiveEffortMetrics)liveMetricsSnapshot; // the same measures copied out unboxed, nothing allocated
++(NSDictionary*)dictionaryFromLiveMetrics:(const LiveEffortMetrics &)live; // keys of liveMetrics
+#endif
 -(NSDictionary*)finalizeCurvesAndGetResults;
+-(NSData*)serializedResults; // binary columnar results (FlowVolumeResults layout), nil until finalized
+#ifdef __cplusplus
+// the finalized results under key (its flags set from the errors), returns the effort's index in the store, -1 until finalized
+-(int64_t)appendToEffortStore:(EffortStore*)store withKey:(EffortKey)key;
+#endif
 -(void)addCustomErrorToEffort:(NSString*)errorMessage forKey:(NSString*)customKey; // errors are completely customizable
+-(void)addArtifactToEffort:(NSString*)errorMessage forKey:(NSString*)customKey fromTime:(double)startTime toTime:(double)endTime; // listed with when it happened
 -(void)clearDataInEffort;
 
 // how to get the data out in a good way? After finalizing:
@@ -0,0 +1,190 @@
+//
+//  FlowVolumeData.m
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#import "FlowVolumeDataAnalyzer.h"
+#import "SpirometerConstants.h"
+#include "FlowVolumeCurve.h"
+
+@interface FlowVolumeDataAnalyzer()
+
+@property (nonatomic) FlowVolumeCurve *curve; // contiguous float columns, nothing boxed until the results are asked for
+@property (nonatomic) BOOL ownsCurve;
+@property (nonatomic) FlowVolumeResults columnarResults; // set when finalized, columns point into the curve
+@property (nonatomic,readwrite) BOOL isFinalized;
+
+-(FlowVolumeResults)finalizeCurvesAndGetColumnarResults;
+
+@end
+
+@implementation FlowVolumeDataAnalyzer
+
+// override designated init
+-(id)init{
+    if(self=[super init]){
+        _isFinalized = NO;
+        _preferredSamplingInterval = 1.0/100.0;
+
+        // sized for TEST_MAX_DURATION_SECONDS up front, reused for every effort
+        _curve = new FlowVolumeCurve(_preferredSamplingInterval);
+        _ownsCurve = YES;
+
+        return self;
+    }
+    return nil;
+}
+
+-(id)initWithCurve:(FlowVolumeCurve*)curve{
+    if(self=[super init]){
+        _isFinalized = NO;
+        _preferredSamplingInterval = curve->PreferredSamplingInterval();
+        _curve = curve;
+        _ownsCurve = NO;
+        return self;
+    }
+    return nil;
+}
+
+-(void)dealloc{
+    if(_curve && _ownsCurve){
+        delete _curve;
+        _curve = nil;
+    }
+}
+
+#pragma mark Computed Properties
+
+// all properties return @0 in error
+-(NSNumber*)fevOneInLiters{
+    return @(self.curve->FEVOne());
+}
+
+-(NSNumber*)fvcInLiters{
+    return @(self.curve->FVC());
+}
+
+-(NSNumber*)peakFlowInLitersPerSecond{
+    return @(self.curve->PeakFlow()); // kept up to date as samples are added
+}
+
+-(NSNumber*)fevOneOverFvc{
+    return @(self.curve->FEVOneOverFVC());
+}
+
+#pragma mark Add/Clear Data Functions
+-(void)addFlowEstimateInLitersPerSecond:(float)flow withTimeStamp:(CFAbsoluteTime)time{
+    self.curve->AddFlowEstimate(flow, time);
+}
+
+-(void)addCustomErrorToEffort:(NSString *)errorMessage forKey:(NSString *)customKey{
+    self.curve->AddCustomError([errorMessage UTF8String], [customKey UTF8String]); // creates key if not already there
+}
+
+-(void)addArtifactToEffort:(NSString *)errorMessage forKey:(NSString *)customKey fromTime:(double)startTime toTime:(double)endTime{
+    self.curve->AddArtifact([errorMessage UTF8String], [customKey UTF8String], startTime, endTime); // stream times, on the results' axis once finalized
+}
+
+-(void)clearDataInEffort{
+    self.isFinalized = NO;
+    self.curve->Clear();
+}
+
+#pragma mark Query Data Functions
+-(FlowVolumeResults)finalizeCurvesAndGetColumnarResults{
+    FlowVolumeResults results;
+    self.curve->FinalizeCurves(&results); // low pass, back extrapolate, scalar measures
+    self.columnarResults = results;
+    self.isFinalized = YES;
+    return results;
+}
+
+-(NSDictionary*)finalizeCurvesAndGetResults{
+
+    FlowVolumeResults results = [self finalizeCurvesAndGetColumnarResults];
+
+    // box only here, for delegates that want the dictionary
+    NSMutableArray *flow = [[NSMutableArray alloc] initWithCapacity:results.numSamples];
+    NSMutableArray *volume = [[NSMutableArray alloc] initWithCapacity:results.numSamples];
+    NSMutableArray *time = [[NSMutableArray alloc] initWithCapacity:results.numSamples];
+    for(int64_t i=0;i<results.numSamples;i++){
+        [flow addObject:@(results.flow[i])];
+        [volume addObject:@(results.volume[i])];
+        [time addObject:@(results.timeStamps[i])];
+    }
+
+    NSMutableDictionary *errors = [[NSMutableDictionary alloc] initWithCapacity:results.numErrors];
+    for(int64_t i=0;i<results.numErrors;i++){
+        errors[@(results.errors[i].key.c_str())] = @(results.errors[i].message.c_str());
+    }
+
+    return @{@"FlowCurveInLitersPerSecond":[[NSArray alloc] initWithArray:flow], // send back nonmutable copy
+             @"VolumeCurveInLiters":[[NSArray alloc] initWithArray:volume], // send back nonmutable copy
+             @"TimeStampsForFlowAndVolume":[[NSArray alloc] initWithArray:time], // send back nonmutable copy
+             @"PeakFlowInLitersPerSecond":@(results.peakFlowInLitersPerSecond),
+             @"FEVOneInLiters":@(results.fevOneInLiters),
+             @"FVCInLiters":@(results.fvcInLiters),
+             @"FEVOneOverFVC":@(results.fevOneOverFvc),
+             @"ErrorsDictionary":[[NSDictionary alloc] initWithDictionary:errors], // send back nonmutable copy
+             };
+    // this returned Dictionary should be very easy to save as JSON for developers and users
+}
+
+-(NSData*)serializedResults{
+    if(!self.isFinalized){
+        return nil;
+    }
+
+    // one copy of the columns, see FlowVolumeResults for the layout
+    FlowVolumeResults results = self.columnarResults;
+    NSMutableData *data = [[NSMutableData alloc] initWithLength:(NSUInteger)results.SerializedSize()];
+    results.Serialize((uint8_t*)data.mutableBytes);
+    return data;
+}
+
+-(int64_t)appendToEffortStore:(EffortStore*)store withKey:(EffortKey)key{
+    if(!self.isFinalized){
+        return -1;
+    }
+
+    // straight from the columns, nothing boxed
+    FlowVolumeResults results = self.columnarResults;
+    key.flags = EffortStoreFlagsFromResults(results);
+    return store->Append(key, results);
+}
+
+-(float)getEstimateOfTotalVolumeInLiters{
+    // if set, return last element of volume array
+    return self.curve->EstimateOfTotalVolume();
+}
+
+-(NSDictionary*)liveMetrics{
+    return [FlowVolumeDataAnalyzer dictionaryFromLiveMetrics:self.curve->LiveMetrics()];
+}
+
+-(LiveEffortMetrics)liveMetricsSnapshot{
+    return self.curve->LiveMetrics();
+}
+
++(NSDictionary*)dictionaryFromLiveMetrics:(const LiveEffortMetrics &)live{
+    // same keys as the results for the measures, the rest say how far along they are
+    return @{@"TimeInSeconds":@(live.timeInSeconds),
+             @"FlowInLitersPerSecond":@(live.flowInLitersPerSecond),
+             @"VolumeInLiters":@(live.volumeInLiters),
+             @"PeakFlowInLitersPerSecond":@(live.peakFlowInLitersPerSecond),
+             @"TimeOfPeakFlowInSeconds":@(live.timeOfPeakFlowInSeconds),
+             @"TimeZeroInSeconds":@(live.timeZeroInSeconds),
+             @"BackExtrapolatedVolumeInLiters":@(live.backExtrapolatedVolumeInLiters),
+             @"StartIsAcceptable":@(live.startIsAcceptable),
+             @"HasFEVOne":@(live.hasFevOne),
+             @"FEVOneInLiters":@(live.fevOneInLiters),
+             @"FVCInLiters":@(live.fvcInLiters),
+             @"FEVOneOverFVC":@(live.fevOneOverFvc),
+             @"HasReachedPlateau":@(live.hasReachedPlateau),
+             };
+}
+
+@end
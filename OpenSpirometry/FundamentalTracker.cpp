@@ -0,0 +1,256 @@
+//
+//  FundamentalTracker.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "FundamentalTracker.h"
+#include <math.h>
+
+FundamentalTracker::FundamentalTracker(float frequencyResolution, int64_t length, int64_t firstBin, int64_t lastBin,
+                                       double hopInSeconds, float maxSlewInHzPerSecond) :
+mFrequencyResolution(frequencyResolution),
+mLength(length),
+mFirstBin(firstBin > 1 ? firstBin : 1),
+mLastBin(lastBin < length - 2 ? lastBin : length - 2),
+mHop(hopInSeconds),
+mMaxSlew(maxSlewInHzPerSecond),
+mPeakFinder(frequencyResolution, length)
+{
+    mMaxNumPeaks = SpectrumPeakFinder::MaxNumPeaks(length, PEAK_WINDOW_SIZE);
+    mNumLeft = (PEAK_WINDOW_SIZE)/2; // same as SpectrumPeakFinder
+    mNumRight = (PEAK_WINDOW_SIZE) - mNumLeft - 1;
+    mPeaks = new SpectrumPeak[mMaxNumPeaks];
+    Clear();
+}
+
+FundamentalTracker::~FundamentalTracker()
+{
+    delete [] mPeaks;
+}
+
+void FundamentalTracker::Clear()
+{
+    mLocked = false;
+    mFrequency = 0;
+    mRate = 0;
+    mP[0][0] = mP[0][1] = mP[1][0] = mP[1][1] = 0;
+    mLastFrequency = -1.0f;
+    mNumSinceVerify = 0;
+    mSearchFirst = mFirstBin;
+    mSearchLast = mLastBin;
+    mSearchIsFull = true;
+    mNumTrackedFrames = 0;
+    mNumFullSearches = 0;
+    mNumLockLosses = 0;
+    mNumBinsSearched = 0;
+}
+
+void FundamentalTracker::Reacquire(double gapInSeconds)
+{
+    if (mLocked)
+        mLastFrequency = mFrequency + (float)(mRate*gapInSeconds);
+    mLocked = false;
+    mFrequency = 0;
+    mRate = 0;
+    mP[0][0] = mP[0][1] = mP[1][0] = mP[1][1] = 0;
+    mNumSinceVerify = 0;
+}
+
+bool FundamentalTracker::SearchBins(int64_t *firstBin, int64_t *lastBin)
+{
+    mSearchIsFull = true;
+    mSearchFirst = mFirstBin;
+    mSearchLast = mLastBin;
+    if (mLocked) {
+        Predict();
+
+        // predicted spread, but no further than the fundamental can move while it has not been seen
+        double measurementNoise = kTrackerMeasurementNoiseBins*mFrequencyResolution;
+        double halfWidth = kTrackerGateSigmas*sqrt(mP[0][0] + measurementNoise*measurementNoise);
+        double minHalfWidth = kTrackerMinHalfWidthBins*mFrequencyResolution;
+        double maxHalfWidth = mMaxSlew*mHop + minHalfWidth;
+        halfWidth = halfWidth < minHalfWidth ? minHalfWidth : (halfWidth > maxHalfWidth ? maxHalfWidth : halfWidth);
+
+        int64_t center = (int64_t)lrint(mFrequency/mFrequencyResolution);
+        int64_t halfWidthBins = (int64_t)ceil(halfWidth/mFrequencyResolution);
+        center = center < mFirstBin ? mFirstBin : (center > mLastBin ? mLastBin : center);
+        mSearchFirst = center - halfWidthBins < mFirstBin ? mFirstBin : center - halfWidthBins;
+        mSearchLast = center + halfWidthBins > mLastBin ? mLastBin : center + halfWidthBins;
+        mSearchIsFull = mNumSinceVerify >= kTrackerVerifyInterval;
+    }
+
+    // the bins around the candidates too, so each can be checked as the maximum of its neighbourhood
+    *firstBin = mSearchIsFull ? mFirstBin : mSearchFirst - mNumLeft;
+    *lastBin = mSearchIsFull ? mLastBin : mSearchLast + mNumRight;
+    mNumBinsSearched += *lastBin - *firstBin + 1;
+    return !mSearchIsFull;
+}
+
+bool FundamentalTracker::Update(const float *magBuffer, FundamentalEstimate *estimate)
+{
+    estimate->numFullBandPeaks = -1;
+    if (mSearchIsFull)
+        return FullSearch(magBuffer, estimate);
+    return TrackedSearch(magBuffer, estimate);
+}
+
+bool FundamentalTracker::FullSearch(const float *magBuffer, FundamentalEstimate *estimate)
+{
+    mNumFullSearches++;
+    mNumSinceVerify = 0;
+
+    // bins above the band are at the floor and can never be peaks, so the search stops one window past it
+    float threshold = mLastFrequency > 0 ? PEAK_DBMAG_SUSTAINED : PEAK_DBMAG_START;
+    int64_t searchLength = mLastBin + 1 + (PEAK_WINDOW_SIZE);
+    searchLength = searchLength < mLength ? searchLength : mLength;
+    int64_t numPeaks = mPeakFinder.GetFundamentalPeaks(magBuffer, searchLength, PEAK_WINDOW_SIZE, threshold,
+                                                       MIN_FREQUENCY_OF_WHISTLE_IN_HZ, mPeaks, mMaxNumPeaks, 3);
+    int64_t numKept = numPeaks < mMaxNumPeaks ? numPeaks : mMaxNumPeaks;
+
+    if (mLocked && TrackedSearch(magBuffer, estimate)) {
+        // verification: keep the tracked peak unless the fundamental an octave below it is there too,
+        // or something much stronger that is not one of its harmonics has taken over the window
+        estimate->numFullBandPeaks = numPeaks;
+        float halfFrequency = 0.5f*estimate->frequency;
+        float tolerance = fmaxf(2.0f*mFrequencyResolution, 0.03f*halfFrequency);
+        int64_t relock = -1;
+        for (int64_t p = 0; p < numKept && relock < 0; p++)
+            if (halfFrequency >= MIN_FREQUENCY_OF_WHISTLE_IN_HZ && fabsf(mPeaks[p].frequency - halfFrequency) <= tolerance)
+                relock = p;
+        if (relock < 0 && numKept > 0 && mPeaks[0].magnitude > estimate->magnitude + kTrackerSwitchDB) {
+            float multiple = mPeaks[0].frequency/estimate->frequency;
+            float nearest = floorf(multiple + 0.5f);
+            if (nearest < 2.0f || fabsf(multiple - nearest)*estimate->frequency > tolerance*nearest)
+                relock = 0;
+        }
+        if (relock >= 0) {
+            Lock(mPeaks[relock].frequency);
+            estimate->frequency = mPeaks[relock].frequency;
+            estimate->magnitude = mPeaks[relock].magnitude;
+            estimate->confidence = 0.5f*ThresholdConfidence(mPeaks[relock].magnitude, threshold);
+            estimate->fromFullSearch = true;
+        }
+        return true;
+    }
+
+    estimate->numFullBandPeaks = numPeaks;
+    if (numPeaks == 0)
+        return false;
+
+    // acquire like the untracked analysis: the largest, or the closest of the top three to the last detection
+    // if it is within a tenth of the largest (a harmonic next to the last one must not win over the fundamental)
+    float frequency = mPeaks[0].frequency;
+    float magnitude = mPeaks[0].magnitude;
+    if (mLastFrequency > 0) {
+        float minDistance = 100000.0f;
+        for (int64_t p = 0; p < numKept && p < 3; p++) {
+            float tmp = fabsf(mPeaks[p].frequency - mLastFrequency);
+            if (tmp < minDistance && mPeaks[p].magnitude > mPeaks[0].magnitude - kTrackerAcquireRangeDB) {
+                minDistance = tmp;
+                frequency = mPeaks[p].frequency;
+                magnitude = mPeaks[p].magnitude;
+            }
+        }
+    }
+    Lock(frequency);
+    estimate->frequency = frequency;
+    estimate->magnitude = magnitude;
+    estimate->confidence = 0.5f*ThresholdConfidence(magnitude, threshold); // not yet confirmed by a prediction
+    estimate->fromFullSearch = true;
+    return true;
+}
+
+bool FundamentalTracker::TrackedSearch(const float *magBuffer, FundamentalEstimate *estimate)
+{
+    int64_t best = mSearchFirst;
+    for (int64_t k = mSearchFirst + 1; k <= mSearchLast; k++)
+        if (magBuffer[k] > magBuffer[best])
+            best = k;
+
+    // a peak like SpectrumPeakFinder's: larger than the bins to its left and no smaller than those to
+    // its right (otherwise it is the side of something bigger, or a ripple on a smeared sweep)
+    float value = magBuffer[best];
+    bool found = value > PEAK_DBMAG_SUSTAINED;
+    int64_t leftEnd = best - mNumLeft < 0 ? 0 : best - mNumLeft;
+    int64_t rightEnd = best + mNumRight > mLength - 1 ? mLength - 1 : best + mNumRight;
+    for (int64_t k = leftEnd; found && k < best; k++)
+        found = value > magBuffer[k];
+    for (int64_t k = best + 1; found && k <= rightEnd; k++)
+        found = value >= magBuffer[k];
+    if (!found) {
+        // lost it, the caller can search the whole band for this window (SearchBins again)
+        mLocked = false;
+        mNumLockLosses++;
+        return false;
+    }
+
+    float frequency = mPeakFinder.GetFrequencyFromIndex(best, magBuffer);
+    double measurementNoise = kTrackerMeasurementNoiseBins*mFrequencyResolution;
+    double innovationVariance = mP[0][0] + measurementNoise*measurementNoise;
+    double innovation = frequency - mFrequency;
+    Correct(frequency);
+    mNumSinceVerify++;
+    mNumTrackedFrames++;
+    mLastFrequency = frequency;
+
+    estimate->frequency = frequency;
+    estimate->magnitude = magBuffer[best];
+    estimate->confidence = ThresholdConfidence(magBuffer[best], PEAK_DBMAG_SUSTAINED)*
+                           (float)exp(-0.5*innovation*innovation/innovationVariance);
+    estimate->fromFullSearch = false;
+    return true;
+}
+
+void FundamentalTracker::Predict()
+{
+    // constant rate, with white noise on the rate of change sized by the slew limit
+    double dt = mHop;
+    double q = (double)mMaxSlew*mMaxSlew;
+    mFrequency += (float)(mRate*dt);
+    double p00 = mP[0][0] + dt*(mP[1][0] + mP[0][1]) + dt*dt*mP[1][1] + q*dt*dt*dt/3.0;
+    double p01 = mP[0][1] + dt*mP[1][1] + q*dt*dt/2.0;
+    double p11 = mP[1][1] + q*dt;
+    mP[0][0] = p00;
+    mP[0][1] = mP[1][0] = p01;
+    mP[1][1] = p11;
+}
+
+void FundamentalTracker::Correct(float frequency)
+{
+    double measurementNoise = kTrackerMeasurementNoiseBins*mFrequencyResolution;
+    double s = mP[0][0] + measurementNoise*measurementNoise;
+    double k0 = mP[0][0]/s, k1 = mP[1][0]/s;
+    double innovation = frequency - mFrequency;
+    mFrequency += (float)(k0*innovation);
+    mRate += (float)(k1*innovation);
+    mRate = mRate > mMaxSlew ? mMaxSlew : (mRate < -mMaxSlew ? -mMaxSlew : mRate);
+
+    double p00 = (1.0 - k0)*mP[0][0];
+    double p01 = (1.0 - k0)*mP[0][1];
+    double p11 = mP[1][1] - k1*mP[0][1];
+    mP[0][0] = p00;
+    mP[0][1] = mP[1][0] = p01;
+    mP[1][1] = p11;
+}
+
+void FundamentalTracker::Lock(float frequency)
+{
+    double measurementNoise = kTrackerMeasurementNoiseBins*mFrequencyResolution;
+    mLocked = true;
+    mFrequency = frequency;
+    mRate = 0;
+    mP[0][0] = measurementNoise*measurementNoise;
+    mP[0][1] = mP[1][0] = 0;
+    mP[1][1] = (double)mMaxSlew*mMaxSlew; // could be moving as fast as it ever does
+    mLastFrequency = frequency;
+    mNumSinceVerify = 0;
+}
+
+float FundamentalTracker::ThresholdConfidence(float magnitude, float threshold)
+{
+    float confidence = (magnitude - threshold)/kTrackerConfidenceRangeDB;
+    return confidence < 0 ? 0 : (confidence > 1 ? 1 : confidence);
+}
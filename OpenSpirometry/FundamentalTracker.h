@@ -0,0 +1,115 @@
+//
+//  FundamentalTracker.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Follows the whistle fundamental from window to window. A Kalman filter on frequency and its
+//  rate of change predicts where the fundamental will be in the next window. Only peaks near the
+//  prediction are looked for, never further away than the flow can physically change in one hop
+//  (MAX_FLOW_SLEW_IN_LPS_PER_SECOND), and only their bins (plus the PEAK_WINDOW_SIZE a peak has to
+//  be the maximum of, as in SpectrumPeakFinder) are converted to dB. A jump to a harmonic is
+//  therefore out of reach while the tracker is locked.
+//
+//  The whole band is searched with SpectrumPeakFinder (as before, the closest of the top three to
+//  the last frequency) to acquire the fundamental, in the same window whenever the tracked peak is
+//  not where it was predicted, and every kTrackerVerifyInterval windows while locked, which also counts the peaks for cough
+//  detection. A verification moves the lock down an octave if the fundamental below it turns out
+//  to be there, or to a much stronger peak that is not one of its harmonics (the long window can
+//  hold on to a sound that is over while the whistle has moved on); a verification that misses the
+//  tracked peak acquires again straight away.
+//  Each estimate comes with a confidence from 0 to 1: how far the peak is above the detection
+//  threshold, times how well it agrees with the prediction.
+
+#ifndef OpenSpirometry_FundamentalTracker_h
+#define OpenSpirometry_FundamentalTracker_h
+
+#include <stdint.h>
+#include "SpirometerConstants.h"
+#include "SpectrumPeakFinder.h"
+
+#define kTrackerVerifyInterval 20           // a full band search every this many tracked windows
+#define kTrackerGateSigmas 3.0f             // search this many predicted standard deviations either side
+#define kTrackerMinHalfWidthBins 3          // but never fewer bins than this
+#define kTrackerMeasurementNoiseBins 1.0f   // standard deviation of one peak estimate
+#define kTrackerConfidenceRangeDB 20.0f     // dB above the threshold for full confidence
+#define kTrackerSwitchDB 6.0f               // a full band peak this much stronger than the tracked one takes over
+#define kTrackerAcquireRangeDB 10.0f        // acquisition only takes peaks this close to the strongest
+
+struct FundamentalEstimate {
+    float frequency;
+    float magnitude;            // dB
+    float confidence;           // 0 to 1
+    bool fromFullSearch;        // acquired (or re-acquired) rather than tracked
+    int64_t numFullBandPeaks;   // fundamentals in the whole band if it was searched this window, else -1
+};
+
+class FundamentalTracker {
+
+public:
+    // bins firstBin...lastBin of a length bin spectrum can hold the whistle (the rest is at the floor);
+    // maxSlew is how fast the fundamental can move, in Hz per second
+    FundamentalTracker(float frequencyResolution, int64_t length, int64_t firstBin, int64_t lastBin,
+                       double hopInSeconds, float maxSlewInHzPerSecond);
+    ~FundamentalTracker();
+
+    // bins the next window needs in dB; false when the whole band is needed
+    bool SearchBins(int64_t *firstBin, int64_t *lastBin);
+    // the window's spectrum (at least the bins SearchBins asked for), false if there is no fundamental;
+    // numFullBandPeaks is filled in either way. A tracked search that misses loses the lock, and
+    // SearchBins then asks for the whole band of the same window
+    bool Update(const float *magBuffer, FundamentalEstimate *estimate);
+    void Clear();
+    // a window or more was skipped, further than the search can reach: the next window acquires from the
+    // whole band, taking the peak closest to where the tracked rate would have taken the fundamental
+    void Reacquire(double gapInSeconds);
+    // a fundamental found some other way (the short windows), acquisition takes the peak closest to it
+    void SetLastFrequency(float frequency) { mLastFrequency = frequency; }
+
+    bool IsLocked() { return mLocked; }
+    float PredictedFrequency() { return mFrequency; }
+    int64_t NumTrackedFrames() { return mNumTrackedFrames; }
+    int64_t NumFullSearches() { return mNumFullSearches; }
+    int64_t NumLockLosses() { return mNumLockLosses; }
+    int64_t NumBinsSearched() { return mNumBinsSearched; } // dB bins asked for since Clear
+
+protected:
+    bool FullSearch(const float *magBuffer, FundamentalEstimate *estimate);
+    bool TrackedSearch(const float *magBuffer, FundamentalEstimate *estimate);
+    void Predict();
+    void Correct(float frequency);
+    void Lock(float frequency);
+    float ThresholdConfidence(float magnitude, float threshold);
+
+    float mFrequencyResolution;
+    int64_t mLength;
+    int64_t mFirstBin;
+    int64_t mLastBin;
+    double mHop;
+    float mMaxSlew;
+
+    SpectrumPeakFinder mPeakFinder;
+    SpectrumPeak *mPeaks;
+    int64_t mMaxNumPeaks;
+
+    // Kalman filter, state is frequency (Hz) and its rate (Hz/s)
+    bool mLocked;
+    float mFrequency;
+    float mRate;
+    double mP[2][2];
+    float mLastFrequency;       // last estimate handed out, -1 before the first
+    int64_t mNumSinceVerify;
+    int64_t mSearchFirst;       // bins the current window's peak can be at
+    int64_t mSearchLast;
+    int64_t mNumLeft;           // bins either side a peak has to be the maximum of
+    int64_t mNumRight;
+    bool mSearchIsFull;
+
+    int64_t mNumTrackedFrames;
+    int64_t mNumFullSearches;
+    int64_t mNumLockLosses;
+    int64_t mNumBinsSearched;
+};
+
+#endif
@@ -0,0 +1,297 @@
+//
+//  LatencyMonitor.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "LatencyMonitor.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+
+static const char *kIntervalNames[kNumLatencyIntervals] = {"callback", "queue", "fft", "peaks", "delivery", "end to end"};
+
+LatencyHistogram::LatencyHistogram() :
+mCounts(kNumLatencyBuckets, 0)
+{
+    Clear();
+}
+
+// below 2^S the bucket is the value, above it the top S-1 bits after the leading one pick
+// one of 2^(S-1) buckets for each power of two
+int LatencyHistogram::BucketForValue(int64_t value)
+{
+    if (value < 0)
+        value = 0;
+    if (value >= ((int64_t)1 << kLatencyMaxValueBits))
+        value = ((int64_t)1 << kLatencyMaxValueBits) - 1;
+    if (value < (1 << kLatencySubBucketBits))
+        return (int)value;
+
+    int exponent = 63 - __builtin_clzll((unsigned long long)value);
+    int shift = exponent - kLatencySubBucketBits + 1;
+    int64_t top = value >> shift; // in [2^(S-1), 2^S)
+    return (1 << kLatencySubBucketBits) + (shift - 1)*(1 << (kLatencySubBucketBits - 1))
+           + (int)(top - (1 << (kLatencySubBucketBits - 1)));
+}
+
+int64_t LatencyHistogram::LowestValueInBucket(int bucket)
+{
+    if (bucket < (1 << kLatencySubBucketBits))
+        return bucket;
+    int above = bucket - (1 << kLatencySubBucketBits);
+    int shift = above/(1 << (kLatencySubBucketBits - 1)) + 1;
+    int64_t top = (1 << (kLatencySubBucketBits - 1)) + above % (1 << (kLatencySubBucketBits - 1));
+    return top << shift;
+}
+
+int64_t LatencyHistogram::HighestValueInBucket(int bucket)
+{
+    if (bucket < (1 << kLatencySubBucketBits))
+        return bucket;
+    int above = bucket - (1 << kLatencySubBucketBits);
+    int shift = above/(1 << (kLatencySubBucketBits - 1)) + 1;
+    return LowestValueInBucket(bucket) + ((int64_t)1 << shift) - 1;
+}
+
+void LatencyHistogram::Record(int64_t value, int64_t count)
+{
+    if (count <= 0)
+        return;
+    mCounts[BucketForValue(value)] += count;
+    if (mCount == 0 || value < mMin)
+        mMin = value;
+    if (value > mMax)
+        mMax = value;
+    mCount += count;
+    mSum += value*count;
+}
+
+void LatencyHistogram::Add(const LatencyHistogram &other)
+{
+    if (other.mCount == 0)
+        return;
+    for (int b = 0; b < kNumLatencyBuckets; b++)
+        mCounts[b] += other.mCounts[b];
+    if (mCount == 0 || other.mMin < mMin)
+        mMin = other.mMin;
+    if (other.mMax > mMax)
+        mMax = other.mMax;
+    mCount += other.mCount;
+    mSum += other.mSum;
+}
+
+void LatencyHistogram::Clear()
+{
+    std::fill(mCounts.begin(), mCounts.end(), 0);
+    mCount = 0;
+    mSum = 0;
+    mMin = 0;
+    mMax = 0;
+}
+
+int64_t LatencyHistogram::ValueAtPercentile(double percentile) const
+{
+    if (mCount == 0)
+        return 0;
+    int64_t rank = (int64_t)ceil(percentile/100.0*(double)mCount);
+    if (rank < 1)
+        rank = 1;
+    if (rank > mCount)
+        rank = mCount;
+
+    int64_t seen = 0;
+    for (int b = 0; b < kNumLatencyBuckets; b++) {
+        seen += mCounts[b];
+        if (seen >= rank) {
+            int64_t value = HighestValueInBucket(b);
+            return value < mMax ? value : mMax;
+        }
+    }
+    return mMax;
+}
+
+//=============================================================================================================
+
+void LatencyMonitor::AtomicHistogram::Record(int64_t value)
+{
+    counts[LatencyHistogram::BucketForValue(value)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+    // one writer, so a load and store is enough for the extremes
+    if (value < min.load(std::memory_order_relaxed))
+        min.store(value, std::memory_order_relaxed);
+    if (value > max.load(std::memory_order_relaxed))
+        max.store(value, std::memory_order_relaxed);
+}
+
+void LatencyMonitor::AtomicHistogram::Clear()
+{
+    for (int b = 0; b < kNumLatencyBuckets; b++)
+        counts[b].store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    min.store(INT64_MAX, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+// counts are read while the writer may be adding, so the copy can be a few values behind but is never torn
+void LatencyMonitor::AtomicHistogram::CopyTo(LatencyHistogram *histogram)
+{
+    histogram->Clear();
+    for (int b = 0; b < kNumLatencyBuckets; b++) {
+        histogram->mCounts[b] = counts[b].load(std::memory_order_relaxed);
+        histogram->mCount += histogram->mCounts[b];
+    }
+    if (histogram->mCount == 0)
+        return;
+    histogram->mSum = sum.load(std::memory_order_relaxed);
+    histogram->mMin = min.load(std::memory_order_relaxed);
+    histogram->mMax = max.load(std::memory_order_relaxed);
+    if (histogram->mMin > histogram->mMax) // caught between the count and the extremes
+        histogram->mMin = histogram->mMax;
+}
+
+//=============================================================================================================
+
+LatencyMonitor::LatencyMonitor(int64_t windowLength, int64_t hopLength, double lateThresholdInSeconds) :
+mWindowLength(windowLength),
+mHopLength(hopLength > 0 ? hopLength : 1),
+mLateThreshold((int64_t)(lateThresholdInSeconds*1e9))
+{
+    Clear();
+}
+
+int64_t LatencyMonitor::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void LatencyMonitor::Clear()
+{
+    mRecordsWritten.store(0, std::memory_order_relaxed);
+    mRecordsRead.store(0, std::memory_order_relaxed);
+    mNumCallbacks.store(0, std::memory_order_relaxed);
+    mNumCallbacksUntraced.store(0, std::memory_order_relaxed);
+    mLastStreamEnd = 0;
+    mNumFramesAnalyzed.store(0, std::memory_order_relaxed);
+    mNumFramesDropped.store(0, std::memory_order_relaxed);
+    mLastFrameEnd = mWindowLength - mHopLength; // so skipping the first window counts too
+    for (int i = 0; i < LatencyIntervalDelivery; i++)
+        mAnalysisIntervals[i].Clear();
+    mQueueDepth.Clear();
+    mNumFramesDelivered.store(0, std::memory_order_relaxed);
+    mNumFramesLate.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < kNumLatencyIntervals - LatencyIntervalDelivery; i++)
+        mDeliveryIntervals[i].Clear();
+}
+
+void LatencyMonitor::RecordCallback(int64_t callbackTime, int64_t streamEnd)
+{
+    mNumCallbacks.fetch_add(1, std::memory_order_relaxed);
+    int64_t streamStart = mLastStreamEnd;
+    mLastStreamEnd = streamEnd;
+
+    int64_t written = mRecordsWritten.load(std::memory_order_relaxed);
+    if (written - mRecordsRead.load(std::memory_order_acquire) >= kNumLatencyCallbackRecords) {
+        mNumCallbacksUntraced.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    CallbackRecord &record = mRecords[written % kNumLatencyCallbackRecords];
+    record.streamStart = streamStart;
+    record.streamEnd = streamEnd;
+    record.callbackTime = callbackTime;
+    record.blockFullTime = Now();
+    mRecordsWritten.store(written + 1, std::memory_order_release);
+}
+
+void LatencyMonitor::BeginFrame(LatencyTrace *trace, int64_t frameEnd, int64_t queueDepth)
+{
+    trace->frameEnd = frameEnd;
+    for (int s = 0; s < kNumLatencyStages; s++)
+        trace->times[s] = 0;
+
+    // callbacks that ended before this window did are never needed again, windows come in stream order
+    int64_t read = mRecordsRead.load(std::memory_order_relaxed);
+    int64_t written = mRecordsWritten.load(std::memory_order_acquire);
+    while (read < written && mRecords[read % kNumLatencyCallbackRecords].streamEnd < frameEnd)
+        read++;
+    if (read < written) {
+        const CallbackRecord &record = mRecords[read % kNumLatencyCallbackRecords];
+        if (record.streamStart < frameEnd) { // not if the callback that completed it went untraced
+            trace->times[LatencyStageCallback] = record.callbackTime;
+            trace->times[LatencyStageBlockFull] = record.blockFullTime;
+        }
+    }
+    mRecordsRead.store(read, std::memory_order_release);
+
+    if (frameEnd - mLastFrameEnd > mHopLength)
+        mNumFramesDropped.fetch_add((frameEnd - mLastFrameEnd)/mHopLength - 1, std::memory_order_relaxed);
+    mLastFrameEnd = frameEnd;
+    mQueueDepth.Record(queueDepth);
+
+    trace->times[LatencyStageAnalysisStart] = Now();
+}
+
+void LatencyMonitor::EndFrame(const LatencyTrace &trace)
+{
+    mNumFramesAnalyzed.fetch_add(1, std::memory_order_relaxed);
+    for (int i = 0; i < LatencyIntervalDelivery; i++)
+        if (trace.times[i] != 0 && trace.times[i+1] != 0)
+            mAnalysisIntervals[i].Record(trace.times[i+1] - trace.times[i]);
+}
+
+void LatencyMonitor::RecordDelivered(LatencyTrace trace)
+{
+    trace.times[LatencyStageDelivered] = Now();
+    mNumFramesDelivered.fetch_add(1, std::memory_order_relaxed);
+    if (trace.times[LatencyStagePeaksDone] != 0)
+        mDeliveryIntervals[0].Record(trace.times[LatencyStageDelivered] - trace.times[LatencyStagePeaksDone]);
+    if (trace.times[LatencyStageCallback] != 0) {
+        int64_t endToEnd = trace.times[LatencyStageDelivered] - trace.times[LatencyStageCallback];
+        mDeliveryIntervals[1].Record(endToEnd);
+        if (endToEnd > mLateThreshold)
+            mNumFramesLate.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void LatencyMonitor::Snapshot(LatencyReport *report)
+{
+    for (int i = 0; i < LatencyIntervalDelivery; i++)
+        mAnalysisIntervals[i].CopyTo(&report->intervals[i]);
+    for (int i = LatencyIntervalDelivery; i < kNumLatencyIntervals; i++)
+        mDeliveryIntervals[i - LatencyIntervalDelivery].CopyTo(&report->intervals[i]);
+    mQueueDepth.CopyTo(&report->queueDepth);
+    report->numCallbacks = mNumCallbacks.load(std::memory_order_relaxed);
+    report->numCallbacksUntraced = mNumCallbacksUntraced.load(std::memory_order_relaxed);
+    report->numFramesAnalyzed = mNumFramesAnalyzed.load(std::memory_order_relaxed);
+    report->numFramesDropped = mNumFramesDropped.load(std::memory_order_relaxed);
+    report->numFramesDelivered = mNumFramesDelivered.load(std::memory_order_relaxed);
+    report->numFramesLate = mNumFramesLate.load(std::memory_order_relaxed);
+    report->lateThresholdInSeconds = (double)mLateThreshold*1e-9;
+}
+
+std::string LatencyMonitor::FormatReport(const LatencyReport &report)
+{
+    std::string text;
+    char line[256];
+    snprintf(line, sizeof(line), "latency in ms   %8s %8s %8s %8s %8s %8s\n", "count", "mean", "p50", "p99", "p99.9", "max");
+    text += line;
+    for (int i = 0; i < kNumLatencyIntervals; i++) {
+        const LatencyHistogram &h = report.intervals[i];
+        snprintf(line, sizeof(line), "%-15s %8lld %8.3f %8.3f %8.3f %8.3f %8.3f\n", kIntervalNames[i], (long long)h.Count(),
+                 h.Mean()*1e-6, h.ValueAtPercentile(50)*1e-6, h.ValueAtPercentile(99)*1e-6,
+                 h.ValueAtPercentile(99.9)*1e-6, h.Max()*1e-6);
+        text += line;
+    }
+    snprintf(line, sizeof(line), "queue depth p50 %lld p99 %lld max %lld windows\n", (long long)report.queueDepth.ValueAtPercentile(50),
+             (long long)report.queueDepth.ValueAtPercentile(99), (long long)report.queueDepth.Max());
+    text += line;
+    snprintf(line, sizeof(line), "callbacks %lld (%lld untraced), windows analyzed %lld, dropped %lld, delivered %lld, late %lld (over %.0f ms)\n",
+             (long long)report.numCallbacks, (long long)report.numCallbacksUntraced, (long long)report.numFramesAnalyzed,
+             (long long)report.numFramesDropped, (long long)report.numFramesDelivered, (long long)report.numFramesLate,
+             report.lateThresholdInSeconds*1e3);
+    text += line;
+    return text;
+}
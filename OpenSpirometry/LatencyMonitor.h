@@ -0,0 +1,183 @@
+//
+//  LatencyMonitor.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  How long a window takes from the audio callback that completed it to the flow update
+//  reaching the delegate, split by stage:
+//
+//    callback      callback entry to the samples being in the framer (block full)
+//    queue         block full to the analysis picking the window up
+//    fft           spectrum of the window (sliding DFT or full FFT, and dB)
+//    peaks         fundamental peak search
+//    delivery      flow estimate, curve update and the hop to the delegate's queue
+//    end to end    callback entry to delivery
+//
+//  Each stage is timed with a steady clock into a log/linear histogram (HDR style: exact below
+//  64 ns, then 32 buckets per power of two, so any percentile is within about 3%). Every counter
+//  and histogram has exactly one writer, the thread (or serial queue) that records that stage:
+//  the audio callback, the analysis worker or the delivery queue. Writers only do relaxed atomic
+//  adds, nothing is locked or allocated, and any thread can take a Snapshot while they run.
+//
+//  The audio side hands (stream position, times) records to the analysis side through a small
+//  single producer ring, so a window is matched with the callback that completed it by position.
+//  Windows the analysis skipped show up as gaps in position and are counted as dropped; windows
+//  delivered more than the late threshold after their callback are counted as late.
+
+#ifndef OpenSpirometry_LatencyMonitor_h
+#define OpenSpirometry_LatencyMonitor_h
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define kLatencySubBucketBits 6          // values below 2^6 exact, 2^5 buckets per power of two above
+#define kLatencyMaxValueBits 36          // larger values (over a minute in ns) land in the top bucket
+#define kNumLatencyBuckets ((1 << kLatencySubBucketBits) + (kLatencyMaxValueBits - kLatencySubBucketBits)*(1 << (kLatencySubBucketBits - 1)))
+#define kNumLatencyCallbackRecords 256   // callbacks the analysis can fall behind and still match windows to them
+
+enum LatencyStage {
+    LatencyStageCallback,
+    LatencyStageBlockFull,
+    LatencyStageAnalysisStart,
+    LatencyStageFFTDone,
+    LatencyStagePeaksDone,
+    LatencyStageDelivered,
+    kNumLatencyStages
+};
+
+// interval i ends at stage i+1, the last one is end to end
+enum LatencyInterval {
+    LatencyIntervalCallback,
+    LatencyIntervalQueue,
+    LatencyIntervalFFT,
+    LatencyIntervalPeaks,
+    LatencyIntervalDelivery,
+    LatencyIntervalEndToEnd,
+    kNumLatencyIntervals
+};
+
+// plain (single threaded) histogram, what a Snapshot hands back
+class LatencyHistogram {
+
+public:
+    LatencyHistogram();
+
+    void Record(int64_t value, int64_t count = 1);
+    void Add(const LatencyHistogram &other);
+    void Clear();
+
+    int64_t Count() const { return mCount; }
+    int64_t Min() const { return mCount ? mMin : 0; }
+    int64_t Max() const { return mMax; }
+    double Mean() const { return mCount ? (double)mSum/(double)mCount : 0.0; }
+    int64_t ValueAtPercentile(double percentile) const; // highest value of the bucket holding it, within Max
+
+    static int BucketForValue(int64_t value);
+    static int64_t LowestValueInBucket(int bucket);
+    static int64_t HighestValueInBucket(int bucket);
+
+protected:
+    friend class LatencyMonitor;
+
+    std::vector<int64_t> mCounts;
+    int64_t mCount;
+    int64_t mSum;
+    int64_t mMin;
+    int64_t mMax;
+};
+
+// stage times of one window in steady clock ns, 0 where a stage was not reached
+struct LatencyTrace {
+    int64_t frameEnd;               // stream position just past the window
+    int64_t times[kNumLatencyStages];
+};
+
+struct LatencyReport {
+    LatencyHistogram intervals[kNumLatencyIntervals];   // ns
+    LatencyHistogram queueDepth;                        // windows waiting when one is picked up
+    int64_t numCallbacks;
+    int64_t numCallbacksUntraced;   // the record ring was full, their windows have no callback times
+    int64_t numFramesAnalyzed;
+    int64_t numFramesDropped;       // skipped by the analysis (gaps in stream position)
+    int64_t numFramesDelivered;
+    int64_t numFramesLate;          // delivered more than the late threshold after the callback
+    double lateThresholdInSeconds;
+};
+
+class LatencyMonitor {
+
+public:
+    LatencyMonitor(int64_t windowLength, int64_t hopLength, double lateThresholdInSeconds);
+
+    static int64_t Now(); // steady clock in ns
+
+    // audio thread: the samples up to streamEnd are in the framer, callbackTime is when the callback started
+    void RecordCallback(int64_t callbackTime, int64_t streamEnd);
+
+    // analysis thread: fills in the callback times of the window ending at frameEnd and starts the analysis
+    void BeginFrame(LatencyTrace *trace, int64_t frameEnd, int64_t queueDepth);
+    static void MarkStage(LatencyTrace *trace, LatencyStage stage) { trace->times[stage] = Now(); }
+    // analysis thread: records the analysis stages, call once per window after the last one reached
+    void EndFrame(const LatencyTrace &trace);
+
+    // delivery thread (the delegate's queue): trace after EndFrame, marks it delivered now
+    void RecordDelivered(LatencyTrace trace);
+
+    // any thread
+    void Snapshot(LatencyReport *report);
+    static std::string FormatReport(const LatencyReport &report); // a few lines for a log
+
+    // call only when no thread is recording (between efforts)
+    void Clear();
+
+protected:
+    struct AtomicHistogram {
+        std::atomic<int64_t> counts[kNumLatencyBuckets];
+        std::atomic<int64_t> sum;
+        std::atomic<int64_t> min;
+        std::atomic<int64_t> max;
+
+        void Record(int64_t value);     // one writer
+        void Clear();
+        void CopyTo(LatencyHistogram *histogram);
+    };
+
+    struct CallbackRecord {
+        int64_t streamStart;    // the callback brought the samples from here up to streamEnd
+        int64_t streamEnd;
+        int64_t callbackTime;
+        int64_t blockFullTime;
+    };
+
+    int64_t mWindowLength;
+    int64_t mHopLength;
+    int64_t mLateThreshold;     // ns
+
+    // audio thread -> analysis thread
+    CallbackRecord mRecords[kNumLatencyCallbackRecords];
+    alignas(64) std::atomic<int64_t> mRecordsWritten;
+    alignas(64) std::atomic<int64_t> mRecordsRead;
+
+    // audio thread
+    alignas(64) std::atomic<int64_t> mNumCallbacks;
+    std::atomic<int64_t> mNumCallbacksUntraced;
+    int64_t mLastStreamEnd;
+
+    // analysis thread
+    alignas(64) std::atomic<int64_t> mNumFramesAnalyzed;
+    std::atomic<int64_t> mNumFramesDropped;
+    int64_t mLastFrameEnd;
+    AtomicHistogram mAnalysisIntervals[LatencyIntervalDelivery];
+    AtomicHistogram mQueueDepth;
+
+    // delivery thread
+    alignas(64) std::atomic<int64_t> mNumFramesDelivered;
+    std::atomic<int64_t> mNumFramesLate;
+    AtomicHistogram mDeliveryIntervals[kNumLatencyIntervals - LatencyIntervalDelivery];
+};
+
+#endif
@@ -963,10 +963,10 @@ void CheckError(OSStatus error, const char *operation)
         AudioBuffer audioBuffer = _convertedFileData.mBuffers[0];
         samplesAsCArray = (float *)audioBuffer.mData;
         
-        dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0),^{
-            if(self.inputBlock != nil)
-                self.inputBlock(samplesAsCArray, _audioFileFrameCount, numChannels);
-        });
+        // call it here, like the microphone callback does: handing the shared buffer to another
+        // queue let the next read overwrite it before the block had copied it out
+        if(self.inputBlock != nil)
+            self.inputBlock(samplesAsCArray, _audioFileFrameCount, numChannels);
     }
     else{
         [timer invalidate];
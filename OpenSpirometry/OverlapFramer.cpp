@@ -0,0 +1,247 @@
+//
+//  OverlapFramer.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "OverlapFramer.h"
+#include "FFTLanes.h"
+#include <stdlib.h>
+#include <string.h>
+
+void FrameView::CopyToBuffer(float *outData) const
+{
+    memcpy(outData, first, (size_t)firstLength*sizeof(float));
+    if (secondLength > 0)
+        memcpy(&outData[firstLength], second, (size_t)secondLength*sizeof(float));
+}
+
+void FrameView::CopyRangeToBuffer(float *outData, int64_t offset, int64_t numFrames) const
+{
+    if (offset < firstLength) {
+        int64_t numInFirst = firstLength - offset < numFrames ? firstLength - offset : numFrames;
+        memcpy(outData, &first[offset], (size_t)numInFirst*sizeof(float));
+        if (numFrames > numInFirst)
+            memcpy(&outData[numInFirst], second, (size_t)(numFrames-numInFirst)*sizeof(float));
+    }
+    else {
+        memcpy(outData, &second[offset-firstLength], (size_t)numFrames*sizeof(float));
+    }
+}
+
+void DeinterleaveFloat(const float *interleaved, int64_t numFrames, int64_t numChannels, float *const *channels, int64_t numOutputChannels)
+{
+    if (numChannels == 1) {
+        memcpy(channels[0], interleaved, (size_t)numFrames*sizeof(float));
+        return;
+    }
+    typedef VectorLanes::V V;
+    const int64_t kNumLanes = VectorLanes::kNumLanes;
+    int64_t i = 0;
+    if (numChannels == 2 && numOutputChannels == 2) {
+        for (; i + kNumLanes <= numFrames; i += kNumLanes) {
+            V left, right;
+            VectorLanes::LoadEvenOdd(&interleaved[2*i], &left, &right);
+            VectorLanes::Store(&channels[0][i], left);
+            VectorLanes::Store(&channels[1][i], right);
+        }
+    }
+    else if (numChannels == 4 && numOutputChannels == 4) {
+        for (; i + kNumLanes <= numFrames; i += kNumLanes) {
+            V a, b, c, d;
+            VectorLanes::LoadQuarters(&interleaved[4*i], &a, &b, &c, &d);
+            VectorLanes::Store(&channels[0][i], a);
+            VectorLanes::Store(&channels[1][i], b);
+            VectorLanes::Store(&channels[2][i], c);
+            VectorLanes::Store(&channels[3][i], d);
+        }
+    }
+    for (int64_t c = 0; c < numOutputChannels; ++c) {
+        const float *p = &interleaved[i*numChannels + c];
+        float *out = channels[c];
+        for (int64_t j = i; j < numFrames; ++j, p += numChannels)
+            out[j] = *p;
+    }
+}
+
+OverlapFramer::OverlapFramer(int64_t windowLength, int64_t hopLength, int64_t bufferLength, int numConsumers, int numChannels) :
+mWindowLength(windowLength),
+mHopLength(hopLength > 0 ? hopLength : 1),
+mNumChannels(numChannels < 1 ? 1 : (numChannels > kMaxNumFramerChannels ? kMaxNumFramerChannels : numChannels)),
+mNumLiveChannels(mNumChannels)
+{
+    if (numConsumers > kMaxNumFramerConsumers)
+        mNumConsumers = kMaxNumFramerConsumers;
+    else if (numConsumers <= 0)
+        mNumConsumers = 1;
+    else
+        mNumConsumers = numConsumers;
+
+    // at least one window plus room for the callback to write while a window is being analyzed
+    if (bufferLength < 2*windowLength)
+        bufferLength = 2*windowLength;
+    mSizeOfBuffer = 1;
+    while (mSizeOfBuffer < bufferLength)
+        mSizeOfBuffer <<= 1;
+    mMask = mSizeOfBuffer - 1;
+
+    mData = (float *)calloc((size_t)(mNumChannels*mSizeOfBuffer), sizeof(float));
+
+    mWriteCount.store(0);
+    mDroppedCount.store(0);
+    for (int i=0; i < kMaxNumFramerConsumers; ++i)
+        mReadHead[i].position.store(0);
+}
+
+OverlapFramer::~OverlapFramer()
+{
+    free(mData);
+}
+
+int64_t OverlapFramer::FreeSpace()
+{
+    int64_t oldestNeeded = mReadHead[0].position.load(std::memory_order_acquire);
+    for (int i=1; i < mNumConsumers; ++i) {
+        int64_t position = mReadHead[i].position.load(std::memory_order_acquire);
+        if (position < oldestNeeded) oldestNeeded = position;
+    }
+    return mSizeOfBuffer - (mWriteCount.load(std::memory_order_relaxed) - oldestNeeded);
+}
+
+int64_t OverlapFramer::AddNewFloatData(const float *newData, const int64_t numFrames)
+{
+    return AddNewInterleavedFloatData(newData, numFrames, 0, 1);
+}
+
+// how much of numFrames fits (the rest is counted as dropped), where it goes and how much before the ring wraps
+int64_t OverlapFramer::BeginWrite(int64_t numFrames, int64_t *idx, int64_t *numInFirstCopy)
+{
+    int64_t freeSpace = FreeSpace();
+    int64_t numToWrite = numFrames <= freeSpace ? numFrames : freeSpace;
+    if (numToWrite < numFrames)
+        mDroppedCount.fetch_add(numFrames - numToWrite, std::memory_order_relaxed);
+
+    *idx = mWriteCount.load(std::memory_order_relaxed) & mMask;
+    *numInFirstCopy = mSizeOfBuffer - *idx < numToWrite ? mSizeOfBuffer - *idx : numToWrite;
+    return numToWrite;
+}
+
+int64_t OverlapFramer::AddNewInterleavedFloatData(const float *newData, const int64_t numFrames, const int64_t whichChannel, const int64_t numChannels)
+{
+    int64_t idx, numInFirstCopy;
+    int64_t numToWrite = BeginWrite(numFrames, &idx, &numInFirstCopy);
+    int64_t writeCount = mWriteCount.load(std::memory_order_relaxed);
+
+    if (numChannels == 1) {
+        memcpy(&mData[idx], newData, (size_t)numInFirstCopy*sizeof(float));
+        memcpy(mData, &newData[numInFirstCopy], (size_t)(numToWrite-numInFirstCopy)*sizeof(float));
+    }
+    else {
+        const float *p = &newData[whichChannel];
+        float *out = &mData[idx];
+        for (int64_t i=0; i < numInFirstCopy; ++i, p += numChannels)
+            out[i] = *p;
+        out = mData;
+        for (int64_t i=numInFirstCopy; i < numToWrite; ++i, p += numChannels)
+            out[i-numInFirstCopy] = *p;
+    }
+
+    // publish the samples after they are in the ring
+    mWriteCount.store(writeCount + numToWrite, std::memory_order_release);
+    return numToWrite;
+}
+
+int64_t OverlapFramer::AddNewInterleavedFloatData(const float *newData, const int64_t numFrames, const int64_t numChannels)
+{
+    int64_t idx, numInFirstCopy;
+    int64_t numToWrite = BeginWrite(numFrames, &idx, &numInFirstCopy);
+    int64_t writeCount = mWriteCount.load(std::memory_order_relaxed);
+    int64_t numCopied = numChannels < mNumChannels ? numChannels : mNumChannels;
+
+    // rings past the callback's channels are left alone (a mono callback is not clearing three rings), one that
+    // comes back holds silence for everything it missed
+    for (int64_t c = mNumLiveChannels; c < numCopied; ++c)
+        memset(&mData[c*mSizeOfBuffer], 0, (size_t)mSizeOfBuffer*sizeof(float));
+    mNumLiveChannels = (int)numCopied;
+
+    // up to the end of the ring, then the rest from its start
+    float *channels[kMaxNumFramerChannels];
+    for (int64_t c = 0; c < numCopied; ++c)
+        channels[c] = &mData[c*mSizeOfBuffer + idx];
+    DeinterleaveFloat(newData, numInFirstCopy, numChannels, channels, numCopied);
+    for (int64_t c = 0; c < numCopied; ++c)
+        channels[c] = &mData[c*mSizeOfBuffer];
+    DeinterleaveFloat(&newData[numInFirstCopy*numChannels], numToWrite - numInFirstCopy, numChannels, channels, numCopied);
+
+    mWriteCount.store(writeCount + numToWrite, std::memory_order_release);
+    return numToWrite;
+}
+
+bool OverlapFramer::PeekFrame(FrameView *view, int whichConsumer)
+{
+    int64_t readPosition = mReadHead[whichConsumer].position.load(std::memory_order_relaxed);
+    int64_t writeCount = mWriteCount.load(std::memory_order_acquire);
+    if (writeCount - readPosition < mWindowLength)
+        return false;
+
+    int64_t idx = readPosition & mMask;
+    view->first = &mData[idx];
+    view->firstSampleIndex = readPosition;
+    if (idx + mWindowLength <= mSizeOfBuffer) {
+        view->firstLength = mWindowLength;
+        view->second = 0;
+        view->secondLength = 0;
+    }
+    else { // window wraps around the end of the ring
+        view->firstLength = mSizeOfBuffer - idx;
+        view->second = mData;
+        view->secondLength = mWindowLength - view->firstLength;
+    }
+    return true;
+}
+
+void OverlapFramer::ReleaseFrame(int whichConsumer)
+{
+    int64_t readPosition = mReadHead[whichConsumer].position.load(std::memory_order_relaxed);
+    mReadHead[whichConsumer].position.store(readPosition + mHopLength, std::memory_order_release);
+}
+
+int64_t OverlapFramer::NumFramesAvailable(int whichConsumer)
+{
+    int64_t unread = mWriteCount.load(std::memory_order_acquire) - mReadHead[whichConsumer].position.load(std::memory_order_relaxed);
+    if (unread < mWindowLength)
+        return 0;
+    return (unread - mWindowLength)/mHopLength + 1;
+}
+
+int64_t OverlapFramer::SkipFrames(int64_t numFrames, int whichConsumer)
+{
+    int64_t numAvailable = NumFramesAvailable(whichConsumer);
+    int64_t numToSkip = numFrames < numAvailable ? numFrames : numAvailable;
+    if (numToSkip <= 0)
+        return 0;
+    int64_t readPosition = mReadHead[whichConsumer].position.load(std::memory_order_relaxed);
+    mReadHead[whichConsumer].position.store(readPosition + numToSkip*mHopLength, std::memory_order_release);
+    return numToSkip;
+}
+
+FrameView OverlapFramer::ChannelFrame(const FrameView &frame, int whichChannel)
+{
+    FrameView view = frame;
+    view.first += whichChannel*mSizeOfBuffer;
+    if (view.second)
+        view.second += whichChannel*mSizeOfBuffer;
+    return view;
+}
+
+void OverlapFramer::Clear()
+{
+    memset(mData, 0, sizeof(float)*(size_t)(mNumChannels*mSizeOfBuffer));
+    mNumLiveChannels = mNumChannels;
+    mWriteCount.store(0);
+    mDroppedCount.store(0);
+    for (int i=0; i < kMaxNumFramerConsumers; ++i)
+        mReadHead[i].position.store(0);
+}
@@ -0,0 +1,102 @@
+//
+//  OverlapFramer.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Lock free replacement for BufferedOverlapQueue. Same idea as RingBuffer: one circular buffer
+//  per stream that the audio callback writes into. Every sample is written exactly once and
+//  nothing is allocated or locked on the write side. Each consumer keeps its own read head and
+//  is handed overlapped windows as views into the ring (pointer + length, split in two where
+//  the window wraps), so no window is ever copied.
+//
+//  Threading: one producer thread, and one thread per consumer index. The producer never
+//  overwrites a window that a consumer has not released; if the ring is full the newest
+//  samples are dropped and counted instead.
+//
+//  With more than one channel there is a ring per channel, all at the same positions. The
+//  callback's interleaved audio is split into them once (vector loads for 2 and 4 channels,
+//  DeinterleaveFloat). Windows are handed out for channel 0, and ChannelFrame gives the same
+//  window of any other channel.
+
+#ifndef OpenSpirometry_OverlapFramer_h
+#define OpenSpirometry_OverlapFramer_h
+
+#include <stdint.h>
+#include <atomic>
+
+#define kMaxNumFramerConsumers 4
+#define kMaxNumFramerChannels 4
+
+struct FrameView {
+    const float *first;         // oldest samples of the window
+    int64_t firstLength;
+    const float *second;        // rest of the window after the ring wraps (null if firstLength covers it)
+    int64_t secondLength;
+    int64_t firstSampleIndex;   // position of the window start in the stream
+
+    int64_t Length() const { return firstLength + secondLength; }
+    float operator[](int64_t i) const { return i < firstLength ? first[i] : second[i-firstLength]; }
+    void CopyToBuffer(float *outData) const; // for code that needs a contiguous window
+    void CopyRangeToBuffer(float *outData, int64_t offset, int64_t numFrames) const;
+};
+
+// the first numOutputChannels channels of numChannels interleaved, one array per channel
+void DeinterleaveFloat(const float *interleaved, int64_t numFrames, int64_t numChannels, float *const *channels, int64_t numOutputChannels);
+
+class OverlapFramer {
+
+public:
+    OverlapFramer(int64_t windowLength, int64_t hopLength, int64_t bufferLength, int numConsumers = 1, int numChannels = 1);
+    ~OverlapFramer();
+
+    // producer side (audio thread)
+    int64_t AddNewFloatData(const float *newData, const int64_t numFrames);
+    // one channel of the audio into the first ring
+    int64_t AddNewInterleavedFloatData(const float *newData, const int64_t numFrames, const int64_t whichChannel, const int64_t numChannels);
+    // every channel into its own ring; rings past numChannels are not written, so read only the newest
+    // callback's channels (a ring that comes back reads as silence for what it missed)
+    int64_t AddNewInterleavedFloatData(const float *newData, const int64_t numFrames, const int64_t numChannels);
+
+    // consumer side, one thread per consumer index
+    bool PeekFrame(FrameView *view, int whichConsumer = 0);
+    void ReleaseFrame(int whichConsumer = 0);
+    int64_t NumFramesAvailable(int whichConsumer = 0);
+    // move past the oldest windows without looking at them (a consumer that has fallen behind),
+    // returns how many were skipped, never more than are available
+    int64_t SkipFrames(int64_t numFrames, int whichConsumer = 0);
+    // the same window of another channel, valid as long as the window is
+    FrameView ChannelFrame(const FrameView &frame, int whichChannel);
+
+    // call only when neither side is running (between efforts)
+    void Clear();
+
+    int64_t WindowLength() { return mWindowLength; }
+    int64_t HopLength() { return mHopLength; }
+    int64_t NumSamplesWritten() { return mWriteCount.load(std::memory_order_acquire); }
+    int64_t NumDroppedSamples() { return mDroppedCount.load(std::memory_order_relaxed); }
+    int NumConsumers() { return mNumConsumers; }
+    int NumChannels() { return mNumChannels; }
+
+protected:
+    int64_t FreeSpace();
+    int64_t BeginWrite(int64_t numFrames, int64_t *idx, int64_t *numInFirstCopy);
+
+    int64_t mWindowLength;
+    int64_t mHopLength;
+    int64_t mSizeOfBuffer;  // power of two so positions wrap with a mask
+    int64_t mMask;
+    int mNumConsumers;
+    int mNumChannels;
+    float *mData;           // a ring of mSizeOfBuffer per channel
+    int mNumLiveChannels;   // rings written by the last interleaved callback (producer only)
+
+    // positions are absolute sample counts, they only ever increase
+    alignas(64) std::atomic<int64_t> mWriteCount;
+    alignas(64) std::atomic<int64_t> mDroppedCount;
+    struct alignas(64) ReadHead { std::atomic<int64_t> position; };
+    ReadHead mReadHead[kMaxNumFramerConsumers];
+};
+
+#endif
@@ -0,0 +1,110 @@
+//
+//  PipelineGeometry.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  The sampling rate, the top of the whistle band, the analysis window and hop as template
+//  parameters, with what ZoomSpectrum and PolyphaseDecimator make of them (the decimation factor,
+//  the decimated window and hop, the number of filter taps) worked out at compile time the same
+//  way they do at run time, and the combinations that can not work caught by static_assert.
+//
+//  PipelineDecimatorTaps<factor, taps> is the decimator's Blackman windowed sinc as a constexpr
+//  table (C++11 has no constexpr sin, so PipelineMath sums its series), in the order and rounding
+//  of the taps PolyphaseDecimator computes. PolyphaseDecimator has a kernel with the factor and
+//  taps fixed for each geometry below and picks it at run time when its own filter is the same.
+//
+//  PipelineGeometry44k and PipelineGeometry48k are the devices the app runs on, with the window
+//  and hop of SpirometerConstants.h (both in samples, so at 48 kHz the window is 0.92 s as it
+//  always was) and the band of the default whistle.
+
+#ifndef OpenSpirometry_PipelineGeometry_h
+#define OpenSpirometry_PipelineGeometry_h
+
+#include <stdint.h>
+#include "SpirometerConstants.h"
+#include "ZoomSpectrum.h"
+
+#define kPipelineBandTopInHz 1072 // the default whistle's MaxFrequency at MAX_FLOW_OF_WHISTLE_IN_LPS, rounded up
+
+struct PipelineMath {
+    static constexpr double Pi() { return 3.14159265358979323846; }
+    static constexpr double Floor(double x) { return (double)(int64_t)x > x ? (double)(int64_t)x - 1.0 : (double)(int64_t)x; }
+    static constexpr double Ceil(double x) { return -Floor(-x); }
+    // into [-pi, pi), where the series below converges in a few terms
+    static constexpr double Reduce(double x) { return x - 2.0*Pi()*Floor((x + Pi())/(2.0*Pi())); }
+    static constexpr double SinSeries(double x, double term, double sum, int n) {
+        return n > 30 ? sum : SinSeries(x, -term*x*x/(double)((2*n)*(2*n + 1)), sum + term, n + 1);
+    }
+    static constexpr double Sin(double x) { return SinSeries(Reduce(x), Reduce(x), 0.0, 1); }
+    static constexpr double Cos(double x) { return Sin(x + 0.5*Pi()); }
+};
+
+template <int kSamplingRate, int kBandTopInHz = kPipelineBandTopInHz,
+          int kWindowLength = BUFFER_SIZE, int kHopLength = BUFFER_SIZE-(BUFFER_OVERLAP)>
+struct PipelineGeometry {
+    static_assert(kWindowLength % 2 == 0, "the spectrum is windowLength/2 bins");
+    static_assert(kHopLength > 0 && kHopLength <= kWindowLength, "the hop must be within the window");
+
+    // ZoomSpectrum::DecimationFactorForBand: the largest factor under the Nyquist margin that divides window and hop
+    static constexpr int LargestFactorFrom(int factor) {
+        return factor <= 1 ? 1 : kWindowLength % factor == 0 && kHopLength % factor == 0 ? factor : LargestFactorFrom(factor - 1);
+    }
+    // PolyphaseDecimator: the Blackman transition runs from the band to the first frequency that aliases onto it,
+    // and the taps are rounded up to an odd number centered on a whole output sample
+    static constexpr int RoundedTaps(int numTaps, int factor) { return ((numTaps + 2*factor - 1)/(2*factor))*2*factor + 1; }
+    static constexpr double Transition(int factor) {
+        return ((double)kSamplingRate/(double)factor - 2.0*(double)kBandTopInHz)/(double)kSamplingRate;
+    }
+    static constexpr int TapsFor(int factor) {
+        return RoundedTaps(Transition(factor) > 0 ? (int)PipelineMath::Ceil(5.5/Transition(factor)) : 64*factor, factor);
+    }
+
+    enum {
+        samplingRate = kSamplingRate,
+        windowLength = kWindowLength,
+        hopLength = kHopLength,
+        numBins = kWindowLength/2,
+        decimationFactor = LargestFactorFrom((int)((float)kSamplingRate/(2.0f*kZoomNyquistMargin*(float)kBandTopInHz))),
+        numTaps = TapsFor(decimationFactor),
+        decimatedWindowLength = kWindowLength/decimationFactor,
+        decimatedHopLength = kHopLength/decimationFactor,
+    };
+    static_assert(decimationFactor > 1, "nothing to specialize without decimation");
+};
+
+typedef PipelineGeometry<44100> PipelineGeometry44k;
+typedef PipelineGeometry<48000> PipelineGeometry48k;
+
+// C++11 has no index sequences, the table is built from this one
+template <int... kIndices> struct PipelineIndices {};
+template <int kCount, int... kIndices> struct MakePipelineIndices : MakePipelineIndices<kCount - 1, kCount - 1, kIndices...> {};
+template <int... kIndices> struct MakePipelineIndices<0, kIndices...> { typedef PipelineIndices<kIndices...> Type; };
+
+template <int kFactor, int kNumTaps, class Indices = typename MakePipelineIndices<kNumTaps>::Type>
+struct PipelineDecimatorTaps;
+
+template <int kFactor, int kNumTaps, int... kIndices>
+struct PipelineDecimatorTaps<kFactor, kNumTaps, PipelineIndices<kIndices...> > {
+    static_assert(kFactor > 1 && kNumTaps % (2*kFactor) == 1, "odd, centered on a whole output sample");
+
+    // the same expressions as PolyphaseDecimator's constructor, cutoff 0.5/factor cycles per input sample
+    static constexpr double Sinc(double x) {
+        return x == 0 ? 2.0*(0.5/(double)kFactor) : PipelineMath::Sin(2.0*PipelineMath::Pi()*(0.5/(double)kFactor)*x)/(PipelineMath::Pi()*x);
+    }
+    static constexpr double Blackman(double w) { return 0.42 - 0.5*PipelineMath::Cos(w) + 0.08*PipelineMath::Cos(2.0*w); }
+    static constexpr double Raw(int i) {
+        return Sinc((double)i - 0.5*(double)(kNumTaps - 1))*Blackman(2.0*PipelineMath::Pi()*(double)i/(double)(kNumTaps - 1));
+    }
+    static constexpr double SumTo(int n) { return n == 0 ? 0.0 : SumTo(n - 1) + Raw(n - 1); } // first to last, as summed at run time
+    // reversed so the dot product runs forward through the history, rounded to float before the gain like the run time taps
+    static constexpr float Tap(int k) { return (float)((double)(float)Raw(kNumTaps - 1 - k)/SumTo(kNumTaps)); }
+
+    static constexpr float taps[kNumTaps] = {Tap(kIndices)...};
+};
+
+template <int kFactor, int kNumTaps, int... kIndices>
+constexpr float PipelineDecimatorTaps<kFactor, kNumTaps, PipelineIndices<kIndices...> >::taps[kNumTaps];
+
+#endif
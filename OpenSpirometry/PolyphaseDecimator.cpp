@@ -0,0 +1,138 @@
+//
+//  PolyphaseDecimator.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "PolyphaseDecimator.h"
+#include "PipelineGeometry.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define kFixedOutputsPerBlock 4 // outputs DecimateFixed sums side by side
+
+PolyphaseDecimator::PolyphaseDecimator(int64_t factor, float samplingRate, float passbandEdge, bool specialize) :
+mFactor(factor < 1 ? 1 : factor),
+mKernel(&PolyphaseDecimator::Decimate)
+{
+    // Blackman transition width is about 5.5/taps of the sampling rate, the transition can run from
+    // the passband edge all the way to the first frequency that aliases back onto it
+    double stopbandEdge = samplingRate/(double)mFactor - passbandEdge;
+    double transition = (stopbandEdge - passbandEdge)/samplingRate;
+    int64_t numTaps = transition > 0 ? (int64_t)ceil(5.5/transition) : 64*mFactor;
+    // odd and centered on a whole number of output samples, so the delay is an exact number of inputs
+    mNumTaps = ((numTaps + 2*mFactor - 1)/(2*mFactor))*2*mFactor + 1;
+
+    mTaps = (float *)calloc((size_t)mNumTaps, sizeof(float));
+    mHistory = (float *)calloc((size_t)(2*mNumTaps), sizeof(float));
+
+    if (mFactor == 1) {
+        mTaps[mNumTaps-1] = 1.0f; // nothing can alias, pass the newest input straight through
+    }
+    else {
+        double cutoff = 0.5/(double)mFactor; // cycles per input sample
+        double center = 0.5*(double)(mNumTaps - 1);
+        double sum = 0;
+        for (int64_t i=0; i < mNumTaps; ++i) {
+            double x = (double)i - center;
+            double sinc = x == 0 ? 2.0*cutoff : sin(2.0*M_PI*cutoff*x)/(M_PI*x);
+            double w = 2.0*M_PI*(double)i/(double)(mNumTaps - 1);
+            double blackman = 0.42 - 0.5*cos(w) + 0.08*cos(2.0*w);
+            mTaps[mNumTaps-1-i] = (float)(sinc*blackman);
+            sum += sinc*blackman;
+        }
+        for (int64_t i=0; i < mNumTaps; ++i)
+            mTaps[i] = (float)(mTaps[i]/sum); // unity gain at DC, flat to a few thousandths of a dB in the passband
+    }
+    if (specialize && !SelectKernel<PipelineGeometry44k>())
+        SelectKernel<PipelineGeometry48k>();
+
+    Clear();
+}
+
+PolyphaseDecimator::~PolyphaseDecimator()
+{
+    free(mTaps);
+    free(mHistory);
+}
+
+// the geometry's kernel if this is its filter
+template <class Geometry>
+bool PolyphaseDecimator::SelectKernel()
+{
+    if (mFactor != Geometry::decimationFactor || mNumTaps != Geometry::numTaps)
+        return false;
+    mKernel = &PolyphaseDecimator::DecimateFixed<Geometry::decimationFactor, Geometry::numTaps>;
+    return true;
+}
+
+int64_t PolyphaseDecimator::AddNewFloatData(const float *newData, const int64_t numFrames, float *output)
+{
+    return (this->*mKernel)(newData, numFrames, output);
+}
+
+int64_t PolyphaseDecimator::Decimate(const float *newData, const int64_t numFrames, float *output)
+{
+    int64_t numOutputs = 0;
+    for (int64_t i=0; i < numFrames; ++i) {
+        mHistory[mHistoryIndex] = newData[i];
+        mHistory[mHistoryIndex + mNumTaps] = newData[i];
+        if (++mHistoryIndex == mNumTaps) mHistoryIndex = 0;
+
+        if (++mPhase < mFactor)
+            continue;
+        mPhase = 0;
+
+        // oldest to newest input against the reversed taps
+        const float *x = &mHistory[mHistoryIndex];
+        float sum = 0;
+        for (int64_t k=0; k < mNumTaps; ++k)
+            sum += mTaps[k]*x[k];
+        output[numOutputs++] = sum;
+    }
+    return numOutputs;
+}
+
+// the same filter with the factor and taps known. Whenever there are inputs for kFixedOutputsPerBlock outputs,
+// the history and those inputs go into a fixed size block on the stack and the outputs are summed side by
+// side, each over the constexpr taps in the same order as Decimate (so the same bits) but not waiting on the
+// others' adds; what is left over goes through the history a sample at a time as before
+template <int kFactor, int kNumTaps>
+int64_t PolyphaseDecimator::DecimateFixed(const float *newData, const int64_t numFrames, float *output)
+{
+    const float *taps = PipelineDecimatorTaps<kFactor, kNumTaps>::taps;
+    float block[kNumTaps + kFixedOutputsPerBlock*kFactor];
+    int64_t numOutputs = 0;
+    int64_t i = 0;
+    while (numFrames - i >= kFixedOutputsPerBlock*kFactor - mPhase) {
+        const int64_t numIn = kFixedOutputsPerBlock*kFactor - mPhase;
+        const float *x = block + (kFactor - mPhase); // window of the first output
+        memcpy(block, &mHistory[mHistoryIndex], sizeof(float)*kNumTaps); // oldest first
+        memcpy(block + kNumTaps, newData + i, sizeof(float)*(size_t)numIn);
+
+        float sum[kFixedOutputsPerBlock] = {0};
+        for (int k=0; k < kNumTaps; ++k)
+            for (int j=0; j < kFixedOutputsPerBlock; ++j)
+                sum[j] += taps[k]*x[j*kFactor + k];
+        for (int j=0; j < kFixedOutputsPerBlock; ++j)
+            output[numOutputs++] = sum[j];
+
+        // the newest kNumTaps samples are the history again
+        memcpy(mHistory, block + numIn, sizeof(float)*kNumTaps);
+        memcpy(mHistory + kNumTaps, block + numIn, sizeof(float)*kNumTaps);
+        mHistoryIndex = 0;
+        mPhase = 0;
+        i += numIn;
+    }
+    return numOutputs + Decimate(newData + i, numFrames - i, output + numOutputs);
+}
+
+void PolyphaseDecimator::Clear()
+{
+    memset(mHistory, 0, sizeof(float)*(size_t)(2*mNumTaps));
+    mHistoryIndex = 0;
+    mPhase = 0;
+}
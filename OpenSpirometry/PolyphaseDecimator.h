@@ -0,0 +1,55 @@
+//
+//  PolyphaseDecimator.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Low pass FIR and downsample by an integer factor in one step. Only every Dth output of the
+//  filter is computed (the polyphase form), so the cost is taps/D multiplies per input sample.
+//  The taps are a Blackman windowed sinc with its cutoff at the new Nyquist frequency, long
+//  enough that nothing above samplingRate/D - passbandEdge (what would alias back into the
+//  passband) gets through at more than about -70 dB.
+//
+//  When the factor and the number of taps are those of one of the PipelineGeometry devices
+//  (44.1 and 48 kHz with the default whistle), the filter runs in a kernel with both fixed at
+//  compile time over the constexpr taps of PipelineDecimatorTaps, otherwise in the generic loop.
+
+#ifndef OpenSpirometry_PolyphaseDecimator_h
+#define OpenSpirometry_PolyphaseDecimator_h
+
+#include <stdint.h>
+
+class PolyphaseDecimator {
+
+public:
+    // passbandEdge must be below samplingRate/(2*factor), the closer it gets the longer the filter;
+    // specialize false keeps the generic loop whatever the filter is (benchmarks)
+    PolyphaseDecimator(int64_t factor, float samplingRate, float passbandEdge, bool specialize = true);
+    ~PolyphaseDecimator();
+
+    // writes one output per factor inputs to output (room for numFrames/factor + 1), returns how many
+    int64_t AddNewFloatData(const float *newData, const int64_t numFrames, float *output);
+    void Clear();
+
+    int64_t Factor() { return mFactor; }
+    int64_t NumTaps() { return mNumTaps; }
+    int64_t GroupDelayInSamples() { return (mNumTaps - 1)/2; } // at the input rate, a multiple of the factor
+    bool IsSpecialized() { return mKernel != &PolyphaseDecimator::Decimate; }
+
+protected:
+    typedef int64_t (PolyphaseDecimator::*Kernel)(const float *newData, const int64_t numFrames, float *output);
+    int64_t Decimate(const float *newData, const int64_t numFrames, float *output);
+    template <int kFactor, int kNumTaps> int64_t DecimateFixed(const float *newData, const int64_t numFrames, float *output);
+    template <class Geometry> bool SelectKernel();
+
+    int64_t mFactor;
+    int64_t mNumTaps;       // 2*k*mFactor + 1, linear phase
+    float *mTaps;           // stored reversed so the dot product runs forward through the history
+    float *mHistory;        // last mNumTaps inputs, written twice so a window never wraps
+    int64_t mHistoryIndex;
+    int64_t mPhase;         // inputs since the last output
+    Kernel mKernel;         // Decimate, or the fixed kernel of a geometry with this filter
+};
+
+#endif
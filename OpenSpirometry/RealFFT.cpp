@@ -0,0 +1,242 @@
+//
+//  RealFFT.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "RealFFT.h"
+#include "FFTLanes.h"
+#include <math.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+
+// window and pack: z_n = w[2n] x[2n] + i w[2n+1] x[2n+1], for n in [begin, end)
+template <class L>
+static void WindowAndPack(const float *data, const float *window, float *zr, float *zi, int64_t begin, int64_t end)
+{
+    typedef typename L::V V;
+    for (int64_t n=begin; n + L::kNumLanes <= end; n += L::kNumLanes) {
+        V even, odd, windowEven, windowOdd;
+        L::LoadEvenOdd(&data[2*n], &even, &odd);
+        if (window) {
+            L::LoadEvenOdd(&window[2*n], &windowEven, &windowOdd);
+            even = even*windowEven;
+            odd = odd*windowOdd;
+        }
+        L::Store(&zr[n], even);
+        L::Store(&zi[n], odd);
+    }
+}
+
+// X_k = (Z_k + Z*_(h-k))/2 - i W^k (Z_k - Z*_(h-k))/2 for k in [begin, end), 0 < begin
+template <class L>
+static void SplitPacked(const float *zr, const float *zi, const float *wr, const float *wi, int64_t h,
+                        float *xr, float *xi, int64_t begin, int64_t end)
+{
+    typedef typename L::V V;
+    const V half = L::Splat(0.5f);
+    for (int64_t k=begin; k + L::kNumLanes <= end; k += L::kNumLanes) {
+        V ar = L::Load(&zr[k]), ai = L::Load(&zi[k]);
+        // Z_(h-k) for the same lanes, read backwards
+        V br = L::Reverse(L::Load(&zr[h - k - L::kNumLanes + 1]));
+        V bi = L::Reverse(L::Load(&zi[h - k - L::kNumLanes + 1]));
+        V er = (ar + br)*half, ei = (ai - bi)*half;   // even samples' transform
+        V or_ = (ai + bi)*half, oi = (br - ar)*half;  // odd samples' transform, -i (Z_k - Z*_(h-k))/2
+        V twr = L::Load(&wr[k]), twi = L::Load(&wi[k]);
+        L::Store(&xr[k], er + twr*or_ - twi*oi);
+        L::Store(&xi[k], ei + twr*oi + twi*or_);
+    }
+}
+
+// |X_k|^2 for k in [begin, end)
+template <class L>
+static void Power(const float *xr, const float *xi, float *power, int64_t begin, int64_t end)
+{
+    typedef typename L::V V;
+    for (int64_t k=begin; k + L::kNumLanes <= end; k += L::kNumLanes) {
+        V re = L::Load(&xr[k]), im = L::Load(&xi[k]);
+        L::Store(&power[k], re*re + im*im);
+    }
+}
+
+static inline int64_t VectorEnd(int64_t begin, int64_t end)
+{
+    return begin + (end - begin) - (end - begin) % VectorLanes::kNumLanes;
+}
+
+RealFFTPlan::RealFFTPlan(int64_t length, FFTWindowType windowType) :
+mLength(length < 2 ? 2 : length),
+mWindowType(windowType)
+{
+    if (windowType != FFTWindowRect) {
+        mWindow.resize((size_t)mLength);
+        for (int64_t n=0; n < mLength; ++n) {
+            double phase = 2.0*M_PI*(double)n/(double)mLength;
+            double w;
+            switch (windowType) {
+                case FFTWindowHamming:  w = 0.54 - 0.46*cos(phase); break;
+                case FFTWindowBlackman: w = 0.42 - 0.5*cos(phase) + 0.08*cos(2.0*phase); break;
+                default:                w = 0.5*(1.0 - cos(phase)); break;
+            }
+            mWindow[(size_t)n] = (float)w;
+        }
+    }
+
+    if (IsPacked()) {
+        int64_t h = mLength/2;
+        mComplexPlan = FFTPlan::Shared(h);
+        mSplitReal.resize((size_t)(h + 1));
+        mSplitImag.resize((size_t)(h + 1));
+        for (int64_t k=0; k <= h; ++k) {
+            double phase = -2.0*M_PI*(double)k/(double)mLength;
+            mSplitReal[(size_t)k] = (float)cos(phase);
+            mSplitImag[(size_t)k] = (float)sin(phase);
+        }
+    }
+    else {
+        mComplexPlan = FFTPlan::Shared(mLength);
+    }
+}
+
+typedef std::map<std::pair<int64_t, int>, std::shared_ptr<const RealFFTPlan> > RealPlanCache;
+
+static std::mutex &RealPlanCacheLock()
+{
+    static std::mutex lock;
+    return lock;
+}
+
+static RealPlanCache &SharedRealPlanCache()
+{
+    static RealPlanCache cache;
+    return cache;
+}
+
+std::shared_ptr<const RealFFTPlan> RealFFTPlan::Shared(int64_t length, FFTWindowType windowType)
+{
+    std::pair<int64_t, int> key(length, (int)windowType);
+    {
+        std::lock_guard<std::mutex> lock(RealPlanCacheLock());
+        RealPlanCache::iterator found = SharedRealPlanCache().find(key);
+        if (found != SharedRealPlanCache().end())
+            return found->second;
+    }
+
+    std::shared_ptr<const RealFFTPlan> plan(new RealFFTPlan(length, windowType));
+    std::lock_guard<std::mutex> lock(RealPlanCacheLock());
+    return SharedRealPlanCache().insert(std::make_pair(key, plan)).first->second;
+}
+
+int64_t RealFFTPlan::NumSharedPlans()
+{
+    std::lock_guard<std::mutex> lock(RealPlanCacheLock());
+    return (int64_t)SharedRealPlanCache().size();
+}
+
+RealFFT::RealFFT(int64_t length, FFTWindowType windowType) :
+mPlan(RealFFTPlan::Shared(length, windowType))
+{
+    const FFTPlan &complexPlan = mPlan->ComplexPlan();
+    mReal.assign((size_t)mPlan->NumBins(), 0.0f);
+    mImag.assign((size_t)mPlan->NumBins(), 0.0f);
+    mWorkReal.assign((size_t)complexPlan.Length(), 0.0f);
+    mWorkImag.assign((size_t)complexPlan.Length(), 0.0f);
+    mScratchReal.assign((size_t)complexPlan.ScratchLength(), 0.0f);
+    mScratchImag.assign((size_t)complexPlan.ScratchLength(), 0.0f);
+
+    // same reference as FFTHelper: vDSP_vdbcon against 1/sqrt(1/(4N)), on 2x the DFT
+    mdBOffset = 10.0f*log10f(4.0f) - 10.0f*log10f(2.0f*sqrtf((float)mPlan->Length()));
+}
+
+void RealFFT::PerformForwardFFT(const float *data)
+{
+    const RealFFTPlan &plan = *mPlan;
+    const int64_t N = plan.Length();
+    const float *window = plan.Window();
+    float *zr = &mWorkReal[0], *zi = &mWorkImag[0];
+
+    if (!plan.IsPacked()) {
+        for (int64_t n=0; n < N; ++n) {
+            zr[n] = window ? data[n]*window[n] : data[n];
+            zi[n] = 0;
+        }
+        plan.ComplexPlan().Forward(zr, zi, &mScratchReal[0], &mScratchImag[0]);
+        memcpy(&mReal[0], zr, sizeof(float)*mReal.size());
+        memcpy(&mImag[0], zi, sizeof(float)*mImag.size());
+        return;
+    }
+
+    const int64_t h = N/2;
+    int64_t vectorEnd = VectorEnd(0, h);
+    WindowAndPack<VectorLanes>(data, window, zr, zi, 0, vectorEnd);
+    WindowAndPack<ScalarLanes>(data, window, zr, zi, vectorEnd, h);
+    plan.ComplexPlan().Forward(zr, zi, &mScratchReal[0], &mScratchImag[0]);
+
+    // DC and Nyquist are real, the rest come from Z_k and Z_(h-k)
+    mReal[0] = zr[0] + zi[0];
+    mImag[0] = 0;
+    mReal[(size_t)h] = zr[0] - zi[0];
+    mImag[(size_t)h] = 0;
+    vectorEnd = VectorEnd(1, h);
+    SplitPacked<VectorLanes>(zr, zi, &plan.mSplitReal[0], &plan.mSplitImag[0], h, &mReal[0], &mImag[0], 1, vectorEnd);
+    SplitPacked<ScalarLanes>(zr, zi, &plan.mSplitReal[0], &plan.mSplitImag[0], h, &mReal[0], &mImag[0], vectorEnd, h);
+}
+
+void RealFFT::CopydBMagnitudeToBuffer(float *buffer)
+{
+    const int64_t numBins = mPlan->Length()/2;
+    int64_t vectorEnd = VectorEnd(0, numBins);
+    Power<VectorLanes>(&mReal[0], &mImag[0], buffer, 0, vectorEnd);
+    Power<ScalarLanes>(&mReal[0], &mImag[0], buffer, vectorEnd, numBins);
+    for (int64_t k=0; k < numBins; ++k)
+        buffer[k] = 10.0f*log10f(buffer[k] + 1e-20f) + mdBOffset;
+}
+
+void RealFFT::PerformForwardFFTAndCopydBMagnitude(const float *data, float *buffer)
+{
+    PerformForwardFFT(data);
+    CopydBMagnitudeToBuffer(buffer);
+}
+
+void RealFFT::PerformInverseFFT(const float *real, const float *imag, float *output)
+{
+    const RealFFTPlan &plan = *mPlan;
+    const int64_t N = plan.Length();
+    float *zr = &mWorkReal[0], *zi = &mWorkImag[0];
+
+    if (!plan.IsPacked()) {
+        // rebuild the conjugate symmetric half
+        for (int64_t k=0; k < N; ++k) {
+            int64_t bin = k <= N/2 ? k : N - k;
+            zr[k] = real[bin];
+            zi[k] = k <= N/2 ? imag[bin] : -imag[bin];
+        }
+        zi[0] = 0;
+        plan.ComplexPlan().Inverse(zr, zi, &mScratchReal[0], &mScratchImag[0]);
+        for (int64_t n=0; n < N; ++n)
+            output[n] = zr[n]/(float)N;
+        return;
+    }
+
+    // Z_k = E_k + i O_k, E_k = (X_k + X*_(h-k))/2, O_k = (X_k - X*_(h-k)) conj(W^k)/2
+    const int64_t h = N/2;
+    const float *wr = &plan.mSplitReal[0], *wi = &plan.mSplitImag[0];
+    for (int64_t k=0; k < h; ++k) {
+        float ar = real[k], ai = imag[k];
+        float br = real[h-k], bi = -imag[h-k];
+        float er = 0.5f*(ar + br), ei = 0.5f*(ai + bi);
+        float dr = 0.5f*(ar - br), di = 0.5f*(ai - bi);
+        float or_ = dr*wr[k] + di*wi[k], oi = di*wr[k] - dr*wi[k];
+        zr[k] = er - oi;
+        zi[k] = ei + or_;
+    }
+    plan.ComplexPlan().Inverse(zr, zi, &mScratchReal[0], &mScratchImag[0]);
+    float scale = 1.0f/(float)h;
+    for (int64_t n=0; n < h; ++n) {
+        output[2*n] = zr[n]*scale;
+        output[2*n+1] = zi[n]*scale;
+    }
+}
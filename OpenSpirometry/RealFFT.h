@@ -0,0 +1,89 @@
+//
+//  RealFFT.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Windowed real FFT of any length, the portable counterpart of FFTHelper. An even length N
+//  packs the samples into a complex transform of N/2 (FFTPlan) and splits the result, odd
+//  lengths run a full complex transform. Constants (complex plan, split twiddles and window)
+//  live in a RealFFTPlan shared by every RealFFT of the same length and window type, so many
+//  analyzers cost one set of tables. Each RealFFT only owns its working buffers.
+//  The dB output has the same scaling as FFTHelper copydBMagnitudeToBuffer: (and SlidingSpectrum).
+
+#ifndef OpenSpirometry_RealFFT_h
+#define OpenSpirometry_RealFFT_h
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include "FFTPlan.h"
+
+enum FFTWindowType {
+    FFTWindowRect,
+    FFTWindowHann,          // periodic, same as vDSP_hann_window(..., vDSP_HANN_DENORM)
+    FFTWindowHamming,
+    FFTWindowBlackman,
+};
+
+class RealFFTPlan {
+
+public:
+    RealFFTPlan(int64_t length, FFTWindowType windowType); // prefer Shared()
+
+    // one plan per (length, window type) for the whole process, built on first use (thread safe)
+    static std::shared_ptr<const RealFFTPlan> Shared(int64_t length, FFTWindowType windowType);
+    static int64_t NumSharedPlans();
+
+    int64_t Length() const { return mLength; }
+    int64_t NumBins() const { return mLength/2 + 1; } // DC...Nyquist (or the last bin below it)
+    FFTWindowType WindowType() const { return mWindowType; }
+    const float *Window() const { return mWindow.empty() ? NULL : &mWindow[0]; }
+    const FFTPlan &ComplexPlan() const { return *mComplexPlan; }
+    bool IsPacked() const { return mLength % 2 == 0; } // even lengths run a half length complex transform
+
+protected:
+    friend class RealFFT;
+
+    int64_t mLength;
+    FFTWindowType mWindowType;
+    std::vector<float> mWindow;
+    std::shared_ptr<const FFTPlan> mComplexPlan;
+    std::vector<float> mSplitReal;  // e^(-2 pi i k/N) for k <= N/2, to split the packed transform
+    std::vector<float> mSplitImag;
+};
+
+class RealFFT {
+
+public:
+    RealFFT(int64_t length, FFTWindowType windowType = FFTWindowHann);
+
+    // window and transform, the spectrum is kept until the next call
+    void PerformForwardFFT(const float *data);
+    // Length()/2 bins in dB, 10*log10(4|X_k|^2/(2 sqrt(N))) like vDSP_zvmags + vDSP_vdbcon on zrip output
+    void CopydBMagnitudeToBuffer(float *buffer);
+    void PerformForwardFFTAndCopydBMagnitude(const float *data, float *buffer);
+
+    // bins 0...NumBins()-1 of a spectrum (DFT scale, as in Real()/Imag()) back to Length() samples,
+    // the result is the windowed input, not divided by the window
+    void PerformInverseFFT(const float *real, const float *imag, float *output);
+
+    const float *Real() const { return &mReal[0]; } // NumBins() values, X_k (not doubled like zrip)
+    const float *Imag() const { return &mImag[0]; }
+    int64_t Length() const { return mPlan->Length(); }
+    int64_t NumBins() const { return mPlan->NumBins(); }
+    const RealFFTPlan &Plan() const { return *mPlan; }
+
+protected:
+    std::shared_ptr<const RealFFTPlan> mPlan;
+    std::vector<float> mReal;
+    std::vector<float> mImag;
+    std::vector<float> mWorkReal;       // complex transform input/output
+    std::vector<float> mWorkImag;
+    std::vector<float> mScratchReal;    // for FFTPlan
+    std::vector<float> mScratchImag;
+    float mdBOffset;
+};
+
+#endif
@@ -0,0 +1,184 @@
+//
+//  ShortWindowEstimator.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "ShortWindowEstimator.h"
+#include <math.h>
+
+ShortWindowEstimator::ShortWindowEstimator(float samplingRate, int64_t windowLength, int64_t hopLength,
+                                           float minFrequency, float maxFrequency, float maxSlewInHzPerSecond) :
+mSamplingRate(samplingRate),
+mWindowLength(windowLength),
+mHopLength(hopLength),
+mMaxSlew(maxSlewInHzPerSecond),
+mFFT(windowLength, FFTWindowHann),
+mWindow((size_t)windowLength),
+mReal((size_t)(windowLength/2 + 1)),
+mImag((size_t)(windowLength/2 + 1)),
+mPreviousReal((size_t)(windowLength/2 + 1)),
+mPreviousImag((size_t)(windowLength/2 + 1))
+{
+    float resolution = samplingRate/(float)windowLength;
+    mFirstBin = (int64_t)ceilf(minFrequency/resolution);
+    mFirstBin = mFirstBin < 2 ? 2 : mFirstBin;
+    mLastBin = (int64_t)floorf(maxFrequency/resolution);
+    mLastBin = mLastBin > windowLength/2 - 2 ? windowLength/2 - 2 : mLastBin;
+    mLastHarmonicBin = 2*mLastBin + 1 > windowLength/2 - 1 ? windowLength/2 - 1 : 2*mLastBin + 1;
+    mMagnitude.resize((size_t)(mLastHarmonicBin + 1), SPECTRUM_FLOOR_DB);
+
+    // a tone is 15 log10(N) dB up with the dB scaling of the long window (Hann, 4|X|^2/(2 sqrt(N)))
+    mThreshold = PEAK_DBMAG_SUSTAINED - 15.0f*log10f((float)(BUFFER_SIZE)/(float)windowLength);
+    Clear();
+}
+
+void ShortWindowEstimator::Clear()
+{
+    mPreviousEnd = -1;
+    mLastFrequency = -1.0f;
+    mNumTransforms = 0;
+}
+
+void ShortWindowEstimator::Transform(const FrameView &frame, int64_t endOffset, float *real, float *imag)
+{
+    frame.CopyRangeToBuffer(&mWindow[0], frame.Length() - endOffset - mWindowLength, mWindowLength);
+    mFFT.PerformForwardFFT(&mWindow[0]);
+    const float *fftReal = mFFT.Real(), *fftImag = mFFT.Imag();
+    for (int64_t k = 0; k <= mLastHarmonicBin; k++) {
+        real[k] = fftReal[k];
+        imag[k] = fftImag[k];
+    }
+    mNumTransforms++;
+}
+
+bool ShortWindowEstimator::Analyze(const FrameView &frame, ShortWindowEstimate *estimate)
+{
+    if (frame.Length() < mWindowLength + mHopLength)
+        return false;
+    int64_t end = frame.firstSampleIndex + frame.Length();
+
+    // the phase reference: the last transform if it is close enough behind (less than half a window,
+    // or the phase no longer tells neighbouring bins apart), else one taken a hop back in this frame
+    int64_t lag = end - mPreviousEnd;
+    if (mPreviousEnd < 0 || lag <= 0 || lag >= mWindowLength/2) {
+        lag = mHopLength;
+        mLastFrequency = -1.0f; // nothing recent to be consistent with
+        Transform(frame, lag, &mPreviousReal[0], &mPreviousImag[0]);
+    }
+    else {
+        mPreviousReal.swap(mReal);
+        mPreviousImag.swap(mImag);
+    }
+    Transform(frame, 0, &mReal[0], &mImag[0]);
+    mPreviousEnd = end;
+
+    float dBOffset = 10.0f*log10f(2.0f/sqrtf((float)mWindowLength));
+    for (int64_t k = mFirstBin - 1; k <= mLastHarmonicBin; k++)
+        mMagnitude[k] = 10.0f*log10f(mReal[k]*mReal[k] + mImag[k]*mImag[k] + 1e-20f) + dBOffset;
+
+    // strongest local maximum in the band
+    int64_t best = -1;
+    for (int64_t k = mFirstBin; k <= mLastBin; k++)
+        if (mMagnitude[k] > mMagnitude[k-1] && mMagnitude[k] >= mMagnitude[k+1] &&
+            mMagnitude[k] > mThreshold && (best < 0 || mMagnitude[k] > mMagnitude[best]))
+            best = k;
+    if (best < 0) {
+        mLastFrequency = -1.0f;
+        return false;
+    }
+
+    // it may be a harmonic of a weaker fundamental an octave down
+    int64_t half = (best + 1)/2;
+    if (half >= mFirstBin) {
+        int64_t below = LocalPeakNear(half, 1);
+        if (below >= 0 && mMagnitude[below] > mThreshold && mMagnitude[below] > mMagnitude[best] - kShortWindowSubharmonicDB)
+            best = below;
+    }
+
+    float frequency = PhaseFrequency(best, lag);
+    estimate->usedHarmonic = false;
+    int64_t harmonic = LocalPeakNear(2*best, 1);
+    if (harmonic >= 0 && mMagnitude[harmonic] > mMagnitude[best] - kShortWindowHarmonicDB) {
+        float harmonicFrequency = 0.5f*PhaseFrequency(harmonic, lag);
+        if (fabsf(harmonicFrequency - frequency) < 0.5f*mSamplingRate/(float)mWindowLength) {
+            // power weighted, the harmonic's phase moves twice as fast so its frequency is twice as precise
+            float weight = powf(10.0f, 0.1f*(mMagnitude[best] - mMagnitude[harmonic]));
+            frequency = (weight*frequency + 4.0f*harmonicFrequency)/(weight + 4.0f);
+            estimate->usedHarmonic = true;
+        }
+    }
+    // within reach of the last window's
+    float lastFrequency = mLastFrequency;
+    mLastFrequency = frequency;
+    float reach = mMaxSlew*(float)lag/mSamplingRate + mSamplingRate/(float)mWindowLength;
+    if (lastFrequency < 0 || fabsf(frequency - lastFrequency) > reach || frequency < MIN_FREQUENCY_OF_WHISTLE_IN_HZ)
+        return false;
+    estimate->frequency = frequency;
+    estimate->magnitude = mMagnitude[best];
+    float confidence = (mMagnitude[best] - mThreshold)/kShortWindowConfidenceRangeDB;
+    estimate->confidence = confidence > 1 ? 1 : confidence;
+    return true;
+}
+
+// largest bin within radius that is a local maximum, -1 if none
+int64_t ShortWindowEstimator::LocalPeakNear(int64_t bin, int64_t radius)
+{
+    int64_t best = -1;
+    for (int64_t k = bin - radius; k <= bin + radius; k++) {
+        if (k < mFirstBin || k >= mLastHarmonicBin)
+            continue;
+        if (mMagnitude[k] > mMagnitude[k-1] && mMagnitude[k] >= mMagnitude[k+1] &&
+            (best < 0 || mMagnitude[k] > mMagnitude[best]))
+            best = k;
+    }
+    return best;
+}
+
+// the bin's phase advance over lag samples, less the advance of the bin center, is the offset from it
+float ShortWindowEstimator::PhaseFrequency(int64_t bin, int64_t lag)
+{
+    double phase = atan2((double)mImag[bin], (double)mReal[bin]);
+    double previousPhase = atan2((double)mPreviousImag[bin], (double)mPreviousReal[bin]);
+    double deviation = phase - previousPhase - 2.0*M_PI*(double)bin*(double)lag/(double)mWindowLength;
+    deviation -= 2.0*M_PI*floor(deviation/(2.0*M_PI) + 0.5);
+    double cyclesPerSample = (double)bin/(double)mWindowLength + deviation/(2.0*M_PI*(double)lag);
+    return (float)(cyclesPerSample*mSamplingRate);
+}
+
+//=============================================================================================================
+
+ResolutionSwitch::ResolutionSwitch(float samplingRate) :
+mSamplingRate(samplingRate)
+{
+    Clear();
+}
+
+void ResolutionSwitch::Clear()
+{
+    mShort = true;
+    mPeakFlow = 0;
+    mPeakFrame = -1;
+    mSwitchFrame = -1;
+}
+
+void ResolutionSwitch::Update(SpirometryStage stage, int64_t frameEnd, float flow)
+{
+    if (!mShort || stage < SpirometryStageIsExhaling)
+        return;
+    if (flow > mPeakFlow) {
+        mPeakFlow = flow;
+        mPeakFrame = frameEnd;
+    }
+
+    // onto the tail, with the peak out of the long window (its loud blast would pull the first long
+    // estimates up to it), or the sound is already dropping away
+    bool peakBehind = mPeakFrame >= 0 && frameEnd - mPeakFrame >= (int64_t)(BUFFER_SIZE);
+    bool onTail = flow >= 0 && flow < MULTIRES_TAIL_FRACTION_OF_PEAK*mPeakFlow;
+    if ((peakBehind && onTail) || stage >= SpirometryStageIsWaitingForEndOfTest) {
+        mShort = false;
+        mSwitchFrame = frameEnd;
+    }
+}
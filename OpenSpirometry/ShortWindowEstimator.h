@@ -0,0 +1,107 @@
+//
+//  ShortWindowEstimator.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Whistle fundamental from the newest SHORT_WINDOW_SIZE samples of a window (about 46 ms at
+//  44.1 kHz) instead of the whole second, for the rise to peak flow where the long window smears
+//  the blast over a second and lags it by half of one. Its bins are over 20 Hz wide, so the
+//  frequency comes from the phase: the phase of the peak bin advances by 2 pi f L/fs between two
+//  transforms L samples apart (a phase vocoder), which places a steady fundamental to a fraction
+//  of a Hz. The previous window's transform is reused when it ended exactly one hop earlier.
+//  Harmonic aware: the strongest peak moves down to the fundamental an octave below when that is
+//  there too, and the second harmonic (when it is strong enough and agrees) refines the estimate,
+//  with twice the weight per unit of power since its phase moves twice as fast. An estimate only
+//  counts when the window before found one within reach of it (maxSlew, plus a bin), so clicks
+//  and breath noise at the start of the blast do not make it into the curve.
+//
+//  ResolutionSwitch decides which window the analysis uses: short ones from the start of the
+//  effort through silence calibration, the blast and peak flow, long ones (the usual BUFFER_SIZE)
+//  once the peak is a whole long window behind and the flow has fallen below
+//  MULTIRES_TAIL_FRACTION_OF_PEAK of it, or the effort is about to end. The slow tail is
+//  where the long window's resolution helps (low frequencies, close harmonics) and its lag does
+//  not matter. The switch happens once per effort.
+
+#ifndef OpenSpirometry_ShortWindowEstimator_h
+#define OpenSpirometry_ShortWindowEstimator_h
+
+#include <stdint.h>
+#include <vector>
+#include "SpirometerConstants.h"
+#include "OverlapFramer.h"
+#include "RealFFT.h"
+
+#define kShortWindowSubharmonicDB 20.0f     // a peak an octave down this far below the strongest is the fundamental
+#define kShortWindowHarmonicDB 20.0f        // the second harmonic refines the estimate if it is within this of the fundamental
+#define kShortWindowConfidenceRangeDB 20.0f // dB above the threshold for full confidence
+
+struct ShortWindowEstimate {
+    float frequency;
+    float magnitude;            // dB, on the short window's scale
+    float confidence;           // 0 to 1, how far the peak is above the threshold
+    bool usedHarmonic;          // the second harmonic took part in the refinement
+};
+
+class ShortWindowEstimator {
+
+public:
+    // maxSlew is how fast the fundamental can move, in Hz per second
+    ShortWindowEstimator(float samplingRate, int64_t windowLength, int64_t hopLength, float minFrequency, float maxFrequency,
+                         float maxSlewInHzPerSecond);
+
+    // the newest windowLength samples of the frame, false if there is no fundamental
+    bool Analyze(const FrameView &frame, ShortWindowEstimate *estimate);
+    void Clear();
+
+    int64_t WindowLength() { return mWindowLength; }
+    int64_t NumTransforms() { return mNumTransforms; } // since Clear, one per window when the hop is steady
+    float Threshold() { return mThreshold; }
+
+protected:
+    void Transform(const FrameView &frame, int64_t endOffset, float *real, float *imag);
+    float PhaseFrequency(int64_t bin, int64_t lag);
+    int64_t LocalPeakNear(int64_t bin, int64_t radius);
+
+    float mSamplingRate;
+    int64_t mWindowLength;
+    int64_t mHopLength;
+    int64_t mFirstBin;
+    int64_t mLastBin;
+    int64_t mLastHarmonicBin;
+    float mThreshold;           // PEAK_DBMAG_SUSTAINED moved to the short window's scale
+    float mMaxSlew;
+    float mLastFrequency;       // of the previous window, consistent or not, -1 if it had none
+
+    RealFFT mFFT;
+    std::vector<float> mWindow;     // samples
+    std::vector<float> mReal;       // newest transform
+    std::vector<float> mImag;
+    std::vector<float> mPreviousReal; // transform lag samples earlier
+    std::vector<float> mPreviousImag;
+    std::vector<float> mMagnitude;  // dB, bins mFirstBin...mLastHarmonicBin
+    int64_t mPreviousEnd;           // stream position the previous transform ended at, -1 for none
+    int64_t mNumTransforms;
+};
+
+class ResolutionSwitch {
+
+public:
+    ResolutionSwitch(float samplingRate);
+
+    // once per window while short: the stage and the flow of the short window (negative for none)
+    void Update(SpirometryStage stage, int64_t frameEnd, float flow);
+    bool UsesShortWindows() { return mShort; }
+    int64_t SwitchFrame() { return mSwitchFrame; } // stream position of the switch, -1 while short
+    void Clear();
+
+protected:
+    float mSamplingRate;
+    bool mShort;
+    float mPeakFlow;            // of the short windows since exhaling started
+    int64_t mPeakFrame;         // stream position of the peak, -1 before
+    int64_t mSwitchFrame;
+};
+
+#endif
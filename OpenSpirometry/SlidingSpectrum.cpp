@@ -0,0 +1,175 @@
+//
+//  SlidingSpectrum.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "SlidingSpectrum.h"
+#include "SpirometerConstants.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+SlidingSpectrum::SlidingSpectrum(int64_t windowLength, float samplingRate, float minFrequency, float maxFrequency) :
+mWindowLength(windowLength),
+mSamplingRate(samplingRate)
+{
+    float resolution = samplingRate/(float)windowLength;
+    int64_t nyquistBin = windowLength/2 - 1; // last bin FFTHelper hands back
+
+    mFirstBin = (int64_t)floorf(minFrequency/resolution);
+    mLastBin = (int64_t)ceilf(maxFrequency/resolution);
+    if (mFirstBin < 0) mFirstBin = 0;
+    if (mLastBin > nyquistBin) mLastBin = nyquistBin;
+    if (mLastBin < mFirstBin) mLastBin = mFirstBin;
+
+    mFirstRawBin = mFirstBin - 1; // can be -1, the recursion works for negative bins too
+    mNumRawBins = mLastBin - mFirstBin + 3;
+
+    mReal = (double *)calloc((size_t)mNumRawBins, sizeof(double));
+    mImag = (double *)calloc((size_t)mNumRawBins, sizeof(double));
+    mCos = (double *)calloc((size_t)mNumRawBins, sizeof(double));
+    mSin = (double *)calloc((size_t)mNumRawBins, sizeof(double));
+    mHistory = (float *)calloc((size_t)windowLength, sizeof(float));
+
+    for (int64_t i=0; i < mNumRawBins; ++i) {
+        double phase = 2.0*M_PI*(double)(mFirstRawBin + i)/(double)windowLength;
+        mCos[i] = cos(phase);
+        mSin[i] = sin(phase);
+    }
+
+    // same scaling as FFTHelper: vDSP_fft_zrip doubles the output and vDSP_vdbcon uses 1/sqrt(1/(4N)) as reference
+    mdBOffset = 10.0f*log10f(4.0f) - 10.0f*log10f(2.0f*sqrtf((float)windowLength));
+
+    mHistoryIndex = 0;
+    mNumFramesSeen = 0;
+}
+
+SlidingSpectrum::~SlidingSpectrum()
+{
+    free(mReal);
+    free(mImag);
+    free(mCos);
+    free(mSin);
+    free(mHistory);
+}
+
+// a whole hop goes through in one block (the hop is in samples, the same at every rate and smaller once decimated)
+#define kSlidingMaxBlockLength (BUFFER_SIZE-(BUFFER_OVERLAP))
+
+void SlidingSpectrum::AddNewFloatData(const float *newData, const int64_t numFrames)
+{
+    for (int64_t i=0; i < numFrames; i += kSlidingMaxBlockLength)
+        AddBlock(newData + i, numFrames - i < kSlidingMaxBlockLength ? numFrames - i : kSlidingMaxBlockLength);
+}
+
+void SlidingSpectrum::AddBlock(const float *newData, int64_t numFrames)
+{
+    // differences first (the history is the only per sample state), then the bins a block at a time
+    double delta[kSlidingMaxBlockLength];
+    for (int64_t i=0; i < numFrames; ++i) {
+        delta[i] = (double)newData[i] - (double)mHistory[mHistoryIndex];
+        mHistory[mHistoryIndex] = newData[i];
+        if (++mHistoryIndex == mWindowLength) mHistoryIndex = 0;
+    }
+
+    int64_t k = 0;
+    for (; k + kSlidingBinsPerBlock <= mNumRawBins; k += kSlidingBinsPerBlock) {
+        double re[kSlidingBinsPerBlock], im[kSlidingBinsPerBlock], c[kSlidingBinsPerBlock], s[kSlidingBinsPerBlock];
+        for (int j=0; j < kSlidingBinsPerBlock; ++j) {
+            re[j] = mReal[k+j]; im[j] = mImag[k+j];
+            c[j] = mCos[k+j]; s[j] = mSin[k+j];
+        }
+        for (int64_t i=0; i < numFrames; ++i) {
+            for (int j=0; j < kSlidingBinsPerBlock; ++j) {
+                double t = re[j] + delta[i];
+                double u = im[j];
+                re[j] = c[j]*t - s[j]*u;
+                im[j] = s[j]*t + c[j]*u;
+            }
+        }
+        for (int j=0; j < kSlidingBinsPerBlock; ++j) {
+            mReal[k+j] = re[j]; mImag[k+j] = im[j];
+        }
+    }
+    for (; k < mNumRawBins; ++k) {
+        double re = mReal[k], im = mImag[k];
+        for (int64_t i=0; i < numFrames; ++i) {
+            double t = re + delta[i];
+            double u = im;
+            re = mCos[k]*t - mSin[k]*u;
+            im = mSin[k]*t + mCos[k]*u;
+        }
+        mReal[k] = re; mImag[k] = im;
+    }
+
+    mNumFramesSeen += numFrames;
+}
+
+void SlidingSpectrum::AddSamples(const float *newData, const int64_t numFrames)
+{
+    // S_k(n) = e^(j*2*pi*k/N) * (S_k(n-1) + x(n) - x(n-N))
+    // kept in double so the rotations do not drift over a whole effort
+    const int64_t numBins = mNumRawBins;
+    double *re = mReal;
+    double *im = mImag;
+    const double *c = mCos;
+    const double *s = mSin;
+
+    for (int64_t i=0; i < numFrames; ++i) {
+        double delta = (double)newData[i] - (double)mHistory[mHistoryIndex];
+        mHistory[mHistoryIndex] = newData[i];
+        if (++mHistoryIndex == mWindowLength) mHistoryIndex = 0;
+
+        for (int64_t k=0; k < numBins; ++k) {
+            double t = re[k] + delta;
+            double u = im[k];
+            re[k] = c[k]*t - s[k]*u;
+            im[k] = s[k]*t + c[k]*u;
+        }
+    }
+
+    mNumFramesSeen += numFrames;
+}
+
+void SlidingSpectrum::CopydBMagnitudeToBuffer(float *buffer)
+{
+    CopydBMagnitudeToBuffer(buffer, mFirstBin, mLastBin);
+}
+
+void SlidingSpectrum::CopydBMagnitudeToBuffer(float *buffer, int64_t firstBin, int64_t lastBin)
+{
+    if (firstBin < mFirstBin)
+        firstBin = mFirstBin;
+    if (lastBin > mLastBin)
+        lastBin = mLastBin;
+
+    // periodic Hann window applied in the frequency domain: W_k = 0.5 X_k - 0.25 (X_k-1 + X_k+1)
+    for (int64_t k=firstBin; k <= lastBin; ++k) {
+        int64_t i = k - mFirstRawBin;
+        double wr = 0.5*mReal[i] - 0.25*(mReal[i-1] + mReal[i+1]);
+        double wi = 0.5*mImag[i] - 0.25*(mImag[i-1] + mImag[i+1]);
+        float power = (float)(wr*wr + wi*wi);
+        buffer[k] = 10.0f*log10f(power + 1e-20f) + mdBOffset;
+    }
+}
+
+void SlidingSpectrum::FillBufferOutsideBand(float *buffer, float value)
+{
+    int64_t lenBuffer = mWindowLength/2;
+    for (int64_t k=0; k < mFirstBin; ++k)
+        buffer[k] = value;
+    for (int64_t k=mLastBin+1; k < lenBuffer; ++k)
+        buffer[k] = value;
+}
+
+void SlidingSpectrum::Clear()
+{
+    memset(mReal, 0, sizeof(double)*(size_t)mNumRawBins);
+    memset(mImag, 0, sizeof(double)*(size_t)mNumRawBins);
+    memset(mHistory, 0, sizeof(float)*(size_t)mWindowLength);
+    mHistoryIndex = 0;
+    mNumFramesSeen = 0;
+}
@@ -0,0 +1,66 @@
+//
+//  SlidingSpectrum.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Band limited sliding DFT. Instead of taking a full FFT of the analysis window every hop, the bins
+//  inside the whistle band are updated once per new sample, so the cost of a hop is
+//  (new samples) x (bins in band) instead of N log N. The output uses the same dB scaling as
+//  FFTHelper copydBMagnitudeToBuffer: so it can be handed straight to the PeakFinder.
+//  Portable C++ (no Accelerate) so that it can be benchmarked off device.
+//  New samples go in blocks of up to a pipeline hop: the block's input
+//  differences go on the stack, then kSlidingBinsPerBlock bins at a time run through all of
+//  them with their state in registers, instead of every sample sweeping every bin through
+//  memory. The arithmetic per bin is the same and in the same order, so the spectrum is the
+//  same bit for bit as AddSamples, the one sample at a time update it replaced.
+
+#ifndef OpenSpirometry_SlidingSpectrum_h
+#define OpenSpirometry_SlidingSpectrum_h
+
+#include <stdint.h>
+
+#define kSlidingBinsPerBlock 16 // independent bin recursions side by side, enough to hide their latency
+
+class SlidingSpectrum {
+
+public:
+    SlidingSpectrum(int64_t windowLength, float samplingRate, float minFrequency, float maxFrequency);
+    ~SlidingSpectrum();
+
+    void AddNewFloatData(const float *newData, const int64_t numFrames);
+    void AddSamples(const float *newData, const int64_t numFrames); // one sample at a time, the reference for checks
+    void CopydBMagnitudeToBuffer(float *buffer); // only writes bins FirstBin()...LastBin() of a windowLength/2 buffer
+    void CopydBMagnitudeToBuffer(float *buffer, int64_t firstBin, int64_t lastBin); // just those bins (clipped to the band)
+    void FillBufferOutsideBand(float *buffer, float value); // call once on a buffer that will be reused every hop
+    void Clear();
+
+    int64_t FirstBin() { return mFirstBin; }
+    int64_t LastBin() { return mLastBin; }
+    int64_t WindowLength() { return mWindowLength; }
+    int64_t NumFramesSeen() { return mNumFramesSeen; }
+    float FrequencyResolution() { return mSamplingRate/(float)mWindowLength; }
+
+protected:
+    void AddBlock(const float *newData, int64_t numFrames);
+
+    int64_t mWindowLength;
+    float mSamplingRate;
+    int64_t mFirstBin;      // first bin handed to the caller
+    int64_t mLastBin;       // last bin handed to the caller
+    int64_t mFirstRawBin;   // one extra bin on each side so the Hann window can be applied in frequency
+    int64_t mNumRawBins;
+
+    double *mReal;          // running (unwindowed) DFT of the last mWindowLength samples
+    double *mImag;
+    double *mCos;           // per bin twiddle, e^(j*2*pi*k/N)
+    double *mSin;
+
+    float *mHistory;        // the last mWindowLength samples, needed to remove the oldest sample
+    int64_t mHistoryIndex;
+    int64_t mNumFramesSeen;
+    float mdBOffset;
+};
+
+#endif
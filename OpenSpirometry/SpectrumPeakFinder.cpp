@@ -0,0 +1,183 @@
+//
+//  SpectrumPeakFinder.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "SpectrumPeakFinder.h"
+
+static inline float MaxOf(float a, float b) { return a > b ? a : b; }
+
+SpectrumPeakFinder::SpectrumPeakFinder(float frequencyResolution, int64_t maxLength) :
+mFrequencyResolution(frequencyResolution),
+mMaxLength(maxLength)
+{
+    mPrefixMax = new float[maxLength];
+    mSuffixMax = new float[maxLength];
+    mLeftMax = new float[maxLength];
+    mRightMax = new float[maxLength];
+}
+
+SpectrumPeakFinder::~SpectrumPeakFinder()
+{
+    delete [] mPrefixMax;
+    delete [] mSuffixMax;
+    delete [] mLeftMax;
+    delete [] mRightMax;
+}
+
+int64_t SpectrumPeakFinder::MaxNumPeaks(int64_t length, int64_t windowSize)
+{
+    // a peak must beat every bin windowSize/2 to its left and tie or beat windowSize-windowSize/2-1 to its right
+    int64_t left = windowSize/2, right = windowSize - windowSize/2 - 1;
+    int64_t spacing = (left < right ? left : right) + 1;
+    return length/spacing + 1;
+}
+
+// output[k] = max(data[k...k+window-1]) for k = 0...length-window, about three compares per element
+// (van Herk/Gil-Werman: max within each block of window samples from the left and from the right,
+// any window spans at most two blocks). The loops have no dependencies between blocks so the
+// compiler can vectorize the combine.
+void SpectrumPeakFinder::RunningMax(const float *data, int64_t length, int64_t window, float *output)
+{
+    for (int64_t blockStart = 0; blockStart < length; blockStart += window) {
+        int64_t blockEnd = blockStart + window < length ? blockStart + window : length;
+        mPrefixMax[blockStart] = data[blockStart];
+        for (int64_t j = blockStart + 1; j < blockEnd; j++)
+            mPrefixMax[j] = MaxOf(mPrefixMax[j-1], data[j]);
+        mSuffixMax[blockEnd-1] = data[blockEnd-1];
+        for (int64_t j = blockEnd - 2; j >= blockStart; j--)
+            mSuffixMax[j] = MaxOf(mSuffixMax[j+1], data[j]);
+    }
+
+    int64_t numOutputs = length - window + 1;
+    const float *suffix = mSuffixMax;
+    const float *prefix = &mPrefixMax[window-1];
+    for (int64_t k = 0; k < numOutputs; k++)
+        output[k] = MaxOf(suffix[k], prefix[k]);
+}
+
+// Use dilation to find local max peaks (use harmonics to refine the peak estimation)
+// Using starter code from Candie Solis, Charlie Albright, and Spencer Kaiser, MSLC 2015
+int64_t SpectrumPeakFinder::GetFundamentalPeaks(const float *magBuffer, int64_t length, int64_t windowSize,
+                                                float peakMagnitude, float minimumFrequency,
+                                                SpectrumPeak *peaks, int64_t capacity, int64_t numTopPeaks)
+{
+    if (length > mMaxLength)
+        length = mMaxLength; // scratch space is only this long
+    int64_t startIndex = (int64_t)(minimumFrequency / mFrequencyResolution); // must be above X Hz
+    int64_t numCandidates = length - windowSize - startIndex; // windows that start at startIndex...length-windowSize-1
+    if (numCandidates <= 0)
+        return 0;
+
+    // The window starting at i has its first maximum at mid = i + windowSize/2 exactly when
+    // mid is larger than every bin to its left in the window and no smaller than every bin to its right.
+    int64_t numLeft = windowSize/2;
+    int64_t numRight = windowSize - numLeft - 1;
+    if (numLeft > 0)
+        RunningMax(&magBuffer[startIndex], numCandidates + numLeft - 1, numLeft, mLeftMax);
+    if (numRight > 0)
+        RunningMax(&magBuffer[startIndex + numLeft + 1], numCandidates + numRight - 1, numRight, mRightMax);
+
+    int64_t numPeaks = 0;
+    int64_t numStored = 0;
+    for (int64_t i = 0; i < numCandidates; i++) {
+        int64_t mid = startIndex + i + numLeft;
+        float value = magBuffer[mid];
+        if (!(value > peakMagnitude) ||
+            (numLeft > 0 && !(value > mLeftMax[i])) ||
+            (numRight > 0 && !(value >= mRightMax[i])))
+            continue;
+
+        float frequency = GetFrequencyFromIndex(mid, magBuffer);
+
+        // Check if harmonic multiple exists below the peak: every fundamental so far, in the order they were found
+        bool unique = true;
+        for (int64_t p = 0; p < numStored; p++) {
+            int64_t numVal = peaks[p].index; // index of peak
+            int64_t multiple = mid / numVal; // integer value of harmonic multiple
+            int64_t modulus = mid % numVal;  // num frequency bins above multiple
+            if (modulus > numVal/multiple) {
+                modulus = numVal - modulus; // num frequency bins below multiple, if closer
+                multiple++; // multiple is next harmonic up
+            }
+            float freqInHzAway = mFrequencyResolution * modulus; // deviation in Hz from harmonic
+
+            if (freqInHzAway <= mFrequencyResolution * multiple) { // scale difference by harmonic multiple
+                unique = false;
+                peaks[p].frequencySum += frequency / ((float)multiple);
+                peaks[p].numHarmonics++;
+                break;
+            }
+        }
+
+        if (unique) { // it was not a harmonic
+            if (numStored < capacity) {
+                SpectrumPeak &peak = peaks[numStored++];
+                peak.index = mid;
+                peak.frequency = frequency;
+                peak.magnitude = value;
+                peak.frequencySum = frequency;
+                peak.numHarmonics = 0;
+            }
+            numPeaks++;
+        }
+    }
+
+    // average the fundamental with its harmonics
+    for (int64_t p = 0; p < numStored; p++)
+        if (peaks[p].numHarmonics > 0)
+            peaks[p].frequency = peaks[p].frequencySum/((float)(peaks[p].numHarmonics + 1));
+
+    // top few by magnitude, kept in insertion order on ties (same as a stable sort), no sort of the rest
+    if (numTopPeaks > kMaxNumTopPeaks)
+        numTopPeaks = kMaxNumTopPeaks;
+    if (numTopPeaks > numStored)
+        numTopPeaks = numStored;
+    int64_t top[kMaxNumTopPeaks];
+    int64_t numTop = 0;
+    for (int64_t p = 0; p < numStored && numTopPeaks > 0; p++) {
+        if (numTop == numTopPeaks && !(peaks[p].magnitude > peaks[top[numTop-1]].magnitude))
+            continue;
+        int64_t position = numTop < numTopPeaks ? numTop++ : numTop - 1;
+        while (position > 0 && peaks[p].magnitude > peaks[top[position-1]].magnitude) {
+            top[position] = top[position-1];
+            position--;
+        }
+        top[position] = p;
+    }
+
+    // move the top peaks to the front: everything else slides toward the back, keeping its order
+    SpectrumPeak topPeaks[kMaxNumTopPeaks];
+    for (int64_t t = 0; t < numTop; t++)
+        topPeaks[t] = peaks[top[t]];
+    int64_t write = numStored - 1;
+    for (int64_t read = numStored - 1; read >= 0 && numTop > 0; read--) {
+        bool selected = false;
+        for (int64_t t = 0; t < numTop; t++)
+            selected = selected || top[t] == read;
+        if (!selected)
+            peaks[write--] = peaks[read];
+    }
+    for (int64_t t = 0; t < numTop; t++)
+        peaks[t] = topPeaks[t];
+
+    return numPeaks;
+}
+
+// Uses quadratic interpolation to estimate the peak frequency given an index and the array of FFT magnitude data from which it was calculated
+// Implementation by Story Zanetti, Jessica Yeh, and Jordan Kayse, MSLC 2015
+float SpectrumPeakFinder::GetFrequencyFromIndex(int64_t index, const float *data)
+{
+    if (index == 0)
+        return 0;
+
+    float f2 = index * mFrequencyResolution;
+    float m1 = data[index - 1];
+    float m2 = data[index];
+    float m3 = data[index + 1];
+
+    return (float)(f2 + ((m3 - m2) / (2.0 * m2 - m1 - m2)) * mFrequencyResolution / 2.0);
+}
@@ -0,0 +1,66 @@
+//
+//  SpectrumPeakFinder.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Allocation free replacement for PeakFinder getFundamentalPeaksFromBuffer:, same peaks and
+//  same order. The window max at every bin (O(N*W)) is replaced by two running max passes
+//  (van Herk/Gil-Werman, O(N) whatever the window), and peaks are plain structs written to an
+//  array the caller owns. Only the top few peaks by magnitude are ordered, the rest are left in
+//  any order.
+//
+//  Harmonics are matched as in PeakFinder: each peak that passes the dilation is tested against
+//  every fundamental stored so far, O(peaks x fundamentals). Both are few once the dilation has
+//  thinned the spectrum, and a lookup of harmonic bins filled in as each fundamental is found
+//  gives the same peaks but is slower on the whistle spectra, since a low fundamental claims
+//  thousands of bins to save a handful of tests.
+
+#ifndef OpenSpirometry_SpectrumPeakFinder_h
+#define OpenSpirometry_SpectrumPeakFinder_h
+
+#include <stdint.h>
+
+#define kMaxNumTopPeaks 8
+
+struct SpectrumPeak {
+    int64_t index;
+    float frequency;        // refined with the harmonics once the scan is done
+    float magnitude;
+    float frequencySum;     // own frequency plus harmonic frequency/multiple, in the order found
+    int32_t numHarmonics;
+};
+
+class SpectrumPeakFinder {
+
+public:
+    // maxLength is the longest magnitude buffer that will be searched (longer ones are cut to it)
+    SpectrumPeakFinder(float frequencyResolution, int64_t maxLength);
+    ~SpectrumPeakFinder();
+
+    // Writes the fundamentals to peaks, the numTopPeaks largest first in descending magnitude
+    // (ties keep spectrum order, like the stable sort in PeakFinder). Returns the number of
+    // fundamentals found; if that is more than capacity the extra ones are counted but not kept,
+    // which can only happen when capacity is below MaxNumPeaks().
+    int64_t GetFundamentalPeaks(const float *magBuffer, int64_t length, int64_t windowSize,
+                                float peakMagnitude, float minimumFrequency,
+                                SpectrumPeak *peaks, int64_t capacity, int64_t numTopPeaks);
+    float GetFrequencyFromIndex(int64_t index, const float *data);
+    float FrequencyResolution() { return mFrequencyResolution; }
+
+    // local maxima are at least this far apart, so this many peaks always fit
+    static int64_t MaxNumPeaks(int64_t length, int64_t windowSize);
+
+protected:
+    void RunningMax(const float *data, int64_t length, int64_t window, float *output);
+
+    float mFrequencyResolution;
+    int64_t mMaxLength;
+    float *mPrefixMax;      // scratch for the running max
+    float *mSuffixMax;
+    float *mLeftMax;        // max of the bins left of each candidate (must be strictly smaller)
+    float *mRightMax;       // max of the bins right of each candidate (can be equal)
+};
+
+#endif
@@ -9,10 +9,30 @@
 #ifndef OpenSpirometry_SpirometerConstants_h
 #define OpenSpirometry_SpirometerConstants_h
 
+#ifndef __OBJC__
+#include <stddef.h>
+typedef size_t NSUInteger; // lets the portable C++ files share these constants
+#endif
+
 #define BUFFER_SIZE         44100
-#define BUFFER_OVERLAP      BUFFER_SIZE-BUFFER_SIZE/200 // overlap, readings per second = Fs/BUFFER_SIZE * divisor
-#define PEAK_WINDOW_SIZE    BUFFER_SIZE/1000 // num frequency bins to search over for local maxima
+#define BUFFER_OVERLAP      (BUFFER_SIZE-BUFFER_SIZE/200) // overlap, readings per second = Fs/BUFFER_SIZE * divisor
+#define PEAK_WINDOW_SIZE    (BUFFER_SIZE/1000) // num frequency bins to search over for local maxima
 #define TIME_OUT_WAIT_FOR_TEST_START 10
+#define MAX_ANALYSIS_LAG_IN_SECONDS 0.5     // most audio allowed to wait for analysis before windows are skipped (see AnalysisBacklog.h)
+#ifndef MEASURE_LATENCY
+#define MEASURE_LATENCY 0                   // time each window from audio callback to flow update (see LatencyMonitor.h), on in Debug and bench builds
+#endif
+#define LATENCY_BUDGET_IN_SECONDS 0.1       // flow updates delivered later than this after their callback count as late
+#define USE_FUNDAMENTAL_TRACKER 1           // follow the whistle fundamental and only search near its prediction (see FundamentalTracker.h)
+#define USE_MULTIRESOLUTION_ANALYSIS 1      // short windows for the blast and peak, the long window on the tail (see ShortWindowEstimator.h)
+#define SHORT_WINDOW_SIZE   2048            // samples in a short window (46 ms at 44.1 kHz)
+#define MULTIRES_TAIL_FRACTION_OF_PEAK 0.7  // long windows once the flow falls below this fraction of its peak
+#define CHANNEL_SCORE_WINDOW_SIZE 1024     // newest samples of each microphone scored per window to pick the one analyzed
+#define CHANNEL_SWITCH_MARGIN_DB 3.0f      // another microphone has to be this much clearer to take over
+#define CHANNEL_MIN_SCORE_DB 10.0f         // and clear at all: its band peak this far above the band's median
+#define USE_ARTIFACT_DETECTOR 1            // classify each window (whistle, cough, voice, noise) and skip the peak search without a tone in the band, unless it is noise while the whistle is still found (see EffortSession.h)
+#define ARTIFACT_WINDOW_SIZE 1024          // newest samples of each window the artifact features are computed over
+#define NOISE_TAIL_MIN_PEAK_OVER_FLOOR_DB 12.0f // a noise window extends the effort only with a peak this far over the band's median (room peaks reach about 10 dB in a long window)
 
 
 // All these need calibration (SPIRO: needs calibration)
@@ -21,12 +41,21 @@
 #define TEST_END_THRESH     1.01            // audio threshold to signal test is ending, not sure what this should be, maybe close to 1
 #define PEAK_DBMAG_START      -2.5           // frequency magnitude for whistle peak (in dB)
 #define PEAK_DBMAG_SUSTAINED  -20           // hysteresis magnitude once triggered
-#define NUM_PEAKS_IS_COUGH  40               // hopefully whistle has a single fundamental
+#define NUM_PEAKS_IS_COUGH  40               // hopefully whistle has a single fundamental (cough check without USE_ARTIFACT_DETECTOR)
 #define WAIT_DURATION_AFTER_PEAK 1          // time after large audio sound before saying the test is ending
 #define WAIT_DURATION_AFTER_TEST 3          // in seconds, time after large audio to end the test
 #define MIN_FREQUENCY_OF_WHISTLE_IN_HZ 60   // smallest detectable frquency we want
+#define MAX_FREQUENCY_OF_WHISTLE_IN_HZ 1200 // largest frequency we want (~12 L/s on the Sato whistle)
+#define MIN_FLOW_OF_WHISTLE_IN_LPS 0        // flow range a band limited whistle is analyzed over
+#define MAX_FLOW_OF_WHISTLE_IN_LPS 12
+#define MAX_FLOW_SLEW_IN_LPS_PER_SECOND 100 // fastest a forced exhalation changes flow (0 to peak in under 0.1 s), bounds the tracker search
+#define SPECTRUM_FLOOR_DB -200              // value for bins that are not computed, never counted as a peak
 #define NUM_SAMPLES_BACK_FROM_PEAKFLOW_TO_INTERPOLATE 30 // number of samples to start the search for breaking monotnic values from the whistle
 #define TEST_MAX_DURATION_SECONDS 10
+#define PLATEAU_VOLUME_CHANGE_IN_LITERS 0.025 // live FVC has plateaued when volume grows less than this...
+#define PLATEAU_DURATION_IN_SECONDS 1         // ...over this long (ATS/ERS end of test)
+#define MAX_BACK_EXTRAPOLATED_VOLUME_IN_LITERS 0.1   // acceptable start: BEV below the larger of these
+#define MAX_BACK_EXTRAPOLATED_VOLUME_FRACTION 0.05   // (fraction of FVC)
 
 
 //define stages for our test
@@ -41,4 +70,11 @@ typedef enum : NSUInteger {
     SpirometryStageIsAnalyzingResults,
 } SpirometryStage;
 
+// what the analysis does when it falls more than MAX_ANALYSIS_LAG_IN_SECONDS behind the audio
+typedef enum : NSUInteger {
+    AnalysisBacklogDropOldest,  // skip the oldest waiting windows, keep the rest
+    AnalysisBacklogCoalesce,    // skip straight to the newest window
+    AnalysisBacklogDegradeHop,  // analyze every k-th window until caught up
+} AnalysisBacklogPolicy;
+
 #endif
@@ -8,7 +8,6 @@
 
 #import <Foundation/Foundation.h>
 #import <UIKit/UIKit.h>
-#import "BufferedOverlapQueue.h"
 #import "SpirometerConstants.h"
 #import "SpirometryWhistle.h"
 
@@ -17,28 +16,50 @@
 -(void)didFinishCalibratingSilence;
 -(void)didTimeoutWaitingForTestToStart;
 -(void)didStartExhaling;
--(void)willEndTestSoon;
+-(void)willEndTestSoon; // each time the sound drops near the end, not every buffer while it stays down
 -(void)didCancelEffort;
 -(void)didEndEffortWithResults:(NSDictionary*)results;
 -(void)didUpdateFlow:(float)flowInLitersPerSecond andVolume:(float)volumeInLiters;
+-(void)didUpdateFlow:(float)flowInLitersPerSecond andVolume:(float)volumeInLiters withConfidence:(float)confidence; // 0 to 1, -1 without USE_FUNDAMENTAL_TRACKER
+-(void)didUpdateLiveMetrics:(NSDictionary*)metrics; // provisional PEF/FEV1/FVC with every flow update, see FlowVolumeDataAnalyzer liveMetrics
 -(void)didUpdateAudioBufferWithMaximum:(float)maxAudioValue;
 @end
 
 
-@interface SpirometerEffortAnalyzer : NSObject <DataBufferProcessDelegate>
+@interface SpirometerEffortAnalyzer : NSObject
 
 @property (nonatomic, weak) id <SpirometerEffortDelegate> delegate;
 @property (nonatomic) SpirometryStage currentStage;
 @property (strong, nonatomic) SpirometryWhistle* whistle;
-@property (nonatomic) float prefferredAudioMaxUpdateIntervalInSeconds;
+@property (nonatomic) float prefferredAudioMaxUpdateIntervalInSeconds; // in seconds of audio, takes effect from the next effort
+@property (nonatomic) AnalysisBacklogPolicy analysisBacklogPolicy; // when analysis falls behind the audio, default drop oldest
+@property (nonatomic) double latencyLogIntervalInSeconds; // log the latency report this often, 0 (default) for never
 
 
 -(void)beginListeningForEffort;
 -(void)askPermissionToUseAudioIfNotDone;
 -(void)requestThatCurrentEffortShouldCancel;
 -(void)requestThatEffortShouldEnd;
+// replaces the microphone: a path to an .effort recording or WAV file is replayed in real time from a
+// memory map (and analyzed at the rate in its header, so it does not start the audio session), any
+// other name is an m4a in the app bundle played by Novocaine
 -(void)activateDebugAudioModeWithWAVFile:(NSString*)filenameAndPath;
+// from the next effort, saves each effort's audio losslessly with its stage markers as <unix time>.effort
+// in the documents directory (see EffortRecorder for the format and EffortRecorder::ReadFile to read it back)
 -(void)shouldSaveSeparateEffortsToDocumentDirectory:(BOOL)should;
+// from the next effort, appends each finished effort's results to the EffortStore file at path (made if it is not there)
+// under the patient, session and whistle given, nil path to stop; NO if the file is not a store
+-(BOOL)storeEffortsAtPath:(NSString*)path forPatient:(int64_t)patient inSession:(int64_t)session withWhistle:(int32_t)whistle;
+// best PEF, FEV1 and FVC of the acceptable stored efforts of the session, their repeatability and the best effort
+// (see EffortStore.h), empty until an effort of the session is stored
+-(NSDictionary*)summaryOfStoredSession;
+// slope of the patient's session bests per year over every stored session, empty without any
+-(NSDictionary*)trendOfStoredPatient;
+// windows analyzed/skipped, samples dropped, queue depth and lag (now and max) for the current effort, any thread
+-(NSDictionary*)analysisLoadStatistics;
+// time from audio callback to flow update per stage (count, mean, percentiles and max in ms), queue depth,
+// windows analyzed, dropped, delivered and late for the current effort, any thread (empty unless MEASURE_LATENCY)
+-(NSDictionary*)latencyStatistics;
 
 //-(void)requestEndEffortInSeconds:(int)seconds;
 
@@ -0,0 +1,1015 @@
+//
+//  SpirometerAnalyzer.m
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+// TODO: save flow rate
+// TODO: calculate volume from analyzer (separate model)
+// TODO: provide end of effort analytics (separate model): cough, bad start, not long enough, insufficient effort
+// TODO: enable custom whistles through some mechanism for setting the whistle (use UI Delegate for presenting settings)
+// TODO: whistle frequency converter (should be stored in this model, most likely)
+// TODO: extrapolate tail (don't want this--can the whistle be made better to get the lower range? How Low?)
+
+#import "SpirometerEffortAnalyzer.h"
+#import "Novocaine.h"
+#import "FlowVolumeDataAnalyzer.h"
+#include "EffortSession.h"
+#include "OverlapFramer.h"
+#include "AnalysisBacklog.h"
+#include "LatencyMonitor.h"
+#include "EffortRecorder.h"
+#include "EffortFileReader.h"
+#include "EffortStageTracker.h"
+#include "EffortStore.h"
+#include "FlowUpdateQueue.h"
+
+@interface SpirometerEffortAnalyzer()
+
+@property (strong, nonatomic) Novocaine* audioManager;
+@property (nonatomic) OverlapFramer *overlapFramer; // audio thread writes samples once, analysis reads overlapped windows
+@property (strong, nonatomic) dispatch_queue_t analysisQueue; // serial, so windows are analyzed in order
+@property (strong, nonatomic) dispatch_source_t framesReadySource; // coalesced wake up from the audio thread
+@property (nonatomic) AnalysisBacklog *analysisBacklog; // hands windows to the analysis queue, skips some if it falls behind
+@property (nonatomic) LatencyMonitor *latencyMonitor; // stage times from audio callback to flow update, null unless MEASURE_LATENCY
+@property (strong, nonatomic) dispatch_source_t latencyLogTimer; // logs the latency report every latencyLogIntervalInSeconds
+@property (nonatomic) EffortRecorder *effortRecorder; // lossless copy of each effort's audio, null until saving is asked for
+@property (nonatomic) EffortStageTracker *stageTracker; // stage machine run on the audio thread, queues only the changes
+@property (strong, nonatomic) dispatch_source_t stageEventSource; // coalesced wake up of the main queue when a change is queued
+@property (nonatomic) FlowUpdateQueue *flowUpdates; // analysis queue pushes, main queue hands them to the delegate
+@property (strong, nonatomic) dispatch_source_t flowUpdateSource; // coalesced wake up of the main queue when updates are queued
+@property (strong, nonatomic) dispatch_queue_t recorderQueue; // serial, finishes one recording before the next starts
+@property (nonatomic) EffortFileReader *debugFileReader; // replaces the microphone when the debug file is a recording or WAV on disk
+@property (strong, nonatomic) dispatch_queue_t replayQueue; // serial, one replay at a time
+@property (atomic) NSUInteger replayGeneration; // bumped every effort, so an older replay stops
+@property (nonatomic) double analysisSamplingRate; // of the microphone, or of the debug file while one is replayed
+@property (nonatomic) EffortSession *session; // the analysis of each window, made for each effort's whistle, analysis queue only
+@property (strong, nonatomic) FlowVolumeDataAnalyzer *fvAnalyzer; // results of the session's curve
+@property (nonatomic) EffortStore *effortStore; // finished efforts are appended to it, null unless asked for, analysis queue only
+@property (nonatomic) EffortKey storeKey; // patient, session and whistle the efforts are stored under
+@property (atomic) NSUInteger numCapturedChannels; // in the newest callback, at most kMaxNumFramerChannels reach the framer
+@property (atomic) NSUInteger selectedChannel; // set by the analysis, the audio thread takes the stage level from it
+
+@property (atomic) BOOL isShuttingDown;
+@property (atomic) NSUInteger numBlocksProcessed;
+@property (atomic) NSUInteger numProcessedSamples;
+
+@property (nonatomic) BOOL audioDebugIsActive;
+@property (nonatomic) BOOL shouldSaveEffortsToDocumentDirectory;
+@property (nonatomic, strong) NSString *audioDebugFileName;
+
+-(void)addNewAudioData:(const float*)data numFrames:(UInt32)numFrames numChannels:(UInt32)numChannels;
+-(void)handleStageEvents;
+
+@end
+
+// hands a debug file replay to the analyzer the way the microphone callback does
+class AnalyzerReplaySink : public EffortSpanSink {
+
+public:
+    AnalyzerReplaySink(SpirometerEffortAnalyzer *analyzer, NSUInteger generation) : mAnalyzer(analyzer), mGeneration(generation) {}
+
+    virtual bool AddSpan(const EffortSpan &span) {
+        SpirometerEffortAnalyzer *analyzer = mAnalyzer;
+        if(analyzer == nil || analyzer.isShuttingDown || analyzer.replayGeneration != mGeneration){
+            return false; // the effort ended or a new one started
+        }
+        [analyzer addNewAudioData:span.samples numFrames:(UInt32)span.numFrames numChannels:(UInt32)span.numChannels];
+        return true;
+    }
+
+protected:
+    __weak SpirometerEffortAnalyzer *mAnalyzer;
+    NSUInteger mGeneration;
+};
+
+
+@implementation SpirometerEffortAnalyzer{
+    struct {
+        unsigned int didFinishCalibratingSilence:1;
+        unsigned int didTimeoutWaitingForTestToStart:1;
+        unsigned int didStartExhaling:1;
+        unsigned int willEndTestSoon:1;
+        unsigned int didCancelEffort:1;
+        unsigned int didEndEffortWithResults:1;
+        unsigned int didUpdateFlowAndVolume:1;
+        unsigned int didUpdateFlowAndVolumeWithConfidence:1;
+        unsigned int didUpdateLiveMetrics:1;
+        unsigned int didUpdateAudioBufferWithMaximum:1;
+    } delegateRespondsTo;
+}
+
+- (void)setDelegate:(id <SpirometerEffortDelegate>)aDelegate {
+    if (_delegate != aDelegate) {
+        _delegate = aDelegate;
+        delegateRespondsTo.didFinishCalibratingSilence = [_delegate respondsToSelector:@selector(didFinishCalibratingSilence)];
+        delegateRespondsTo.didTimeoutWaitingForTestToStart = [_delegate respondsToSelector:@selector(didTimeoutWaitingForTestToStart)];
+        delegateRespondsTo.didStartExhaling = [_delegate respondsToSelector:@selector(didStartExhaling)];
+        delegateRespondsTo.willEndTestSoon = [_delegate respondsToSelector:@selector(willEndTestSoon)];
+        delegateRespondsTo.didCancelEffort = [_delegate respondsToSelector:@selector(didCancelEffort)];
+        delegateRespondsTo.didEndEffortWithResults = [_delegate respondsToSelector:@selector(didEndEffortWithResults:)];
+        delegateRespondsTo.didUpdateFlowAndVolume = [_delegate respondsToSelector:@selector(didUpdateFlow:andVolume:)];
+        delegateRespondsTo.didUpdateFlowAndVolumeWithConfidence = [_delegate respondsToSelector:@selector(didUpdateFlow:andVolume:withConfidence:)];
+        delegateRespondsTo.didUpdateLiveMetrics = [_delegate respondsToSelector:@selector(didUpdateLiveMetrics:)];
+        delegateRespondsTo.didUpdateAudioBufferWithMaximum = [_delegate respondsToSelector:@selector(didUpdateAudioBufferWithMaximum:)];
+    }
+}
+
+//=============================================================================================================
+#pragma mark Lazy Instantiation
+-(Novocaine*)audioManager{
+    if(!_audioManager){
+        _audioManager = [Novocaine audioManager];
+        
+        
+        if(_audioDebugIsActive && !_debugFileReader){
+            [_audioManager overrideMicrophoneWithAudioFile:_audioDebugFileName];
+        }
+    }
+    return _audioManager;
+}
+
+// the backlog and stages count in samples of the audio analyzed, remade when an effort's rate differs from the last
+// (a replayed file is analyzed at its own rate, so replaying never starts Novocaine or asks for the microphone)
+-(void)prepareAnalysisAtSamplingRate:(double)samplingRate{
+    if(_stageTracker && _analysisBacklog && self.analysisSamplingRate == samplingRate){
+        return;
+    }
+    self.analysisSamplingRate = samplingRate;
+    
+    // bound the backlog in windows from the allowed lag
+    int64_t maxBacklog = (int64_t)(MAX_ANALYSIS_LAG_IN_SECONDS*samplingRate/(BUFFER_SIZE-(BUFFER_OVERLAP)));
+    AnalysisBacklog *backlog = new AnalysisBacklog(_overlapFramer, samplingRate, maxBacklog, _analysisBacklogPolicy);
+    EffortStageTracker *tracker = new EffortStageTracker(samplingRate);
+    
+    // swapped with both queues that use them drained, the replay adds to the tracker and every window reads
+    // its stage (the microphone is paused, stage events are only read on this queue, the replay never waits on analysis)
+    dispatch_sync(self.analysisQueue, ^{
+        dispatch_sync(self.replayQueue, ^{
+            if(_stageTracker){
+                delete _stageTracker;
+            }
+            _stageTracker = tracker;
+        });
+        if(_analysisBacklog){
+            delete _analysisBacklog;
+        }
+        _analysisBacklog = backlog;
+    });
+}
+
+// the portable model of the whistle's current terms, Sato's if it has none (its flows would all be -1)
+-(WhistleModel)modelOfWhistle:(SpirometryWhistle*)whistle{
+    float bias = [whistle calcFlowInLiterPerSecondFromFrequencyInHz:0];
+    float coefficient = [whistle calcFlowInLiterPerSecondFromFrequencyInHz:1] - bias;
+    if(!(coefficient > 0)){
+        return WhistleModel();
+    }
+    return WhistleModel(coefficient, bias, whistle.useBandLimitedSpectrum);
+}
+
+-(void)setAnalysisBacklogPolicy:(AnalysisBacklogPolicy)analysisBacklogPolicy{
+    _analysisBacklogPolicy = analysisBacklogPolicy;
+    if(_analysisBacklog){
+        _analysisBacklog->SetPolicy(analysisBacklogPolicy); // picked up by the next window
+    }
+}
+
+-(void)setLatencyLogIntervalInSeconds:(double)latencyLogIntervalInSeconds{
+    _latencyLogIntervalInSeconds = latencyLogIntervalInSeconds;
+    if(_latencyLogTimer){
+        dispatch_source_cancel(_latencyLogTimer);
+        _latencyLogTimer = nil;
+    }
+    if(!_latencyMonitor || latencyLogIntervalInSeconds <= 0){
+        return;
+    }
+    
+    // snapshots are lock free, so the log never holds up the audio or the analysis
+    LatencyMonitor *monitor = _latencyMonitor;
+    uint64_t interval = (uint64_t)(latencyLogIntervalInSeconds*NSEC_PER_SEC);
+    _latencyLogTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+    dispatch_source_set_timer(_latencyLogTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval/10);
+    dispatch_source_set_event_handler(_latencyLogTimer, ^{
+        LatencyReport report;
+        monitor->Snapshot(&report);
+        NSLog(@"Spirometer latency\n%s", LatencyMonitor::FormatReport(report).c_str());
+    });
+    dispatch_resume(_latencyLogTimer);
+}
+
+//=============================================================================================================
+#pragma mark Init/Dealloc
+// set up as singleton class
++ (SpirometerEffortAnalyzer *) spirometerAnalyzer
+{
+    static SpirometerEffortAnalyzer * _sharedInstance = nil;
+    
+    static dispatch_once_t oncePredicate;
+    
+    dispatch_once(&oncePredicate,^{
+        _sharedInstance = [[SpirometerEffortAnalyzer alloc] init];
+    });
+    
+    return _sharedInstance;
+}
+
+-(id)init{
+    
+    if(self = [super init]){
+        [self setup];
+        return self;
+    }
+    return nil;
+}
+
+-(void)dealloc{
+    if(_audioManager){
+        [_audioManager setInputBlock:nil];
+        [_audioManager teardownAudio];
+    }
+    if(_framesReadySource){
+        dispatch_source_cancel(_framesReadySource);
+    }
+    if(_stageEventSource){
+        dispatch_source_cancel(_stageEventSource);
+    }
+    if(_flowUpdateSource){
+        dispatch_source_cancel(_flowUpdateSource);
+    }
+    if(_latencyLogTimer){
+        dispatch_source_cancel(_latencyLogTimer);
+    }
+    if(_debugFileReader){
+        self.replayGeneration++; // the replay stops at its next span (this object is gone for it anyway)
+        EffortFileReader *reader = _debugFileReader;
+        dispatch_sync(_replayQueue, ^{
+            delete reader;
+        });
+        _debugFileReader = nil;
+    }
+    if(_effortRecorder){
+        EffortRecorder *recorder = _effortRecorder;
+        dispatch_sync(_recorderQueue, ^{
+            delete recorder; // after any recording still being finished, closes one still open
+        });
+        _effortRecorder = nil;
+    }
+    if(_stageTracker){
+        delete _stageTracker; // the replay and the audio are stopped by now
+        _stageTracker = nil;
+    }
+    if(_analysisBacklog){
+        delete _analysisBacklog;
+        _analysisBacklog = nil;
+    }
+    if(_overlapFramer){
+        delete _overlapFramer;
+        _overlapFramer = nil;
+    }
+    if(_latencyMonitor){
+        delete _latencyMonitor;
+        _latencyMonitor = nil;
+    }
+    _fvAnalyzer = nil; // before the session whose curve it reads
+    if(_session){
+        delete _session;
+        _session = nil;
+    }
+    if(_effortStore){
+        delete _effortStore; // writes what is still buffered
+        _effortStore = nil;
+    }
+    if(_flowUpdates){
+        delete _flowUpdates; // the source is cancelled and the analysis is done with this object
+        _flowUpdates = nil;
+    }
+}
+
+-(void) safeFree:(float **) var{
+    // don't want to use c++ here for passing by reference so instead we will use double indirection
+    if(*var){
+        free(*var);
+    }
+    *var = nil;
+}
+
+-(void) setup{
+    
+    // instantiate in init
+    // ring holds a few windows so the callback never waits on the analysis,
+    // one per microphone since the input may turn out to have more than one
+    _overlapFramer = new OverlapFramer(BUFFER_SIZE, BUFFER_SIZE-(BUFFER_OVERLAP), 4*BUFFER_SIZE, 1, kMaxNumFramerChannels);
+#if MEASURE_LATENCY
+    _latencyMonitor = new LatencyMonitor(BUFFER_SIZE, BUFFER_SIZE-(BUFFER_OVERLAP), LATENCY_BUDGET_IN_SECONDS);
+#endif
+    _latencyLogIntervalInSeconds = 0;
+    _recorderQueue = dispatch_queue_create("edu.smu.OpenSpirometry.recorder", DISPATCH_QUEUE_SERIAL);
+    _replayQueue = dispatch_queue_create("edu.smu.OpenSpirometry.replay", DISPATCH_QUEUE_SERIAL);
+    
+    _analysisQueue = dispatch_queue_create("edu.smu.OpenSpirometry.analysis", DISPATCH_QUEUE_SERIAL);
+    dispatch_set_target_queue(_analysisQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+    
+    // the audio thread only merges a count into this source (no allocation, no lock),
+    // the handler then analyzes every window that is ready
+    __block SpirometerEffortAnalyzer * __weak weakSelf = self;
+    _framesReadySource = dispatch_source_create(DISPATCH_SOURCE_TYPE_DATA_ADD, 0, 0, _analysisQueue);
+    dispatch_source_set_event_handler(_framesReadySource, ^{
+        [weakSelf processAvailableFramesAllowingSkips:YES];
+    });
+    dispatch_resume(_framesReadySource);
+    
+    // same for stage changes, the main queue only wakes up when the stage or the level meter has news
+    _stageEventSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_DATA_ADD, 0, 0, dispatch_get_main_queue());
+    dispatch_source_set_event_handler(_stageEventSource, ^{
+        [weakSelf handleStageEvents];
+    });
+    dispatch_resume(_stageEventSource);
+    
+    // and for flow updates, queued in a fixed ring instead of a block copied for every window
+    _flowUpdates = new FlowUpdateQueue();
+    _flowUpdateSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_DATA_ADD, 0, 0, dispatch_get_main_queue());
+    dispatch_source_set_event_handler(_flowUpdateSource, ^{
+        [weakSelf handleFlowUpdates];
+    });
+    dispatch_resume(_flowUpdateSource);
+    
+    _analysisBacklogPolicy = AnalysisBacklogDropOldest;
+    
+    _isShuttingDown = NO;
+    _numBlocksProcessed = 0;
+    _numProcessedSamples = 0;
+    _currentStage = SpirometryStageIsIdle;
+    _prefferredAudioMaxUpdateIntervalInSeconds = 1.0/30.0; // 30FPS default
+    _audioDebugIsActive = NO;
+    _audioDebugFileName = nil;
+    _shouldSaveEffortsToDocumentDirectory = NO;
+    
+    _whistle = [[SpirometryWhistle alloc]init]; // whistle is set to default params (Sato Whistle)
+    
+    _fvAnalyzer = [[FlowVolumeDataAnalyzer alloc] init]; // until the first effort's session
+    
+}
+
+//=============================================================================================================
+#pragma mark Permission
+// return if successful
+-(void)askPermissionToUseAudioIfNotDone{
+    if(![self delegateCanPresentUI]){return;}
+    
+    if(self.currentStage == SpirometryStageIsIdle){
+        //display alert if permissions not set
+        //      maybe get text for alert from use or provide default
+        
+        enum AVAudioSessionRecordPermission auth = [Novocaine checkAudioAuthorization];
+
+        //BOOL shouldInformUserDeviceIsRestricted = NO; // No support for this yet in AVAudioSession
+        switch (auth) {
+            case AVAudioSessionRecordPermissionGranted:
+            {
+                // nothing to do, audio can be setup now without prompting
+                [self setupAudio];
+            }
+                break;
+            case AVAudioSessionRecordPermissionDenied:
+            {
+                //we have been denied in the past
+                [self informUserToChangeRecordingSettings];
+            }
+                break;
+            case AVAudioSessionRecordPermissionUndetermined:
+                // ask for access twice, once where we explain the process, then with iOS
+                [self explainRecordingPermissions];
+                break;
+            //case Restricted: // No support for this yet in AVAudioSession yet
+                //shouldInformUserDeviceIsRestricted = YES;
+        }
+    }
+}
+
+-(BOOL)delegateCanPresentUI{
+    if(!self.delegate){return NO;} // if no delegate, no UI. sorry
+    if(![self.delegate isKindOfClass:[UIViewController class]]){return NO;} // not a UIcontroller, can't do this, sorry
+    return YES;
+}
+
+-(void)informUserToChangeRecordingSettings{
+    UIAlertController* alert = [UIAlertController alertControllerWithTitle:@"Microphone Access Denied Previously"
+                                                                   message:@"To perform a spirometry test, you will need to allow this app access to record audio.\n\n To allow access: \n1. Close this app. \n2.Open settings from the home screen.\n3. Find and Click on this app. \n4. Change the privacy to \"Allow\". "
+                                                            preferredStyle:UIAlertControllerStyleActionSheet];
+    
+    UIAlertAction* defaultAction = [UIAlertAction actionWithTitle:@"OK" style:UIAlertActionStyleDefault
+                                                          handler:^(UIAlertAction * action) {
+                                                          }];
+    //TODO: add a "settings" button for easy launch
+    
+    [alert addAction:defaultAction];
+    [(UIViewController*)self.delegate presentViewController:alert animated:YES completion:nil];
+}
+
+-(void)explainRecordingPermissions{
+    if([self delegateCanPresentUI]){
+        UIAlertController* alert = [UIAlertController alertControllerWithTitle:@"Need Microphone Access"
+                                                                       message:@"To perform a spirometry test, you will need to allow this app recording access in order to listen to the sound of the test. \n\nRecording will only occur during the test and will never be saved."
+                                                                preferredStyle:UIAlertControllerStyleActionSheet];
+        
+        UIAlertAction* defaultAction = [UIAlertAction actionWithTitle:@"Allow" style:UIAlertActionStyleDefault
+                                                              handler:^(UIAlertAction * action) {
+                                                                  NSLog(@"User wants to attain access.");
+                                                                  [self setupAudio];
+                                                              }];
+        
+        UIAlertAction* refuseAction = [UIAlertAction actionWithTitle:@"Ask Later" style:UIAlertActionStyleCancel
+                                                             handler:^(UIAlertAction * action) {
+                                                                 NSLog(@"User will wait to allow access");
+                                                             }];
+        
+        [alert addAction:defaultAction];
+        [alert addAction:refuseAction];
+        [(UIViewController*)self.delegate presentViewController:alert animated:YES completion:nil];
+    }
+}
+
+-(void)askForRecordingPermission{
+    [[AVAudioSession sharedInstance] requestRecordPermission:^(BOOL granted) {
+        if (granted) {
+            NSLog(@"Recording Permission Granted through Prompt");
+            [self setupAudio];
+        } else {
+            NSLog(@"Recording Permission Denied through Prompt");
+        }
+    }];
+}
+
+//=============================================================================================================
+#pragma mark Analyze Audio Methods
+
+-(void)setupAudio{
+    [self.audioManager setInputBlock:nil];
+    [self.audioManager pause];
+    
+    self.currentStage = SpirometryStageIsIdle;
+    
+}
+
+-(void)resetEffort{
+    self.numBlocksProcessed = 0;
+    self.numProcessedSamples = 0;
+    
+    // stages restart every effort, cleared on the replay queue so an older replay is not adding to it
+    // (the microphone is paused and the stage events are only read on this queue)
+    EffortStageTracker *tracker = self.stageTracker;
+    double levelInterval = delegateRespondsTo.didUpdateAudioBufferWithMaximum ? self.prefferredAudioMaxUpdateIntervalInSeconds : 0;
+    dispatch_sync(self.replayQueue, ^{
+        tracker->Clear();
+        tracker->SetLevelInterval(levelInterval);
+    });
+    self.isShuttingDown = NO;
+    
+    // clear on the analysis queue so nothing is reading windows while we do
+    OverlapFramer *framer = self.overlapFramer;
+    LatencyMonitor *monitor = self.latencyMonitor;
+    // whistle may have changed since the last effort, the spectrum, tracker, detector and curve are per effort
+    EffortSession *session = new EffortSession(self.analysisSamplingRate, [self modelOfWhistle:self.whistle]);
+    FlowVolumeDataAnalyzer *fvAnalyzer = [[FlowVolumeDataAnalyzer alloc] initWithCurve:&session->Curve()];
+    AnalysisBacklog *backlog = self.analysisBacklog;
+    FlowUpdateQueue *updates = self.flowUpdates;
+    dispatch_sync(self.analysisQueue, ^{
+        framer->Clear(); // stream positions restart every effort
+        if(backlog){
+            backlog->Clear(); // metrics are per effort
+        }
+        if(monitor){
+            monitor->Clear(); // so are the latencies (the audio is stopped and deliveries are on this thread's queue)
+        }
+        updates->Clear(); // the last effort's updates that were never delivered (this is the consuming queue)
+        self.fvAnalyzer = fvAnalyzer; // before the session whose curve the old one reads goes
+        if(_session){
+            delete _session;
+        }
+        _session = session;
+        self.selectedChannel = 0; // first microphone again until another is clearly better
+    });
+}
+
+
+-(void)beginListeningForEffort{
+    self.replayGeneration++; // any older replay stops at its next span
+    if(self.debugFileReader){
+        [self prepareAnalysisAtSamplingRate:self.debugFileReader->SamplingRate()]; // from the file's header
+    }
+    else{
+        [self prepareAnalysisAtSamplingRate:self.audioManager.samplingRate];
+    }
+    [self resetEffort];
+    [self startRecordingEffort]; // before the first stage so it gets a marker
+    
+    self.currentStage = SpirometryStageIsCalibratingSilence;
+    
+    if(self.debugFileReader){
+        [self replayDebugFile];
+        return;
+    }
+    
+    // audio instantiated here if neccessary (will generate microphone ask if not set)
+    // grab non-reference count adding handle to ourselves
+    __block SpirometerEffortAnalyzer * __weak  weakSelf = self;
+    [self.audioManager setInputBlock:^(float *data, UInt32 numFrames, UInt32 numChannels)
+     {
+         [weakSelf addNewAudioData:data numFrames:numFrames numChannels:numChannels];
+     }];
+    
+    [self.audioManager play];
+}
+
+-(void)addNewAudioData:(const float*)data numFrames:(UInt32)numFrames numChannels:(UInt32)numChannels{
+    // audio thread (or the replay queue)
+    // add data to the ring buffer (interleaved in case iOS upgrades microphone or test is over airplay)
+    if(!self.isShuttingDown){
+        LatencyMonitor *monitor = self.latencyMonitor;
+        int64_t callbackTime = monitor ? LatencyMonitor::Now() : 0;
+        
+        // split every microphone into its ring and wake up the analysis
+        OverlapFramer *framer = self.overlapFramer;
+        framer->AddNewInterleavedFloatData(data, numFrames, numChannels);
+        self.numCapturedChannels = numChannels;
+        if(monitor){
+            monitor->RecordCallback(callbackTime, framer->NumSamplesWritten());
+        }
+        
+        // lossless copy for the documents directory, the writer thread does the file work
+        EffortRecorder *recorder = self.effortRecorder;
+        if(recorder && recorder->NumChannels() == (int)numChannels){
+            recorder->AddNewInterleavedFloatData(data, numFrames);
+        }
+        dispatch_source_merge_data(self.framesReadySource, 1);
+        
+        // get max of this buffer stream, on the microphone being analyzed
+        float maxValue;
+        NSUInteger channel = self.selectedChannel < numChannels ? self.selectedChannel : 0;
+        vDSP_maxv(&data[channel], numChannels, &maxValue, numFrames);
+        
+        // stages are analyzed right here (counting samples, no clock), the main queue only hears about changes
+        if(self.stageTracker->AddBlock(maxValue, numFrames) > 0){
+            dispatch_source_merge_data(self.stageEventSource, 1);
+        }
+    }
+}
+
+-(void)handleFlowUpdates{ // main queue, every update the analysis queued since the last wake up
+    FlowUpdateQueue *updates = self.flowUpdates;
+    LatencyMonitor *monitor = self.latencyMonitor;
+    FlowUpdate update;
+    BOOL hasLiveMetrics = NO;
+    LiveEffortMetrics live;
+    while(updates->Pop(&update)){
+        if(delegateRespondsTo.didUpdateFlowAndVolume){
+            [self.delegate didUpdateFlow:update.flowInLitersPerSecond andVolume:update.volumeInLiters];
+        }
+        if(delegateRespondsTo.didUpdateFlowAndVolumeWithConfidence){
+            [self.delegate didUpdateFlow:update.flowInLitersPerSecond andVolume:update.volumeInLiters withConfidence:update.confidence];
+        }
+        if(monitor && update.hasTrace){
+            monitor->RecordDelivered(update.trace); // after the delegate has the update
+        }
+        if(update.hasLiveMetrics){
+            hasLiveMetrics = YES;
+            live = update.liveMetrics;
+        }
+    }
+    
+    // the measures only ever move forward, so the newest of the batch is the one worth boxing
+    if(hasLiveMetrics && delegateRespondsTo.didUpdateLiveMetrics){
+        [self.delegate didUpdateLiveMetrics:[FlowVolumeDataAnalyzer dictionaryFromLiveMetrics:live]];
+    }
+}
+
+-(void)handleStageEvents{ // main queue, everything the audio thread queued since the last wake up
+    EffortStageTracker *tracker = self.stageTracker;
+    StageEvent event;
+    while(tracker->Events().Pop(&event)){
+        if(self.isShuttingDown){
+            continue; // effort already ended (or was cancelled), just drain
+        }
+        
+        if(event.type == StageEventAudioLevel){
+            // update the delegate about the audio (this will happen after calibrating silence)
+            if(delegateRespondsTo.didUpdateAudioBufferWithMaximum){
+                [self.delegate didUpdateAudioBufferWithMaximum:event.maxValue];
+            }
+            continue;
+        }
+        
+        self.currentStage = event.stage;
+        if(event.previousStage == SpirometryStageIsCalibratingSilence && delegateRespondsTo.didFinishCalibratingSilence){
+            [self.delegate didFinishCalibratingSilence];
+        }
+        if(event.stage == SpirometryStageIsExhaling && event.previousStage < SpirometryStageIsExhaling){
+            NSLog(@"Spirometry Effort has begun");
+            if(delegateRespondsTo.didStartExhaling){
+                [self.delegate didStartExhaling];
+            }
+        }
+        else if(event.stage == SpirometryStageIsWaitingForEndOfTest && delegateRespondsTo.willEndTestSoon){
+            [self.delegate willEndTestSoon]; // once each time the audio drops, not every callback while it stays down
+        }
+        else if(event.stage == SpirometryStageIsFinished){
+            NSLog(@"Test has finished (no more audible sound)");
+        }
+        
+        // shut down audio from main queue if needed
+        // this has sync code in it, so it might be a bit slow for the main queue
+        [self endEffortIfDone];
+    }
+}
+
+// runs on the serial analysis queue (the only analysis worker, so windows and flow updates stay in order)
+// while recording, more than MAX_ANALYSIS_LAG_IN_SECONDS of waiting windows are skipped according to
+// analysisBacklogPolicy, so the delay stays bounded and the audio callback never has to drop samples
+-(void)processAvailableFramesAllowingSkips:(BOOL)allowSkips{
+    FrameView frame;
+    AnalysisBacklog *backlog = self.analysisBacklog;
+    OverlapFramer *framer = self.overlapFramer;
+    EffortSession *session = self.session;
+    LatencyMonitor *monitor = self.latencyMonitor;
+    int numChannels = (int)MAX(MIN(self.numCapturedChannels, (NSUInteger)framer->NumChannels()), (NSUInteger)1);
+    FrameView frames[kMaxNumFramerChannels];
+    while(backlog->NextFrame(&frame, allowSkips)){
+        // the same window on every microphone, the session analyzes the one the whistle is clearest on
+        frames[0] = frame;
+        for(int c=1; c<numChannels; c++){
+            frames[c] = framer->ChannelFrame(frame, c);
+        }
+        LatencyTrace trace = LatencyTrace();
+        if(monitor){
+            monitor->BeginFrame(&trace, frame.firstSampleIndex + frame.Length(), framer->NumFramesAvailable());
+        }
+        // the stage is the audio thread's, a little ahead of this window at most
+        BOOL hasFlowEstimate = session->AnalyzeWindow(frames, numChannels, self.stageTracker->Stage(), monitor ? &trace : NULL);
+        if(monitor){
+            monitor->EndFrame(trace);
+        }
+        self.selectedChannel = (NSUInteger)session->SelectedChannel();
+        if(hasFlowEstimate){
+            [self queueFlowUpdateWithTrace:trace];
+        }
+        backlog->ReleaseFrame();
+    }
+}
+
+// the session's newest flow estimate, queued for the delegate on the main queue with the live
+// measures copied unboxed (only if someone listens)
+-(void)queueFlowUpdateWithTrace:(const LatencyTrace &)trace{
+    if(!delegateRespondsTo.didUpdateFlowAndVolume && !delegateRespondsTo.didUpdateFlowAndVolumeWithConfidence &&
+       !delegateRespondsTo.didUpdateLiveMetrics){
+        return;
+    }
+    EffortSession *session = self.session;
+    FlowUpdate update;
+    update.flowInLitersPerSecond = session->LastFlow();
+    // this is not a great method, maybe do not even offer volume until we know start of effort for sure
+    update.volumeInLiters = [self.fvAnalyzer getEstimateOfTotalVolumeInLiters];
+    update.confidence = session->LastConfidence();
+    update.hasLiveMetrics = delegateRespondsTo.didUpdateLiveMetrics;
+    if(update.hasLiveMetrics){
+        update.liveMetrics = [self.fvAnalyzer liveMetricsSnapshot];
+    }
+    update.hasTrace = self.latencyMonitor != NULL;
+    update.trace = trace;
+    if(self.flowUpdates->Push(update)){
+        dispatch_source_merge_data(self.flowUpdateSource, 1);
+    }
+}
+
+-(NSDictionary*)analysisLoadStatistics{
+    if(!_analysisBacklog){
+        return @{};
+    }
+    AnalysisLoadStats stats = _analysisBacklog->Stats();
+    return @{@"FramesAnalyzed":@(stats.numFramesAnalyzed),
+             @"FramesSkipped":@(stats.numFramesSkipped),
+             @"SamplesDropped":@(stats.numDroppedSamples),
+             @"QueueDepth":@(stats.queueDepth),
+             @"MaxQueueDepth":@(stats.maxQueueDepth),
+             @"LagInSeconds":@(stats.lagInSeconds),
+             @"MaxLagInSeconds":@(stats.maxLagInSeconds)};
+}
+
+-(NSDictionary*)latencyStatistics{
+    if(!_latencyMonitor){
+        return @{};
+    }
+    LatencyReport report;
+    _latencyMonitor->Snapshot(&report);
+    
+    NSArray *intervalKeys = @[@"Callback", @"Queue", @"FFT", @"Peaks", @"Delivery", @"EndToEnd"];
+    NSMutableDictionary *latencies = [[NSMutableDictionary alloc] init];
+    for(NSUInteger i=0; i<kNumLatencyIntervals; i++){
+        const LatencyHistogram &h = report.intervals[i];
+        latencies[intervalKeys[i]] = @{@"Count":@(h.Count()),
+                                       @"MeanInMs":@(h.Mean()*1e-6),
+                                       @"P50InMs":@(h.ValueAtPercentile(50)*1e-6),
+                                       @"P90InMs":@(h.ValueAtPercentile(90)*1e-6),
+                                       @"P99InMs":@(h.ValueAtPercentile(99)*1e-6),
+                                       @"P999InMs":@(h.ValueAtPercentile(99.9)*1e-6),
+                                       @"MaxInMs":@(h.Max()*1e-6)};
+    }
+    latencies[@"QueueDepth"] = @{@"P50":@(report.queueDepth.ValueAtPercentile(50)),
+                                 @"P99":@(report.queueDepth.ValueAtPercentile(99)),
+                                 @"Max":@(report.queueDepth.Max())};
+    latencies[@"Callbacks"] = @(report.numCallbacks);
+    latencies[@"CallbacksUntraced"] = @(report.numCallbacksUntraced);
+    latencies[@"FramesAnalyzed"] = @(report.numFramesAnalyzed);
+    latencies[@"FramesDropped"] = @(report.numFramesDropped);
+    latencies[@"FramesDelivered"] = @(report.numFramesDelivered);
+    latencies[@"FramesLate"] = @(report.numFramesLate);
+    latencies[@"LateThresholdInSeconds"] = @(report.lateThresholdInSeconds);
+    latencies[@"SamplesDropped"] = @(self.overlapFramer->NumDroppedSamples());
+    return latencies;
+}
+
+-(void)didFinishProcessingAllFrames{
+    // if all windows are analyzed, and we are shutting down
+    if(self.isShuttingDown && self.currentStage==SpirometryStageIsFinished){
+        
+        self.currentStage = SpirometryStageIsAnalyzingResults;
+        
+        // coughs and voice the session timed during the effort go in its errors, then finalize and get the results
+        self.session->FinishAnalysis();
+        NSDictionary *results = [self.fvAnalyzer finalizeCurvesAndGetResults];
+        
+        // with the session's other efforts, before the delegate hears of it so a summary includes it
+        if(self.effortStore){
+            EffortKey key = self.storeKey;
+            key.timeInSeconds = [[NSDate date] timeIntervalSince1970];
+            if([self.fvAnalyzer appendToEffortStore:self.effortStore withKey:key] < 0 || !self.effortStore->Flush()){
+                NSLog(@"Effort could not be stored");
+            }
+        }
+        
+        // perform delegation for effort did finish (after any flow updates still queued)
+        if(delegateRespondsTo.didEndEffortWithResults){
+            dispatch_async(dispatch_get_main_queue(),^{
+                [self handleFlowUpdates];
+                [self.delegate didEndEffortWithResults:[[NSDictionary alloc]initWithDictionary:results]];
+            });
+        }
+        
+        // add this for synchronization of the serial main queue (not UI related, but simple calculation so, meh)
+        dispatch_async(dispatch_get_main_queue(),^{
+            self.currentStage = SpirometryStageIsIdle;
+        });
+    }
+}
+
+
+-(void)endEffortIfDone{ // only called from main queue
+    if(!self.isShuttingDown){
+        if(self.currentStage == SpirometryStageIsFinished)
+        {
+            self.isShuttingDown = YES; // this function should only be called from main queue so no semaphore needed
+            NSLog(@"Effort did end, Shutting Down Audio");
+            [self.audioManager pause]; // stop
+            [self finishRecordingEffort];
+            
+            // analyze whatever full windows are left, then finalize (on the analysis queue, after anything in flight)
+            dispatch_async(self.analysisQueue, ^{
+                [self processAvailableFramesAllowingSkips:NO]; // audio stopped, the backlog only shrinks now
+                [self didFinishProcessingAllFrames];
+            });
+        }
+        else if(self.currentStage == SpirometryStageDidTimeOutWaitingForEffort){
+            self.isShuttingDown = YES; // this function should only be called from main queue so no semaphore needed
+            NSLog(@"Effort did time out waiting");
+            [self.audioManager pause]; // stop
+            [self finishRecordingEffort];
+            dispatch_async(self.analysisQueue, ^{
+                self.overlapFramer->Clear();
+            });
+            
+            self.currentStage = SpirometryStageIsIdle;
+            
+            // perform delegation for effort did timeout
+            if(delegateRespondsTo.didTimeoutWaitingForTestToStart){
+                [self.delegate didTimeoutWaitingForTestToStart];
+            }
+        }
+    }
+}
+
+
+//====================================================================================================
+#pragma mark Effort Recording
+-(void)setCurrentStage:(SpirometryStage)currentStage{
+    // also set when nothing changed (ending an effort that was already finishing), so only mark real changes
+    if(currentStage != _currentStage && _effortRecorder){
+        _effortRecorder->AddMarker((int32_t)currentStage);
+    }
+    _currentStage = currentStage;
+}
+
+-(void)startRecordingEffort{ // main queue, audio not playing
+    if(!self.shouldSaveEffortsToDocumentDirectory || self.audioDebugIsActive){
+        return; // like Novocaine, never save the debug file back out
+    }
+    if(!_effortRecorder){
+        _effortRecorder = new EffortRecorder();
+    }
+    
+    NSString *documents = [NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, YES) lastObject];
+    NSString *fileName = [NSString stringWithFormat:@"%f.effort",[[NSDate date] timeIntervalSince1970]]; // UTC time string
+    std::string path = [[documents stringByAppendingPathComponent:fileName] UTF8String];
+    double samplingRate = self.audioManager.samplingRate;
+    int numChannels = (int)self.audioManager.numInputChannels;
+    
+    // waits for the last effort's file to be finished first
+    EffortRecorder *recorder = _effortRecorder;
+    __block bool started = false;
+    dispatch_sync(self.recorderQueue, ^{
+        started = recorder->Start(path, samplingRate, numChannels);
+    });
+    if(!started){
+        NSLog(@"Could not create effort recording %@", fileName);
+    }
+}
+
+-(void)finishRecordingEffort{ // main queue, after the audio is paused
+    EffortRecorder *recorder = _effortRecorder;
+    if(recorder && recorder->IsRecording()){
+        // last chunk, index and close off the main queue
+        dispatch_async(self.recorderQueue, ^{
+            recorder->Stop();
+            int64_t dropped = recorder->NumDroppedFrames();
+            if(recorder->HasFailed()){
+                NSLog(@"Effort recording could not be written, kept up to the last whole chunk");
+            }
+            if(dropped > 0){
+                NSLog(@"Effort recording dropped %lld samples", (long long)dropped);
+            }
+        });
+    }
+}
+
+//====================================================================================================
+#pragma mark User Request Controls
+-(void)requestThatCurrentEffortShouldCancel{
+    if(self.currentStage != SpirometryStageIsIdle){
+        dispatch_async(dispatch_get_main_queue(),^{
+            self.isShuttingDown = YES; // this function should only be called from main queue so no semaphore needed
+            NSLog(@"Effort cancelled");
+            [self.audioManager pause]; // stop
+            [self finishRecordingEffort];
+            
+            // throw away anything not analyzed yet
+            dispatch_async(self.analysisQueue, ^{
+                self.overlapFramer->Clear();
+            });
+            
+            self.currentStage = SpirometryStageIsIdle;
+            
+            // perform delegation for effort was cancelled successfully
+            if(delegateRespondsTo.didCancelEffort){
+                [self.delegate didCancelEffort];
+            }
+        });
+    }
+}
+
+-(void)requestThatEffortShouldEnd{
+    // add this for synchronization of the serial main queue (not UI related, but simple calculation so, meh)
+    dispatch_async(dispatch_get_main_queue(),^{
+       
+        if(self.currentStage > SpirometryStageIsWaitingForTestToBegin){
+             NSLog(@"Requesting that effort should end without canceling, user inititated");
+            self.currentStage = SpirometryStageIsFinished;
+            [self endEffortIfDone];
+        }
+        else{
+             NSLog(@"Cannot end test because no valid start was found, canceling");
+            [self requestThatCurrentEffortShouldCancel];
+        }
+    });
+}
+
+//=============================================================================================================
+#pragma mark Debug Options
+-(void)activateDebugAudioModeWithWAVFile:(NSString*)filename{
+    self.audioDebugIsActive = YES;
+    if(filename != nil)
+        self.audioDebugFileName = filename;
+    else
+        self.audioDebugFileName = @"VortexWhistleRed";
+    
+    // a recording or WAV anywhere on disk (an effort saved to the documents directory, say) is
+    // memory mapped and replayed by us, a name in the bundle is still played by Novocaine
+    if([[NSFileManager defaultManager] fileExistsAtPath:self.audioDebugFileName]){
+        EffortFileReader *reader = new EffortFileReader();
+        std::string error;
+        if(reader->Open([self.audioDebugFileName UTF8String], &error)){
+            self.replayGeneration++;
+            EffortFileReader *previous = _debugFileReader;
+            _debugFileReader = reader;
+            if(previous){
+                dispatch_async(self.replayQueue, ^{
+                    delete previous; // after any replay still using it
+                });
+            }
+            return;
+        }
+        NSLog(@"Cannot replay %@: %s", self.audioDebugFileName, error.c_str());
+        delete reader;
+    }
+    
+    // set it, if we can, otherwise set at time of creation
+    if(_audioManager){
+        [self.audioManager overrideMicrophoneWithAudioFile:self.audioDebugFileName];
+    }
+}
+
+-(void)replayDebugFile{ // main queue, in place of starting the microphone
+    EffortFileReader *reader = self.debugFileReader; // the effort was set up at its rate
+    
+    // paced at real time so the delegate sees it as it would live (Novocaine hands out about 1024 frames)
+    __block SpirometerEffortAnalyzer * __weak weakSelf = self;
+    NSUInteger generation = self.replayGeneration;
+    dispatch_async(self.replayQueue, ^{
+        AnalyzerReplaySink sink(weakSelf, generation);
+        reader->Deliver(&sink, 0, reader->NumFrames(), 1024, 1.0);
+    });
+}
+
+-(void)shouldSaveSeparateEffortsToDocumentDirectory:(BOOL)should{
+    self.shouldSaveEffortsToDocumentDirectory = should; // takes effect from the next effort
+}
+
+-(BOOL)storeEffortsAtPath:(NSString*)path forPatient:(int64_t)patient inSession:(int64_t)session withWhistle:(int32_t)whistle{
+    EffortStore *store = nil;
+    if(path){
+        // opened here, the header scan of a large store should not hold up the analysis
+        store = new EffortStore();
+        std::string error;
+        if(!store->Open([path UTF8String], self.fvAnalyzer.preferredSamplingInterval, &error)){
+            NSLog(@"Cannot store efforts at %@: %s", path, error.c_str());
+            delete store;
+            return NO;
+        }
+    }
+    
+    EffortKey key = {patient, session, whistle, 0, 0};
+    dispatch_sync(self.analysisQueue, ^{
+        if(self.effortStore){
+            delete self.effortStore;
+        }
+        self.effortStore = store;
+        self.storeKey = key;
+    });
+    return YES;
+}
+
+-(NSDictionary*)summaryOfStoredSession{
+    __block SessionSummary summary;
+    __block BOOL found = NO;
+    dispatch_sync(self.analysisQueue, ^{
+        if(self.effortStore){
+            found = self.effortStore->SummarizeSession(self.storeKey.session, &summary);
+        }
+    });
+    if(!found){
+        return @{};
+    }
+    return @{@"NumEfforts":@(summary.numEfforts),
+             @"NumAcceptable":@(summary.numAcceptable),
+             @"BestEffort":@(summary.bestEffort),
+             @"PeakFlowInLitersPerSecond":@(summary.peakFlowInLitersPerSecond),
+             @"FEVOneInLiters":@(summary.fevOneInLiters),
+             @"FVCInLiters":@(summary.fvcInLiters),
+             @"FEVOneOverFVC":@(summary.fevOneOverFvc),
+             @"FEVOneRepeatabilityInLiters":@(summary.fevOneRepeatabilityInLiters),
+             @"FVCRepeatabilityInLiters":@(summary.fvcRepeatabilityInLiters),
+             @"IsRepeatable":@(summary.isRepeatable)};
+}
+
+-(NSDictionary*)trendOfStoredPatient{
+    __block PatientTrend trend;
+    __block BOOL found = NO;
+    dispatch_sync(self.analysisQueue, ^{
+        if(self.effortStore){
+            found = self.effortStore->TrendOfPatient(self.storeKey.patient, &trend);
+        }
+    });
+    if(!found){
+        return @{};
+    }
+    return @{@"NumSessions":@(trend.numSessions),
+             @"FirstTimeInSeconds":@(trend.firstTimeInSeconds),
+             @"LastTimeInSeconds":@(trend.lastTimeInSeconds),
+             @"LastFEVOneInLiters":@(trend.lastFevOneInLiters),
+             @"LastFVCInLiters":@(trend.lastFvcInLiters),
+             @"FEVOneSlopeInLitersPerYear":@(trend.fevOneSlopeInLitersPerYear),
+             @"FVCSlopeInLitersPerYear":@(trend.fvcSlopeInLitersPerYear)};
+}
+
+
+@end
@@ -28,6 +28,7 @@ struct WhistleDimensions { // in millimeters
 @property (nonatomic) NSNumber *calculatedBias; // bias term for regression
 
 @property (nonatomic) struct WhistleDimensions dimensions;
+@property (nonatomic) BOOL useBandLimitedSpectrum; // analyze only this whistle's band (decimated), takes effect on the next effort
 
 -(void)setAsWhistleWithDimensions:(struct WhistleDimensions)structDims;
 -(void)setWhistleToDefault; // hard coded Sato, et al., Application of the Vortex Whistle to a Spirometer
@@ -0,0 +1,155 @@
+//
+//  SplineInterpolator.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "SplineInterpolator.h"
+#include <algorithm>
+
+SplineInterpolator::SplineInterpolator(const float *x, const float *y, int64_t numPoints) :
+mWindowLength(0)
+{
+    SetPoints(x, y, numPoints);
+}
+
+void SplineInterpolator::SetPoints(const float *x, const float *y, int64_t numPoints)
+{
+    mX.assign(x, x + numPoints);
+    mA.assign(y, y + numPoints);
+    mH.clear();
+    mQ.clear();
+    for (int64_t i = 0; i + 1 < numPoints; i++) {
+        mH.push_back(x[i + 1] - x[i]);
+        mQ.push_back(3 / mH[i] * (y[i + 1] - y[i]));
+    }
+    Solve();
+}
+
+void SplineInterpolator::SetWindowLength(int64_t numPoints)
+{
+    mWindowLength = numPoints;
+    if ((int64_t)mX.capacity() < numPoints)
+        Reserve(numPoints);
+    ClearPoints();
+}
+
+void SplineInterpolator::ClearPoints()
+{
+    std::vector<float> *arrays[7] = {&mX, &mA, &mB, &mC, &mD, &mH, &mQ};
+    for (int i = 0; i < 7; i++)
+        arrays[i]->clear();
+}
+
+void SplineInterpolator::PushPoint(float x, float y)
+{
+    if (mWindowLength > 0 && (int64_t)mX.size() == mWindowLength) {
+        // slide the window, the remaining segments keep their terms
+        mX.erase(mX.begin());
+        mA.erase(mA.begin());
+        if (!mH.empty()) {
+            mH.erase(mH.begin());
+            mQ.erase(mQ.begin());
+        }
+    }
+    if (!mX.empty()) {
+        float h = x - mX.back();
+        mH.push_back(h);
+        mQ.push_back(3 / h * (y - mA.back()));
+    }
+    mX.push_back(x);
+    mA.push_back(y);
+    Solve();
+}
+
+void SplineInterpolator::Solve()
+{
+    int64_t numPoints = (int64_t)mX.size();
+    mB.assign(numPoints, 0.0f);
+    mC.assign(numPoints, 0.0f);
+    mD.assign(numPoints, 0.0f);
+    if (numPoints < 2)
+        return;
+
+    // natural spline over n = numPoints-1 segments
+    // (CubicSpline.m runs these loops to count, which reads one knot past the end of its arrays)
+    int64_t n = numPoints - 1;
+    mL.resize(numPoints);
+    mU.resize(numPoints);
+    mZ.resize(numPoints);
+    const float *x = &mX[0], *a = &mA[0], *h = &mH[0], *q = &mQ[0];
+    float *l = &mL[0], *u = &mU[0], *z = &mZ[0];
+    float *b = &mB[0], *c = &mC[0], *d = &mD[0];
+
+    l[0] = 1;
+    u[0] = 0;
+    z[0] = 0;
+
+    for (int64_t i = 1; i < n; i++) {
+        float alpha = q[i] - q[i - 1];
+        l[i] = 2 * (x[i + 1] - x[i - 1]) - h[i - 1] * u[i - 1];
+        u[i] = h[i] / l[i];
+        z[i] = (alpha - h[i - 1] * z[i - 1]) / l[i];
+    }
+
+    l[n] = 1;
+    z[n] = 0;
+    c[n] = 0;
+
+    for (int64_t i = n - 1; i >= 0; i--) {
+        c[i] = z[i] - u[i] * c[i + 1];
+        b[i] = (a[i + 1] - a[i]) / h[i] - h[i] * (c[i + 1] + 2.0f * c[i]) / 3.0f;
+        d[i] = (c[i + 1] - c[i]) / (3 * h[i]);
+    }
+}
+
+void SplineInterpolator::Reserve(int64_t numPoints)
+{
+    std::vector<float> *arrays[10] = {&mX, &mA, &mB, &mC, &mD, &mH, &mQ, &mL, &mU, &mZ};
+    for (int i = 0; i < 10; i++)
+        arrays[i]->reserve(numPoints);
+}
+
+float SplineInterpolator::InterpolateX(float input) const
+{
+    if (mX.size() == 0) {
+        // No points. Return identity.
+        return input;
+    }
+
+    int64_t i = 0;
+    for (i = (int64_t)mX.size() - 1; i > 0; i--) {
+        if (mX[i] <= input)
+            break;
+    }
+
+    float deltaX = input - mX[i];
+    return mA[i] + mB[i]*deltaX + mC[i]*deltaX*deltaX + mD[i]*deltaX*deltaX*deltaX;
+}
+
+void SplineInterpolator::Interpolate(const float *input, float *output, int64_t count) const
+{
+    int64_t numPoints = (int64_t)mX.size();
+    if (numPoints == 0) {
+        std::copy(input, input + count, output);
+        return;
+    }
+
+    // same segment as InterpolateX (last knot at or before the input, the first one before all
+    // knots), found by moving forward from the previous input's segment
+    const float *x = &mX[0];
+    int64_t i = 0;
+    for (int64_t k = 0; k < count; k++) {
+        float value = input[k];
+        if (i > 0 && x[i] > value) // out of order, start over
+            i = std::upper_bound(x, x + numPoints, value) - x - 1;
+        if (i < 0)
+            i = 0;
+        while (i + 1 < numPoints && x[i + 1] <= value)
+            i++;
+        float deltaX = value - x[i];
+        output[k] = mA[i] + mB[i]*deltaX + mC[i]*deltaX*deltaX + mD[i]*deltaX*deltaX*deltaX;
+    }
+}
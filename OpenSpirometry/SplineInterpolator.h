@@ -0,0 +1,51 @@
+//
+//  SplineInterpolator.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Portable natural cubic spline, the same math as CubicSpline (from SAMCubicSpline)
+//  on plain float arrays instead of NSArrays of NSNumbers.
+//
+//  Two ways to give it knots: SetPoints fits a whole set at once (back extrapolation), or
+//  SetWindowLength + PushPoint keeps only the newest knots in a fixed window for resampling a
+//  stream of estimates. Pushing a knot drops the oldest, carries over the segment terms of the
+//  others and only re-solves the small tridiagonal system of the window, so nothing allocates
+//  and nothing is recomputed from the knots. Interpolate evaluates many inputs in one call,
+//  walking a cursor forward through the segments when the inputs are in order.
+
+#ifndef OpenSpirometry_SplineInterpolator_h
+#define OpenSpirometry_SplineInterpolator_h
+
+#include <stdint.h>
+#include <vector>
+
+class SplineInterpolator {
+
+public:
+    SplineInterpolator() : mWindowLength(0) {};
+    SplineInterpolator(const float *x, const float *y, int64_t numPoints);
+
+    void SetPoints(const float *x, const float *y, int64_t numPoints);
+    void Reserve(int64_t numPoints); // fits of up to numPoints knots will not allocate
+
+    // sliding window of the newest numPoints knots (x increasing), refit as each one is pushed
+    void SetWindowLength(int64_t numPoints);
+    void PushPoint(float x, float y);
+    void ClearPoints();
+    int64_t NumPoints() const { return (int64_t)mX.size(); }
+
+    float InterpolateX(float input) const;
+    void Interpolate(const float *input, float *output, int64_t count) const; // fastest with inputs in increasing order
+
+protected:
+    void Solve();   // coefficients from mX, mA and the segment terms mH, mQ
+
+    std::vector<float> mX, mA, mB, mC, mD;
+    std::vector<float> mH, mQ;      // per segment: width and 3/h*(y[i+1]-y[i]), kept while the window slides
+    std::vector<float> mL, mU, mZ;  // scratch, kept so refitting does not allocate
+    int64_t mWindowLength;
+};
+
+#endif
@@ -0,0 +1,96 @@
+//
+//  StreamingEffortMetrics.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "StreamingEffortMetrics.h"
+#include "SpirometerConstants.h"
+#include <math.h>
+
+StreamingEffortMetrics::StreamingEffortMetrics(float samplingInterval) :
+mSamplingInterval(samplingInterval)
+{
+    Clear();
+}
+
+void StreamingEffortMetrics::Clear()
+{
+    mMetrics.numSamples = 0;
+    mMetrics.timeInSeconds = 0;
+    mMetrics.flowInLitersPerSecond = 0;
+    mMetrics.volumeInLiters = 0;
+    mMetrics.peakFlowInLitersPerSecond = 0;
+    mMetrics.timeOfPeakFlowInSeconds = 0;
+    mMetrics.timeZeroInSeconds = 0;
+    mMetrics.backExtrapolatedVolumeInLiters = 0;
+    mMetrics.startIsAcceptable = true;
+    mMetrics.hasFevOne = false;
+    mMetrics.fevOneInLiters = 0;
+    mMetrics.fvcInLiters = 0;
+    mMetrics.fevOneOverFvc = 0;
+    mMetrics.hasReachedPlateau = false;
+}
+
+// sample i is at i*interval, so any time is one lookup (linear between samples, clamped to the curve)
+float StreamingEffortMetrics::VolumeAtTime(const float *volume, int64_t numSamples, float time) const
+{
+    float position = time/mSamplingInterval;
+    if (position <= 0)
+        return volume[0];
+    int64_t i = (int64_t)position;
+    if (i >= numSamples - 1)
+        return volume[numSamples-1];
+    float fraction = position - (float)i;
+    return volume[i] + fraction*(volume[i+1] - volume[i]);
+}
+
+void StreamingEffortMetrics::AddSample(const float *time, const float *flow, const float *volume, int64_t numSamples)
+{
+    if (numSamples <= 0)
+        return;
+
+    LiveEffortMetrics &m = mMetrics;
+    int64_t newest = numSamples - 1;
+    m.numSamples = numSamples;
+    m.timeInSeconds = time[newest];
+    m.flowInLitersPerSecond = flow[newest];
+    m.volumeInLiters = volume[newest];
+    m.fvcInLiters = volume[newest];
+
+    // new peak: the steepest point of the volume curve moved, so does time zero
+    bool timeZeroMoved = false;
+    if (numSamples == 1 || flow[newest] > m.peakFlowInLitersPerSecond) {
+        m.peakFlowInLitersPerSecond = flow[newest];
+        m.timeOfPeakFlowInSeconds = time[newest];
+        if (flow[newest] > 0)
+            m.timeZeroInSeconds = time[newest] - volume[newest]/flow[newest];
+        else
+            m.timeZeroInSeconds = time[newest];
+        timeZeroMoved = true;
+    }
+
+    if (timeZeroMoved) {
+        m.backExtrapolatedVolumeInLiters = m.timeZeroInSeconds > 0 ? VolumeAtTime(volume, numSamples, m.timeZeroInSeconds) : 0;
+        m.hasFevOne = false; // measured from the new time zero once the curve gets there
+        m.fevOneInLiters = 0;
+    }
+    float limit = MAX_BACK_EXTRAPOLATED_VOLUME_FRACTION*m.volumeInLiters;
+    if (limit < MAX_BACK_EXTRAPOLATED_VOLUME_IN_LITERS)
+        limit = MAX_BACK_EXTRAPOLATED_VOLUME_IN_LITERS;
+    m.startIsAcceptable = m.backExtrapolatedVolumeInLiters <= limit;
+
+    float fevOneTime = m.timeZeroInSeconds + 1.0f;
+    if (!m.hasFevOne && m.timeInSeconds >= fevOneTime) {
+        m.hasFevOne = true;
+        m.fevOneInLiters = VolumeAtTime(volume, numSamples, fevOneTime);
+    }
+    m.fevOneOverFvc = m.hasFevOne && m.fvcInLiters > 0 ? m.fevOneInLiters/m.fvcInLiters : 0;
+
+    // end of test: volume has stopped growing (only once the blow has lasted the plateau duration)
+    float plateauStart = m.timeInSeconds - PLATEAU_DURATION_IN_SECONDS;
+    m.hasReachedPlateau = plateauStart >= m.timeZeroInSeconds && plateauStart >= 0 &&
+        m.volumeInLiters - VolumeAtTime(volume, numSamples, plateauStart) < PLATEAU_VOLUME_CHANGE_IN_LITERS;
+}
@@ -0,0 +1,66 @@
+//
+//  StreamingEffortMetrics.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Live (provisional) effort measures, kept up to date as FlowVolumeCurve appends each
+//  constant rate sample, so PEF, FEV1 and FVC are known during the blow instead of only after
+//  finalizeCurvesAndGetResults. Every update is O(1): running peak flow, and because the
+//  columns are evenly spaced any earlier volume is one indexed lookup away.
+//
+//    time zero    back extrapolation (ATS/ERS): the tangent to the volume curve at peak flow
+//                 crosses zero volume at t0 = tPEF - V(tPEF)/PEF, moves whenever a new peak arrives
+//    BEV          volume already exhaled at t0, the start is acceptable if it is below
+//                 MAX_BACK_EXTRAPOLATED_VOLUME_FRACTION of the volume or MAX_BACK_EXTRAPOLATED_VOLUME_IN_LITERS
+//    FEV1         volume at t0 + 1 s, once the curve reaches it
+//    FVC          volume so far, with a plateau once it changed less than PLATEAU_VOLUME_CHANGE_IN_LITERS
+//                 over the last PLATEAU_DURATION_IN_SECONDS
+//
+//  Uses the resampled flow before the low pass and back extrapolation of FinalizeCurves, so the
+//  final numbers can differ slightly from the live ones.
+
+#ifndef OpenSpirometry_StreamingEffortMetrics_h
+#define OpenSpirometry_StreamingEffortMetrics_h
+
+#include <stdint.h>
+
+struct LiveEffortMetrics {
+    int64_t numSamples;             // constant rate samples seen
+    float timeInSeconds;            // of the newest sample, curve time
+    float flowInLitersPerSecond;    // newest sample
+    float volumeInLiters;           // newest sample, also the provisional FVC
+    float peakFlowInLitersPerSecond;
+    float timeOfPeakFlowInSeconds;
+    float timeZeroInSeconds;        // back extrapolated start of the blow (can be before the curve starts)
+    float backExtrapolatedVolumeInLiters;
+    bool startIsAcceptable;         // BEV within limits
+    bool hasFevOne;                 // t0 + 1 s reached
+    float fevOneInLiters;           // 0 until hasFevOne
+    float fvcInLiters;
+    float fevOneOverFvc;            // 0 until hasFevOne
+    bool hasReachedPlateau;         // end of test criterion for FVC
+};
+
+class StreamingEffortMetrics {
+
+public:
+    StreamingEffortMetrics(float samplingInterval = 1.0f/100.0f);
+
+    // call after each sample is appended to the columns (times evenly spaced from 0 by the sampling
+    // interval), only the newest sample and a few indexed earlier volumes are read
+    void AddSample(const float *time, const float *flow, const float *volume, int64_t numSamples);
+    void Clear();
+
+    const LiveEffortMetrics &Metrics() const { return mMetrics; }
+    float SamplingInterval() const { return mSamplingInterval; }
+
+protected:
+    float VolumeAtTime(const float *volume, int64_t numSamples, float time) const;
+
+    float mSamplingInterval;
+    LiveEffortMetrics mMetrics;
+};
+
+#endif
@@ -0,0 +1,768 @@
+//
+//  WhistleCalibrator.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "WhistleCalibrator.h"
+#include "EffortFileReader.h"
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#define kCalibrationCacheMagic 0x43575053 // "SPWC" when read as little endian bytes
+#define kCalibrationCacheVersion 1
+
+static const bool kFormUsesTerm[kNumCalibrationModelForms][kCalibrationMaxNumTerms] = {
+    {true, true, false, false},     // linear
+    {true, true, true, false},      // quadratic
+    {true, true, false, true},      // linear, temperature
+    {true, true, true, true},       // quadratic, temperature
+};
+
+const char *CalibrationModelFormName(CalibrationModelForm form)
+{
+    switch (form) {
+        case CalibrationModelLinear: return "linear";
+        case CalibrationModelQuadratic: return "quadratic";
+        case CalibrationModelLinearTemperature: return "linear+temperature";
+        case CalibrationModelQuadraticTemperature: return "quadratic+temperature";
+        case kNumCalibrationModelForms: break;
+    }
+    return "unknown";
+}
+
+CalibrationReference::CalibrationReference() :
+peakFlowInLitersPerSecond(NAN),
+fevOneInLiters(NAN),
+fvcInLiters(NAN),
+temperatureInCelsius(NAN)
+{
+}
+
+//=============================================================================================================
+// Calibrated whistle
+
+CalibratedWhistle::CalibratedWhistle()
+{
+    *this = CalibratedWhistle(WhistleModel());
+}
+
+CalibratedWhistle::CalibratedWhistle(const WhistleModel &whistle) :
+form(whistle.quadratic != 0 ? CalibrationModelQuadratic : CalibrationModelLinear),
+bias(whistle.bias),
+coefficient(whistle.coefficient),
+quadratic(whistle.quadratic),
+temperatureCoefficient(0)
+{
+}
+
+float CalibratedWhistle::FlowFromFrequency(float frequencyInHz, float temperatureInCelsius) const
+{
+    return ModelAtTemperature(temperatureInCelsius).FlowFromFrequency(frequencyInHz);
+}
+
+WhistleModel CalibratedWhistle::ModelAtTemperature(float temperatureInCelsius) const
+{
+    float difference = isnan(temperatureInCelsius) ? 0.0f : temperatureInCelsius - kCalibrationReferenceTemperature;
+    WhistleModel whistle(coefficient + temperatureCoefficient*difference, bias);
+    whistle.quadratic = quadratic;
+    return whistle;
+}
+
+// the terms in the units the equations are in (kHz)
+static void ScaledTerms(const CalibratedWhistle &whistle, double *terms)
+{
+    terms[0] = whistle.bias;
+    terms[1] = whistle.coefficient*kCalibrationFrequencyScale;
+    terms[2] = whistle.quadratic*kCalibrationFrequencyScale*kCalibrationFrequencyScale;
+    terms[3] = whistle.temperatureCoefficient*kCalibrationFrequencyScale;
+}
+
+static void BasisAtFrequency(float frequency, double temperatureDifference, double *basis)
+{
+    double x = frequency/kCalibrationFrequencyScale;
+    basis[0] = 1.0;
+    basis[1] = x;
+    basis[2] = x*x;
+    basis[3] = x*temperatureDifference;
+}
+
+static double TemperatureDifference(const CalibrationReference &reference)
+{
+    return isnan(reference.temperatureInCelsius) ? 0.0 : reference.temperatureInCelsius - kCalibrationReferenceTemperature;
+}
+
+// linear between the reference samples, false outside them
+static bool InterpolateReference(const CalibrationReference &reference, double time, double *flow)
+{
+    const std::vector<float> &times = reference.curveTimes;
+    if (times.empty() || time < times.front() || time > times.back())
+        return false;
+    size_t upper = std::upper_bound(times.begin(), times.end(), (float)time) - times.begin();
+    if (upper >= times.size()) {
+        *flow = reference.curveFlows.back();
+        return true;
+    }
+    size_t lower = upper - 1;
+    double span = times[upper] - times[lower];
+    double fraction = span > 0 ? (time - times[lower])/span : 0.0;
+    *flow = reference.curveFlows[lower] + fraction*(reference.curveFlows[upper] - reference.curveFlows[lower]);
+    return true;
+}
+
+static float Median(std::vector<float> &values)
+{
+    if (values.empty())
+        return NAN;
+    std::vector<float>::iterator middle = values.begin() + values.size()/2;
+    std::nth_element(values.begin(), middle, values.end());
+    return *middle;
+}
+
+//=============================================================================================================
+// Efforts and extraction
+
+WhistleCalibrator::WhistleCalibrator(const WhistleModel &nominal) :
+mNominal(nominal)
+{
+}
+
+int WhistleCalibrator::AddEffortFile(const std::string &path, const CalibrationReference &reference, int channel)
+{
+    CalibrationEffort effort;
+    effort.name = path;
+    effort.path = path;
+    effort.channel = channel;
+    effort.samples = NULL;
+    effort.numFrames = 0;
+    effort.samplingRate = 0;
+    effort.reference = reference;
+    effort.extraction.isExtracted = false;
+    effort.extraction.didFinish = false;
+    effort.extraction.referenceLag = 0;
+
+    // only the headers are read here, the audio is mapped again when it is extracted
+    EffortFileReader reader;
+    std::string error;
+    if (!reader.Open(path, &error)) {
+        effort.extraction.isExtracted = true;
+        effort.extraction.error = error;
+    }
+    else if (channel < 0 || channel >= reader.NumChannels()) {
+        effort.extraction.isExtracted = true;
+        effort.extraction.error = "no such channel";
+    }
+    else {
+        effort.numFrames = reader.NumFrames();
+        effort.samplingRate = (float)reader.SamplingRate();
+    }
+    mEfforts.push_back(effort);
+    return (int)mEfforts.size() - 1;
+}
+
+int WhistleCalibrator::AddEffortAudio(const float *samples, int64_t numFrames, float samplingRate,
+                                      const CalibrationReference &reference, const std::string &name)
+{
+    CalibrationEffort effort;
+    effort.name = name;
+    effort.channel = 0;
+    effort.samples = samples;
+    effort.numFrames = numFrames;
+    effort.samplingRate = samplingRate;
+    effort.reference = reference;
+    effort.extraction.isExtracted = false;
+    effort.extraction.didFinish = false;
+    effort.extraction.referenceLag = 0;
+    mEfforts.push_back(effort);
+    return (int)mEfforts.size() - 1;
+}
+
+void WhistleCalibrator::ClearExtractions()
+{
+    for (size_t e = 0; e < mEfforts.size(); e++) {
+        CalibrationExtraction &extraction = mEfforts[e].extraction;
+        if (mEfforts[e].samplingRate == 0)
+            continue; // could not be opened, stays that way
+        extraction.isExtracted = false;
+        extraction.didFinish = false;
+        extraction.error.clear();
+        extraction.estimates.clear();
+        extraction.referenceLag = 0;
+    }
+}
+
+int WhistleCalibrator::Extract(int numThreads)
+{
+    if (numThreads <= 0)
+        numThreads = (int)std::thread::hardware_concurrency();
+    numThreads = numThreads < 1 ? 1 : numThreads;
+
+    // a session is built for one sampling rate, so the efforts go in groups of one rate
+    std::vector<int> pending;
+    for (size_t e = 0; e < mEfforts.size(); e++)
+        if (!mEfforts[e].extraction.isExtracted)
+            pending.push_back((int)e);
+    int numExtracted = (int)pending.size();
+    while (!pending.empty()) {
+        float rate = mEfforts[pending[0]].samplingRate;
+        std::vector<int> group, rest;
+        for (size_t i = 0; i < pending.size(); i++)
+            (mEfforts[pending[i]].samplingRate == rate ? group : rest).push_back(pending[i]);
+        ExtractEfforts(group, numThreads);
+        pending.swap(rest);
+    }
+    return numExtracted;
+}
+
+void WhistleCalibrator::ExtractEfforts(const std::vector<int> &efforts, int numThreads)
+{
+    float rate = mEfforts[efforts[0]].samplingRate;
+    if (numThreads > (int)efforts.size())
+        numThreads = (int)efforts.size();
+
+    // efforts are handed out one at a time, each worker reuses its own session through Clear
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < numThreads; t++) {
+        workers.push_back(std::thread([this, &efforts, &next, rate]() {
+            EffortSession session(rate, mNominal);
+            std::vector<float> channelBuffer;
+            for (size_t i = next.fetch_add(1); i < efforts.size(); i = next.fetch_add(1))
+                ExtractEffort(mEfforts[efforts[i]], session, &channelBuffer);
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
+void WhistleCalibrator::ExtractEffort(CalibrationEffort &effort, EffortSession &session, std::vector<float> *channelBuffer)
+{
+    CalibrationExtraction &extraction = effort.extraction;
+    extraction.estimates.clear();
+    extraction.estimates.reserve((size_t)(TEST_MAX_DURATION_SECONDS*effort.samplingRate/(BUFFER_SIZE-(BUFFER_OVERLAP))));
+    session.Clear();
+    session.SetEstimateLog(&extraction.estimates);
+
+    if (effort.path.empty()) {
+        session.AddNewFloatData(effort.samples, effort.numFrames);
+    }
+    else {
+        EffortFileReader reader;
+        std::string error;
+        if (!reader.Open(effort.path, &error)) {
+            session.SetEstimateLog(NULL);
+            extraction.error = error;
+            extraction.isExtracted = true;
+            return;
+        }
+        EffortSpan span;
+        while (session.CurrentStage() < SpirometryStageIsFinished && reader.Read(kReaderMaxConvertedFrames, &span) > 0) {
+            if (span.numChannels == 1) {
+                session.AddNewFloatData(span.samples, span.numFrames);
+                continue;
+            }
+            channelBuffer->resize((size_t)span.numFrames);
+            for (int64_t i = 0; i < span.numFrames; i++)
+                (*channelBuffer)[i] = span.samples[i*span.numChannels + effort.channel];
+            session.AddNewFloatData(&(*channelBuffer)[0], span.numFrames);
+        }
+    }
+    session.FinishStream();
+    FlowVolumeResults results;
+    extraction.didFinish = session.GetResults(&results);
+    session.SetEstimateLog(NULL);
+    if (extraction.estimates.size() < 2)
+        extraction.error = "no whistle found";
+    AlignReferenceCurve(effort);
+    extraction.isExtracted = true;
+}
+
+// the reference spirometer keeps its own clock: slide its curve to where it follows the frequencies
+// best (flow is close to linear in frequency, so the correlation does not depend on the model); only
+// the blast and peak are compared, a quiet tail can leave the tracker on room noise anywhere in the band
+void WhistleCalibrator::AlignReferenceCurve(CalibrationEffort &effort)
+{
+    CalibrationExtraction &extraction = effort.extraction;
+    const CalibrationReference &reference = effort.reference;
+    extraction.referenceLag = 0;
+    if (reference.curveTimes.size() < 2 || reference.curveTimes.size() != reference.curveFlows.size() || extraction.estimates.size() < 2)
+        return;
+
+    // coarse steps over the whole range, then every step around the best of them
+    int64_t numLags = (int64_t)floor(kCalibrationMaxReferenceLag/kCalibrationLagStep);
+    double bestCorrelation = -2.0;
+    int64_t best = 0;
+    for (int64_t l = -numLags; l <= numLags; l += 10) {
+        double correlation = LagCorrelation(effort, l*kCalibrationLagStep);
+        if (correlation > bestCorrelation) {
+            bestCorrelation = correlation;
+            best = l;
+        }
+    }
+    int64_t coarse = best;
+    for (int64_t l = std::max(-numLags, coarse - 9); l <= std::min(numLags, coarse + 9); l++) {
+        double correlation = l == coarse ? bestCorrelation : LagCorrelation(effort, l*kCalibrationLagStep);
+        if (correlation > bestCorrelation) {
+            bestCorrelation = correlation;
+            best = l;
+        }
+    }
+    extraction.referenceLag = best*kCalibrationLagStep;
+}
+
+double WhistleCalibrator::LagCorrelation(const CalibrationEffort &effort, double lag)
+{
+    const std::vector<WhistleEstimate> &estimates = effort.extraction.estimates;
+    double sumF = 0, sumR = 0, sumFF = 0, sumRR = 0, sumFR = 0;
+    int64_t n = 0;
+    double end = estimates[0].timeStamp + kCalibrationAlignmentSeconds;
+    for (size_t i = 0; i < estimates.size() && estimates[i].timeStamp <= end; i++) {
+        double f = estimates[i].frequency, r = 0;
+        if (f < MIN_FREQUENCY_OF_WHISTLE_IN_HZ || f > MAX_FREQUENCY_OF_WHISTLE_IN_HZ)
+            continue; // no whistle makes that, and one of them can outweigh the effort
+        n++;
+        if (!InterpolateReference(effort.reference, estimates[i].timeStamp - lag, &r))
+            r = 0; // no flow before or after the reference
+        sumF += f; sumR += r; sumFF += f*f; sumRR += r*r; sumFR += f*r;
+    }
+    if (n < 2)
+        return -1.0;
+    double covariance = sumFR - sumF*sumR/n;
+    double variance = (sumFF - sumF*sumF/n)*(sumRR - sumR*sumR/n);
+    return variance > 0 ? covariance/sqrt(variance) : -1.0;
+}
+
+//=============================================================================================================
+// Extraction cache, host byte order (a cache next to the efforts, not an interchange format)
+
+template <typename T>
+static bool WriteValue(FILE *file, const T &value)
+{
+    return fwrite(&value, sizeof(T), 1, file) == 1;
+}
+
+template <typename T>
+static bool ReadValue(FILE *file, T *value)
+{
+    return fread(value, sizeof(T), 1, file) == 1;
+}
+
+bool WhistleCalibrator::SaveExtractions(const std::string &path, std::string *error)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        if (error)
+            *error = "cannot write " + path;
+        return false;
+    }
+    uint32_t numSaved = 0;
+    for (size_t e = 0; e < mEfforts.size(); e++)
+        numSaved += mEfforts[e].extraction.isExtracted && mEfforts[e].samplingRate > 0 ? 1 : 0;
+    bool ok = WriteValue(file, (uint32_t)kCalibrationCacheMagic) && WriteValue(file, (uint32_t)kCalibrationCacheVersion) &&
+              WriteValue(file, numSaved);
+    for (size_t e = 0; ok && e < mEfforts.size(); e++) {
+        const CalibrationEffort &effort = mEfforts[e];
+        if (!effort.extraction.isExtracted || effort.samplingRate <= 0)
+            continue;
+        const std::vector<WhistleEstimate> &estimates = effort.extraction.estimates;
+        ok = WriteValue(file, (uint32_t)effort.name.size()) && fwrite(effort.name.data(), 1, effort.name.size(), file) == effort.name.size() &&
+             WriteValue(file, effort.numFrames) && WriteValue(file, effort.samplingRate) && WriteValue(file, (int32_t)effort.channel) &&
+             WriteValue(file, (uint8_t)effort.extraction.didFinish) && WriteValue(file, (uint32_t)estimates.size());
+        for (size_t i = 0; ok && i < estimates.size(); i++)
+            ok = WriteValue(file, estimates[i].timeStamp) && WriteValue(file, estimates[i].frequency) && WriteValue(file, estimates[i].confidence);
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok && error)
+        *error = "cannot write " + path;
+    return ok;
+}
+
+bool WhistleCalibrator::LoadExtractions(const std::string &path, int *numLoaded, std::string *error)
+{
+    if (numLoaded)
+        *numLoaded = 0;
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        if (error)
+            *error = "cannot read " + path;
+        return false;
+    }
+    uint32_t magic = 0, version = 0, numSaved = 0;
+    if (!ReadValue(file, &magic) || !ReadValue(file, &version) || !ReadValue(file, &numSaved) ||
+        magic != kCalibrationCacheMagic || version != kCalibrationCacheVersion) {
+        fclose(file);
+        if (error)
+            *error = path + " is not a calibration cache";
+        return false;
+    }
+
+    // efforts by name, several can share one (channels of a file)
+    std::vector<std::pair<std::string, int> > byName(mEfforts.size());
+    for (size_t e = 0; e < mEfforts.size(); e++)
+        byName[e] = std::make_pair(mEfforts[e].name, (int)e);
+    std::sort(byName.begin(), byName.end());
+
+    bool ok = true;
+    std::string name;
+    CalibrationExtraction extraction;
+    for (uint32_t s = 0; ok && s < numSaved; s++) {
+        uint32_t nameLength = 0, numEstimates = 0;
+        int64_t numFrames = 0;
+        float samplingRate = 0;
+        int32_t channel = 0;
+        uint8_t didFinish = 0;
+        ok = ReadValue(file, &nameLength) && nameLength < (1u << 20);
+        if (!ok)
+            break;
+        name.resize(nameLength);
+        ok = (nameLength == 0 || fread(&name[0], 1, nameLength, file) == nameLength) &&
+             ReadValue(file, &numFrames) && ReadValue(file, &samplingRate) && ReadValue(file, &channel) &&
+             ReadValue(file, &didFinish) && ReadValue(file, &numEstimates) && numEstimates < (1u << 24);
+        extraction.estimates.resize(ok ? numEstimates : 0);
+        for (uint32_t i = 0; ok && i < numEstimates; i++)
+            ok = ReadValue(file, &extraction.estimates[i].timeStamp) && ReadValue(file, &extraction.estimates[i].frequency) &&
+                 ReadValue(file, &extraction.estimates[i].confidence);
+        if (!ok)
+            break;
+
+        std::vector<std::pair<std::string, int> >::iterator match =
+            std::lower_bound(byName.begin(), byName.end(), std::make_pair(name, -1));
+        for (; match != byName.end() && match->first == name; ++match) {
+            CalibrationEffort &effort = mEfforts[match->second];
+            if (effort.numFrames != numFrames || effort.samplingRate != samplingRate || effort.channel != channel)
+                continue;
+            effort.extraction.estimates = extraction.estimates;
+            effort.extraction.didFinish = didFinish != 0;
+            effort.extraction.error = effort.extraction.estimates.size() < 2 ? "no whistle found" : "";
+            effort.extraction.isExtracted = true;
+            AlignReferenceCurve(effort); // the references may be new
+            if (numLoaded)
+                (*numLoaded)++;
+        }
+    }
+    fclose(file);
+    if (!ok && error)
+        *error = path + " is truncated";
+    return ok;
+}
+
+//=============================================================================================================
+// Equations and the fit
+
+void WhistleCalibrator::AddEquations(int index, std::vector<Equation> *equations)
+{
+    const CalibrationEffort &effort = mEfforts[index];
+    const CalibrationExtraction &extraction = effort.extraction;
+    const CalibrationReference &reference = effort.reference;
+    const std::vector<WhistleEstimate> &estimates = extraction.estimates;
+    if (!extraction.isExtracted || estimates.size() < 2)
+        return;
+    double temperatureDifference = TemperatureDifference(reference);
+    Equation equation;
+    equation.effort = index;
+
+    // one equation per estimate in the whistle band the reference curve covers, together weighing as much as one measure
+    if (reference.curveTimes.size() >= 2 && reference.curveTimes.size() == reference.curveFlows.size()) {
+        size_t first = equations->size();
+        for (size_t i = 0; i < estimates.size(); i++) {
+            double flow;
+            if (estimates[i].frequency < MIN_FREQUENCY_OF_WHISTLE_IN_HZ || estimates[i].frequency > MAX_FREQUENCY_OF_WHISTLE_IN_HZ ||
+                !InterpolateReference(reference, estimates[i].timeStamp - extraction.referenceLag, &flow))
+                continue; // no whistle makes that
+            BasisAtFrequency(estimates[i].frequency, temperatureDifference, equation.terms);
+            equation.target = flow;
+            equation.kind = kCurveEquation;
+            equations->push_back(equation);
+        }
+        for (size_t i = first; i < equations->size(); i++)
+            (*equations)[i].weight = 1.0/(double)(equations->size() - first);
+    }
+    if (!extraction.didFinish)
+        return; // the volumes would be short
+    equation.weight = 1.0;
+
+    // the peak of the three point median, one wild estimate is not the peak
+    if (!isnan(reference.peakFlowInLitersPerSecond)) {
+        float peak = estimates[0].frequency;
+        for (size_t i = 1; i + 1 < estimates.size(); i++) {
+            float a = estimates[i-1].frequency, b = estimates[i].frequency, c = estimates[i+1].frequency;
+            float median = std::max(std::min(a, b), std::min(std::max(a, b), c));
+            peak = std::max(peak, median);
+        }
+        BasisAtFrequency(peak, temperatureDifference, equation.terms);
+        equation.target = reference.peakFlowInLitersPerSecond;
+        equation.kind = kPEFEquation;
+        equations->push_back(equation);
+    }
+
+    // volumes: the terms integrated over the estimates (trapezoids), FEV1 up to a second after the first
+    bool hasFEVOne = !isnan(reference.fevOneInLiters), hasFVC = !isnan(reference.fvcInLiters);
+    if (!hasFEVOne && !hasFVC)
+        return;
+    double fevOne[kCalibrationMaxNumTerms] = {0}, fvc[kCalibrationMaxNumTerms] = {0};
+    double previous[kCalibrationMaxNumTerms], current[kCalibrationMaxNumTerms];
+    double oneSecond = estimates[0].timeStamp + 1.0;
+    BasisAtFrequency(estimates[0].frequency, temperatureDifference, previous);
+    for (size_t i = 1; i < estimates.size(); i++) {
+        BasisAtFrequency(estimates[i].frequency, temperatureDifference, current);
+        double start = estimates[i-1].timeStamp, end = estimates[i].timeStamp;
+        for (int k = 0; k < kCalibrationMaxNumTerms; k++) {
+            double area = 0.5*(previous[k] + current[k])*(end - start);
+            fvc[k] += area;
+            if (end <= oneSecond) {
+                fevOne[k] += area;
+            }
+            else if (start < oneSecond) {
+                double fraction = (oneSecond - start)/(end - start);
+                double atOneSecond = previous[k] + fraction*(current[k] - previous[k]);
+                fevOne[k] += 0.5*(previous[k] + atOneSecond)*(oneSecond - start);
+            }
+            previous[k] = current[k];
+        }
+    }
+    if (hasFEVOne) {
+        std::copy(fevOne, fevOne + kCalibrationMaxNumTerms, equation.terms);
+        equation.target = reference.fevOneInLiters;
+        equation.kind = kFEVOneEquation;
+        equations->push_back(equation);
+    }
+    if (hasFVC) {
+        std::copy(fvc, fvc + kCalibrationMaxNumTerms, equation.terms);
+        equation.target = reference.fvcInLiters;
+        equation.kind = kFVCEquation;
+        equations->push_back(equation);
+    }
+}
+
+// weighted normal equations over the form's terms, Gaussian elimination with partial pivoting; a term
+// the equations say nothing about (a temperature term without any temperature spread) stays at zero
+static void SolveWeighted(const bool *uses, const double *const *rows, const double *targets, const double *weights,
+                          size_t numRows, double *terms)
+{
+    int index[kCalibrationMaxNumTerms], n = 0;
+    for (int k = 0; k < kCalibrationMaxNumTerms; k++)
+        if (uses[k])
+            index[n++] = k;
+    double A[kCalibrationMaxNumTerms][kCalibrationMaxNumTerms + 1] = {{0}};
+    for (size_t r = 0; r < numRows; r++) {
+        for (int i = 0; i < n; i++) {
+            double wx = weights[r]*rows[r][index[i]];
+            for (int j = 0; j < n; j++)
+                A[i][j] += wx*rows[r][index[j]];
+            A[i][n] += wx*targets[r];
+        }
+    }
+    double largest = 0;
+    for (int i = 0; i < n; i++)
+        largest = std::max(largest, A[i][i]);
+    for (int i = 0; i < n; i++)
+        A[i][i] += 1e-12*largest;
+
+    for (int c = 0; c < n; c++) {
+        int pivot = c;
+        for (int r = c + 1; r < n; r++)
+            if (fabs(A[r][c]) > fabs(A[pivot][c]))
+                pivot = r;
+        for (int j = 0; j <= n; j++)
+            std::swap(A[c][j], A[pivot][j]);
+        if (A[c][c] == 0)
+            continue;
+        for (int r = c + 1; r < n; r++) {
+            double factor = A[r][c]/A[c][c];
+            for (int j = c; j <= n; j++)
+                A[r][j] -= factor*A[c][j];
+        }
+    }
+    double solution[kCalibrationMaxNumTerms] = {0};
+    for (int i = n - 1; i >= 0; i--) {
+        double sum = A[i][n];
+        for (int j = i + 1; j < n; j++)
+            sum -= A[i][j]*solution[j];
+        solution[i] = A[i][i] != 0 ? sum/A[i][i] : 0.0;
+    }
+    std::fill(terms, terms + kCalibrationMaxNumTerms, 0.0);
+    for (int i = 0; i < n; i++)
+        terms[index[i]] = solution[i];
+}
+
+bool WhistleCalibrator::Solve(CalibrationModelForm form, const std::vector<Equation> &equations, CalibrationFit *fit)
+{
+    const bool *uses = kFormUsesTerm[form];
+    int numTerms = 0;
+    for (int k = 0; k < kCalibrationMaxNumTerms; k++)
+        numTerms += uses[k] ? 1 : 0;
+    size_t numEquations = equations.size();
+    if ((int)numEquations < numTerms)
+        return false;
+
+    std::vector<const double*> rows(numEquations);
+    std::vector<double> targets(numEquations), weights(numEquations), residuals(numEquations);
+    for (size_t r = 0; r < numEquations; r++) {
+        rows[r] = equations[r].terms;
+        targets[r] = equations[r].target;
+        weights[r] = equations[r].weight;
+    }
+    double terms[kCalibrationMaxNumTerms];
+    SolveWeighted(uses, &rows[0], &targets[0], &weights[0], numEquations, terms);
+
+    // Huber reweighting, each kind of reference with its own scale; the scales settle first and are then
+    // held, or a scale and the weights it sets can chase each other without converging
+    std::vector<float> magnitudes;
+    double scale[kNumEquationKinds];
+    fit->didConverge = false;
+    fit->numIterations = 0;
+    for (int iteration = 0; iteration < kCalibrationMaxIterations && !fit->didConverge; iteration++) {
+        for (size_t r = 0; r < numEquations; r++) {
+            double prediction = 0;
+            for (int k = 0; k < kCalibrationMaxNumTerms; k++)
+                prediction += terms[k]*rows[r][k];
+            residuals[r] = targets[r] - prediction;
+        }
+        for (int kind = 0; kind < kNumEquationKinds && iteration < kCalibrationNumScaleIterations; kind++) {
+            magnitudes.clear();
+            for (size_t r = 0; r < numEquations; r++)
+                if (equations[r].kind == kind)
+                    magnitudes.push_back((float)fabs(residuals[r]));
+            scale[kind] = magnitudes.empty() ? 0.0 : 1.4826*Median(magnitudes);
+        }
+        for (size_t r = 0; r < numEquations; r++) {
+            double limit = kCalibrationHuberThreshold*scale[equations[r].kind];
+            double magnitude = fabs(residuals[r]);
+            weights[r] = equations[r].weight*(magnitude > limit && magnitude > 0 ? limit/magnitude : 1.0);
+        }
+        double previous[kCalibrationMaxNumTerms];
+        std::copy(terms, terms + kCalibrationMaxNumTerms, previous);
+        SolveWeighted(uses, &rows[0], &targets[0], &weights[0], numEquations, terms);
+        fit->numIterations = iteration + 1;
+
+        double change = 0, size = 0;
+        for (int k = 0; k < kCalibrationMaxNumTerms; k++) {
+            change = std::max(change, fabs(terms[k] - previous[k]));
+            size = std::max(size, fabs(terms[k]));
+        }
+        fit->didConverge = change <= 1e-7*(size > 0 ? size : 1.0);
+    }
+
+    CalibratedWhistle &whistle = fit->whistle;
+    whistle.form = form;
+    whistle.bias = terms[0];
+    whistle.coefficient = terms[1]/kCalibrationFrequencyScale;
+    whistle.quadratic = terms[2]/(kCalibrationFrequencyScale*kCalibrationFrequencyScale);
+    whistle.temperatureCoefficient = terms[3]/kCalibrationFrequencyScale;
+    fit->numEquations = (int64_t)numEquations;
+    return true;
+}
+
+void WhistleCalibrator::Predict(const CalibratedWhistle &whistle, const std::vector<Equation> &equations,
+                                std::vector<double> *predictions)
+{
+    double terms[kCalibrationMaxNumTerms];
+    ScaledTerms(whistle, terms);
+    for (size_t r = 0; r < equations.size(); r++) {
+        double prediction = 0;
+        for (int k = 0; k < kCalibrationMaxNumTerms; k++)
+            prediction += terms[k]*equations[r].terms[k];
+        predictions->push_back(prediction);
+    }
+}
+
+// each effort's equations are next to each other
+void WhistleCalibrator::ScoreEquations(const std::vector<Equation> &equations, const std::vector<double> &predictions,
+                                       CalibrationScores *scores)
+{
+    std::vector<float> errors[kNumEquationKinds];
+    int lastCurve = -1, lastEffort = -1;
+    scores->numEfforts = 0;
+    scores->numCurves = 0;
+    for (size_t r = 0; r < equations.size(); r++) {
+        const Equation &equation = equations[r];
+        if (equation.effort != lastEffort) {
+            scores->numEfforts++;
+            lastEffort = equation.effort;
+        }
+        double error = predictions[r] - equation.target;
+        if (equation.kind == kCurveEquation) {
+            errors[kCurveEquation].push_back((float)fabs(error));
+            if (equation.effort != lastCurve) {
+                scores->numCurves++;
+                lastCurve = equation.effort;
+            }
+        }
+        else if (equation.target != 0) {
+            errors[equation.kind].push_back((float)(100.0*fabs(error)/fabs(equation.target)));
+        }
+    }
+    scores->medianFlowError = Median(errors[kCurveEquation]);
+    scores->medianPEFError = Median(errors[kPEFEquation]);
+    scores->medianFEVOneError = Median(errors[kFEVOneEquation]);
+    scores->medianFVCError = Median(errors[kFVCEquation]);
+}
+
+bool WhistleCalibrator::Fit(CalibrationModelForm form, CalibrationFit *fit, const std::vector<int> *efforts)
+{
+    std::vector<Equation> equations;
+    size_t numEfforts = efforts ? efforts->size() : mEfforts.size();
+    for (size_t i = 0; i < numEfforts; i++)
+        AddEquations(efforts ? (*efforts)[i] : (int)i, &equations);
+    if (!Solve(form, equations, fit))
+        return false;
+    std::vector<double> predictions;
+    Predict(fit->whistle, equations, &predictions);
+    ScoreEquations(equations, predictions, &fit->scores);
+    return true;
+}
+
+void WhistleCalibrator::Score(const CalibratedWhistle &whistle, CalibrationScores *scores, const std::vector<int> *efforts)
+{
+    std::vector<Equation> equations;
+    size_t numEfforts = efforts ? efforts->size() : mEfforts.size();
+    for (size_t i = 0; i < numEfforts; i++)
+        AddEquations(efforts ? (*efforts)[i] : (int)i, &equations);
+    std::vector<double> predictions;
+    Predict(whistle, equations, &predictions);
+    ScoreEquations(equations, predictions, scores);
+}
+
+bool WhistleCalibrator::CrossValidate(CalibrationModelForm form, int numFolds, CalibrationScores *scores)
+{
+    int numEfforts = (int)mEfforts.size();
+    numFolds = std::min(std::max(numFolds, 2), numEfforts);
+    if (numFolds < 2)
+        return false;
+
+    // efforts of a batch are often recorded in order (one person, one day), so the folds are shuffled
+    std::vector<int> order(numEfforts);
+    for (int e = 0; e < numEfforts; e++)
+        order[e] = e;
+    uint32_t state = 2015;
+    for (int e = numEfforts - 1; e > 0; e--) {
+        state = state*1664525u + 1013904223u;
+        std::swap(order[e], order[state % (uint32_t)(e + 1)]);
+    }
+
+    // every held out effort's equations scored together, each predicted by the fit that did not see it
+    std::vector<Equation> equations;
+    std::vector<double> predictions;
+    std::vector<int> training, heldOut;
+    for (int fold = 0; fold < numFolds; fold++) {
+        training.clear();
+        heldOut.clear();
+        for (int i = 0; i < numEfforts; i++)
+            (i % numFolds == fold ? heldOut : training).push_back(order[i]);
+        CalibrationFit fit;
+        if (!Fit(form, &fit, &training))
+            return false;
+        size_t first = equations.size();
+        for (size_t i = 0; i < heldOut.size(); i++)
+            AddEquations(heldOut[i], &equations);
+        std::vector<Equation> foldEquations(equations.begin() + first, equations.end());
+        Predict(fit.whistle, foldEquations, &predictions);
+    }
+    ScoreEquations(equations, predictions, scores);
+    return true;
+}
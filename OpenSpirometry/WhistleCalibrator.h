@@ -0,0 +1,171 @@
+//
+//  WhistleCalibrator.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Fits a printed whistle's frequency to flow model from recorded efforts paired with a reference
+//  spirometer, instead of Sato's coefficients or calculateTermsFromDimensions' guesses. Each effort
+//  goes through EffortSession once (on every core, one session per worker) and the whistle
+//  frequencies behind its flow estimates are kept; that extraction does not depend on the model
+//  being fit, so it is cached (and can be saved to disk) and a refit of any model form only redoes
+//  a few sums over the cached frequencies.
+//
+//  Every model form is linear in its terms, flow = b + a f + c f^2 + d f (T - T0), so each reference
+//  gives linear equations: a reference flow curve one per estimate (after lining its clock up with
+//  the audio), PEF the terms at the peak frequency, FEV1 and FVC the terms integrated over the
+//  estimates like FlowVolumeCurve integrates flow. The equations are solved by iteratively
+//  reweighted least squares with Huber weights (scale from the median absolute residual of each
+//  kind of reference), so estimates the tracker took from noise after the whistle stopped and
+//  efforts with a bad reference do not drag the fit. Cross validation holds out whole efforts.
+//  Volumes start at the first estimate, not at the back extrapolated start.
+
+#ifndef OpenSpirometry_WhistleCalibrator_h
+#define OpenSpirometry_WhistleCalibrator_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "EffortSession.h"
+#include "WhistleModel.h"
+
+#define kCalibrationMaxNumTerms 4
+#define kCalibrationReferenceTemperature 22.0f  // Celsius, T0 of the temperature term (and of efforts without one)
+#define kCalibrationMaxReferenceLag 1.0         // seconds a reference curve's clock is searched against the audio
+#define kCalibrationAlignmentSeconds 1.0       // from the first estimate, compared with the reference curve to find it
+#define kCalibrationLagStep 0.005               // one estimate apart, after a search ten times coarser
+#define kCalibrationHuberThreshold 1.345        // residuals past this many robust deviations are down weighted
+#define kCalibrationMaxIterations 50
+#define kCalibrationNumScaleIterations 10       // the robust scales are estimated again for this many
+#define kCalibrationFrequencyScale 1000.0       // frequencies are fit in kHz so f^2 does not swamp the normal equations
+
+enum CalibrationModelForm {
+    CalibrationModelLinear,                 // b + a f (Sato)
+    CalibrationModelQuadratic,              // b + a f + c f^2
+    CalibrationModelLinearTemperature,      // b + (a + d (T - T0)) f
+    CalibrationModelQuadraticTemperature,   // b + (a + d (T - T0)) f + c f^2
+    kNumCalibrationModelForms
+};
+
+const char *CalibrationModelFormName(CalibrationModelForm form);
+
+// what the reference spirometer measured for one effort, NAN (or an empty curve) for what it did not
+struct CalibrationReference {
+    float peakFlowInLitersPerSecond;
+    float fevOneInLiters;
+    float fvcInLiters;
+    std::vector<float> curveTimes;          // seconds into the audio, give or take kCalibrationMaxReferenceLag
+    std::vector<float> curveFlows;          // liters per second
+    float temperatureInCelsius;             // of the air through the whistle, NAN for kCalibrationReferenceTemperature
+
+    CalibrationReference();
+};
+
+struct CalibratedWhistle {
+    CalibrationModelForm form;
+    double bias;                            // liters per second
+    double coefficient;                     // liters per second per Hz at T0
+    double quadratic;                       // per Hz squared
+    double temperatureCoefficient;          // liters per second per Hz per degree from T0
+
+    CalibratedWhistle();                                // Sato, et al. (WhistleModel())
+    CalibratedWhistle(const WhistleModel &whistle);
+    float FlowFromFrequency(float frequencyInHz, float temperatureInCelsius = kCalibrationReferenceTemperature) const;
+    WhistleModel ModelAtTemperature(float temperatureInCelsius = kCalibrationReferenceTemperature) const;
+};
+
+// errors against the references, over the efforts that have each kind
+struct CalibrationScores {
+    int numEfforts;
+    int numCurves;
+    float medianFlowError;                  // liters per second over the curve samples, NAN without curves
+    float medianPEFError;                   // percent of the reference, NAN without any
+    float medianFEVOneError;
+    float medianFVCError;
+};
+
+struct CalibrationFit {
+    CalibratedWhistle whistle;
+    int64_t numEquations;
+    int numIterations;
+    bool didConverge;
+    CalibrationScores scores;               // on the efforts it was fit to
+};
+
+// what the pipeline found in one effort, all a refit needs
+struct CalibrationExtraction {
+    bool isExtracted;
+    bool didFinish;                         // the effort ended (or the stream did while exhaling)
+    std::string error;                      // why there is nothing, empty if there is
+    std::vector<WhistleEstimate> estimates;
+    double referenceLag;                    // seconds added to the reference curve times to line up with the audio
+};
+
+class WhistleCalibrator {
+
+public:
+    // nominal is the whistle the pipeline runs with (band, tracker slew), it only needs to be close
+    WhistleCalibrator(const WhistleModel &nominal = WhistleModel());
+
+    // an effort file EffortFileReader can open, from its start, one channel of it; returns its index
+    int AddEffortFile(const std::string &path, const CalibrationReference &reference, int channel = 0);
+    // audio in memory, not copied: it has to stay until Extract is done with it
+    int AddEffortAudio(const float *samples, int64_t numFrames, float samplingRate, const CalibrationReference &reference,
+                       const std::string &name);
+    int NumEfforts() { return (int)mEfforts.size(); }
+    const std::string &EffortName(int effort) { return mEfforts[effort].name; }
+    const CalibrationReference &Reference(int effort) { return mEfforts[effort].reference; }
+    const CalibrationExtraction &Extraction(int effort) { return mEfforts[effort].extraction; }
+
+    // runs every effort not extracted yet through the pipeline, numThreads 0 uses every core;
+    // returns the number extracted now
+    int Extract(int numThreads = 0);
+    void ClearExtractions();
+    // extractions keyed by effort name and length, loading fills in the efforts that match and
+    // (re)lines up their reference curves; false (and error) if the file cannot be used
+    bool SaveExtractions(const std::string &path, std::string *error = NULL);
+    bool LoadExtractions(const std::string &path, int *numLoaded = NULL, std::string *error = NULL);
+
+    // over the given efforts (NULL for all of them), false if there are fewer references than terms
+    bool Fit(CalibrationModelForm form, CalibrationFit *fit, const std::vector<int> *efforts = NULL);
+    // k folds of whole efforts, each scored with the fit to the others
+    bool CrossValidate(CalibrationModelForm form, int numFolds, CalibrationScores *scores);
+    void Score(const CalibratedWhistle &whistle, CalibrationScores *scores, const std::vector<int> *efforts = NULL);
+
+protected:
+    enum EquationKind { kCurveEquation, kPEFEquation, kFEVOneEquation, kFVCEquation, kNumEquationKinds };
+
+    struct Equation {
+        double terms[kCalibrationMaxNumTerms]; // bias, kHz, kHz^2, kHz per degree (each integrated for volumes)
+        double target;
+        double weight;                          // curve samples of an effort share one equation's weight
+        int effort;
+        EquationKind kind;
+    };
+
+    struct CalibrationEffort {
+        std::string name;
+        std::string path;                       // empty for audio in memory
+        int channel;
+        const float *samples;
+        int64_t numFrames;
+        float samplingRate;
+        CalibrationReference reference;
+        CalibrationExtraction extraction;
+    };
+
+    void ExtractEfforts(const std::vector<int> &efforts, int numThreads);  // all at one sampling rate
+    void ExtractEffort(CalibrationEffort &effort, EffortSession &session, std::vector<float> *channelBuffer);
+    void AlignReferenceCurve(CalibrationEffort &effort);
+    double LagCorrelation(const CalibrationEffort &effort, double lag);
+    void AddEquations(int effort, std::vector<Equation> *equations);
+    bool Solve(CalibrationModelForm form, const std::vector<Equation> &equations, CalibrationFit *fit);
+    void Predict(const CalibratedWhistle &whistle, const std::vector<Equation> &equations, std::vector<double> *predictions);
+    void ScoreEquations(const std::vector<Equation> &equations, const std::vector<double> &predictions, CalibrationScores *scores);
+
+    WhistleModel mNominal;
+    std::vector<CalibrationEffort> mEfforts;
+};
+
+#endif
@@ -0,0 +1,60 @@
+//
+//  WhistleModel.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "WhistleModel.h"
+#include "SpirometerConstants.h"
+#include <math.h>
+
+WhistleModel::WhistleModel() :
+coefficient(1.0/89.5),
+bias(2.42/89.5),
+quadratic(0),
+useBandLimitedSpectrum(false)
+{
+}
+
+WhistleModel::WhistleModel(double coefficient, double bias, bool useBandLimitedSpectrum) :
+coefficient(coefficient),
+bias(bias),
+quadratic(0),
+useBandLimitedSpectrum(useBandLimitedSpectrum)
+{
+}
+
+float WhistleModel::FlowFromFrequency(float frequencyInHz) const
+{
+    return (float)((quadratic*frequencyInHz + coefficient)*frequencyInHz + bias);
+}
+
+float WhistleModel::FrequencyFromFlow(float flowInLitersPerSecond) const
+{
+    if (quadratic == 0)
+        return (float)((flowInLitersPerSecond - bias)/coefficient);
+    // the root on the rising side of the parabola (the one that becomes the line as quadratic goes to 0)
+    double c = bias - flowInLitersPerSecond;
+    double discriminant = coefficient*coefficient - 4.0*quadratic*c;
+    if (discriminant < 0)
+        return (float)(-coefficient/(2.0*quadratic)); // past the vertex, the closest the model gets
+    double q = -0.5*(coefficient + (coefficient < 0 ? -1.0 : 1.0)*sqrt(discriminant));
+    return (float)(c/q);
+}
+
+float WhistleModel::MinFrequency() const
+{
+    if (!useBandLimitedSpectrum)
+        return MIN_FREQUENCY_OF_WHISTLE_IN_HZ;
+    float frequency = FrequencyFromFlow(MIN_FLOW_OF_WHISTLE_IN_LPS);
+    return frequency > MIN_FREQUENCY_OF_WHISTLE_IN_HZ ? frequency : MIN_FREQUENCY_OF_WHISTLE_IN_HZ; // peaks are never searched below this
+}
+
+float WhistleModel::MaxFrequency() const
+{
+    if (!useBandLimitedSpectrum)
+        return MAX_FREQUENCY_OF_WHISTLE_IN_HZ;
+    return FrequencyFromFlow(MAX_FLOW_OF_WHISTLE_IN_LPS);
+}
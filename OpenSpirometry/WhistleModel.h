@@ -0,0 +1,34 @@
+//
+//  WhistleModel.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Portable version of the frequency to flow model in SpirometryWhistle, for code that runs
+//  without Foundation. A SpirometryWhistle can hand one of these out with its current terms.
+//  A whistle can also ask for band limited analysis: only the frequencies it produces between
+//  MIN_FLOW_OF_WHISTLE_IN_LPS and MAX_FLOW_OF_WHISTLE_IN_LPS are decimated and transformed (ZoomSpectrum).
+//  Sato's whistle is a line; a whistle fit by WhistleCalibrator can bend it with a quadratic term.
+
+#ifndef OpenSpirometry_WhistleModel_h
+#define OpenSpirometry_WhistleModel_h
+
+struct WhistleModel {
+    double coefficient;     // liters per second per Hz
+    double bias;            // liters per second
+    double quadratic;       // liters per second per Hz squared, 0 for a line
+    bool useBandLimitedSpectrum; // same as SpirometryWhistle useBandLimitedSpectrum
+
+    WhistleModel();         // Sato, et al. (same as setWhistleToDefault)
+    WhistleModel(double coefficient, double bias, bool useBandLimitedSpectrum = false);
+
+    float FlowFromFrequency(float frequencyInHz) const;
+    float FrequencyFromFlow(float flowInLitersPerSecond) const;
+
+    // band the spectrum is computed over, the fixed whistle band unless useBandLimitedSpectrum is set
+    float MinFrequency() const;
+    float MaxFrequency() const;
+};
+
+#endif
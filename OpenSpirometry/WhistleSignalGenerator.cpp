@@ -0,0 +1,228 @@
+//
+//  WhistleSignalGenerator.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "WhistleSignalGenerator.h"
+#include <math.h>
+#include <algorithm>
+
+// uniform in [-1, 1), one stream per noise source so changing one leaves the others alone
+static inline float NextNoise(uint32_t *state)
+{
+    *state = *state*1664525u + 1013904223u;
+    return ((float)(*state >> 8)/(float)(1u << 24))*2.0f - 1.0f;
+}
+
+WhistleSignalOptions::WhistleSignalOptions() :
+samplingRate(44100.0f),
+quietBeforeInSeconds(2.5),
+quietAfterInSeconds(2.0),
+whistleAmplitude(0.6f),
+minAmplitudeFraction(0.2f),
+minFlowToSoundInLitersPerSecond(0.7f), // about where the Sato whistle drops below MIN_FREQUENCY_OF_WHISTLE_IN_HZ
+numHarmonics(3),
+breathNoiseLevel(0.0f),
+roomNoiseLevel(0.001f),
+snrInDecibels(INFINITY),
+seed(777)
+{
+    std::fill(harmonicLevels, harmonicLevels + kMaxWhistleHarmonics, 0.0f);
+    harmonicLevels[0] = 1.0f;
+    harmonicLevels[1] = 0.25f;
+    harmonicLevels[2] = 0.1f;
+}
+
+WhistleSignalGenerator::WhistleSignalGenerator(const WhistleModel &whistle, const WhistleSignalOptions &options) :
+mWhistle(whistle),
+mOptions(options),
+mFlowInterval(0.001f)
+{
+    mOptions.numHarmonics = std::max(1, std::min(mOptions.numHarmonics, (int)kMaxWhistleHarmonics));
+}
+
+void WhistleSignalGenerator::SetFlowCurve(const float *flowInLitersPerSecond, int64_t numSamples, float interval)
+{
+    mFlow.assign(flowInLitersPerSecond, flowInLitersPerSecond + numSamples);
+    mFlowInterval = interval;
+}
+
+void WhistleSignalGenerator::SetParametricFlowCurve(float peakFlow, float riseTime, float decayTime, float duration, float interval)
+{
+    int64_t numSamples = (int64_t)(duration/interval);
+    mFlow.resize((size_t)numSamples);
+    for (int64_t i = 0; i < numSamples; i++) {
+        float t = (float)i*interval;
+        mFlow[i] = t < riseTime ? peakFlow*t/riseTime : peakFlow*expf(-(t - riseTime)/decayTime);
+    }
+    mFlowInterval = interval;
+}
+
+void WhistleSignalGenerator::AddCough(const SyntheticCough &cough)
+{
+    mCoughs.push_back(cough);
+}
+
+void WhistleSignalGenerator::AddVoice(const SyntheticVoice &voice)
+{
+    mVoices.push_back(voice);
+}
+
+// level of a harmonic through the formants of an open vowel (about /a/), 1 at the first formant
+static float FormantLevel(float frequency)
+{
+    static const float formants[3] = {700.0f, 1220.0f, 2600.0f};
+    static const float bandwidths[3] = {130.0f, 70.0f, 160.0f};
+    static const float levels[3] = {1.0f, 0.5f, 0.25f};
+    float level = 0;
+    for (int f = 0; f < 3; f++) {
+        float x = (frequency - formants[f])/bandwidths[f];
+        level += levels[f]/(1.0f + x*x);
+    }
+    return level < 1.0f ? level : 1.0f;
+}
+
+int64_t WhistleSignalGenerator::NumSamples() const
+{
+    double seconds = mOptions.quietBeforeInSeconds + EffortDuration() + mOptions.quietAfterInSeconds;
+    return (int64_t)(seconds*mOptions.samplingRate);
+}
+
+float WhistleSignalGenerator::FlowAtTime(double timeInSeconds) const
+{
+    if (timeInSeconds < 0 || mFlow.empty())
+        return 0;
+    double position = timeInSeconds/mFlowInterval;
+    int64_t i = (int64_t)position;
+    float fraction = (float)(position - (double)i);
+    int64_t numSamples = (int64_t)mFlow.size();
+    if (i >= numSamples)
+        return 0;
+    float next = i + 1 < numSamples ? mFlow[i+1] : 0.0f; // falls to zero over the last interval
+    return mFlow[i] + fraction*(next - mFlow[i]);
+}
+
+// trapezoids of the piecewise linear curve, exact for it
+float WhistleSignalGenerator::VolumeAtTime(double timeInSeconds) const
+{
+    double volume = 0;
+    int64_t numSamples = (int64_t)mFlow.size();
+    for (int64_t i = 0; i < numSamples; i++) {
+        double start = (double)i*mFlowInterval;
+        if (start >= timeInSeconds)
+            break;
+        double width = std::min((double)mFlowInterval, timeInSeconds - start);
+        double endFlow = FlowAtTime(start + width);
+        volume += 0.5*(mFlow[i] + endFlow)*width;
+    }
+    return (float)volume;
+}
+
+float WhistleSignalGenerator::PeakFlow() const
+{
+    return mFlow.empty() ? 0 : *std::max_element(mFlow.begin(), mFlow.end());
+}
+
+float WhistleSignalGenerator::FEVOne() const
+{
+    return VolumeAtTime(1.0);
+}
+
+float WhistleSignalGenerator::FVC() const
+{
+    return VolumeAtTime(EffortDuration());
+}
+
+void WhistleSignalGenerator::Generate(std::vector<float> *audio) const
+{
+    const WhistleSignalOptions &o = mOptions;
+    int64_t numSamples = NumSamples();
+    audio->assign((size_t)numSamples, 0.0f);
+    float *out = audio->empty() ? NULL : &(*audio)[0];
+
+    int64_t effortStart = (int64_t)(o.quietBeforeInSeconds*o.samplingRate);
+    int64_t effortEnd = std::min(numSamples, effortStart + (int64_t)(EffortDuration()*o.samplingRate));
+    float peakFlow = PeakFlow();
+    uint32_t breathState = o.seed*2654435761u + 1;
+    uint32_t coughState = o.seed*2246822519u + 2;
+    uint32_t backgroundState = o.seed*3266489917u + 3;
+
+    // whistle and breath noise
+    double phase = 0, whistleEnergy = 0;
+    float breath = 0;
+    const float attackTime = 0.02f;
+    for (int64_t i = effortStart; i < effortEnd; i++) {
+        double t = (double)(i - effortStart)/o.samplingRate;
+        float flow = FlowAtTime(t);
+        float level = peakFlow > 0 ? flow/peakFlow : 0;
+
+        float value = 0;
+        if (flow > o.minFlowToSoundInLitersPerSecond) {
+            float frequency = std::max(0.0f, mWhistle.FrequencyFromFlow(flow));
+            phase += 2.0*M_PI*frequency/o.samplingRate;
+            if (phase > 2.0*M_PI)
+                phase -= 2.0*M_PI;
+            float amplitude = o.whistleAmplitude*(o.minAmplitudeFraction + (1.0f - o.minAmplitudeFraction)*level);
+            if (t < attackTime)
+                amplitude *= (float)(t/attackTime);
+            for (int h = 0; h < o.numHarmonics; h++)
+                value += o.harmonicLevels[h]*sinf((float)((h + 1)*phase));
+            value *= amplitude;
+        }
+        whistleEnergy += (double)value*value;
+
+        breath += 0.1f*(NextNoise(&breathState) - breath); // one pole low pass, most energy below ~700 Hz at 44.1 kHz
+        value += 4.0f*o.breathNoiseLevel*o.whistleAmplitude*level*level*breath;
+        out[i] = value;
+    }
+
+    // coughs, a raised sine envelope over broadband noise
+    for (size_t c = 0; c < mCoughs.size(); c++) {
+        int64_t start = effortStart + (int64_t)(mCoughs[c].timeInSeconds*o.samplingRate);
+        int64_t length = (int64_t)(mCoughs[c].durationInSeconds*o.samplingRate);
+        for (int64_t k = 0; k < length; k++) {
+            if (start + k < 0 || start + k >= numSamples)
+                continue;
+            float envelope = sinf((float)M_PI*(float)k/(float)length);
+            out[start + k] += mCoughs[c].amplitude*envelope*envelope*NextNoise(&coughState);
+        }
+    }
+
+    // voices, harmonics up to 4 kHz with a few percent of vibrato and 30 ms fades
+    for (size_t v = 0; v < mVoices.size(); v++) {
+        const SyntheticVoice &voice = mVoices[v];
+        int64_t start = effortStart + (int64_t)(voice.timeInSeconds*o.samplingRate);
+        int64_t length = (int64_t)(voice.durationInSeconds*o.samplingRate);
+        int64_t fade = std::min(length/2, (int64_t)(0.03*o.samplingRate));
+        int numHarmonics = std::max(1, (int)(4000.0f/voice.pitchInHz));
+        double voicePhase = 0;
+        for (int64_t k = 0; k < length; k++) {
+            if (start + k < 0 || start + k >= numSamples)
+                continue;
+            double t = (double)k/o.samplingRate;
+            float pitch = voice.pitchInHz*(1.0f + 0.03f*sinf((float)(2.0*M_PI*5.0*t)));
+            voicePhase += 2.0*M_PI*pitch/o.samplingRate;
+            if (voicePhase > 2.0*M_PI)
+                voicePhase -= 2.0*M_PI;
+            float value = 0;
+            for (int h = 1; h <= numHarmonics; h++)
+                value += FormantLevel(h*pitch)*sinf((float)(h*voicePhase));
+            float envelope = 1.0f;
+            if (k < fade || length - 1 - k < fade)
+                envelope = 0.5f - 0.5f*cosf((float)M_PI*(float)std::min(k, length - 1 - k)/(float)fade);
+            out[start + k] += voice.amplitude*envelope*value;
+        }
+    }
+
+    // room noise everywhere, background noise at the requested SNR (uniform noise has RMS 1/sqrt(3))
+    float backgroundScale = 0;
+    if (isfinite(o.snrInDecibels) && effortEnd > effortStart) {
+        double whistleRMS = sqrt(whistleEnergy/(double)(effortEnd - effortStart));
+        backgroundScale = (float)(sqrt(3.0)*whistleRMS*pow(10.0, -o.snrInDecibels/20.0));
+    }
+    for (int64_t i = 0; i < numSamples; i++)
+        out[i] += (o.roomNoiseLevel + backgroundScale)*NextNoise(&backgroundState);
+}
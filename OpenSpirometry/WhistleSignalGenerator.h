@@ -0,0 +1,98 @@
+//
+//  WhistleSignalGenerator.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Deterministic synthetic efforts for benchmarks and regression checks: audio of a vortex
+//  whistle driven by a known flow-time curve through a WhistleModel (the SpirometryWhistle
+//  terms), so the pipeline's PEF, FEV1 and FVC can be compared with the truth.
+//
+//  The audio is a quiet lead in (long enough for the silence calibration), the effort, and a
+//  quiet tail. During the effort the fundamental follows the flow with harmonics at fixed
+//  relative levels and a level that grows with flow, plus breath noise (low passed, growing with
+//  flow squared). Coughs are bursts of broadband noise, voice a wandering pitch with harmonics
+//  shaped by the formants of a vowel. Background noise is white and set by its
+//  SNR against the whistle during the effort. Everything random comes from the seed, so the same
+//  options always give the same samples.
+
+#ifndef OpenSpirometry_WhistleSignalGenerator_h
+#define OpenSpirometry_WhistleSignalGenerator_h
+
+#include <stdint.h>
+#include <vector>
+#include "WhistleModel.h"
+
+#define kMaxWhistleHarmonics 8
+
+struct WhistleSignalOptions {
+    float samplingRate;
+    double quietBeforeInSeconds;        // before the effort, covers the 2 s silence calibration
+    double quietAfterInSeconds;
+    float whistleAmplitude;             // of the fundamental at peak flow
+    float minAmplitudeFraction;         // whistle level at zero flow relative to peak flow
+    float minFlowToSoundInLitersPerSecond; // the whistle is silent below this flow
+    int numHarmonics;                   // including the fundamental
+    float harmonicLevels[kMaxWhistleHarmonics]; // relative to the fundamental, [0] is the fundamental
+    float breathNoiseLevel;             // relative to whistleAmplitude at peak flow
+    float roomNoiseLevel;               // always there, even with no background noise
+    float snrInDecibels;                // background noise against the whistle RMS, INFINITY for none
+    uint32_t seed;
+
+    WhistleSignalOptions();             // 44.1 kHz, fundamental plus two harmonics, no background noise
+};
+
+struct SyntheticCough {
+    double timeInSeconds;               // from the start of the effort
+    double durationInSeconds;
+    float amplitude;
+};
+
+struct SyntheticVoice {
+    double timeInSeconds;               // from the start of the effort
+    double durationInSeconds;
+    float amplitude;                    // of the harmonic nearest the first formant
+    float pitchInHz;                    // speaking fundamental, wanders a few percent about it
+};
+
+class WhistleSignalGenerator {
+
+public:
+    WhistleSignalGenerator(const WhistleModel &whistle = WhistleModel(), const WhistleSignalOptions &options = WhistleSignalOptions());
+
+    // flow every interval seconds from the start of the effort (linear in between), zero after the last
+    void SetFlowCurve(const float *flowInLitersPerSecond, int64_t numSamples, float interval);
+    // linear rise to peak flow then an exponential decay, the usual shape of a forced exhalation
+    void SetParametricFlowCurve(float peakFlow, float riseTime, float decayTime, float duration, float interval = 0.001f);
+    void AddCough(const SyntheticCough &cough);
+    void ClearCoughs() { mCoughs.clear(); }
+    void AddVoice(const SyntheticVoice &voice);
+    void ClearVoices() { mVoices.clear(); }
+
+    int64_t NumSamples() const;
+    void Generate(std::vector<float> *audio) const;     // resizes to NumSamples()
+
+    // truth of the flow curve, the effort starting at its first sample
+    float FlowAtTime(double timeInSeconds) const;       // from the start of the effort
+    float PeakFlow() const;
+    float FEVOne() const;                                // volume after one second
+    float FVC() const;
+    float EffortDuration() const { return mFlowInterval*(float)mFlow.size(); }
+    double EffortStartInSeconds() const { return mOptions.quietBeforeInSeconds; } // into the audio
+
+    const WhistleSignalOptions &Options() const { return mOptions; }
+    const WhistleModel &Whistle() const { return mWhistle; }
+
+protected:
+    float VolumeAtTime(double timeInSeconds) const;
+
+    WhistleModel mWhistle;
+    WhistleSignalOptions mOptions;
+    std::vector<float> mFlow;
+    float mFlowInterval;
+    std::vector<SyntheticCough> mCoughs;
+    std::vector<SyntheticVoice> mVoices;
+};
+
+#endif
@@ -0,0 +1,91 @@
+//
+//  ZoomSpectrum.cpp
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+
+#include "ZoomSpectrum.h"
+#include <stdlib.h>
+#include <math.h>
+
+#define kDecimateBlockSize 1024 // input frames decimated at a time
+
+ZoomSpectrum::ZoomSpectrum(int64_t windowLength, float samplingRate, float minFrequency, float maxFrequency, int64_t decimationFactor) :
+mWindowLength(windowLength),
+mSamplingRate(samplingRate),
+mDecimationFactor(decimationFactor < 1 ? 1 : decimationFactor),
+mDecimator(mDecimationFactor, samplingRate, maxFrequency),
+mSpectrum(windowLength/mDecimationFactor, samplingRate/(float)mDecimationFactor, minFrequency, maxFrequency)
+{
+    mDecimatedCapacity = kDecimateBlockSize/mDecimationFactor + 1;
+    mDecimated = (float *)calloc((size_t)mDecimatedCapacity, sizeof(float));
+
+    // the decimated window sums D times fewer samples of (in band) the same signal, so the power is
+    // D^2 lower, and the SlidingSpectrum reference uses sqrt(N/D) instead of sqrt(N): 15*log10(D) dB
+    mdBOffset = 15.0f*log10f((float)mDecimationFactor);
+
+    mNumFramesSeen = 0;
+}
+
+ZoomSpectrum::~ZoomSpectrum()
+{
+    free(mDecimated);
+}
+
+int64_t ZoomSpectrum::DecimationFactorForBand(int64_t windowLength, int64_t hopLength, float samplingRate, float maxFrequency)
+{
+    int64_t factor = (int64_t)(samplingRate/(2.0f*kZoomNyquistMargin*maxFrequency));
+    for (; factor > 1; --factor)
+        if (windowLength % factor == 0 && hopLength % factor == 0)
+            return factor;
+    return 1;
+}
+
+void ZoomSpectrum::AddNewFloatData(const float *newData, const int64_t numFrames)
+{
+    mNumFramesSeen += numFrames;
+    if (mDecimationFactor == 1) {
+        mSpectrum.AddNewFloatData(newData, numFrames);
+        return;
+    }
+
+    for (int64_t position = 0; position < numFrames; position += kDecimateBlockSize) {
+        int64_t numInBlock = numFrames - position < kDecimateBlockSize ? numFrames - position : kDecimateBlockSize;
+        int64_t numDecimated = mDecimator.AddNewFloatData(&newData[position], numInBlock, mDecimated);
+        mSpectrum.AddNewFloatData(mDecimated, numDecimated);
+    }
+}
+
+void ZoomSpectrum::CopydBMagnitudeToBuffer(float *buffer)
+{
+    CopydBMagnitudeToBuffer(buffer, mSpectrum.FirstBin(), mSpectrum.LastBin());
+}
+
+void ZoomSpectrum::CopydBMagnitudeToBuffer(float *buffer, int64_t firstBin, int64_t lastBin)
+{
+    mSpectrum.CopydBMagnitudeToBuffer(buffer, firstBin, lastBin);
+    if (mDecimationFactor == 1)
+        return;
+    firstBin = firstBin > mSpectrum.FirstBin() ? firstBin : mSpectrum.FirstBin();
+    lastBin = lastBin < mSpectrum.LastBin() ? lastBin : mSpectrum.LastBin();
+    for (int64_t k=firstBin; k <= lastBin; ++k)
+        buffer[k] += mdBOffset;
+}
+
+void ZoomSpectrum::FillBufferOutsideBand(float *buffer, float value)
+{
+    int64_t lenBuffer = mWindowLength/2;
+    for (int64_t k=0; k < mSpectrum.FirstBin(); ++k)
+        buffer[k] = value;
+    for (int64_t k=mSpectrum.LastBin()+1; k < lenBuffer; ++k)
+        buffer[k] = value;
+}
+
+void ZoomSpectrum::Clear()
+{
+    mDecimator.Clear();
+    mSpectrum.Clear();
+    mNumFramesSeen = 0;
+}
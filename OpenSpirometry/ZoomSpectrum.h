@@ -0,0 +1,61 @@
+//
+//  ZoomSpectrum.h
+//  OpenSpirometry
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Band limited spectrum for one whistle. The audio is decimated by D (PolyphaseDecimator) and a
+//  SlidingSpectrum of windowLength/D samples at samplingRate/D keeps only the bins of the whistle
+//  band. Bin k is still k*samplingRate/windowLength Hz, so the output drops into the same
+//  windowLength/2 buffer, with the same dB scaling, as the full band SlidingSpectrum, and the
+//  window, history and per sample updates are all D times smaller. With a factor of 1 it is
+//  just the full rate SlidingSpectrum.
+
+#ifndef OpenSpirometry_ZoomSpectrum_h
+#define OpenSpirometry_ZoomSpectrum_h
+
+#include <stdint.h>
+#include "SlidingSpectrum.h"
+#include "PolyphaseDecimator.h"
+
+#define kZoomNyquistMargin 1.25f // new Nyquist must be this far above the top of the band
+
+class ZoomSpectrum {
+
+public:
+    // decimationFactor must divide windowLength (and the hop, so every window ends on a decimated sample)
+    ZoomSpectrum(int64_t windowLength, float samplingRate, float minFrequency, float maxFrequency, int64_t decimationFactor = 1);
+    ~ZoomSpectrum();
+
+    // largest factor that divides windowLength and hopLength and keeps maxFrequency away from the new Nyquist
+    static int64_t DecimationFactorForBand(int64_t windowLength, int64_t hopLength, float samplingRate, float maxFrequency);
+
+    void AddNewFloatData(const float *newData, const int64_t numFrames);
+    void CopydBMagnitudeToBuffer(float *buffer); // only writes bins FirstBin()...LastBin() of a windowLength/2 buffer
+    void CopydBMagnitudeToBuffer(float *buffer, int64_t firstBin, int64_t lastBin); // just those bins (clipped to the band)
+    void FillBufferOutsideBand(float *buffer, float value); // whole windowLength/2 buffer, call once
+    void Clear();
+
+    int64_t FirstBin() { return mSpectrum.FirstBin(); }
+    int64_t LastBin() { return mSpectrum.LastBin(); }
+    int64_t WindowLength() { return mWindowLength; }
+    int64_t DecimationFactor() { return mDecimationFactor; }
+    int64_t NumFramesSeen() { return mNumFramesSeen; } // at the input rate
+    float FrequencyResolution() { return mSamplingRate/(float)mWindowLength; }
+    int64_t NumDecimatedSamples() { return mSpectrum.WindowLength(); } // length of the transform actually kept
+    int64_t DelayInSamples() { return mDecimationFactor > 1 ? mDecimator.GroupDelayInSamples() : 0; } // window lags the input by this much
+
+protected:
+    int64_t mWindowLength;
+    float mSamplingRate;
+    int64_t mDecimationFactor;
+    PolyphaseDecimator mDecimator;
+    SlidingSpectrum mSpectrum;
+    float *mDecimated;      // decimator output for one block of input
+    int64_t mDecimatedCapacity;
+    int64_t mNumFramesSeen;
+    float mdBOffset;        // puts the shorter window back on the full window's dB scale
+};
+
+#endif
@@ -0,0 +1,251 @@
+//
+//  AnalysisBacklogCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Check for AnalysisBacklog: 44.1 kHz audio arrives in callbacks of two hops while the
+//  analysis keeps up, then only manages one window every other callback (quarter speed), then stalls
+//  for a second and comes back faster than real time. For every policy the windows must
+//  arrive in stream order with the right samples, the framer must never drop audio, and the
+//  lag must stay within the policy's bound. Without skipping (what the analyzer did before)
+//  the same load fills the ring and the callback drops audio. Then a threaded run with a
+//  consumer that is slower than real time checks the same things with real concurrency.
+//  Last, an EffortSession behind the backlog on a synthetic effort, with the analysis stalled for
+//  0.8 s in the tail of the blow: after every policy's skips, each estimate must match the one
+//  the same window gives without the stall (the sliding spectrum has to catch up on the audio of
+//  the skipped windows, or start again from the whole window).
+
+#include "BenchUtils.h"
+#include "AnalysisBacklog.h"
+#include "SpirometerConstants.h"
+#include "EffortSession.h"
+#include "WhistleSignalGenerator.h"
+#include <map>
+#include <thread>
+
+static const float kSamplingRate = 44100.0f;
+static const int64_t kWindow = BUFFER_SIZE;
+static const int64_t kHop = BUFFER_SIZE-(BUFFER_OVERLAP);
+static const int64_t kCallbackFrames = 2*kHop;
+
+static const double kStallStartInEffort = 1.5, kStallSeconds = 0.8; // seconds, in the long window's tail
+static const float kMaxStallFrequencyError = 0.01f;     // Hz, against the same window without the stall
+
+static inline float SampleValue(int64_t position) { return (float)(position % 16777216); }
+
+struct RunResult {
+    int64_t numAnalyzed;
+    int64_t numErrors;
+    double maxLagSteady;    // seconds, during the quarter speed part
+    AnalysisLoadStats stats;
+};
+
+// windows analyzed per callback: keeping up, quarter speed, stalled, catching up
+static int WindowsPerCallback(int64_t callback)
+{
+    if (callback < 500) return 2;           // ~5 s keeping up
+    if (callback < 1500) return callback % 2 ? 1 : 0; // ~10 s at quarter speed
+    if (callback < 1600) return 0;          // ~1 s stall
+    return 4;
+}
+
+static RunResult RunScripted(AnalysisBacklogPolicy policy, bool allowSkipping, int64_t maxBacklog)
+{
+    OverlapFramer framer(kWindow, kHop, 4*kWindow);
+    AnalysisBacklog backlog(&framer, kSamplingRate, maxBacklog, policy);
+    std::vector<float> block((size_t)kCallbackFrames);
+    RunResult result = {0, 0, 0.0, AnalysisLoadStats()};
+    int64_t lastStart = -kHop, position = 0;
+
+    for (int64_t callback=0; callback < 2500; ++callback) {
+        for (int64_t i=0; i < kCallbackFrames; ++i)
+            block[(size_t)i] = SampleValue(position + i);
+        position += kCallbackFrames;
+        framer.AddNewFloatData(&block[0], kCallbackFrames);
+
+        int numToAnalyze = WindowsPerCallback(callback);
+        FrameView view;
+        for (int w=0; w < numToAnalyze && backlog.NextFrame(&view, allowSkipping); ++w) {
+            // stream order, whole hops, and the samples that belong there
+            if (view.firstSampleIndex <= lastStart || view.firstSampleIndex % kHop != 0)
+                ++result.numErrors;
+            if (view[0] != SampleValue(view.firstSampleIndex) || view[kWindow-1] != SampleValue(view.firstSampleIndex + kWindow - 1))
+                ++result.numErrors;
+            lastStart = view.firstSampleIndex;
+            backlog.ReleaseFrame();
+            ++result.numAnalyzed;
+            if (callback >= 600 && callback < 1500)
+                result.maxLagSteady = fmax(result.maxLagSteady, backlog.Stats().lagInSeconds);
+        }
+    }
+    result.stats = backlog.Stats();
+    return result;
+}
+
+// expectDrops: the framer is expected to lose audio, which also puts the wrong samples in later windows
+static bool Report(const char *name, const RunResult &r, double maxAllowedLag, double maxAllowedSteadyLag, bool expectDrops)
+{
+    bool ok = expectDrops ? (r.stats.numDroppedSamples > 0 && r.numErrors > 0) :
+                            (r.numErrors == 0 && r.stats.numDroppedSamples == 0 &&
+                             r.stats.maxLagInSeconds <= maxAllowedLag && r.maxLagSteady <= maxAllowedSteadyLag);
+    printf("%-12s analyzed %5lld skipped %5lld dropped %7lld samples, max depth %4lld, lag max %.3f s (slow part %.3f s), %lld bad windows%s\n",
+           name, (long long)r.stats.numFramesAnalyzed, (long long)r.stats.numFramesSkipped,
+           (long long)r.stats.numDroppedSamples, (long long)r.stats.maxQueueDepth,
+           r.stats.maxLagInSeconds, r.maxLagSteady, (long long)r.numErrors, ok ? "" : "  FAIL");
+    return ok;
+}
+
+// producer paced at twice real time, consumer spends about three hops of audio time per window
+static bool RunThreaded(int64_t maxBacklog)
+{
+    OverlapFramer framer(kWindow, kHop, 4*kWindow);
+    AnalysisBacklog backlog(&framer, kSamplingRate, maxBacklog, AnalysisBacklogDropOldest);
+    std::atomic<bool> producerDone(false);
+    int64_t numErrors = 0;
+
+    std::thread consumer([&]() {
+        int64_t lastStart = -kHop;
+        FrameView view;
+        while (true) {
+            if (!backlog.NextFrame(&view)) {
+                if (producerDone.load() && !backlog.NextFrame(&view))
+                    break;
+                std::this_thread::yield();
+                continue;
+            }
+            if (view.firstSampleIndex <= lastStart || view[kWindow/2] != SampleValue(view.firstSampleIndex + kWindow/2))
+                ++numErrors;
+            lastStart = view.firstSampleIndex;
+            double until = WallSeconds() + 3.0*kHop/kSamplingRate/2.0;
+            while (WallSeconds() < until) {} // the "analysis"
+            backlog.ReleaseFrame();
+        }
+    });
+
+    std::vector<float> block((size_t)kCallbackFrames);
+    int64_t position = 0;
+    double start = WallSeconds();
+    for (int64_t callback=0; callback < 1000; ++callback) {
+        for (int64_t i=0; i < kCallbackFrames; ++i)
+            block[(size_t)i] = SampleValue(position + i);
+        position += kCallbackFrames;
+        framer.AddNewFloatData(&block[0], kCallbackFrames);
+        double due = start + (double)position/kSamplingRate/2.0;
+        while (WallSeconds() < due)
+            std::this_thread::yield();
+    }
+    producerDone.store(true);
+    consumer.join();
+
+    AnalysisLoadStats stats = backlog.Stats();
+    // bounded by the backlog plus what arrives while one window is analyzed (generous for a loaded machine)
+    double allowedLag = (double)(maxBacklog + 1)*kHop/kSamplingRate + 0.1;
+    bool ok = numErrors == 0 && stats.numDroppedSamples == 0 && stats.numFramesSkipped > 0 && stats.maxLagInSeconds <= allowedLag;
+    printf("threaded     analyzed %5lld skipped %5lld dropped %7lld samples, lag max %.3f s (allowed %.3f s)%s\n",
+           (long long)stats.numFramesAnalyzed, (long long)stats.numFramesSkipped, (long long)stats.numDroppedSamples,
+           stats.maxLagInSeconds, allowedLag, ok ? "" : "  FAIL");
+    return ok;
+}
+
+// the analyzer's order of work: callbacks into the framer and the stage tracker, windows through the backlog
+// into EffortSession::AnalyzeWindow, nothing analyzed during the stall
+static bool RunSessionStall(const char *name, AnalysisBacklogPolicy policy, int64_t maxBacklog)
+{
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = true;
+    WhistleSignalOptions options;
+    options.samplingRate = kSamplingRate;
+    WhistleSignalGenerator generator(whistle, options);
+    generator.SetParametricFlowCurve(9.0f, 0.10f, 0.9f, 5.0f);
+    std::vector<float> audio;
+    generator.Generate(&audio);
+
+    // every window analyzed, straight through the session
+    std::vector<WhistleEstimate> reference, stalled;
+    EffortSession straight(kSamplingRate, whistle);
+    straight.SetEstimateLog(&reference);
+    straight.AddNewFloatData(&audio[0], (int64_t)audio.size());
+    straight.FinishStream();
+
+    OverlapFramer framer(kWindow, kHop, 4*kWindow);
+    AnalysisBacklog backlog(&framer, kSamplingRate, maxBacklog, policy);
+    EffortStageTracker stages(kSamplingRate);
+    EffortSession session(kSamplingRate, whistle);
+    session.SetEstimateLog(&stalled);
+    int64_t stallStart = (int64_t)((generator.EffortStartInSeconds() + kStallStartInEffort)*kSamplingRate);
+    int64_t stallEnd = stallStart + (int64_t)(kStallSeconds*kSamplingRate);
+    for (int64_t position=0; position < (int64_t)audio.size(); position += kCallbackFrames) {
+        int64_t numFrames = std::min(kCallbackFrames, (int64_t)audio.size() - position);
+        float maxValue = 0;
+        for (int64_t i=0; i < numFrames; ++i)
+            maxValue = std::max(maxValue, audio[(size_t)(position + i)]);
+        framer.AddNewFloatData(&audio[(size_t)position], numFrames);
+        stages.AddBlock(maxValue, numFrames);
+        if (position >= stallStart && position < stallEnd)
+            continue;
+        FrameView view;
+        while (backlog.NextFrame(&view)) {
+            session.AnalyzeWindow(&view, 1, stages.Stage());
+            backlog.ReleaseFrame();
+        }
+    }
+
+    // windows analyzed by both are stamped alike
+    std::map<double, float> frequencyAt;
+    for (size_t e=0; e < reference.size(); ++e)
+        frequencyAt[reference[e].timeStamp] = reference[e].frequency;
+    int64_t numCompared = 0, numOff = 0;
+    float worst = 0;
+    for (size_t e=0; e < stalled.size(); ++e) {
+        std::map<double, float>::const_iterator match = frequencyAt.find(stalled[e].timeStamp);
+        if (match == frequencyAt.end() || stalled[e].timeStamp*kSamplingRate < stallEnd - kWindow)
+            continue;
+        float error = fabsf(stalled[e].frequency - match->second);
+        numCompared++;
+        if (error > kMaxStallFrequencyError)
+            numOff++;
+        worst = std::max(worst, error);
+    }
+    AnalysisLoadStats stats = backlog.Stats();
+    bool ok = numOff == 0 && numCompared > 0 && stats.numFramesSkipped > 0;
+    printf("%-12s session stalled %.1f s: %lld windows skipped, %lld estimates after it compared, %lld off by more than %.2f Hz, worst %.3f Hz%s\n",
+           name, kStallSeconds, (long long)stats.numFramesSkipped, (long long)numCompared, (long long)numOff,
+           kMaxStallFrequencyError, worst, ok ? "" : "  FAIL");
+    return ok;
+}
+
+int main()
+{
+    const int64_t maxBacklog = (int64_t)(MAX_ANALYSIS_LAG_IN_SECONDS*kSamplingRate/kHop);
+    const double hopSeconds = kHop/kSamplingRate;
+    const double backlogSeconds = maxBacklog*hopSeconds;
+    bool ok = true;
+
+    printf("window %lld, hop %lld, max backlog %lld windows (%.2f s)\n", (long long)kWindow, (long long)kHop,
+           (long long)maxBacklog, backlogSeconds);
+
+    // drop oldest: never more than maxBacklog windows behind
+    ok = Report("drop oldest", RunScripted(AnalysisBacklogDropOldest, true, maxBacklog),
+                backlogSeconds, backlogSeconds, false) && ok;
+    // coalesce: once behind, always the newest window
+    ok = Report("coalesce", RunScripted(AnalysisBacklogCoalesce, true, maxBacklog),
+                backlogSeconds, backlogSeconds, false) && ok;
+    // degrade hop: the step grows with the backlog (at quarter speed it settles near every 4th window),
+    // the backlog itself is capped at kMaxDegradedBacklogFactor times the limit
+    ok = Report("degrade hop", RunScripted(AnalysisBacklogDegradeHop, true, maxBacklog),
+                kMaxDegradedBacklogFactor*backlogSeconds, kMaxDegradedBacklogFactor*backlogSeconds, false) && ok;
+    // no skipping: the ring fills and new audio is lost
+    ok = Report("no skipping", RunScripted(AnalysisBacklogDropOldest, false, maxBacklog),
+                0, 0, true) && ok;
+
+    ok = RunThreaded(maxBacklog) && ok;
+
+    ok = RunSessionStall("drop oldest", AnalysisBacklogDropOldest, maxBacklog) && ok;
+    ok = RunSessionStall("coalesce", AnalysisBacklogCoalesce, maxBacklog) && ok;
+    ok = RunSessionStall("degrade hop", AnalysisBacklogDegradeHop, maxBacklog) && ok;
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,385 @@
+//
+//  ArtifactDetectionBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Checks ArtifactDetector (USE_ARTIFACT_DETECTOR) against what it replaces, counting fundamentals
+//  from the whole band peak search to call a cough. First how well it classifies: synthetic efforts
+//  from WhistleSignalGenerator with coughs, voice before and during the blow, breath and background
+//  noise, where what each window holds is known, give a confusion table of the frames (windows
+//  that straddle a change are left out) and the artifacts it timed next to the true ones. Then
+//  what it costs and saves per window: the features against the dB conversion and peak search of
+//  the whole band, on the same windows. Last, EffortSession with and without it, with the tracker
+//  and with the peak finder: windows searched and skipped, CPU time per second of audio, the
+//  errors of PEF, FEV1 and FVC and the errors the effort was flagged with. Recordings given on
+//  the command line (.effort, WAV) have no truth, their frame counts, artifacts and sessions are
+//  reported.
+//
+//  usage: ArtifactDetectionBenchmark [-r repeats] [file.effort|file.wav ...]
+
+#include "BenchUtils.h"
+#include "WhistleSignalGenerator.h"
+#include "ArtifactDetector.h"
+#include "ZoomSpectrum.h"
+#include "SpectrumPeakFinder.h"
+#include "EffortSession.h"
+#include "EffortFileReader.h"
+#include <algorithm>
+#include <string>
+#include <string.h>
+
+static double Median(std::vector<double> v)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[v.size()/2];
+}
+
+static FrameView WholeFrame(const std::vector<float> &audio, int64_t end)
+{
+    FrameView frame;
+    frame.first = &audio[(size_t)(end - BUFFER_SIZE)];
+    frame.firstLength = BUFFER_SIZE;
+    frame.second = NULL;
+    frame.secondLength = 0;
+    frame.firstSampleIndex = end - BUFFER_SIZE;
+    return frame;
+}
+
+struct Scenario {
+    const char *name;
+    float samplingRate;
+    float peakFlow, decayTime;
+    float breathNoiseLevel;
+    float snrInDecibels;
+    SyntheticCough cough;       // none if its duration is 0
+    SyntheticVoice voice;       // none if its duration is 0
+};
+
+//=============================================================================================================
+// Classification against what the generator put in
+
+// what the audio at time (seconds into it) holds, the way the detector ranks it
+static FrameClass TrueClass(const WhistleSignalGenerator &truth, const Scenario &scenario, double time)
+{
+    double t = time - truth.EffortStartInSeconds();
+    if (scenario.cough.durationInSeconds > 0 && t >= scenario.cough.timeInSeconds &&
+        t < scenario.cough.timeInSeconds + scenario.cough.durationInSeconds)
+        return FrameClassCough;
+    if (t >= 0 && t < truth.EffortDuration() && truth.FlowAtTime(t) >= truth.Options().minFlowToSoundInLitersPerSecond)
+        return FrameClassWhistle;
+    if (scenario.voice.durationInSeconds > 0 && t >= scenario.voice.timeInSeconds &&
+        t < scenario.voice.timeInSeconds + scenario.voice.durationInSeconds)
+        return FrameClassVoice;
+    return FrameClassNoise;
+}
+
+static void PrintArtifacts(ArtifactDetector &detector)
+{
+    for (int64_t a=0; a < detector.NumArtifacts(); ++a) {
+        const ArtifactInterval &artifact = detector.Artifact(a);
+        printf("    detected %-6s %6.3f - %6.3f s\n", FrameClassName(artifact.kind), artifact.startTime, artifact.endTime);
+    }
+    if (detector.NumDroppedArtifacts() > 0)
+        printf("    and %lld more not kept\n", (long long)detector.NumDroppedArtifacts());
+}
+
+static void Classify(const Scenario &scenario, const std::vector<float> &audio, const WhistleSignalGenerator &truth,
+                     int64_t confusion[kNumFrameClasses][kNumFrameClasses])
+{
+    const float samplingRate = scenario.samplingRate;
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    const WhistleModel &whistle = truth.Whistle();
+    ArtifactDetector detector(samplingRate, whistle.MinFrequency(), whistle.MaxFrequency(), hop/(double)samplingRate);
+
+    int64_t counts[kNumFrameClasses][kNumFrameClasses] = {{0}};
+    int64_t numAmbiguous = 0;
+    for (int64_t end = BUFFER_SIZE; end <= (int64_t)audio.size(); end += hop) {
+        FrameClass detected = detector.Classify(WholeFrame(audio, end));
+        // the detector sees the newest ARTIFACT_WINDOW_SIZE samples, both ends of them have to agree
+        FrameClass first = TrueClass(truth, scenario, (end - ARTIFACT_WINDOW_SIZE)/(double)samplingRate);
+        FrameClass last = TrueClass(truth, scenario, (end - 1)/(double)samplingRate);
+        if (first != last) {
+            numAmbiguous++;
+            continue;
+        }
+        counts[last][detected]++;
+    }
+    detector.Finish();
+
+    printf("  %s (%lld windows straddle a change)\n", scenario.name, (long long)numAmbiguous);
+    printf("    %-8s", "truth");
+    for (int d=0; d < kNumFrameClasses; ++d)
+        printf(" %8s", FrameClassName((FrameClass)d));
+    printf("   correct\n");
+    for (int t=0; t < kNumFrameClasses; ++t) {
+        int64_t total = 0;
+        for (int d=0; d < kNumFrameClasses; ++d)
+            total += counts[t][d];
+        if (total == 0)
+            continue;
+        printf("    %-8s", FrameClassName((FrameClass)t));
+        for (int d=0; d < kNumFrameClasses; ++d) {
+            printf(" %8lld", (long long)counts[t][d]);
+            confusion[t][d] += counts[t][d];
+        }
+        printf("   %6.1f%%\n", 100.0*counts[t][t]/total);
+    }
+
+    double effortStart = truth.EffortStartInSeconds();
+    if (scenario.cough.durationInSeconds > 0)
+        printf("    true     cough  %6.3f - %6.3f s\n", effortStart + scenario.cough.timeInSeconds,
+               effortStart + scenario.cough.timeInSeconds + scenario.cough.durationInSeconds);
+    if (scenario.voice.durationInSeconds > 0)
+        printf("    true     voice  %6.3f - %6.3f s\n", effortStart + scenario.voice.timeInSeconds,
+               effortStart + scenario.voice.timeInSeconds + scenario.voice.durationInSeconds);
+    PrintArtifacts(detector);
+}
+
+//=============================================================================================================
+// Cost per window: the features against the whole band search they let a window skip
+
+static void TimeFeatures(const std::vector<float> &audio, float samplingRate, int numRepeats)
+{
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    const int64_t length = BUFFER_SIZE/2;
+    WhistleModel whistle;
+    ArtifactDetector detector(samplingRate, whistle.MinFrequency(), whistle.MaxFrequency(), hop/(double)samplingRate);
+    // the spectrum and search EffortSession uses without the tracker (whole band, not band limited)
+    ZoomSpectrum spectrum(BUFFER_SIZE, samplingRate, MIN_FREQUENCY_OF_WHISTLE_IN_HZ, MAX_FREQUENCY_OF_WHISTLE_IN_HZ);
+    SpectrumPeakFinder finder(spectrum.FrequencyResolution(), length);
+    std::vector<SpectrumPeak> peaks((size_t)SpectrumPeakFinder::MaxNumPeaks(length, PEAK_WINDOW_SIZE));
+    std::vector<float> magnitude((size_t)length);
+    spectrum.FillBufferOutsideBand(&magnitude[0], SPECTRUM_FLOOR_DB);
+    int64_t searchLength = std::min<int64_t>(spectrum.LastBin() + 1 + (PEAK_WINDOW_SIZE), length);
+
+    int64_t numWindows = ((int64_t)audio.size() - BUFFER_SIZE)/hop + 1;
+    std::vector<double> featureTimes((size_t)numWindows, 1e300), searchTimes((size_t)numWindows, 1e300);
+    std::vector<FrameClass> classes((size_t)numWindows);
+    volatile int64_t sink = 0;
+    for (int r=0; r < numRepeats; ++r) {
+        detector.Clear();
+        spectrum.Clear();
+        spectrum.AddNewFloatData(&audio[0], BUFFER_SIZE - hop);
+        for (int64_t w=0; w < numWindows; ++w) {
+            int64_t end = BUFFER_SIZE + w*hop;
+            spectrum.AddNewFloatData(&audio[(size_t)(end - hop)], hop);
+
+            // wall clock, the process CPU clock is too coarse for one window
+            double start = WallSeconds();
+            classes[(size_t)w] = detector.Classify(WholeFrame(audio, end));
+            double middle = WallSeconds();
+            spectrum.CopydBMagnitudeToBuffer(&magnitude[0]);
+            sink += finder.GetFundamentalPeaks(&magnitude[0], searchLength, PEAK_WINDOW_SIZE, PEAK_DBMAG_SUSTAINED,
+                                               MIN_FREQUENCY_OF_WHISTLE_IN_HZ, &peaks[0], (int64_t)peaks.size(), 3);
+            double stop = WallSeconds();
+            featureTimes[(size_t)w] = std::min(featureTimes[(size_t)w], 1e9*(middle - start));
+            searchTimes[(size_t)w] = std::min(searchTimes[(size_t)w], 1e9*(stop - middle));
+        }
+    }
+
+    printf("cost per window (%lld windows of a coughed effort, best of %d)\n", (long long)numWindows, numRepeats);
+    printf("  %-8s %8s %14s %14s\n", "class", "windows", "features ns", "search ns");
+    double featureTotal = 0, searchTotal = 0, skippedTotal = 0;
+    for (int c=0; c < kNumFrameClasses; ++c) {
+        std::vector<double> features, search;
+        for (int64_t w=0; w < numWindows; ++w) {
+            if (classes[(size_t)w] != (FrameClass)c)
+                continue;
+            features.push_back(featureTimes[(size_t)w]);
+            search.push_back(searchTimes[(size_t)w]);
+        }
+        for (size_t i=0; i < features.size(); ++i) {
+            featureTotal += features[i];
+            searchTotal += search[i];
+            skippedTotal += c == FrameClassWhistle ? 0 : search[i];
+        }
+        if (!features.empty())
+            printf("  %-8s %8d %14.0f %14.0f\n", FrameClassName((FrameClass)c), (int)features.size(), Median(features),
+                   Median(search));
+    }
+    printf("  searching every window %.2f ms, features plus the windows with a tone %.2f ms (%.0f%% of it)\n",
+           1e-6*searchTotal, 1e-6*(featureTotal + searchTotal - skippedTotal),
+           100.0*(featureTotal + searchTotal - skippedTotal)/std::max(1.0, searchTotal));
+}
+
+//=============================================================================================================
+// EffortSession with and without the detector
+
+struct SessionStats {
+    int64_t numAnalyzed;
+    int64_t numSkipped;
+    double cpuMillisecondsPerSecond;
+    bool hasResults;
+    FlowVolumeResults results;
+    std::string errors;         // keys of the effort's errors
+};
+
+static void RunSession(const std::vector<float> &audio, float samplingRate, bool useTracker, bool useDetector,
+                       SessionStats *stats)
+{
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    WhistleModel whistle;
+    EffortSession session(samplingRate, whistle);
+    session.SetFundamentalTracking(useTracker);
+    session.SetArtifactDetection(useDetector);
+
+    int64_t numAudio = (int64_t)audio.size();
+    double start = CPUSeconds();
+    for (int64_t p=0; p < numAudio && session.CurrentStage() < SpirometryStageIsFinished; p += hop)
+        session.AddNewFloatData(&audio[(size_t)p], std::min(hop, numAudio - p));
+    session.FinishStream();
+    stats->cpuMillisecondsPerSecond = 1e3*(CPUSeconds() - start)/(numAudio/(double)samplingRate);
+    stats->numAnalyzed = session.NumFramesAnalyzed();
+    stats->numSkipped = session.NumFramesSkipped();
+    stats->hasResults = session.GetResults(&stats->results);
+    stats->errors.clear();
+    for (int64_t e=0; stats->hasResults && e < stats->results.numErrors; ++e) {
+        const EffortError &error = stats->results.errors[e];
+        if (error.key == "Cough" || error.key == "Voice")
+            stats->errors += (stats->errors.empty() ? "" : ", ") + error.message;
+    }
+}
+
+static double PercentError(float measured, float truth)
+{
+    return 100.0*fabs(measured - truth)/truth;
+}
+
+static void CompareSessions(const char *name, const std::vector<float> &audio, float samplingRate,
+                            const WhistleSignalGenerator *truth)
+{
+    printf("  %s\n", name);
+    for (int m=0; m < 4; ++m) {
+        bool useTracker = m < 2, useDetector = m % 2 == 1;
+        SessionStats stats;
+        RunSession(audio, samplingRate, useTracker, useDetector, &stats);
+        printf("    %-7s %-11s %5lld searched %5lld skipped %6.1f ms/s", useTracker ? "tracker" : "peaks",
+               useDetector ? "detector" : "no detector", (long long)(stats.numAnalyzed - stats.numSkipped),
+               (long long)stats.numSkipped, stats.cpuMillisecondsPerSecond);
+        if (!stats.hasResults)
+            printf("  (no effort)");
+        else if (truth)
+            printf("  PEF %5.1f%% FEV1 %5.1f%% FVC %5.1f%%", PercentError(stats.results.peakFlowInLitersPerSecond, truth->PeakFlow()),
+                   PercentError(stats.results.fevOneInLiters, truth->FEVOne()), PercentError(stats.results.fvcInLiters, truth->FVC()));
+        else
+            printf("  PEF %5.2f FEV1 %5.2f FVC %5.2f", stats.results.peakFlowInLitersPerSecond, stats.results.fevOneInLiters,
+                   stats.results.fvcInLiters);
+        printf("\n");
+        if (!stats.errors.empty())
+            printf("        %s\n", stats.errors.c_str());
+    }
+}
+
+static bool ReadRecording(const char *path, std::vector<float> *audio, float *samplingRate)
+{
+    EffortFileReader reader;
+    std::string error;
+    if (!reader.Open(path, &error)) {
+        fprintf(stderr, "%s: %s\n", path, error.c_str());
+        return false;
+    }
+    // channel 0, like the app
+    audio->resize((size_t)reader.NumFrames());
+    EffortSpan span;
+    int64_t numRead;
+    while ((numRead = reader.Read(65536, &span)) > 0)
+        for (int64_t i=0; i < numRead; ++i)
+            (*audio)[(size_t)(span.firstFrame + i)] = span.samples[i*span.numChannels];
+    *samplingRate = (float)reader.SamplingRate();
+    return true;
+}
+
+static void ClassifyRecording(const char *path, const std::vector<float> &audio, float samplingRate)
+{
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    WhistleModel whistle;
+    ArtifactDetector detector(samplingRate, whistle.MinFrequency(), whistle.MaxFrequency(), hop/(double)samplingRate);
+    for (int64_t end = BUFFER_SIZE; end <= (int64_t)audio.size(); end += hop)
+        detector.Classify(WholeFrame(audio, end));
+    detector.Finish();
+    printf("  %s\n   ", path);
+    for (int c=0; c < kNumFrameClasses; ++c)
+        printf(" %s %lld", FrameClassName((FrameClass)c), (long long)detector.NumFrames((FrameClass)c));
+    printf("\n");
+    PrintArtifacts(detector);
+}
+
+int main(int argc, char **argv)
+{
+    int numRepeats = 5;
+    std::vector<const char *> paths;
+    for (int a=1; a < argc; ++a) {
+        if (strcmp(argv[a], "-r") == 0 && a+1 < argc)
+            numRepeats = std::max(1, atoi(argv[++a]));
+        else
+            paths.push_back(argv[a]);
+    }
+
+    const SyntheticCough noCough = {0, 0, 0};
+    const SyntheticVoice noVoice = {0, 0, 0, 0};
+    const Scenario scenarios[] = {
+        //  name            Fs        PEF   decay  breath  SNR       cough                voice
+        {"normal",        44100.0f,  9.0f, 0.9f, 0.0f,   INFINITY, noCough,             noVoice},
+        {"weak",          44100.0f,  2.5f, 0.8f, 0.0f,   INFINITY, noCough,             noVoice},
+        {"cough",         44100.0f,  9.0f, 0.9f, 0.0f,   INFINITY, {1.5, 0.15, 0.8f},   noVoice},
+        {"cough_late",    44100.0f,  9.0f, 0.9f, 0.0f,   INFINITY, {3.0, 0.2, 0.5f},    noVoice},
+        {"voice_before",  44100.0f,  9.0f, 0.9f, 0.0f,   INFINITY, noCough,             {-1.5, 1.0, 0.1f, 120.0f}},
+        {"voice_during",  44100.0f,  9.0f, 0.9f, 0.0f,   INFINITY, noCough,             {3.0, 1.0, 0.1f, 210.0f}},
+        {"breath",        44100.0f,  9.0f, 0.9f, 0.5f,   INFINITY, noCough,             noVoice},
+        {"snr_20db",      44100.0f,  9.0f, 0.9f, 0.0f,   20.0f,    noCough,             noVoice},
+        {"snr_10db",      44100.0f,  9.0f, 0.9f, 0.0f,   10.0f,    noCough,             noVoice},
+        {"cough_48k",     48000.0f,  9.0f, 0.9f, 0.0f,   INFINITY, {1.5, 0.15, 0.8f},   noVoice},
+    };
+    int numScenarios = (int)(sizeof(scenarios)/sizeof(Scenario));
+    std::vector<std::vector<float> > audio((size_t)numScenarios);
+    std::vector<WhistleSignalGenerator*> truths((size_t)numScenarios);
+    for (int s=0; s < numScenarios; ++s) {
+        WhistleSignalOptions options;
+        options.samplingRate = scenarios[s].samplingRate;
+        options.breathNoiseLevel = scenarios[s].breathNoiseLevel;
+        options.snrInDecibels = scenarios[s].snrInDecibels;
+        truths[(size_t)s] = new WhistleSignalGenerator(WhistleModel(), options);
+        truths[(size_t)s]->SetParametricFlowCurve(scenarios[s].peakFlow, 0.1f, scenarios[s].decayTime, 5.0f);
+        if (scenarios[s].cough.durationInSeconds > 0)
+            truths[(size_t)s]->AddCough(scenarios[s].cough);
+        if (scenarios[s].voice.durationInSeconds > 0)
+            truths[(size_t)s]->AddVoice(scenarios[s].voice);
+        truths[(size_t)s]->Generate(&audio[(size_t)s]);
+    }
+
+    printf("frames by what they hold (rows) and what the detector called them (columns)\n");
+    int64_t confusion[kNumFrameClasses][kNumFrameClasses] = {{0}};
+    for (int s=0; s < numScenarios; ++s)
+        Classify(scenarios[s], audio[(size_t)s], *truths[(size_t)s], confusion);
+    printf("  all synthetic\n");
+    for (int t=0; t < kNumFrameClasses; ++t) {
+        int64_t total = 0;
+        for (int d=0; d < kNumFrameClasses; ++d)
+            total += confusion[t][d];
+        int64_t numArtifacts = (t == FrameClassCough ? 0 : confusion[t][FrameClassCough]) + (t == FrameClassVoice ? 0 : confusion[t][FrameClassVoice]);
+        printf("    %-8s %6lld windows %6.1f%% correct, %lld called another artifact\n", FrameClassName((FrameClass)t),
+               (long long)total, total > 0 ? 100.0*confusion[t][t]/total : 0.0, (long long)numArtifacts);
+    }
+
+    TimeFeatures(audio[2], scenarios[2].samplingRate, numRepeats);
+
+    printf("efforts with and without the detector\n");
+    for (int s=0; s < numScenarios; ++s)
+        CompareSessions(scenarios[s].name, audio[(size_t)s], scenarios[s].samplingRate, truths[(size_t)s]);
+    for (int s=0; s < numScenarios; ++s)
+        delete truths[(size_t)s];
+
+    for (size_t f=0; f < paths.size(); ++f) {
+        std::vector<float> recording;
+        float samplingRate;
+        if (!ReadRecording(paths[f], &recording, &samplingRate))
+            return 2;
+        ClassifyRecording(paths[f], recording, samplingRate);
+        CompareSessions(paths[f], recording, samplingRate, NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+//
+//  BenchUtils.h
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Small helpers shared by the desktop benchmarks: timers and a quick whistle-like test signal.
+
+#ifndef OpenSpirometryBench_BenchUtils_h
+#define OpenSpirometryBench_BenchUtils_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include <chrono>
+
+// wall clock in seconds
+static inline double WallSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// process CPU time in seconds
+static inline double CPUSeconds()
+{
+    return (double)clock()/(double)CLOCKS_PER_SEC;
+}
+
+// deterministic noise so every run sees the same input
+static inline float BenchNoise(uint32_t *state)
+{
+    *state = *state*1664525u + 1013904223u;
+    return ((float)(*state >> 8)/(float)(1u << 24))*2.0f - 1.0f;
+}
+
+// Quick effort-like signal: fundamental sweeps up to peakFrequency in the first 0.3 s, then decays
+// exponentially (like the flow curve), with a second harmonic and some broadband noise.
+static inline std::vector<float> MakeWhistleSweep(float samplingRate, float seconds, float peakFrequency)
+{
+    std::vector<float> signal((size_t)(samplingRate*seconds));
+    uint32_t state = 12345;
+    double phase = 0;
+    for (size_t i=0; i < signal.size(); ++i) {
+        double t = (double)i/samplingRate;
+        double f = t < 0.3 ? 80.0 + (peakFrequency-80.0)*t/0.3 : 80.0 + (peakFrequency-80.0)*exp(-(t-0.3)/1.2);
+        phase += 2.0*M_PI*f/samplingRate;
+        signal[i] = (float)(0.5*sin(phase) + 0.15*sin(2.0*phase)) + 0.02f*BenchNoise(&state);
+    }
+    return signal;
+}
+
+#endif
@@ -0,0 +1,287 @@
+//
+//  BoxedFlowVolumeReference.h
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Stand in for the NSNumber/NSMutableArray version of FlowVolumeDataAnalyzer on machines
+//  without Foundation. Every sample is a separately allocated box held in a growable array of
+//  pointers, and the same unbox/rebox steps happen in the same places (subarrays and spline
+//  arrays for every estimate, unboxing to C arrays and reboxing around the FIR filter and back
+//  extrapolation, KVC style scans for the peak and FEV1). It leaves out message sends and
+//  retain/release, so it understates what the device pays.
+
+#ifndef OpenSpirometryBench_BoxedFlowVolumeReference_h
+#define OpenSpirometryBench_BoxedFlowVolumeReference_h
+
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include "SpirometerConstants.h"
+
+struct BoxedNumber { double value; };
+typedef std::vector<BoxedNumber*> BoxedArray;
+
+class BoxedFlowVolumeReference {
+
+public:
+    BoxedFlowVolumeReference() : mInitialTime(0), mInterval(1.0f/100.0f) {}
+    ~BoxedFlowVolumeReference() { Clear(); }
+
+    static BoxedNumber *Box(double value) { BoxedNumber *b = new BoxedNumber; b->value = value; return b; }
+
+    void Clear()
+    {
+        BoxedArray *arrays[5] = {&mFlow, &mVolume, &mTime, &mDynamicFlow, &mDynamicTime};
+        for (int a=0; a < 5; ++a) {
+            for (size_t i=0; i < arrays[a]->size(); ++i)
+                delete (*arrays[a])[i];
+            arrays[a]->clear();
+            BoxedArray().swap(*arrays[a]); // removeAllObjects gives the storage back too
+        }
+        ClearResults();
+    }
+
+    void AddFlowEstimate(float flow, double time)
+    {
+        mDynamicFlow.push_back(Box(flow));
+        mDynamicTime.push_back(Box(time));
+
+        if (mTime.size() == 0) {
+            mInitialTime = (float)time;
+            mTime.push_back(Box(0));
+            mFlow.push_back(Box(flow));
+            mVolume.push_back(Box(0));
+        }
+        else if (mTime.size() == 1) {
+            float timeX0 = (float)mTime.back()->value;
+            float timeX1 = (float)(time - mInitialTime);
+            float flowX0 = (float)mFlow.back()->value;
+            float slope = (flow - flowX0)/(timeX1 - timeX0);
+            float fillTime = timeX0 + mInterval;
+            float newVolume = (float)mVolume.back()->value;
+            while (fillTime <= timeX1) {
+                float newFlow = flowX0 + slope*(fillTime - timeX0);
+                newVolume += newFlow*mInterval;
+                mFlow.push_back(Box(newFlow));
+                mVolume.push_back(Box(newVolume));
+                mTime.push_back(Box(fillTime));
+                fillTime += mInterval;
+            }
+        }
+        else if (mDynamicTime.size() >= 3) {
+            size_t last = mDynamicTime.size();
+            size_t num = last < 5 ? last : 5;
+            // subarrayWithRange + mutableCopy, then a box per zero referenced time
+            BoxedArray timeX(mDynamicTime.begin() + (last - num), mDynamicTime.end());
+            BoxedArray flowX(mDynamicFlow.begin() + (last - num), mDynamicFlow.end());
+            for (size_t i=0; i < timeX.size(); ++i)
+                timeX[i] = Box(timeX[i]->value - mInitialTime);
+
+            BoxedSpline spline(timeX, flowX);
+            float fillTime = (float)mTime.back()->value + mInterval;
+            float newVolume = (float)mVolume.back()->value;
+            while (fillTime <= (float)timeX.back()->value) {
+                float newFlow = spline.Interpolate(fillTime);
+                if (newFlow < 0)
+                    newFlow = (float)mFlow.back()->value;
+                newVolume += newFlow*mInterval;
+                mFlow.push_back(Box(newFlow));
+                mVolume.push_back(Box(newVolume));
+                mTime.push_back(Box(fillTime));
+                fillTime += mInterval;
+            }
+            for (size_t i=0; i < timeX.size(); ++i)
+                delete timeX[i];
+        }
+    }
+
+    // the dictionary: three copied arrays of boxes plus boxed scalars
+    void FinalizeCurves()
+    {
+        ClearResults();
+        BoxedArray filtered = FilterArray(mFlow);
+        BackExtrapolate(filtered);
+        mResultFlow = filtered;
+        mResultVolume = mVolume;    // initWithArray: copies the pointers (retains, no new boxes)
+        mResultTime = mTime;
+        mResultScalars.push_back(Box(PeakFlow()));
+        mResultScalars.push_back(Box(FEVOne()));
+        mResultScalars.push_back(Box(FVC()));
+        double ratio = FEVOne()/FVC();
+        mResultScalars.push_back(Box(isnan(ratio) ? 0 : ratio));
+    }
+
+    float PeakFlow() // valueForKeyPath:@"@max.self"
+    {
+        double best = 0;
+        for (size_t i=0; i < mFlow.size(); ++i)
+            if (i == 0 || mFlow[i]->value > best)
+                best = mFlow[i]->value;
+        return (float)best;
+    }
+    float FEVOne()
+    {
+        for (size_t i=0; i < mTime.size(); ++i)
+            if ((float)mTime[i]->value > 1)
+                return (float)mVolume[i]->value;
+        return 0;
+    }
+    float FVC() { return mVolume.empty() ? 0 : (float)mVolume.back()->value; }
+
+    const BoxedArray &ResultFlow() { return mResultFlow; }
+    const BoxedArray &ResultVolume() { return mResultVolume; }
+    const BoxedArray &ResultTime() { return mResultTime; }
+
+private:
+    // CubicSpline: boxed b, c, d, every query unboxes all the knots again
+    struct BoxedSpline {
+        BoxedArray x, y, b, c, d;
+        BoxedSpline(const BoxedArray &inX, const BoxedArray &inY) : x(inX), y(inY)
+        {
+            size_t count = x.size();
+            if (count == 0)
+                return;
+            size_t n = count - 1;
+            std::vector<float> fx(count), a(count), h(count), yy(count), l(count), u(count), z(count);
+            for (size_t i=0; i < count; ++i) { fx[i] = (float)x[i]->value; a[i] = (float)y[i]->value; }
+            for (size_t i=0; i < n; ++i) h[i] = fx[i+1] - fx[i];
+            for (size_t i=1; i < n; ++i) yy[i] = 3/h[i]*(a[i+1]-a[i]) - 3/h[i-1]*(a[i]-a[i-1]);
+            l[0] = 1; u[0] = 0; z[0] = 0;
+            for (size_t i=1; i < n; ++i) {
+                l[i] = 2*(fx[i+1]-fx[i-1]) - h[i-1]*u[i-1];
+                u[i] = h[i]/l[i];
+                z[i] = (yy[i] - h[i-1]*z[i-1])/l[i];
+            }
+            for (size_t i=0; i < count; ++i) { b.push_back(Box(0)); c.push_back(Box(0)); d.push_back(Box(0)); }
+            for (long i=(long)n-1; i >= 0; --i) {
+                float cNext = (float)c[i+1]->value;
+                delete c[i]; c[i] = Box(z[i] - u[i]*cNext);
+                float cI = (float)c[i]->value;
+                delete b[i]; b[i] = Box((a[i+1]-a[i])/h[i] - h[i]*(cNext + 2.0f*cI)/3.0f);
+                delete d[i]; d[i] = Box((cNext - cI)/(3*h[i]));
+            }
+        }
+        ~BoxedSpline()
+        {
+            for (size_t i=0; i < b.size(); ++i) { delete b[i]; delete c[i]; delete d[i]; }
+        }
+        float Interpolate(float input)
+        {
+            if (x.empty())
+                return input;
+            std::vector<float> fx(x.size()), a(x.size());
+            for (size_t i=0; i < x.size(); ++i) { fx[i] = (float)x[i]->value; a[i] = (float)y[i]->value; }
+            long i;
+            for (i=(long)x.size()-1; i > 0; --i)
+                if (fx[i] <= input)
+                    break;
+            float dx = input - fx[i];
+            return a[i] + (float)b[i]->value*dx + (float)c[i]->value*dx*dx + (float)d[i]->value*dx*dx*dx;
+        }
+    };
+
+    BoxedArray FilterArray(const BoxedArray &series)
+    {
+        static const float taps[] = {
+            -0.0570114635f, 0.0477192582f, 0.0345309828f, 0.0268428757f, 0.0225935565f, 0.0203979552f, 0.0194419320f,
+            0.0192504413f, 0.0196427420f, 0.0203327997f, 0.0210234412f, 0.0219978553f, 0.0228894845f, 0.0237515661f,
+            0.0246741134f, 0.0254770231f, 0.0263172908f, 0.0270086622f, 0.0277167684f, 0.0282894016f, 0.0287857463f,
+            0.0291875253f, 0.0295200754f, 0.0297003562f, 0.0298753302f, 0.0298742843f, 0.0298753302f, 0.0297003562f,
+            0.0295200754f, 0.0291875253f, 0.0287857463f, 0.0282894016f, 0.0277167684f, 0.0270086622f, 0.0263172908f,
+            0.0254770231f, 0.0246741134f, 0.0237515661f, 0.0228894845f, 0.0219978553f, 0.0210234412f, 0.0203327997f,
+            0.0196427420f, 0.0192504413f, 0.0194419320f, 0.0203979552f, 0.0225935565f, 0.0268428757f, 0.0345309828f,
+            0.0477192582f, -0.0570114635f,
+        };
+        const size_t numTaps = sizeof(taps)/sizeof(float);
+        // the filter taps are boxed in the call too (an @[] literal of 51 NSNumbers)
+        BoxedArray boxedTaps;
+        for (size_t p=0; p < numTaps; ++p)
+            boxedTaps.push_back(Box(taps[p]));
+
+        size_t length = series.size();
+        float *x = (float*)calloc(length + numTaps, sizeof(float));
+        float *h = (float*)calloc(numTaps, sizeof(float));
+        float *y = (float*)calloc(length + numTaps - 1, sizeof(float));
+        for (size_t i=0; i < length; ++i) x[i] = (float)series[i]->value;
+        for (size_t p=0; p < numTaps; ++p) h[p] = (float)boxedTaps[p]->value;
+        for (size_t n=0; n < length; ++n) {
+            float sum = 0;
+            for (size_t p=0; p < numTaps; ++p)
+                sum += x[n+p]*h[numTaps-1-p];
+            y[n] = sum;
+        }
+        BoxedArray output;
+        for (size_t i=0; i < length; ++i)
+            output.push_back(Box(y[i]));
+        free(x); free(h); free(y);
+        for (size_t p=0; p < numTaps; ++p)
+            delete boxedTaps[p];
+        return output;
+    }
+
+    void BackExtrapolate(BoxedArray &flow)
+    {
+        size_t length = flow.size();
+        if (length == 0)
+            return;
+        float *f = (float*)calloc(length, sizeof(float));
+        for (size_t i=0; i < length; ++i) f[i] = (float)flow[i]->value;
+        size_t maxPosition = 0;
+        for (size_t i=1; i < length; ++i)
+            if (f[i] > f[maxPosition]) maxPosition = i;
+        size_t idx = 5;
+        if (maxPosition > NUM_SAMPLES_BACK_FROM_PEAKFLOW_TO_INTERPOLATE)
+            idx = maxPosition - NUM_SAMPLES_BACK_FROM_PEAKFLOW_TO_INTERPOLATE;
+        while (idx > 5 && f[idx-1] < f[idx])
+            idx--;
+        if (maxPosition < idx + 2) {
+            free(f);
+            return;
+        }
+        BoxedArray timeX(mTime.begin() + idx, mTime.begin() + maxPosition);
+        BoxedArray flowX(flow.begin() + idx, flow.begin() + maxPosition);
+        BoxedSpline spline(timeX, flowX);
+        long firstNonZero = -1;
+        for (size_t i=0; i < idx; ++i) {
+            float tmp = spline.Interpolate((float)mTime[i]->value);
+            if (tmp >= 0 && tmp < f[i]) {
+                f[i] = tmp;
+                if (firstNonZero < 0) firstNonZero = (long)i;
+            }
+            else if (tmp < 0)
+                f[i] = 0;
+        }
+        if (firstNonZero > 0) {
+            for (size_t i=0; i < mTime.size(); ++i) {
+                delete mTime[i];
+                mTime[i] = Box(mInterval*((long)i - firstNonZero + 1));
+            }
+        }
+        for (size_t i=0; i < length; ++i) {
+            delete flow[i];
+            flow[i] = Box(f[i]);
+        }
+        free(f);
+    }
+
+    void ClearResults()
+    {
+        for (size_t i=0; i < mResultFlow.size(); ++i)
+            delete mResultFlow[i];
+        for (size_t i=0; i < mResultScalars.size(); ++i)
+            delete mResultScalars[i];
+        BoxedArray().swap(mResultFlow);
+        BoxedArray().swap(mResultVolume);
+        BoxedArray().swap(mResultTime);
+        BoxedArray().swap(mResultScalars);
+    }
+
+    BoxedArray mFlow, mVolume, mTime, mDynamicFlow, mDynamicTime;
+    BoxedArray mResultFlow, mResultVolume, mResultTime, mResultScalars;
+    float mInitialTime;
+    float mInterval;
+};
+
+#endif
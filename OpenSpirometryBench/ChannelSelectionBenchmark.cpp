@@ -0,0 +1,259 @@
+//
+//  ChannelSelectionBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Multichannel capture for 1, 2 and 4 microphones. First the framing: time per callback to
+//  split interleaved audio into every channel's ring at once (OverlapFramer, vector loads),
+//  against one strided copy per channel (what taking each channel the old way would cost), and
+//  a check that both leave the same samples. Then whole efforts through EffortSession on
+//  synthetic multichannel audio: PEF, FEV1 and FVC error, CPU per second of audio and channel
+//  switches for the first channel only (what the analyzer used to do), ChannelSelector picking
+//  the channel per window, and every channel analyzed in full by its own session (the cost
+//  selection avoids, with the errors of whichever channel came out best). Scenarios: the first mic covered or facing away, all mics alike, and the
+//  phone moved mid-effort so the clear mic changes.
+//
+//  usage: ChannelSelectionBenchmark [-r repeats]
+
+#include "BenchUtils.h"
+#include "WhistleSignalGenerator.h"
+#include "EffortSession.h"
+#include <algorithm>
+#include <string.h>
+
+static double Median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    return v[v.size()/2];
+}
+
+//=============================================================================================================
+// Framing
+
+static bool TimeFraming(int numChannels, int numRepeats)
+{
+    const int64_t callbackSize = 1024, numCallbacks = 400;
+    const int64_t window = BUFFER_SIZE, hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    std::vector<float> audio((size_t)(callbackSize*numCallbacks*numChannels));
+    uint32_t state = 5;
+    for (size_t i=0; i < audio.size(); ++i)
+        audio[i] = BenchNoise(&state);
+
+    // rings big enough for the whole run, so nothing waits on a consumer
+    int64_t bufferLength = callbackSize*numCallbacks;
+    OverlapFramer together(window, hop, bufferLength, 1, numChannels);
+    OverlapFramer separate0(window, hop, bufferLength), separate1(window, hop, bufferLength),
+                  separate2(window, hop, bufferLength), separate3(window, hop, bufferLength);
+    OverlapFramer *separate[kMaxNumFramerChannels] = {&separate0, &separate1, &separate2, &separate3};
+
+    std::vector<double> togetherTimes, separateTimes;
+    for (int r=0; r < numRepeats; ++r) {
+        together.Clear();
+        double start = CPUSeconds();
+        for (int64_t b=0; b < numCallbacks; ++b)
+            together.AddNewInterleavedFloatData(&audio[(size_t)(b*callbackSize*numChannels)], callbackSize, numChannels);
+        togetherTimes.push_back(CPUSeconds() - start);
+
+        for (int c=0; c < numChannels; ++c)
+            separate[c]->Clear();
+        start = CPUSeconds();
+        for (int64_t b=0; b < numCallbacks; ++b)
+            for (int c=0; c < numChannels; ++c)
+                separate[c]->AddNewInterleavedFloatData(&audio[(size_t)(b*callbackSize*numChannels)], callbackSize, c, numChannels);
+        separateTimes.push_back(CPUSeconds() - start);
+    }
+
+    // every window of every channel holds the same samples both ways, through rings small enough to wrap
+    OverlapFramer wrapped(window, hop, 2*window, 1, numChannels);
+    for (int c=0; c < numChannels; ++c)
+        separate[c]->Clear();
+    bool same = true;
+    FrameView frame, reference;
+    for (int64_t b=0; b < numCallbacks && same; ++b) {
+        const float *callback = &audio[(size_t)(b*callbackSize*numChannels)];
+        wrapped.AddNewInterleavedFloatData(callback, callbackSize, numChannels);
+        for (int c=0; c < numChannels; ++c)
+            separate[c]->AddNewInterleavedFloatData(callback, callbackSize, c, numChannels);
+        while (wrapped.PeekFrame(&frame)) {
+            for (int c=0; c < numChannels && same; ++c) {
+                same = separate[c]->PeekFrame(&reference);
+                FrameView view = wrapped.ChannelFrame(frame, c);
+                for (int64_t i=0; i < view.Length() && same; ++i)
+                    same = view[i] == reference[i];
+                separate[c]->ReleaseFrame();
+            }
+            wrapped.ReleaseFrame();
+        }
+    }
+    same = same && wrapped.NumDroppedSamples() == 0;
+
+    printf("  %d channel%s  %8.2f us %8.2f us  %5.2fx  %s\n", numChannels, numChannels > 1 ? "s" : " ",
+           1e6*Median(togetherTimes)/numCallbacks, 1e6*Median(separateTimes)/numCallbacks,
+           Median(separateTimes)/Median(togetherTimes), same ? "same" : "DIFFERENT");
+    return same;
+}
+
+//=============================================================================================================
+// Efforts
+
+struct Scenario {
+    const char *name;
+    float gain[kMaxNumFramerChannels];          // whistle level at each mic
+    float noise[kMaxNumFramerChannels];         // room or wind noise at each mic for the first part of the effort
+    float movedNoise[kMaxNumFramerChannels];    // and after the move (same as noise for no move)
+    double moveTime;                            // s into the effort, negative for none
+};
+
+// one generator per mic: the same whistle, scaled by how well the mic hears it, over its own noise
+static void Generate(const Scenario &s, int numChannels, WhistleSignalGenerator **truth, std::vector<float> *interleaved)
+{
+    std::vector<float> parts[2][kMaxNumFramerChannels];
+    for (int part=0; part < 2; ++part) {
+        for (int c=0; c < numChannels; ++c) {
+            WhistleSignalOptions options;
+            options.whistleAmplitude *= s.gain[c];
+            options.roomNoiseLevel = part == 0 ? s.noise[c] : s.movedNoise[c];
+            options.seed += 31*c; // the same noise in both parts, so a move only changes its level
+            WhistleSignalGenerator generator(WhistleModel(), options);
+            generator.SetParametricFlowCurve(8.0f, 0.10f, 1.0f, 5.0f);
+            generator.Generate(&parts[part][c]);
+        }
+    }
+    *truth = new WhistleSignalGenerator(WhistleModel(), WhistleSignalOptions());
+    (*truth)->SetParametricFlowCurve(8.0f, 0.10f, 1.0f, 5.0f);
+
+    // cross fade from the first part to the moved one over 50 ms
+    size_t numFrames = parts[0][0].size();
+    double fs = WhistleSignalOptions().samplingRate;
+    double moveStart = s.moveTime < 0 ? 1e30 : ((*truth)->EffortStartInSeconds() + s.moveTime)*fs;
+    double fade = 0.05*fs;
+    interleaved->resize(numFrames*numChannels);
+    for (size_t i=0; i < numFrames; ++i) {
+        double w = std::min(1.0, std::max(0.0, (i - moveStart)/fade));
+        for (int c=0; c < numChannels; ++c)
+            (*interleaved)[i*numChannels + c] = (float)((1.0 - w)*parts[0][c][i] + w*parts[1][c][i]);
+    }
+}
+
+struct EffortStats {
+    bool hasResults;
+    double pefError, fevOneError, fvcError; // percent
+    double cpuMillisecondsPerSecond;
+    int64_t numSwitches;
+};
+
+static void Errors(EffortSession &session, const WhistleSignalGenerator &truth, EffortStats *stats)
+{
+    FlowVolumeResults results;
+    stats->hasResults = session.GetResults(&results);
+    stats->pefError = stats->fevOneError = stats->fvcError = 0;
+    if (stats->hasResults) {
+        stats->pefError = 100.0*fabs(results.peakFlowInLitersPerSecond - truth.PeakFlow())/truth.PeakFlow();
+        stats->fevOneError = 100.0*fabs(results.fevOneInLiters - truth.FEVOne())/truth.FEVOne();
+        stats->fvcError = 100.0*fabs(results.fvcInLiters - truth.FVC())/truth.FVC();
+    }
+}
+
+// method 0: the first channel only, 1: selection, 2: every channel in its own session (errors of the best)
+static void RunEffort(const std::vector<float> &interleaved, int numChannels, const WhistleSignalGenerator &truth,
+                      int method, int numRepeats, EffortStats *stats)
+{
+    const int64_t callbackSize = 1024;
+    int64_t numFrames = (int64_t)interleaved.size()/numChannels;
+    int numSessions = method == 2 ? numChannels : 1;
+    std::vector<float> mono((size_t)(callbackSize*numChannels));
+    std::vector<double> times;
+    for (int r=0; r < numRepeats; ++r) {
+        WhistleModel whistle;
+        whistle.useBandLimitedSpectrum = true;
+        float fs = WhistleSignalOptions().samplingRate;
+        int sessionChannels = method == 1 ? numChannels : 1;
+        EffortSession session0(fs, whistle, callbackSize, sessionChannels), session1(fs, whistle, callbackSize, sessionChannels),
+                      session2(fs, whistle, callbackSize, sessionChannels), session3(fs, whistle, callbackSize, sessionChannels);
+        EffortSession *sessions[kMaxNumFramerChannels] = {&session0, &session1, &session2, &session3};
+
+        double start = CPUSeconds();
+        for (int64_t p=0; p < numFrames; p += callbackSize) {
+            int64_t n = std::min(callbackSize, numFrames - p);
+            const float *block = &interleaved[(size_t)(p*numChannels)];
+            if (method == 1) {
+                sessions[0]->AddNewInterleavedFloatData(block, n, numChannels);
+                continue;
+            }
+            // one channel per session, taken out the way the framer used to
+            for (int s=0; s < numSessions; ++s) {
+                for (int64_t i=0; i < n; ++i)
+                    mono[(size_t)i] = block[i*numChannels + s];
+                sessions[s]->AddNewFloatData(&mono[0], n);
+            }
+        }
+        for (int s=0; s < numSessions; ++s)
+            sessions[s]->FinishStream();
+        times.push_back(CPUSeconds() - start);
+
+        if (r == numRepeats - 1) {
+            // every channel analyzed: the one that came out closest, as if it had been known in advance
+            for (int s=0; s < numSessions; ++s) {
+                EffortStats channel;
+                Errors(*sessions[s], truth, &channel);
+                double error = channel.pefError + channel.fevOneError + channel.fvcError;
+                if (s == 0 || (channel.hasResults && error < stats->pefError + stats->fevOneError + stats->fvcError))
+                    *stats = channel;
+            }
+            stats->numSwitches = sessions[0]->NumChannelSwitches();
+        }
+    }
+    stats->cpuMillisecondsPerSecond = 1e3*Median(times)/(numFrames/(double)WhistleSignalOptions().samplingRate);
+}
+
+int main(int argc, char **argv)
+{
+    int numRepeats = 3;
+    for (int a=1; a < argc; ++a)
+        if (strcmp(argv[a], "-r") == 0 && a+1 < argc)
+            numRepeats = std::max(1, atoi(argv[++a]));
+
+    bool same = true;
+    printf("framing per %d frame callback, median of %d\n", 1024, 5*numRepeats);
+    printf("  %-10s  %11s %11s\n", "", "together", "per channel");
+    const int channelCounts[] = {1, 2, 4};
+    for (int n=0; n < 3; ++n)
+        same = TimeFraming(channelCounts[n], 5*numRepeats) && same;
+
+    // the whistle is 0.6 at gain 1; noise much above 0.005 through the tail already throws off FVC on one mic
+    const Scenario scenarios[] = {
+        //  name           whistle gain per mic        noise per mic                    after the move                   move (s)
+        {"all alike",     {1.0f, 1.0f, 1.0f, 1.0f},   {0.002f, 0.002f, 0.002f, 0.002f}, {0.002f, 0.002f, 0.002f, 0.002f}, -1.0},
+        {"first covered", {0.03f, 1.0f, 0.3f, 0.1f},  {0.002f, 0.002f, 0.002f, 0.002f}, {0.002f, 0.002f, 0.002f, 0.002f}, -1.0},
+        {"first noisy",   {1.0f, 1.0f, 1.0f, 1.0f},   {0.05f, 0.002f, 0.01f, 0.05f},    {0.05f, 0.002f, 0.01f, 0.05f},    -1.0},
+        {"moved",         {1.0f, 1.0f, 1.0f, 1.0f},   {0.002f, 0.05f, 0.01f, 0.05f},    {0.05f, 0.002f, 0.01f, 0.05f},    0.8},
+    };
+    const char *methods[] = {"first", "selected", "all"};
+    printf("efforts (PEF 8 L/s), error against the truth, CPU per second of audio\n");
+    for (int n=1; n < 3; ++n) {
+        int numChannels = channelCounts[n];
+        for (int s=0; s < (int)(sizeof(scenarios)/sizeof(Scenario)); ++s) {
+            WhistleSignalGenerator *truth;
+            std::vector<float> interleaved;
+            Generate(scenarios[s], numChannels, &truth, &interleaved);
+            printf("  %d channels, %s\n", numChannels, scenarios[s].name);
+            for (int m=0; m < 3; ++m) {
+                EffortStats stats = EffortStats();
+                RunEffort(interleaved, numChannels, *truth, m, numRepeats, &stats);
+                printf("    %-9s", methods[m]);
+                if (stats.hasResults)
+                    printf(" PEF %5.1f%% FEV1 %5.1f%% FVC %5.1f%%", stats.pefError, stats.fevOneError, stats.fvcError);
+                else
+                    printf(" %-34s", " (no effort)");
+                printf("  %6.2f ms/s", stats.cpuMillisecondsPerSecond);
+                if (m == 1)
+                    printf("  %lld switches", (long long)stats.numSwitches);
+                printf("\n");
+            }
+            delete truth;
+        }
+    }
+    return same ? 0 : 1;
+}
@@ -0,0 +1,327 @@
+//
+//  EffortAllocationCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Check that an effort never touches the heap once its session is set up: everything an effort
+//  can need (framer ring, spectrum, tracker, short windows, channel selector, the flow/volume
+//  columns for TEST_MAX_DURATION_SECONDS, error text) is reserved when the EffortSession is built
+//  and reused through Clear. Counts heap allocations by replacing operator new and fails if any
+//  happen between the first sample and the results, for a clean effort, a noisy tail the tracker
+//  chases, a cough, nobody blowing (time out), 2 and 4 microphones, flagged errors on the curve
+//  and the flow updates the analyzer queues for the main queue.
+//
+//  Then what that saves per effort: allocations, bytes, time spent in new/delete, wall time
+//  and peak RSS (each way in its own forked process) for the session reused, a session built
+//  for every effort, and the reused session with the per window buffers and per update copies
+//  the analyzer used to allocate (a magnitude buffer per window, a block per flow update).
+//
+//  usage: EffortAllocationCheck [-r repeats]
+
+#include "BenchUtils.h"
+#include "EffortSession.h"
+#include "FlowUpdateQueue.h"
+#include "WhistleSignalGenerator.h"
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+static std::atomic<int64_t> gNumAllocations(0);
+static std::atomic<int64_t> gNumBytes(0);
+static std::atomic<int64_t> gAllocatorNanoseconds(0);
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // new and delete below are a malloc/free pair
+#endif
+
+static inline int64_t NowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void *operator new(size_t size)
+{
+    int64_t start = NowNanoseconds();
+    gNumAllocations.fetch_add(1, std::memory_order_relaxed);
+    gNumBytes.fetch_add((int64_t)size, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    gAllocatorNanoseconds.fetch_add(NowNanoseconds() - start, std::memory_order_relaxed);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept
+{
+    int64_t start = NowNanoseconds();
+    free(p);
+    gAllocatorNanoseconds.fetch_add(NowNanoseconds() - start, std::memory_order_relaxed);
+}
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+static const float kSamplingRate = 44100.0f;
+static const int64_t kCallbackFrames = 1024;
+
+struct Effort {
+    const char *name;
+    int numChannels;
+    std::vector<float> audio; // interleaved
+};
+
+static std::vector<float> Interleave(const std::vector<float> *channels, int numChannels)
+{
+    std::vector<float> audio(channels[0].size()*numChannels);
+    for (size_t i=0; i < channels[0].size(); ++i)
+        for (int c=0; c < numChannels; ++c)
+            audio[i*numChannels + c] = channels[c][i];
+    return audio;
+}
+
+static void MakeEfforts(std::vector<Effort> *efforts)
+{
+    WhistleSignalOptions noisy;
+    noisy.roomNoiseLevel = 0.02f;
+    const WhistleSignalOptions options[3] = {WhistleSignalOptions(), noisy, WhistleSignalOptions()};
+    const char *names[3] = {"clean", "noisy tail", "cough"};
+    for (int e=0; e < 3; ++e) {
+        WhistleSignalGenerator generator(WhistleModel(), options[e]);
+        generator.SetParametricFlowCurve(8.0f, 0.10f, 1.0f, 5.0f);
+        if (e == 2) {
+            SyntheticCough cough = {0.8, 0.15, 0.5f};
+            generator.AddCough(cough);
+        }
+        Effort effort = {names[e], 1, std::vector<float>()};
+        generator.Generate(&effort.audio);
+        efforts->push_back(effort);
+    }
+
+    Effort silence = {"nobody blowing", 1, std::vector<float>((size_t)((2.0 + TIME_OUT_WAIT_FOR_TEST_START + 3.0)*kSamplingRate))};
+    uint32_t state = 5;
+    for (size_t i=0; i < silence.audio.size(); ++i)
+        silence.audio[i] = 0.001f*BenchNoise(&state);
+    efforts->push_back(silence);
+
+    // the same whistle on every mic, each over its own noise, the first one noisier
+    std::vector<float> channels[kMaxNumFramerChannels];
+    for (int c=0; c < kMaxNumFramerChannels; ++c) {
+        WhistleSignalOptions mic;
+        mic.roomNoiseLevel = c == 0 ? 0.05f : 0.002f;
+        mic.seed += 31*c;
+        WhistleSignalGenerator generator(WhistleModel(), mic);
+        generator.SetParametricFlowCurve(8.0f, 0.10f, 1.0f, 5.0f);
+        generator.Generate(&channels[c]);
+    }
+    Effort two = {"2 mics", 2, Interleave(channels, 2)};
+    Effort four = {"4 mics", 4, Interleave(channels, 4)};
+    efforts->push_back(two);
+    efforts->push_back(four);
+}
+
+static WhistleModel BandLimitedWhistle()
+{
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = true;
+    return whistle;
+}
+
+// the callbacks of one effort through a session already set up, false if it gave no results when it should have
+static bool RunEffort(EffortSession &session, const Effort &effort)
+{
+    int64_t numFrames = (int64_t)effort.audio.size()/effort.numChannels;
+    for (int64_t p=0; p < numFrames; p += kCallbackFrames) {
+        int64_t n = std::min(kCallbackFrames, numFrames - p);
+        session.AddNewInterleavedFloatData(&effort.audio[(size_t)(p*effort.numChannels)], n, effort.numChannels);
+    }
+    session.FinishStream();
+    FlowVolumeResults results;
+    return session.GetResults(&results) || session.CurrentStage() == SpirometryStageDidTimeOutWaitingForEffort;
+}
+
+//=============================================================================================================
+// What it saves
+
+enum SetupWay { kReused, kBuiltPerEffort, kPerWindowBuffers, kNumSetupWays };
+static const char *kSetupWayNames[kNumSetupWays] = {"session reused", "built per effort", "per window buffers"};
+
+struct SetupCost {
+    double allocations, megabytes, allocatorMilliseconds, effortMilliseconds; // per effort
+    double peakRSSMegabytes;
+};
+
+static int64_t PeakRSSBytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return (int64_t)usage.ru_maxrss;        // bytes
+#else
+    return (int64_t)usage.ru_maxrss*1024;   // kilobytes
+#endif
+}
+
+static volatile float gSink = 0;
+
+// the analyzer's hot path as it was: a dB buffer for every window, a copied block for every flow update
+static void RunEffortWithPerWindowBuffers(EffortSession &session, const Effort &effort)
+{
+    int64_t numFrames = (int64_t)effort.audio.size();
+    for (int64_t p=0; p < numFrames; p += kCallbackFrames) {
+        int64_t framesBefore = session.NumFramesAnalyzed(), estimatesBefore = session.NumFlowEstimates();
+        session.AddNewFloatData(&effort.audio[(size_t)p], std::min(kCallbackFrames, numFrames - p));
+        for (int64_t w = framesBefore; w < session.NumFramesAnalyzed(); ++w) {
+            float *magnitude = new float[BUFFER_SIZE/2]();
+            gSink = gSink + magnitude[w % (BUFFER_SIZE/2)];
+            delete [] magnitude;
+        }
+        for (int64_t u = estimatesBefore; u < session.NumFlowEstimates(); ++u) {
+            FlowUpdate *update = new FlowUpdate();
+            gSink = gSink + update->flowInLitersPerSecond;
+            delete update;
+        }
+    }
+    session.FinishStream();
+}
+
+static SetupCost MeasureSetup(SetupWay way, const Effort &effort, int numEfforts)
+{
+    int64_t rssBefore = PeakRSSBytes();
+    int64_t allocationsBefore = gNumAllocations.load(), bytesBefore = gNumBytes.load();
+    int64_t allocatorBefore = gAllocatorNanoseconds.load();
+    double start = WallSeconds();
+    if (way == kBuiltPerEffort) {
+        for (int e=0; e < numEfforts; ++e) {
+            EffortSession session(kSamplingRate, BandLimitedWhistle());
+            RunEffort(session, effort);
+        }
+    }
+    else {
+        EffortSession reused(kSamplingRate, BandLimitedWhistle()); // built once, counted once
+        for (int e=0; e < numEfforts; ++e) {
+            reused.Clear();
+            if (way == kPerWindowBuffers)
+                RunEffortWithPerWindowBuffers(reused, effort);
+            else
+                RunEffort(reused, effort);
+        }
+    }
+
+    SetupCost cost;
+    cost.effortMilliseconds = 1e3*(WallSeconds() - start)/numEfforts;
+    cost.allocations = (double)(gNumAllocations.load() - allocationsBefore)/numEfforts;
+    cost.megabytes = (double)(gNumBytes.load() - bytesBefore)/numEfforts/(1 << 20);
+    cost.allocatorMilliseconds = 1e-6*(gAllocatorNanoseconds.load() - allocatorBefore)/numEfforts;
+    cost.peakRSSMegabytes = (double)(PeakRSSBytes() - rssBefore)/(1 << 20);
+    return cost;
+}
+
+// in a child process, so each way's peak RSS is its own
+static bool MeasureSetupInChild(SetupWay way, const Effort &effort, int numEfforts, SetupCost *cost)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0) {
+        close(fds[0]);
+        SetupCost measured = MeasureSetup(way, effort, numEfforts);
+        ssize_t written = write(fds[1], &measured, sizeof(measured));
+        _exit(written == (ssize_t)sizeof(measured) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t numRead = read(fds[0], cost, sizeof(*cost));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return numRead == (ssize_t)sizeof(*cost) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int numRepeats = 3;
+    for (int a=1; a < argc; ++a)
+        if (strcmp(argv[a], "-r") == 0 && a+1 < argc)
+            numRepeats = std::max(1, atoi(argv[++a]));
+
+    std::vector<Effort> efforts;
+    MakeEfforts(&efforts);
+    bool ok = true;
+
+    // one session per channel count, built before anything is counted, every effort twice (after Clear)
+    printf("heap allocations during an effort (session built first, reused through Clear)\n");
+    EffortSession mono(kSamplingRate, BandLimitedWhistle());
+    EffortSession stereo(kSamplingRate, BandLimitedWhistle(), kCallbackFrames, 2);
+    EffortSession quad(kSamplingRate, BandLimitedWhistle(), kCallbackFrames, 4);
+    for (size_t e=0; e < efforts.size(); ++e) {
+        EffortSession &session = efforts[e].numChannels == 4 ? quad : efforts[e].numChannels == 2 ? stereo : mono;
+        int64_t worst = 0;
+        bool finished = true;
+        for (int pass=0; pass < 2; ++pass) {
+            session.Clear();
+            int64_t before = gNumAllocations.load();
+            finished = RunEffort(session, efforts[e]) && finished;
+            worst = std::max(worst, gNumAllocations.load() - before);
+        }
+        bool effortOk = worst == 0 && finished;
+        printf("  %-16s %6lld  %s\n", efforts[e].name, (long long)worst, effortOk ? "ok" : finished ? "FAIL" : "FAIL (no results)");
+        ok = ok && effortOk;
+    }
+
+    // errors flagged on the curve, the analyzer's messages and a longer one
+    FlowVolumeCurve curve;
+    int64_t before = gNumAllocations.load();
+    for (int i=0; i < 500; ++i)
+        curve.AddFlowEstimate(8.0f*expf(-i/100.0f), 2.5 + 0.005*i);
+    curve.AddCustomError("Cough Detected During Test", "Cough");
+    curve.AddCustomError("Effort Started Too Slowly, Back Extrapolated Volume Too Large", "BackExtrapolation");
+    curve.AddCustomError("Cough Detected During Test", "Cough");
+    FlowVolumeResults results;
+    curve.FinalizeCurves(&results);
+    int64_t curveAllocations = gNumAllocations.load() - before;
+    printf("  %-16s %6lld  %s\n", "curve errors", (long long)curveAllocations,
+           curveAllocations == 0 && results.numErrors == 2 ? "ok" : "FAIL");
+    ok = ok && curveAllocations == 0 && results.numErrors == 2;
+
+    // flow updates through the queue the analyzer hands to the main queue, with one drain falling behind
+    FlowUpdateQueue updates;
+    FlowUpdate update = FlowUpdate(), popped;
+    int64_t numDelivered = 0;
+    before = gNumAllocations.load();
+    for (int i=0; i < 2000; ++i) {
+        update.flowInLitersPerSecond = (float)i;
+        updates.Push(update);
+        if (i % 7 == 6 && i < 1500)
+            while (updates.Pop(&popped))
+                numDelivered++;
+    }
+    while (updates.Pop(&popped))
+        numDelivered++;
+    int64_t queueAllocations = gNumAllocations.load() - before;
+    bool queueOk = queueAllocations == 0 && numDelivered + updates.NumDropped() == 2000 && popped.flowInLitersPerSecond < 2000;
+    printf("  %-16s %6lld  %s (%lld delivered, %lld dropped)\n", "flow updates", (long long)queueAllocations, queueOk ? "ok" : "FAIL",
+           (long long)numDelivered, (long long)updates.NumDropped());
+    ok = ok && queueOk;
+
+    // what it saves, per effort on the clean effort
+    printf("per effort, %d efforts each (peak RSS over the process before the first)\n", numRepeats);
+    printf("  %-20s %11s %9s %12s %10s %9s\n", "", "allocations", "MB", "allocator ms", "effort ms", "peak RSS");
+    for (int w=0; w < kNumSetupWays; ++w) {
+        SetupCost cost;
+        if (!MeasureSetupInChild((SetupWay)w, efforts[0], numRepeats, &cost)) {
+            printf("  %-20s could not measure\n", kSetupWayNames[w]);
+            continue;
+        }
+        printf("  %-20s %11.0f %9.2f %12.3f %10.2f %6.1f MB\n", kSetupWayNames[w], cost.allocations, cost.megabytes,
+               cost.allocatorMilliseconds, cost.effortMilliseconds, cost.peakRSSMegabytes);
+    }
+
+    printf("%s\n", ok ? "no allocations during efforts OK" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,330 @@
+//
+//  EffortBatchTool.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Offline replay of recorded efforts (the .effort files saved by shouldSaveSeparateEffortsToDocumentDirectory:,
+//  or any WAV recording), memory mapped through EffortFileReader. Every effort in a file (from its stage
+//  index) goes through its own EffortSession in 1024 frame spans as fast as the CPU allows, files are
+//  spread over a pool of worker threads, and each effort's results dictionary is written as JSON (same
+//  keys as finalizeCurvesAndGetResults), CSV or the binary FlowVolumeResults blob, numbered after the
+//  file name when the file holds more than one effort.
+//
+//  usage: EffortBatchTool [-j threads] [-f json|csv|bin] [-o outputDir] [-c channel] [-z] file.wav|file.effort ...
+
+#include "BenchUtils.h"
+#include "EffortFileReader.h"
+#include "EffortSession.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+struct BatchOptions {
+    int numThreads;
+    std::string format;             // json, csv or bin
+    std::string outputDirectory;    // empty means next to each input file
+    int channel;
+    bool bandLimited;               // -z, decimated whistle band spectrum (WhistleModel useBandLimitedSpectrum)
+};
+
+struct BatchEffort {
+    std::string path;
+    std::string outputPath;
+    SpirometryStage stage;
+    FlowVolumeResults results;      // scalars stay valid after the session is gone, the columns do not
+    EffortError statusError;        // reported when there is no effort to finalize
+};
+
+struct BatchItem {
+    std::string path;
+    double audioSeconds;
+    double wallSeconds;             // analyzing and writing every effort of the file
+    bool didRead;
+    std::vector<BatchEffort> efforts;
+};
+
+static const char *StageName(SpirometryStage stage)
+{
+    switch (stage) {
+        case SpirometryStageIsIdle: return "Idle";
+        case SpirometryStageIsCalibratingSilence: return "CalibratingSilence";
+        case SpirometryStageIsWaitingForTestToBegin: return "WaitingForTestToBegin";
+        case SpirometryStageIsExhaling: return "Exhaling";
+        case SpirometryStageIsWaitingForEndOfTest: return "WaitingForEndOfTest";
+        case SpirometryStageIsFinished: return "Finished";
+        case SpirometryStageDidTimeOutWaitingForEffort: return "DidTimeOutWaitingForEffort";
+        case SpirometryStageIsAnalyzingResults: return "AnalyzingResults";
+    }
+    return "Unknown";
+}
+
+static std::string JSONEscape(const std::string &text)
+{
+    std::string escaped;
+    for (size_t i=0; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == '"' || c == '\\') { escaped += '\\'; escaped += c; }
+        else if ((unsigned char)c < 0x20) { char hex[8]; snprintf(hex, sizeof(hex), "\\u%04x", c); escaped += hex; }
+        else escaped += c;
+    }
+    return escaped;
+}
+
+static void WriteJSONArray(FILE *file, const char *key, const float *values, int64_t numValues)
+{
+    fprintf(file, "  \"%s\": [", key);
+    for (int64_t i=0; i < numValues; ++i)
+        fprintf(file, i == 0 ? "%.6g" : ",%.6g", values[i]);
+    fprintf(file, "],\n");
+}
+
+static bool WriteResultsJSON(const BatchEffort &item)
+{
+    FILE *file = fopen(item.outputPath.c_str(), "w");
+    if (!file)
+        return false;
+    const FlowVolumeResults &r = item.results;
+    fprintf(file, "{\n");
+    fprintf(file, "  \"File\": \"%s\",\n", JSONEscape(item.path).c_str());
+    fprintf(file, "  \"Stage\": \"%s\",\n", StageName(item.stage));
+    WriteJSONArray(file, "FlowCurveInLitersPerSecond", r.flow, r.numSamples);
+    WriteJSONArray(file, "VolumeCurveInLiters", r.volume, r.numSamples);
+    WriteJSONArray(file, "TimeStampsForFlowAndVolume", r.timeStamps, r.numSamples);
+    fprintf(file, "  \"PeakFlowInLitersPerSecond\": %.6g,\n", r.peakFlowInLitersPerSecond);
+    fprintf(file, "  \"FEVOneInLiters\": %.6g,\n", r.fevOneInLiters);
+    fprintf(file, "  \"FVCInLiters\": %.6g,\n", r.fvcInLiters);
+    fprintf(file, "  \"FEVOneOverFVC\": %.6g,\n", r.fevOneOverFvc);
+    fprintf(file, "  \"ErrorsDictionary\": {");
+    for (int64_t i=0; i < r.numErrors; ++i)
+        fprintf(file, "%s\"%s\": \"%s\"", i == 0 ? "" : ", ",
+                JSONEscape(r.errors[i].key).c_str(), JSONEscape(r.errors[i].message).c_str());
+    fprintf(file, "}\n}\n");
+    return fclose(file) == 0;
+}
+
+// curves as columns, scalar measures and errors as comment lines on top
+static bool WriteResultsCSV(const BatchEffort &item)
+{
+    FILE *file = fopen(item.outputPath.c_str(), "w");
+    if (!file)
+        return false;
+    const FlowVolumeResults &r = item.results;
+    fprintf(file, "# File,%s\n# Stage,%s\n", item.path.c_str(), StageName(item.stage));
+    fprintf(file, "# PeakFlowInLitersPerSecond,%.6g\n# FEVOneInLiters,%.6g\n# FVCInLiters,%.6g\n# FEVOneOverFVC,%.6g\n",
+            r.peakFlowInLitersPerSecond, r.fevOneInLiters, r.fvcInLiters, r.fevOneOverFvc);
+    for (int64_t i=0; i < r.numErrors; ++i)
+        fprintf(file, "# Error,%s,%s\n", r.errors[i].key.c_str(), r.errors[i].message.c_str());
+    fprintf(file, "TimeStampsForFlowAndVolume,FlowCurveInLitersPerSecond,VolumeCurveInLiters\n");
+    for (int64_t i=0; i < r.numSamples; ++i)
+        fprintf(file, "%.6g,%.6g,%.6g\n", r.timeStamps[i], r.flow[i], r.volume[i]);
+    return fclose(file) == 0;
+}
+
+// FlowVolumeResults::Serialize layout, no conversion at all
+static bool WriteResultsBinary(const BatchEffort &item)
+{
+    FILE *file = fopen(item.outputPath.c_str(), "wb");
+    if (!file)
+        return false;
+    std::vector<uint8_t> blob((size_t)item.results.SerializedSize());
+    item.results.Serialize(&blob[0]);
+    fwrite(&blob[0], 1, blob.size(), file);
+    return fclose(file) == 0;
+}
+
+// effort is 0 for a file with one effort, its number from 1 otherwise
+static std::string OutputPathForInput(const std::string &path, int effort, const BatchOptions &options)
+{
+    std::string name = path;
+    size_t slash = name.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : name.substr(0, slash);
+    if (slash != std::string::npos)
+        name = name.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    if (dot != std::string::npos)
+        name = name.substr(0, dot);
+    if (!options.outputDirectory.empty())
+        directory = options.outputDirectory;
+    if (effort > 0)
+        name += "-" + std::to_string(effort);
+    return directory + "/" + name + "." + options.format;
+}
+
+// one channel of each span into the session, straight from the file when it is mono floats
+struct ChannelSink : public EffortSpanSink {
+    EffortSession *session;
+    int channel;
+    std::vector<float> mono;
+
+    virtual bool AddSpan(const EffortSpan &span) {
+        const float *data = span.samples;
+        if (span.numChannels > 1) {
+            mono.resize((size_t)span.numFrames);
+            for (int64_t i=0; i < span.numFrames; ++i)
+                mono[(size_t)i] = span.samples[i*span.numChannels + channel];
+            data = &mono[0];
+        }
+        return session->AddNewFloatData(data, span.numFrames) < SpirometryStageIsFinished;
+    }
+};
+
+// frames [firstFrame, endFrame) of the file through a fresh session, results written as effort number effort
+static void AnalyzeEffort(EffortFileReader *reader, int64_t firstFrame, int64_t endFrame, int effort,
+                          const BatchOptions &options, BatchEffort *outcome)
+{
+    // the app analyzes channel 0 of the interleaved input
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = options.bandLimited;
+    EffortSession session((float)reader->SamplingRate(), whistle);
+    ChannelSink sink;
+    sink.session = &session;
+    sink.channel = options.channel < reader->NumChannels() ? options.channel : 0;
+    reader->Deliver(&sink, firstFrame, endFrame, 1024, 0.0);
+    outcome->stage = session.FinishStream();
+
+    if (!session.GetResults(&outcome->results)) {
+        FlowVolumeResults empty = {};
+        outcome->results = empty;
+        if (outcome->stage == SpirometryStageDidTimeOutWaitingForEffort) {
+            outcome->statusError.key = "Timeout";
+            outcome->statusError.message = "Timed Out Waiting For Effort";
+        }
+        else {
+            outcome->statusError.key = "NoEffort";
+            outcome->statusError.message = "No Effort Found In Recording";
+        }
+        outcome->results.numErrors = 1;
+        outcome->results.errors = &outcome->statusError;
+    }
+
+    // write while the session still owns the columns
+    outcome->outputPath = OutputPathForInput(outcome->path, effort, options);
+    bool didWrite = options.format == "csv" ? WriteResultsCSV(*outcome) :
+                    options.format == "bin" ? WriteResultsBinary(*outcome) : WriteResultsJSON(*outcome);
+    outcome->results.timeStamps = outcome->results.flow = outcome->results.volume = NULL;
+    outcome->results.errors = NULL;
+    if (!didWrite)
+        fprintf(stderr, "%s: cannot write %s\n", outcome->path.c_str(), outcome->outputPath.c_str());
+}
+
+static void AnalyzeItem(BatchItem *item, const BatchOptions &options)
+{
+    EffortFileReader reader;
+    std::string error;
+    item->didRead = reader.Open(item->path, &error);
+    if (!item->didRead) {
+        fprintf(stderr, "%s: %s\n", item->path.c_str(), error.c_str());
+        return;
+    }
+    item->audioSeconds = reader.Seconds();
+
+    // each effort from the first frame of its first stage to the first of the next one's, the whole
+    // file when the index finds none (so it is reported as a timeout or no effort)
+    const std::vector<EffortStageRegion> &regions = reader.StageRegions();
+    std::vector<int64_t> starts(1, 0);
+    for (size_t r = 1; r < regions.size(); r++)
+        if (regions[r].effort != regions[r-1].effort)
+            starts.push_back(regions[r].firstFrame);
+    starts.push_back(reader.NumFrames());
+    int numEfforts = (int)starts.size() - 1;
+    // the quiet after the last effort starts another one in the index, it is not an effort of its own
+    EffortStageRegion exhaling;
+    if (numEfforts > 1 && !reader.FindStage(numEfforts - 1, SpirometryStageIsExhaling, &exhaling))
+        starts.erase(starts.end() - 2);
+    numEfforts = (int)starts.size() - 1;
+    item->efforts.resize((size_t)numEfforts);
+    for (int e = 0; e < numEfforts; e++) {
+        item->efforts[(size_t)e].path = item->path;
+        AnalyzeEffort(&reader, starts[(size_t)e], starts[(size_t)e+1], numEfforts > 1 ? e + 1 : 0, options, &item->efforts[(size_t)e]);
+    }
+}
+
+static void Usage()
+{
+    fprintf(stderr, "usage: EffortBatchTool [-j threads] [-f json|csv|bin] [-o outputDir] [-c channel] [-z] file.wav|file.effort ...\n");
+}
+
+int main(int argc, char **argv)
+{
+    BatchOptions options;
+    options.numThreads = (int)std::thread::hardware_concurrency();
+    options.format = "json";
+    options.channel = 0;
+    options.bandLimited = false;
+
+    std::vector<BatchItem> items;
+    for (int i=1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "-j" || arg == "-f" || arg == "-o" || arg == "-c") && i+1 >= argc) {
+            Usage();
+            return 2;
+        }
+        if (arg == "-j") options.numThreads = atoi(argv[++i]);
+        else if (arg == "-f") options.format = argv[++i];
+        else if (arg == "-o") options.outputDirectory = argv[++i];
+        else if (arg == "-c") options.channel = atoi(argv[++i]);
+        else if (arg == "-z") options.bandLimited = true;
+        else if (arg == "-h" || arg == "--help") { Usage(); return 0; }
+        else {
+            BatchItem item;
+            item.path = arg;
+            item.audioSeconds = 0;
+            item.wallSeconds = 0;
+            item.didRead = false;
+            items.push_back(item);
+        }
+    }
+    if (items.empty() || (options.format != "json" && options.format != "csv" && options.format != "bin")) {
+        Usage();
+        return 2;
+    }
+    if (options.numThreads < 1)
+        options.numThreads = 1;
+    if (options.numThreads > (int)items.size())
+        options.numThreads = (int)items.size();
+
+    // workers pull the next file index until the list is used up
+    std::atomic<size_t> nextItem(0);
+    std::mutex printLock;
+    double start = WallSeconds();
+    std::vector<std::thread> workers;
+    for (int t=0; t < options.numThreads; ++t)
+        workers.push_back(std::thread([&]() {
+            size_t index;
+            while ((index = nextItem.fetch_add(1)) < items.size()) {
+                BatchItem &item = items[index];
+                double itemStart = WallSeconds();
+                AnalyzeItem(&item, options);
+                item.wallSeconds = WallSeconds() - itemStart;
+                if (item.didRead) {
+                    std::lock_guard<std::mutex> lock(printLock);
+                    printf("%s: %d effort%s, %.1f s audio in %.3f s wall\n", item.path.c_str(), (int)item.efforts.size(),
+                           item.efforts.size() == 1 ? "" : "s", item.audioSeconds, item.wallSeconds);
+                    for (size_t e=0; e < item.efforts.size(); ++e) {
+                        const BatchEffort &effort = item.efforts[e];
+                        printf("    %s: %s, PEF %.2f L/s, FEV1 %.2f L, FVC %.2f L\n", effort.outputPath.c_str(),
+                               StageName(effort.stage), effort.results.peakFlowInLitersPerSecond,
+                               effort.results.fevOneInLiters, effort.results.fvcInLiters);
+                    }
+                }
+            }
+        }));
+    for (size_t t=0; t < workers.size(); ++t)
+        workers[t].join();
+    double wallSeconds = WallSeconds() - start;
+
+    double totalAudio = 0;
+    int numFailed = 0, numEfforts = 0;
+    for (size_t i=0; i < items.size(); ++i) {
+        totalAudio += items[i].audioSeconds;
+        numFailed += items[i].didRead ? 0 : 1;
+        numEfforts += (int)items[i].efforts.size();
+    }
+    printf("%d files (%d unreadable), %d efforts on %d threads: %.1f s of audio in %.2f s wall, %.1f audio s per wall s\n",
+           (int)items.size(), numFailed, numEfforts, options.numThreads, totalAudio, wallSeconds,
+           wallSeconds > 0 ? totalAudio/wallSeconds : 0.0);
+    return numFailed == 0 ? 0 : 1;
+}
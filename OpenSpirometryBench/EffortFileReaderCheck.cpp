@@ -0,0 +1,356 @@
+//
+//  EffortFileReaderCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Check for EffortFileReader. A session of three synthetic efforts back to back is written as
+//  float and 16 bit WAV (one with its data chunk at an offset that is not a multiple of four),
+//  headerless 16 bit PCM, and float and Rice coded EffortRecorder files with the stage markers the
+//  app would have written. Every file has to read back sample for sample, the stage index has to
+//  find all three efforts with the exhalation where the generator put it, a replay seeked to one
+//  effort has to give EffortSession the same results as the audio straight from memory, a paced
+//  replay has to take the time the audio lasts (over the speed), and a recording cut short has to
+//  read up to the last whole chunk. Also reports what opening costs next to reading a whole WAV.
+//
+//  usage: EffortFileReaderCheck [-x speed]
+
+#include "BenchUtils.h"
+#include "WavFile.h"
+#include "EffortFileReader.h"
+#include "EffortSession.h"
+#include "EffortStageDetector.h"
+#include "WhistleSignalGenerator.h"
+#include <algorithm>
+#include <thread>
+#include <math.h>
+#include <string.h>
+
+static const float kSamplingRate = 44100.0f;
+static const int kNumEfforts = 3;
+
+static inline int16_t ToInt16(float sample)
+{
+    float scaled = sample*32767.0f;
+    scaled = scaled > 32767.0f ? 32767.0f : (scaled < -32768.0f ? -32768.0f : scaled);
+    return (int16_t)lrintf(scaled);
+}
+
+// 16 bit PCM WAV, with a padding chunk of padBytes before the data (0 for none)
+static bool WriteWav16(const std::string &path, const std::vector<float> &mono, uint32_t padBytes)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    uint32_t dataLength = (uint32_t)(mono.size()*2), sampleRate = (uint32_t)kSamplingRate;
+    uint16_t format = 1, numChannels = 1, bits = 16, blockAlign = 2;
+    uint32_t byteRate = sampleRate*blockAlign, fmtLength = 16;
+    uint32_t riffLength = 36 + dataLength + (padBytes ? 8 + padBytes + (padBytes & 1) : 0);
+    fwrite("RIFF", 1, 4, file); fwrite(&riffLength, 4, 1, file); fwrite("WAVE", 1, 4, file);
+    fwrite("fmt ", 1, 4, file); fwrite(&fmtLength, 4, 1, file);
+    fwrite(&format, 2, 1, file); fwrite(&numChannels, 2, 1, file);
+    fwrite(&sampleRate, 4, 1, file); fwrite(&byteRate, 4, 1, file);
+    fwrite(&blockAlign, 2, 1, file); fwrite(&bits, 2, 1, file);
+    if (padBytes) {
+        std::vector<uint8_t> pad(padBytes + (padBytes & 1), 0);
+        fwrite("JUNK", 1, 4, file); fwrite(&padBytes, 4, 1, file); fwrite(&pad[0], 1, pad.size(), file);
+    }
+    fwrite("data", 1, 4, file); fwrite(&dataLength, 4, 1, file);
+    for (size_t i = 0; i < mono.size(); i++) {
+        int16_t sample = ToInt16(mono[i]);
+        fwrite(&sample, 2, 1, file);
+    }
+    return fclose(file) == 0;
+}
+
+static bool WriteRawPCM16(const std::string &path, const std::vector<float> &mono)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    for (size_t i = 0; i < mono.size(); i++) {
+        int16_t sample = ToInt16(mono[i]);
+        fwrite(&sample, 2, 1, file);
+    }
+    return fclose(file) == 0;
+}
+
+// a recording as the app makes one: 1024 frame callbacks, a marker whenever the stage changes
+static bool WriteRecording(const std::string &path, const std::vector<float> &mono, EffortSampleFormat format, EffortRecordingCodec codec)
+{
+    EffortRecorder recorder;
+    if (!recorder.Start(path, kSamplingRate, 1, format, codec))
+        return false;
+    EffortStageDetector detector(kSamplingRate);
+    int64_t numFrames = (int64_t)mono.size(), effortStart = 0;
+    int stage = -1;
+    for (int64_t frame = 0; frame < numFrames; frame += kReaderStageBlockFrames) {
+        int64_t blockFrames = std::min<int64_t>(kReaderStageBlockFrames, numFrames - frame);
+        recorder.AddNewInterleavedFloatData(&mono[(size_t)frame], blockFrames);
+        float blockMax = *std::max_element(mono.begin() + frame, mono.begin() + frame + blockFrames);
+        SpirometryStage next = detector.AnalyzeStageFromAudioMax(blockMax, frame + blockFrames - effortStart);
+        if ((int)next != stage)
+            recorder.AddMarker((int32_t)next);
+        stage = (int)next;
+        if (next == SpirometryStageIsFinished || next == SpirometryStageDidTimeOutWaitingForEffort) {
+            detector.Clear();
+            effortStart = frame + blockFrames;
+        }
+        while (frame - recorder.NumFramesWritten() > recorder.RingCapacityInFrames()/2)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5)); // faster than real time, so let the writer keep up
+    }
+    recorder.Stop();
+    return recorder.NumDroppedFrames() == 0;
+}
+
+// everything the reader hands out, in order
+static void ReadAll(EffortFileReader *reader, std::vector<float> *samples, int64_t *numSpans)
+{
+    samples->clear();
+    *numSpans = 0;
+    EffortSpan span;
+    reader->Seek(0);
+    while (reader->Read(4096, &span) > 0) {
+        samples->insert(samples->end(), span.samples, span.samples + span.numFrames*span.numChannels);
+        (*numSpans)++;
+    }
+}
+
+struct SessionSink : public EffortSpanSink {
+    EffortSession *session;
+    int64_t numSpans;
+    double maxLateness;         // paced replays: how far past its due time a span arrived
+    double start;
+    double speed;
+    int64_t firstFrame;
+
+    virtual bool AddSpan(const EffortSpan &span) {
+        if (speed > 0) {
+            double due = start + (double)(span.firstFrame + span.numFrames - firstFrame)/kSamplingRate/speed;
+            maxLateness = std::max(maxLateness, WallSeconds() - due);
+        }
+        numSpans++;
+        if (!session)
+            return true;
+        session->AddNewFloatData(span.samples, span.numFrames); // mono
+        return session->CurrentStage() < SpirometryStageIsFinished;
+    }
+};
+
+struct FileCase {
+    const char *name;
+    std::string path;
+    EffortFileFormat format;
+    bool isInt16;
+    bool zeroCopy;
+    bool hasMarkers;
+};
+
+int main(int argc, char **argv)
+{
+    double speed = 4.0;
+    for (int a=1; a+1 < argc; a += 2)
+        if (strcmp(argv[a], "-x") == 0) speed = atof(argv[a+1]);
+    std::string base = argv[0];
+
+    // three efforts, each long enough after the exhalation for the stage detector to finish it
+    std::vector<float> session;
+    std::vector<int64_t> exhaleStarts;
+    float peakFlows[kNumEfforts] = {8.0f, 6.0f, 9.5f};
+    WhistleSignalOptions options;
+    options.quietAfterInSeconds = 4.0;
+    for (int e = 0; e < kNumEfforts; e++) {
+        options.seed = 11 + e;
+        WhistleSignalGenerator generator(WhistleModel(), options);
+        generator.SetParametricFlowCurve(peakFlows[e], 0.1f, 0.8f, 4.0f);
+        std::vector<float> audio;
+        generator.Generate(&audio);
+        exhaleStarts.push_back((int64_t)session.size() + (int64_t)(generator.EffortStartInSeconds()*kSamplingRate));
+        session.insert(session.end(), audio.begin(), audio.end());
+    }
+    std::vector<float> quantized(session.size());
+    for (size_t i = 0; i < session.size(); i++)
+        quantized[i] = (float)ToInt16(session[i]);
+    printf("%d efforts, %.1f s of audio\n\n", kNumEfforts, session.size()/kSamplingRate);
+
+    WavAudio wav;
+    wav.samplingRate = kSamplingRate;
+    wav.numChannels = 1;
+    wav.samples = session;
+    FileCase cases[] = {
+        {"wav float", base + ".float.wav", EffortFileFormatWAV, false, true, false},
+        {"wav int16", base + ".int16.wav", EffortFileFormatWAV, true, false, false},
+        {"wav int16, unaligned", base + ".unaligned.wav", EffortFileFormatWAV, true, false, false},
+        {"raw int16", base + ".pcm", EffortFileFormatRawPCM, true, false, false},
+        {"recording float", base + ".float.effort", EffortFileFormatRecording, false, true, true},
+        {"recording rice", base + ".rice.effort", EffortFileFormatRecording, true, false, true},
+    };
+    const int numCases = sizeof(cases)/sizeof(cases[0]);
+    bool ok = WriteWavFile(cases[0].path, wav) && WriteWav16(cases[1].path, session, 0) && WriteWav16(cases[2].path, session, 2) &&
+              WriteRawPCM16(cases[3].path, session) &&
+              WriteRecording(cases[4].path, session, EffortSampleFormatFloat32, EffortRecordingCodecNone) &&
+              WriteRecording(cases[5].path, session, EffortSampleFormatInt16, EffortRecordingCodecRice);
+    if (!ok) {
+        printf("could not write the test files  FAIL\n");
+        return 1;
+    }
+
+    std::vector<EffortStageRegion> wavRegions;
+    for (int c = 0; c < numCases; c++) {
+        const FileCase &file = cases[c];
+        EffortFileReader reader;
+        std::string error;
+        bool opened = file.format == EffortFileFormatRawPCM ?
+            reader.OpenRawPCM(file.path, kSamplingRate, 1, EffortSampleFormatInt16, &error) : reader.Open(file.path, &error);
+        if (!opened) {
+            printf("%-22s %s  FAIL\n", file.name, error.c_str());
+            ok = false;
+            continue;
+        }
+
+        // sample for sample: floats exactly, 16 bit as the integer over the file's scale
+        std::vector<float> samples;
+        int64_t numSpans;
+        ReadAll(&reader, &samples, &numSpans);
+        float scale = file.format == EffortFileFormatRecording ? 32767.0f : 32768.0f;
+        int64_t numMismatched = 0;
+        for (size_t i = 0; i < samples.size() && i < session.size(); i++)
+            if (samples[i] != (file.isInt16 ? quantized[i]/scale : session[i]))
+                numMismatched++;
+        bool readOk = reader.Format() == file.format && reader.NumChannels() == 1 && reader.SamplingRate() == kSamplingRate &&
+                      samples.size() == session.size() && numMismatched == 0 && reader.IsZeroCopy() == file.zeroCopy;
+
+        // three efforts, each exhaling from where the generator started it (within a few blocks), and
+        // the quiet after the last one starts a fourth that never gets that far
+        const std::vector<EffortStageRegion> &regions = reader.StageRegions();
+        EffortStageRegion unused;
+        bool stagesOk = reader.NumEfforts() == kNumEfforts + 1 && !reader.FindStage(kNumEfforts, SpirometryStageIsExhaling, &unused) &&
+                        (reader.Markers().size() > 0) == file.hasMarkers;
+        double worstStartError = 0;
+        for (int e = 0; e < kNumEfforts && stagesOk; e++) {
+            EffortStageRegion exhale, calibrate, finished;
+            stagesOk = reader.FindStage(e, SpirometryStageIsExhaling, &exhale) &&
+                       reader.FindStage(e, SpirometryStageIsCalibratingSilence, &calibrate) &&
+                       reader.FindStage(e, SpirometryStageIsFinished, &finished) &&
+                       calibrate.firstFrame < exhale.firstFrame && exhale.firstFrame < finished.firstFrame;
+            double startError = fabs((double)(exhale.firstFrame - exhaleStarts[e]))/kSamplingRate;
+            worstStartError = std::max(worstStartError, startError);
+            stagesOk = stagesOk && startError < 0.25;
+        }
+        if (c == 0)
+            wavRegions = regions;
+        else if (!file.isInt16) // the same floats give the same index, from markers or from the detector
+            stagesOk = stagesOk && regions.size() == wavRegions.size() &&
+                       std::equal(regions.begin(), regions.end(), wavRegions.begin(), [](const EffortStageRegion &a, const EffortStageRegion &b) {
+                           return a.effort == b.effort && a.stage == b.stage && a.firstFrame == b.firstFrame && a.endFrame == b.endFrame;
+                       });
+
+        // seek to the second effort and replay it unpaced, against the same audio from memory
+        EffortStageRegion calibrate;
+        reader.FindStage(1, SpirometryStageIsCalibratingSilence, &calibrate);
+        EffortSession fromFile(kSamplingRate), fromMemory(kSamplingRate);
+        SessionSink sink;
+        sink.session = &fromFile;
+        sink.numSpans = 0;
+        sink.maxLateness = 0;
+        sink.speed = 0;
+        sink.firstFrame = calibrate.firstFrame;
+        double replayStart = WallSeconds();
+        int64_t delivered = reader.Deliver(&sink, calibrate.firstFrame, reader.NumFrames(), 1024, 0.0);
+        double replaySeconds = WallSeconds() - replayStart;
+        fromFile.FinishStream();
+        for (int64_t frame = calibrate.firstFrame; frame < calibrate.firstFrame + delivered; frame += 1024)
+            fromMemory.AddNewFloatData(&samples[(size_t)frame], std::min<int64_t>(1024, calibrate.firstFrame + delivered - frame));
+        fromMemory.FinishStream();
+        FlowVolumeResults a, b;
+        bool replayOk = fromFile.GetResults(&a) && fromMemory.GetResults(&b) && a.numSamples == b.numSamples &&
+                        a.peakFlowInLitersPerSecond == b.peakFlowInLitersPerSecond && a.fvcInLiters == b.fvcInLiters &&
+                        fabs(a.peakFlowInLitersPerSecond - peakFlows[1]) < 0.15f*peakFlows[1];
+
+        bool fileOk = readOk && stagesOk && replayOk;
+        printf("%-22s %7.1f s  %6lld spans  mismatched %lld  zero copy %-3s  efforts %d  regions %3d  exhale within %3.0f ms  "
+               "effort 2 PEF %.2f L/s  replay %5.0fx real time%s\n",
+               file.name, reader.Seconds(), (long long)numSpans, (long long)numMismatched, reader.IsZeroCopy() ? "yes" : "no",
+               reader.NumEfforts(), (int)regions.size(), worstStartError*1e3, a.peakFlowInLitersPerSecond,
+               delivered/kSamplingRate/std::max(replaySeconds, 1e-9), fileOk ? "" : "  FAIL");
+        ok = ok && fileOk;
+    }
+
+    // paced: the first effort's exhalation and end of test at -x times real time, none late by much
+    {
+        EffortFileReader reader;
+        reader.Open(cases[5].path);
+        EffortStageRegion exhale;
+        reader.FindStage(0, SpirometryStageIsExhaling, &exhale);
+        SessionSink sink;
+        sink.session = NULL; // only the pacing, so the sink's own work can not make it late
+        sink.numSpans = 0;
+        sink.maxLateness = 0;
+        sink.speed = speed;
+        sink.firstFrame = exhale.firstFrame;
+        sink.start = WallSeconds();
+        int64_t delivered = reader.Deliver(&sink, exhale.firstFrame, exhale.endFrame, 1024, speed);
+        double seconds = WallSeconds() - sink.start;
+        double expected = delivered/kSamplingRate/speed;
+        bool pacedOk = delivered == exhale.endFrame - exhale.firstFrame && seconds >= expected && seconds < expected + 0.1 && sink.maxLateness < 0.05;
+        printf("\npaced at %.1fx: %.2f s of exhalation in %.2f s (expected %.2f), worst span %.1f ms late%s\n",
+               speed, delivered/kSamplingRate, seconds, expected, sink.maxLateness*1e3, pacedOk ? "" : "  FAIL");
+        ok = ok && pacedOk;
+    }
+
+    // a recording that was never stopped and lost its tail: reads up to the last whole chunk
+    {
+        FILE *in = fopen(cases[4].path.c_str(), "rb");
+        std::vector<uint8_t> bytes;
+        uint8_t block[65536];
+        size_t numRead;
+        while (in && (numRead = fread(block, 1, sizeof(block), in)) > 0)
+            bytes.insert(bytes.end(), block, block + numRead);
+        if (in)
+            fclose(in);
+        int64_t chunkBytes = kEffortRecordingChunkHeaderBytes + (int64_t)kSamplingRate*sizeof(float);
+        std::string cutPath = base + ".cut.effort";
+        FILE *out = fopen(cutPath.c_str(), "wb");
+        size_t keep = (size_t)(kEffortRecordingHeaderBytes + 5*chunkBytes + chunkBytes/2); // five chunks and half of one (markers move it a bit)
+        fwrite(&bytes[0], 1, std::min(keep, bytes.size()), out);
+        fclose(out);
+        EffortFileReader reader;
+        std::vector<float> samples;
+        int64_t numSpans;
+        bool cutOk = reader.Open(cutPath);
+        ReadAll(&reader, &samples, &numSpans);
+        cutOk = cutOk && reader.NumFrames() > 0 && reader.NumFrames() % (int64_t)kSamplingRate == 0 &&
+                reader.NumFrames() <= 5*(int64_t)kSamplingRate && std::equal(samples.begin(), samples.end(), session.begin());
+        printf("recording cut at %zu bytes: %.1f s read back%s\n", keep, reader.Seconds(), cutOk ? "" : "  FAIL");
+        ok = ok && cutOk;
+        remove(cutPath.c_str());
+    }
+
+    // what opening costs next to reading the whole WAV into memory
+    {
+        const int numRepeats = 20;
+        double start = WallSeconds();
+        int64_t numFrames = 0;
+        for (int r = 0; r < numRepeats; r++) {
+            EffortFileReader reader;
+            reader.Open(cases[0].path);
+            numFrames += reader.NumFrames();
+        }
+        double openSeconds = (WallSeconds() - start)/numRepeats;
+        start = WallSeconds();
+        for (int r = 0; r < numRepeats; r++) {
+            WavAudio audio;
+            std::string error;
+            ReadWavFile(cases[0].path, &audio, &error);
+            numFrames += audio.NumFrames();
+        }
+        double readSeconds = (WallSeconds() - start)/numRepeats;
+        printf("open %.1f us against %.1f ms to read the whole %.1f MB WAV\n", openSeconds*1e6, readSeconds*1e3, session.size()*4e-6);
+    }
+
+    for (int c = 0; c < numCases; c++)
+        remove(cases[c].path.c_str());
+    printf("%s\n", ok ? "effort file reader OK" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,269 @@
+//
+//  EffortRecorderCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Check for EffortRecorder. A synthetic effort (and a quieter second channel for the stereo
+//  cases) is fed in 1024 frame callbacks at -x times real time (default 4) by an audio thread,
+//  while another thread adds stage markers, into a recorder whose writer stalls for 1.5 s on its
+//  first chunk and 50 ms on every later one, like storage that is busy. Nothing may be dropped,
+//  and the file must read back exactly what went in: the floats bit for bit, 16 bit PCM (plain or
+//  Rice coded) equal to the rounded input, and every marker. With a ring shorter than the stall
+//  the frames that do not fit have to be counted as dropped, and the file has to hold exactly the
+//  rest. When the storage fails partway the recording has to say so, and the file has to read
+//  back exactly the chunks written before the failure, with the rest counted as dropped. Also reports the worst time a callback spent in the recorder and what the codec saves.
+//
+//  usage: EffortRecorderCheck [-x speed]
+
+#include "BenchUtils.h"
+#include "EffortRecorder.h"
+#include "WhistleSignalGenerator.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <math.h>
+#include <string.h>
+
+static const float kSamplingRate = 44100.0f;
+static const int64_t kCallbackFrames = 1024;
+static const double kFirstStallInSeconds = 1.5;
+static const double kStallInSeconds = 0.05;
+
+// writer that is as slow as a busy flash write
+class SlowEffortRecorder : public EffortRecorder {
+
+public:
+    SlowEffortRecorder(double ringSeconds) : EffortRecorder(ringSeconds), mNumWrites(0) {}
+    ~SlowEffortRecorder() { Stop(); } // while WriteBytes is still this one
+
+protected:
+    virtual bool WriteBytes(const void *data, size_t numBytes) {
+        if (numBytes > 1024) // audio chunks, not the header or markers
+            std::this_thread::sleep_for(std::chrono::duration<double>(mNumWrites++ == 0 ? kFirstStallInSeconds : kStallInSeconds));
+        return EffortRecorder::WriteBytes(data, numBytes);
+    }
+
+    int mNumWrites;
+};
+
+// writer whose storage fails (full, removed) after a few audio chunks, with part of a chunk written
+class FailingEffortRecorder : public EffortRecorder {
+
+public:
+    FailingEffortRecorder(int numGoodChunks) : EffortRecorder(), mNumGoodChunks(numGoodChunks) {}
+    ~FailingEffortRecorder() { Stop(); }
+
+protected:
+    virtual bool WriteBytes(const void *data, size_t numBytes) {
+        if (numBytes > 1024 && mNumGoodChunks-- <= 0) {
+            EffortRecorder::WriteBytes(data, numBytes/2);
+            return false;
+        }
+        return EffortRecorder::WriteBytes(data, numBytes);
+    }
+
+    int mNumGoodChunks;
+};
+
+struct RecordingRun {
+    int64_t numFramesFed;
+    int64_t numFramesDropped;
+    int64_t numBytes;
+    int numMarkers;
+    double maxCallbackSeconds;
+    double stopSeconds;
+};
+
+static RecordingRun Record(EffortRecorder *recorder, const std::vector<float> &interleaved, int numChannels, double speed)
+{
+    RecordingRun run;
+    run.numFramesFed = (int64_t)interleaved.size()/numChannels;
+    run.maxCallbackSeconds = 0.0;
+    run.numMarkers = 6;
+
+    std::atomic<bool> fed(false);
+    std::thread markers([&]() {
+        for (int m = 0; m < run.numMarkers; m++) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(0.1/speed));
+            recorder->AddMarker(m);
+        }
+        while (!fed.load())
+            std::this_thread::yield();
+    });
+
+    double start = WallSeconds();
+    for (int64_t frame = 0; frame < run.numFramesFed; frame += kCallbackFrames) {
+        double due = start + frame/kSamplingRate/speed;
+        while (WallSeconds() < due)
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        int64_t numFrames = std::min(kCallbackFrames, run.numFramesFed - frame);
+        double callbackStart = WallSeconds();
+        recorder->AddNewInterleavedFloatData(&interleaved[(size_t)(frame*numChannels)], numFrames);
+        run.maxCallbackSeconds = std::max(run.maxCallbackSeconds, WallSeconds() - callbackStart);
+    }
+    fed.store(true);
+    markers.join();
+
+    double stopStart = WallSeconds();
+    recorder->Stop();
+    run.stopSeconds = WallSeconds() - stopStart;
+    run.numFramesDropped = recorder->NumDroppedFrames();
+    run.numBytes = recorder->NumBytesWritten();
+    return run;
+}
+
+static float Quantized(float sample)
+{
+    float scaled = sample*32767.0f;
+    scaled = scaled > 32767.0f ? 32767.0f : (scaled < -32768.0f ? -32768.0f : scaled);
+    return (float)lrintf(scaled)/32767.0f;
+}
+
+static bool CheckRecording(const char *name, const std::string &path, const std::vector<float> &interleaved, int numChannels,
+                           EffortSampleFormat format, EffortRecordingCodec codec, double ringSeconds, double speed, bool expectDrops)
+{
+    SlowEffortRecorder recorder(ringSeconds);
+    if (!recorder.Start(path, kSamplingRate, numChannels, format, codec)) {
+        printf("%-22s could not create %s  FAIL\n", name, path.c_str());
+        return false;
+    }
+    RecordingRun run = Record(&recorder, interleaved, numChannels, speed);
+
+    EffortRecordingInfo info;
+    std::vector<float> readBack;
+    std::vector<EffortRecordingMarker> markers;
+    bool ok = EffortRecorder::ReadFile(path, &info, &readBack, &markers);
+    ok = ok && info.numChannels == numChannels && info.samplingRate == kSamplingRate && info.sampleFormat == format;
+
+    // the first frames always fit, drops are the newest frames while the ring was full, so compare
+    // the read back frames against the fed frames that were not dropped, in order
+    int64_t numFramesRead = (int64_t)readBack.size()/numChannels;
+    ok = ok && numFramesRead + run.numFramesDropped == run.numFramesFed && numFramesRead == recorder.NumFramesWritten();
+    ok = ok && (expectDrops ? run.numFramesDropped > 0 : run.numFramesDropped == 0);
+    int64_t numMismatched = 0;
+    if (!expectDrops) {
+        for (size_t i = 0; i < readBack.size() && i < interleaved.size(); i++) {
+            float expected = format == EffortSampleFormatFloat32 ? interleaved[i] : Quantized(interleaved[i]);
+            if (memcmp(&expected, &readBack[i], sizeof(float)) != 0)
+                numMismatched++;
+        }
+    }
+    else {
+        // every chunk that made it is a run of consecutive fed samples
+        for (size_t i = 0; i < (size_t)std::min<int64_t>(recorder.RingCapacityInFrames()*numChannels, readBack.size()); i++)
+            if (memcmp(&interleaved[i], &readBack[i], sizeof(float)) != 0)
+                numMismatched++;
+    }
+    ok = ok && numMismatched == 0;
+
+    bool markersOk = (int)markers.size() == run.numMarkers;
+    for (size_t m = 0; markersOk && m < markers.size(); m++)
+        markersOk = markers[m].stage == (int32_t)m && markers[m].frame >= 0 && markers[m].frame <= run.numFramesFed &&
+                    (m == 0 || (markers[m].frame >= markers[m-1].frame && markers[m].timeInSeconds >= markers[m-1].timeInSeconds));
+    ok = ok && markersOk;
+
+    double rawBytes = (double)run.numFramesFed*numChannels*(format == EffortSampleFormatFloat32 ? 4 : 2);
+    printf("%-22s %3d ch  ring %4.1f s  dropped %7lld  mismatched %lld  markers %d/%d  %5.2f of raw  max callback %6.1f us  stop %4.2f s%s\n",
+           name, numChannels, (double)recorder.RingCapacityInFrames()/kSamplingRate, (long long)run.numFramesDropped,
+           (long long)numMismatched, (int)markers.size(), run.numMarkers, (double)run.numBytes/rawBytes,
+           run.maxCallbackSeconds*1e6, run.stopSeconds, ok ? "" : "  FAIL");
+    remove(path.c_str());
+    return ok;
+}
+
+static bool CheckFailedWrite(const std::string &path, const std::vector<float> &mono, double speed)
+{
+    const int numGoodChunks = 2;
+    FailingEffortRecorder recorder(numGoodChunks);
+    if (!recorder.Start(path, kSamplingRate, 1, EffortSampleFormatFloat32, EffortRecordingCodecNone)) {
+        printf("%-22s could not create %s  FAIL\n", "failed write", path.c_str());
+        return false;
+    }
+    RecordingRun run = Record(&recorder, mono, 1, speed);
+
+    EffortRecordingInfo info;
+    std::vector<float> readBack;
+    std::vector<EffortRecordingMarker> markers;
+    bool ok = recorder.HasFailed() && EffortRecorder::ReadFile(path, &info, &readBack, &markers);
+    int64_t numFramesRead = (int64_t)readBack.size();
+    ok = ok && numFramesRead == numGoodChunks*(int64_t)kSamplingRate && numFramesRead == recorder.NumFramesWritten();
+    ok = ok && numFramesRead + run.numFramesDropped == run.numFramesFed;
+    ok = ok && memcmp(&readBack[0], &mono[0], readBack.size()*sizeof(float)) == 0;
+
+    printf("%-22s %3d ch  written %lld frames  dropped %7lld  failed %s%s\n", "failed write", 1, (long long)numFramesRead,
+           (long long)run.numFramesDropped, recorder.HasFailed() ? "yes" : "no", ok ? "" : "  FAIL");
+    remove(path.c_str());
+    return ok;
+}
+
+// the codec on its own: exact round trip and speed on a minute of 16 bit whistle
+static bool CheckCodec(const std::vector<float> &mono)
+{
+    std::vector<int16_t> samples;
+    while (samples.size() < (size_t)(60*kSamplingRate))
+        for (size_t i = 0; i < mono.size(); i++)
+            samples.push_back((int16_t)lrintf(Quantized(mono[i])*32767.0f));
+    int64_t numFrames = (int64_t)samples.size();
+
+    std::vector<uint8_t> coded;
+    coded.reserve(samples.size()*2);
+    double start = CPUSeconds();
+    EffortRecorder::EncodeRice(&samples[0], numFrames, 1, &coded);
+    double encodeSeconds = CPUSeconds() - start;
+    std::vector<int16_t> decoded(samples.size());
+    start = CPUSeconds();
+    bool ok = EffortRecorder::DecodeRice(&coded[0], (int64_t)coded.size(), numFrames, 1, &decoded[0]);
+    double decodeSeconds = CPUSeconds() - start;
+    ok = ok && decoded == samples;
+
+    // a corrupt stream has to be refused, not read past its end
+    std::vector<uint8_t> truncated(coded.begin(), coded.begin() + coded.size()/2);
+    ok = ok && !EffortRecorder::DecodeRice(&truncated[0], (int64_t)truncated.size(), numFrames, 1, &decoded[0]);
+
+    double audioSeconds = numFrames/kSamplingRate;
+    printf("rice codec: %.0f s of 16 bit audio to %.2f of its size, encode %.0fx decode %.0fx real time%s\n",
+           audioSeconds, (double)coded.size()/(2.0*numFrames), audioSeconds/std::max(encodeSeconds, 1e-9),
+           audioSeconds/std::max(decodeSeconds, 1e-9), ok ? "" : "  FAIL");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 4.0;
+    for (int a=1; a+1 < argc; a += 2)
+        if (strcmp(argv[a], "-x") == 0) speed = atof(argv[a+1]);
+    std::string path = std::string(argv[0]) + ".effort";
+
+    WhistleSignalOptions options;
+    options.quietBeforeInSeconds = 1.0;
+    options.quietAfterInSeconds = 0.5;
+    options.snrInDecibels = 30.0f;
+    WhistleSignalGenerator generator(WhistleModel(), options);
+    generator.SetParametricFlowCurve(8.0f, 0.1f, 0.8f, 4.0f);
+    std::vector<float> mono;
+    generator.Generate(&mono);
+
+    // second microphone: quieter, delayed and with its own noise
+    std::vector<float> stereo(mono.size()*2);
+    uint32_t state = 7;
+    for (size_t i = 0; i < mono.size(); i++) {
+        stereo[2*i] = mono[i];
+        stereo[2*i+1] = 0.5f*(i >= 12 ? mono[i-12] : 0.0f) + 0.002f*BenchNoise(&state);
+    }
+    printf("%.1f s effort fed at %.1fx real time in %lld frame callbacks, writer stalls %.1f s then %.0f ms per chunk\n\n",
+           mono.size()/kSamplingRate, speed, (long long)kCallbackFrames, kFirstStallInSeconds, kStallInSeconds*1e3);
+
+    bool ok = CheckCodec(mono);
+    printf("\n");
+    ok = CheckRecording("float32", path, mono, 1, EffortSampleFormatFloat32, EffortRecordingCodecNone, kRecorderRingSeconds, speed, false) && ok;
+    ok = CheckRecording("int16", path, stereo, 2, EffortSampleFormatInt16, EffortRecordingCodecNone, kRecorderRingSeconds, speed, false) && ok;
+    ok = CheckRecording("int16 rice", path, mono, 1, EffortSampleFormatInt16, EffortRecordingCodecRice, kRecorderRingSeconds, speed, false) && ok;
+    ok = CheckRecording("int16 rice", path, stereo, 2, EffortSampleFormatInt16, EffortRecordingCodecRice, kRecorderRingSeconds, speed, false) && ok;
+    ok = CheckRecording("float32, short ring", path, mono, 1, EffortSampleFormatFloat32, EffortRecordingCodecNone, 2.0, speed, true) && ok;
+    ok = CheckFailedWrite(path, mono, speed) && ok;
+
+    printf("%s\n", ok ? "effort recorder OK" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,318 @@
+//
+//  EffortStageTrackerCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Check for EffortStageTracker. A synthetic effort whose flow stops for a moment in the middle
+//  (so the test nearly ends twice) and a recording with nobody blowing are pushed through the
+//  tracker in 1024 frame callbacks. The transitions it queues have to be exactly the ones
+//  EffortStageDetector gives for the same blocks, with willEndTestSoon once per drop instead of
+//  once per callback, and nothing after the effort is over. Then the threading: an audio thread
+//  paced at -x times real time (default 4) and a main queue stand-in that is slow to wake up
+//  must see the same transitions in the same order, and a consumer that does not drain at all
+//  must still get every transition while the level updates are held to half the queue. Other
+//  callback sizes have to give the same stages to within a callback.
+//
+//  usage: EffortStageTrackerCheck [-x speed]
+
+#include "BenchUtils.h"
+#include "EffortStageTracker.h"
+#include "EffortStageDetector.h"
+#include "WhistleSignalGenerator.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include <string.h>
+
+static const float kSamplingRate = 44100.0f;
+static const int64_t kCallbackFrames = 1024;
+
+struct StageChange {
+    SpirometryStage stage;
+    SpirometryStage previousStage;
+    int64_t frame;
+};
+
+static const char *StageName(SpirometryStage stage)
+{
+    switch (stage) {
+        case SpirometryStageIsIdle: return "idle";
+        case SpirometryStageIsCalibratingSilence: return "calibrating";
+        case SpirometryStageIsWaitingForTestToBegin: return "waiting to begin";
+        case SpirometryStageIsExhaling: return "exhaling";
+        case SpirometryStageIsWaitingForEndOfTest: return "end soon";
+        case SpirometryStageIsFinished: return "finished";
+        case SpirometryStageDidTimeOutWaitingForEffort: return "timed out";
+        case SpirometryStageIsAnalyzingResults: return "analyzing";
+    }
+    return "?";
+}
+
+static float BlockMax(const float *data, int64_t numFrames)
+{
+    float maxValue = data[0];
+    for (int64_t i = 1; i < numFrames; i++)
+        if (data[i] > maxValue)
+            maxValue = data[i];
+    return maxValue;
+}
+
+// what the analyzer used to do: the detector every callback until it is done
+static std::vector<StageChange> DetectorChanges(const std::vector<float> &audio, int64_t blockFrames, int64_t *numEndSoonCallbacks)
+{
+    EffortStageDetector detector(kSamplingRate);
+    std::vector<StageChange> changes;
+    SpirometryStage stage = SpirometryStageIsCalibratingSilence;
+    int64_t samplesRead = 0;
+    *numEndSoonCallbacks = 0;
+    for (int64_t i = 0; i < (int64_t)audio.size() && stage < SpirometryStageIsFinished; i += blockFrames) {
+        int64_t n = (int64_t)audio.size() - i < blockFrames ? (int64_t)audio.size() - i : blockFrames;
+        samplesRead += n;
+        SpirometryStage next = detector.AnalyzeStageFromAudioMax(BlockMax(&audio[i], n), samplesRead);
+        if (next == SpirometryStageIsWaitingForEndOfTest)
+            (*numEndSoonCallbacks)++;
+        if (next != stage) {
+            StageChange change = {next, stage, samplesRead};
+            changes.push_back(change);
+        }
+        stage = next;
+    }
+    return changes;
+}
+
+static bool SameChanges(const std::vector<StageChange> &a, const std::vector<StageChange> &b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++)
+        if (a[i].stage != b[i].stage || a[i].previousStage != b[i].previousStage || a[i].frame != b[i].frame)
+            return false;
+    return true;
+}
+
+static void PrintChanges(const std::vector<StageChange> &changes)
+{
+    for (size_t i = 0; i < changes.size(); i++)
+        printf("    %6.2f s  %s -> %s\n", changes[i].frame/kSamplingRate, StageName(changes[i].previousStage), StageName(changes[i].stage));
+}
+
+struct TrackerRun {
+    std::vector<StageChange> changes;
+    int64_t numLevelEvents;
+    int64_t numEventsAfterDone;
+    int64_t numDropped;
+    int64_t maxQueueSize;
+    double producerSecondsPerBlock;
+};
+
+static void PopEvents(StageEventQueue &events, TrackerRun *run, bool *sawDone)
+{
+    StageEvent event;
+    while (events.Pop(&event)) {
+        if (*sawDone)
+            run->numEventsAfterDone++;
+        if (event.type == StageEventAudioLevel) {
+            run->numLevelEvents++;
+            continue;
+        }
+        StageChange change = {event.stage, event.previousStage, event.frame};
+        run->changes.push_back(change);
+        *sawDone = event.stage >= SpirometryStageIsFinished;
+    }
+}
+
+// the audio thread calls AddBlock and wakes the consumer when something was queued (like merging
+// into the dispatch source); the consumer takes wakeSeconds to get going every time it is woken,
+// or never runs until the audio is over if wakeSeconds is negative
+static TrackerRun RunThreaded(const std::vector<float> &audio, double speed, double levelInterval, double wakeSeconds)
+{
+    EffortStageTracker tracker(kSamplingRate, levelInterval);
+    TrackerRun run = TrackerRun();
+    std::atomic<int> wakeUps(0);
+    std::atomic<bool> producerDone(false);
+    std::atomic<int64_t> maxQueueSize(0);
+    bool sawDone = false;
+
+    std::thread consumer([&]() {
+        if (wakeSeconds < 0)
+            return;
+        for (;;) {
+            bool done = producerDone.load();
+            if (wakeUps.exchange(0) > 0 || done) {
+                if (wakeSeconds > 0)
+                    std::this_thread::sleep_for(std::chrono::duration<double>(wakeSeconds));
+                PopEvents(tracker.Events(), &run, &sawDone);
+            }
+            if (done)
+                break;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    });
+
+    double start = WallSeconds();
+    double busySeconds = 0;
+    int64_t numBlocks = 0;
+    for (int64_t i = 0; i < (int64_t)audio.size(); i += kCallbackFrames) {
+        int64_t n = (int64_t)audio.size() - i < kCallbackFrames ? (int64_t)audio.size() - i : kCallbackFrames;
+        if (speed > 0) {
+            double due = start + i/(kSamplingRate*speed);
+            while (WallSeconds() < due)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        double blockStart = WallSeconds();
+        if (tracker.AddBlock(BlockMax(&audio[i], n), n) > 0)
+            wakeUps.fetch_add(1);
+        busySeconds += WallSeconds() - blockStart;
+        numBlocks++;
+        int64_t size = tracker.Events().Size();
+        if (size > maxQueueSize.load())
+            maxQueueSize.store(size);
+    }
+    producerDone.store(true);
+    consumer.join();
+    if (wakeSeconds < 0)
+        PopEvents(tracker.Events(), &run, &sawDone);
+
+    run.numDropped = tracker.Events().NumDropped();
+    run.maxQueueSize = maxQueueSize.load();
+    run.producerSecondsPerBlock = busySeconds/numBlocks;
+    return run;
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 4.0;
+    for (int a=1; a+1 < argc; a += 2)
+        if (strcmp(argv[a], "-x") == 0) speed = atof(argv[a+1]);
+
+    // a forced exhalation that stops for 1.6 s (more than WAIT_DURATION_AFTER_PEAK, less than
+    // WAIT_DURATION_AFTER_TEST) and picks up again before it tails off
+    const float interval = 0.01f;
+    std::vector<float> flow;
+    for (int i = 0; i < 500; i++) {
+        float t = i*interval;
+        if (t < 0.1f)
+            flow.push_back(8.0f*t/0.1f);
+        else if (t < 1.2f)
+            flow.push_back(8.0f*expf(-(t - 0.1f)/0.8f));
+        else if (t < 2.8f)
+            flow.push_back(0.0f);
+        else
+            flow.push_back(3.0f*expf(-(t - 2.8f)/0.8f));
+    }
+    WhistleSignalOptions options;
+    options.quietAfterInSeconds = 5.0;
+    WhistleSignalGenerator generator(WhistleModel(), options);
+    generator.SetFlowCurve(&flow[0], (int64_t)flow.size(), interval);
+    std::vector<float> effort;
+    generator.Generate(&effort);
+
+    // nobody blows, the tracker has to time out and stay quiet after it
+    std::vector<float> silence((size_t)((2.0 + TIME_OUT_WAIT_FOR_TEST_START + 3.0)*kSamplingRate));
+    uint32_t state = 5;
+    for (size_t i = 0; i < silence.size(); i++)
+        silence[i] = options.roomNoiseLevel*options.whistleAmplitude*BenchNoise(&state);
+
+    bool ok = true;
+
+    // transitions against the detector, unthreaded
+    int64_t numEndSoonCallbacks = 0, numIgnored = 0;
+    std::vector<StageChange> reference = DetectorChanges(effort, kCallbackFrames, &numEndSoonCallbacks);
+    std::vector<StageChange> silenceReference = DetectorChanges(silence, kCallbackFrames, &numIgnored);
+    printf("effort, %.1f s:\n", effort.size()/kSamplingRate);
+    PrintChanges(reference);
+    printf("nobody blowing, %.1f s:\n", silence.size()/kSamplingRate);
+    PrintChanges(silenceReference);
+
+    int64_t numEndSoon = 0;
+    for (size_t i = 0; i < reference.size(); i++)
+        if (reference[i].stage == SpirometryStageIsWaitingForEndOfTest)
+            numEndSoon++;
+    bool shapeOk = !reference.empty() && reference.back().stage == SpirometryStageIsFinished && numEndSoon == 2 &&
+                   !silenceReference.empty() && silenceReference.back().stage == SpirometryStageDidTimeOutWaitingForEffort;
+    printf("willEndTestSoon %lld times, was once per callback: %lld times  %s\n\n",
+           (long long)numEndSoon, (long long)numEndSoonCallbacks, shapeOk ? "ok" : "FAIL");
+    ok = ok && shapeOk;
+
+    TrackerRun unthreaded = RunThreaded(effort, 0, 0, -1);
+    TrackerRun timeout = RunThreaded(silence, 0, 0, -1);
+    bool sameOk = SameChanges(unthreaded.changes, reference) && SameChanges(timeout.changes, silenceReference) &&
+                  unthreaded.numEventsAfterDone == 0 && timeout.numEventsAfterDone == 0;
+    printf("tracker against the detector: %s (%.0f ns per callback)\n", sameOk ? "same transitions" : "FAIL",
+           unthreaded.producerSecondsPerBlock*1e9);
+    ok = ok && sameOk;
+
+    // the same stages are reached again after Clear
+    {
+        EffortStageTracker tracker(kSamplingRate);
+        for (int pass = 0; pass < 2; pass++) {
+            tracker.Clear();
+            TrackerRun run = TrackerRun();
+            bool sawDone = false;
+            for (int64_t i = 0; i < (int64_t)effort.size(); i += kCallbackFrames) {
+                int64_t n = (int64_t)effort.size() - i < kCallbackFrames ? (int64_t)effort.size() - i : kCallbackFrames;
+                tracker.AddBlock(BlockMax(&effort[i], n), n);
+            }
+            PopEvents(tracker.Events(), &run, &sawDone);
+            bool clearOk = SameChanges(run.changes, reference) && tracker.Stage() == SpirometryStageIsFinished;
+            if (!clearOk) {
+                printf("pass %d after Clear: FAIL\n", pass);
+                ok = false;
+            }
+        }
+    }
+
+    // threads: paced audio with a main queue that takes 20 ms to get to it, and level updates at 30 per second
+    const double levelInterval = 1.0/30.0;
+    TrackerRun paced = RunThreaded(effort, speed, levelInterval, 0.020);
+    // counted in samples, so an update goes out on the first callback at least the interval after the last
+    int64_t levelFrames = (int64_t)ceil(levelInterval*kSamplingRate);
+    levelFrames = (levelFrames + kCallbackFrames - 1)/kCallbackFrames*kCallbackFrames;
+    int64_t expectedLevels = (reference.back().frame - reference.front().frame)/levelFrames;
+    bool pacedOk = SameChanges(paced.changes, reference) && paced.numEventsAfterDone == 0 && paced.numDropped == 0 &&
+                   paced.numLevelEvents >= expectedLevels - 1 && paced.numLevelEvents <= expectedLevels + 2;
+    printf("paced %.0fx, consumer 20 ms late: %s, %lld level updates (%lld expected), queue at most %lld  %s\n",
+           speed, paced.changes.size() == reference.size() ? "every transition" : "transitions missing",
+           (long long)paced.numLevelEvents, (long long)expectedLevels, (long long)paced.maxQueueSize, pacedOk ? "ok" : "FAIL");
+    ok = ok && pacedOk;
+
+    // a consumer that never gets to run while the audio comes in: transitions still all there,
+    // level updates stop at half the queue instead of crowding them out
+    TrackerRun stalled = RunThreaded(effort, 0, 1.0/kSamplingRate, -1);
+    bool stalledOk = SameChanges(stalled.changes, reference) && stalled.numDropped == 0 &&
+                     stalled.numLevelEvents <= kStageEventQueueLength/2 && stalled.maxQueueSize < kStageEventQueueLength;
+    printf("consumer stalled, level every callback: %lld transitions, %lld level updates, %lld dropped  %s\n",
+           (long long)stalled.changes.size(), (long long)stalled.numLevelEvents, (long long)stalled.numDropped, stalledOk ? "ok" : "FAIL");
+    ok = ok && stalledOk;
+
+    // other callback sizes see the stages within a callback of where 1024 frames do
+    const int64_t blockSizes[] = {256, 512, 2048, 4096};
+    for (size_t b = 0; b < sizeof(blockSizes)/sizeof(blockSizes[0]); b++) {
+        std::vector<StageChange> changes;
+        EffortStageTracker tracker(kSamplingRate);
+        bool sawDone = false;
+        TrackerRun run = TrackerRun();
+        for (int64_t i = 0; i < (int64_t)effort.size(); i += blockSizes[b]) {
+            int64_t n = (int64_t)effort.size() - i < blockSizes[b] ? (int64_t)effort.size() - i : blockSizes[b];
+            tracker.AddBlock(BlockMax(&effort[i], n), n);
+        }
+        PopEvents(tracker.Events(), &run, &sawDone);
+        bool sizeOk = run.changes.size() == reference.size();
+        int64_t worst = 0;
+        int64_t tolerance = blockSizes[b] + kCallbackFrames; // where each size's callback ends, either side
+        for (size_t i = 0; sizeOk && i < reference.size(); i++) {
+            int64_t diff = llabs(run.changes[i].frame - reference[i].frame);
+            worst = diff > worst ? diff : worst;
+            sizeOk = run.changes[i].stage == reference[i].stage && diff <= tolerance;
+        }
+        printf("%lld frame callbacks: transitions at most %.1f ms from 1024 frames  %s\n",
+               (long long)blockSizes[b], 1e3*worst/kSamplingRate, sizeOk ? "ok" : "FAIL");
+        ok = ok && sizeOk;
+    }
+
+    printf("%s\n", ok ? "stage tracker OK" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,469 @@
+//
+//  EffortStoreBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  EffortStore with a million synthetic efforts: 10000 patients, 20 sessions each spread over four
+//  years, about 5 efforts a session on one of 8 whistles, one in ten flagged with a cough. Each
+//  patient has a FEV1 and FVC that decline at their own rate and every effort is a little off them,
+//  with a gamma shaped flow curve of 2 to 4 s at 100 Hz that holds exactly those measures (the
+//  pipeline is not run, these are the results it would hand over). Sessions of different patients
+//  take turns, so a patient's efforts are spread over the whole file.
+//
+//  Times appending and the file size, opening the store again (the record header scan), building
+//  the indexes, single session queries, every session summarized and every patient's trend from 1
+//  thread up to every core, pairwise curve comparisons with the vector lanes against one lane, and
+//  the whistle index. Fails if a summary or trend differs from one worked out from the generated
+//  efforts, a curve does not come back within half a count, the vector and scalar comparisons
+//  disagree, the indexes lose an effort or a torn last record is not dropped on open.
+//
+//  usage: EffortStoreBenchmark [-n efforts] [-j maxThreads] [-f file]
+
+#include "BenchUtils.h"
+#include "EffortStore.h"
+#include "FFTLanes.h"
+#include <algorithm>
+#include <thread>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+
+static const int kEffortsPerPatient = 100;
+static const int kSessionsPerPatient = 20;
+static const int kNumWhistles = 8;
+static const double kFirstTime = 1.42e9;            // unix seconds, early 2015
+static const float kInterval = 1.0f/100.0f;
+
+// what the store should say, kept as the efforts are made
+struct TrueSession {
+    int64_t patient;
+    double timeInSeconds;
+    int numEfforts, numAcceptable;
+    int64_t bestEffort;
+    float pef, fevOne[2], fvc[2];
+};
+
+struct Generator {
+    uint32_t state;
+    std::vector<float> timeStamps, flow, volume;
+
+    float Uniform(float low, float high) { return low + (high - low)*0.5f*(BenchNoise(&state) + 1.0f); }
+
+    // flow = fvc k^2 t e^-kt, its volume fvc (1 - (1 + kt) e^-kt), from a first stamp a little before zero
+    void MakeCurves(float fevOne, float fvc, FlowVolumeResults *results) {
+        float k = -logf(1.0f - fevOne/fvc)*0.55f + 1.0f;  // about what puts the right share into the first second
+        int64_t numSamples = (int64_t)Uniform(200, 400);
+        float first = -kInterval*(int)Uniform(0, 4);
+        timeStamps.resize((size_t)numSamples);
+        flow.resize((size_t)numSamples);
+        volume.resize((size_t)numSamples);
+        for (int64_t i = 0; i < numSamples; i++) {
+            float t = first + i*kInterval;
+            float kt = k*std::max(t, 0.0f);
+            timeStamps[(size_t)i] = t;
+            flow[(size_t)i] = fvc*k*kt*expf(-kt);
+            volume[(size_t)i] = fvc*(1.0f - (1.0f + kt)*expf(-kt));
+        }
+        results->numSamples = numSamples;
+        results->timeStamps = &timeStamps[0];
+        results->flow = &flow[0];
+        results->volume = &volume[0];
+        results->peakFlowInLitersPerSecond = fvc*k/expf(1.0f);
+        results->fevOneInLiters = fevOne;
+        results->fvcInLiters = fvc;
+        results->fevOneOverFvc = fevOne/fvc;
+        results->numErrors = 0;
+        results->errors = NULL;
+    }
+};
+
+static bool Same(float a, float b, float tolerance = 0)
+{
+    return (isnan(a) && isnan(b)) || fabsf(a - b) <= tolerance;
+}
+
+// CompareCurves with one lane, to check and time the vector kernel against
+static CurveDistance CompareCurvesScalar(const float *flowA, const float *volumeA, int64_t numA, float firstTimeA,
+                                         const float *flowB, const float *volumeB, int64_t numB, float firstTimeB)
+{
+    int64_t shift = (int64_t)lroundf((firstTimeA - firstTimeB)/kInterval);
+    int64_t firstA = std::max<int64_t>(0, -shift);
+    int64_t length = std::min(numA, numB - shift) - firstA;
+    CurveDistance distance;
+    distance.numSamples = std::max<int64_t>(0, length);
+    double flowSum = 0, volumeSum = 0;
+    for (int64_t i = firstA; i < firstA + length; i++) {
+        flowSum += (double)(flowA[i] - flowB[i + shift])*(flowA[i] - flowB[i + shift]);
+        volumeSum += (double)(volumeA[i] - volumeB[i + shift])*(volumeA[i] - volumeB[i + shift]);
+    }
+    distance.flowInLitersPerSecond = length > 0 ? (float)sqrt(flowSum/length) : NAN;
+    distance.volumeInLiters = length > 0 ? (float)sqrt(volumeSum/length) : NAN;
+    return distance;
+}
+
+int main(int argc, char **argv)
+{
+    int64_t numEfforts = 1000000;
+    int maxThreads = (int)std::thread::hardware_concurrency();
+    std::string path = "/tmp/EffortStoreBenchmark.store";
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "-n") == 0 && a+1 < argc)
+            numEfforts = std::max(kEffortsPerPatient, atoi(argv[++a]));
+        else if (strcmp(argv[a], "-j") == 0 && a+1 < argc)
+            maxThreads = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-f") == 0 && a+1 < argc)
+            path = argv[++a];
+    }
+    maxThreads = std::max(1, maxThreads);
+    int64_t numPatients = numEfforts/kEffortsPerPatient;
+    int64_t numSessions = numPatients*kSessionsPerPatient;
+    remove(path.c_str());
+
+    bool ok = true;
+    std::string error;
+    EffortStore store;
+    if (!store.Open(path, kInterval, &error)) {
+        printf("cannot open %s: %s\nFAIL\n", path.c_str(), error.c_str());
+        return 1;
+    }
+
+    // each patient's level and decline, then the sessions round by round, every patient once a round
+    Generator generator;
+    generator.state = 2015;
+    std::vector<float> patientFvc((size_t)numPatients), patientRatio((size_t)numPatients), patientDecline((size_t)numPatients);
+    for (int64_t p = 0; p < numPatients; p++) {
+        patientFvc[(size_t)p] = generator.Uniform(2.0f, 5.5f);
+        patientRatio[(size_t)p] = generator.Uniform(0.55f, 0.85f);
+        patientDecline[(size_t)p] = generator.Uniform(0.0f, 0.12f);
+    }
+    std::vector<TrueSession> truth((size_t)numSessions);
+    FlowVolumeResults results;
+    int64_t numAppended = 0, numSamples = 0;
+    double appendSeconds = 0, start;
+    for (int64_t s = 0; s < numSessions; s++) {
+        int64_t patient = s % numPatients;
+        int64_t round = s/numPatients;
+        TrueSession &session = truth[(size_t)s];
+        session.patient = 1000 + patient;
+        session.timeInSeconds = kFirstTime + (round*(4.0/kSessionsPerPatient) + generator.Uniform(0.0f, 0.1f))*kSecondsPerYear;
+        session.numEfforts = (int)std::min<int64_t>(numEfforts - numAppended, (int64_t)generator.Uniform(3, 8));
+        session.numAcceptable = 0;
+        session.bestEffort = -1;
+        session.pef = session.fevOne[0] = session.fevOne[1] = session.fvc[0] = session.fvc[1] = -INFINITY;
+        float years = (float)((session.timeInSeconds - kFirstTime)/kSecondsPerYear);
+        float fvc = patientFvc[(size_t)patient] - patientDecline[(size_t)patient]*years;
+        int32_t whistle = (int32_t)(patient % kNumWhistles);
+        for (int e = 0; e < session.numEfforts; e++) {
+            float effortFvc = fvc*generator.Uniform(0.94f, 1.0f);
+            float effortFevOne = effortFvc*patientRatio[(size_t)patient]*generator.Uniform(0.97f, 1.03f);
+            generator.MakeCurves(effortFevOne, effortFvc, &results);
+            EffortKey key;
+            key.patient = session.patient;
+            key.session = 5000000 + s;
+            key.whistle = whistle;
+            key.timeInSeconds = session.timeInSeconds + 60.0*e;
+            key.flags = generator.Uniform(0, 1) < 0.1f ? EffortStoreFlagCough : EffortStoreFlagAcceptable;
+
+            start = WallSeconds();
+            int64_t effort = store.Append(key, results, &error);
+            appendSeconds += WallSeconds() - start;
+            ok = ok && effort == numAppended;
+            numAppended++;
+            numSamples += results.numSamples;
+
+            if (!(key.flags & EffortStoreFlagAcceptable))
+                continue;
+            session.numAcceptable++;
+            float *fevOne = session.fevOne, *bestFvc = session.fvc;
+            if (effortFevOne > fevOne[0]) { fevOne[1] = fevOne[0]; fevOne[0] = effortFevOne; }
+            else if (effortFevOne > fevOne[1]) fevOne[1] = effortFevOne;
+            if (effortFvc > bestFvc[0]) { bestFvc[1] = bestFvc[0]; bestFvc[0] = effortFvc; }
+            else if (effortFvc > bestFvc[1]) bestFvc[1] = effortFvc;
+            session.pef = std::max(session.pef, results.peakFlowInLitersPerSecond);
+            if (session.bestEffort < 0 || effortFevOne + effortFvc > store.Effort(session.bestEffort).fevOneInLiters +
+                store.Effort(session.bestEffort).fvcInLiters)
+                session.bestEffort = effort;
+        }
+        if (session.numEfforts == 0) {
+            numSessions = s;
+            truth.resize((size_t)s);
+            break;
+        }
+    }
+    start = WallSeconds();
+    store.Flush();
+    appendSeconds += WallSeconds() - start;
+    double fileBytes = (double)store.FileBytes();
+    printf("%lld efforts, %lld sessions, %lld patients, %.1f samples per curve\n", (long long)numAppended,
+           (long long)numSessions, (long long)numPatients, numSamples/(double)numAppended);
+    printf("append        %7.2f s  %9.0f efforts/s  %6.1f MB/s, file %.0f MB (%.0f bytes per effort, %.0f as floats)\n",
+           appendSeconds, numAppended/appendSeconds, fileBytes/1e6/appendSeconds, fileBytes/1e6, fileBytes/numAppended,
+           12.0*numSamples/numAppended + 64);
+
+    // results at another interval are turned away
+    generator.MakeCurves(3.0f, 4.0f, &results);
+    std::vector<float> wrongStamps(generator.timeStamps);
+    for (size_t i = 0; i < wrongStamps.size(); i++)
+        wrongStamps[i] *= 2;
+    results.timeStamps = &wrongStamps[0];
+    EffortKey wrongKey = {1, 1, 0, kFirstTime, EffortStoreFlagAcceptable};
+    if (store.Append(wrongKey, results, &error) != -1 || store.NumEfforts() != numAppended) {
+        printf("FAIL: appended results at another interval\n");
+        ok = false;
+    }
+    store.Close();
+
+    // the header scan
+    start = WallSeconds();
+    ok = store.Open(path, kInterval, &error) && ok;
+    double openSeconds = WallSeconds() - start;
+    if (store.NumEfforts() != numAppended || store.NumDroppedBytes() != 0) {
+        printf("FAIL: reopened with %lld efforts, %lld bytes dropped\n", (long long)store.NumEfforts(), (long long)store.NumDroppedBytes());
+        ok = false;
+    }
+    start = WallSeconds();
+    int64_t numIndexedSessions = store.NumSessions();
+    double indexSeconds = WallSeconds() - start;
+    printf("open          %7.3f s  %9.0f efforts/s\n", openSeconds, numAppended/openSeconds);
+    printf("indexes       %7.3f s  %lld patients, %lld sessions, %lld whistles\n", indexSeconds, (long long)store.NumPatients(),
+           (long long)numIndexedSessions, (long long)store.NumWhistles());
+    if (numIndexedSessions != numSessions || store.NumPatients() != numPatients) {
+        printf("FAIL: indexes hold %lld sessions and %lld patients\n", (long long)numIndexedSessions, (long long)store.NumPatients());
+        ok = false;
+    }
+
+    // curves back within half a count, on every 997th effort
+    int64_t numBadCurves = 0;
+    float worstCurve = 0;
+    std::vector<float> flow, volume;
+    generator.state = 99;
+    for (int64_t e = 0; e < numAppended; e += 997) {
+        const StoredEffort &stored = store.Effort(e);
+        if (!store.ReadCurves(e, &flow, &volume) || (int64_t)flow.size() != stored.numSamples) {
+            numBadCurves++;
+            continue;
+        }
+        // the same shape again from the stored measures
+        float k = -logf(1.0f - stored.fevOneInLiters/stored.fvcInLiters)*0.55f + 1.0f;
+        for (int64_t i = 0; i < stored.numSamples; i++) {
+            float kt = k*std::max(stored.firstTimeStamp + i*kInterval, 0.0f);
+            float off = std::max(fabsf(flow[(size_t)i] - stored.fvcInLiters*k*kt*expf(-kt)),
+                                 fabsf(volume[(size_t)i] - stored.fvcInLiters*(1.0f - (1.0f + kt)*expf(-kt))));
+            worstCurve = std::max(worstCurve, off);
+            numBadCurves += off > 0.5f*kEffortStoreQuantum + 1e-5f ? 1 : 0;
+        }
+    }
+    printf("curves        worst error %.5f (count %.4f), %lld samples off\n", worstCurve, kEffortStoreQuantum, (long long)numBadCurves);
+    ok = ok && numBadCurves == 0;
+
+    // single sessions at random, summary then every pair of curves
+    const int kNumQueries = 10000;
+    std::vector<double> summaryTimes, curveTimes;
+    SessionSummary summary;
+    std::vector<int64_t> compared;
+    std::vector<CurveDistance> distances;
+    int64_t numPairs = 0;
+    for (int q = 0; q < kNumQueries; q++) {
+        int64_t session = store.Session((int64_t)generator.Uniform(0, (float)numSessions - 1));
+        start = WallSeconds();
+        store.SummarizeSession(session, &summary);
+        summaryTimes.push_back(WallSeconds() - start);
+        start = WallSeconds();
+        int64_t n = store.CompareSessionCurves(session, &compared, &distances);
+        curveTimes.push_back(WallSeconds() - start);
+        numPairs += n*(n - 1)/2;
+    }
+    std::sort(summaryTimes.begin(), summaryTimes.end());
+    std::sort(curveTimes.begin(), curveTimes.end());
+    printf("one session   summary %.2f us (99%% %.2f), curve pairs %.1f us (99%% %.1f, %.1f pairs)\n",
+           1e6*summaryTimes[kNumQueries/2], 1e6*summaryTimes[kNumQueries*99/100], 1e6*curveTimes[kNumQueries/2],
+           1e6*curveTimes[kNumQueries*99/100], numPairs/(double)kNumQueries);
+
+    // every session and patient, from 1 thread up to every core
+    std::vector<SessionSummary> summaries, firstSummaries;
+    std::vector<PatientTrend> trends, firstTrends;
+    std::vector<CurveDistance> closest, firstClosest;
+    printf("every session and patient\n");
+    double oneThread[3] = {0, 0, 0};
+    for (int threads = 1; ; threads = std::min(2*threads, maxThreads)) {
+        double seconds[3];
+        start = WallSeconds();
+        store.SummarizeSessions(&summaries, threads);
+        seconds[0] = WallSeconds() - start;
+        start = WallSeconds();
+        store.TrendsOfPatients(&trends, threads);
+        seconds[1] = WallSeconds() - start;
+        start = WallSeconds();
+        numPairs = store.CompareAllSessionCurves(&closest, threads);
+        seconds[2] = WallSeconds() - start;
+        for (int i = 0; i < 3; i++)
+            oneThread[i] = threads == 1 ? seconds[i] : oneThread[i];
+        printf("    %2d threads  summaries %6.3f s (%4.1fx)  trends %6.3f s (%4.1fx)  closest curves %6.2f s (%4.1fx, %.1fM pairs/s)\n",
+               threads, seconds[0], oneThread[0]/seconds[0], seconds[1], oneThread[1]/seconds[1], seconds[2],
+               oneThread[2]/seconds[2], numPairs/seconds[2]/1e6);
+        if (threads == 1) {
+            firstSummaries = summaries;
+            firstTrends = trends;
+            firstClosest = closest;
+        }
+        else {
+            bool same = true;
+            for (size_t s = 0; s < summaries.size(); s++)
+                same = same && summaries[s].bestEffort == firstSummaries[s].bestEffort &&
+                       Same(summaries[s].fvcRepeatabilityInLiters, firstSummaries[s].fvcRepeatabilityInLiters) &&
+                       Same(closest[s].flowInLitersPerSecond, firstClosest[s].flowInLitersPerSecond);
+            for (size_t p = 0; p < trends.size(); p++)
+                same = same && trends[p].numSessions == firstTrends[p].numSessions &&
+                       Same(trends[p].fvcSlopeInLitersPerYear, firstTrends[p].fvcSlopeInLitersPerYear);
+            if (!same) {
+                printf("FAIL: %d threads differ from one\n", threads);
+                ok = false;
+            }
+        }
+        if (threads == maxThreads)
+            break;
+    }
+
+    // the summaries against the generated efforts
+    int64_t numBadSummaries = 0, numRepeatable = 0;
+    for (int64_t s = 0; s < numSessions; s++) {
+        const TrueSession &t = truth[(size_t)s];
+        const SessionSummary &m = summaries[(size_t)s];
+        bool hasOne = t.numAcceptable > 0, hasTwo = t.numAcceptable > 1;
+        float fevOneRepeatability = hasTwo ? t.fevOne[0] - t.fevOne[1] : NAN;
+        float fvcRepeatability = hasTwo ? t.fvc[0] - t.fvc[1] : NAN;
+        float limit = t.fvc[0] <= kSmallFVCInLiters ? kSmallRepeatabilityInLiters : kRepeatabilityInLiters;
+        bool isRepeatable = hasTwo && fevOneRepeatability <= limit && fvcRepeatability <= limit;
+        numRepeatable += isRepeatable ? 1 : 0;
+        bool same = m.session == 5000000 + s && m.patient == t.patient && m.timeInSeconds == t.timeInSeconds &&
+                    m.numEfforts == t.numEfforts && m.numAcceptable == t.numAcceptable && m.bestEffort == t.bestEffort &&
+                    Same(m.peakFlowInLitersPerSecond, hasOne ? t.pef : NAN) && Same(m.fevOneInLiters, hasOne ? t.fevOne[0] : NAN) &&
+                    Same(m.fvcInLiters, hasOne ? t.fvc[0] : NAN) && Same(m.fevOneRepeatabilityInLiters, fevOneRepeatability) &&
+                    Same(m.fvcRepeatabilityInLiters, fvcRepeatability) && m.isRepeatable == isRepeatable;
+        if (!same && numBadSummaries++ < 5)
+            printf("FAIL: session %lld summary differs\n", (long long)m.session);
+    }
+    printf("summaries     %lld of %lld sessions differ, %.0f%% repeatable\n", (long long)numBadSummaries, (long long)numSessions,
+           100.0*numRepeatable/numSessions);
+    ok = ok && numBadSummaries == 0;
+
+    // the trends, fit again from the generated session bests
+    int64_t numBadTrends = 0;
+    float worstSlope = 0, meanSlopeError = 0;
+    for (int64_t p = 0; p < numPatients; p++) {
+        double sumT = 0, sumTT = 0, sumF = 0, sumTF = 0, first = NAN;
+        int n = 0;
+        for (int64_t s = p; s < numSessions; s += numPatients) {
+            const TrueSession &t = truth[(size_t)s];
+            if (t.numAcceptable == 0)
+                continue;
+            first = n == 0 ? t.timeInSeconds : first;
+            double years = (t.timeInSeconds - first)/kSecondsPerYear;
+            sumT += years;
+            sumTT += years*years;
+            sumF += t.fvc[0];
+            sumTF += years*t.fvc[0];
+            n++;
+        }
+        float slope = n > 1 ? (float)((n*sumTF - sumT*sumF)/(n*sumTT - sumT*sumT)) : NAN;
+        const PatientTrend &trend = trends[(size_t)p];
+        bool same = trend.patient == 1000 + p && trend.numSessions == n && Same(trend.fvcSlopeInLitersPerYear, slope, 1e-4f);
+        numBadTrends += same ? 0 : 1;
+        if (n > 1) {
+            worstSlope = std::max(worstSlope, fabsf(trend.fvcSlopeInLitersPerYear - slope));
+            meanSlopeError += fabsf(trend.fvcSlopeInLitersPerYear + patientDecline[(size_t)p])/numPatients;
+        }
+    }
+    printf("trends        %lld of %lld patients differ (worst %.6f L/year), FVC slope %.3f L/year from the true decline\n",
+           (long long)numBadTrends, (long long)numPatients, worstSlope, meanSlopeError);
+    ok = ok && numBadTrends == 0;
+
+    // the comparison kernel alone on the first sessions' curves, held in memory
+    int64_t numKernelSessions = std::min<int64_t>(numSessions, 2000);
+    std::vector<std::vector<float> > flows, volumes;
+    std::vector<int64_t> sessionStarts, curveEfforts;
+    for (int64_t s = 0; s < numKernelSessions; s++) {
+        const int64_t *efforts;
+        int64_t n = store.SessionEfforts(store.Session(s), &efforts);
+        sessionStarts.push_back((int64_t)flows.size());
+        for (int64_t e = 0; e < n; e++) {
+            flows.push_back(std::vector<float>());
+            volumes.push_back(std::vector<float>());
+            store.ReadCurves(efforts[e], &flows.back(), &volumes.back());
+            curveEfforts.push_back(efforts[e]);
+        }
+    }
+    sessionStarts.push_back((int64_t)flows.size());
+    // every pair of each session's curves, vector lanes or one lane
+    auto compare = [&](int64_t i, int64_t j, bool vector) {
+        const StoredEffort &a = store.Effort(curveEfforts[(size_t)i]), &b = store.Effort(curveEfforts[(size_t)j]);
+        return vector ? EffortStore::CompareCurves(&flows[(size_t)i][0], &volumes[(size_t)i][0], a.numSamples, a.firstTimeStamp,
+                                                   &flows[(size_t)j][0], &volumes[(size_t)j][0], b.numSamples, b.firstTimeStamp, kInterval)
+                      : CompareCurvesScalar(&flows[(size_t)i][0], &volumes[(size_t)i][0], a.numSamples, a.firstTimeStamp,
+                                            &flows[(size_t)j][0], &volumes[(size_t)j][0], b.numSamples, b.firstTimeStamp);
+    };
+    int64_t numKernelPairs = 0, numDisagreements = 0;
+    for (int64_t s = 0; s < numKernelSessions; s++) {
+        for (int64_t i = sessionStarts[(size_t)s]; i < sessionStarts[(size_t)s+1]; i++) {
+            for (int64_t j = i + 1; j < sessionStarts[(size_t)s+1]; j++) {
+                CurveDistance vector = compare(i, j, true), scalar = compare(i, j, false);
+                numKernelPairs++;
+                numDisagreements += vector.numSamples == scalar.numSamples &&
+                                    Same(vector.flowInLitersPerSecond, scalar.flowInLitersPerSecond, 1e-4f*scalar.flowInLitersPerSecond + 1e-6f) &&
+                                    Same(vector.volumeInLiters, scalar.volumeInLiters, 1e-4f*scalar.volumeInLiters + 1e-6f) ? 0 : 1;
+            }
+        }
+    }
+    const int kNumRepeats = 20;
+    double laneSeconds[2];
+    volatile float sink = 0;
+    for (int lanes = 0; lanes < 2; lanes++) {
+        start = WallSeconds();
+        for (int repeat = 0; repeat < kNumRepeats; repeat++)
+            for (int64_t s = 0; s < numKernelSessions; s++)
+                for (int64_t i = sessionStarts[(size_t)s]; i < sessionStarts[(size_t)s+1]; i++)
+                    for (int64_t j = i + 1; j < sessionStarts[(size_t)s+1]; j++)
+                        sink = sink + compare(i, j, lanes == 0).flowInLitersPerSecond;
+        laneSeconds[lanes] = (WallSeconds() - start)/kNumRepeats;
+    }
+    printf("curve pairs   %d lanes %.3f us, 1 lane %.3f us per pair (%.1fx), %lld of %lld pairs disagree\n",
+           (int)VectorLanes::kNumLanes, 1e6*laneSeconds[0]/numKernelPairs, 1e6*laneSeconds[1]/numKernelPairs,
+           laneSeconds[1]/laneSeconds[0], (long long)numDisagreements, (long long)numKernelPairs);
+    ok = ok && numDisagreements == 0;
+
+    // the whistle index
+    int64_t numWhistleEfforts = 0;
+    start = WallSeconds();
+    for (int64_t w = 0; w < store.NumWhistles(); w++) {
+        const int64_t *efforts;
+        int64_t n = store.WhistleEfforts((int32_t)store.Whistle(w), &efforts);
+        for (int64_t e = 0; e < n; e++)
+            numWhistleEfforts += store.Effort(efforts[e]).key.whistle == store.Whistle(w) ? 1 : 0;
+    }
+    double whistleSeconds = WallSeconds() - start;
+    printf("whistles      %.3f s to walk all %lld whistles' efforts\n", whistleSeconds, (long long)store.NumWhistles());
+    if (numWhistleEfforts != numAppended) {
+        printf("FAIL: the whistle index holds %lld of %lld efforts\n", (long long)numWhistleEfforts, (long long)numAppended);
+        ok = false;
+    }
+
+    // a record torn by a crash is dropped, and appends carry on after the one before it
+    store.Close();
+    ok = truncate(path.c_str(), (off_t)fileBytes - 100) == 0 && ok;
+    ok = store.Open(path, kInterval, &error) && ok;
+    int64_t numDropped = store.NumDroppedBytes();
+    generator.MakeCurves(3.0f, 4.0f, &results);
+    ok = store.Append(wrongKey, results, &error) == numAppended - 1 && ok;
+    store.Close();
+    ok = store.Open(path, kInterval, &error) && ok;
+    bool reappended = store.NumEfforts() == numAppended && store.NumDroppedBytes() == 0 && store.ReadCurves(numAppended - 1, &flow, &volume);
+    printf("torn record   %lld bytes dropped on open, %s after appending again\n", (long long)numDropped, reappended ? "whole" : "damaged");
+    ok = ok && numDropped > 0 && reappended;
+    store.Close();
+    remove(path.c_str());
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+//
+//  FFTPlanBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Time per windowed real transform plus dB magnitude (what FFTHelper does per hop) for the
+//  window lengths the spirometer uses, RealFFT against ReferenceFFT (the radix-2 stand in for
+//  the old FFTHelper, which only transformed 2^floor(log2(N)) of the N samples). Also times a
+//  prime length that needs Bluestein, and the cost of the first instance (which builds the shared
+//  plans) against later ones (which only allocate their buffers).
+//
+//  usage: FFTPlanBenchmark [seconds per size]
+
+#include "BenchUtils.h"
+#include "ReferenceFFT.h"
+#include "RealFFT.h"
+#include <string.h>
+
+template <class F>
+static double SecondsPerCall(F call, double minSeconds)
+{
+    int64_t numCalls = 0;
+    double start = WallSeconds(), elapsed = 0;
+    do {
+        for (int i=0; i < 8; ++i)
+            call();
+        numCalls += 8;
+        elapsed = WallSeconds() - start;
+    } while (elapsed < minSeconds);
+    return elapsed/(double)numCalls;
+}
+
+int main(int argc, char **argv)
+{
+    const double secondsPerSize = argc > 1 ? atof(argv[1]) : 0.3;
+    const int sizes[] = {4096, 4410, 4800, 32768, 44100, 48000, 44111};
+
+    printf("%8s %10s %12s %12s %12s %10s\n", "length", "plan", "RealFFT us", "Msamples/s", "reference us", "speedup");
+    for (size_t i=0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+        int n = sizes[i];
+        std::vector<float> signal = MakeWhistleSweep(44100.0f, (float)n/44100.0f + 0.01f, 900.0f);
+        std::vector<float> magnitude((size_t)n/2 + 1);
+
+        double start = WallSeconds();
+        RealFFT fft(n);
+        double planSeconds = WallSeconds() - start;
+        start = WallSeconds();
+        RealFFT again(n);
+        double cachedSeconds = WallSeconds() - start;
+
+        double fftSeconds = SecondsPerCall([&]() { fft.PerformForwardFFTAndCopydBMagnitude(&signal[0], &magnitude[0]); }, secondsPerSize);
+        ReferenceFFT reference(n);
+        double referenceSeconds = SecondsPerCall([&]() { reference.PerformForwardFFTAndCopydBMagnitude(&signal[0], &magnitude[0]); }, secondsPerSize);
+
+        const FFTPlan &plan = fft.Plan().ComplexPlan();
+        char planName[32] = "";
+        if (plan.UsesBluestein())
+            snprintf(planName, sizeof(planName), "bluestein");
+        else
+            for (size_t r=0; r < plan.Radices().size() && strlen(planName) < 24; ++r)
+                snprintf(planName + strlen(planName), sizeof(planName) - strlen(planName), "%d", plan.Radices()[r]);
+        printf("%8d %10s %12.1f %12.1f %12.1f %9.2fx\n", n, planName, 1e6*fftSeconds, 1e-6*n/fftSeconds,
+               1e6*referenceSeconds, referenceSeconds/fftSeconds);
+        printf("%8s first instance (builds the plans) %.2f ms, next instance %.1f us\n", "", 1e3*planSeconds, 1e6*cachedSeconds);
+    }
+    printf("reference transforms 2^floor(log2(N)) points, so it is only exact for powers of two\n");
+    return 0;
+}
@@ -0,0 +1,166 @@
+//
+//  FFTPlanCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Correctness check for FFTPlan and RealFFT against a double precision DFT: every length up
+//  to 64, primes (Bluestein), powers of two and the window lengths the spirometer uses
+//  (4410, 4800, 22050, 24000, 44100, 48000). Large lengths compare a spread of bins rather
+//  than the full O(N^2) DFT. Also checks inverse round trips, the dB output against the
+//  FFTHelper formula, and that the plan caches hand out one plan per key across threads.
+
+#include "BenchUtils.h"
+#include "FFTPlan.h"
+#include "RealFFT.h"
+#include <thread>
+
+static const double kMaxError = 5e-6;  // max |X_k - DFT_k| relative to the signal's L2 norm
+
+// DFT of every 'step'-th bin below numBins, exact twiddles from a table indexed by k*n mod N
+static double MaxDFTError(const std::vector<float> &xr, const std::vector<float> &xi,
+                          const float *yr, const float *yi, int64_t numBins, int64_t step)
+{
+    int64_t n = (int64_t)xr.size();
+    std::vector<double> c((size_t)n), s((size_t)n);
+    for (int64_t i=0; i < n; ++i) {
+        c[(size_t)i] = cos(2.0*M_PI*(double)i/(double)n);
+        s[(size_t)i] = -sin(2.0*M_PI*(double)i/(double)n);
+    }
+    double norm = 0;
+    for (int64_t i=0; i < n; ++i)
+        norm += (double)xr[(size_t)i]*xr[(size_t)i] + (double)xi[(size_t)i]*xi[(size_t)i];
+    norm = sqrt(norm) + 1e-30;
+
+    double maxError = 0;
+    for (int64_t k=0; k < numBins; k += step) {
+        double re = 0, im = 0;
+        int64_t index = 0;
+        for (int64_t i=0; i < n; ++i) {
+            re += xr[(size_t)i]*c[(size_t)index] - xi[(size_t)i]*s[(size_t)index];
+            im += xr[(size_t)i]*s[(size_t)index] + xi[(size_t)i]*c[(size_t)index];
+            index += k;
+            if (index >= n) index -= n;
+        }
+        double error = hypot(re - yr[k], im - yi[k])/norm;
+        if (error > maxError) maxError = error;
+    }
+    return maxError;
+}
+
+static std::vector<float> Noise(int64_t n, uint32_t seed)
+{
+    std::vector<float> x((size_t)n);
+    for (int64_t i=0; i < n; ++i)
+        x[(size_t)i] = BenchNoise(&seed);
+    return x;
+}
+
+static bool CheckComplex(int64_t n)
+{
+    std::vector<float> xr = Noise(n, 17 + (uint32_t)n), xi = Noise(n, 91 + (uint32_t)n);
+    std::vector<float> yr = xr, yi = xi;
+    std::shared_ptr<const FFTPlan> plan = FFTPlan::Shared(n);
+    std::vector<float> sr((size_t)plan->ScratchLength()), si((size_t)plan->ScratchLength());
+    plan->Forward(&yr[0], &yi[0], sr.empty() ? NULL : &sr[0], si.empty() ? NULL : &si[0]);
+    int64_t step = n <= 1024 ? 1 : n/97;
+    double forwardError = MaxDFTError(xr, xi, &yr[0], &yi[0], n, step);
+
+    // Inverse(Forward(x))/N == x
+    plan->Inverse(&yr[0], &yi[0], sr.empty() ? NULL : &sr[0], si.empty() ? NULL : &si[0]);
+    double roundTripError = 0, norm = 0;
+    for (int64_t i=0; i < n; ++i) {
+        roundTripError = fmax(roundTripError, hypot(yr[(size_t)i]/n - xr[(size_t)i], yi[(size_t)i]/n - xi[(size_t)i]));
+        norm = fmax(norm, hypot(xr[(size_t)i], xi[(size_t)i]));
+    }
+    roundTripError /= norm;
+
+    bool ok = forwardError < kMaxError && roundTripError < kMaxError;
+    if (!ok || n > 64) {
+        printf("complex %6lld %-10s  forward %.2e  round trip %.2e%s\n", (long long)n,
+               plan->UsesBluestein() ? "bluestein" : "stockham", forwardError, roundTripError, ok ? "" : "  FAIL");
+    }
+    return ok;
+}
+
+static bool CheckReal(int64_t n, FFTWindowType windowType)
+{
+    std::vector<float> x = Noise(n, 7 + (uint32_t)n);
+    RealFFT fft(n, windowType);
+    fft.PerformForwardFFT(&x[0]);
+
+    const float *window = fft.Plan().Window();
+    std::vector<float> xr((size_t)n), xi((size_t)n, 0.0f);
+    for (int64_t i=0; i < n; ++i)
+        xr[(size_t)i] = window ? x[(size_t)i]*window[i] : x[(size_t)i];
+    int64_t step = n <= 1024 ? 1 : n/97;
+    double forwardError = MaxDFTError(xr, xi, fft.Real(), fft.Imag(), fft.NumBins(), step);
+
+    // dB output has the FFTHelper scaling
+    std::vector<float> dB((size_t)(n/2 + 1));
+    fft.CopydBMagnitudeToBuffer(&dB[0]);
+    double dBError = 0;
+    for (int64_t k=0; k < n/2; k += step) {
+        double power = (double)fft.Real()[k]*fft.Real()[k] + (double)fft.Imag()[k]*fft.Imag()[k];
+        double expected = 10.0*log10(4.0*power + 1e-20) - 10.0*log10(2.0*sqrt((double)n));
+        if (power > 1e-6)
+            dBError = fmax(dBError, fabs(expected - dB[(size_t)k]));
+    }
+
+    // inverse gives back the windowed frame
+    std::vector<float> y((size_t)n);
+    fft.PerformInverseFFT(fft.Real(), fft.Imag(), &y[0]);
+    double roundTripError = 0;
+    for (int64_t i=0; i < n; ++i)
+        roundTripError = fmax(roundTripError, fabs(y[(size_t)i] - xr[(size_t)i]));
+
+    bool ok = forwardError < kMaxError && roundTripError < 1e-4 && dBError < 1e-3;
+    if (!ok || n > 64) {
+        printf("real    %6lld window %d     forward %.2e  round trip %.2e  dB %.1e%s\n", (long long)n,
+               (int)windowType, forwardError, roundTripError, dBError, ok ? "" : "  FAIL");
+    }
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+
+    for (int64_t n=1; n <= 64; ++n)
+        ok = CheckComplex(n) && ok;
+    for (int64_t n=2; n <= 64; ++n)
+        ok = CheckReal(n, n % 2 ? FFTWindowRect : FFTWindowHann) && ok;
+    printf("lengths 1-64 %s\n", ok ? "ok" : "FAILED");
+
+    const int64_t sizes[] = {97, 101, 127, 1009, 1024, 4096, 4410, 4800, 22050, 24000, 32768, 44100, 48000, 65536, 100003};
+    for (size_t i=0; i < sizeof(sizes)/sizeof(sizes[0]); ++i)
+        ok = CheckComplex(sizes[i]) && ok;
+    const int64_t realSizes[] = {1009, 4096, 4410, 4800, 44100, 48000, 88200};
+    const FFTWindowType windows[] = {FFTWindowHann, FFTWindowRect, FFTWindowHamming, FFTWindowBlackman};
+    for (size_t i=0; i < sizeof(realSizes)/sizeof(realSizes[0]); ++i)
+        ok = CheckReal(realSizes[i], windows[i % 4]) && ok;
+
+    // spirometer window lengths should not need Bluestein
+    ok = !FFTPlan::Shared(44100)->UsesBluestein() && !FFTPlan::Shared(48000)->UsesBluestein() && ok;
+
+    // one plan per key, even when many threads ask at once
+    int64_t numPlans = RealFFTPlan::NumSharedPlans();
+    std::vector<const RealFFTPlan*> seen(8);
+    std::vector<std::thread> threads;
+    for (size_t t=0; t < seen.size(); ++t)
+        threads.push_back(std::thread([&seen, t]() { seen[t] = RealFFTPlan::Shared(24000, FFTWindowBlackman).get(); }));
+    for (size_t t=0; t < threads.size(); ++t)
+        threads[t].join();
+    bool shared = RealFFTPlan::NumSharedPlans() == numPlans + 1;
+    for (size_t t=1; t < seen.size(); ++t)
+        shared = shared && seen[t] == seen[0];
+    RealFFT a(44100), b(44100);
+    shared = shared && &a.Plan() == &b.Plan() && &a.Plan().ComplexPlan() == FFTPlan::Shared(22050).get();
+    printf("plan cache: %lld complex, %lld real plans, shared %s\n", (long long)FFTPlan::NumSharedPlans(),
+           (long long)RealFFTPlan::NumSharedPlans(), shared ? "ok" : "FAILED");
+    ok = shared && ok;
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
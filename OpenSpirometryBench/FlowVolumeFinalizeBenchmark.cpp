@@ -0,0 +1,235 @@
+//
+//  FlowVolumeFinalizeBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Per effort cost of building and finalizing the flow/volume curves: FlowVolumeCurve (contiguous
+//  preallocated columns) against the boxed reference (one allocation per sample, like the
+//  NSNumber arrays it replaces). Counts heap allocations by replacing operator new, reports the
+//  time to add all estimates and the finalize latency, and checks both give the same curves.
+//  Then the finalize latency against effort length (FlowVolumeCurve filters and back extrapolates
+//  as samples arrive, so it should not grow), and the same curves as the reference when the peak
+//  is replaced by a later one, when the flow is still rising at the end, and when estimates
+//  keep coming after finalizing.
+
+#include "BenchUtils.h"
+#include "BoxedFlowVolumeReference.h"
+#include "FlowVolumeCurve.h"
+#include <new>
+#include <atomic>
+#include <algorithm>
+#include <string.h>
+
+static std::atomic<int64_t> gNumAllocations(0);
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // new and delete below are a malloc/free pair
+#endif
+
+void *operator new(size_t size)
+{
+    gNumAllocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+struct EffortTimes {
+    std::vector<double> add, finalize;
+    int64_t addAllocations, finalizeAllocations;
+};
+
+// flow estimates at the analysis hop rate for a typical effort: fast rise, exponential decay
+static void MakeFlowEstimates(int which, std::vector<float> *flow, std::vector<double> *time)
+{
+    const double hop = (BUFFER_SIZE-(BUFFER_OVERLAP))/44100.0;
+    const double seconds = 5.0 + 0.5*(which % 4);
+    const double peak = 7.0 + (which % 5);
+    uint32_t state = 777 + which;
+    flow->clear();
+    time->clear();
+    for (double t=0; t < seconds; t += hop) {
+        double f = t < 0.12 ? peak*t/0.12 : peak*exp(-(t-0.12)/1.1);
+        flow->push_back((float)(f + 0.05*BenchNoise(&state)) + 0.3f);
+        time->push_back(2.5 + t); // estimates start after the silence calibration
+    }
+}
+
+// shapes the streaming post processing has to get right: a second, larger blow replaces the peak
+// after it settled, or the flow still rises at the end so the peak is among the last samples filtered
+static void MakeShapedFlowEstimates(int shape, double seconds, std::vector<float> *flow, std::vector<double> *time)
+{
+    const double hop = (BUFFER_SIZE-(BUFFER_OVERLAP))/44100.0;
+    uint32_t state = 99 + shape;
+    flow->clear();
+    time->clear();
+    for (double t=0; t < seconds; t += hop) {
+        double f = t < 0.12 ? 8.0*t/0.12 : 8.0*exp(-(t-0.12)/1.1);
+        if (shape == 1 && t > 0.6*seconds)
+            f += 10.0*exp(-(t-0.6*seconds)/0.4)*std::min(1.0, (t-0.6*seconds)/0.1);
+        if (shape == 2)
+            f = 1.0 + 6.0*t/seconds;
+        flow->push_back((float)(f + 0.05*BenchNoise(&state)) + 0.3f);
+        time->push_back(2.5 + t);
+    }
+}
+
+static double CurveDifference(const FlowVolumeResults &results, BoxedFlowVolumeReference &boxed)
+{
+    if ((int64_t)boxed.ResultFlow().size() != results.numSamples)
+        return INFINITY;
+    double difference = 0;
+    for (int64_t i=0; i < results.numSamples; ++i) {
+        difference = std::max(difference, (double)fabs(results.flow[i] - boxed.ResultFlow()[i]->value));
+        difference = std::max(difference, (double)fabs(results.volume[i] - boxed.ResultVolume()[i]->value));
+        difference = std::max(difference, (double)fabs(results.timeStamps[i] - boxed.ResultTime()[i]->value));
+    }
+    return difference;
+}
+
+static double Median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    return v[v.size()/2];
+}
+
+int main(int argc, char **argv)
+{
+    const int numEfforts = argc > 1 ? atoi(argv[1]) : 200;
+    std::vector<float> flow;
+    std::vector<double> time;
+
+    FlowVolumeCurve curve;
+    BoxedFlowVolumeReference boxed;
+    EffortTimes curveTimes = {}, boxedTimes = {};
+    curveTimes.add.reserve(numEfforts); curveTimes.finalize.reserve(numEfforts);
+    boxedTimes.add.reserve(numEfforts); boxedTimes.finalize.reserve(numEfforts);
+    double maxDifference = 0;
+    int64_t numSamples = 0;
+
+    for (int e=0; e < numEfforts; ++e) {
+        MakeFlowEstimates(e, &flow, &time);
+
+        // contiguous columns, reused across efforts like the analyzer does
+        curve.Clear();
+        int64_t allocationsBefore = gNumAllocations.load();
+        double start = WallSeconds();
+        for (size_t i=0; i < flow.size(); ++i)
+            curve.AddFlowEstimate(flow[i], time[i]);
+        double added = WallSeconds();
+        int64_t allocationsAdded = gNumAllocations.load();
+        FlowVolumeResults results;
+        curve.FinalizeCurves(&results);
+        double finished = WallSeconds();
+        int64_t allocationsFinished = gNumAllocations.load();
+        if (e > 0) { // first effort warms up, then nothing should allocate
+            curveTimes.add.push_back(added - start);
+            curveTimes.finalize.push_back(finished - added);
+            curveTimes.addAllocations += allocationsAdded - allocationsBefore;
+            curveTimes.finalizeAllocations += allocationsFinished - allocationsAdded;
+        }
+
+        // boxed reference
+        boxed.Clear();
+        allocationsBefore = gNumAllocations.load();
+        start = WallSeconds();
+        for (size_t i=0; i < flow.size(); ++i)
+            boxed.AddFlowEstimate(flow[i], time[i]);
+        added = WallSeconds();
+        allocationsAdded = gNumAllocations.load();
+        boxed.FinalizeCurves();
+        finished = WallSeconds();
+        allocationsFinished = gNumAllocations.load();
+        if (e > 0) {
+            boxedTimes.add.push_back(added - start);
+            boxedTimes.finalize.push_back(finished - added);
+            boxedTimes.addAllocations += allocationsAdded - allocationsBefore;
+            boxedTimes.finalizeAllocations += allocationsFinished - allocationsAdded;
+        }
+
+        // same curves from both
+        maxDifference = std::max(maxDifference, CurveDifference(results, boxed));
+        numSamples += results.numSamples;
+    }
+
+    int measured = numEfforts - 1;
+    printf("%d efforts, %.0f curve samples per effort, capacity %lld, grew %lld times\n",
+           measured, (double)numSamples/numEfforts, (long long)curve.Capacity(), (long long)curve.NumGrowths());
+    printf("                     add all (median)   finalize (median)   allocs/effort add   allocs/effort finalize\n");
+    printf("boxed reference      %10.1f us      %10.1f us       %10.1f          %10.1f\n",
+           1e6*Median(boxedTimes.add), 1e6*Median(boxedTimes.finalize),
+           (double)boxedTimes.addAllocations/measured, (double)boxedTimes.finalizeAllocations/measured);
+    printf("FlowVolumeCurve      %10.1f us      %10.1f us       %10.1f          %10.1f\n",
+           1e6*Median(curveTimes.add), 1e6*Median(curveTimes.finalize),
+           (double)curveTimes.addAllocations/measured, (double)curveTimes.finalizeAllocations/measured);
+    printf("finalize speedup %.1fx, max curve difference %.2g\n",
+           Median(boxedTimes.finalize)/Median(curveTimes.finalize), maxDifference);
+
+    // finalize latency should not depend on how long the effort was
+    const double durations[] = {2.5, 5.0, 10.0, 20.0, 40.0};
+    printf("effort length   samples   finalize FlowVolumeCurve (median)   finalize boxed (median)\n");
+    for (int d=0; d < (int)(sizeof(durations)/sizeof(double)); ++d) {
+        MakeShapedFlowEstimates(0, durations[d], &flow, &time);
+        std::vector<double> curveFinalize, boxedFinalize;
+        FlowVolumeResults results;
+        for (int r=0; r < 21; ++r) {
+            curve.Clear();
+            for (size_t i=0; i < flow.size(); ++i)
+                curve.AddFlowEstimate(flow[i], time[i]);
+            double start = WallSeconds();
+            curve.FinalizeCurves(&results);
+            curveFinalize.push_back(WallSeconds() - start);
+            boxed.Clear();
+            for (size_t i=0; i < flow.size(); ++i)
+                boxed.AddFlowEstimate(flow[i], time[i]);
+            start = WallSeconds();
+            boxed.FinalizeCurves();
+            boxedFinalize.push_back(WallSeconds() - start);
+        }
+        maxDifference = std::max(maxDifference, CurveDifference(results, boxed));
+        printf("%10.1f s   %7lld   %21.1f us   %19.1f us\n", durations[d], (long long)results.numSamples,
+               1e6*Median(curveFinalize), 1e6*Median(boxedFinalize));
+    }
+
+    // peaks the streaming fit has to revisit, and more estimates after finalizing
+    const char *shapes[] = {"later, larger peak", "rising at the end", "added after finalizing"};
+    for (int shape=0; shape < 3; ++shape) {
+        MakeShapedFlowEstimates(shape == 2 ? 1 : shape, 6.0, &flow, &time);
+        size_t split = shape == 2 ? flow.size()/2 : flow.size();
+        FlowVolumeResults results;
+        curve.Clear();
+        boxed.Clear();
+        for (size_t i=0; i < flow.size(); ++i) {
+            if (i == split)
+                curve.FinalizeCurves(&results);
+            curve.AddFlowEstimate(flow[i], time[i]);
+            boxed.AddFlowEstimate(flow[i], time[i]);
+        }
+        curve.FinalizeCurves(&results);
+        boxed.FinalizeCurves();
+        double difference = CurveDifference(results, boxed);
+        maxDifference = std::max(maxDifference, difference);
+        printf("%-24s max curve difference %.2g\n", shapes[shape], difference);
+    }
+
+    // serialized blob reads back to the same columns
+    FlowVolumeResults results, readBack;
+    curve.FinalizeCurves(&results);
+    std::vector<uint8_t> blob((size_t)results.SerializedSize());
+    int64_t numBytes = results.Serialize(&blob[0]);
+    bool blobOK = numBytes == (int64_t)blob.size() &&
+                  ReadSerializedFlowVolumeResults(&blob[0], numBytes, &readBack) &&
+                  readBack.numSamples == results.numSamples &&
+                  readBack.fvcInLiters == results.fvcInLiters &&
+                  memcmp(readBack.flow, results.flow, results.numSamples*sizeof(float)) == 0 &&
+                  memcmp(readBack.volume, results.volume, results.numSamples*sizeof(float)) == 0 &&
+                  memcmp(readBack.timeStamps, results.timeStamps, results.numSamples*sizeof(float)) == 0;
+    printf("serialized columnar results: %lld bytes for %lld samples, read back %s\n",
+           (long long)numBytes, (long long)results.numSamples, blobOK ? "identical" : "DIFFERENT");
+    return maxDifference < 1e-4 && curveTimes.finalizeAllocations == 0 && curveTimes.addAllocations == 0 && blobOK ? 0 : 1;
+}
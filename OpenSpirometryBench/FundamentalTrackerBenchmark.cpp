@@ -0,0 +1,337 @@
+//
+//  FundamentalTrackerBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Compares following the whistle fundamental with FundamentalTracker (USE_FUNDAMENTAL_TRACKER)
+//  against searching the whole band every window, the way EffortSession did before. First the
+//  per window cost of what the tracker changes, dB conversion plus the peak search, on the same
+//  band limited spectra of a normal effort, with the bins converted per window. Then both run
+//  through EffortSession on synthetic efforts from WhistleSignalGenerator (where the true
+//  fundamental is known) and any recordings given on the command line (.effort, WAV): the error
+//  of each estimate against the true fundamental at the window center, octave errors (an
+//  estimate at twice or half the truth) and octave jumps (from one estimate to the next), the
+//  PEF, FEV1 and FVC error, CPU time per second of audio, and for the tracker how often it
+//  searched the whole band and how confident it was. Recordings have no truth, only the jumps,
+//  the estimates that differ by more than 5% and the time are reported.
+//
+//  usage: FundamentalTrackerBenchmark [-r repeats] [file.effort|file.wav ...]
+
+#include "BenchUtils.h"
+#include "WhistleSignalGenerator.h"
+#include "ZoomSpectrum.h"
+#include "SpectrumPeakFinder.h"
+#include "FundamentalTracker.h"
+#include "EffortSession.h"
+#include "EffortFileReader.h"
+#include <algorithm>
+#include <string>
+#include <string.h>
+
+static const double kOctaveTolerance = 0.06;   // ratio within 6% of 2 or 1/2
+
+static double Median(std::vector<double> v)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[v.size()/2];
+}
+
+static double Percentile(std::vector<double> v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t)(p*(v.size()-1))];
+}
+
+static bool IsOctave(double ratio)
+{
+    return fabs(ratio - 2.0) < 2.0*kOctaveTolerance || fabs(ratio - 0.5) < 0.5*kOctaveTolerance;
+}
+
+//=============================================================================================================
+// dB conversion and peak search per window
+
+static void TimeSearch(int numRepeats)
+{
+    const float samplingRate = 44100.0f;
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    const int64_t length = BUFFER_SIZE/2;
+    WhistleModel whistle;
+    WhistleSignalOptions options;
+    WhistleSignalGenerator generator(whistle, options);
+    generator.SetParametricFlowCurve(9.0f, 0.1f, 0.9f, 5.0f);
+    std::vector<float> audio;
+    generator.Generate(&audio);
+
+    int64_t decimation = ZoomSpectrum::DecimationFactorForBand(BUFFER_SIZE, hop, samplingRate, whistle.MaxFrequency());
+    ZoomSpectrum spectrum(BUFFER_SIZE, samplingRate, whistle.MinFrequency(), whistle.MaxFrequency(), decimation);
+    SpectrumPeakFinder finder(spectrum.FrequencyResolution(), length);
+    FundamentalTracker tracker(spectrum.FrequencyResolution(), length, spectrum.FirstBin(), spectrum.LastBin(),
+                               hop/(double)samplingRate, (float)(MAX_FLOW_SLEW_IN_LPS_PER_SECOND/whistle.coefficient));
+    std::vector<SpectrumPeak> peaks((size_t)SpectrumPeakFinder::MaxNumPeaks(length, PEAK_WINDOW_SIZE));
+    std::vector<float> fullMagnitude((size_t)length), trackedMagnitude((size_t)length);
+    spectrum.FillBufferOutsideBand(&fullMagnitude[0], SPECTRUM_FLOOR_DB);
+    spectrum.FillBufferOutsideBand(&trackedMagnitude[0], SPECTRUM_FLOOR_DB);
+    int64_t searchLength = std::min<int64_t>(spectrum.LastBin() + 1 + (PEAK_WINDOW_SIZE), length);
+
+    // windows while the whistle sounds, from the start of the effort; each repeat goes through all of them
+    // again from a cleared tracker (it moves on with every update) and the fastest time per window is kept
+    int64_t first = (int64_t)(generator.EffortStartInSeconds()*samplingRate);
+    int64_t numWindows = (int64_t)(5.0*samplingRate)/hop;
+    std::vector<double> fullTimes((size_t)numWindows, 1e300), trackedTimes((size_t)numWindows, 1e300);
+    int64_t numTrackedBins = 0, numFound = 0, numTrackedFound = 0, numFullSearches = 0;
+    for (int r=0; r < numRepeats; ++r) {
+        spectrum.Clear();
+        tracker.Clear();
+        spectrum.AddNewFloatData(&audio[(size_t)(first - BUFFER_SIZE + hop)], BUFFER_SIZE - hop);
+        numTrackedBins = numFound = numTrackedFound = 0;
+        for (int64_t w=0; w < numWindows; ++w) {
+            spectrum.AddNewFloatData(&audio[(size_t)(first + w*hop)], hop);
+
+            double start = CPUSeconds();
+            spectrum.CopydBMagnitudeToBuffer(&fullMagnitude[0]);
+            int64_t numPeaks = finder.GetFundamentalPeaks(&fullMagnitude[0], searchLength, PEAK_WINDOW_SIZE, PEAK_DBMAG_SUSTAINED,
+                                                          MIN_FREQUENCY_OF_WHISTLE_IN_HZ, &peaks[0], (int64_t)peaks.size(), 3);
+            double middle = CPUSeconds();
+            int64_t firstBin, lastBin;
+            FundamentalEstimate estimate;
+            bool tracked = tracker.SearchBins(&firstBin, &lastBin);
+            spectrum.CopydBMagnitudeToBuffer(&trackedMagnitude[0], firstBin, lastBin);
+            bool found = tracker.Update(&trackedMagnitude[0], &estimate);
+            if (!found && tracked) { // lost, the whole band of this window (as EffortSession does)
+                tracker.SearchBins(&firstBin, &lastBin);
+                spectrum.CopydBMagnitudeToBuffer(&trackedMagnitude[0], firstBin, lastBin);
+                found = tracker.Update(&trackedMagnitude[0], &estimate);
+            }
+            double end = CPUSeconds();
+
+            fullTimes[(size_t)w] = std::min(fullTimes[(size_t)w], 1e9*(middle - start));
+            trackedTimes[(size_t)w] = std::min(trackedTimes[(size_t)w], 1e9*(end - middle));
+            numFound += numPeaks > 0 ? 1 : 0;
+            numTrackedFound += found ? 1 : 0;
+        }
+        numTrackedBins = tracker.NumBinsSearched();
+        numFullSearches = tracker.NumFullSearches();
+    }
+
+    int64_t bandBins = spectrum.LastBin() - spectrum.FirstBin() + 1;
+    printf("dB conversion and peak search per window (%lld windows of a 9 L/s effort, best of %d)\n",
+           (long long)numWindows, numRepeats);
+    printf("  %-12s %10s %10s %12s %10s\n", "", "median ns", "p95 ns", "bins/window", "found");
+    printf("  %-12s %10.0f %10.0f %12lld %10lld\n", "whole band", Median(fullTimes), Percentile(fullTimes, 0.95),
+           (long long)bandBins, (long long)numFound);
+    printf("  %-12s %10.0f %10.0f %12.1f %10lld\n", "tracker", Median(trackedTimes), Percentile(trackedTimes, 0.95),
+           numTrackedBins/(double)numWindows, (long long)numTrackedFound);
+    printf("  %lld whole band searches (%.0f%% of windows), %.1fx faster\n", (long long)numFullSearches,
+           100.0*numFullSearches/numWindows, Median(fullTimes)/std::max(1.0, Median(trackedTimes)));
+}
+
+//=============================================================================================================
+// Accuracy through EffortSession
+
+struct EffortStats {
+    std::vector<double> errors;     // Hz against the truth
+    std::vector<double> confidences;
+    std::vector<float> frequencies; // every estimate, in order
+    int64_t numOctaveErrors;
+    int64_t numOctaveJumps;
+    int64_t numFullSearches;
+    int64_t numLockLosses;
+    double cpuMillisecondsPerSecond;
+    bool hasResults;
+    double pefError, fevOneError, fvcError; // percent
+};
+
+static void RunEffort(const std::vector<float> &audio, float samplingRate, const WhistleModel &whistle, bool useTracker,
+                      const WhistleSignalGenerator *truth, EffortStats *stats)
+{
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    EffortSession session(samplingRate, whistle);
+    session.SetFundamentalTracking(useTracker);
+    session.SetMultiResolution(false); // long windows throughout, the tracker follows them
+    stats->numOctaveErrors = stats->numOctaveJumps = 0;
+    stats->hasResults = false;
+    stats->pefError = stats->fevOneError = stats->fvcError = 0;
+
+    double cpu = 0;
+    int64_t numAudio = (int64_t)audio.size();
+    for (int64_t p=0; p < numAudio && session.CurrentStage() < SpirometryStageIsFinished; p += hop) {
+        int64_t numEstimates = session.NumFlowEstimates();
+        double start = CPUSeconds();
+        session.AddNewFloatData(&audio[(size_t)p], std::min(hop, numAudio - p));
+        cpu += CPUSeconds() - start;
+        if (session.NumFlowEstimates() == numEstimates)
+            continue;
+
+        float frequency = session.LastFrequency();
+        if (!stats->frequencies.empty() && IsOctave(frequency/stats->frequencies.back()))
+            stats->numOctaveJumps++;
+        stats->frequencies.push_back(frequency);
+        if (useTracker)
+            stats->confidences.push_back(session.LastConfidence());
+        if (truth) {
+            // the window ending here, centered half a window back
+            double center = (p + std::min(hop, numAudio - p) - BUFFER_SIZE/2)/(double)samplingRate - truth->EffortStartInSeconds();
+            float trueFlow = truth->FlowAtTime(center);
+            float trueFrequency = whistle.FrequencyFromFlow(trueFlow);
+            if (trueFlow > 0.05f*truth->PeakFlow() && trueFrequency > MIN_FREQUENCY_OF_WHISTLE_IN_HZ) {
+                stats->errors.push_back(fabs(frequency - trueFrequency));
+                stats->numOctaveErrors += IsOctave(frequency/trueFrequency) ? 1 : 0;
+            }
+        }
+    }
+    double start = CPUSeconds();
+    session.FinishStream();
+    cpu += CPUSeconds() - start;
+    stats->cpuMillisecondsPerSecond = 1e3*cpu/(numAudio/(double)samplingRate);
+    stats->numFullSearches = useTracker ? session.Tracker().NumFullSearches() : session.NumFramesAnalyzed();
+    stats->numLockLosses = useTracker ? session.Tracker().NumLockLosses() : 0;
+
+    FlowVolumeResults results;
+    stats->hasResults = session.GetResults(&results);
+    if (stats->hasResults && truth) {
+        stats->pefError = 100.0*fabs(results.peakFlowInLitersPerSecond - truth->PeakFlow())/truth->PeakFlow();
+        stats->fevOneError = 100.0*fabs(results.fevOneInLiters - truth->FEVOne())/truth->FEVOne();
+        stats->fvcError = 100.0*fabs(results.fvcInLiters - truth->FVC())/truth->FVC();
+    }
+}
+
+static void PrintStats(const char *method, const EffortStats &s, bool hasTruth)
+{
+    printf("    %-8s %5d est", method, (int)s.frequencies.size());
+    if (hasTruth)
+        printf("  error median %6.1f p95 %6.1f Hz  octave %3lld", Median(s.errors), Percentile(s.errors, 0.95),
+               (long long)s.numOctaveErrors);
+    printf("  jumps %3lld  full %4lld", (long long)s.numOctaveJumps, (long long)s.numFullSearches);
+    if (hasTruth && s.hasResults)
+        printf("  PEF %5.1f%% FEV1 %5.1f%% FVC %5.1f%%", s.pefError, s.fevOneError, s.fvcError);
+    else if (!s.hasResults)
+        printf("  (no effort)");
+    if (!s.confidences.empty())
+        printf("  conf %.2f  lost %lld", Median(s.confidences), (long long)s.numLockLosses);
+    printf("  %.1f ms/s\n", s.cpuMillisecondsPerSecond);
+}
+
+struct Scenario {
+    const char *name;
+    float samplingRate;
+    float peakFlow, riseTime, decayTime, duration;
+    float breathNoiseLevel;
+    float snrInDecibels;
+    bool cough;
+};
+
+static void CompareOnEffort(const char *name, const std::vector<float> &audio, float samplingRate,
+                            const WhistleSignalGenerator *truth, EffortStats totals[2])
+{
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = true;
+    EffortStats stats[2];
+    for (int m=0; m < 2; ++m)
+        RunEffort(audio, samplingRate, whistle, m == 1, truth, &stats[m]);
+
+    printf("  %s\n", name);
+    PrintStats("band", stats[0], truth != NULL);
+    PrintStats("tracker", stats[1], truth != NULL);
+    if (!truth) {
+        size_t n = std::min(stats[0].frequencies.size(), stats[1].frequencies.size());
+        int64_t numDiffer = 0;
+        for (size_t e=0; e < n; ++e)
+            numDiffer += fabs(stats[1].frequencies[e] - stats[0].frequencies[e]) > 0.05*stats[0].frequencies[e] ? 1 : 0;
+        printf("    %lld of %d estimates differ by more than 5%%\n", (long long)numDiffer, (int)n);
+    }
+    for (int m=0; m < 2; ++m) {
+        totals[m].errors.insert(totals[m].errors.end(), stats[m].errors.begin(), stats[m].errors.end());
+        totals[m].numOctaveErrors += stats[m].numOctaveErrors;
+        totals[m].numOctaveJumps += stats[m].numOctaveJumps;
+        totals[m].cpuMillisecondsPerSecond += stats[m].cpuMillisecondsPerSecond;
+    }
+}
+
+static bool ReadRecording(const char *path, std::vector<float> *audio, float *samplingRate)
+{
+    EffortFileReader reader;
+    std::string error;
+    if (!reader.Open(path, &error)) {
+        fprintf(stderr, "%s: %s\n", path, error.c_str());
+        return false;
+    }
+    // channel 0, like the app
+    audio->resize((size_t)reader.NumFrames());
+    EffortSpan span;
+    int64_t numRead;
+    while ((numRead = reader.Read(65536, &span)) > 0)
+        for (int64_t i=0; i < numRead; ++i)
+            (*audio)[(size_t)(span.firstFrame + i)] = span.samples[i*span.numChannels];
+    *samplingRate = (float)reader.SamplingRate();
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int numRepeats = 5;
+    std::vector<const char *> paths;
+    for (int a=1; a < argc; ++a) {
+        if (strcmp(argv[a], "-r") == 0 && a+1 < argc)
+            numRepeats = std::max(1, atoi(argv[++a]));
+        else
+            paths.push_back(argv[a]);
+    }
+
+    TimeSearch(numRepeats);
+
+    const Scenario scenarios[] = {
+        //  name         Fs        PEF    rise   decay  dur   breath  SNR       cough
+        {"normal",     44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   INFINITY, false},
+        {"obstructed", 44100.0f,  4.0f, 0.15f, 2.5f, 7.0f, 0.0f,   INFINITY, false},
+        {"weak",       44100.0f,  2.5f, 0.12f, 0.8f, 4.0f, 0.0f,   INFINITY, false},
+        {"breath",     44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.5f,   INFINITY, false},
+        {"snr_20db",   44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   20.0f,    false},
+        {"snr_10db",   44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   10.0f,    false},
+        {"cough",      44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   INFINITY, true},
+        {"normal_48k", 48000.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   INFINITY, false},
+    };
+    EffortStats totals[2];
+    for (int m=0; m < 2; ++m) {
+        totals[m].numOctaveErrors = totals[m].numOctaveJumps = 0;
+        totals[m].cpuMillisecondsPerSecond = 0;
+    }
+    printf("efforts, whole band search against the tracker\n");
+    int numScenarios = (int)(sizeof(scenarios)/sizeof(Scenario));
+    for (int s=0; s < numScenarios; ++s) {
+        WhistleSignalOptions options;
+        options.samplingRate = scenarios[s].samplingRate;
+        options.breathNoiseLevel = scenarios[s].breathNoiseLevel;
+        options.snrInDecibels = scenarios[s].snrInDecibels;
+        WhistleSignalGenerator generator(WhistleModel(), options);
+        generator.SetParametricFlowCurve(scenarios[s].peakFlow, scenarios[s].riseTime, scenarios[s].decayTime, scenarios[s].duration);
+        if (scenarios[s].cough) {
+            SyntheticCough cough = {1.5, 0.15, 0.8f};
+            generator.AddCough(cough);
+        }
+        std::vector<float> audio;
+        generator.Generate(&audio);
+        CompareOnEffort(scenarios[s].name, audio, scenarios[s].samplingRate, &generator, totals);
+    }
+    printf("  all synthetic\n");
+    for (int m=0; m < 2; ++m)
+        printf("    %-8s error median %6.1f p95 %6.1f Hz  octave errors %lld  octave jumps %lld  %.1f ms/s\n",
+               m == 0 ? "band" : "tracker", Median(totals[m].errors), Percentile(totals[m].errors, 0.95),
+               (long long)totals[m].numOctaveErrors, (long long)totals[m].numOctaveJumps,
+               totals[m].cpuMillisecondsPerSecond/numScenarios);
+
+    for (size_t f=0; f < paths.size(); ++f) {
+        std::vector<float> audio;
+        float samplingRate;
+        if (!ReadRecording(paths[f], &audio, &samplingRate))
+            return 2;
+        EffortStats recorded[2];
+        CompareOnEffort(paths[f], audio, samplingRate, NULL, recorded);
+    }
+    return 0;
+}
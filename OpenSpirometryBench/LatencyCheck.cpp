@@ -0,0 +1,289 @@
+//
+//  LatencyCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Check for LatencyMonitor. First the histogram: every bucket maps back to itself and the
+//  percentiles of a million log-normal latencies are within the bucket precision of the exact
+//  ones. Then the analyzer's threading on a synthetic effort: an audio thread paced at -x times
+//  real time (default 4) writing 1024 frame callbacks into the framer, the analysis thread taking
+//  windows through AnalysisBacklog into EffortSession::AnalyzeWindow with the stage the audio
+//  thread's EffortStageTracker is at (like processAvailableFramesAllowingSkips:), and
+//  a delivery thread standing in for the main queue, while another thread takes snapshots the
+//  way the periodic log does. Every window must be either analyzed or counted as dropped, every
+//  analyzed window traced back to its callback, and the snapshots must only ever grow. A second
+//  run makes the peak search 3 ms slower; the report has to put the regression in that stage and
+//  show the backlog, dropped and late windows it causes.
+//
+//  usage: LatencyCheck [-x speed]
+
+#include "BenchUtils.h"
+#include "LatencyMonitor.h"
+#include "AnalysisBacklog.h"
+#include "WhistleSignalGenerator.h"
+#include "EffortSession.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <string.h>
+
+static const float kSamplingRate = 44100.0f;
+static const int64_t kHop = BUFFER_SIZE-(BUFFER_OVERLAP);
+static const int64_t kCallbackFrames = 1024;
+
+static bool CheckHistogram()
+{
+    bool ok = true;
+    int64_t expectedLowest = 0;
+    for (int b=0; b < kNumLatencyBuckets; ++b) {
+        int64_t lowest = LatencyHistogram::LowestValueInBucket(b), highest = LatencyHistogram::HighestValueInBucket(b);
+        if (lowest != expectedLowest || LatencyHistogram::BucketForValue(lowest) != b || LatencyHistogram::BucketForValue(highest) != b) {
+            printf("bucket %d covers %lld..%lld, expected to start at %lld\n", b, (long long)lowest, (long long)highest, (long long)expectedLowest);
+            ok = false;
+            break;
+        }
+        expectedLowest = highest + 1;
+    }
+
+    // log-normal around 2 ms, from well under a microsecond to seconds
+    uint32_t state = 99;
+    std::vector<int64_t> values;
+    LatencyHistogram histogram;
+    for (int i=0; i < 1000000; ++i) {
+        double u1 = 0.5*(BenchNoise(&state) + 1.0) + 1e-9, u2 = 0.5*(BenchNoise(&state) + 1.0);
+        double normal = sqrt(-2.0*log(u1))*cos(2.0*M_PI*u2);
+        int64_t value = (int64_t)(2e6*exp(1.5*normal));
+        values.push_back(value);
+        histogram.Record(value);
+    }
+    std::sort(values.begin(), values.end());
+    const double percentiles[] = {0, 1, 50, 90, 99, 99.9, 99.99, 100};
+    double worst = 0;
+    for (size_t p=0; p < sizeof(percentiles)/sizeof(percentiles[0]); ++p) {
+        int64_t rank = std::max<int64_t>(1, (int64_t)ceil(percentiles[p]/100.0*values.size()));
+        int64_t exact = values[(size_t)(rank - 1)], found = histogram.ValueAtPercentile(percentiles[p]);
+        double error = exact > 0 ? (double)(found - exact)/(double)exact : (double)found;
+        worst = std::max(worst, fabs(error));
+        if (found < exact || error > 1.0/(1 << (kLatencySubBucketBits - 1))) {
+            printf("p%g: histogram %lld, exact %lld\n", percentiles[p], (long long)found, (long long)exact);
+            ok = false;
+        }
+    }
+    if (histogram.Min() != values.front() || histogram.Max() != values.back())
+        ok = false;
+    printf("histogram: %d buckets, 1e6 values, worst percentile error %.2f%% (bound %.2f%%)%s\n", kNumLatencyBuckets,
+           100.0*worst, 100.0/(1 << (kLatencySubBucketBits - 1)), ok ? "" : "  FAIL");
+    return ok;
+}
+
+struct PipelineRun {
+    LatencyReport report;
+    int64_t numFrames;          // full windows in the audio
+    int64_t numFlowUpdates;
+    int64_t numSnapshots;
+    bool snapshotsGrew;
+};
+
+// the analyzer's threads: audio callback, serial analysis queue, main queue, and a periodic snapshot
+static PipelineRun RunPipeline(const std::vector<float> &audio, const WhistleModel &whistle, double speed, double extraPeakSeconds)
+{
+    OverlapFramer framer(BUFFER_SIZE, kHop, 4*BUFFER_SIZE);
+    int64_t maxBacklog = (int64_t)(MAX_ANALYSIS_LAG_IN_SECONDS*kSamplingRate/kHop);
+    AnalysisBacklog backlog(&framer, kSamplingRate, maxBacklog);
+    LatencyMonitor monitor(BUFFER_SIZE, kHop, LATENCY_BUDGET_IN_SECONDS);
+    EffortStageTracker stages(kSamplingRate);
+    EffortSession session(kSamplingRate, whistle);
+
+    PipelineRun run;
+    run.numFrames = ((int64_t)audio.size() - BUFFER_SIZE)/kHop + 1;
+    run.numFlowUpdates = 0;
+    run.numSnapshots = 0;
+    run.snapshotsGrew = true;
+
+    std::mutex lock;
+    std::condition_variable wake, delivered;
+    bool audioDone = false, analysisDone = false;
+    int64_t numCallbacksPending = 0;
+    std::deque<LatencyTrace> mainQueue;
+
+    std::thread delivery([&]() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            while (mainQueue.empty() && !analysisDone)
+                delivered.wait(guard);
+            if (mainQueue.empty())
+                return;
+            LatencyTrace trace = mainQueue.front();
+            mainQueue.pop_front();
+            guard.unlock();
+            monitor.RecordDelivered(trace);
+            guard.lock();
+        }
+    });
+
+    std::thread analysis([&]() {
+        while (true) {
+            bool finished;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                while (numCallbacksPending == 0 && !audioDone)
+                    wake.wait(guard);
+                numCallbacksPending = 0;
+                finished = audioDone;
+            }
+            FrameView frame;
+            while (backlog.NextFrame(&frame, !finished)) {
+                LatencyTrace trace;
+                int64_t frameEnd = frame.firstSampleIndex + frame.Length();
+                monitor.BeginFrame(&trace, frameEnd, framer.NumFramesAvailable());
+                bool hasFlowEstimate = session.AnalyzeWindow(&frame, 1, stages.Stage(), &trace);
+                if (extraPeakSeconds > 0) { // a slower search, its stage is marked done again after the wait
+                    for (double until = WallSeconds() + extraPeakSeconds; WallSeconds() < until; ) {}
+                    LatencyMonitor::MarkStage(&trace, LatencyStagePeaksDone);
+                }
+                monitor.EndFrame(trace);
+                backlog.ReleaseFrame();
+
+                if (hasFlowEstimate) {
+                    run.numFlowUpdates++;
+                    std::lock_guard<std::mutex> guard(lock);
+                    mainQueue.push_back(trace);
+                    delivered.notify_one();
+                }
+            }
+            if (finished)
+                break;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        analysisDone = true;
+        delivered.notify_one();
+    });
+
+    std::atomic<bool> stopSnapshots(false);
+    std::thread snapshots([&]() {
+        LatencyReport last;
+        monitor.Snapshot(&last);
+        while (!stopSnapshots.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            LatencyReport now;
+            monitor.Snapshot(&now);
+            run.numSnapshots++;
+            for (int i=0; i < kNumLatencyIntervals; ++i)
+                if (now.intervals[i].Count() < last.intervals[i].Count())
+                    run.snapshotsGrew = false;
+            if (now.numCallbacks < last.numCallbacks || now.numFramesAnalyzed < last.numFramesAnalyzed ||
+                now.numFramesDelivered < last.numFramesDelivered || now.numFramesDropped < last.numFramesDropped)
+                run.snapshotsGrew = false;
+            last = now;
+        }
+    });
+
+    // audio callbacks at the device rate, times speed
+    double callbackSeconds = kCallbackFrames/kSamplingRate/speed;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int64_t numAudio = (int64_t)audio.size();
+    for (int64_t p=0, c=0; p < numAudio; p += kCallbackFrames, ++c) {
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(c*callbackSeconds)));
+        int64_t callbackTime = LatencyMonitor::Now();
+        int64_t numFrames = std::min(kCallbackFrames, numAudio - p);
+        framer.AddNewFloatData(&audio[p], numFrames);
+        monitor.RecordCallback(callbackTime, framer.NumSamplesWritten());
+        stages.AddBlock(*std::max_element(&audio[p], &audio[p] + numFrames), numFrames);
+        std::lock_guard<std::mutex> guard(lock);
+        numCallbacksPending++;
+        wake.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        audioDone = true;
+        wake.notify_one();
+    }
+    analysis.join();
+    delivery.join();
+    stopSnapshots.store(true);
+    snapshots.join();
+
+    monitor.Snapshot(&run.report);
+    return run;
+}
+
+static bool CheckRun(const char *name, const PipelineRun &run)
+{
+    const LatencyReport &r = run.report;
+    bool ok = true;
+    if (r.numFramesAnalyzed + r.numFramesDropped != run.numFrames) {
+        printf("%lld windows analyzed and %lld dropped, the audio has %lld\n", (long long)r.numFramesAnalyzed,
+               (long long)r.numFramesDropped, (long long)run.numFrames);
+        ok = false;
+    }
+    if (r.numFramesDelivered != run.numFlowUpdates || r.intervals[LatencyIntervalEndToEnd].Count() != run.numFlowUpdates) {
+        printf("%lld flow updates, %lld delivered\n", (long long)run.numFlowUpdates, (long long)r.numFramesDelivered);
+        ok = false;
+    }
+    for (int i=0; i < LatencyIntervalDelivery; ++i) {
+        if (r.intervals[i].Count() != r.numFramesAnalyzed) {
+            printf("interval %d has %lld of %lld windows\n", i, (long long)r.intervals[i].Count(), (long long)r.numFramesAnalyzed);
+            ok = false;
+        }
+    }
+    if (r.numCallbacksUntraced != 0 || !run.snapshotsGrew || run.numSnapshots == 0)
+        ok = false;
+    printf("\n%s: %lld snapshots while running%s\n%s", name, (long long)run.numSnapshots,
+           run.snapshotsGrew ? "" : " (went backwards)", LatencyMonitor::FormatReport(r).c_str());
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 4.0;
+    for (int a=1; a+1 < argc; a += 2)
+        if (strcmp(argv[a], "-x") == 0) speed = atof(argv[a+1]);
+
+    bool ok = CheckHistogram();
+
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = true;
+    WhistleSignalOptions options;
+    options.quietAfterInSeconds = 1.0;
+    WhistleSignalGenerator generator(whistle, options);
+    generator.SetParametricFlowCurve(8.0f, 0.1f, 0.8f, 4.0f);
+    std::vector<float> audio;
+    generator.Generate(&audio);
+    printf("\n%.1f s effort fed at %.1fx real time in %lld frame callbacks, late past %.0f ms\n",
+           audio.size()/kSamplingRate, speed, (long long)kCallbackFrames, LATENCY_BUDGET_IN_SECONDS*1e3);
+
+    PipelineRun normal = RunPipeline(audio, whistle, speed, 0.0);
+    ok = CheckRun("as is", normal) && ok;
+
+    const double extraPeakSeconds = 0.003;
+    PipelineRun slow = RunPipeline(audio, whistle, speed, extraPeakSeconds);
+    ok = CheckRun("peak search 3 ms slower", slow) && ok;
+
+    // the report has to point at the stage that got slower, and show what it did to the rest
+    int slowest = LatencyIntervalCallback;
+    double largestGrowth = -1e30;
+    for (int i=0; i < LatencyIntervalDelivery; ++i) {
+        if (i == LatencyIntervalQueue)
+            continue; // waiting is the effect, not the cause
+        double growth = slow.report.intervals[i].Mean() - normal.report.intervals[i].Mean();
+        if (growth > largestGrowth) {
+            largestGrowth = growth;
+            slowest = i;
+        }
+    }
+    bool found = slowest == LatencyIntervalPeaks && slow.report.intervals[LatencyIntervalPeaks].ValueAtPercentile(50) >= (int64_t)(extraPeakSeconds*1e9);
+    bool backedUp = slow.report.queueDepth.ValueAtPercentile(50) > normal.report.queueDepth.ValueAtPercentile(50) &&
+                    slow.report.numFramesDropped > 0 && slow.report.numFramesLate > 0;
+    printf("\nregression found in %s (mean %.2f ms slower), median backlog %lld -> %lld windows, %lld dropped, %lld late%s\n",
+           slowest == LatencyIntervalPeaks ? "peaks" : "the wrong stage", largestGrowth*1e-6,
+           (long long)normal.report.queueDepth.ValueAtPercentile(50), (long long)slow.report.queueDepth.ValueAtPercentile(50),
+           (long long)slow.report.numFramesDropped, (long long)slow.report.numFramesLate, found && backedUp ? "" : "  FAIL");
+    ok = ok && found && backedUp;
+
+    printf("%s\n", ok ? "latency monitor OK" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+//
+//  LiveEffortMetricsCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Check for StreamingEffortMetrics (the live measures of FlowVolumeCurve). Synthetic blows
+//  (a short rise to PEF then an exponential decay, flow estimates every hop like the analyzer)
+//  are fed through FlowVolumeCurve. After every estimate the live measures must equal a brute
+//  force recomputation over the whole curve, and at the end they must be close to the analytic
+//  PEF, FEV1, FVC and BEV of the blow. Also times the update per resampled point early and
+//  late in a long curve, which should not grow with the length of the curve.
+
+#include "BenchUtils.h"
+#include "FlowVolumeCurve.h"
+#include "SpirometerConstants.h"
+
+// exposes the columns for the brute force reference
+class CurveProbe : public FlowVolumeCurve {
+public:
+    const float *Time() { return mTime; }
+    const float *Flow() { return mFlow; }
+    const float *Volume() { return mVolume; }
+};
+
+struct Blow {
+    float peakFlow;         // L/s
+    float riseTime;         // s, linear rise from startFlow
+    float startFlow;        // L/s when the whistle is first heard (a late start has a large BEV)
+    float decay;            // s, time constant after the peak
+    float duration;         // s
+};
+
+static float BlowFlow(const Blow &b, double t)
+{
+    if (t < b.riseTime)
+        return b.startFlow + (b.peakFlow - b.startFlow)*(float)(t/b.riseTime);
+    return b.peakFlow*(float)exp(-(t - b.riseTime)/b.decay);
+}
+
+// volume from the first estimate
+static double BlowVolume(const Blow &b, double t)
+{
+    if (t < b.riseTime)
+        return b.startFlow*t + 0.5*(b.peakFlow - b.startFlow)*t*t/b.riseTime;
+    double rise = 0.5*(b.startFlow + b.peakFlow)*b.riseTime;
+    return rise + b.peakFlow*b.decay*(1.0 - exp(-(t - b.riseTime)/b.decay));
+}
+
+static float Interpolate(const float *volume, int64_t n, float interval, float t)
+{
+    float position = t/interval;
+    if (position <= 0) return volume[0];
+    int64_t i = (int64_t)position;
+    if (i >= n-1) return volume[n-1];
+    return volume[i] + (position - (float)i)*(volume[i+1] - volume[i]);
+}
+
+// everything StreamingEffortMetrics keeps, recomputed from scratch over the whole curve
+static LiveEffortMetrics BruteForce(CurveProbe &curve)
+{
+    const float *time = curve.Time(), *flow = curve.Flow(), *volume = curve.Volume();
+    int64_t n = curve.NumSamples();
+    float interval = curve.PreferredSamplingInterval();
+    LiveEffortMetrics m;
+    int64_t peak = 0;
+    for (int64_t i=1; i < n; ++i)
+        if (flow[i] > flow[peak]) peak = i;
+    m.peakFlowInLitersPerSecond = flow[peak];
+    m.timeOfPeakFlowInSeconds = time[peak];
+    m.timeZeroInSeconds = flow[peak] > 0 ? time[peak] - volume[peak]/flow[peak] : time[peak];
+    m.backExtrapolatedVolumeInLiters = m.timeZeroInSeconds > 0 ? Interpolate(volume, n, interval, m.timeZeroInSeconds) : 0;
+    m.volumeInLiters = m.fvcInLiters = volume[n-1];
+    m.hasFevOne = time[n-1] >= m.timeZeroInSeconds + 1.0f;
+    m.fevOneInLiters = m.hasFevOne ? Interpolate(volume, n, interval, m.timeZeroInSeconds + 1.0f) : 0;
+    float limit = fmaxf(MAX_BACK_EXTRAPOLATED_VOLUME_FRACTION*m.volumeInLiters, MAX_BACK_EXTRAPOLATED_VOLUME_IN_LITERS);
+    m.startIsAcceptable = m.backExtrapolatedVolumeInLiters <= limit;
+    float plateauStart = time[n-1] - PLATEAU_DURATION_IN_SECONDS;
+    m.hasReachedPlateau = plateauStart >= m.timeZeroInSeconds && plateauStart >= 0 &&
+        volume[n-1] - Interpolate(volume, n, interval, plateauStart) < PLATEAU_VOLUME_CHANGE_IN_LITERS;
+    return m;
+}
+
+static bool Same(const LiveEffortMetrics &a, const LiveEffortMetrics &b)
+{
+    const float tolerance = 1e-4f;
+    return fabsf(a.peakFlowInLitersPerSecond - b.peakFlowInLitersPerSecond) < tolerance &&
+           fabsf(a.timeZeroInSeconds - b.timeZeroInSeconds) < tolerance &&
+           fabsf(a.backExtrapolatedVolumeInLiters - b.backExtrapolatedVolumeInLiters) < tolerance &&
+           fabsf(a.fvcInLiters - b.fvcInLiters) < tolerance &&
+           a.hasFevOne == b.hasFevOne && fabsf(a.fevOneInLiters - b.fevOneInLiters) < tolerance &&
+           a.startIsAcceptable == b.startIsAcceptable && a.hasReachedPlateau == b.hasReachedPlateau;
+}
+
+static bool CheckBlow(const char *name, const Blow &blow, bool expectAcceptableStart)
+{
+    const double hop = (double)(BUFFER_SIZE-(BUFFER_OVERLAP))/44100.0;
+    const double startTime = 2.7; // stream time of the first estimate, the curve starts its own clock
+    CurveProbe curve;
+    int64_t numMismatches = 0, firstMismatch = -1, numEstimates = 0;
+    double plateauTime = -1;
+
+    for (double t=0; t <= blow.duration; t += hop, ++numEstimates) {
+        curve.AddFlowEstimate(BlowFlow(blow, t), startTime + t);
+        if (curve.NumSamples() == 0)
+            continue;
+        if (!Same(curve.LiveMetrics(), BruteForce(curve))) {
+            if (firstMismatch < 0) firstMismatch = numEstimates;
+            ++numMismatches;
+        }
+        if (plateauTime < 0 && curve.LiveMetrics().hasReachedPlateau)
+            plateauTime = t;
+    }
+
+    // analytic measures: tangent at the peak, FEV1 at t0 + 1 s on the true volume
+    const LiveEffortMetrics &live = curve.LiveMetrics();
+    double t0 = blow.riseTime - BlowVolume(blow, blow.riseTime)/blow.peakFlow;
+    double bev = t0 > 0 ? BlowVolume(blow, t0) : 0;
+    double fevOne = BlowVolume(blow, t0 + 1.0);
+    double fvc = BlowVolume(blow, live.timeInSeconds);
+    double pefError = fabs(live.peakFlowInLitersPerSecond - blow.peakFlow)/blow.peakFlow;
+    double fevOneError = fabs(live.fevOneInLiters - fevOne)/fevOne;
+    double fvcError = fabs(live.fvcInLiters - fvc)/fvc;
+    double bevError = fabs(live.backExtrapolatedVolumeInLiters - bev);
+    bool ok = numMismatches == 0 && pefError < 0.01 && fevOneError < 0.02 && fvcError < 0.02 && bevError < 0.02 && live.hasFevOne &&
+        live.startIsAcceptable == expectAcceptableStart;
+
+    printf("%-10s PEF %5.2f (%5.2f) FEV1 %5.2f (%5.2f) FVC %5.2f (%5.2f) BEV %.3f (%.3f) start %s, plateau at %.2f s, "
+           "%lld/%lld updates differ from brute force%s\n",
+           name, live.peakFlowInLitersPerSecond, blow.peakFlow, live.fevOneInLiters, fevOne, live.fvcInLiters, fvc,
+           live.backExtrapolatedVolumeInLiters, bev, live.startIsAcceptable ? "ok " : "BAD", plateauTime,
+           (long long)numMismatches, (long long)numEstimates, ok ? "" : "  FAIL");
+    if (firstMismatch >= 0)
+        printf("           first difference at estimate %lld\n", (long long)firstMismatch);
+    return ok;
+}
+
+// per point cost of the live update early and late in a curve of `seconds` (the spline is the same in both)
+static bool TimeUpdates(float seconds)
+{
+    const float interval = 1.0f/100.0f;
+    int64_t n = (int64_t)(seconds/interval);
+    std::vector<float> time((size_t)n), flow((size_t)n), volume((size_t)n);
+    uint32_t state = 5;
+    for (int64_t i=0; i < n; ++i) {
+        time[(size_t)i] = (float)i*interval;
+        flow[(size_t)i] = 6.0f*expf(-(float)i*interval/3.0f) + 0.05f*BenchNoise(&state);
+        volume[(size_t)i] = i ? volume[(size_t)i-1] + flow[(size_t)i]*interval : 0;
+    }
+
+    StreamingEffortMetrics metrics(interval);
+    const int64_t numRepeats = 50;
+    double early = 0, late = 0;
+    int64_t span = n/10;
+    for (int64_t r=0; r < numRepeats; ++r) {
+        metrics.Clear();
+        double start = WallSeconds();
+        for (int64_t i=1; i <= span; ++i)
+            metrics.AddSample(&time[0], &flow[0], &volume[0], i);
+        early += WallSeconds() - start;
+        for (int64_t i=span+1; i <= n - span; ++i)
+            metrics.AddSample(&time[0], &flow[0], &volume[0], i);
+        start = WallSeconds();
+        for (int64_t i=n - span + 1; i <= n; ++i)
+            metrics.AddSample(&time[0], &flow[0], &volume[0], i);
+        late += WallSeconds() - start;
+    }
+    double earlyNs = 1e9*early/(double)(numRepeats*span), lateNs = 1e9*late/(double)(numRepeats*span);
+    bool ok = lateNs < 3.0*earlyNs + 20.0;
+    printf("update per resampled point: %.1f ns in the first tenth, %.1f ns in the last tenth of %.0f s%s\n",
+           earlyNs, lateNs, seconds, ok ? "" : "  FAIL");
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    Blow normal = {9.0f, 0.08f, 0.2f, 0.9f, 6.0f};
+    Blow obstructed = {3.5f, 0.15f, 0.1f, 2.5f, 9.0f};
+    Blow lateStart = {7.0f, 0.6f, 3.0f, 1.0f, 6.0f}; // slow, hesitant rise: BEV over the limit
+    Blow shortBlow = {6.0f, 0.1f, 0.2f, 0.6f, 1.5f};  // FEV1 only, never plateaus
+
+    ok = CheckBlow("normal", normal, true) && ok;
+    ok = CheckBlow("obstructed", obstructed, true) && ok;
+    ok = CheckBlow("late start", lateStart, false) && ok;
+    ok = CheckBlow("short", shortBlow, true) && ok;
+    ok = TimeUpdates(600.0f) && ok;
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,233 @@
+//
+//  MultiResolutionBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Compares multi-resolution analysis (USE_MULTIRESOLUTION_ANALYSIS, short windows through the
+//  blast and peak, the long window on the tail) against the long window throughout. First the
+//  cost per analyzed frame in each mode, the best of the repeats for every frame of a normal
+//  effort. Then both run through EffortSession on synthetic efforts from WhistleSignalGenerator:
+//  the PEF timing error (where the largest flow estimate sits on the curve's time axis against
+//  the true peak), how long after the true peak it was delivered (audio position of the frame
+//  that produced it), the PEF, FEV1 and FVC error, CPU time per second of audio and when the
+//  switch to the long window happened.
+//
+//  usage: MultiResolutionBenchmark [-r repeats]
+
+#include "BenchUtils.h"
+#include "WhistleSignalGenerator.h"
+#include "EffortSession.h"
+#include <algorithm>
+#include <string.h>
+
+static double Median(std::vector<double> v)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[v.size()/2];
+}
+
+static double Percentile(std::vector<double> v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t)(p*(v.size()-1))];
+}
+
+struct Scenario {
+    const char *name;
+    float samplingRate;
+    float peakFlow, riseTime, decayTime, duration;
+    float breathNoiseLevel;
+    float snrInDecibels;
+};
+
+static void Generate(const Scenario &s, WhistleSignalGenerator **generator, std::vector<float> *audio)
+{
+    WhistleSignalOptions options;
+    options.samplingRate = s.samplingRate;
+    options.breathNoiseLevel = s.breathNoiseLevel;
+    options.snrInDecibels = s.snrInDecibels;
+    *generator = new WhistleSignalGenerator(WhistleModel(), options);
+    (*generator)->SetParametricFlowCurve(s.peakFlow, s.riseTime, s.decayTime, s.duration);
+    (*generator)->Generate(audio);
+}
+
+//=============================================================================================================
+// Cost per analyzed frame
+
+static void TimeFrames(int numRepeats)
+{
+    const Scenario normal = {"normal", 44100.0f, 9.0f, 0.10f, 0.9f, 5.0f, 0.0f, INFINITY};
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    WhistleSignalGenerator *generator;
+    std::vector<float> audio;
+    Generate(normal, &generator, &audio);
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = true;
+
+    // each repeat runs the whole effort again from a new session and keeps the fastest time per frame,
+    // frames are told apart by the mode the session was in when it analyzed them
+    int64_t numHops = ((int64_t)audio.size() + hop - 1)/hop;
+    std::vector<double> longTimes((size_t)numHops, 1e300), multiTimes((size_t)numHops, 1e300);
+    std::vector<char> analyzed((size_t)numHops, 0), shortFrame((size_t)numHops, 0);
+    for (int r=0; r < numRepeats; ++r) {
+        for (int m=0; m < 2; ++m) {
+            EffortSession session(normal.samplingRate, whistle);
+            session.SetMultiResolution(m == 1);
+            std::vector<double> &times = m == 0 ? longTimes : multiTimes;
+            for (int64_t h=0; h < numHops; ++h) {
+                int64_t p = h*hop;
+                int64_t numFrames = session.NumFramesAnalyzed();
+                bool isShort = session.UsesShortWindows();
+                double start = CPUSeconds();
+                session.AddNewFloatData(&audio[(size_t)p], std::min(hop, (int64_t)audio.size() - p));
+                double elapsed = CPUSeconds() - start;
+                if (session.NumFramesAnalyzed() == numFrames)
+                    continue;
+                times[(size_t)h] = std::min(times[(size_t)h], 1e6*elapsed);
+                if (m == 1) {
+                    analyzed[(size_t)h] = 1;
+                    shortFrame[(size_t)h] = isShort ? 1 : 0;
+                }
+            }
+        }
+    }
+
+    std::vector<double> longOnly, multiShort, multiLong;
+    for (int64_t h=0; h < numHops; ++h) {
+        if (longTimes[(size_t)h] < 1e300)
+            longOnly.push_back(longTimes[(size_t)h]);
+        if (analyzed[(size_t)h])
+            (shortFrame[(size_t)h] ? multiShort : multiLong).push_back(multiTimes[(size_t)h]);
+    }
+    printf("cost per analyzed frame, %s effort, best of %d\n", normal.name, numRepeats);
+    printf("  %-22s %8s %10s %10s\n", "", "frames", "median us", "p95 us");
+    printf("  %-22s %8d %10.1f %10.1f\n", "long only", (int)longOnly.size(), Median(longOnly), Percentile(longOnly, 0.95));
+    printf("  %-22s %8d %10.1f %10.1f\n", "multires short window", (int)multiShort.size(), Median(multiShort), Percentile(multiShort, 0.95));
+    printf("  %-22s %8d %10.1f %10.1f\n", "multires long window", (int)multiLong.size(), Median(multiLong), Percentile(multiLong, 0.95));
+    delete generator;
+}
+
+//=============================================================================================================
+// Accuracy and timing through EffortSession
+
+struct EffortStats {
+    bool hasResults;
+    double peakTimeError;       // ms, the largest estimate's time stamp against the true peak
+    double peakDelivery;        // ms after the true peak the largest estimate was delivered
+    double pefError, fevOneError, fvcError; // percent
+    double cpuMillisecondsPerSecond;
+    double switchTime;          // s after the start of the effort, negative for never
+};
+
+static void RunEffort(const std::vector<float> &audio, const Scenario &s, const WhistleSignalGenerator &truth,
+                      bool useMultiResolution, EffortStats *stats)
+{
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = true;
+    EffortSession session(s.samplingRate, whistle);
+    session.SetMultiResolution(useMultiResolution);
+
+    double cpu = 0;
+    float maxFlow = -1.0f;
+    double maxTime = 0, maxDelivered = 0;
+    int64_t numAudio = (int64_t)audio.size();
+    for (int64_t p=0; p < numAudio && session.CurrentStage() < SpirometryStageIsFinished; p += hop) {
+        int64_t numEstimates = session.NumFlowEstimates();
+        int64_t numFrames = std::min(hop, numAudio - p);
+        double start = CPUSeconds();
+        session.AddNewFloatData(&audio[(size_t)p], numFrames);
+        cpu += CPUSeconds() - start;
+        if (session.NumFlowEstimates() == numEstimates)
+            continue;
+        float flow = whistle.FlowFromFrequency(session.LastFrequency());
+        if (flow > maxFlow) {
+            maxFlow = flow;
+            maxTime = session.LastTimeStamp();
+            maxDelivered = (p + numFrames)/(double)s.samplingRate;
+        }
+    }
+    double start = CPUSeconds();
+    session.FinishStream();
+    cpu += CPUSeconds() - start;
+    stats->cpuMillisecondsPerSecond = 1e3*cpu/(numAudio/(double)s.samplingRate);
+
+    double truePeak = truth.EffortStartInSeconds() + s.riseTime;
+    stats->peakTimeError = 1e3*(maxTime - truePeak);
+    stats->peakDelivery = 1e3*(maxDelivered - truePeak);
+    stats->switchTime = session.ResolutionSwitchFrame() < 0 || !useMultiResolution ? -1.0 :
+                        session.ResolutionSwitchFrame()/(double)s.samplingRate - truth.EffortStartInSeconds();
+
+    FlowVolumeResults results;
+    stats->hasResults = session.GetResults(&results);
+    stats->pefError = stats->fevOneError = stats->fvcError = 0;
+    if (stats->hasResults) {
+        stats->pefError = 100.0*fabs(results.peakFlowInLitersPerSecond - truth.PeakFlow())/truth.PeakFlow();
+        stats->fevOneError = 100.0*fabs(results.fevOneInLiters - truth.FEVOne())/truth.FEVOne();
+        stats->fvcError = 100.0*fabs(results.fvcInLiters - truth.FVC())/truth.FVC();
+    }
+}
+
+static void PrintStats(const char *method, const EffortStats &s)
+{
+    printf("    %-9s PEF at %+7.1f ms, delivered %+7.1f ms", method, s.peakTimeError, s.peakDelivery);
+    if (s.hasResults)
+        printf("  PEF %5.1f%% FEV1 %5.1f%% FVC %5.1f%%", s.pefError, s.fevOneError, s.fvcError);
+    else
+        printf("  (no effort)");
+    printf("  %5.1f ms/s", s.cpuMillisecondsPerSecond);
+    if (s.switchTime >= 0)
+        printf("  long from %.2f s", s.switchTime);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int numRepeats = 5;
+    for (int a=1; a < argc; ++a)
+        if (strcmp(argv[a], "-r") == 0 && a+1 < argc)
+            numRepeats = std::max(1, atoi(argv[++a]));
+
+    TimeFrames(numRepeats);
+
+    const Scenario scenarios[] = {
+        //  name         Fs        PEF    rise   decay  dur   breath  SNR
+        {"normal",     44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   INFINITY},
+        {"obstructed", 44100.0f,  4.0f, 0.15f, 2.5f, 7.0f, 0.0f,   INFINITY},
+        {"weak",       44100.0f,  2.5f, 0.12f, 0.8f, 4.0f, 0.0f,   INFINITY},
+        {"breath",     44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.5f,   INFINITY},
+        {"snr_20db",   44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   20.0f},
+        {"snr_10db",   44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   10.0f},
+        {"normal_48k", 48000.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   INFINITY},
+    };
+    int numScenarios = (int)(sizeof(scenarios)/sizeof(Scenario));
+    std::vector<double> timing[2], delivery[2], pef[2], cpu[2];
+    printf("efforts, long window throughout against multi-resolution\n");
+    for (int s=0; s < numScenarios; ++s) {
+        WhistleSignalGenerator *generator;
+        std::vector<float> audio;
+        Generate(scenarios[s], &generator, &audio);
+        printf("  %s\n", scenarios[s].name);
+        for (int m=0; m < 2; ++m) {
+            EffortStats stats;
+            RunEffort(audio, scenarios[s], *generator, m == 1, &stats);
+            PrintStats(m == 0 ? "long" : "multires", stats);
+            timing[m].push_back(fabs(stats.peakTimeError));
+            delivery[m].push_back(stats.peakDelivery);
+            pef[m].push_back(stats.pefError);
+            cpu[m].push_back(stats.cpuMillisecondsPerSecond);
+        }
+        delete generator;
+    }
+    printf("  all synthetic, median\n");
+    for (int m=0; m < 2; ++m)
+        printf("    %-9s |PEF timing| %6.1f ms  delivered %+7.1f ms  PEF error %5.1f%%  %5.1f ms/s\n",
+               m == 0 ? "long" : "multires", Median(timing[m]), Median(delivery[m]), Median(pef[m]), Median(cpu[m]));
+    return 0;
+}
@@ -0,0 +1,147 @@
+//
+//  OverlapFramerCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Stress check for OverlapFramer: a producer thread pushes 48 kHz audio in 512 frame
+//  callbacks (paced faster than real time) while several consumer threads pull overlapped
+//  windows. Checks that every window arrives, in order, with the right samples, that nothing
+//  was dropped, and reports how long the producer spends in each callback. Then, on one thread,
+//  that a second microphone dropping out for a while and coming back reads as silence for the
+//  callbacks it missed and as itself after.
+
+#include "BenchUtils.h"
+#include "OverlapFramer.h"
+#include <thread>
+#include <algorithm>
+
+static const float kSamplingRate = 48000.0f;
+static const int64_t kWindow = 48000;
+static const int64_t kHop = 240;
+static const int64_t kCallbackFrames = 512;
+static const double kSpeedUp = 4.0;       // how much faster than real time the producer runs
+static const double kAudioSeconds = 8.0;
+
+// sample value encodes its own position so consumers can check it (exact in a float below 2^24)
+static inline float SampleValue(int64_t position) { return (float)(position % 16777216); }
+
+static int64_t RunConsumer(OverlapFramer *framer, int which, const std::atomic<bool> *producerDone, int64_t *numErrors)
+{
+    int64_t numFrames = 0;
+    int64_t expectedStart = 0;
+    FrameView view;
+    while (true) {
+        if (!framer->PeekFrame(&view, which)) {
+            if (producerDone->load() && !framer->PeekFrame(&view, which))
+                break;
+            std::this_thread::yield();
+            continue;
+        }
+        if (view.firstSampleIndex != expectedStart || view.Length() != kWindow)
+            ++*numErrors;
+        // spot check every window, full check every 50th
+        int64_t step = (numFrames % 50 == 0) ? 1 : kWindow/7;
+        for (int64_t i=0; i < kWindow; i += step)
+            if (view[i] != SampleValue(view.firstSampleIndex + i))
+                ++*numErrors;
+        if (view[kWindow-1] != SampleValue(view.firstSampleIndex + kWindow - 1))
+            ++*numErrors;
+        framer->ReleaseFrame(which);
+        expectedStart += kHop;
+        ++numFrames;
+    }
+    return numFrames;
+}
+
+// stereo, mono, stereo callbacks into a two channel framer, the second channel is its position negated
+static bool CheckChannelCountChanges()
+{
+    const int64_t window = 4*kCallbackFrames, numCallbacks = 20; // the ring wraps, so what it held before is there to leak
+    OverlapFramer framer(window, window, 4*window, 1, 2);
+    std::vector<float> callbackData(2*kCallbackFrames);
+    for (int64_t b=0; b < numCallbacks; ++b) {
+        int numChannels = b >= 13 && b < 17 ? 1 : 2;
+        for (int64_t i=0; i < kCallbackFrames; ++i) {
+            callbackData[(size_t)(i*numChannels)] = SampleValue(b*kCallbackFrames + i);
+            if (numChannels == 2)
+                callbackData[(size_t)(i*2 + 1)] = -SampleValue(b*kCallbackFrames + i);
+        }
+        framer.AddNewInterleavedFloatData(&callbackData[0], kCallbackFrames, numChannels);
+    }
+
+    // the last window is callbacks 16 to 19, 16 was mono
+    int64_t numErrors = 0;
+    FrameView view;
+    while (framer.PeekFrame(&view)) {
+        FrameView second = framer.ChannelFrame(view, 1);
+        bool isLast = framer.NumFramesAvailable() == 1;
+        for (int64_t i=0; i < window; ++i) {
+            int64_t position = view.firstSampleIndex + i;
+            numErrors += view[i] != SampleValue(position);
+            if (isLast)
+                numErrors += second[i] != (position < 17*kCallbackFrames ? 0.0f : -SampleValue(position));
+        }
+        framer.ReleaseFrame();
+    }
+    printf("channel count changes: %lld errors\n", (long long)numErrors);
+    return numErrors == 0;
+}
+
+int main()
+{
+    const int numConsumers = 3;
+    OverlapFramer framer(kWindow, kHop, 4*kWindow, numConsumers);
+
+    std::atomic<bool> producerDone(false);
+    int64_t consumerFrames[numConsumers] = {0};
+    int64_t consumerErrors[numConsumers] = {0};
+    std::vector<std::thread> consumers;
+    for (int c=0; c < numConsumers; ++c)
+        consumers.push_back(std::thread([&, c]() {
+            consumerFrames[c] = RunConsumer(&framer, c, &producerDone, &consumerErrors[c]);
+        }));
+
+    // producer, the "audio callback"
+    const int64_t totalSamples = (int64_t)(kAudioSeconds*kSamplingRate);
+    const double callbackPeriod = (double)kCallbackFrames/kSamplingRate/kSpeedUp;
+    std::vector<float> callbackData(kCallbackFrames);
+    std::vector<double> latencies;
+    int64_t position = 0;
+    double nextCallback = WallSeconds();
+    while (position < totalSamples) {
+        while (WallSeconds() < nextCallback)
+            std::this_thread::yield();
+        nextCallback += callbackPeriod;
+
+        for (int64_t i=0; i < kCallbackFrames; ++i)
+            callbackData[i] = SampleValue(position + i);
+        double start = WallSeconds();
+        framer.AddNewFloatData(&callbackData[0], kCallbackFrames);
+        latencies.push_back(WallSeconds() - start);
+        position += kCallbackFrames;
+    }
+    producerDone.store(true);
+    for (size_t c=0; c < consumers.size(); ++c)
+        consumers[c].join();
+
+    std::sort(latencies.begin(), latencies.end());
+    double p50 = latencies[latencies.size()/2];
+    double p99 = latencies[latencies.size()*99/100];
+    double maxLatency = latencies.back();
+
+    int64_t expectedFrames = (position - kWindow)/kHop + 1;
+    bool ok = framer.NumDroppedSamples() == 0;
+    printf("producer: %lld callbacks of %lld frames at %.0fx real time, latency p50 %.2f us, p99 %.2f us, max %.2f us\n",
+           (long long)latencies.size(), (long long)kCallbackFrames, kSpeedUp, 1e6*p50, 1e6*p99, 1e6*maxLatency);
+    printf("dropped samples: %lld\n", (long long)framer.NumDroppedSamples());
+    for (int c=0; c < numConsumers; ++c) {
+        printf("consumer %d: %lld of %lld windows, %lld errors\n", c,
+               (long long)consumerFrames[c], (long long)expectedFrames, (long long)consumerErrors[c]);
+        ok = ok && consumerFrames[c] == expectedFrames && consumerErrors[c] == 0;
+    }
+    ok = CheckChannelCountChanges() && ok;
+    printf(ok ? "PASS\n" : "FAIL\n");
+    return ok ? 0 : 1;
+}
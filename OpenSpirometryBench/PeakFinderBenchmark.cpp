@@ -0,0 +1,161 @@
+//
+//  PeakFinderBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Checks that SpectrumPeakFinder returns exactly the peaks of the reference port of PeakFinder
+//  (count, top three in order, and every fundamental with its refined frequency, bit for bit)
+//  on every analysis frame of a corpus, then times both per frame. The corpus is a set of
+//  synthetic efforts plus any WAV files given on the command line. Frames are taken through
+//  the full FFT spectrum (all N/2 bins, what the analyzer scanned before the sliding spectrum)
+//  and the band limited sliding spectrum, at the start, sustained and a low (cough-like) threshold.
+//
+//  usage: PeakFinderBenchmark [file.wav ...]
+
+#include "BenchUtils.h"
+#include "ReferenceFFT.h"
+#include "ReferencePeakFinder.h"
+#include "WavFile.h"
+#include "SlidingSpectrum.h"
+#include "SpectrumPeakFinder.h"
+#include "SpirometerConstants.h"
+#include <algorithm>
+#include <string.h>
+
+struct Timing {
+    std::vector<double> reference, linear;
+};
+
+static double Percentile(std::vector<double> v, double p)
+{
+    std::sort(v.begin(), v.end());
+    return v[(size_t)(p*(v.size()-1))];
+}
+
+static bool SameBits(float a, float b) { return memcmp(&a, &b, sizeof(float)) == 0; }
+static bool ByIndex(const SpectrumPeak &a, const SpectrumPeak &b) { return a.index < b.index; }
+static bool RefByIndex(const ReferencePeak &a, const ReferencePeak &b) { return a.index < b.index; }
+
+int main(int argc, char **argv)
+{
+    const float samplingRate = 44100.0f;
+    const int windowLength = BUFFER_SIZE;
+    const int hop = BUFFER_SIZE - (BUFFER_OVERLAP);
+    const int64_t length = windowLength/2;
+    const float resolution = samplingRate/windowLength;
+    const float thresholds[3] = {PEAK_DBMAG_START, PEAK_DBMAG_SUSTAINED, -60.0f};
+
+    // corpus
+    std::vector<std::vector<float> > signals;
+    std::vector<std::string> names;
+    const float peaks[4] = {400.0f, 650.0f, 900.0f, 1100.0f};
+    for (int s=0; s < 4; ++s) {
+        signals.push_back(MakeWhistleSweep(samplingRate, 3.0f, peaks[s]));
+        char name[64];
+        snprintf(name, sizeof(name), "synthetic sweep to %.0f Hz", peaks[s]);
+        names.push_back(name);
+    }
+    {   // broadband burst, lots of small peaks
+        std::vector<float> cough((size_t)(samplingRate*2.0f));
+        uint32_t state = 99;
+        for (size_t i=0; i < cough.size(); ++i)
+            cough[i] = 0.6f*BenchNoise(&state)*(float)exp(-(double)i/samplingRate*2.0);
+        signals.push_back(cough);
+        names.push_back("synthetic cough");
+    }
+    for (int a=1; a < argc; ++a) {
+        WavAudio audio;
+        std::string error;
+        if (!ReadWavFile(argv[a], &audio, &error)) {
+            fprintf(stderr, "%s: %s\n", argv[a], error.c_str());
+            return 2;
+        }
+        std::vector<float> mono((size_t)audio.NumFrames());
+        for (int64_t i=0; i < audio.NumFrames(); ++i)
+            mono[(size_t)i] = audio.samples[(size_t)(i*audio.numChannels)];
+        signals.push_back(mono);
+        names.push_back(argv[a]);
+    }
+
+    ReferenceFFT fft(windowLength);
+    ReferencePeakFinder reference(resolution);
+    SpectrumPeakFinder linear(resolution, length);
+    std::vector<ReferencePeak> referencePeaks;
+    std::vector<SpectrumPeak> linearPeaks((size_t)SpectrumPeakFinder::MaxNumPeaks(length, PEAK_WINDOW_SIZE));
+    std::vector<float> magnitude((size_t)length);
+    Timing fullTiming, bandTiming;
+    int64_t numFrames = 0, numMismatches = 0, numPeaksCompared = 0;
+
+    for (size_t s=0; s < signals.size(); ++s) {
+        const std::vector<float> &signal = signals[s];
+        if ((int64_t)signal.size() < windowLength)
+            continue;
+        SlidingSpectrum sliding(windowLength, samplingRate, MIN_FREQUENCY_OF_WHISTLE_IN_HZ, MAX_FREQUENCY_OF_WHISTLE_IN_HZ);
+        std::vector<float> bandMagnitude((size_t)length);
+        sliding.FillBufferOutsideBand(&bandMagnitude[0], SPECTRUM_FLOOR_DB);
+        sliding.AddNewFloatData(&signal[0], windowLength - hop);
+        int64_t numHops = ((int64_t)signal.size() - windowLength)/hop + 1;
+        int64_t fileMismatches = numMismatches;
+
+        for (int64_t h=0; h < numHops; ++h) {
+            sliding.AddNewFloatData(&signal[(size_t)(h*hop + windowLength - hop)], hop);
+            bool doFull = h % 8 == 0; // full FFT frames are slow to make, take every 8th
+            if (doFull)
+                fft.PerformForwardFFTAndCopydBMagnitude(&signal[(size_t)(h*hop)], &magnitude[0]);
+            sliding.CopydBMagnitudeToBuffer(&bandMagnitude[0]);
+
+            for (int spectrum=0; spectrum < 2; ++spectrum) {
+                if (spectrum == 0 && !doFull)
+                    continue;
+                const float *mag = spectrum == 0 ? &magnitude[0] : &bandMagnitude[0];
+                Timing &timing = spectrum == 0 ? fullTiming : bandTiming;
+                for (int t=0; t < 3; ++t) {
+                    double start = WallSeconds();
+                    int64_t numReference = reference.GetFundamentalPeaks(mag, length, PEAK_WINDOW_SIZE, thresholds[t],
+                                                                         MIN_FREQUENCY_OF_WHISTLE_IN_HZ, referencePeaks);
+                    double middle = WallSeconds();
+                    int64_t numLinear = linear.GetFundamentalPeaks(mag, length, PEAK_WINDOW_SIZE, thresholds[t],
+                                                                   MIN_FREQUENCY_OF_WHISTLE_IN_HZ, &linearPeaks[0],
+                                                                   (int64_t)linearPeaks.size(), 3);
+                    double end = WallSeconds();
+                    timing.reference.push_back(middle - start);
+                    timing.linear.push_back(end - middle);
+                    numFrames++;
+
+                    bool same = numReference == numLinear;
+                    for (int64_t p=0; same && p < numLinear && p < 3; ++p) // top three, in order
+                        same = referencePeaks[p].index == linearPeaks[p].index &&
+                               SameBits(referencePeaks[p].magnitude, linearPeaks[p].magnitude) &&
+                               SameBits(referencePeaks[p].frequency, linearPeaks[p].frequency);
+                    if (same) { // and every other fundamental
+                        std::sort(referencePeaks.begin(), referencePeaks.end(), RefByIndex);
+                        std::sort(linearPeaks.begin(), linearPeaks.begin() + numLinear, ByIndex);
+                        for (int64_t p=0; same && p < numLinear; ++p)
+                            same = referencePeaks[p].index == linearPeaks[p].index &&
+                                   SameBits(referencePeaks[p].magnitude, linearPeaks[p].magnitude) &&
+                                   SameBits(referencePeaks[p].frequency, linearPeaks[p].frequency);
+                    }
+                    numPeaksCompared += numReference;
+                    numMismatches += same ? 0 : 1;
+                }
+            }
+        }
+        printf("%-40s %6lld hops, %lld mismatched frames\n", names[s].c_str(), (long long)numHops,
+               (long long)(numMismatches - fileMismatches));
+    }
+
+    printf("%lld frames, %lld peaks compared, %lld mismatched frames\n",
+           (long long)numFrames, (long long)numPeaksCompared, (long long)numMismatches);
+    printf("per frame latency           reference p50/p99 (us)    linear p50/p99 (us)   speedup (p50)\n");
+    printf("full spectrum (%5lld bins)  %8.1f / %8.1f      %8.1f / %8.1f      %6.1fx\n", (long long)length,
+           1e6*Percentile(fullTiming.reference, 0.5), 1e6*Percentile(fullTiming.reference, 0.99),
+           1e6*Percentile(fullTiming.linear, 0.5), 1e6*Percentile(fullTiming.linear, 0.99),
+           Percentile(fullTiming.reference, 0.5)/Percentile(fullTiming.linear, 0.5));
+    printf("sliding band spectrum       %8.1f / %8.1f      %8.1f / %8.1f      %6.1fx\n",
+           1e6*Percentile(bandTiming.reference, 0.5), 1e6*Percentile(bandTiming.reference, 0.99),
+           1e6*Percentile(bandTiming.linear, 0.5), 1e6*Percentile(bandTiming.linear, 0.99),
+           Percentile(bandTiming.reference, 0.5)/Percentile(bandTiming.linear, 0.5));
+    return numMismatches == 0 ? 0 : 1;
+}
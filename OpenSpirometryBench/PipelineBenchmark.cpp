@@ -0,0 +1,394 @@
+//
+//  PipelineBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Benchmark and regression suite on synthetic efforts from WhistleSignalGenerator, where the
+//  true flow curve is known. Times each stage of the analysis on its own (framing, full FFT,
+//  dB conversion, band limited spectrum, peak finding, resampling to the curve, FIR finalize) and
+//  the whole EffortSession end to end, then runs a set of scenarios (obstructed and weak blows,
+//  breath noise, background noise at 20 and 10 dB SNR, a cough, 48 kHz, full band) and reports
+//  the PEF, FEV1 and FVC error against the input curve. Each scenario has a limit on those errors
+//  of its own, so a baseline written after a regression cannot make it pass.
+//
+//  Everything measured goes into a flat JSON object (-o file). Given an earlier file (-b), the
+//  run fails if a stage got slower than the baseline by more than the tolerance (-t, default
+//  0.3 = 30%), an error grew by more than one percentage point or a cough flag changed; -a
+//  leaves the stage times out, for a baseline written on another machine. PipelineBaseline.json
+//  is checked by make check (-a) and make bench, make baseline writes it again. The
+//  printed cough column is flagged/expected: ArtifactDetector times the cough (without it the
+//  pipeline only searches the whistle band, and rarely finds the NUM_PEAKS_IS_COUGH peaks there).
+//
+//  usage: PipelineBenchmark [-o results.json] [-b baseline.json] [-t tolerance] [-a] [-r repeats]
+
+#include "BenchUtils.h"
+#include "WhistleSignalGenerator.h"
+#include "OverlapFramer.h"
+#include "RealFFT.h"
+#include "ZoomSpectrum.h"
+#include "SpectrumPeakFinder.h"
+#include "FlowVolumeCurve.h"
+#include "EffortSession.h"
+#include <algorithm>
+#include <string>
+#include <string.h>
+
+static const double kMaxErrorGrowthInPercent = 1.0;
+
+struct Measurement {
+    std::string key;
+    double value;
+};
+
+static std::vector<Measurement> gMeasurements;
+
+static void Record(const std::string &key, double value)
+{
+    gMeasurements.push_back(Measurement());
+    gMeasurements.back().key = key;
+    gMeasurements.back().value = value;
+}
+
+static double Median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    return v[v.size()/2];
+}
+
+//=============================================================================================================
+// Stage timings
+
+static WhistleSignalGenerator NormalEffort(float samplingRate)
+{
+    WhistleSignalOptions options;
+    options.samplingRate = samplingRate;
+    WhistleSignalGenerator generator(WhistleModel(), options);
+    generator.SetParametricFlowCurve(9.0f, 0.1f, 0.9f, 5.0f);
+    return generator;
+}
+
+static void TimeStages(int numRepeats)
+{
+    const float samplingRate = 44100.0f;
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    WhistleSignalGenerator generator = NormalEffort(samplingRate);
+    std::vector<float> audio;
+    generator.Generate(&audio);
+    int64_t numAudio = (int64_t)audio.size();
+    int64_t effortStart = (int64_t)(generator.EffortStartInSeconds()*samplingRate);
+
+    // framing: 1024 frame blocks in, every window copied out contiguously (the full FFT path)
+    std::vector<double> framing;
+    std::vector<float> window(BUFFER_SIZE);
+    OverlapFramer framer(BUFFER_SIZE, hop, 4*BUFFER_SIZE);
+    for (int r=0; r < numRepeats; ++r) {
+        framer.Clear();
+        int64_t numFrames = 0;
+        double start = WallSeconds();
+        for (int64_t p=0; p < numAudio; p += 1024) {
+            framer.AddNewFloatData(&audio[p], std::min<int64_t>(1024, numAudio - p));
+            FrameView frame;
+            while (framer.PeekFrame(&frame)) {
+                frame.CopyToBuffer(&window[0]);
+                framer.ReleaseFrame();
+                numFrames++;
+            }
+        }
+        framing.push_back(1e9*(WallSeconds() - start)/(double)numFrames);
+    }
+    Record("time.framing_ns_per_frame", Median(framing));
+
+    // full FFT and dB conversion of windows through the effort
+    const int64_t numWindows = 64;
+    RealFFT fft(BUFFER_SIZE, FFTWindowHann);
+    std::vector<float> magnitudes((size_t)(numWindows*(BUFFER_SIZE/2)));
+    std::vector<double> transform, decibels;
+    for (int r=0; r < numRepeats; ++r) {
+        double fftTime = 0, dBTime = 0;
+        for (int64_t w=0; w < numWindows; ++w) {
+            const float *data = &audio[(size_t)(effortStart + w*hop*4)];
+            double start = WallSeconds();
+            fft.PerformForwardFFT(data);
+            double transformed = WallSeconds();
+            fft.CopydBMagnitudeToBuffer(&magnitudes[(size_t)(w*(BUFFER_SIZE/2))]);
+            dBTime += WallSeconds() - transformed;
+            fftTime += transformed - start;
+        }
+        transform.push_back(1e9*fftTime/numWindows);
+        decibels.push_back(1e9*dBTime/numWindows);
+    }
+    Record("time.fft_ns_per_frame", Median(transform));
+    Record("time.db_ns_per_frame", Median(decibels));
+
+    // band limited, decimated spectrum per hop (the default whistle analysis)
+    WhistleModel bandLimited;
+    bandLimited.useBandLimitedSpectrum = true;
+    int64_t factor = ZoomSpectrum::DecimationFactorForBand(BUFFER_SIZE, hop, samplingRate, bandLimited.MaxFrequency());
+    ZoomSpectrum zoom(BUFFER_SIZE, samplingRate, bandLimited.MinFrequency(), bandLimited.MaxFrequency(), factor);
+    std::vector<float> zoomMagnitude(BUFFER_SIZE/2);
+    zoom.FillBufferOutsideBand(&zoomMagnitude[0], SPECTRUM_FLOOR_DB);
+    std::vector<double> zoomTimes;
+    for (int r=0; r < numRepeats; ++r) {
+        zoom.Clear();
+        zoom.AddNewFloatData(&audio[0], BUFFER_SIZE);
+        int64_t numHops = 0;
+        double start = WallSeconds();
+        for (int64_t p=BUFFER_SIZE; p + hop <= numAudio; p += hop, ++numHops) {
+            zoom.AddNewFloatData(&audio[p], hop);
+            zoom.CopydBMagnitudeToBuffer(&zoomMagnitude[0]);
+        }
+        zoomTimes.push_back(1e9*(WallSeconds() - start)/(double)numHops);
+    }
+    Record("time.band_limited_spectrum_ns_per_frame", Median(zoomTimes));
+
+    // fundamental peaks on the full spectra from above
+    SpectrumPeakFinder finder(samplingRate/BUFFER_SIZE, BUFFER_SIZE/2);
+    std::vector<SpectrumPeak> peaks((size_t)SpectrumPeakFinder::MaxNumPeaks(BUFFER_SIZE/2, PEAK_WINDOW_SIZE));
+    std::vector<double> peakTimes;
+    int64_t numFound = 0;
+    for (int r=0; r < numRepeats; ++r) {
+        double start = WallSeconds();
+        for (int64_t w=0; w < numWindows; ++w)
+            numFound += finder.GetFundamentalPeaks(&magnitudes[(size_t)(w*(BUFFER_SIZE/2))], BUFFER_SIZE/2, PEAK_WINDOW_SIZE,
+                                                   PEAK_DBMAG_START, MIN_FREQUENCY_OF_WHISTLE_IN_HZ, &peaks[0], (int64_t)peaks.size(), 3);
+        peakTimes.push_back(1e9*(WallSeconds() - start)/numWindows);
+    }
+    Record("time.peak_finder_ns_per_frame", Median(peakTimes));
+
+    // flow estimates at the hop rate from the true curve, resampled, integrated and finalized
+    FlowVolumeCurve curve;
+    std::vector<double> resampling, finalize;
+    double hopSeconds = (double)hop/samplingRate;
+    int64_t numEstimates = (int64_t)(generator.EffortDuration()/hopSeconds);
+    for (int r=0; r < numRepeats; ++r) {
+        curve.Clear();
+        double start = WallSeconds();
+        for (int64_t e=0; e < numEstimates; ++e)
+            curve.AddFlowEstimate(generator.FlowAtTime(e*hopSeconds) + 0.01f, 2.5 + e*hopSeconds);
+        double added = WallSeconds();
+        FlowVolumeResults results;
+        curve.FinalizeCurves(&results);
+        finalize.push_back(1e6*(WallSeconds() - added));
+        resampling.push_back(1e9*(added - start)/(double)numEstimates);
+    }
+    Record("time.resampling_ns_per_estimate", Median(resampling));
+    Record("time.finalize_us_per_effort", Median(finalize));
+
+    // whole session, in ms of CPU per second of audio
+    for (int band=0; band < 2; ++band) {
+        WhistleModel whistle;
+        whistle.useBandLimitedSpectrum = band == 1;
+        std::vector<double> session;
+        for (int r=0; r < std::max(1, numRepeats/2); ++r) {
+            EffortSession effort(samplingRate, whistle);
+            double start = CPUSeconds();
+            effort.AddNewFloatData(&audio[0], numAudio);
+            effort.FinishStream();
+            session.push_back(1e3*(CPUSeconds() - start)/((double)numAudio/samplingRate));
+        }
+        Record(band ? "time.end_to_end_band_limited_ms_per_audio_second" : "time.end_to_end_full_band_ms_per_audio_second",
+               Median(session));
+    }
+
+    printf("stage timings (median of %d, %lld peaks found)\n", numRepeats, (long long)numFound);
+    for (size_t m=0; m < gMeasurements.size(); ++m)
+        printf("  %-50s %12.1f\n", gMeasurements[m].key.c_str() + 5, gMeasurements[m].value);
+}
+
+//=============================================================================================================
+// Accuracy scenarios
+
+struct Scenario {
+    const char *name;
+    float samplingRate;
+    float peakFlow, riseTime, decayTime, duration;
+    float breathNoiseLevel;
+    float snrInDecibels;
+    bool cough;
+    bool bandLimited;
+    float maxErrorInPercent;    // of PEF, FEV1 and FVC each, whatever the baseline says
+};
+
+static bool RunScenario(const Scenario &s)
+{
+    WhistleSignalOptions options;
+    options.samplingRate = s.samplingRate;
+    options.breathNoiseLevel = s.breathNoiseLevel;
+    options.snrInDecibels = s.snrInDecibels;
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = s.bandLimited;
+    WhistleSignalGenerator generator(whistle, options);
+    generator.SetParametricFlowCurve(s.peakFlow, s.riseTime, s.decayTime, s.duration);
+    if (s.cough) {
+        SyntheticCough cough = {1.5, 0.15, 0.8f};
+        generator.AddCough(cough);
+    }
+    std::vector<float> audio;
+    generator.Generate(&audio);
+
+    EffortSession session(s.samplingRate, whistle);
+    session.AddNewFloatData(&audio[0], (int64_t)audio.size());
+    session.FinishStream();
+    FlowVolumeResults results;
+    bool hasResults = session.GetResults(&results);
+    bool coughFlagged = false;
+    for (int64_t e=0; hasResults && e < results.numErrors; ++e)
+        if (results.errors[e].key == "Cough")
+            coughFlagged = true;
+
+    double pefError = 100.0*fabs(results.peakFlowInLitersPerSecond - generator.PeakFlow())/generator.PeakFlow();
+    double fevOneError = 100.0*fabs(results.fevOneInLiters - generator.FEVOne())/generator.FEVOne();
+    double fvcError = 100.0*fabs(results.fvcInLiters - generator.FVC())/generator.FVC();
+    bool withinLimit = pefError <= s.maxErrorInPercent && fevOneError <= s.maxErrorInPercent && fvcError <= s.maxErrorInPercent;
+    bool ok = hasResults && withinLimit;
+
+    std::string prefix = std::string("accuracy.") + s.name + ".";
+    if (hasResults) {
+        Record(prefix + "pef_error_pct", pefError);
+        Record(prefix + "fev1_error_pct", fevOneError);
+        Record(prefix + "fvc_error_pct", fvcError);
+    }
+    Record(prefix + "cough_flagged", coughFlagged ? 1 : 0);
+
+    printf("  %-16s PEF %5.2f/%5.2f (%5.1f%%)  FEV1 %5.2f/%5.2f (%5.1f%%)  FVC %5.2f/%5.2f (%5.1f%%)  cough %s/%s%s\n",
+           s.name, results.peakFlowInLitersPerSecond, generator.PeakFlow(), pefError,
+           results.fevOneInLiters, generator.FEVOne(), fevOneError, results.fvcInLiters, generator.FVC(), fvcError,
+           coughFlagged ? "yes" : "no ", s.cough ? "yes" : "no ", !hasResults ? "  FAIL (no effort)" : !withinLimit ? "  FAIL (over the limit)" : "");
+    return ok;
+}
+
+//=============================================================================================================
+// Machine readable output and baseline comparison
+
+static bool WriteJSON(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+    fprintf(file, "{\n");
+    for (size_t m=0; m < gMeasurements.size(); ++m)
+        fprintf(file, "  \"%s\": %.6g%s\n", gMeasurements[m].key.c_str(), gMeasurements[m].value, m + 1 < gMeasurements.size() ? "," : "");
+    fprintf(file, "}\n");
+    fclose(file);
+    return true;
+}
+
+// flat {"key": number, ...} as written above
+static bool ReadJSON(const char *path, std::vector<Measurement> *measurements)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+    std::string text;
+    char buffer[4096];
+    size_t numRead;
+    while ((numRead = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, numRead);
+    fclose(file);
+
+    size_t position = 0;
+    while ((position = text.find('"', position)) != std::string::npos) {
+        size_t end = text.find('"', position + 1);
+        size_t colon = end == std::string::npos ? end : text.find(':', end);
+        if (colon == std::string::npos)
+            break;
+        Measurement m;
+        m.key = text.substr(position + 1, end - position - 1);
+        m.value = strtod(text.c_str() + colon + 1, NULL);
+        measurements->push_back(m);
+        position = colon + 1;
+    }
+    return true;
+}
+
+// stage times only if compareTimes, they are only comparable on the machine the baseline was written on
+static bool CompareWithBaseline(const char *path, double tolerance, bool compareTimes)
+{
+    std::vector<Measurement> baseline;
+    if (!ReadJSON(path, &baseline)) {
+        printf("could not read baseline %s\n", path);
+        return false;
+    }
+    int numRegressions = 0, numCompared = 0;
+    for (size_t b=0; b < baseline.size(); ++b) {
+        const Measurement *current = NULL;
+        for (size_t m=0; m < gMeasurements.size(); ++m)
+            if (gMeasurements[m].key == baseline[b].key)
+                current = &gMeasurements[m];
+        if (!current)
+            continue;
+        const std::string &key = baseline[b].key;
+        bool isTime = key.compare(0, 5, "time.") == 0;
+        bool isError = key.size() > 10 && key.compare(key.size() - 10, 10, "_error_pct") == 0;
+        bool isFlag = key.size() > 8 && key.compare(key.size() - 8, 8, "_flagged") == 0;
+        bool regressed = false;
+        if (isTime && !compareTimes)
+            continue;
+        else if (isTime)
+            regressed = current->value > baseline[b].value*(1.0 + tolerance);
+        else if (isError)
+            regressed = current->value > baseline[b].value + kMaxErrorGrowthInPercent;
+        else if (isFlag)
+            regressed = current->value != baseline[b].value; // a detection lost or a new false alarm
+        else
+            continue;
+        numCompared++;
+        if (regressed) {
+            printf("  REGRESSION %-50s %12.2f, baseline %12.2f\n", key.c_str(), current->value, baseline[b].value);
+            numRegressions++;
+        }
+    }
+    printf("baseline %s: %d measures compared, %d regressions\n", path, numCompared, numRegressions);
+    return numRegressions == 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *outputPath = NULL, *baselinePath = NULL;
+    double tolerance = 0.3;
+    int numRepeats = 5;
+    bool compareTimes = true;
+    for (int a=1; a < argc; ++a) {
+        if (strcmp(argv[a], "-a") == 0) compareTimes = false;
+        else if (a+1 == argc) break;
+        else if (strcmp(argv[a], "-o") == 0) outputPath = argv[++a];
+        else if (strcmp(argv[a], "-b") == 0) baselinePath = argv[++a];
+        else if (strcmp(argv[a], "-t") == 0) tolerance = atof(argv[++a]);
+        else if (strcmp(argv[a], "-r") == 0) numRepeats = std::max(1, atoi(argv[++a]));
+    }
+
+    TimeStages(numRepeats);
+
+    const Scenario scenarios[] = {
+        //  name              Fs        PEF    rise   decay  dur   breath  SNR       cough  band limited  max error %
+        {"normal",          44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   INFINITY, false, true,         3.0f},
+        {"obstructed",      44100.0f,  4.0f, 0.15f, 2.5f, 7.0f, 0.0f,   INFINITY, false, true,         5.0f},
+        {"weak",            44100.0f,  2.5f, 0.12f, 0.8f, 4.0f, 0.0f,   INFINITY, false, true,        12.0f},
+        {"breath_noise",    44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.5f,   INFINITY, false, true,         5.0f},
+        {"snr_20db",        44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   20.0f,    false, true,         3.0f},
+        {"snr_10db",        44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   10.0f,    false, true,         6.0f},
+        {"cough",           44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   INFINITY, true,  true,         3.0f},
+        {"normal_48k",      48000.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   INFINITY, false, true,         3.0f},
+        {"normal_fullband", 44100.0f,  9.0f, 0.10f, 0.9f, 5.0f, 0.0f,   INFINITY, false, false,        3.0f},
+    };
+    bool ok = true;
+    printf("accuracy against the input curve (measured/true)\n");
+    for (size_t s=0; s < sizeof(scenarios)/sizeof(Scenario); ++s)
+        ok = RunScenario(scenarios[s]) && ok;
+
+    if (outputPath) {
+        if (WriteJSON(outputPath))
+            printf("wrote %d measures to %s\n", (int)gMeasurements.size(), outputPath);
+        else {
+            printf("could not write %s\n", outputPath);
+            ok = false;
+        }
+    }
+    if (baselinePath)
+        ok = CompareWithBaseline(baselinePath, tolerance, compareTimes) && ok;
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+//
+//  PipelineGeometryBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  The decimator of the band limited spectrum with its factor and taps fixed at compile time
+//  (PipelineGeometry44k and PipelineGeometry48k, picked at run time by PolyphaseDecimator) against
+//  the generic loop, at 44.1 and 48 kHz with the analyzer's window, hop and default whistle. For
+//  each rate: the geometry worked out at compile time next to what ZoomSpectrum and the decimator
+//  pick at run time, the time per hop of both kernels (best of the repeats) and of the whole
+//  ZoomSpectrum hop for scale. Fails if the run time filter is not the geometry's, the dispatcher
+//  does not pick the fixed kernel, or the two kernels (also fed uneven chunks) do not give the
+//  same output bit for bit.
+//
+//  usage: PipelineGeometryBenchmark [-r repeats] [-s seconds]
+
+#include "BenchUtils.h"
+#include "PipelineGeometry.h"
+#include "PolyphaseDecimator.h"
+#include "ZoomSpectrum.h"
+#include "WhistleModel.h"
+#include <string.h>
+
+template <class Geometry>
+static bool RunGeometry(const char *name, float seconds, int numRepeats)
+{
+    const float samplingRate = (float)Geometry::samplingRate;
+    const int hop = Geometry::hopLength;
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = true;
+    int64_t factor = ZoomSpectrum::DecimationFactorForBand(Geometry::windowLength, hop, samplingRate, whistle.MaxFrequency());
+    std::vector<float> signal = MakeWhistleSweep(samplingRate, seconds, 900.0f);
+    int numHops = (int)signal.size()/hop;
+
+    PolyphaseDecimator fixed(factor, samplingRate, whistle.MaxFrequency());
+    PolyphaseDecimator generic(factor, samplingRate, whistle.MaxFrequency(), false);
+    bool sameFilter = factor == Geometry::decimationFactor && fixed.NumTaps() == Geometry::numTaps;
+    printf("  %-4s compile time D=%d %d taps, hop %d -> %d   run time D=%lld %lld taps, %s kernel\n", name,
+           (int)Geometry::decimationFactor, (int)Geometry::numTaps, hop, (int)Geometry::decimatedHopLength,
+           (long long)factor, (long long)fixed.NumTaps(), fixed.IsSpecialized() ? "fixed" : "generic");
+
+    double best[2] = {1e300, 1e300};
+    std::vector<float> output[3];
+    for (int r=0; r < numRepeats; ++r) {
+        for (int m=0; m < 2; ++m) {
+            PolyphaseDecimator &decimator = m == 0 ? generic : fixed;
+            decimator.Clear();
+            output[m].assign(signal.size()/factor + 1, 0.0f);
+            int64_t numOutputs = 0;
+            double start = CPUSeconds();
+            for (int h=0; h < numHops; ++h)
+                numOutputs += decimator.AddNewFloatData(&signal[(size_t)h*hop], hop, &output[m][(size_t)numOutputs]);
+            best[m] = std::min(best[m], CPUSeconds() - start);
+            output[m].resize((size_t)numOutputs);
+        }
+    }
+
+    // the same audio in chunks that do not line up with the factor
+    fixed.Clear();
+    output[2].assign(signal.size()/factor + 1, 0.0f);
+    int64_t numOutputs = 0, end = (int64_t)numHops*hop;
+    for (int64_t p=0, n=1; p < end; p += n, n = n*7 % 613 + 1)
+        numOutputs += fixed.AddNewFloatData(&signal[(size_t)p], std::min(n, end - p), &output[2][(size_t)numOutputs]);
+    output[2].resize((size_t)numOutputs);
+
+    bool same = output[0].size() == output[1].size() && output[0].size() == output[2].size() &&
+                memcmp(&output[0][0], &output[1][0], output[0].size()*sizeof(float)) == 0 &&
+                memcmp(&output[0][0], &output[2][0], output[0].size()*sizeof(float)) == 0;
+
+    ZoomSpectrum zoom(Geometry::windowLength, samplingRate, whistle.MinFrequency(), whistle.MaxFrequency(), factor);
+    double zoomBest = 1e300;
+    for (int r=0; r < numRepeats; ++r) {
+        zoom.Clear();
+        double start = CPUSeconds();
+        for (int h=0; h < numHops; ++h)
+            zoom.AddNewFloatData(&signal[(size_t)h*hop], hop);
+        zoomBest = std::min(zoomBest, CPUSeconds() - start);
+    }
+
+    printf("  %-4s decimator per hop  generic %7.2f us  fixed %7.2f us  %5.2fx   whole ZoomSpectrum hop %7.2f us   %s\n", name,
+           1e6*best[0]/numHops, 1e6*best[1]/numHops, best[0]/best[1], 1e6*zoomBest/numHops, same ? "same" : "DIFFERENT");
+    return sameFilter && fixed.IsSpecialized() && !generic.IsSpecialized() && same;
+}
+
+int main(int argc, char **argv)
+{
+    int numRepeats = 5;
+    float seconds = 5.0f;
+    for (int a=1; a < argc; ++a) {
+        if (strcmp(argv[a], "-r") == 0 && a+1 < argc)
+            numRepeats = std::max(1, atoi(argv[++a]));
+        else if (strcmp(argv[a], "-s") == 0 && a+1 < argc)
+            seconds = (float)atof(argv[++a]);
+    }
+
+    printf("band limited decimator, fixed geometry against the generic loop, best of %d\n", numRepeats);
+    bool ok = RunGeometry<PipelineGeometry44k>("44k", seconds, numRepeats);
+    ok = RunGeometry<PipelineGeometry48k>("48k", seconds, numRepeats) && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+//
+//  ReferenceFFT.h
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Stand in for FFTHelper on machines without Accelerate. It does the same work per hop as
+//  performForwardFFTWithData:andCopydBMagnitudeToBuffer: (window, radix-2 transform of
+//  2^floor(log2(N)) points, magnitude and dB of N/2 bins) so timings are comparable.
+
+#ifndef OpenSpirometryBench_ReferenceFFT_h
+#define OpenSpirometryBench_ReferenceFFT_h
+
+#include <math.h>
+#include <vector>
+
+class ReferenceFFT {
+
+public:
+    ReferenceFFT(int fftSize) : mFFTSize(fftSize)
+    {
+        mLog2n = (int)log2f((float)fftSize); // same truncation as FFTHelper setup
+        mPow2Size = 1 << mLog2n;
+        mWindow.resize(fftSize);
+        for (int i=0; i < fftSize; ++i)
+            mWindow[i] = 0.5f*(1.0f - cosf(2.0f*(float)M_PI*(float)i/(float)fftSize));
+        mReal.resize(mPow2Size);
+        mImag.resize(mPow2Size);
+        mWindowed.resize(fftSize);
+        mCos.resize(mPow2Size/2);
+        mSin.resize(mPow2Size/2);
+        for (int i=0; i < mPow2Size/2; ++i) {
+            mCos[i] = cosf(2.0f*(float)M_PI*(float)i/(float)mPow2Size);
+            mSin[i] = -sinf(2.0f*(float)M_PI*(float)i/(float)mPow2Size);
+        }
+        mScale = 1.0f/(4.0f*(float)fftSize);
+    }
+
+    void PerformForwardFFTAndCopydBMagnitude(const float *data, float *buffer)
+    {
+        for (int i=0; i < mFFTSize; ++i)
+            mWindowed[i] = data[i]*mWindow[i];
+        for (int i=0; i < mPow2Size; ++i) {
+            mReal[i] = mWindowed[i];
+            mImag[i] = 0;
+        }
+        Transform();
+
+        // zvmags + vdbcon on the half spectrum (zrip output is 2x the DFT)
+        float reference = 1.0f/sqrtf(mScale);
+        int numBins = mFFTSize/2 < mPow2Size/2 ? mFFTSize/2 : mPow2Size/2;
+        for (int k=0; k < numBins; ++k) {
+            float power = 4.0f*(mReal[k]*mReal[k] + mImag[k]*mImag[k]);
+            buffer[k] = 10.0f*log10f(power/reference + 1e-20f);
+        }
+        for (int k=numBins; k < mFFTSize/2; ++k)
+            buffer[k] = buffer[numBins-1];
+    }
+
+private:
+    void Transform()
+    {
+        int n = mPow2Size;
+        for (int i=1, j=0; i < n; ++i) {
+            int bit = n >> 1;
+            for (; j & bit; bit >>= 1)
+                j ^= bit;
+            j ^= bit;
+            if (i < j) {
+                float t = mReal[i]; mReal[i] = mReal[j]; mReal[j] = t;
+                t = mImag[i]; mImag[i] = mImag[j]; mImag[j] = t;
+            }
+        }
+        for (int len=2; len <= n; len <<= 1) {
+            int step = n/len;
+            for (int i=0; i < n; i += len) {
+                for (int j=0; j < len/2; ++j) {
+                    float wr = mCos[j*step], wi = mSin[j*step];
+                    float ur = mReal[i+j], ui = mImag[i+j];
+                    float vr = mReal[i+j+len/2]*wr - mImag[i+j+len/2]*wi;
+                    float vi = mReal[i+j+len/2]*wi + mImag[i+j+len/2]*wr;
+                    mReal[i+j] = ur + vr; mImag[i+j] = ui + vi;
+                    mReal[i+j+len/2] = ur - vr; mImag[i+j+len/2] = ui - vi;
+                }
+            }
+        }
+    }
+
+    int mFFTSize;
+    int mLog2n;
+    int mPow2Size;
+    float mScale;
+    std::vector<float> mWindow, mWindowed, mReal, mImag, mCos, mSin;
+};
+
+#endif
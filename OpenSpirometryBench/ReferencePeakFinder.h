@@ -0,0 +1,112 @@
+//
+//  ReferencePeakFinder.h
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Line for line port of PeakFinder getFundamentalPeaksFromBuffer: (window max at every bin,
+//  harmonics checked against every fundamental, sort by magnitude at the end). Kept here as
+//  the reference the linear time SpectrumPeakFinder has to match exactly.
+
+#ifndef OpenSpirometryBench_ReferencePeakFinder_h
+#define OpenSpirometryBench_ReferencePeakFinder_h
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+struct ReferencePeak {
+    int64_t index;
+    float frequency;
+    float magnitude;
+    int64_t multiple;
+    std::vector<ReferencePeak> harmonics;
+};
+
+class ReferencePeakFinder {
+
+public:
+    ReferencePeakFinder(float frequencyResolution) : mFrequencyResolution(frequencyResolution) {}
+
+    int64_t GetFundamentalPeaks(const float *magBuffer, int64_t length, int64_t windowSize,
+                                float peakMagnitude, float minimumFrequency, std::vector<ReferencePeak> &peaks)
+    {
+        peaks.clear();
+        int64_t startIndex = (int64_t)(minimumFrequency / mFrequencyResolution);
+
+        for (int64_t i = startIndex; i < length-windowSize; i++) {
+            int64_t mid = i + windowSize/2;
+
+            // vDSP_maxvi: first maximum in the window
+            float maxValue = magBuffer[i];
+            int64_t maxIndex = i;
+            for (int64_t j = i+1; j < i+windowSize; j++) {
+                if (magBuffer[j] > maxValue) {
+                    maxValue = magBuffer[j];
+                    maxIndex = j;
+                }
+            }
+
+            if ((maxValue > peakMagnitude) && (mid == maxIndex)) {
+                ReferencePeak peakFound;
+                peakFound.index = mid;
+                peakFound.magnitude = maxValue;
+                peakFound.frequency = GetFrequencyFromIndex(mid, magBuffer);
+                peakFound.multiple = 1;
+
+                bool unique = true;
+                for (size_t p = 0; p < peaks.size(); p++) {
+                    int64_t numVal = peaks[p].index;
+                    int64_t multiple = mid / numVal;
+                    int64_t modulus = mid % numVal;
+                    if (modulus > numVal/multiple) {
+                        modulus = numVal - modulus;
+                        multiple++;
+                    }
+                    float freqInHzAway = mFrequencyResolution * modulus;
+                    if (freqInHzAway <= mFrequencyResolution * multiple) {
+                        unique = false;
+                        peakFound.multiple = multiple;
+                        peaks[p].harmonics.push_back(peakFound);
+                        break;
+                    }
+                }
+                if (unique)
+                    peaks.push_back(peakFound);
+            }
+        }
+
+        for (size_t p = 0; p < peaks.size(); p++) {
+            if (peaks[p].harmonics.size() > 0) {
+                float frequency = peaks[p].frequency;
+                int numFrequenciesToAverage = 1;
+                for (size_t h = 0; h < peaks[p].harmonics.size(); h++) {
+                    frequency += peaks[p].harmonics[h].frequency / ((float)peaks[p].harmonics[h].multiple);
+                    numFrequenciesToAverage++;
+                }
+                peaks[p].frequency = frequency/((float)numFrequenciesToAverage);
+            }
+        }
+
+        std::stable_sort(peaks.begin(), peaks.end(), HasLargerMagnitude);
+        return (int64_t)peaks.size();
+    }
+
+    float GetFrequencyFromIndex(int64_t index, const float *data)
+    {
+        if (index == 0)
+            return 0;
+        float f2 = index * mFrequencyResolution;
+        float m1 = data[index - 1];
+        float m2 = data[index];
+        float m3 = data[index + 1];
+        return (float)(f2 + ((m3 - m2) / (2.0 * m2 - m1 - m2)) * mFrequencyResolution / 2.0);
+    }
+
+private:
+    static bool HasLargerMagnitude(const ReferencePeak &a, const ReferencePeak &b) { return a.magnitude > b.magnitude; }
+    float mFrequencyResolution;
+};
+
+#endif
@@ -0,0 +1,156 @@
+//
+//  SessionPoolBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Throughput of EffortSessionPool from 1 worker up to every core (or -j workers): many synthetic
+//  efforts are opened as pooled sessions and fed 1024 frame chunks round robin from one ingest
+//  thread, like uploads arriving together. Reports seconds of audio analyzed per wall second,
+//  the speedup over one worker and the parallel efficiency, and checks every pooled session gives
+//  exactly the results of the same audio through a plain EffortSession.
+//
+//  usage: SessionPoolBenchmark [-s sessions] [-j maxWorkers] [-z 0|1]
+
+#include "BenchUtils.h"
+#include "EffortSessionPool.h"
+#include <thread>
+#include <string.h>
+
+static const double kQuietBefore = 2.5, kEffortSeconds = 4.0, kQuietAfter = 2.0;
+static const int64_t kChunkFrames = 1024;
+
+// quiet room, a whistle following a rise and exponential decay of flow, quiet again
+static std::vector<float> MakeEffort(float samplingRate, float peakFlow, const WhistleModel &whistle, uint32_t seed)
+{
+    std::vector<float> signal((size_t)(samplingRate*(kQuietBefore + kEffortSeconds + kQuietAfter)));
+    uint32_t state = seed;
+    double phase = 0;
+    for (size_t i=0; i < signal.size(); ++i) {
+        double t = (double)i/samplingRate - kQuietBefore;
+        float value = 0.001f*BenchNoise(&state);
+        if (t >= 0 && t < kEffortSeconds) {
+            double flow = t < 0.15 ? peakFlow*t/0.15 : peakFlow*exp(-(t-0.15)/0.8);
+            double amplitude = 0.6*(0.2 + 0.8*flow/peakFlow)*(t < 0.02 ? t/0.02 : 1.0);
+            phase += 2.0*M_PI*whistle.FrequencyFromFlow((float)flow)/samplingRate;
+            value += (float)(amplitude*(sin(phase) + 0.25*sin(2.0*phase)));
+        }
+        signal[i] = value;
+    }
+    return signal;
+}
+
+struct EffortSummary {
+    SpirometryStage stage;
+    int64_t numSamples;
+    float peakFlow, fevOne, fvc;
+};
+
+static bool operator==(const EffortSummary &a, const EffortSummary &b)
+{
+    return a.stage == b.stage && a.numSamples == b.numSamples && a.peakFlow == b.peakFlow && a.fevOne == b.fevOne && a.fvc == b.fvc;
+}
+
+static EffortSummary Summarize(SpirometryStage stage, bool hasResults, const FlowVolumeResults &results)
+{
+    EffortSummary summary = {stage, -1, 0, 0, 0};
+    if (hasResults) {
+        summary.numSamples = results.numSamples;
+        summary.peakFlow = results.peakFlowInLitersPerSecond;
+        summary.fevOne = results.fevOneInLiters;
+        summary.fvc = results.fvcInLiters;
+    }
+    return summary;
+}
+
+int main(int argc, char **argv)
+{
+    int numSessions = 48, maxWorkers = std::max(1, (int)std::thread::hardware_concurrency());
+    bool bandLimited = true;
+    for (int a=1; a+1 < argc; a += 2) {
+        if (strcmp(argv[a], "-s") == 0) numSessions = atoi(argv[a+1]);
+        else if (strcmp(argv[a], "-j") == 0) maxWorkers = atoi(argv[a+1]);
+        else if (strcmp(argv[a], "-z") == 0) bandLimited = atoi(argv[a+1]) != 0;
+    }
+
+    const float samplingRate = 44100.0f;
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = bandLimited;
+
+    // a handful of distinct efforts, sessions cycle through them
+    const int numEfforts = 6;
+    std::vector<std::vector<float> > efforts;
+    std::vector<EffortSummary> expected;
+    for (int e=0; e < numEfforts; ++e) {
+        efforts.push_back(MakeEffort(samplingRate, 3.0f + 1.6f*e, whistle, 100 + e));
+        EffortSession session(samplingRate, whistle);
+        SpirometryStage stage = SpirometryStageIsCalibratingSilence;
+        for (size_t p=0; p < efforts[e].size(); p += kChunkFrames)
+            stage = session.AddNewFloatData(&efforts[e][p], std::min<int64_t>(kChunkFrames, (int64_t)(efforts[e].size() - p)));
+        stage = session.FinishStream();
+        FlowVolumeResults results;
+        bool hasResults = session.GetResults(&results);
+        expected.push_back(Summarize(stage, hasResults, results));
+    }
+    double audioSeconds = numSessions*(kQuietBefore + kEffortSeconds + kQuietAfter);
+
+    printf("%d sessions, %.0f s of audio at %.0f Hz, %s spectrum, %d cores\n", numSessions, audioSeconds, samplingRate,
+           bandLimited ? "band limited" : "full band", (int)std::thread::hardware_concurrency());
+    printf("workers   wall s   audio s per wall s   speedup   efficiency\n");
+
+    bool ok = true;
+    double singleWorkerWall = 0;
+    std::vector<int> workerCounts;
+    for (int w=1; w < maxWorkers; w *= 2)
+        workerCounts.push_back(w);
+    workerCounts.push_back(maxWorkers);
+
+    for (size_t c=0; c < workerCounts.size(); ++c) {
+        int numWorkers = workerCounts[c];
+        EffortSessionPool pool(numWorkers);
+        std::vector<PooledEffortSession*> sessions;
+        for (int s=0; s < numSessions; ++s)
+            sessions.push_back(pool.OpenSession(samplingRate, whistle));
+
+        double start = WallSeconds();
+        size_t longest = 0;
+        for (int e=0; e < numEfforts; ++e)
+            longest = std::max(longest, efforts[e].size());
+        for (size_t p=0; p < longest; p += kChunkFrames) {
+            for (int s=0; s < numSessions; ++s) {
+                const std::vector<float> &audio = efforts[s % numEfforts];
+                if (p < audio.size())
+                    sessions[s]->AddNewFloatData(&audio[p], std::min<int64_t>(kChunkFrames, (int64_t)(audio.size() - p)));
+            }
+        }
+        for (int s=0; s < numSessions; ++s)
+            sessions[s]->FinishStream();
+
+        int numDifferent = 0;
+        for (int s=0; s < numSessions; ++s) {
+            SpirometryStage stage = sessions[s]->WaitUntilIdle();
+            FlowVolumeResults results;
+            bool hasResults = sessions[s]->GetResults(&results);
+            if (!(Summarize(stage, hasResults, results) == expected[s % numEfforts]))
+                numDifferent++;
+        }
+        double wall = WallSeconds() - start;
+        for (int s=0; s < numSessions; ++s)
+            pool.CloseSession(sessions[s]);
+
+        if (numWorkers == 1)
+            singleWorkerWall = wall;
+        double speedup = singleWorkerWall/wall;
+        printf("%7d %8.2f %20.1f %9.2f %11.0f%%%s\n", numWorkers, wall, audioSeconds/wall, speedup,
+               100.0*speedup/numWorkers, numDifferent ? "  RESULTS DIFFER" : "");
+        if (numDifferent)
+            ok = false;
+    }
+
+    printf("expected per effort: ");
+    for (int e=0; e < numEfforts; ++e)
+        printf("%sPEF %.2f FVC %.2f", e ? ", " : "", expected[e].peakFlow, expected[e].fvc);
+    printf("\n%s\n", ok ? "all pooled sessions match the single session results" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+//
+//  SlidingBlockBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Time per hop of the sliding spectrum over the whistle band, the blocked update
+//  (AddNewFloatData: bins kSlidingBinsPerBlock at a time through the hop's samples) against one
+//  sample at a time through every bin (AddSamples), at 44.1 and 48 kHz with the analyzer's window
+//  and hop, at the full rate and after the decimation factors ZoomSpectrum picks. Time per hop is the best of
+//  the repeats. Both, and the blocked update fed uneven chunks, must give the same dB values
+//  bit for bit.
+//
+//  usage: SlidingBlockBenchmark [-r repeats] [-s seconds]
+
+#include "BenchUtils.h"
+#include "SlidingSpectrum.h"
+#include "SpirometerConstants.h"
+#include <string.h>
+
+static bool RunRate(const char *name, float fullRate, int factor, float seconds, int numRepeats)
+{
+    const float samplingRate = fullRate/(float)factor;
+    const int windowLength = BUFFER_SIZE/factor;
+    const int hop = (BUFFER_SIZE-(BUFFER_OVERLAP))/factor; // the factors all divide the window and the hop
+    const float maxFrequency = MAX_FREQUENCY_OF_WHISTLE_IN_HZ;
+    std::vector<float> signal = MakeWhistleSweep(samplingRate, seconds, 900.0f);
+    int numHops = ((int)signal.size() - windowLength)/hop;
+
+    double best[2] = {1e300, 1e300};
+    std::vector<float> magnitude[3];
+    int64_t numBins = 0;
+    for (int r=0; r < numRepeats; ++r) {
+        for (int m=0; m < 2; ++m) {
+            SlidingSpectrum sliding(windowLength, samplingRate, MIN_FREQUENCY_OF_WHISTLE_IN_HZ, maxFrequency);
+            numBins = sliding.LastBin() - sliding.FirstBin() + 1;
+            magnitude[m].assign((size_t)(windowLength/2), -200.0f);
+            sliding.AddSamples(&signal[0], windowLength - hop);
+            double start = CPUSeconds();
+            for (int h=0; h < numHops; ++h) {
+                const float *block = &signal[(size_t)h*hop + windowLength - hop];
+                if (m == 0)
+                    sliding.AddSamples(block, hop);
+                else
+                    sliding.AddNewFloatData(block, hop);
+            }
+            best[m] = std::min(best[m], CPUSeconds() - start);
+            sliding.CopydBMagnitudeToBuffer(&magnitude[m][0]);
+        }
+    }
+
+    // the same audio in chunks that do not line up with the hop, some longer than a block
+    SlidingSpectrum uneven(windowLength, samplingRate, MIN_FREQUENCY_OF_WHISTLE_IN_HZ, maxFrequency);
+    magnitude[2].assign((size_t)(windowLength/2), -200.0f);
+    int64_t end = (int64_t)numHops*hop + windowLength - hop;
+    for (int64_t p=0, n=1; p < end; p += n, n = n*7 % 613 + 1)
+        uneven.AddNewFloatData(&signal[(size_t)p], std::min(n, end - p));
+    uneven.CopydBMagnitudeToBuffer(&magnitude[2][0]);
+
+    size_t numBytes = magnitude[0].size()*sizeof(float);
+    bool same = memcmp(&magnitude[0][0], &magnitude[1][0], numBytes) == 0 &&
+                memcmp(&magnitude[0][0], &magnitude[2][0], numBytes) == 0;
+    printf("  %-4s D=%-3d hop %4d, %5lld bins  %9.2f us %9.2f us  %5.2fx  %s\n", name, factor, hop, (long long)numBins,
+           1e6*best[0]/numHops, 1e6*best[1]/numHops, best[0]/best[1], same ? "same" : "DIFFERENT");
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    int numRepeats = 5;
+    float seconds = 5.0f;
+    for (int a=1; a < argc; ++a) {
+        if (strcmp(argv[a], "-r") == 0 && a+1 < argc)
+            numRepeats = std::max(1, atoi(argv[++a]));
+        else if (strcmp(argv[a], "-s") == 0 && a+1 < argc)
+            seconds = (float)atof(argv[++a]);
+    }
+
+    printf("sliding spectrum per hop, best of %d\n", numRepeats);
+    printf("  %-4s %-5s %9s %11s  %9s %9s  %6s\n", "", "", "", "", "samples", "blocked", "");
+    bool same = true;
+    const int factors[] = {1, 2, 5, 10, 20};
+    for (int f=0; f < (int)(sizeof(factors)/sizeof(int)); ++f) {
+        same = RunRate("44k", 44100.0f, factors[f], seconds, numRepeats) && same;
+        same = RunRate("48k", 48000.0f, factors[f], seconds, numRepeats) && same;
+    }
+    return same ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+//
+//  SlidingSpectrumBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  CPU time per second of audio for the per-hop full FFT (what didFillBuffer: does now)
+//  against the band limited sliding DFT, plus a spot check of the sliding dB values
+//  against a direct Hann windowed DFT of the same window.
+
+#include "BenchUtils.h"
+#include "ReferenceFFT.h"
+#include "SlidingSpectrum.h"
+#include "SpirometerConstants.h"
+
+int main(int argc, char **argv)
+{
+    const float samplingRate = 44100.0f;
+    const float seconds = argc > 1 ? (float)atof(argv[1]) : 5.0f;
+    const int windowLength = BUFFER_SIZE;
+    const int hop = BUFFER_SIZE - (BUFFER_OVERLAP);
+    const float minFrequency = MIN_FREQUENCY_OF_WHISTLE_IN_HZ;
+    const float maxFrequency = MAX_FREQUENCY_OF_WHISTLE_IN_HZ;
+
+    std::vector<float> signal = MakeWhistleSweep(samplingRate, seconds, 900.0f);
+    std::vector<float> magnitude(windowLength/2, 0.0f);
+    int numHops = ((int)signal.size() - windowLength)/hop;
+
+    // current path: full FFT of the whole window every hop
+    ReferenceFFT fft(windowLength);
+    double start = CPUSeconds();
+    for (int h=0; h < numHops; ++h)
+        fft.PerformForwardFFTAndCopydBMagnitude(&signal[(size_t)h*hop], &magnitude[0]);
+    double fftSeconds = CPUSeconds() - start;
+
+    // sliding path: only the new samples of each hop, only the whistle band
+    SlidingSpectrum sliding(windowLength, samplingRate, minFrequency, maxFrequency);
+    sliding.FillBufferOutsideBand(&magnitude[0], -200.0f);
+    sliding.AddNewFloatData(&signal[0], windowLength - hop); // prime the window, the same as the first block filling up
+    start = CPUSeconds();
+    for (int h=0; h < numHops; ++h) {
+        sliding.AddNewFloatData(&signal[(size_t)h*hop + windowLength - hop], hop);
+        sliding.CopydBMagnitudeToBuffer(&magnitude[0]);
+    }
+    double slidingSeconds = CPUSeconds() - start;
+
+    // check the last window against a direct DFT over the band
+    const float *window = &signal[(size_t)(numHops-1)*hop];
+    double maxError = 0;
+    for (int64_t k=sliding.FirstBin(); k <= sliding.LastBin(); k += 7) {
+        double re = 0, im = 0;
+        for (int n=0; n < windowLength; ++n) {
+            double w = 0.5*(1.0 - cos(2.0*M_PI*n/windowLength));
+            re += w*window[n]*cos(2.0*M_PI*k*n/windowLength);
+            im -= w*window[n]*sin(2.0*M_PI*k*n/windowLength);
+        }
+        double dB = 10.0*log10(4.0*(re*re + im*im) + 1e-20) - 10.0*log10(2.0*sqrt((double)windowLength));
+        double err = fabs(dB - magnitude[k]);
+        if (err > maxError) maxError = err;
+    }
+
+    double audioSeconds = (double)numHops*hop/samplingRate;
+    printf("window %d, hop %d, band %lld-%lld (%lld bins), %.1f s of audio\n",
+           windowLength, hop, (long long)sliding.FirstBin(), (long long)sliding.LastBin(),
+           (long long)(sliding.LastBin() - sliding.FirstBin() + 1), audioSeconds);
+    printf("full FFT per hop:   %8.4f CPU s per audio s (%.1f us per hop)\n",
+           fftSeconds/audioSeconds, 1e6*fftSeconds/numHops);
+    printf("sliding DFT:        %8.4f CPU s per audio s (%.1f us per hop)\n",
+           slidingSeconds/audioSeconds, 1e6*slidingSeconds/numHops);
+    printf("speedup:            %8.2fx\n", fftSeconds/slidingSeconds);
+    printf("max dB error in band vs direct DFT: %.4f dB\n", maxError);
+    return maxError < 0.1 ? 0 : 1;
+}
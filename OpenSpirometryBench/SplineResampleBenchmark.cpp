@@ -0,0 +1,268 @@
+//
+//  SplineResampleBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Per flow estimate cost of resampling the estimates to the 100 Hz curve: the boxed reference
+//  (a CubicSpline built from boxed arrays for every estimate), refitting SplineInterpolator from
+//  the last five estimates for every estimate (what FlowVolumeCurve did before) and the sliding
+//  knot window with block evaluation that FlowVolumeCurve uses now. Counts heap allocations by
+//  replacing operator new and checks the sliding window gives bit for bit the same curve as the
+//  refit. Also times the back extrapolation fit, one InterpolateX per sample against one
+//  Interpolate call, and checks they agree.
+
+#include "BenchUtils.h"
+#include "BoxedFlowVolumeReference.h"
+#include "FlowVolumeCurve.h"
+#include "SplineInterpolator.h"
+#include <new>
+#include <atomic>
+#include <algorithm>
+
+static std::atomic<int64_t> gNumAllocations(0);
+volatile float gSink; // keeps the timed interpolation from being optimized away
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // new and delete below are a malloc/free pair
+#endif
+
+void *operator new(size_t size)
+{
+    gNumAllocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// the resampling of FlowVolumeCurve before the sliding window: copy the last five estimates out of
+// a ring and fit them from scratch for every estimate, one InterpolateX per output sample
+class RefitResampler {
+public:
+    RefitResampler(float interval) : mInterval(interval) { mSpline.Reserve(kNumKnots); Clear(); }
+    void Clear() { mTime.clear(); mFlow.clear(); mVolume.clear(); mNumEstimates = 0; mInitialTime = 0; }
+    void Reserve(size_t n) { mTime.reserve(n); mFlow.reserve(n); mVolume.reserve(n); }
+
+    void AddFlowEstimate(float flow, double time)
+    {
+        mRingFlow[mNumEstimates % kNumKnots] = flow;
+        mRingTime[mNumEstimates % kNumKnots] = time;
+        mNumEstimates++;
+        if (mTime.empty()) {
+            mInitialTime = (float)time;
+            Append(flow, 0, 0);
+        }
+        else if (mTime.size() == 1) {
+            float timeX0 = mTime[0], timeX1 = (float)(time - mInitialTime), flowX0 = mFlow[0];
+            float slope = (flow - flowX0)/(timeX1 - timeX0);
+            float fillTime = timeX0 + mInterval, newVolume = mVolume[0];
+            while (fillTime <= timeX1) {
+                float newFlow = flowX0 + slope*(fillTime - timeX0);
+                newVolume += newFlow*mInterval;
+                Append(newFlow, newVolume, fillTime);
+                fillTime += mInterval;
+            }
+        }
+        else if (mNumEstimates >= 3) {
+            int64_t num = std::min<int64_t>(mNumEstimates, kNumKnots);
+            float timeX[kNumKnots], flowX[kNumKnots];
+            for (int64_t i=0; i < num; ++i) {
+                int64_t which = (mNumEstimates - num + i) % kNumKnots;
+                timeX[i] = (float)(mRingTime[which] - mInitialTime);
+                flowX[i] = mRingFlow[which];
+            }
+            mSpline.SetPoints(timeX, flowX, num);
+            float fillTime = mTime.back() + mInterval, newVolume = mVolume.back();
+            while (fillTime <= timeX[num-1]) {
+                float newFlow = mSpline.InterpolateX(fillTime);
+                if (newFlow < 0)
+                    newFlow = mFlow.back();
+                newVolume += newFlow*mInterval;
+                Append(newFlow, newVolume, fillTime);
+                fillTime += mInterval;
+            }
+        }
+    }
+
+    std::vector<float> mTime, mFlow, mVolume;
+
+private:
+    enum { kNumKnots = 5 };
+    void Append(float flow, float volume, float time) { mTime.push_back(time); mFlow.push_back(flow); mVolume.push_back(volume); }
+    float mInterval, mInitialTime;
+    float mRingFlow[kNumKnots];
+    double mRingTime[kNumKnots];
+    int64_t mNumEstimates;
+    SplineInterpolator mSpline;
+};
+
+// exposes the columns to compare against the refit
+class CurveProbe : public FlowVolumeCurve {
+public:
+    const float *Time() { return mTime; }
+    const float *Flow() { return mFlow; }
+    const float *Volume() { return mVolume; }
+};
+
+// estimates at the analysis hop with a little jitter in their timing, and now and then a gap of
+// several hops (dropped windows) so some estimates fill many output samples at once
+static void MakeFlowEstimates(int which, std::vector<float> *flow, std::vector<double> *time)
+{
+    const double hop = (BUFFER_SIZE-(BUFFER_OVERLAP))/44100.0;
+    const double peak = 6.0 + (which % 5);
+    uint32_t state = 91 + which;
+    flow->clear();
+    time->clear();
+    double t = 0;
+    while (t < 6.0) {
+        double f = t < 0.1 ? peak*t/0.1 : peak*exp(-(t-0.1)/1.2);
+        flow->push_back((float)(f + 0.08*BenchNoise(&state)) + 0.2f);
+        time->push_back(2.5 + t);
+        t += hop*(1.0 + 0.1*BenchNoise(&state));
+        if (BenchNoise(&state) > 0.97f)
+            t += 8*hop;
+    }
+}
+
+static double Median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    return v[v.size()/2];
+}
+
+struct PathCost {
+    std::vector<double> nsPerEstimate;
+    int64_t numAllocations;
+};
+
+static void Report(const char *name, const PathCost &cost, int64_t numEstimates)
+{
+    printf("%-34s %10.1f ns   %8.2f\n", name, Median(cost.nsPerEstimate), (double)cost.numAllocations/(double)numEstimates);
+}
+
+int main(int argc, char **argv)
+{
+    const int numEfforts = argc > 1 ? atoi(argv[1]) : 100;
+    const float interval = 1.0f/100.0f;
+    std::vector<float> flow;
+    std::vector<double> time;
+
+    BoxedFlowVolumeReference boxed;
+    RefitResampler refit(interval);
+    refit.Reserve((size_t)((TEST_MAX_DURATION_SECONDS + 2)/interval));
+    CurveProbe curve;
+    PathCost boxedCost = {}, refitCost = {}, curveCost = {};
+    int64_t numEstimates = 0, numDifferent = 0, numCompared = 0;
+    PathCost *costs[3] = {&boxedCost, &refitCost, &curveCost};
+    for (int c=0; c < 3; ++c)
+        costs[c]->nsPerEstimate.reserve(numEfforts); // so only the paths themselves allocate in the timed spans
+
+    for (int e=0; e < numEfforts; ++e) {
+        MakeFlowEstimates(e, &flow, &time);
+        size_t n = flow.size();
+        bool measure = e > 0; // first effort warms up
+
+        boxed.Clear();
+        int64_t allocationsBefore = gNumAllocations.load();
+        double start = WallSeconds();
+        for (size_t i=0; i < n; ++i)
+            boxed.AddFlowEstimate(flow[i], time[i]);
+        double elapsed = WallSeconds() - start;
+        if (measure) {
+            boxedCost.nsPerEstimate.push_back(1e9*elapsed/(double)n);
+            boxedCost.numAllocations += gNumAllocations.load() - allocationsBefore;
+        }
+
+        refit.Clear();
+        allocationsBefore = gNumAllocations.load();
+        start = WallSeconds();
+        for (size_t i=0; i < n; ++i)
+            refit.AddFlowEstimate(flow[i], time[i]);
+        elapsed = WallSeconds() - start;
+        if (measure) {
+            refitCost.nsPerEstimate.push_back(1e9*elapsed/(double)n);
+            refitCost.numAllocations += gNumAllocations.load() - allocationsBefore;
+        }
+
+        curve.Clear();
+        allocationsBefore = gNumAllocations.load();
+        start = WallSeconds();
+        for (size_t i=0; i < n; ++i)
+            curve.AddFlowEstimate(flow[i], time[i]);
+        elapsed = WallSeconds() - start;
+        if (measure) {
+            curveCost.nsPerEstimate.push_back(1e9*elapsed/(double)n);
+            curveCost.numAllocations += gNumAllocations.load() - allocationsBefore;
+            numEstimates += (int64_t)n;
+        }
+
+        // the sliding window must not change the curve
+        if ((int64_t)refit.mTime.size() != curve.NumSamples())
+            numDifferent += 1 + (int64_t)refit.mTime.size();
+        else {
+            for (int64_t i=0; i < curve.NumSamples(); ++i)
+                if (refit.mTime[i] != curve.Time()[i] || refit.mFlow[i] != curve.Flow()[i] || refit.mVolume[i] != curve.Volume()[i])
+                    numDifferent++;
+        }
+        numCompared += curve.NumSamples();
+    }
+
+    printf("%d efforts, %.0f estimates and %.0f curve samples per effort\n", numEfforts - 1,
+           (double)numEstimates/(numEfforts - 1), (double)numCompared/numEfforts);
+    printf("resampling, per flow estimate         time (median)  allocs\n");
+    Report("boxed reference (CubicSpline)", boxedCost, numEstimates);
+    Report("refit SplineInterpolator", refitCost, numEstimates);
+    Report("sliding window (FlowVolumeCurve)", curveCost, numEstimates);
+    printf("sliding window against refit: %lld of %lld curve samples differ\n", (long long)numDifferent, (long long)numCompared);
+
+    // back extrapolation: a fit from the start of valid flow to the peak, evaluated at the samples before it
+    const int numKnots = NUM_SAMPLES_BACK_FROM_PEAKFLOW_TO_INTERPOLATE, numQueries = 40, numRepeats = 20000;
+    float knotTime[numKnots], knotFlow[numKnots], queries[numQueries], batch[numQueries];
+    for (int i=0; i < numKnots; ++i) {
+        knotTime[i] = (numQueries + i)*interval;
+        knotFlow[i] = 0.5f + 0.25f*i - 0.002f*i*i;
+    }
+    for (int i=0; i < numQueries; ++i)
+        queries[i] = i*interval;
+    SplineInterpolator spline;
+    spline.Reserve(numKnots);
+    spline.SetPoints(knotTime, knotFlow, numKnots);
+    float sink = 0;
+    double start = WallSeconds();
+    for (int r=0; r < numRepeats; ++r)
+        for (int i=0; i < numQueries; ++i)
+            sink += spline.InterpolateX(queries[i] + 1e-9f*r);
+    double perPoint = WallSeconds() - start;
+    start = WallSeconds();
+    for (int r=0; r < numRepeats; ++r) {
+        spline.Interpolate(queries, batch, numQueries);
+        sink += batch[r % numQueries];
+    }
+    double blocked = WallSeconds() - start;
+    gSink = sink;
+
+    // and on inputs spread over and past the knots, in order and shuffled
+    int64_t numMismatches = 0;
+    float spread[200], spreadOut[200];
+    uint32_t state = 3;
+    for (int i=0; i < 200; ++i)
+        spread[i] = -0.2f + 0.006f*i;
+    for (int pass=0; pass < 2; ++pass) {
+        if (pass == 1)
+            for (int i=199; i > 0; --i)
+                std::swap(spread[i], spread[(int)((BenchNoise(&state)*0.5f + 0.5f)*i)]);
+        spline.Interpolate(spread, spreadOut, 200);
+        for (int i=0; i < 200; ++i)
+            if (spreadOut[i] != spline.InterpolateX(spread[i]))
+                numMismatches++;
+    }
+    printf("back extrapolation, %d knots, %d samples: InterpolateX each %.1f ns, one Interpolate %.1f ns (%.1fx), "
+           "%lld mismatches\n", numKnots, numQueries, 1e9*perPoint/numRepeats, 1e9*blocked/numRepeats,
+           perPoint/blocked, (long long)numMismatches);
+
+    return numDifferent == 0 && numMismatches == 0 && curveCost.numAllocations == 0 ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+//
+//  WavFile.h
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Minimal RIFF/WAVE reader and writer for the desktop tools. Reads 16/24/32 bit PCM and
+//  32 bit float (plain or WAVE_FORMAT_EXTENSIBLE) into floats in [-1,1), writes 32 bit float.
+
+#ifndef OpenSpirometryBench_WavFile_h
+#define OpenSpirometryBench_WavFile_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+struct WavAudio {
+    float samplingRate;
+    int numChannels;
+    std::vector<float> samples; // interleaved
+
+    int64_t NumFrames() const { return numChannels > 0 ? (int64_t)samples.size()/numChannels : 0; }
+    double Seconds() const { return samplingRate > 0 ? NumFrames()/(double)samplingRate : 0; }
+};
+
+static inline uint32_t WavReadLE(const unsigned char *p, int numBytes)
+{
+    uint32_t value = 0;
+    for (int i=numBytes-1; i >= 0; --i)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+// returns false (and sets error) if the file is missing or not a format we can read
+static inline bool ReadWavFile(const std::string &path, WavAudio *audio, std::string *error)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        *error = "cannot open file";
+        return false;
+    }
+    std::vector<unsigned char> bytes;
+    unsigned char chunk[65536];
+    size_t numRead;
+    while ((numRead = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        bytes.insert(bytes.end(), chunk, chunk + numRead);
+    fclose(file);
+
+    if (bytes.size() < 12 || memcmp(&bytes[0], "RIFF", 4) != 0 || memcmp(&bytes[8], "WAVE", 4) != 0) {
+        *error = "not a RIFF/WAVE file";
+        return false;
+    }
+
+    int format = 0, bitsPerSample = 0;
+    audio->numChannels = 0;
+    audio->samplingRate = 0;
+    const unsigned char *data = NULL;
+    size_t dataLength = 0;
+    size_t position = 12;
+    while (position + 8 <= bytes.size()) {
+        const unsigned char *header = &bytes[position];
+        size_t chunkLength = WavReadLE(header + 4, 4);
+        size_t available = bytes.size() - position - 8;
+        if (chunkLength > available)
+            chunkLength = available; // truncated recording, take what is there
+        if (memcmp(header, "fmt ", 4) == 0 && chunkLength >= 16) {
+            format = (int)WavReadLE(header + 8, 2);
+            audio->numChannels = (int)WavReadLE(header + 10, 2);
+            audio->samplingRate = (float)WavReadLE(header + 12, 4);
+            bitsPerSample = (int)WavReadLE(header + 22, 2);
+            if (format == 0xFFFE && chunkLength >= 26)
+                format = (int)WavReadLE(header + 32, 2); // sub format GUID starts with the plain format tag
+        }
+        else if (memcmp(header, "data", 4) == 0) {
+            data = header + 8;
+            dataLength = chunkLength;
+        }
+        position += 8 + chunkLength + (chunkLength & 1);
+    }
+
+    if (!data || audio->numChannels <= 0 || audio->samplingRate <= 0) {
+        *error = "missing fmt or data chunk";
+        return false;
+    }
+    if (!((format == 1 && (bitsPerSample == 16 || bitsPerSample == 24 || bitsPerSample == 32)) ||
+          (format == 3 && bitsPerSample == 32))) {
+        *error = "unsupported sample format";
+        return false;
+    }
+
+    int bytesPerSample = bitsPerSample/8;
+    size_t numSamples = dataLength/bytesPerSample;
+    numSamples -= numSamples % audio->numChannels;
+    audio->samples.resize(numSamples);
+    for (size_t i=0; i < numSamples; ++i) {
+        const unsigned char *p = data + i*bytesPerSample;
+        uint32_t raw = WavReadLE(p, bytesPerSample);
+        if (format == 3) {
+            float value;
+            memcpy(&value, &raw, sizeof(float));
+            audio->samples[i] = value;
+        }
+        else {
+            // sign extend to 32 bits, then scale
+            int shift = 32 - bitsPerSample;
+            int32_t value = (int32_t)(raw << shift) >> shift;
+            audio->samples[i] = (float)((double)value/(double)(1u << (bitsPerSample-1)));
+        }
+    }
+    return true;
+}
+
+// 32 bit float, interleaved
+static inline bool WriteWavFile(const std::string &path, const WavAudio &audio)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    uint32_t dataLength = (uint32_t)(audio.samples.size()*sizeof(float));
+    uint32_t sampleRate = (uint32_t)audio.samplingRate;
+    uint16_t numChannels = (uint16_t)audio.numChannels;
+    uint16_t format = 3, bits = 32, blockAlign = (uint16_t)(numChannels*4);
+    uint32_t byteRate = sampleRate*blockAlign, fmtLength = 16, riffLength = 36 + dataLength;
+
+    fwrite("RIFF", 1, 4, file); fwrite(&riffLength, 4, 1, file); fwrite("WAVE", 1, 4, file);
+    fwrite("fmt ", 1, 4, file); fwrite(&fmtLength, 4, 1, file);
+    fwrite(&format, 2, 1, file); fwrite(&numChannels, 2, 1, file);
+    fwrite(&sampleRate, 4, 1, file); fwrite(&byteRate, 4, 1, file);
+    fwrite(&blockAlign, 2, 1, file); fwrite(&bits, 2, 1, file);
+    fwrite("data", 1, 4, file); fwrite(&dataLength, 4, 1, file);
+    if (!audio.samples.empty())
+        fwrite(&audio.samples[0], sizeof(float), audio.samples.size(), file);
+    return fclose(file) == 0;
+}
+
+#endif
@@ -0,0 +1,218 @@
+//
+//  WhistleCalibrationBenchmark.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  WhistleCalibrator on synthetic efforts from a whistle that is not Sato's: a different line, a
+//  bend (quadratic term) and a coefficient that moves with temperature, blown at 15 to 35 C. Every
+//  effort has reference PEF, FEV1 and FVC, every other one a reference flow curve on a clock up to
+//  0.3 s off the audio, and every sixteenth a reference FVC 20% wrong. Times the extraction on 1
+//  thread up to every core, saving and loading the extraction cache, and each model form's fit
+//  from the cache; then the terms against the truth and the median errors of the fit, of 5 fold
+//  cross validation and of the Sato coefficients the app uses now. Fails if the richest form is
+//  not within 3% held out and better than Sato on PEF, FEV1 and FVC, the reference clocks are not
+//  found within 10 ms or a fit from the loaded cache differs. The terms do not come back exactly:
+//  the pipeline's volumes miss the tail the whistle is too slow to sound for, and the bias and
+//  bend make up for it, which is what the app needs from them.
+//
+//  usage: WhistleCalibrationBenchmark [-n efforts] [-j maxThreads]
+
+#include "BenchUtils.h"
+#include "WhistleSignalGenerator.h"
+#include "WhistleCalibrator.h"
+#include <algorithm>
+#include <thread>
+#include <string>
+#include <string.h>
+
+static const float kSamplingRate = 44100.0f;
+static const float kReferenceInterval = 0.01f; // reference spirometers sample at about 100 Hz
+static const char *kCachePath = "/tmp/WhistleCalibrationBenchmark.cache";
+
+static CalibratedWhistle TrueWhistle()
+{
+    CalibratedWhistle whistle;
+    whistle.form = CalibrationModelQuadraticTemperature;
+    whistle.bias = 0.10;
+    whistle.coefficient = 1.0/95.0;
+    whistle.quadratic = 1.5e-6;
+    whistle.temperatureCoefficient = 4.0e-5; // about 0.4% per degree
+    return whistle;
+}
+
+static float Uniform(uint32_t *state, float low, float high)
+{
+    return low + (high - low)*0.5f*(BenchNoise(state) + 1.0f);
+}
+
+struct SyntheticEffort {
+    std::vector<float> audio;
+    CalibrationReference reference;
+    double clockOffset;             // reference time = audio time - clockOffset
+};
+
+static void MakeEfforts(int numEfforts, std::vector<SyntheticEffort> *efforts)
+{
+    CalibratedWhistle truth = TrueWhistle();
+    uint32_t state = 4242;
+    efforts->resize(numEfforts);
+    for (int e = 0; e < numEfforts; e++) {
+        SyntheticEffort &effort = (*efforts)[e];
+        float temperature = Uniform(&state, 15.0f, 35.0f);
+        WhistleSignalOptions options;
+        options.seed = 1000 + 17*e;
+        WhistleSignalGenerator generator(truth.ModelAtTemperature(temperature), options);
+        generator.SetParametricFlowCurve(Uniform(&state, 4.0f, 10.0f), Uniform(&state, 0.05f, 0.15f),
+                                         Uniform(&state, 0.6f, 1.5f), Uniform(&state, 4.0f, 6.0f));
+        generator.Generate(&effort.audio);
+
+        effort.reference.temperatureInCelsius = temperature;
+        effort.reference.peakFlowInLitersPerSecond = generator.PeakFlow();
+        effort.reference.fevOneInLiters = generator.FEVOne();
+        effort.reference.fvcInLiters = generator.FVC()*(e % 16 == 7 ? 1.2f : 1.0f);
+        effort.clockOffset = 0;
+        if (e % 2 == 0) {
+            effort.clockOffset = Uniform(&state, -0.3f, 0.3f);
+            for (float t = 0; t <= generator.EffortDuration(); t += kReferenceInterval) {
+                effort.reference.curveTimes.push_back((float)(generator.EffortStartInSeconds() + t - effort.clockOffset));
+                effort.reference.curveFlows.push_back(generator.FlowAtTime(t));
+            }
+        }
+    }
+}
+
+static void AddEfforts(WhistleCalibrator *calibrator, const std::vector<SyntheticEffort> &efforts)
+{
+    for (size_t e = 0; e < efforts.size(); e++) {
+        char name[32];
+        snprintf(name, sizeof(name), "synthetic-%03d", (int)e);
+        calibrator->AddEffortAudio(&efforts[e].audio[0], (int64_t)efforts[e].audio.size(), kSamplingRate, efforts[e].reference, name);
+    }
+}
+
+static void PrintScores(const char *label, const CalibrationScores &scores)
+{
+    printf("    %-12s PEF %5.2f%%  FEV1 %5.2f%%  FVC %5.2f%%  flow %.3f L/s (%d efforts, %d curves)\n", label,
+           scores.medianPEFError, scores.medianFEVOneError, scores.medianFVCError, scores.medianFlowError,
+           scores.numEfforts, scores.numCurves);
+}
+
+static bool SameWhistle(const CalibratedWhistle &a, const CalibratedWhistle &b)
+{
+    return a.form == b.form && a.bias == b.bias && a.coefficient == b.coefficient && a.quadratic == b.quadratic &&
+           a.temperatureCoefficient == b.temperatureCoefficient;
+}
+
+int main(int argc, char **argv)
+{
+    int numEfforts = 64;
+    int maxThreads = (int)std::thread::hardware_concurrency();
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "-n") == 0 && a+1 < argc)
+            numEfforts = std::max(32, atoi(argv[++a])); // fewer leave the folds too small to hold the richest form to 3%
+        else if (strcmp(argv[a], "-j") == 0 && a+1 < argc)
+            maxThreads = atoi(argv[++a]);
+    }
+    maxThreads = std::max(1, maxThreads);
+
+    double start = WallSeconds();
+    std::vector<SyntheticEffort> efforts;
+    MakeEfforts(numEfforts, &efforts);
+    double audioSeconds = 0;
+    for (size_t e = 0; e < efforts.size(); e++)
+        audioSeconds += efforts[e].audio.size()/kSamplingRate;
+    printf("%d synthetic efforts, %.0f s of audio (made in %.1f s)\n", numEfforts, audioSeconds, WallSeconds() - start);
+
+    // extraction, the part that runs the pipeline, on more and more threads
+    WhistleCalibrator calibrator;
+    AddEfforts(&calibrator, efforts);
+    printf("extraction\n");
+    double oneThread = 0;
+    for (int threads = 1; ; threads = std::min(2*threads, maxThreads)) {
+        calibrator.ClearExtractions();
+        start = WallSeconds();
+        calibrator.Extract(threads);
+        double seconds = WallSeconds() - start;
+        oneThread = threads == 1 ? seconds : oneThread;
+        printf("    %2d threads %7.2f s  %6.1f efforts/s  %5.1fx\n", threads, seconds, numEfforts/seconds, oneThread/seconds);
+        if (threads == maxThreads)
+            break;
+    }
+
+    bool ok = true;
+    int numBadClocks = 0, numCurves = 0, numUnfinished = 0;
+    double worstClock = 0;
+    for (int e = 0; e < numEfforts; e++) {
+        const CalibrationExtraction &extraction = calibrator.Extraction(e);
+        numUnfinished += extraction.didFinish ? 0 : 1;
+        if (efforts[e].reference.curveTimes.empty())
+            continue;
+        numCurves++;
+        double clockError = fabs(extraction.referenceLag - efforts[e].clockOffset);
+        numBadClocks += clockError > 0.010 ? 1 : 0;
+        worstClock = std::max(worstClock, clockError);
+    }
+    printf("    %d of %d reference clocks found within 10 ms (worst %.0f ms), %d efforts unfinished\n", numCurves - numBadClocks,
+           numCurves, 1e3*worstClock, numUnfinished);
+    ok = ok && numBadClocks == 0;
+
+    // the cache, then a calibrator that never runs the pipeline
+    std::string error;
+    start = WallSeconds();
+    bool saved = calibrator.SaveExtractions(kCachePath, &error);
+    double saveSeconds = WallSeconds() - start;
+    WhistleCalibrator cached;
+    AddEfforts(&cached, efforts);
+    int numLoaded = 0;
+    start = WallSeconds();
+    bool loaded = saved && cached.LoadExtractions(kCachePath, &numLoaded, &error);
+    double loadSeconds = WallSeconds() - start;
+    printf("extraction cache: saved in %.1f ms, %d of %d loaded in %.1f ms%s%s\n", 1e3*saveSeconds, numLoaded, numEfforts,
+           1e3*loadSeconds, error.empty() ? "" : ", ", error.c_str());
+    ok = ok && loaded && numLoaded == numEfforts;
+
+    CalibratedWhistle truth = TrueWhistle();
+    printf("truth: bias %.4f  coefficient %.6f  quadratic %.3g  temperature %.3g\n", truth.bias, truth.coefficient,
+           truth.quadratic, truth.temperatureCoefficient);
+    CalibrationScores sato;
+    cached.Score(CalibratedWhistle(), &sato);
+    printf("Sato coefficients (uncalibrated)\n");
+    PrintScores("all", sato);
+
+    for (int f = 0; f < kNumCalibrationModelForms; f++) {
+        CalibrationModelForm form = (CalibrationModelForm)f;
+        CalibrationFit fit, fromCache;
+        start = WallSeconds();
+        bool didFit = cached.Fit(form, &fromCache);
+        double fitSeconds = WallSeconds() - start;
+        didFit = didFit && calibrator.Fit(form, &fit);
+        CalibrationScores crossValidated;
+        start = WallSeconds();
+        bool didValidate = cached.CrossValidate(form, 5, &crossValidated);
+        double validateSeconds = WallSeconds() - start;
+        if (!didFit || !didValidate) {
+            printf("%s: could not fit\n", CalibrationModelFormName(form));
+            ok = false;
+            continue;
+        }
+        const CalibratedWhistle &whistle = fromCache.whistle;
+        printf("%s: fit %.1f ms (%lld equations, %d iterations%s), 5 fold %.1f ms\n", CalibrationModelFormName(form),
+               1e3*fitSeconds, (long long)fromCache.numEquations, fromCache.numIterations,
+               fromCache.didConverge ? "" : ", not converged", 1e3*validateSeconds);
+        printf("    bias %.4f  coefficient %.6f  quadratic %.3g  temperature %.3g\n", whistle.bias, whistle.coefficient,
+               whistle.quadratic, whistle.temperatureCoefficient);
+        PrintScores("fit", fromCache.scores);
+        PrintScores("held out", crossValidated);
+        ok = ok && SameWhistle(fit.whistle, fromCache.whistle);
+        if (form == CalibrationModelQuadraticTemperature)
+            ok = ok && crossValidated.medianPEFError < std::min(3.0f, sato.medianPEFError) &&
+                 crossValidated.medianFEVOneError < std::min(3.0f, sato.medianFEVOneError) &&
+                 crossValidated.medianFVCError < std::min(3.0f, sato.medianFVCError);
+    }
+    remove(kCachePath);
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
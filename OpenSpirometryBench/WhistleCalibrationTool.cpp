@@ -0,0 +1,228 @@
+//
+//  WhistleCalibrationTool.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Calibrates a whistle from a batch of recorded efforts (anything EffortFileReader opens) and what
+//  a reference spirometer measured for each. The list is CSV, one effort per line:
+//
+//      file, PEF (L/s), FEV1 (L), FVC (L), temperature (C), reference curve file
+//
+//  where any of the measures can be left empty, and the curve file (optional) has one "seconds,
+//  liters per second" pair per line on the reference's clock. Lines starting with # are skipped.
+//  Relative paths are from the list's directory. The efforts are extracted on every core (-j),
+//  with the extraction cache (-c) loaded first and saved after, so fitting another model form to
+//  the same batch does not run the pipeline again. Prints each form's terms with its median
+//  errors on the batch and held out (-k folds), and the form that does best held out.
+//
+//  usage: WhistleCalibrationTool [-j threads] [-k folds] [-c cache] [-m linear|quadratic|linear+temperature|quadratic+temperature]
+//                                [-n channel] [-z] efforts.csv
+
+#include "BenchUtils.h"
+#include "WhistleCalibrator.h"
+#include <thread>
+#include <string>
+#include <string.h>
+
+static std::string Trim(const std::string &text)
+{
+    size_t first = text.find_first_not_of(" \t\r\n");
+    size_t last = text.find_last_not_of(" \t\r\n");
+    return first == std::string::npos ? std::string() : text.substr(first, last - first + 1);
+}
+
+static std::vector<std::string> SplitCSV(const std::string &line)
+{
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t comma = line.find(',', start);
+        fields.push_back(Trim(line.substr(start, comma == std::string::npos ? std::string::npos : comma - start)));
+        if (comma == std::string::npos)
+            return fields;
+        start = comma + 1;
+    }
+}
+
+static float FieldValue(const std::vector<std::string> &fields, size_t index)
+{
+    return index < fields.size() && !fields[index].empty() ? (float)atof(fields[index].c_str()) : NAN;
+}
+
+static std::string RelativeTo(const std::string &directory, const std::string &path)
+{
+    return path.empty() || path[0] == '/' ? path : directory + "/" + path;
+}
+
+static bool ReadReferenceCurve(const std::string &path, CalibrationReference *reference)
+{
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        float time, flow;
+        if (line[0] != '#' && sscanf(line, "%f , %f", &time, &flow) == 2) {
+            reference->curveTimes.push_back(time);
+            reference->curveFlows.push_back(flow);
+        }
+    }
+    fclose(file);
+    return reference->curveTimes.size() >= 2;
+}
+
+static bool ReadEffortList(const std::string &listPath, int channel, WhistleCalibrator *calibrator)
+{
+    FILE *file = fopen(listPath.c_str(), "r");
+    if (!file) {
+        fprintf(stderr, "cannot read %s\n", listPath.c_str());
+        return false;
+    }
+    size_t slash = listPath.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : listPath.substr(0, slash);
+    char buffer[4096];
+    int lineNumber = 0;
+    while (fgets(buffer, sizeof(buffer), file)) {
+        lineNumber++;
+        std::string line = Trim(buffer);
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::vector<std::string> fields = SplitCSV(line);
+        CalibrationReference reference;
+        reference.peakFlowInLitersPerSecond = FieldValue(fields, 1);
+        reference.fevOneInLiters = FieldValue(fields, 2);
+        reference.fvcInLiters = FieldValue(fields, 3);
+        reference.temperatureInCelsius = FieldValue(fields, 4);
+        if (fields.size() > 5 && !fields[5].empty() && !ReadReferenceCurve(RelativeTo(directory, fields[5]), &reference))
+            fprintf(stderr, "%s:%d: cannot read the reference curve %s\n", listPath.c_str(), lineNumber, fields[5].c_str());
+        int effort = calibrator->AddEffortFile(RelativeTo(directory, fields[0]), reference, channel);
+        const CalibrationExtraction &extraction = calibrator->Extraction(effort);
+        if (!extraction.error.empty())
+            fprintf(stderr, "%s:%d: %s\n", listPath.c_str(), lineNumber, extraction.error.c_str());
+    }
+    fclose(file);
+    return true;
+}
+
+static void PrintScores(const char *label, const CalibrationScores &scores)
+{
+    printf("    %-10s PEF %5.2f%%  FEV1 %5.2f%%  FVC %5.2f%%  flow %.3f L/s  (%d efforts, %d curves)\n", label,
+           scores.medianPEFError, scores.medianFEVOneError, scores.medianFVCError, scores.medianFlowError,
+           scores.numEfforts, scores.numCurves);
+}
+
+// sum of the median percent errors the batch has references for
+static float Badness(const CalibrationScores &scores)
+{
+    float errors[3] = {scores.medianPEFError, scores.medianFEVOneError, scores.medianFVCError};
+    float sum = 0;
+    for (int i = 0; i < 3; i++)
+        sum += isnan(errors[i]) ? 0.0f : errors[i];
+    return sum;
+}
+
+static void PrintUsage()
+{
+    fprintf(stderr, "usage: WhistleCalibrationTool [-j threads] [-k folds] [-c cache] "
+                    "[-m linear|quadratic|linear+temperature|quadratic+temperature] [-n channel] [-z] efforts.csv\n");
+}
+
+int main(int argc, char **argv)
+{
+    int numThreads = (int)std::thread::hardware_concurrency();
+    int numFolds = 5, channel = 0, onlyForm = -1;
+    bool bandLimited = false;
+    std::string cachePath, listPath;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "-j") == 0 && a+1 < argc)
+            numThreads = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-k") == 0 && a+1 < argc)
+            numFolds = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-c") == 0 && a+1 < argc)
+            cachePath = argv[++a];
+        else if (strcmp(argv[a], "-n") == 0 && a+1 < argc)
+            channel = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-z") == 0)
+            bandLimited = true;
+        else if (strcmp(argv[a], "-m") == 0 && a+1 < argc) {
+            const char *name = argv[++a];
+            for (int f = 0; f < kNumCalibrationModelForms; f++)
+                if (strcmp(name, CalibrationModelFormName((CalibrationModelForm)f)) == 0)
+                    onlyForm = f;
+            if (onlyForm < 0) {
+                PrintUsage();
+                return 1;
+            }
+        }
+        else if (argv[a][0] != '-' && listPath.empty())
+            listPath = argv[a];
+        else {
+            PrintUsage();
+            return 1;
+        }
+    }
+    if (listPath.empty()) {
+        PrintUsage();
+        return 1;
+    }
+
+    WhistleModel nominal;
+    nominal.useBandLimitedSpectrum = bandLimited;
+    WhistleCalibrator calibrator(nominal);
+    if (!ReadEffortList(listPath, channel, &calibrator))
+        return 1;
+
+    std::string error;
+    int numLoaded = 0;
+    if (!cachePath.empty() && !calibrator.LoadExtractions(cachePath, &numLoaded, &error))
+        fprintf(stderr, "%s (extracting everything)\n", error.c_str());
+    double start = WallSeconds();
+    int numExtracted = calibrator.Extract(numThreads);
+    printf("%d efforts: %d from the cache, %d extracted on %d threads in %.2f s\n", calibrator.NumEfforts(), numLoaded,
+           numExtracted, numThreads, WallSeconds() - start);
+    if (!cachePath.empty() && numExtracted > 0 && !calibrator.SaveExtractions(cachePath, &error))
+        fprintf(stderr, "%s\n", error.c_str());
+
+    int numUsable = 0;
+    for (int e = 0; e < calibrator.NumEfforts(); e++)
+        numUsable += calibrator.Extraction(e).error.empty() ? 1 : 0;
+    printf("%d efforts with a whistle\n", numUsable);
+
+    CalibrationScores sato;
+    calibrator.Score(CalibratedWhistle(nominal), &sato);
+    printf("current whistle: bias %.6f  coefficient %.8f\n", nominal.bias, nominal.coefficient);
+    PrintScores("batch", sato);
+
+    int best = -1;
+    float bestBadness = INFINITY;
+    CalibrationFit fits[kNumCalibrationModelForms];
+    for (int f = 0; f < kNumCalibrationModelForms; f++) {
+        if (onlyForm >= 0 && f != onlyForm)
+            continue;
+        CalibrationModelForm form = (CalibrationModelForm)f;
+        CalibrationScores heldOut;
+        if (!calibrator.Fit(form, &fits[f]) || !calibrator.CrossValidate(form, numFolds, &heldOut)) {
+            printf("%s: not enough references to fit\n", CalibrationModelFormName(form));
+            continue;
+        }
+        const CalibratedWhistle &whistle = fits[f].whistle;
+        printf("%s:%s\n", CalibrationModelFormName(form), fits[f].didConverge ? "" : " (did not converge)");
+        printf("    bias %.6f  coefficient %.8f  quadratic %.6g  temperature %.6g per C from %.0f C\n", whistle.bias,
+               whistle.coefficient, whistle.quadratic, whistle.temperatureCoefficient, kCalibrationReferenceTemperature);
+        PrintScores("batch", fits[f].scores);
+        PrintScores("held out", heldOut);
+        if (Badness(heldOut) < bestBadness) {
+            bestBadness = Badness(heldOut);
+            best = f;
+        }
+    }
+    if (best < 0)
+        return 1;
+    const CalibratedWhistle &whistle = fits[best].whistle;
+    printf("best held out: %s, at %.0f C calibratedCoefficient = %.8f, calibratedBias = %.6f%s\n",
+           CalibrationModelFormName((CalibrationModelForm)best), kCalibrationReferenceTemperature, whistle.coefficient,
+           whistle.bias, whistle.quadratic != 0 ? " (plus the quadratic term)" : "");
+    return 0;
+}
@@ -0,0 +1,271 @@
+//
+//  ZoomSpectrumCheck.cpp
+//  OpenSpirometryBench
+//
+//  Created by Eric Larson
+//  Copyright (c) 2015 Eric Larson. All rights reserved.
+//
+//  Checks the band limited (decimated) whistle spectrum against the full band path. First the
+//  spectra themselves: steady tones across the Sato band must give the same interpolated peak
+//  frequency and level from ZoomSpectrum as from the full rate SlidingSpectrum. Then whole
+//  efforts: synthetic efforts (WhistleSignalGenerator, and any WAV files on the command line) go
+//  through EffortSession with useBandLimitedSpectrum off and on, one hop at a time, and the flow
+//  estimates of each hop are compared. The one second window smears a fast sweep over many bins
+//  of nearly the same level, and which of those wins flips with differences far below a
+//  hundredth of a dB (the full band path does the same against itself with -100 dB of dither
+//  added), so the median hop must agree exactly and kMinFractionClose of the hops to within a
+//  tenth of a liter per second. Last, the finalized PEF, FEV1 and FVC of both paths, in the
+//  analyzer's own configuration (tracker and short windows), must be within kMaxPEFDifference,
+//  kMaxFEVOneDifference and kMaxFVCDifference of each other.
+//  Also prints the size of each transform and the CPU time per second of audio.
+//
+//  usage: ZoomSpectrumCheck [file.wav ...]
+
+#include "BenchUtils.h"
+#include "WavFile.h"
+#include "EffortSession.h"
+#include "WhistleSignalGenerator.h"
+#include <string>
+#include <algorithm>
+
+static const float kMaxFrequencyError = 0.25f;  // Hz, the bins are 1 Hz apart
+static const float kMaxLevelError = 0.1f;       // dB at the peak
+static const float kMaxFlowError = 0.1f;        // L/s, about 9 Hz on the Sato whistle
+static const float kMinFractionClose = 0.85f;   // of the hops both paths made an estimate for (89% at worst)
+static const float kMaxMedianFlowError = 0.01f; // L/s
+static const int64_t kMaxUnpairedEstimates = 5; // hops only one path found a whistle in (threshold crossings)
+static const float kMaxPEFDifference = 0.005f;  // finalized, relative to the full band path's
+static const float kMaxFEVOneDifference = 0.005f;
+static const float kMaxFVCDifference = 0.01f;
+
+// parabolic peak position around bin k, in Hz
+static float InterpolatedFrequency(const std::vector<float> &mag, int64_t k, float resolution)
+{
+    float m1 = mag[(size_t)(k-1)], m2 = mag[(size_t)k], m3 = mag[(size_t)(k+1)];
+    return resolution*((float)k + 0.5f*(m1 - m3)/(m1 - 2.0f*m2 + m3));
+}
+
+static bool CheckTones(float samplingRate)
+{
+    WhistleModel whistle;
+    whistle.useBandLimitedSpectrum = true;
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    int64_t factor = ZoomSpectrum::DecimationFactorForBand(BUFFER_SIZE, hop, samplingRate, whistle.MaxFrequency());
+    ZoomSpectrum full(BUFFER_SIZE, samplingRate, MIN_FREQUENCY_OF_WHISTLE_IN_HZ, MAX_FREQUENCY_OF_WHISTLE_IN_HZ);
+    ZoomSpectrum zoom(BUFFER_SIZE, samplingRate, whistle.MinFrequency(), whistle.MaxFrequency(), factor);
+    std::vector<float> fullMag(BUFFER_SIZE/2), zoomMag(BUFFER_SIZE/2);
+    full.FillBufferOutsideBand(&fullMag[0], SPECTRUM_FLOOR_DB);
+    zoom.FillBufferOutsideBand(&zoomMag[0], SPECTRUM_FLOOR_DB);
+
+    printf("%.0f Hz: band %.1f...%.1f Hz, decimate by %lld (%lld taps, %lld samples delay), transform of %lld samples instead of %d, %lld bins instead of %lld\n",
+           samplingRate, whistle.MinFrequency(), whistle.MaxFrequency(), (long long)factor,
+           (long long)(factor > 1 ? PolyphaseDecimator(factor, samplingRate, whistle.MaxFrequency()).NumTaps() : 0),
+           (long long)zoom.DelayInSamples(),
+           (long long)zoom.NumDecimatedSamples(), BUFFER_SIZE,
+           (long long)(zoom.LastBin() - zoom.FirstBin() + 1), (long long)(full.LastBin() - full.FirstBin() + 1));
+
+    float worstFrequency = 0, worstLevel = 0;
+    uint32_t state = 4242;
+    for (float tone = 80.0f; tone < whistle.MaxFrequency() - 10.0f; tone += 97.3f) {
+        full.Clear();
+        zoom.Clear();
+        std::vector<float> signal((size_t)(BUFFER_SIZE + 20*hop));
+        for (size_t i=0; i < signal.size(); ++i)
+            signal[i] = 0.5f*(float)sin(2.0*M_PI*tone*(double)i/samplingRate) + 0.01f*BenchNoise(&state);
+        // same hops as the session, compare after every one of the last few
+        full.AddNewFloatData(&signal[0], BUFFER_SIZE);
+        zoom.AddNewFloatData(&signal[0], BUFFER_SIZE);
+        for (int64_t h=0; h < 20; ++h) {
+            full.AddNewFloatData(&signal[(size_t)(BUFFER_SIZE + h*hop)], hop);
+            zoom.AddNewFloatData(&signal[(size_t)(BUFFER_SIZE + h*hop)], hop);
+            full.CopydBMagnitudeToBuffer(&fullMag[0]);
+            zoom.CopydBMagnitudeToBuffer(&zoomMag[0]);
+            int64_t peak = (int64_t)(tone/full.FrequencyResolution() + 0.5f);
+            for (int64_t k=peak-1; k <= peak+1; ++k)
+                if (fullMag[(size_t)k] > fullMag[(size_t)peak]) peak = k;
+            float resolution = full.FrequencyResolution();
+            float frequencyError = fabsf(InterpolatedFrequency(fullMag, peak, resolution) - InterpolatedFrequency(zoomMag, peak, resolution));
+            float levelError = 0;
+            for (int64_t k=peak-1; k <= peak+1; ++k)
+                if (fabsf(fullMag[(size_t)k] - zoomMag[(size_t)k]) > levelError)
+                    levelError = fabsf(fullMag[(size_t)k] - zoomMag[(size_t)k]);
+            if (frequencyError > worstFrequency) worstFrequency = frequencyError;
+            if (levelError > worstLevel) worstLevel = levelError;
+        }
+    }
+    bool ok = worstFrequency <= kMaxFrequencyError && worstLevel <= kMaxLevelError;
+    printf("  tones: worst peak frequency difference %.4f Hz, worst level difference around the peak %.4f dB %s\n",
+           worstFrequency, worstLevel, ok ? "" : "FAIL");
+    return ok;
+}
+
+static float Percentile(std::vector<float> v, double p)
+{
+    std::sort(v.begin(), v.end());
+    return v.empty() ? 0 : v[(size_t)(p*(v.size()-1))];
+}
+
+static float RelativeDifference(float full, float zoom)
+{
+    return full > 0 ? fabsf(zoom - full)/full : fabsf(zoom - full);
+}
+
+// finalized measures of both paths as the analyzer runs them, false if only one found an effort
+static bool CompareFinalized(const std::string &name, const std::vector<float> &audio, const std::vector<float> &delayed,
+                             float samplingRate)
+{
+    WhistleModel fullWhistle, zoomWhistle;
+    zoomWhistle.useBandLimitedSpectrum = true;
+    EffortSession full(samplingRate, fullWhistle);
+    EffortSession zoom(samplingRate, zoomWhistle);
+    full.AddNewFloatData(&delayed[0], (int64_t)delayed.size());
+    zoom.AddNewFloatData(&audio[0], (int64_t)audio.size());
+    full.FinishStream();
+    zoom.FinishStream();
+
+    FlowVolumeResults a, b;
+    bool hasFull = full.GetResults(&a), hasZoom = zoom.GetResults(&b);
+    if (!hasFull || !hasZoom) {
+        printf("%-32s finalized: no effort (full %s, band limited %s) %s%s\n", "", hasFull ? "yes" : "no",
+               hasZoom ? "yes" : "no", hasFull == hasZoom ? "" : "FAIL ", hasFull == hasZoom ? "" : name.c_str());
+        return hasFull == hasZoom;
+    }
+    float pef = RelativeDifference(a.peakFlowInLitersPerSecond, b.peakFlowInLitersPerSecond);
+    float fevOne = RelativeDifference(a.fevOneInLiters, b.fevOneInLiters);
+    float fvc = RelativeDifference(a.fvcInLiters, b.fvcInLiters);
+    bool ok = pef <= kMaxPEFDifference && fevOne <= kMaxFEVOneDifference && fvc <= kMaxFVCDifference;
+    printf("%-32s finalized PEF %.2f/%.2f L/s (%.2f%%), FEV1 %.2f/%.2f L (%.2f%%), FVC %.2f/%.2f L (%.2f%%) %s%s\n", "",
+           a.peakFlowInLitersPerSecond, b.peakFlowInLitersPerSecond, 100.0f*pef, a.fevOneInLiters, b.fevOneInLiters,
+           100.0f*fevOne, a.fvcInLiters, b.fvcInLiters, 100.0f*fvc, ok ? "" : "FAIL ", ok ? "" : name.c_str());
+    return ok;
+}
+
+// runs the effort through both paths one hop at a time and compares every flow estimate, then the
+// finalized measures; generator made the synthetic effort (NULL for a recording, no true flow to compare against)
+static bool CheckEffort(const std::string &name, const std::vector<float> &audio, float samplingRate,
+                        const WhistleSignalGenerator *generator, double *fullSeconds, double *zoomSeconds)
+{
+    const int64_t hop = BUFFER_SIZE-(BUFFER_OVERLAP);
+    WhistleModel fullWhistle, zoomWhistle;
+    zoomWhistle.useBandLimitedSpectrum = true;
+    EffortSession full(samplingRate, fullWhistle, hop);
+    EffortSession zoom(samplingRate, zoomWhistle, hop);
+    // every window searched on its own, so a near tie flipped in one hop is not carried into the next
+    // by FundamentalTracker (FundamentalTrackerBenchmark compares the tracker), and every window a long
+    // one, the short windows of the blast never see either spectrum (MultiResolutionBenchmark)
+    full.SetFundamentalTracking(false);
+    zoom.SetFundamentalTracking(false);
+    full.SetMultiResolution(false);
+    zoom.SetMultiResolution(false);
+
+    // the decimating filter delays what the band limited path sees by a millisecond or so, enough
+    // to move near-tied peaks of a sweep, so the full band path is given the same delay
+    int64_t delay = zoom.SpectrumDelayInSamples();
+    std::vector<float> delayed(audio.size(), 0.0f);
+    for (size_t i=(size_t)delay; i < audio.size(); ++i)
+        delayed[i] = audio[i - (size_t)delay];
+
+    std::vector<float> flowErrors;
+    double fullTruthError = 0, zoomTruthError = 0;
+    int64_t numUnpaired = 0;
+    for (int64_t position = 0; position < (int64_t)audio.size(); position += hop) {
+        int64_t numFrames = (int64_t)audio.size() - position < hop ? (int64_t)audio.size() - position : hop;
+        int64_t fullBefore = full.NumFlowEstimates(), zoomBefore = zoom.NumFlowEstimates();
+        double start = CPUSeconds();
+        full.AddNewFloatData(&delayed[(size_t)position], numFrames);
+        double middle = CPUSeconds();
+        zoom.AddNewFloatData(&audio[(size_t)position], numFrames);
+        *fullSeconds += middle - start;
+        *zoomSeconds += CPUSeconds() - middle;
+
+        bool fullNew = full.NumFlowEstimates() > fullBefore, zoomNew = zoom.NumFlowEstimates() > zoomBefore;
+        if (fullNew && zoomNew) {
+            float fullFlow = fullWhistle.FlowFromFrequency(full.LastFrequency());
+            float zoomFlow = zoomWhistle.FlowFromFrequency(zoom.LastFrequency());
+            flowErrors.push_back(fabsf(fullFlow - zoomFlow));
+            // true flow at the middle of the window both just analyzed
+            double center = (double)(position + numFrames - delay - BUFFER_SIZE/2)/samplingRate;
+            double truth = generator ? generator->FlowAtTime(center - generator->EffortStartInSeconds()) : 0;
+            fullTruthError += fabs(fullFlow - truth);
+            zoomTruthError += fabs(zoomFlow - truth);
+        }
+        else if (fullNew || zoomNew) {
+            numUnpaired++;
+        }
+    }
+    full.FinishStream();
+    zoom.FinishStream();
+
+    FlowVolumeResults a, b;
+    bool hasFull = full.GetResults(&a), hasZoom = zoom.GetResults(&b);
+    if (!hasFull || !hasZoom) {
+        printf("%-32s no effort (full %s, band limited %s) %s\n", name.c_str(), hasFull ? "yes" : "no",
+               hasZoom ? "yes" : "no", hasFull == hasZoom ? "" : "FAIL");
+        return hasFull == hasZoom;
+    }
+
+    int64_t numClose = 0;
+    for (size_t i=0; i < flowErrors.size(); ++i)
+        if (flowErrors[i] <= kMaxFlowError)
+            numClose++;
+    float fractionClose = flowErrors.empty() ? 1.0f : (float)numClose/(float)flowErrors.size();
+    float medianError = Percentile(flowErrors, 0.5);
+    bool ok = fractionClose >= kMinFractionClose && medianError <= kMaxMedianFlowError && numUnpaired <= kMaxUnpairedEstimates;
+    printf("%-32s %5lld estimates (%lld unpaired), median difference %.4f L/s, %5.1f%% within %.2f L/s",
+           name.c_str(), (long long)flowErrors.size(), (long long)numUnpaired, medianError, 100.0f*fractionClose, kMaxFlowError);
+    if (generator && !flowErrors.empty()) {
+        double fullMean = fullTruthError/flowErrors.size(), zoomMean = zoomTruthError/flowErrors.size();
+        printf(", error against true flow %.3f/%.3f L/s", fullMean, zoomMean);
+    }
+    // the error against the true flow (mostly the one second window lagging the sweep) is shown for reference
+    printf(" %s\n", ok ? "" : "FAIL");
+
+    // finalized from these estimates, back extrapolation and the monotonic searches can turn a single
+    // flipped hop into a different PEF, so the measures are compared as the analyzer makes them
+    return CompareFinalized(name, audio, delayed, samplingRate) && ok;
+}
+
+int main(int argc, char **argv)
+{
+    bool ok = true;
+    const float rates[2] = {44100.0f, 48000.0f};
+    for (int r=0; r < 2; ++r)
+        ok = CheckTones(rates[r]) && ok;
+
+    double fullSeconds = 0, zoomSeconds = 0, audioSeconds = 0;
+    const float peakFlows[4] = {3.0f, 6.0f, 9.0f, 11.5f};
+    for (int r=0; r < 2; ++r) {
+        for (int p=0; p < 4; ++p) {
+            WhistleSignalOptions options;
+            options.samplingRate = rates[r];
+            WhistleSignalGenerator generator(WhistleModel(), options);
+            generator.SetParametricFlowCurve(peakFlows[p], 0.10f, 0.9f, 5.0f);
+            std::vector<float> audio;
+            generator.Generate(&audio);
+            char name[64];
+            snprintf(name, sizeof(name), "synthetic %.1f L/s at %.0f Hz", peakFlows[p], rates[r]);
+            ok = CheckEffort(name, audio, rates[r], &generator, &fullSeconds, &zoomSeconds) && ok;
+            audioSeconds += audio.size()/rates[r];
+        }
+    }
+    for (int a=1; a < argc; ++a) {
+        WavAudio wav;
+        std::string error;
+        if (!ReadWavFile(argv[a], &wav, &error)) {
+            fprintf(stderr, "%s: %s\n", argv[a], error.c_str());
+            return 2;
+        }
+        std::vector<float> mono((size_t)wav.NumFrames());
+        for (int64_t i=0; i < wav.NumFrames(); ++i)
+            mono[(size_t)i] = wav.samples[(size_t)(i*wav.numChannels)];
+        if (mono.empty())
+            continue;
+        ok = CheckEffort(argv[a], mono, wav.samplingRate, NULL, &fullSeconds, &zoomSeconds) && ok;
+        audioSeconds += wav.Seconds();
+    }
+
+    printf("whole session CPU per second of audio: full band %.2f ms, band limited %.2f ms (%.1fx)\n",
+           1000.0*fullSeconds/audioSeconds, 1000.0*zoomSeconds/audioSeconds, fullSeconds/zoomSeconds);
+    printf(ok ? "band limited spectrum agrees with the full band path\n" : "band limited spectrum disagrees with the full band path\n");
+    return ok ? 0 : 1;
+}